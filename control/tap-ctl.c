@@ -283,7 +283,12 @@ tap_cli_create_usage(FILE *stream)
 		"use secondary image (in mirror mode if no -s)] [-s "
 		"fail over to the secondary image on ENOSPC] "
 		"[-t request timeout in seconds] [-D no O_DIRECT] "
-		"[-C <path/to/logfile> insert log layer to track changed blocks]\n");
+		"[-C <path/to/logfile> insert log layer to track changed blocks] "
+		"[-U serve a local shared-memory ring] "
+		"[-Y resync the secondary after it failed] "
+		"[-A mirror to the secondary asynchronously] "
+		"[-P prefetch ahead of sequential reads] "
+		"[-B buffered I/O, writes acked after a batched fdatasync]\n");
 }
 
 static int
@@ -302,7 +307,7 @@ tap_cli_create(int argc, char **argv)
 	timeout   = 0;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:RDd:e:r2:st:C:h")) != -1) {
+	while ((c = getopt(argc, argv, "a:RDBd:e:r2:st:C:UYAPh")) != -1) {
 		switch (c) {
 		case 'a':
 			args = optarg;
@@ -317,9 +322,18 @@ tap_cli_create(int argc, char **argv)
 		case 'D':
 			flags |= TAPDISK_MESSAGE_FLAG_NO_O_DIRECT;
 			break;
+		case 'B':
+			flags |= TAPDISK_MESSAGE_FLAG_BUFFERED_IO;
+			break;
+		case 'U':
+			flags |= TAPDISK_MESSAGE_FLAG_LOCAL_RING;
+			break;
 		case 'r':
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LCACHE;
 			break;
+		case 'P':
+			flags |= TAPDISK_MESSAGE_FLAG_READAHEAD;
+			break;
 		case 'e':
 			flags |= TAPDISK_MESSAGE_FLAG_REUSE_PRT;
 			prt_minor = atoi(optarg);
@@ -331,6 +345,12 @@ tap_cli_create(int argc, char **argv)
 		case 's':
 			flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
 			break;
+		case 'Y':
+			flags |= TAPDISK_MESSAGE_FLAG_RESYNC;
+			break;
+		case 'A':
+			flags |= TAPDISK_MESSAGE_FLAG_ASYNC_MIRROR;
+			break;
 		case 't':
 			timeout = atoi(optarg);
 			break;
@@ -644,12 +664,181 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_coalesce_usage(FILE *stream)
+{
+	fprintf(stream, "usage: coalesce <-p pid> <-m minor> [-a]\n");
+}
+
+static int
+tap_cli_coalesce(int argc, char **argv)
+{
+	int c, pid, minor, abort;
+
+	pid   = -1;
+	minor = -1;
+	abort = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:ah")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'a':
+			abort = 1;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_coalesce_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	return tap_ctl_coalesce(pid, minor, abort);
+
+usage:
+	tap_cli_coalesce_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_ublk_usage(FILE *stream)
+{
+	fprintf(stream, "usage: ublk <-p pid> <-m minor> [-q queues] "
+		"[-d depth] [-r]\n");
+}
+
+static int
+tap_cli_ublk(int argc, char **argv)
+{
+	int c, pid, minor, queues, depth, remove, dev_id, err;
+
+	pid    = -1;
+	minor  = -1;
+	queues = 0;
+	depth  = 0;
+	remove = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:q:d:rh")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'q':
+			queues = atoi(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'r':
+			remove = 1;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_ublk_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	if (remove)
+		return tap_ctl_ublk_destroy(pid, minor);
+
+	err = tap_ctl_ublk_create(pid, minor, queues, depth, &dev_id);
+	if (!err)
+		printf("/dev/ublkb%d\n", dev_id);
+
+	return err;
+
+usage:
+	tap_cli_ublk_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_nbd_usage(FILE *stream)
+{
+	fprintf(stream, "usage: nbd <-p pid> <-m minor> [-n connections] "
+		"[-i index] [-r]\n");
+}
+
+static int
+tap_cli_nbd(int argc, char **argv)
+{
+	int c, pid, minor, conns, index, remove, err;
+
+	pid    = -1;
+	minor  = -1;
+	conns  = 0;
+	index  = -1;
+	remove = 0;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:n:i:rh")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'n':
+			conns = atoi(optarg);
+			break;
+		case 'i':
+			index = atoi(optarg);
+			break;
+		case 'r':
+			remove = 1;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_nbd_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	if (remove)
+		return tap_ctl_nbd_detach(pid, minor);
+
+	err = tap_ctl_nbd_attach(pid, minor, conns, &index);
+	if (!err)
+		printf("/dev/nbd%d\n", index);
+
+	return err;
+
+usage:
+	tap_cli_nbd_usage(stderr);
+	return EINVAL;
+}
+
 static void
 tap_cli_unpause_usage(FILE *stream)
 {
 	fprintf(stream, "usage: unpause <-p pid> <-m minor> [-a type:/path/to/file] "
     "[-2 secondary] "
-    "[-c </path/to/logfile> insert log layer to track changed blocks]\n");
+    "[-c </path/to/logfile> insert log layer to track changed blocks] "
+    "[-Y resync the secondary after it failed] "
+    "[-A mirror to the secondary asynchronously]\n");
 }
 
 int
@@ -667,7 +856,7 @@ tap_cli_unpause(int argc, char **argv)
 	logpath	   = NULL;	
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "p:m:a:2:c:h")) != -1) {
+	while ((c = getopt(argc, argv, "p:m:a:2:c:YAh")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -686,6 +875,12 @@ tap_cli_unpause(int argc, char **argv)
 			logpath = optarg;
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LOG;
 			break;
+		case 'Y':
+			flags |= TAPDISK_MESSAGE_FLAG_RESYNC;
+			break;
+		case 'A':
+			flags |= TAPDISK_MESSAGE_FLAG_ASYNC_MIRROR;
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -762,7 +957,12 @@ tap_cli_open_usage(FILE *stream)
 		"fail over to the secondary image on ENOSPC] "
 		"[-t request timeout in seconds] [-D no O_DIRECT] "
 		"[-C </path/to/logfile> insert log layer to track changed blocks] "
-		"[-E read encryption key from stdin]\n");
+		"[-E read encryption key from stdin] "
+		"[-U serve a local shared-memory ring] "
+		"[-Y resync the secondary after it failed] "
+		"[-A mirror to the secondary asynchronously] "
+		"[-P prefetch ahead of sequential reads] "
+		"[-B buffered I/O, writes acked after a batched fdatasync]\n");
 }
 
 static int
@@ -784,7 +984,7 @@ tap_cli_open(int argc, char **argv)
 	encryption_key = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:RDm:p:e:r2:st:C:Eh")) != -1) {
+	while ((c = getopt(argc, argv, "a:RDBm:p:e:r2:st:C:EUYAPh")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -801,9 +1001,18 @@ tap_cli_open(int argc, char **argv)
 		case 'D':
 			flags |= TAPDISK_MESSAGE_FLAG_NO_O_DIRECT;
 			break;
+		case 'B':
+			flags |= TAPDISK_MESSAGE_FLAG_BUFFERED_IO;
+			break;
+		case 'U':
+			flags |= TAPDISK_MESSAGE_FLAG_LOCAL_RING;
+			break;
 		case 'r':
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LCACHE;
 			break;
+		case 'P':
+			flags |= TAPDISK_MESSAGE_FLAG_READAHEAD;
+			break;
 		case 'e':
 			flags |= TAPDISK_MESSAGE_FLAG_REUSE_PRT;
 			prt_minor = atoi(optarg);
@@ -815,6 +1024,12 @@ tap_cli_open(int argc, char **argv)
 		case 's':
 			flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
 			break;
+		case 'Y':
+			flags |= TAPDISK_MESSAGE_FLAG_RESYNC;
+			break;
+		case 'A':
+			flags |= TAPDISK_MESSAGE_FLAG_ASYNC_MIRROR;
+			break;
 		case 't':
 			timeout = atoi(optarg);
 			break;
@@ -956,6 +1171,9 @@ struct command commands[] = {
 	{ .name = "close",        .func = tap_cli_close         },
 	{ .name = "pause",        .func = tap_cli_pause         },
 	{ .name = "unpause",      .func = tap_cli_unpause       },
+	{ .name = "coalesce",     .func = tap_cli_coalesce      },
+	{ .name = "ublk",         .func = tap_cli_ublk          },
+	{ .name = "nbd",          .func = tap_cli_nbd           },
 	{ .name = "stats",        .func = tap_cli_stats         },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
@@ -47,6 +47,7 @@
 #include "tapdisk-interface.h"
 #include "block-aio.h"
 
+#define MIN(a, b)       ((a) < (b) ? (a) : (b))
 
 
 /*Get Image size, secsize*/
@@ -114,7 +115,7 @@ static int tdaio_get_image_info(int fd, td_disk_info_t *info)
 int tdaio_open(td_driver_t *driver, const char *name,
 	       struct td_vbd_encryption *encryption, td_flag_t flags)
 {
-	int i, fd, ret, o_flags;
+	int i, fd, ret, o_flags, buffered;
 	struct tdaio_state *prv;
 
 	ret = 0;
@@ -123,25 +124,33 @@ int tdaio_open(td_driver_t *driver, const char *name,
 	DPRINTF("block-aio open('%s')", name);
 
 	memset(prv, 0, sizeof(struct tdaio_state));
+	prv->driver = driver;
 
 	prv->aio_free_count = MAX_AIO_REQS;
 	for (i = 0; i < MAX_AIO_REQS; i++)
 		prv->aio_free_list[i] = &prv->aio_requests[i];
 
 	/* Open the file */
-	o_flags = O_DIRECT | O_LARGEFILE | 
+	buffered = !!(flags & TD_OPEN_BUFFERED);
+	o_flags = (buffered ? 0 : O_DIRECT) | O_LARGEFILE |
 		((flags & TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
         fd = open(name, o_flags);
 
-        if ( (fd == -1) && (errno == EINVAL) ) {
+        if ( (fd == -1) && (errno == EINVAL) && !buffered ) {
 
-                /* Maybe O_DIRECT isn't supported. */
+                /*
+		 * Maybe O_DIRECT isn't supported. Writes then go through
+		 * the page cache, and are only acked once synced.
+		 */
 		o_flags &= ~O_DIRECT;
                 fd = open(name, o_flags);
                 if (fd != -1) DPRINTF("WARNING: Accessing image without"
-                                     "O_DIRECT! (%s)\n", name);
+                                     " O_DIRECT, using buffered I/O! (%s)\n",
+				     name);
+		buffered = 1;
 
-        } else if (fd != -1) DPRINTF("open(%s) with O_DIRECT\n", name);
+        } else if (fd != -1) DPRINTF("open(%s) with %s\n", name,
+				     buffered ? "buffered I/O" : "O_DIRECT");
 	
         if (fd == -1) {
 		DPRINTF("Unable to open [%s] (%d)!\n", name, 0 - errno);
@@ -156,20 +165,220 @@ int tdaio_open(td_driver_t *driver, const char *name,
 	}
 
         prv->fd = fd;
+	td_syncer_init(&prv->syncer, fd,
+		       buffered && !(flags & TD_OPEN_RDONLY));
+
+	/* Block devices have no holes we could ask lseek() about. */
+	{
+		struct stat st;
+		if (!fstat(fd, &st) && S_ISREG(st.st_mode))
+			prv->seek_hole = 1;
+	}
 
 done:
 	return ret;	
 }
 
-void tdaio_complete(void *arg, struct tiocb *tiocb, int err)
+/*
+ * Writes only ever turn holes into data, so cached data extents stay
+ * valid; anything else overlapping the range is dropped.
+ */
+static void
+tdaio_invalidate_extents(struct tdaio_state *prv,
+			 td_sector_t sec, int secs)
+{
+	int i;
+	struct aio_extent *ext;
+
+	for (i = 0; i < AIO_EXTENT_CACHE; i++) {
+		ext = &prv->extents[i];
+		if (ext->end == 0 || ext->status == TD_BLOCK_STATE_NONE)
+			continue;
+		if (ext->start < sec + secs && sec < ext->end)
+			ext->end = 0;
+	}
+}
+
+static struct aio_extent *
+tdaio_lookup_extent(struct tdaio_state *prv, td_sector_t sec)
+{
+	int i;
+	struct aio_extent *ext;
+
+	for (i = 0; i < AIO_EXTENT_CACHE; i++) {
+		ext = &prv->extents[i];
+		if (ext->end && ext->start <= sec && sec < ext->end) {
+			ext->seqno = ++prv->extent_seqno;
+			return ext;
+		}
+	}
+
+	return NULL;
+}
+
+static struct aio_extent *
+tdaio_insert_extent(struct tdaio_state *prv, td_sector_t start,
+		    td_sector_t end, int status)
+{
+	int i;
+	struct aio_extent *ext, *lru;
+
+	lru = &prv->extents[0];
+	for (i = 0; i < AIO_EXTENT_CACHE; i++) {
+		ext = &prv->extents[i];
+		if (!ext->end) {
+			lru = ext;
+			break;
+		}
+		if (ext->seqno < lru->seqno)
+			lru = ext;
+	}
+
+	lru->start  = start;
+	lru->end    = end;
+	lru->status = status;
+	lru->seqno  = ++prv->extent_seqno;
+
+	return lru;
+}
+
+/*
+ * Ask the filesystem for the extent containing @sec. Returns the
+ * extent in sectors, clipped to the image size. Data which does not
+ * start on a sector boundary is rounded outwards.
+ */
+static int
+tdaio_probe_extent(struct tdaio_state *prv, td_sector_t sec,
+		   td_sector_t size, td_sector_t *end, int *status)
+{
+	off_t off, data, hole;
+
+	/* until proven otherwise, a single sector of data */
+	*end    = sec + 1;
+	*status = TD_BLOCK_STATE_NONE;
+
+	off  = (off_t)sec << SECTOR_SHIFT;
+
+	data = lseek(prv->fd, off, SEEK_DATA);
+	if (data == -1) {
+		if (errno != ENXIO)
+			return -errno;
+		/* hole running up to EOF */
+		*end    = size;
+		*status = TD_BLOCK_STATE_HOLE | TD_BLOCK_STATE_ZERO;
+		return 0;
+	}
+
+	if ((data >> SECTOR_SHIFT) > sec) {
+		*end    = MIN(size, (td_sector_t)data >> SECTOR_SHIFT);
+		*status = TD_BLOCK_STATE_HOLE | TD_BLOCK_STATE_ZERO;
+		return 0;
+	}
+
+	hole = lseek(prv->fd, off, SEEK_HOLE);
+	if (hole == -1)
+		return -errno;
+
+	*end    = MIN(size, (td_sector_t)
+		      ((hole + SECTOR_SIZE - 1) >> SECTOR_SHIFT));
+	if (*end <= sec)
+		*end = sec + 1;
+
+	return 0;
+}
+
+void tdaio_queue_block_status(td_driver_t *driver, td_request_t treq)
+{
+	int err, status;
+	td_sector_t end;
+	td_request_t clone;
+	struct aio_extent *ext;
+	struct tdaio_state *prv;
+
+	prv = (struct tdaio_state *)driver->data;
+
+	while (treq.secs > 0) {
+		clone = treq;
+
+		if (!prv->seek_hole) {
+			clone.status = TD_BLOCK_STATE_NONE;
+			td_complete_request(clone, 0);
+			return;
+		}
+
+		ext = tdaio_lookup_extent(prv, treq.sec);
+		if (ext) {
+			prv->extent_hits++;
+			end    = ext->end;
+			status = ext->status;
+		} else {
+			prv->extent_misses++;
+			err = tdaio_probe_extent(prv, treq.sec,
+						 driver->info.size,
+						 &end, &status);
+			if (err == -EINVAL || err == -EOPNOTSUPP) {
+				DPRINTF("SEEK_DATA not supported, "
+					"reporting all data\n");
+				prv->seek_hole = 0;
+				continue;
+			}
+			if (err) {
+				td_complete_request(treq, err);
+				return;
+			}
+			if (end <= treq.sec)
+				end = treq.sec + treq.secs;
+			else
+				tdaio_insert_extent(prv, treq.sec,
+						    end, status);
+		}
+
+		clone.secs   = MIN((td_sector_t)treq.secs, end - treq.sec);
+		clone.status = status;
+		td_complete_request(clone, 0);
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		treq.buf  += clone.secs << SECTOR_SHIFT;
+	}
+}
+
+static void
+tdaio_finish(struct aio_request *aio, int err)
 {
-	struct aio_request *aio = (struct aio_request *)arg;
 	struct tdaio_state *prv = aio->state;
 
 	td_complete_request(aio->treq, err);
 	prv->aio_free_list[prv->aio_free_count++] = aio;
 }
 
+static void
+tdaio_write_synced(struct td_sync_waiter *waiter, int err)
+{
+	tdaio_finish(container_of(waiter, struct aio_request, waiter), err);
+}
+
+void tdaio_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct aio_request *aio = (struct aio_request *)arg;
+	struct tdaio_state *prv = aio->state;
+
+	if (aio->treq.op != TD_OP_WRITE) {
+		tdaio_finish(aio, err);
+		return;
+	}
+
+	/*
+	 * Block status may have been probed while the write was in
+	 * flight; drop whatever got cached over it meanwhile.
+	 */
+	tdaio_invalidate_extents(prv, aio->treq.sec, aio->treq.secs);
+
+	td_syncer_complete(&prv->syncer, &aio->waiter, tdaio_write_synced,
+			   aio->treq.sec * (uint64_t)prv->driver->info.sector_size,
+			   aio->treq.secs * prv->driver->info.sector_size, err);
+}
+
 void tdaio_queue_read(td_driver_t *driver, td_request_t treq)
 {
 	int size;
@@ -216,6 +425,8 @@ void tdaio_queue_write(td_driver_t *driver, td_request_t treq)
 	aio->treq  = treq;
 	aio->state = prv;
 
+	tdaio_invalidate_extents(prv, treq.sec, treq.secs);
+
 	td_prep_write(driver, &aio->tiocb, prv->fd, treq.buf,
 		      size, offset, tdaio_complete, aio);
 	td_queue_tiocb(driver, &aio->tiocb);
@@ -230,6 +441,7 @@ int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
 	
+	td_syncer_close(&prv->syncer);
 	close(prv->fd);
 
 	return 0;
@@ -257,6 +469,16 @@ void tdaio_stats(td_driver_t *driver, td_stats_t *st)
 	tapdisk_stats_field(st, "max", "lu", MAX_AIO_REQS);
 	tapdisk_stats_field(st, "pending", "d", n_pending);
 	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "extent_cache", "{");
+	tapdisk_stats_field(st, "seek_hole", "d", prv->seek_hole);
+	tapdisk_stats_field(st, "hits", "llu", prv->extent_hits);
+	tapdisk_stats_field(st, "misses", "llu", prv->extent_misses);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "io", "{");
+	td_syncer_stats(&prv->syncer, st);
+	tapdisk_stats_leave(st, '}');
 }
 
 struct tap_disk tapdisk_aio = {
@@ -267,6 +489,7 @@ struct tap_disk tapdisk_aio = {
 	.td_close           = tdaio_close,
 	.td_queue_read      = tdaio_queue_read,
 	.td_queue_write     = tdaio_queue_write,
+	.td_queue_block_status = tdaio_queue_block_status,
 	.td_get_parent_id   = tdaio_get_parent_id,
 	.td_validate_parent = tdaio_validate_parent,
 	.td_debug           = NULL,
@@ -32,9 +32,22 @@
 #define __BLOCK_AIO_H__
 
 #include "tapdisk.h"
+#include "tapdisk-syncer.h"
 
 
 #define MAX_AIO_REQS         TAPDISK_DATA_REQUESTS
+#define AIO_EXTENT_CACHE     64
+
+/*
+ * A cached SEEK_DATA/SEEK_HOLE answer covering [start, end). Unused
+ * slots have end == 0.
+ */
+struct aio_extent {
+	td_sector_t          start;
+	td_sector_t          end;
+	int                  status;
+	uint64_t             seqno;
+};
 
 struct tdaio_state;
 
@@ -42,17 +55,26 @@ struct aio_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdaio_state  *state;
+	struct td_sync_waiter waiter;
 };
 
 struct tdaio_state {
 	int                  fd;
 	td_driver_t         *driver;
+	struct td_syncer     syncer;
 
 	int                  aio_free_count;
 	struct aio_request   aio_requests[MAX_AIO_REQS];
 	struct aio_request  *aio_free_list[MAX_AIO_REQS];
+
+	int                  seek_hole;
+	uint64_t             extent_seqno;
+	struct aio_extent    extents[AIO_EXTENT_CACHE];
+	unsigned long long   extent_hits;
+	unsigned long long   extent_misses;
 };
 
 void tdaio_complete(void *arg, struct tiocb *tiocb, int err);
+void tdaio_queue_block_status(td_driver_t *driver, td_request_t treq);
 
 #endif
@@ -0,0 +1,1307 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compressed images (see block-cz.h). Chunks are the unit of
+ * compression: reads decompress whole chunks, keeping the most recent
+ * ones around for the reads that follow, and partial writes
+ * read-modify-write theirs, fetching chunks never written from the
+ * parent through the usual forwarding path.
+ *
+ * A rewritten chunk always goes to free space, and the old copy is
+ * released only once the map points at the new one. Map updates are
+ * committed a sector at a time, one round in flight, so writes
+ * arriving meanwhile share the next round's sector writes.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "tapdisk.h"
+#include "tapdisk-utils.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "block-cz.h"
+
+#define DBG(_f, _a...)       tlog_syslog(TLOG_DBG, _f, ##_a)
+#define INFO(_f, _a...)      tlog_syslog(TLOG_INFO, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+#define MIN(a, b)            ((a) < (b) ? (a) : (b))
+
+#define CZ_UNIT_SIZE         (1 << CZ_UNIT_SHIFT)
+#define CZ_MAP_PER_SEC       (SECTOR_SIZE / sizeof(struct cz_entry))
+#define CZ_MAX_OPS           64
+#define CZ_CACHE_SLOTS       32
+#define CZ_LEVEL             1          /* fastest deflate */
+
+#define CZ_ALIGN(_v, _a)     (((_v) + (_a) - 1) & ~((uint64_t)(_a) - 1))
+
+typedef struct td_cz td_cz_t;
+
+struct cz_waiter {
+	struct list_head        next;
+	td_request_t            treq;
+};
+
+/*
+ * A chunk being read or rewritten. Requests for the same chunk wait
+ * behind it.
+ */
+struct cz_op {
+	td_cz_t                *s;
+	int                     busy;
+	uint64_t                chunk;
+	int                     secs;       /* of the chunk within the image */
+	td_request_t            treq;
+
+	struct cz_entry         old;
+	struct cz_entry         new;
+	char                   *raw;
+	char                   *zbuf;
+	int                     pending;
+	int                     err;
+	struct tiocb            tiocb;
+
+	struct list_head        waiters;
+	struct list_head        commit;
+};
+
+struct cz_slot {
+	uint64_t                chunk;
+	int                     valid;
+	uint64_t                seq;
+	char                   *buf;
+};
+
+struct td_cz {
+	td_driver_t            *driver;
+	char                   *name;
+	int                     fd;
+	struct cz_header        hdr;
+
+	uint64_t                n_chunks;
+	int                     chunk_shift; /* in sectors */
+	int                     chunk_secs;
+	size_t                  chunk_size;
+
+	struct cz_entry        *map;
+	uint64_t                map_bytes;
+	uint8_t                *map_dirty;
+	uint32_t                dirty[CZ_MAX_OPS];
+	int                     n_dirty;
+
+	uint64_t               *units;
+	uint64_t                n_units;     /* in use up to here */
+	uint64_t                max_units;   /* bitmap capacity */
+	uint64_t                free_hint;
+
+	z_stream                zdef;
+	z_stream                zinf;
+
+	struct cz_op            ops[CZ_MAX_OPS];
+
+	struct cz_slot          cache[CZ_CACHE_SLOTS];
+	uint64_t                seq;
+
+	struct list_head        commit_pending;
+	struct list_head        committing;
+	int                     commit_inflight;
+	int                     commit_err;
+	uint32_t                commit_secs[CZ_MAX_OPS];
+	char                   *commit_buf;
+	struct tiocb            commit_tiocb[CZ_MAX_OPS];
+
+	uint64_t                codecs[CZ_CODEC_MAX];
+
+	struct {
+		unsigned long long      cache_hits;
+		unsigned long long      decompressed;
+		unsigned long long      forwarded;
+		unsigned long long      rmw;
+		unsigned long long      bytes_in;
+		unsigned long long      bytes_out;
+		unsigned long long      commits;
+		unsigned long long      busy;
+		unsigned long long      errors;
+	} stats;
+};
+
+static void cz_dispatch(td_cz_t *, td_request_t);
+static void __cz_commit_done(void *, struct tiocb *, int);
+
+static uint32_t
+cz_header_crc(const struct cz_header *hdr)
+{
+	return crc32(0L, (const Bytef *)hdr, offsetof(struct cz_header, crc));
+}
+
+static int
+cz_header_valid(const struct cz_header *hdr)
+{
+	return hdr->magic == CZ_MAGIC &&
+		hdr->version == CZ_VERSION &&
+		hdr->crc == cz_header_crc(hdr) &&
+		hdr->chunk_shift >= CZ_MIN_CHUNK_SHIFT &&
+		hdr->chunk_shift <= CZ_MAX_CHUNK_SHIFT &&
+		hdr->map_off >= CZ_HEADER_SIZE &&
+		hdr->data_off > hdr->map_off;
+}
+
+static inline uint64_t
+cz_unit_offset(td_cz_t *s, uint32_t unit)
+{
+	return s->hdr.data_off + ((uint64_t)unit << CZ_UNIT_SHIFT);
+}
+
+static inline int
+cz_entry_units(const struct cz_entry *e)
+{
+	if (e->codec != CZ_CODEC_RAW && e->codec != CZ_CODEC_DEFLATE)
+		return 0;
+	return CZ_ALIGN((uint64_t)e->secs << SECTOR_SHIFT, CZ_UNIT_SIZE)
+		>> CZ_UNIT_SHIFT;
+}
+
+/*
+ * Unit allocation bitmap, rebuilt from the map on open.
+ */
+static inline int
+cz_unit_used(td_cz_t *s, uint64_t u)
+{
+	return !!(s->units[u >> 6] & (1ULL << (u & 63)));
+}
+
+static int
+cz_units_reserve(td_cz_t *s, uint64_t n)
+{
+	uint64_t *units, words;
+
+	if (n <= s->max_units)
+		return 0;
+
+	words = CZ_ALIGN(n + (n >> 2), 64) >> 6;
+	units = realloc(s->units, words * sizeof(uint64_t));
+	if (!units)
+		return -ENOMEM;
+
+	memset(units + (s->max_units >> 6), 0,
+	       (words - (s->max_units >> 6)) * sizeof(uint64_t));
+
+	s->units     = units;
+	s->max_units = words << 6;
+	return 0;
+}
+
+static void
+cz_units_mark(td_cz_t *s, uint64_t start, int n, int used)
+{
+	uint64_t u;
+
+	for (u = start; u < start + n; u++)
+		if (used)
+			s->units[u >> 6] |= 1ULL << (u & 63);
+		else
+			s->units[u >> 6] &= ~(1ULL << (u & 63));
+
+	if (!used && start < s->free_hint)
+		s->free_hint = start;
+}
+
+/*
+ * First fit, or else the end of the data area.
+ */
+static int64_t
+cz_units_alloc(td_cz_t *s, int n)
+{
+	uint64_t u, start = 0, run = 0;
+	int first = 1;
+
+	for (u = s->free_hint; u < s->n_units; u++) {
+		if (!(u & 63) && s->units[u >> 6] == ~0ULL &&
+		    u + 64 <= s->n_units) {
+			run = 0;
+			u += 63;
+			continue;
+		}
+
+		if (cz_unit_used(s, u)) {
+			run = 0;
+			continue;
+		}
+
+		if (first) {
+			s->free_hint = u;
+			first = 0;
+		}
+
+		if (!run++)
+			start = u;
+
+		if (run == n)
+			goto found;
+	}
+
+	if (!run)
+		start = s->n_units;
+	if (first)
+		s->free_hint = start;
+
+	if (cz_units_reserve(s, start + n))
+		return -ENOMEM;
+	s->n_units = start + n;
+
+found:
+	cz_units_mark(s, start, n, 1);
+	if (s->free_hint == start)
+		s->free_hint = start + n;
+
+	return start;
+}
+
+static void
+cz_units_free(td_cz_t *s, const struct cz_entry *e)
+{
+	int n = cz_entry_units(e);
+
+	if (n)
+		cz_units_mark(s, e->unit, n, 0);
+}
+
+/*
+ * Decompressed chunks, most recently used kept.
+ */
+static struct cz_slot *
+cz_cache_find(td_cz_t *s, uint64_t chunk)
+{
+	int i;
+
+	for (i = 0; i < CZ_CACHE_SLOTS; i++)
+		if (s->cache[i].valid && s->cache[i].chunk == chunk) {
+			s->cache[i].seq = ++s->seq;
+			return &s->cache[i];
+		}
+
+	return NULL;
+}
+
+/*
+ * Hands the op's buffer over to the cache, taking the evicted one in
+ * exchange.
+ */
+static void
+cz_cache_put(td_cz_t *s, struct cz_op *op)
+{
+	struct cz_slot *slot = NULL;
+	char *buf;
+	int i;
+
+	for (i = 0; i < CZ_CACHE_SLOTS; i++) {
+		if (s->cache[i].valid && s->cache[i].chunk == op->chunk) {
+			slot = &s->cache[i];
+			break;
+		}
+		if (!slot || !s->cache[i].valid ||
+		    (slot->valid && s->cache[i].seq < slot->seq))
+			slot = &s->cache[i];
+	}
+
+	buf         = slot->buf;
+	slot->buf   = op->raw;
+	slot->chunk = op->chunk;
+	slot->valid = 1;
+	slot->seq   = ++s->seq;
+	op->raw     = buf;
+}
+
+static void
+cz_cache_drop(td_cz_t *s, uint64_t chunk)
+{
+	int i;
+
+	for (i = 0; i < CZ_CACHE_SLOTS; i++)
+		if (s->cache[i].valid && s->cache[i].chunk == chunk)
+			s->cache[i].valid = 0;
+}
+
+static struct cz_op *
+cz_find_op(td_cz_t *s, uint64_t chunk)
+{
+	int i;
+
+	for (i = 0; i < CZ_MAX_OPS; i++)
+		if (s->ops[i].busy && s->ops[i].chunk == chunk)
+			return &s->ops[i];
+
+	return NULL;
+}
+
+static struct cz_op *
+cz_get_op(td_cz_t *s, td_request_t treq)
+{
+	struct cz_op *op = NULL;
+	uint64_t chunk;
+	int i, err;
+
+	for (i = 0; i < CZ_MAX_OPS; i++)
+		if (!s->ops[i].busy) {
+			op = &s->ops[i];
+			break;
+		}
+
+	if (!op)
+		return NULL;
+
+	if (!op->raw) {
+		err = posix_memalign((void **)&op->raw, 4096, s->chunk_size);
+		if (err) {
+			op->raw = NULL;
+			return NULL;
+		}
+	}
+
+	if (!op->zbuf) {
+		err = posix_memalign((void **)&op->zbuf, 4096, s->chunk_size);
+		if (err) {
+			op->zbuf = NULL;
+			return NULL;
+		}
+	}
+
+	chunk = treq.sec >> s->chunk_shift;
+
+	op->s     = s;
+	op->busy  = 1;
+	op->chunk = chunk;
+	op->secs  = MIN(s->chunk_secs,
+			s->driver->info.size - (chunk << s->chunk_shift));
+	op->treq  = treq;
+	op->old   = s->map[chunk];
+	op->err   = 0;
+	INIT_LIST_HEAD(&op->waiters);
+	INIT_LIST_HEAD(&op->commit);
+
+	return op;
+}
+
+static void
+cz_put_op(td_cz_t *s, struct cz_op *op)
+{
+	struct cz_waiter *w, *tmp;
+	struct list_head waiters;
+
+	INIT_LIST_HEAD(&waiters);
+	list_splice_tail(&op->waiters, &waiters);
+	INIT_LIST_HEAD(&op->waiters);
+	op->busy = 0;
+
+	list_for_each_entry_safe(w, tmp, &waiters, next) {
+		list_del(&w->next);
+		cz_dispatch(s, w->treq);
+		free(w);
+	}
+}
+
+static void
+cz_op_done(td_cz_t *s, struct cz_op *op, int err)
+{
+	if (err)
+		s->stats.errors++;
+
+	td_complete_request(op->treq, err);
+	cz_put_op(s, op);
+}
+
+/*
+ * Map sectors are committed in rounds: sectors dirtied while one
+ * round is in flight all go out together in the next one.
+ */
+static void
+cz_commit_kick(td_cz_t *s)
+{
+	struct tiocb *tiocb;
+	uint32_t sec;
+	int i, n;
+
+	if (s->commit_inflight || !s->n_dirty)
+		return;
+
+	list_splice_tail(&s->commit_pending, &s->committing);
+	INIT_LIST_HEAD(&s->commit_pending);
+
+	n = s->n_dirty;
+	s->n_dirty = 0;
+	s->commit_inflight = n;
+	s->stats.commits++;
+
+	for (i = 0; i < n; i++) {
+		sec = s->dirty[i];
+		s->map_dirty[sec] = 0;
+		s->commit_secs[i] = sec;
+
+		memcpy(s->commit_buf + ((size_t)i << SECTOR_SHIFT),
+		       (char *)s->map + ((size_t)sec << SECTOR_SHIFT),
+		       SECTOR_SIZE);
+	}
+
+	for (i = 0; i < n; i++) {
+		tiocb = &s->commit_tiocb[i];
+		td_prep_write(s->driver, tiocb, s->fd,
+			      s->commit_buf + ((size_t)i << SECTOR_SHIFT),
+			      SECTOR_SIZE,
+			      s->hdr.map_off +
+			      ((uint64_t)s->commit_secs[i] << SECTOR_SHIFT),
+			      __cz_commit_done, s);
+	}
+
+	for (i = 0; i < n; i++)
+		td_queue_tiocb(s->driver, &s->commit_tiocb[i]);
+}
+
+static void
+cz_map_dirty(td_cz_t *s, uint64_t chunk)
+{
+	uint32_t sec = chunk / CZ_MAP_PER_SEC;
+
+	if (s->map_dirty[sec])
+		return;
+
+	s->map_dirty[sec]       = 1;
+	s->dirty[s->n_dirty++]  = sec;
+}
+
+static void
+cz_map_set(td_cz_t *s, uint64_t chunk, const struct cz_entry *e)
+{
+	s->codecs[s->map[chunk].codec]--;
+	s->map[chunk] = *e;
+	s->codecs[e->codec]++;
+	cz_map_dirty(s, chunk);
+}
+
+static void
+__cz_commit_done(void *arg, struct tiocb *tiocb, int err)
+{
+	td_cz_t *s = arg;
+	struct cz_op *op, *tmp;
+	struct list_head done;
+
+	if (err)
+		s->commit_err = s->commit_err ? : err;
+
+	if (--s->commit_inflight)
+		return;
+
+	err = s->commit_err;
+	s->commit_err = 0;
+
+	if (err)
+		ERR(err, "%s: map update failed\n", s->name);
+
+	/* completions may start the next round */
+	INIT_LIST_HEAD(&done);
+	list_splice_tail(&s->committing, &done);
+	INIT_LIST_HEAD(&s->committing);
+
+	list_for_each_entry_safe(op, tmp, &done, commit) {
+		list_del_init(&op->commit);
+
+		if (err) {
+			/* back to the old copy, rewritten next round */
+			cz_map_set(s, op->chunk, &op->old);
+			cz_units_free(s, &op->new);
+		} else {
+			cz_units_free(s, &op->old);
+			cz_cache_put(s, op);
+		}
+
+		cz_op_done(s, op, err);
+	}
+
+	cz_commit_kick(s);
+}
+
+static void
+cz_op_commit(td_cz_t *s, struct cz_op *op)
+{
+	cz_map_set(s, op->chunk, &op->new);
+	list_add_tail(&op->commit, &s->commit_pending);
+	cz_commit_kick(s);
+}
+
+static void
+__cz_data_written(void *arg, struct tiocb *tiocb, int err)
+{
+	struct cz_op *op = arg;
+	td_cz_t *s = op->s;
+
+	if (err) {
+		cz_units_free(s, &op->new);
+		cz_op_done(s, op, err);
+		return;
+	}
+
+	cz_op_commit(s, op);
+}
+
+static int
+cz_is_zero(const char *buf, size_t size)
+{
+	const uint64_t *p = (const uint64_t *)buf;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(*p); i++)
+		if (p[i])
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Deflates the chunk, settling for a raw copy unless that saves at
+ * least a unit.
+ */
+static int
+cz_deflate(td_cz_t *s, struct cz_op *op, size_t size)
+{
+	z_stream *zs = &s->zdef;
+	int err;
+
+	if (size <= CZ_UNIT_SIZE)
+		return -ENOSPC;
+
+	err = deflateReset(zs);
+	if (err != Z_OK)
+		return -EIO;
+
+	zs->next_in   = (Bytef *)op->raw;
+	zs->avail_in  = size;
+	zs->next_out  = (Bytef *)op->zbuf;
+	zs->avail_out = CZ_ALIGN(size, CZ_UNIT_SIZE) - CZ_UNIT_SIZE;
+
+	err = deflate(zs, Z_FINISH);
+	if (err != Z_STREAM_END)
+		return -ENOSPC;
+
+	return zs->total_out;
+}
+
+static void
+cz_op_store(td_cz_t *s, struct cz_op *op)
+{
+	size_t size = (size_t)op->secs << SECTOR_SHIFT, len;
+	struct cz_entry *e = &op->new;
+	int64_t unit;
+	char *buf;
+	int n;
+
+	memset(e, 0, sizeof(*e));
+	s->stats.bytes_in += size;
+
+	/*
+	 * Superseded: a successful commit caches the new contents, a
+	 * failed one has the next read load whatever the map points at.
+	 */
+	cz_cache_drop(s, op->chunk);
+
+	if (cz_is_zero(op->raw, size)) {
+		e->codec = CZ_CODEC_ZERO;
+		cz_op_commit(s, op);
+		return;
+	}
+
+	n = cz_deflate(s, op, size);
+	if (n > 0) {
+		e->codec = CZ_CODEC_DEFLATE;
+		len      = n;
+		buf      = op->zbuf;
+	} else {
+		e->codec = CZ_CODEC_RAW;
+		len      = size;
+		buf      = op->raw;
+	}
+
+	e->secs = CZ_ALIGN(len, SECTOR_SIZE) >> SECTOR_SHIFT;
+	n       = cz_entry_units(e);
+	memset(buf + len, 0, ((size_t)n << CZ_UNIT_SHIFT) - len);
+
+	unit = cz_units_alloc(s, n);
+	if (unit < 0) {
+		cz_op_done(s, op, unit);
+		return;
+	}
+
+	e->unit = unit;
+	s->stats.bytes_out += (uint64_t)n << CZ_UNIT_SHIFT;
+
+	td_prep_write(s->driver, &op->tiocb, s->fd, buf,
+		      (size_t)n << CZ_UNIT_SHIFT, cz_unit_offset(s, unit),
+		      __cz_data_written, op);
+	td_queue_tiocb(s->driver, &op->tiocb);
+}
+
+/*
+ * The op's chunk is in op->raw: serve a read, or merge a write in
+ * and store it back.
+ */
+static void
+cz_op_loaded(td_cz_t *s, struct cz_op *op, int err)
+{
+	td_request_t *treq = &op->treq;
+	size_t off;
+
+	if (err) {
+		cz_op_done(s, op, err);
+		return;
+	}
+
+	off = (size_t)(treq->sec - (op->chunk << s->chunk_shift))
+		<< SECTOR_SHIFT;
+
+	if (treq->op == TD_OP_WRITE) {
+		memcpy(op->raw + off, treq->buf,
+		       (size_t)treq->secs << SECTOR_SHIFT);
+		cz_op_store(s, op);
+		return;
+	}
+
+	memcpy(treq->buf, op->raw + off, (size_t)treq->secs << SECTOR_SHIFT);
+	cz_cache_put(s, op);
+	cz_op_done(s, op, 0);
+}
+
+static void
+__cz_chunk_read(void *arg, struct tiocb *tiocb, int err)
+{
+	struct cz_op *op = arg;
+	td_cz_t *s = op->s;
+	z_stream *zs = &s->zinf;
+	size_t size = (size_t)op->secs << SECTOR_SHIFT;
+
+	if (err || op->old.codec == CZ_CODEC_RAW)
+		goto out;
+
+	s->stats.decompressed++;
+
+	err = inflateReset(zs);
+	if (err != Z_OK) {
+		err = -EIO;
+		goto out;
+	}
+
+	zs->next_in   = (Bytef *)op->zbuf;
+	zs->avail_in  = (size_t)op->old.secs << SECTOR_SHIFT;
+	zs->next_out  = (Bytef *)op->raw;
+	zs->avail_out = size;
+
+	err = inflate(zs, Z_FINISH);
+	if (err != Z_STREAM_END || zs->total_out != size) {
+		ERR(-EIO, "%s: chunk %"PRIu64" is corrupt\n",
+		    s->name, op->chunk);
+		err = -EIO;
+		goto out;
+	}
+
+	err = 0;
+
+out:
+	cz_op_loaded(s, op, err);
+}
+
+static void
+__cz_parent_read(td_request_t treq, int err)
+{
+	struct cz_op *op = treq.cb_data;
+
+	if (err)
+		op->err = op->err ? : err;
+
+	/* may come back in pieces past the end of the parent */
+	op->pending -= treq.secs;
+	if (!op->pending)
+		cz_op_loaded(op->s, op, op->err);
+}
+
+static void
+cz_op_load(td_cz_t *s, struct cz_op *op)
+{
+	struct cz_entry *e = &op->old;
+	td_request_t clone;
+	struct cz_slot *slot;
+	char *buf;
+
+	switch (e->codec) {
+	case CZ_CODEC_ZERO:
+		memset(op->raw, 0, s->chunk_size);
+		cz_op_loaded(s, op, 0);
+		return;
+
+	case CZ_CODEC_NONE:
+		s->stats.forwarded += op->secs;
+
+		clone         = op->treq;
+		clone.op      = TD_OP_READ;
+		clone.sec     = op->chunk << s->chunk_shift;
+		clone.secs    = op->secs;
+		clone.buf     = op->raw;
+		clone.cb      = __cz_parent_read;
+		clone.cb_data = op;
+
+		op->pending   = op->secs;
+		td_forward_request(clone);
+		return;
+	}
+
+	slot = cz_cache_find(s, op->chunk);
+	if (slot) {
+		s->stats.cache_hits++;
+		memcpy(op->raw, slot->buf, (size_t)op->secs << SECTOR_SHIFT);
+		cz_op_loaded(s, op, 0);
+		return;
+	}
+
+	buf = e->codec == CZ_CODEC_RAW ? op->raw : op->zbuf;
+
+	td_prep_read(s->driver, &op->tiocb, s->fd, buf,
+		     (size_t)e->secs << SECTOR_SHIFT,
+		     cz_unit_offset(s, e->unit), __cz_chunk_read, op);
+	td_queue_tiocb(s->driver, &op->tiocb);
+}
+
+static void
+cz_status(td_cz_t *s, td_request_t treq)
+{
+	switch (s->map[treq.sec >> s->chunk_shift].codec) {
+	case CZ_CODEC_NONE:
+		td_forward_request(treq);
+		return;
+	case CZ_CODEC_ZERO:
+		treq.status = TD_BLOCK_STATE_HOLE | TD_BLOCK_STATE_ZERO;
+		break;
+	default:
+		treq.status = TD_BLOCK_STATE_NONE;
+		break;
+	}
+
+	td_complete_request(treq, 0);
+}
+
+/*
+ * Serves a request within a single chunk.
+ */
+static void
+cz_dispatch(td_cz_t *s, td_request_t treq)
+{
+	uint64_t chunk = treq.sec >> s->chunk_shift;
+	struct cz_entry *e = &s->map[chunk];
+	struct cz_waiter *w;
+	struct cz_slot *slot;
+	struct cz_op *op;
+	size_t off;
+
+	op = cz_find_op(s, chunk);
+	if (op) {
+		w = malloc(sizeof(*w));
+		if (!w) {
+			td_complete_request(treq, -EBUSY);
+			return;
+		}
+
+		w->treq = treq;
+		list_add_tail(&w->next, &op->waiters);
+		return;
+	}
+
+	if (treq.op == TD_OP_BLOCK_STATUS) {
+		cz_status(s, treq);
+		return;
+	}
+
+	if (treq.op == TD_OP_READ) {
+		switch (e->codec) {
+		case CZ_CODEC_NONE:
+			s->stats.forwarded += treq.secs;
+			td_forward_request(treq);
+			return;
+
+		case CZ_CODEC_ZERO:
+			memset(treq.buf, 0, (size_t)treq.secs << SECTOR_SHIFT);
+			td_complete_request(treq, 0);
+			return;
+		}
+
+		slot = cz_cache_find(s, chunk);
+		if (slot) {
+			s->stats.cache_hits++;
+			off = (size_t)(treq.sec - (chunk << s->chunk_shift))
+				<< SECTOR_SHIFT;
+			memcpy(treq.buf, slot->buf + off,
+			       (size_t)treq.secs << SECTOR_SHIFT);
+			td_complete_request(treq, 0);
+			return;
+		}
+	}
+
+	op = cz_get_op(s, treq);
+	if (!op) {
+		s->stats.busy++;
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	/* a whole chunk overwritten needs nothing read first */
+	if (treq.op == TD_OP_WRITE && treq.secs == op->secs) {
+		memcpy(op->raw, treq.buf, (size_t)treq.secs << SECTOR_SHIFT);
+		cz_op_store(s, op);
+		return;
+	}
+
+	if (treq.op == TD_OP_WRITE)
+		s->stats.rmw++;
+
+	cz_op_load(s, op);
+}
+
+static void
+cz_queue_request(td_driver_t *driver, td_request_t treq)
+{
+	td_cz_t *s = driver->data;
+	td_request_t clone;
+	td_sector_t end;
+
+	while (treq.secs) {
+		end = ((treq.sec >> s->chunk_shift) + 1) << s->chunk_shift;
+
+		clone      = treq;
+		clone.secs = MIN((td_sector_t)treq.secs, end - treq.sec);
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		if (treq.buf)
+			treq.buf += (size_t)clone.secs << SECTOR_SHIFT;
+
+		cz_dispatch(s, clone);
+	}
+}
+
+static void
+cz_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	cz_queue_request(driver, treq);
+}
+
+static void
+cz_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	td_cz_t *s = driver->data;
+
+	if (td_flag_test(s->driver->state, TD_DRIVER_RDONLY)) {
+		td_complete_request(treq, -EPERM);
+		return;
+	}
+
+	cz_queue_request(driver, treq);
+}
+
+static void
+cz_queue_block_status(td_driver_t *driver, td_request_t treq)
+{
+	cz_queue_request(driver, treq);
+}
+
+static int
+cz_load_map(td_cz_t *s)
+{
+	struct cz_entry *e;
+	uint64_t i, end;
+	ssize_t n;
+	int err;
+
+	s->map_bytes = CZ_ALIGN(s->n_chunks * sizeof(struct cz_entry),
+				CZ_UNIT_SIZE);
+	if (s->hdr.map_off + s->map_bytes > s->hdr.data_off)
+		return -EINVAL;
+
+	err = posix_memalign((void **)&s->map, 4096, s->map_bytes);
+	if (err) {
+		s->map = NULL;
+		return -err;
+	}
+
+	n = pread(s->fd, s->map, s->map_bytes, s->hdr.map_off);
+	if (n != s->map_bytes)
+		return n < 0 ? -errno : -EIO;
+
+	s->map_dirty = calloc(s->map_bytes >> SECTOR_SHIFT, 1);
+	if (!s->map_dirty)
+		return -ENOMEM;
+
+	for (i = 0; i < s->n_chunks; i++) {
+		e = &s->map[i];
+		if (e->codec >= CZ_CODEC_MAX ||
+		    ((e->codec == CZ_CODEC_RAW ||
+		      e->codec == CZ_CODEC_DEFLATE) &&
+		     (!e->secs || e->secs > s->chunk_secs))) {
+			ERR(-EINVAL, "%s: bad map entry for chunk %"PRIu64"\n",
+			    s->name, i);
+			return -EINVAL;
+		}
+
+		s->codecs[e->codec]++;
+
+		if (!cz_entry_units(e))
+			continue;
+
+		end = (uint64_t)e->unit + cz_entry_units(e);
+		err = cz_units_reserve(s, end);
+		if (err)
+			return err;
+
+		cz_units_mark(s, e->unit, cz_entry_units(e), 1);
+		if (end > s->n_units)
+			s->n_units = end;
+	}
+
+	s->free_hint = 0;
+	return 0;
+}
+
+static int
+cz_close(td_driver_t *driver)
+{
+	td_cz_t *s = driver->data;
+	int i;
+
+	for (i = 0; i < CZ_MAX_OPS; i++) {
+		free(s->ops[i].raw);
+		free(s->ops[i].zbuf);
+	}
+
+	for (i = 0; i < CZ_CACHE_SLOTS; i++)
+		free(s->cache[i].buf);
+
+	if (s->zdef.state)
+		deflateEnd(&s->zdef);
+	if (s->zinf.state)
+		inflateEnd(&s->zinf);
+
+	if (s->fd >= 0)
+		close(s->fd);
+
+	free(s->commit_buf);
+	free(s->units);
+	free(s->map_dirty);
+	free(s->map);
+	free(s->name);
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+
+	return 0;
+}
+
+static int
+cz_open(td_driver_t *driver, const char *name,
+	struct td_vbd_encryption *encryption, td_flag_t flags)
+{
+	td_cz_t *s = driver->data;
+	int o_flags, err;
+	char *buf = NULL;
+	ssize_t n;
+
+	memset(s, 0, sizeof(*s));
+	s->driver = driver;
+	s->fd     = -1;
+	INIT_LIST_HEAD(&s->commit_pending);
+	INIT_LIST_HEAD(&s->committing);
+
+	s->name = strdup(name);
+	if (!s->name) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	o_flags = O_DIRECT | O_LARGEFILE |
+		((flags & TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
+	s->fd = open(name, o_flags);
+	if (s->fd == -1 && errno == EINVAL) {
+		/* Maybe O_DIRECT isn't supported. */
+		o_flags &= ~O_DIRECT;
+		s->fd = open(name, o_flags);
+	}
+	if (s->fd == -1) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = posix_memalign((void **)&buf, 4096, CZ_HEADER_SIZE);
+	if (err) {
+		buf = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	n = pread(s->fd, buf, CZ_HEADER_SIZE, 0);
+	if (n != CZ_HEADER_SIZE) {
+		err = n < 0 ? -errno : -EINVAL;
+		goto fail;
+	}
+
+	memcpy(&s->hdr, buf, sizeof(s->hdr));
+	if (!cz_header_valid(&s->hdr)) {
+		ERR(-EINVAL, "%s: not a valid cz image\n", name);
+		err = -EINVAL;
+		goto fail;
+	}
+	s->hdr.parent[CZ_NAME_MAX - 1] = '\0';
+
+	s->chunk_size  = (size_t)1 << s->hdr.chunk_shift;
+	s->chunk_shift = s->hdr.chunk_shift - SECTOR_SHIFT;
+	s->chunk_secs  = 1 << s->chunk_shift;
+	s->n_chunks    = CZ_ALIGN(s->hdr.size, s->chunk_size) >>
+		s->hdr.chunk_shift;
+
+	err = cz_load_map(s);
+	if (err)
+		goto fail;
+
+	err = posix_memalign((void **)&s->commit_buf, 4096,
+			     CZ_MAX_OPS << SECTOR_SHIFT);
+	if (err) {
+		s->commit_buf = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	if (deflateInit(&s->zdef, CZ_LEVEL) != Z_OK ||
+	    inflateInit(&s->zinf) != Z_OK) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	driver->info.size        = s->hdr.size >> SECTOR_SHIFT;
+	driver->info.sector_size = SECTOR_SIZE;
+	driver->info.info        = 0;
+
+	INFO("%s: %"PRIu64" chunks of %zu bytes, %"PRIu64" units in use\n",
+	     name, s->n_chunks, s->chunk_size, s->n_units);
+
+	free(buf);
+	return 0;
+
+fail:
+	free(buf);
+	cz_close(driver);
+	return err;
+}
+
+static int
+cz_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	td_cz_t *s = driver->data;
+	int flags = id->flags;
+
+	memset(id, 0, sizeof(*id));
+
+	if (!(s->hdr.flags & CZ_HAS_PARENT))
+		return TD_NO_PARENT;
+
+	id->name = strdup(s->hdr.parent);
+	if (!id->name)
+		return -ENOMEM;
+
+	id->type  = s->hdr.parent_type;
+	id->flags = flags | TD_OPEN_SHAREABLE | TD_OPEN_RDONLY;
+
+	return 0;
+}
+
+static int
+cz_validate_parent(td_driver_t *driver,
+		   td_driver_t *pdriver, td_flag_t flags)
+{
+	td_cz_t *s = driver->data;
+
+	if (pdriver->info.size > driver->info.size) {
+		ERR(-EINVAL, "%s: parent %s is larger than the image\n",
+		    s->name, pdriver->name);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void
+cz_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_cz_t *s = driver->data;
+
+	tapdisk_stats_field(st, "chunks", "[");
+	tapdisk_stats_val(st, "llu", (unsigned long long)s->n_chunks);
+	tapdisk_stats_val(st, "llu", (unsigned long long)s->codecs[CZ_CODEC_DEFLATE]);
+	tapdisk_stats_val(st, "llu", (unsigned long long)s->codecs[CZ_CODEC_RAW]);
+	tapdisk_stats_val(st, "llu", (unsigned long long)s->codecs[CZ_CODEC_ZERO]);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "units", "llu", (unsigned long long)s->n_units);
+	tapdisk_stats_field(st, "cache_hits", "llu", s->stats.cache_hits);
+	tapdisk_stats_field(st, "decompressed", "llu", s->stats.decompressed);
+	tapdisk_stats_field(st, "forwarded", "llu", s->stats.forwarded);
+	tapdisk_stats_field(st, "rmw", "llu", s->stats.rmw);
+	tapdisk_stats_field(st, "bytes_in", "llu", s->stats.bytes_in);
+	tapdisk_stats_field(st, "bytes_out", "llu", s->stats.bytes_out);
+	tapdisk_stats_field(st, "commits", "llu", s->stats.commits);
+	tapdisk_stats_field(st, "busy", "llu", s->stats.busy);
+	tapdisk_stats_field(st, "errors", "llu", s->stats.errors);
+}
+
+int
+tdcz_create(const char *name, uint64_t size,
+	    const char *parent, int parent_type, int chunk_shift)
+{
+	struct cz_header hdr;
+	uint64_t n_chunks;
+	char *buf;
+	int fd, err;
+
+	if (!chunk_shift)
+		chunk_shift = CZ_DEFAULT_CHUNK_SHIFT;
+
+	if (chunk_shift < CZ_MIN_CHUNK_SHIFT ||
+	    chunk_shift > CZ_MAX_CHUNK_SHIFT ||
+	    !size || size & (SECTOR_SIZE - 1))
+		return -EINVAL;
+
+	if (parent && strlen(parent) >= CZ_NAME_MAX)
+		return -ENAMETOOLONG;
+
+	n_chunks = CZ_ALIGN(size, 1ULL << chunk_shift) >> chunk_shift;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic       = CZ_MAGIC;
+	hdr.version     = CZ_VERSION;
+	hdr.chunk_shift = chunk_shift;
+	hdr.size        = size;
+	hdr.map_off     = CZ_HEADER_SIZE;
+	hdr.data_off    = hdr.map_off +
+		CZ_ALIGN(n_chunks * sizeof(struct cz_entry), CZ_UNIT_SIZE);
+	hdr.parent_type = -1;
+	if (parent) {
+		hdr.flags      |= CZ_HAS_PARENT;
+		hdr.parent_type = parent_type;
+		strcpy(hdr.parent, parent);
+	}
+	hdr.crc         = cz_header_crc(&hdr);
+
+	buf = calloc(1, CZ_HEADER_SIZE);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf, &hdr, sizeof(hdr));
+
+	fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	/* the map starts out sparse: all chunks unwritten */
+	if (pwrite(fd, buf, CZ_HEADER_SIZE, 0) != CZ_HEADER_SIZE ||
+	    ftruncate(fd, hdr.data_off) || fsync(fd)) {
+		err = -errno ? : -EIO;
+		close(fd);
+		unlink(name);
+		goto out;
+	}
+
+	err = close(fd) ? -errno : 0;
+
+out:
+	free(buf);
+	return err;
+}
+
+int
+tdcz_query(const char *name, uint64_t *size, char **parent, int *parent_type)
+{
+	struct cz_header hdr;
+	ssize_t n;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_LARGEFILE);
+	if (fd == -1)
+		return -errno;
+
+	n = pread(fd, &hdr, sizeof(hdr), 0);
+	close(fd);
+
+	if (n != sizeof(hdr) || !cz_header_valid(&hdr))
+		return -EINVAL;
+	hdr.parent[CZ_NAME_MAX - 1] = '\0';
+
+	if (size)
+		*size = hdr.size;
+
+	if (parent) {
+		*parent = NULL;
+		if (hdr.flags & CZ_HAS_PARENT) {
+			*parent = strdup(hdr.parent);
+			if (!*parent)
+				return -ENOMEM;
+		}
+	}
+
+	if (parent_type)
+		*parent_type = hdr.parent_type;
+
+	return 0;
+}
+
+struct tap_disk tapdisk_cz = {
+	.disk_type                  = "tapdisk_cz",
+	.flags                      = 0,
+	.private_data_size          = sizeof(td_cz_t),
+	.td_open                    = cz_open,
+	.td_close                   = cz_close,
+	.td_queue_read              = cz_queue_read,
+	.td_queue_write             = cz_queue_write,
+	.td_queue_block_status      = cz_queue_block_status,
+	.td_get_parent_id           = cz_get_parent_id,
+	.td_validate_parent         = cz_validate_parent,
+	.td_stats                   = cz_stats,
+};
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BLOCK_CZ_H_
+#define _BLOCK_CZ_H_
+
+#include <stdint.h>
+
+/*
+ * Compressed image. A header, a map with one entry per fixed-size
+ * chunk, and a data area allocated in 4KiB units. Each chunk is
+ * stored deflated, raw where that doesn't save a unit, or not at all
+ * when it is all zeroes. Chunks never written read through to the
+ * parent image, if there is one.
+ */
+
+#define CZ_MAGIC                0x7a636474 /* "tdcz" */
+#define CZ_VERSION              1
+#define CZ_HEADER_SIZE          4096
+#define CZ_NAME_MAX             1024
+#define CZ_UNIT_SHIFT           12
+#define CZ_DEFAULT_CHUNK_SHIFT  16         /* 64KiB */
+#define CZ_MIN_CHUNK_SHIFT      12
+#define CZ_MAX_CHUNK_SHIFT      20
+
+#define CZ_HAS_PARENT           0x1
+
+enum {
+	CZ_CODEC_NONE = 0,                 /* never written */
+	CZ_CODEC_RAW,
+	CZ_CODEC_DEFLATE,
+	CZ_CODEC_ZERO,
+	CZ_CODEC_MAX,
+};
+
+struct cz_header {
+	uint32_t                magic;
+	uint32_t                version;
+	uint32_t                chunk_shift;
+	uint32_t                flags;
+	uint64_t                size;      /* bytes */
+	uint64_t                map_off;
+	uint64_t                data_off;
+	int32_t                 parent_type;
+	char                    parent[CZ_NAME_MAX];
+	uint32_t                crc;
+} __attribute__((packed));
+
+struct cz_entry {
+	uint32_t                unit;      /* in the data area */
+	uint16_t                secs;      /* stored length */
+	uint8_t                 codec;
+	uint8_t                 pad;
+} __attribute__((packed));
+
+int tdcz_create(const char *name, uint64_t size,
+		const char *parent, int parent_type, int chunk_shift);
+int tdcz_query(const char *name, uint64_t *size,
+	       char **parent, int *parent_type);
+
+#endif
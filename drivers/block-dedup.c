@@ -0,0 +1,1954 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Content-addressed deduplication filter. Whole chunks written by the
+ * guest are fingerprinted, and a chunk whose contents are already in
+ * the store is kept by reference rather than written again. The store
+ * is one file shared by many images: an index of chunk fingerprints
+ * and reference counts, followed by the chunks. It is opened once per
+ * process, and so is its cache of chunks, which every VBD reading a
+ * chunk from the store shares: clones of one golden image hold their
+ * common blocks once, in memory as well as on disk.
+ *
+ * Each image has a map, naming the store slot of each of its chunks,
+ * if any. Chunks not in the store are read from the image below, and
+ * partial writes to them go there too; partial writes to a stored
+ * chunk are merged and stored anew. When the store is full, whole
+ * chunks go to the image below as well.
+ *
+ * The name is the map, e.g. "dedup:/var/lib/blktap/dedup/vm.map" as
+ * the first line of an x-chain. The store is dedup.store next to it,
+ * unless TAPDISK_DEDUP_STORE names another one. A missing store is
+ * formatted with TAPDISK_DEDUP_STORE_MB worth of
+ * TAPDISK_DEDUP_CHUNK_KB chunks; TAPDISK_DEDUP_CACHE_MB sizes the
+ * cache.
+ *
+ * Fingerprints are the crc32 and adler32 of a chunk, and contents are
+ * compared before a reference is taken. A reference is committed
+ * before the map points at it, and dropped only once the map no longer
+ * does: a crash may leak store space, but loses no data. A map holds
+ * data its image doesn't, so it is refused on any other image.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "list.h"
+#include "tapdisk.h"
+#include "tapdisk-utils.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
+
+#define DBG(_f, _a...)       tlog_syslog(TLOG_DBG, _f, ##_a)
+#define INFO(_f, _a...)      tlog_syslog(TLOG_INFO, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+#define MIN(a, b)            ((a) < (b) ? (a) : (b))
+
+#define DD_STORE_MAGIC       0x54534444 /* "DDST" */
+#define DD_MAP_MAGIC         0x504d4444 /* "DDMP" */
+#define DD_VERSION           1
+
+#define DD_HEADER_SIZE       4096
+#define DD_NAME_MAX          1024
+#define DD_STORE_FILE        "dedup.store"
+#define DD_DEFAULT_STORE_MB  4096
+#define DD_DEFAULT_CHUNK_KB  16
+#define DD_DEFAULT_CACHE_MB  64
+#define DD_MIN_CHUNK_SHIFT   12
+#define DD_MAX_CHUNK_SHIFT   16
+
+#define DD_MAX_OPS           64
+#define DD_SLOTS_PER_SEC     (SECTOR_SIZE / sizeof(struct dd_slot))
+#define DD_MAP_PER_SEC       (SECTOR_SIZE / sizeof(uint32_t))
+
+#define DD_ALIGN(_v, _a)     (((_v) + (_a) - 1) & ~((uint64_t)(_a) - 1))
+
+struct dd_store_header {
+	uint32_t                magic;
+	uint32_t                version;
+	uint32_t                chunk_shift;
+	uint32_t                pad;
+	uint64_t                id;
+	uint64_t                slots;
+	uint64_t                index_off;
+	uint64_t                data_off;
+	uint32_t                crc;
+} __attribute__((packed));
+
+/* index entry, one per store slot */
+struct dd_slot {
+	uint64_t                fp;
+	uint32_t                refs;
+	uint32_t                pad;
+} __attribute__((packed));
+
+struct dd_map_header {
+	uint32_t                magic;
+	uint32_t                version;
+	uint32_t                chunk_shift;
+	uint32_t                pad;
+	uint64_t                store_id;
+	uint64_t                chunks;
+	uint64_t                map_off;
+	char                    parent[DD_NAME_MAX];
+	uint32_t                crc;
+} __attribute__((packed));
+
+typedef struct td_dedup td_dedup_t;
+struct dd_op;
+
+struct dd_cblk {
+	struct list_head        lru;
+	uint32_t                slot;
+	char                   *buf;
+};
+
+struct dd_entry {
+	uint64_t                fp;
+	uint32_t                refs;
+	uint32_t                next;       /* hash chain or free list, slot + 1 */
+	uint16_t                pins;       /* comparisons in flight */
+	uint8_t                 hashed;
+	uint8_t                 used;
+	struct dd_cblk         *cblk;
+};
+
+/*
+ * Shared by all the filters in the process using it.
+ */
+struct dd_store {
+	struct list_head        next;
+	char                   *name;
+	int                     fd;
+	int                     users;
+	struct dd_store_header  hdr;
+
+	size_t                  chunk_size;
+	uint64_t                n_slots;
+	uint64_t                n_used;
+	struct dd_entry        *entries;
+	uint32_t               *buckets;
+	uint64_t                hash_mask;
+	uint32_t                free_head;
+
+	struct dd_slot         *index;
+	uint64_t                index_secs;
+	uint8_t                *index_dirty;
+	uint32_t               *dirty;
+	uint64_t                n_dirty;
+
+	struct list_head        commit_pending;
+	struct list_head        committing;
+	int                     commit_inflight;
+	int                     commit_err;
+	uint64_t                commit_round;
+	td_driver_t            *commit_driver;
+	uint32_t               *commit_secs;
+	char                   *commit_buf;
+	struct tiocb           *commit_tiocb;
+	uint64_t                commit_max;
+
+	struct list_head        lru;
+	uint64_t                n_cached;
+	uint64_t                max_cached;
+};
+
+struct dd_waiter {
+	struct list_head        next;
+	td_request_t            treq;
+};
+
+typedef void (*dd_commit_cb_t)(td_dedup_t *, struct dd_op *, int);
+
+/*
+ * A whole chunk being read or rewritten. Requests for the same chunk
+ * wait behind it.
+ */
+struct dd_op {
+	td_dedup_t             *s;
+	int                     busy;
+	uint64_t                chunk;
+	td_request_t            treq;
+
+	uint32_t                old;        /* map entries, slot + 1 */
+	uint32_t                new;
+	uint64_t                fp;
+	uint32_t                pinned;
+	char                   *buf;
+	char                   *vbuf;
+	int                     pending;
+	int                     err;
+	struct tiocb            tiocb;
+
+	struct list_head        waiters;
+	struct list_head        commit;
+	dd_commit_cb_t          committed;
+};
+
+struct td_dedup {
+	td_driver_t            *driver;
+	char                   *name;
+	int                     fd;
+	int                     rdonly;
+	struct dd_store        *store;
+	struct dd_map_header    hdr;
+	int                     formatted;
+
+	int                     chunk_shift; /* in sectors */
+	int                     chunk_secs;
+	uint64_t                n_chunks;
+	uint64_t                n_mapped;
+
+	uint32_t               *map;
+	uint64_t                map_bytes;
+	uint8_t                *map_dirty;
+	uint32_t                dirty[DD_MAX_OPS];
+	int                     n_dirty;
+
+	struct list_head        commit_pending;
+	struct list_head        committing;
+	int                     commit_inflight;
+	int                     commit_err;
+	uint32_t                commit_secs[DD_MAX_OPS];
+	char                   *commit_buf;
+	struct tiocb            commit_tiocb[DD_MAX_OPS];
+
+	struct dd_op            ops[DD_MAX_OPS];
+	int                     n_busy;
+
+	struct {
+		unsigned long long      hits;
+		unsigned long long      stored;
+		unsigned long long      passthru;
+		unsigned long long      forwarded;
+		unsigned long long      cache_hits;
+		unsigned long long      reads;
+		unsigned long long      rmw;
+		unsigned long long      collisions;
+		unsigned long long      busy;
+		unsigned long long      errors;
+	} stats;
+};
+
+static struct list_head dd_stores = LIST_HEAD_INIT(dd_stores);
+
+static void dd_dispatch(td_dedup_t *, td_request_t);
+static void dd_op_store(td_dedup_t *, struct dd_op *);
+static void __dd_index_done(void *, struct tiocb *, int);
+static void __dd_map_done(void *, struct tiocb *, int);
+
+static inline uint64_t
+dd_fingerprint(const char *buf, size_t size)
+{
+	return ((uint64_t)crc32(0L, (const Bytef *)buf, size) << 32) |
+		adler32(1L, (const Bytef *)buf, size);
+}
+
+static inline uint64_t
+dd_slot_offset(struct dd_store *st, uint32_t slot)
+{
+	return st->hdr.data_off + ((uint64_t)slot << st->hdr.chunk_shift);
+}
+
+static uint32_t
+dd_store_header_crc(const struct dd_store_header *hdr)
+{
+	return crc32(0L, (const Bytef *)hdr,
+		     offsetof(struct dd_store_header, crc));
+}
+
+static uint32_t
+dd_map_header_crc(const struct dd_map_header *hdr)
+{
+	return crc32(0L, (const Bytef *)hdr,
+		     offsetof(struct dd_map_header, crc));
+}
+
+static inline int
+dd_env(const char *name, int def)
+{
+	const char *env = getenv(name);
+	return env ? atoi(env) : def;
+}
+
+/*
+ * Slots in use are hashed by fingerprint; free ones are kept on a
+ * list. A slot whose last reference goes while a comparison still
+ * reads it is freed when that is done.
+ */
+static void
+dd_hash_insert(struct dd_store *st, uint32_t slot)
+{
+	struct dd_entry *e = &st->entries[slot];
+	uint32_t *b = &st->buckets[e->fp & st->hash_mask];
+
+	e->next   = *b;
+	e->hashed = 1;
+	*b        = slot + 1;
+}
+
+static void
+dd_hash_remove(struct dd_store *st, uint32_t slot)
+{
+	struct dd_entry *e = &st->entries[slot];
+	uint32_t *p = &st->buckets[e->fp & st->hash_mask];
+
+	while (*p && *p != slot + 1)
+		p = &st->entries[*p - 1].next;
+
+	if (*p)
+		*p = e->next;
+
+	e->next   = 0;
+	e->hashed = 0;
+}
+
+static uint32_t
+dd_hash_find(struct dd_store *st, uint64_t fp)
+{
+	uint32_t n = st->buckets[fp & st->hash_mask];
+
+	while (n && st->entries[n - 1].fp != fp)
+		n = st->entries[n - 1].next;
+
+	return n;
+}
+
+static int64_t
+dd_slot_alloc(struct dd_store *st, uint64_t fp)
+{
+	struct dd_entry *e;
+	uint32_t slot;
+
+	if (!st->free_head)
+		return -ENOSPC;
+
+	slot          = st->free_head - 1;
+	e             = &st->entries[slot];
+	st->free_head = e->next;
+
+	e->fp   = fp;
+	e->refs = 1;
+	e->next = 0;
+	e->used = 1;
+	st->n_used++;
+
+	return slot;
+}
+
+static void
+dd_slot_release(struct dd_store *st, uint32_t slot)
+{
+	struct dd_entry *e = &st->entries[slot];
+
+	e->used       = 0;
+	e->next       = st->free_head;
+	st->free_head = slot + 1;
+	st->n_used--;
+}
+
+static void
+dd_cache_drop(struct dd_store *st, struct dd_entry *e)
+{
+	struct dd_cblk *c = e->cblk;
+
+	if (!c)
+		return;
+
+	list_del(&c->lru);
+	free(c->buf);
+	free(c);
+	e->cblk = NULL;
+	st->n_cached--;
+}
+
+static struct dd_cblk *
+dd_cache_find(struct dd_store *st, uint32_t slot)
+{
+	struct dd_cblk *c = st->entries[slot].cblk;
+
+	if (c)
+		list_move(&c->lru, &st->lru);
+
+	return c;
+}
+
+static void
+dd_cache_put(struct dd_store *st, uint32_t slot, const char *buf)
+{
+	struct dd_entry *e = &st->entries[slot];
+	struct dd_cblk *c = e->cblk;
+
+	if (c) {
+		list_move(&c->lru, &st->lru);
+		return;
+	}
+
+	if (!st->max_cached)
+		return;
+
+	if (st->n_cached >= st->max_cached) {
+		c = list_entry(st->lru.prev, struct dd_cblk, lru);
+		list_del(&c->lru);
+		st->entries[c->slot].cblk = NULL;
+		st->n_cached--;
+	} else {
+		c = calloc(1, sizeof(*c));
+		if (!c)
+			return;
+
+		if (posix_memalign((void **)&c->buf, 4096, st->chunk_size)) {
+			free(c);
+			return;
+		}
+	}
+
+	memcpy(c->buf, buf, st->chunk_size);
+	c->slot = slot;
+	e->cblk = c;
+	list_add(&c->lru, &st->lru);
+	st->n_cached++;
+}
+
+static void
+dd_index_dirty(struct dd_store *st, uint32_t slot)
+{
+	struct dd_entry *e = &st->entries[slot];
+	uint64_t sec = slot / DD_SLOTS_PER_SEC;
+
+	st->index[slot].fp   = e->refs ? e->fp : 0;
+	st->index[slot].refs = e->refs;
+
+	if (st->index_dirty[sec])
+		return;
+
+	st->index_dirty[sec]     = 1;
+	st->dirty[st->n_dirty++] = sec;
+}
+
+static void
+dd_slot_get(struct dd_store *st, uint32_t slot)
+{
+	st->entries[slot].refs++;
+	dd_index_dirty(st, slot);
+}
+
+static void
+dd_slot_put(struct dd_store *st, uint32_t slot)
+{
+	struct dd_entry *e = &st->entries[slot];
+
+	if (--e->refs) {
+		dd_index_dirty(st, slot);
+		return;
+	}
+
+	dd_index_dirty(st, slot);
+	if (e->hashed)
+		dd_hash_remove(st, slot);
+	dd_cache_drop(st, e);
+
+	if (!e->pins)
+		dd_slot_release(st, slot);
+}
+
+static void
+dd_slot_pin(struct dd_store *st, uint32_t slot)
+{
+	st->entries[slot].pins++;
+}
+
+static void
+dd_slot_unpin(struct dd_store *st, uint32_t slot)
+{
+	struct dd_entry *e = &st->entries[slot];
+
+	if (!--e->pins && !e->refs && e->used)
+		dd_slot_release(st, slot);
+}
+
+static int
+dd_store_commit_reserve(struct dd_store *st, uint64_t n)
+{
+	struct tiocb *tiocbs;
+	uint32_t *secs;
+	char *buf;
+
+	if (n <= st->commit_max)
+		return 0;
+
+	n = DD_ALIGN(n, 64);
+
+	if (posix_memalign((void **)&buf, 4096, n << SECTOR_SHIFT))
+		return -ENOMEM;
+
+	secs   = realloc(st->commit_secs, n * sizeof(*secs));
+	if (secs)
+		st->commit_secs = secs;
+	tiocbs = realloc(st->commit_tiocb, n * sizeof(*tiocbs));
+	if (tiocbs)
+		st->commit_tiocb = tiocbs;
+
+	if (!secs || !tiocbs) {
+		free(buf);
+		return -ENOMEM;
+	}
+
+	free(st->commit_buf);
+	st->commit_buf = buf;
+	st->commit_max = n;
+
+	return 0;
+}
+
+/*
+ * Index sectors are committed in rounds, like the maps: reference
+ * changes made while one round is in flight go out with the next.
+ */
+static void
+dd_store_kick(struct dd_store *st, td_driver_t *driver)
+{
+	uint64_t i, n;
+	uint32_t sec;
+
+	if (st->commit_inflight || !st->n_dirty)
+		return;
+
+	if (dd_store_commit_reserve(st, st->n_dirty)) {
+		ERR(-ENOMEM, "%s: no memory for an index update\n", st->name);
+		return;
+	}
+
+	list_splice_tail(&st->commit_pending, &st->committing);
+	INIT_LIST_HEAD(&st->commit_pending);
+
+	n = st->n_dirty;
+	st->n_dirty         = 0;
+	st->commit_inflight = n;
+	st->commit_round    = n;
+	st->commit_driver   = driver;
+
+	for (i = 0; i < n; i++) {
+		sec = st->dirty[i];
+		st->index_dirty[sec] = 0;
+		st->commit_secs[i]   = sec;
+
+		memcpy(st->commit_buf + (i << SECTOR_SHIFT),
+		       (char *)st->index + ((uint64_t)sec << SECTOR_SHIFT),
+		       SECTOR_SIZE);
+	}
+
+	for (i = 0; i < n; i++)
+		td_prep_write(driver, &st->commit_tiocb[i], st->fd,
+			      st->commit_buf + (i << SECTOR_SHIFT),
+			      SECTOR_SIZE,
+			      st->hdr.index_off +
+			      ((uint64_t)st->commit_secs[i] << SECTOR_SHIFT),
+			      __dd_index_done, st);
+
+	for (i = 0; i < n; i++)
+		td_queue_tiocb(driver, &st->commit_tiocb[i]);
+}
+
+static void
+dd_store_commit(struct dd_store *st, struct dd_op *op, dd_commit_cb_t cb)
+{
+	op->committed = cb;
+	list_add_tail(&op->commit, &st->commit_pending);
+	dd_store_kick(st, op->s->driver);
+}
+
+static void
+__dd_index_done(void *arg, struct tiocb *tiocb, int err)
+{
+	struct dd_store *st = arg;
+	struct list_head done;
+	struct dd_op *op, *tmp;
+	uint64_t i;
+
+	if (err)
+		st->commit_err = st->commit_err ? : err;
+
+	if (--st->commit_inflight)
+		return;
+
+	err = st->commit_err;
+	st->commit_err = 0;
+
+	if (err) {
+		ERR(err, "%s: index update failed\n", st->name);
+
+		/* written again next round */
+		for (i = 0; i < st->commit_round; i++) {
+			uint32_t sec = st->commit_secs[i];
+
+			if (!st->index_dirty[sec]) {
+				st->index_dirty[sec]     = 1;
+				st->dirty[st->n_dirty++] = sec;
+			}
+		}
+	}
+
+	INIT_LIST_HEAD(&done);
+	list_splice_tail(&st->committing, &done);
+	INIT_LIST_HEAD(&st->committing);
+
+	list_for_each_entry_safe(op, tmp, &done, commit) {
+		list_del_init(&op->commit);
+		op->committed(op->s, op, err);
+	}
+
+	dd_store_kick(st, st->commit_driver);
+}
+
+static void
+dd_map_kick(td_dedup_t *s)
+{
+	struct tiocb *tiocb;
+	uint32_t sec;
+	int i, n;
+
+	if (s->commit_inflight || !s->n_dirty)
+		return;
+
+	list_splice_tail(&s->commit_pending, &s->committing);
+	INIT_LIST_HEAD(&s->commit_pending);
+
+	n = s->n_dirty;
+	s->n_dirty = 0;
+	s->commit_inflight = n;
+
+	for (i = 0; i < n; i++) {
+		sec = s->dirty[i];
+		s->map_dirty[sec] = 0;
+		s->commit_secs[i] = sec;
+
+		memcpy(s->commit_buf + ((size_t)i << SECTOR_SHIFT),
+		       (char *)s->map + ((size_t)sec << SECTOR_SHIFT),
+		       SECTOR_SIZE);
+	}
+
+	for (i = 0; i < n; i++) {
+		tiocb = &s->commit_tiocb[i];
+		td_prep_write(s->driver, tiocb, s->fd,
+			      s->commit_buf + ((size_t)i << SECTOR_SHIFT),
+			      SECTOR_SIZE,
+			      s->hdr.map_off +
+			      ((uint64_t)s->commit_secs[i] << SECTOR_SHIFT),
+			      __dd_map_done, s);
+	}
+
+	for (i = 0; i < n; i++)
+		td_queue_tiocb(s->driver, &s->commit_tiocb[i]);
+}
+
+static void
+dd_map_set(td_dedup_t *s, uint64_t chunk, uint32_t e)
+{
+	uint32_t sec = chunk / DD_MAP_PER_SEC;
+
+	s->n_mapped += !!e - !!s->map[chunk];
+	s->map[chunk] = e;
+
+	if (s->map_dirty[sec])
+		return;
+
+	s->map_dirty[sec]      = 1;
+	s->dirty[s->n_dirty++] = sec;
+}
+
+static void
+dd_map_commit(td_dedup_t *s, struct dd_op *op, dd_commit_cb_t cb)
+{
+	dd_map_set(s, op->chunk, op->new);
+
+	op->committed = cb;
+	list_add_tail(&op->commit, &s->commit_pending);
+	dd_map_kick(s);
+}
+
+static void
+__dd_map_done(void *arg, struct tiocb *tiocb, int err)
+{
+	td_dedup_t *s = arg;
+	struct dd_op *op, *tmp;
+	struct list_head done;
+
+	if (err)
+		s->commit_err = s->commit_err ? : err;
+
+	if (--s->commit_inflight)
+		return;
+
+	err = s->commit_err;
+	s->commit_err = 0;
+
+	if (err)
+		ERR(err, "%s: map update failed\n", s->name);
+
+	INIT_LIST_HEAD(&done);
+	list_splice_tail(&s->committing, &done);
+	INIT_LIST_HEAD(&s->committing);
+
+	list_for_each_entry_safe(op, tmp, &done, commit) {
+		list_del_init(&op->commit);
+		op->committed(s, op, err);
+	}
+
+	dd_map_kick(s);
+	dd_store_kick(s->store, s->driver);
+}
+
+static struct dd_op *
+dd_find_op(td_dedup_t *s, uint64_t chunk)
+{
+	int i;
+
+	if (!s->n_busy)
+		return NULL;
+
+	for (i = 0; i < DD_MAX_OPS; i++)
+		if (s->ops[i].busy && s->ops[i].chunk == chunk)
+			return &s->ops[i];
+
+	return NULL;
+}
+
+static struct dd_op *
+dd_get_op(td_dedup_t *s, td_request_t treq)
+{
+	size_t size = s->store->chunk_size;
+	struct dd_op *op = NULL;
+	int i;
+
+	for (i = 0; i < DD_MAX_OPS; i++)
+		if (!s->ops[i].busy) {
+			op = &s->ops[i];
+			break;
+		}
+
+	if (!op)
+		return NULL;
+
+	if (!op->buf && posix_memalign((void **)&op->buf, 4096, size)) {
+		op->buf = NULL;
+		return NULL;
+	}
+
+	if (!op->vbuf && posix_memalign((void **)&op->vbuf, 4096, size)) {
+		op->vbuf = NULL;
+		return NULL;
+	}
+
+	op->s      = s;
+	op->busy   = 1;
+	op->chunk  = treq.sec >> s->chunk_shift;
+	op->treq   = treq;
+	op->old    = s->map[op->chunk];
+	op->new    = 0;
+	op->pinned = 0;
+	op->err    = 0;
+	INIT_LIST_HEAD(&op->waiters);
+	INIT_LIST_HEAD(&op->commit);
+	s->n_busy++;
+
+	return op;
+}
+
+static void
+dd_put_op(td_dedup_t *s, struct dd_op *op)
+{
+	struct dd_waiter *w, *tmp;
+	struct list_head waiters;
+
+	INIT_LIST_HEAD(&waiters);
+	list_splice_tail(&op->waiters, &waiters);
+	INIT_LIST_HEAD(&op->waiters);
+	op->busy = 0;
+	s->n_busy--;
+
+	list_for_each_entry_safe(w, tmp, &waiters, next) {
+		list_del(&w->next);
+		dd_dispatch(s, w->treq);
+		free(w);
+	}
+}
+
+static void
+dd_op_done(td_dedup_t *s, struct dd_op *op, int err)
+{
+	if (err)
+		s->stats.errors++;
+
+	td_complete_request(op->treq, err);
+	dd_put_op(s, op);
+}
+
+/*
+ * The map no longer points at the old copy: let go of it.
+ */
+static void
+__dd_op_mapped(td_dedup_t *s, struct dd_op *op, int err)
+{
+	struct dd_store *st = s->store;
+
+	if (err) {
+		/*
+		 * Back to the old copy, rewritten next round. The new one
+		 * may be on disk all the same, and keeps its reference.
+		 */
+		dd_map_set(s, op->chunk, op->old);
+	} else if (op->old)
+		dd_slot_put(st, op->old - 1);
+
+	dd_op_done(s, op, err);
+}
+
+/*
+ * The store holds a reference for the chunk: point the map at it.
+ */
+static void
+__dd_op_indexed(td_dedup_t *s, struct dd_op *op, int err)
+{
+	struct dd_store *st = s->store;
+	uint32_t slot = op->new - 1;
+
+	if (err) {
+		dd_slot_put(st, slot);
+		dd_op_done(s, op, err);
+		return;
+	}
+
+	if (!st->entries[slot].hashed) {
+		dd_hash_insert(st, slot);
+		dd_cache_put(st, slot, op->buf);
+	}
+
+	dd_map_commit(s, op, __dd_op_mapped);
+}
+
+static void
+__dd_slot_written(void *arg, struct tiocb *tiocb, int err)
+{
+	struct dd_op *op = arg;
+	td_dedup_t *s = op->s;
+	struct dd_store *st = s->store;
+	uint32_t slot = op->new - 1;
+
+	if (err) {
+		dd_slot_put(st, slot);
+		dd_op_done(s, op, err);
+		return;
+	}
+
+	dd_index_dirty(st, slot);
+	dd_store_commit(st, op, __dd_op_indexed);
+}
+
+static void
+__dd_passthru_done(td_request_t clone, int err)
+{
+	struct dd_op *op = clone.cb_data;
+	td_dedup_t *s = op->s;
+
+	if (err)
+		op->err = op->err ? : err;
+
+	op->pending -= clone.secs;
+	if (op->pending)
+		return;
+
+	if (op->err || !op->old) {
+		dd_op_done(s, op, op->err);
+		return;
+	}
+
+	op->new = 0;
+	dd_map_commit(s, op, __dd_op_mapped);
+}
+
+/*
+ * The store is full: the chunk goes to the image below, and the map
+ * lets go of any stored copy once it is there.
+ */
+static void
+dd_op_passthru(td_dedup_t *s, struct dd_op *op)
+{
+	td_request_t clone;
+
+	s->stats.passthru++;
+
+	clone         = op->treq;
+	clone.sec     = op->chunk << s->chunk_shift;
+	clone.secs    = s->chunk_secs;
+	clone.buf     = op->buf;
+	clone.cb      = __dd_passthru_done;
+	clone.cb_data = op;
+
+	op->pending   = clone.secs;
+	td_forward_request(clone);
+}
+
+static void
+dd_op_hit(td_dedup_t *s, struct dd_op *op, uint32_t slot)
+{
+	struct dd_store *st = s->store;
+
+	s->stats.hits++;
+
+	if (slot + 1 == op->old) {
+		dd_op_done(s, op, 0);
+		return;
+	}
+
+	op->new = slot + 1;
+	dd_slot_get(st, slot);
+	dd_store_commit(st, op, __dd_op_indexed);
+}
+
+static void
+dd_op_miss(td_dedup_t *s, struct dd_op *op)
+{
+	struct dd_store *st = s->store;
+	int64_t slot;
+
+	slot = dd_slot_alloc(st, op->fp);
+	if (slot < 0) {
+		dd_op_passthru(s, op);
+		return;
+	}
+
+	s->stats.stored++;
+	op->new = slot + 1;
+
+	td_prep_write(s->driver, &op->tiocb, st->fd, op->buf,
+		      st->chunk_size, dd_slot_offset(st, slot),
+		      __dd_slot_written, op);
+	td_queue_tiocb(s->driver, &op->tiocb);
+}
+
+static void
+__dd_compare_read(void *arg, struct tiocb *tiocb, int err)
+{
+	struct dd_op *op = arg;
+	td_dedup_t *s = op->s;
+	struct dd_store *st = s->store;
+	uint32_t slot = op->pinned - 1;
+	struct dd_entry *e = &st->entries[slot];
+	int same;
+
+	same = !err && e->refs && e->fp == op->fp &&
+		!memcmp(op->buf, op->vbuf, st->chunk_size);
+
+	if (!err && e->refs && !same)
+		s->stats.collisions++;
+
+	op->pinned = 0;
+	dd_slot_unpin(st, slot);
+
+	if (same) {
+		dd_cache_put(st, slot, op->vbuf);
+		dd_op_hit(s, op, slot);
+	} else
+		dd_op_miss(s, op);
+}
+
+/*
+ * Stores the whole chunk in op->buf, by reference if the store has it
+ * already.
+ */
+static void
+dd_op_store(td_dedup_t *s, struct dd_op *op)
+{
+	struct dd_store *st = s->store;
+	struct dd_cblk *c;
+	uint32_t n;
+
+	op->fp = dd_fingerprint(op->buf, st->chunk_size);
+
+	n = dd_hash_find(st, op->fp);
+	if (!n) {
+		dd_op_miss(s, op);
+		return;
+	}
+
+	c = dd_cache_find(st, n - 1);
+	if (c) {
+		if (!memcmp(op->buf, c->buf, st->chunk_size)) {
+			dd_op_hit(s, op, n - 1);
+			return;
+		}
+
+		s->stats.collisions++;
+		dd_op_miss(s, op);
+		return;
+	}
+
+	op->pinned = n;
+	dd_slot_pin(st, n - 1);
+
+	td_prep_read(s->driver, &op->tiocb, st->fd, op->vbuf,
+		     st->chunk_size, dd_slot_offset(st, n - 1),
+		     __dd_compare_read, op);
+	td_queue_tiocb(s->driver, &op->tiocb);
+}
+
+/*
+ * The op's stored chunk is in op->buf: serve a read, or merge a write
+ * in and store the result.
+ */
+static void
+dd_op_loaded(td_dedup_t *s, struct dd_op *op)
+{
+	td_request_t *treq = &op->treq;
+	size_t off;
+
+	off = (size_t)(treq->sec - (op->chunk << s->chunk_shift))
+		<< SECTOR_SHIFT;
+
+	if (treq->op == TD_OP_WRITE) {
+		memcpy(op->buf + off, treq->buf,
+		       (size_t)treq->secs << SECTOR_SHIFT);
+		dd_op_store(s, op);
+		return;
+	}
+
+	memcpy(treq->buf, op->buf + off, (size_t)treq->secs << SECTOR_SHIFT);
+	dd_op_done(s, op, 0);
+}
+
+static void
+__dd_chunk_read(void *arg, struct tiocb *tiocb, int err)
+{
+	struct dd_op *op = arg;
+	td_dedup_t *s = op->s;
+
+	if (err) {
+		dd_op_done(s, op, err);
+		return;
+	}
+
+	dd_cache_put(s->store, op->old - 1, op->buf);
+	dd_op_loaded(s, op);
+}
+
+static void
+dd_op_load(td_dedup_t *s, struct dd_op *op)
+{
+	struct dd_store *st = s->store;
+
+	s->stats.reads++;
+
+	/* the map's reference keeps the slot */
+	td_prep_read(s->driver, &op->tiocb, st->fd, op->buf,
+		     st->chunk_size, dd_slot_offset(st, op->old - 1),
+		     __dd_chunk_read, op);
+	td_queue_tiocb(s->driver, &op->tiocb);
+}
+
+/*
+ * Chunks not in the store, nor busy, pass straight through to the
+ * image below, along with whole chunk writes to the image's tail.
+ */
+static int
+dd_forwardable(td_dedup_t *s, td_request_t treq)
+{
+	uint64_t chunk = treq.sec >> s->chunk_shift;
+
+	if (s->map[chunk] || dd_find_op(s, chunk))
+		return 0;
+
+	if (treq.op != TD_OP_WRITE)
+		return 1;
+
+	return treq.secs != s->chunk_secs ||
+		((chunk + 1) << s->chunk_shift) > s->driver->info.size;
+}
+
+/*
+ * Serves a request within a single chunk.
+ */
+static void
+dd_dispatch(td_dedup_t *s, td_request_t treq)
+{
+	uint64_t chunk = treq.sec >> s->chunk_shift;
+	struct dd_store *st = s->store;
+	struct dd_waiter *w;
+	struct dd_cblk *c;
+	struct dd_op *op;
+	size_t off;
+
+	op = dd_find_op(s, chunk);
+	if (op) {
+		w = malloc(sizeof(*w));
+		if (!w) {
+			td_complete_request(treq, -EBUSY);
+			return;
+		}
+
+		w->treq = treq;
+		list_add_tail(&w->next, &op->waiters);
+		return;
+	}
+
+	if (dd_forwardable(s, treq)) {
+		s->stats.forwarded += treq.secs;
+		td_forward_request(treq);
+		return;
+	}
+
+	if (treq.op == TD_OP_BLOCK_STATUS) {
+		treq.status = TD_BLOCK_STATE_NONE;
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	off = (size_t)(treq.sec - (chunk << s->chunk_shift)) << SECTOR_SHIFT;
+
+	if (treq.op == TD_OP_READ) {
+		c = dd_cache_find(st, s->map[chunk] - 1);
+		if (c) {
+			s->stats.cache_hits++;
+			memcpy(treq.buf, c->buf + off,
+			       (size_t)treq.secs << SECTOR_SHIFT);
+			td_complete_request(treq, 0);
+			return;
+		}
+	}
+
+	op = dd_get_op(s, treq);
+	if (!op) {
+		s->stats.busy++;
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	if (treq.op == TD_OP_WRITE && treq.secs == s->chunk_secs) {
+		memcpy(op->buf, treq.buf, st->chunk_size);
+		dd_op_store(s, op);
+		return;
+	}
+
+	if (treq.op == TD_OP_WRITE) {
+		s->stats.rmw++;
+
+		c = dd_cache_find(st, op->old - 1);
+		if (c) {
+			s->stats.cache_hits++;
+			memcpy(op->buf, c->buf, st->chunk_size);
+			dd_op_loaded(s, op);
+			return;
+		}
+	}
+
+	dd_op_load(s, op);
+}
+
+/*
+ * Splits the request at chunk boundaries, forwarding runs of chunks
+ * the store doesn't hold as one request.
+ */
+static void
+dd_queue_request(td_driver_t *driver, td_request_t treq)
+{
+	td_dedup_t *s = driver->data;
+	td_request_t clone, run;
+	td_sector_t end;
+
+	run.secs = 0;
+
+	while (treq.secs) {
+		end = ((treq.sec >> s->chunk_shift) + 1) << s->chunk_shift;
+
+		clone      = treq;
+		clone.secs = MIN((td_sector_t)treq.secs, end - treq.sec);
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		if (treq.buf)
+			treq.buf += (size_t)clone.secs << SECTOR_SHIFT;
+
+		if (dd_forwardable(s, clone)) {
+			if (run.secs)
+				run.secs += clone.secs;
+			else
+				run = clone;
+			continue;
+		}
+
+		if (run.secs) {
+			s->stats.forwarded += run.secs;
+			td_forward_request(run);
+			run.secs = 0;
+		}
+
+		dd_dispatch(s, clone);
+	}
+
+	if (run.secs) {
+		s->stats.forwarded += run.secs;
+		td_forward_request(run);
+	}
+}
+
+static void
+dd_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	dd_queue_request(driver, treq);
+}
+
+static void
+dd_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	td_dedup_t *s = driver->data;
+
+	if (s->rdonly) {
+		td_complete_request(treq, -EPERM);
+		return;
+	}
+
+	dd_queue_request(driver, treq);
+}
+
+static void
+dd_queue_block_status(td_driver_t *driver, td_request_t treq)
+{
+	dd_queue_request(driver, treq);
+}
+
+static int
+dd_write_header(int fd, const void *hdr, size_t size)
+{
+	char *buf;
+	ssize_t n;
+	int err;
+
+	err = posix_memalign((void **)&buf, 4096, DD_HEADER_SIZE);
+	if (err)
+		return -err;
+
+	memset(buf, 0, DD_HEADER_SIZE);
+	memcpy(buf, hdr, size);
+
+	n   = pwrite(fd, buf, DD_HEADER_SIZE, 0);
+	err = n == DD_HEADER_SIZE ? 0 : n < 0 ? -errno : -EIO;
+	free(buf);
+
+	if (!err && fdatasync(fd))
+		err = -errno;
+
+	return err;
+}
+
+static int
+dd_read_header(int fd, void *hdr, size_t size)
+{
+	char *buf;
+	ssize_t n;
+	int err;
+
+	err = posix_memalign((void **)&buf, 4096, DD_HEADER_SIZE);
+	if (err)
+		return -err;
+
+	n = pread(fd, buf, DD_HEADER_SIZE, 0);
+	if (n == DD_HEADER_SIZE)
+		memcpy(hdr, buf, size);
+	free(buf);
+
+	if (n < 0)
+		return -errno;
+
+	return n;
+}
+
+static int
+dd_open_file(const char *name, int rdonly)
+{
+	int fd, o_flags;
+
+	o_flags = O_DIRECT | O_LARGEFILE |
+		(rdonly ? O_RDONLY : O_RDWR | O_CREAT);
+
+	fd = open(name, o_flags, 0600);
+	if (fd == -1 && errno == EINVAL) {
+		/* Maybe O_DIRECT isn't supported. */
+		o_flags &= ~O_DIRECT;
+		fd = open(name, o_flags, 0600);
+	}
+
+	return fd == -1 ? -errno : fd;
+}
+
+static int
+dd_store_format(struct dd_store *st)
+{
+	struct dd_store_header *hdr = &st->hdr;
+	int shift, chunk_kb, store_mb, err;
+	struct timeval tv;
+	uint64_t slots;
+
+	chunk_kb = dd_env("TAPDISK_DEDUP_CHUNK_KB", DD_DEFAULT_CHUNK_KB);
+	store_mb = dd_env("TAPDISK_DEDUP_STORE_MB", DD_DEFAULT_STORE_MB);
+
+	shift = ffs(chunk_kb) - 1 + 10;
+	if (chunk_kb <= 0 || (chunk_kb & (chunk_kb - 1)) ||
+	    shift < DD_MIN_CHUNK_SHIFT || shift > DD_MAX_CHUNK_SHIFT) {
+		ERR(-EINVAL, "%s: bad chunk size %dKiB\n", st->name, chunk_kb);
+		return -EINVAL;
+	}
+
+	slots = ((uint64_t)(store_mb > 0 ? store_mb : 0) << 20) >> shift;
+	if (!slots || slots >= UINT32_MAX) {
+		ERR(-EINVAL, "%s: bad store size %dMiB\n", st->name, store_mb);
+		return -EINVAL;
+	}
+
+	gettimeofday(&tv, NULL);
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic       = DD_STORE_MAGIC;
+	hdr->version     = DD_VERSION;
+	hdr->chunk_shift = shift;
+	hdr->id          = ((uint64_t)tv.tv_sec << 32) ^ tv.tv_usec ^
+		((uint64_t)getpid() << 16);
+	hdr->slots       = slots;
+	hdr->index_off   = DD_HEADER_SIZE;
+	hdr->data_off    = hdr->index_off +
+		DD_ALIGN(slots * sizeof(struct dd_slot), 4096);
+	hdr->crc         = dd_store_header_crc(hdr);
+
+	if (ftruncate(st->fd, hdr->data_off))
+		return -errno;
+
+	err = dd_write_header(st->fd, hdr, sizeof(*hdr));
+	if (err)
+		return err;
+
+	INFO("%s: formatted, %"PRIu64" chunks of %dKiB\n",
+	     st->name, slots, chunk_kb);
+
+	return 0;
+}
+
+static int
+dd_store_load(struct dd_store *st)
+{
+	struct dd_store_header *hdr = &st->hdr;
+	uint64_t i, bytes, size;
+	struct dd_entry *e;
+	ssize_t n;
+	int err;
+
+	if (hdr->magic != DD_STORE_MAGIC || hdr->version != DD_VERSION ||
+	    hdr->crc != dd_store_header_crc(hdr) ||
+	    hdr->chunk_shift < DD_MIN_CHUNK_SHIFT ||
+	    hdr->chunk_shift > DD_MAX_CHUNK_SHIFT ||
+	    !hdr->slots || hdr->slots >= UINT32_MAX ||
+	    hdr->index_off < DD_HEADER_SIZE ||
+	    hdr->data_off < hdr->index_off +
+	    hdr->slots * sizeof(struct dd_slot)) {
+		ERR(-EINVAL, "%s: not a valid store\n", st->name);
+		return -EINVAL;
+	}
+
+	st->chunk_size = (size_t)1 << hdr->chunk_shift;
+	st->n_slots    = hdr->slots;
+
+	bytes = DD_ALIGN(st->n_slots * sizeof(struct dd_slot), 4096);
+	err = posix_memalign((void **)&st->index, 4096, bytes);
+	if (err) {
+		st->index = NULL;
+		return -err;
+	}
+
+	n = pread(st->fd, st->index, bytes, hdr->index_off);
+	if (n != bytes)
+		return n < 0 ? -errno : -EIO;
+
+	st->index_secs  = bytes >> SECTOR_SHIFT;
+	st->index_dirty = calloc(st->index_secs, 1);
+	st->dirty       = calloc(st->index_secs, sizeof(uint32_t));
+	st->entries     = calloc(st->n_slots, sizeof(struct dd_entry));
+
+	for (size = 1024; size < st->n_slots; size <<= 1)
+		;
+	st->buckets   = calloc(size, sizeof(uint32_t));
+	st->hash_mask = size - 1;
+
+	if (!st->index_dirty || !st->dirty || !st->entries || !st->buckets)
+		return -ENOMEM;
+
+	/* lowest free slots first */
+	for (i = st->n_slots; i-- > 0; ) {
+		e = &st->entries[i];
+
+		if (!st->index[i].refs) {
+			e->next       = st->free_head;
+			st->free_head = i + 1;
+			continue;
+		}
+
+		e->fp   = st->index[i].fp;
+		e->refs = st->index[i].refs;
+		e->used = 1;
+		dd_hash_insert(st, i);
+		st->n_used++;
+	}
+
+	st->max_cached = ((uint64_t)dd_env("TAPDISK_DEDUP_CACHE_MB",
+					   DD_DEFAULT_CACHE_MB) << 20) >>
+		hdr->chunk_shift;
+
+	return 0;
+}
+
+/*
+ * Writes back reference changes no round took along.
+ */
+static void
+dd_store_sync(struct dd_store *st)
+{
+	uint64_t i;
+	uint32_t sec;
+	ssize_t n;
+
+	for (i = 0; i < st->n_dirty; i++) {
+		sec = st->dirty[i];
+		st->index_dirty[sec] = 0;
+
+		n = pwrite(st->fd,
+			   (char *)st->index + ((uint64_t)sec << SECTOR_SHIFT),
+			   SECTOR_SIZE,
+			   st->hdr.index_off + ((uint64_t)sec << SECTOR_SHIFT));
+		if (n != SECTOR_SIZE)
+			ERR(n < 0 ? -errno : -EIO,
+			    "%s: index update failed\n", st->name);
+	}
+
+	st->n_dirty = 0;
+}
+
+static void
+dd_store_put(struct dd_store *st)
+{
+	struct dd_cblk *c, *tmp;
+
+	if (--st->users)
+		return;
+
+	if (!st->commit_inflight)
+		dd_store_sync(st);
+
+	list_for_each_entry_safe(c, tmp, &st->lru, lru) {
+		list_del(&c->lru);
+		free(c->buf);
+		free(c);
+	}
+
+	if (!list_empty(&st->next))
+		list_del(&st->next);
+
+	if (st->fd >= 0)
+		close(st->fd);
+
+	free(st->commit_tiocb);
+	free(st->commit_secs);
+	free(st->commit_buf);
+	free(st->buckets);
+	free(st->entries);
+	free(st->dirty);
+	free(st->index_dirty);
+	free(st->index);
+	free(st->name);
+	free(st);
+}
+
+/*
+ * One store per file in the process, whatever name it goes by.
+ */
+static int
+dd_store_get(const char *name, struct dd_store **_st)
+{
+	struct dd_store *st;
+	struct stat sb;
+	int err;
+
+	*_st = NULL;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&st->next);
+	INIT_LIST_HEAD(&st->commit_pending);
+	INIT_LIST_HEAD(&st->committing);
+	INIT_LIST_HEAD(&st->lru);
+	st->users = 1;
+
+	st->fd = dd_open_file(name, 0);
+	if (st->fd < 0) {
+		err = st->fd;
+		ERR(err, "%s: failed to open store\n", name);
+		goto fail;
+	}
+
+	if (fstat(st->fd, &sb)) {
+		err = -errno;
+		goto fail;
+	}
+
+	list_for_each_entry(*_st, &dd_stores, next) {
+		struct stat ob;
+
+		if (!fstat((*_st)->fd, &ob) &&
+		    ob.st_dev == sb.st_dev && ob.st_ino == sb.st_ino) {
+			(*_st)->users++;
+			dd_store_put(st);
+			return 0;
+		}
+	}
+	*_st = NULL;
+
+	st->name = strdup(name);
+	if (!st->name) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	if (flock(st->fd, LOCK_EX | LOCK_NB)) {
+		err = -errno;
+		ERR(err, "%s: store in use by another process\n", name);
+		goto fail;
+	}
+
+	if (!sb.st_size) {
+		err = dd_store_format(st);
+		if (err)
+			goto fail;
+	} else {
+		err = dd_read_header(st->fd, &st->hdr, sizeof(st->hdr));
+		if (err < 0)
+			goto fail;
+	}
+
+	err = dd_store_load(st);
+	if (err)
+		goto fail;
+
+	list_add(&st->next, &dd_stores);
+
+	INFO("%s: %"PRIu64" of %"PRIu64" chunks in use\n",
+	     st->name, st->n_used, st->n_slots);
+
+	*_st = st;
+	return 0;
+
+fail:
+	dd_store_put(st);
+	return err;
+}
+
+static int
+dd_store_name(td_dedup_t *s, char *path, size_t size)
+{
+	const char *env = getenv("TAPDISK_DEDUP_STORE");
+	char *copy;
+
+	if (env) {
+		snprintf(path, size, "%s", env);
+		return 0;
+	}
+
+	copy = strdup(s->name);
+	if (!copy)
+		return -ENOMEM;
+
+	snprintf(path, size, "%s/%s", dirname(copy), DD_STORE_FILE);
+	free(copy);
+
+	return 0;
+}
+
+static void
+dd_map_sync(td_dedup_t *s)
+{
+	uint32_t sec;
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < s->n_dirty; i++) {
+		sec = s->dirty[i];
+		s->map_dirty[sec] = 0;
+
+		n = pwrite(s->fd,
+			   (char *)s->map + ((uint64_t)sec << SECTOR_SHIFT),
+			   SECTOR_SIZE,
+			   s->hdr.map_off + ((uint64_t)sec << SECTOR_SHIFT));
+		if (n != SECTOR_SIZE)
+			ERR(n < 0 ? -errno : -EIO,
+			    "%s: map update failed\n", s->name);
+	}
+
+	s->n_dirty = 0;
+}
+
+static int
+dd_close(td_driver_t *driver)
+{
+	td_dedup_t *s = driver->data;
+	int i;
+
+	if (s->map && !s->commit_inflight)
+		dd_map_sync(s);
+
+	for (i = 0; i < DD_MAX_OPS; i++) {
+		free(s->ops[i].buf);
+		free(s->ops[i].vbuf);
+		s->ops[i].buf  = NULL;
+		s->ops[i].vbuf = NULL;
+	}
+
+	if (s->store)
+		dd_store_put(s->store);
+	s->store = NULL;
+
+	if (s->fd >= 0)
+		close(s->fd);
+	s->fd = -1;
+
+	free(s->map);
+	s->map = NULL;
+	free(s->map_dirty);
+	s->map_dirty = NULL;
+	free(s->commit_buf);
+	s->commit_buf = NULL;
+	free(s->name);
+	s->name = NULL;
+
+	return 0;
+}
+
+static int
+dd_open(td_driver_t *driver, const char *name,
+	struct td_vbd_encryption *encryption, td_flag_t flags)
+{
+	td_dedup_t *s = driver->data;
+	char path[PATH_MAX];
+	int err;
+
+	memset(s, 0, sizeof(*s));
+	s->driver = driver;
+	s->fd     = -1;
+	s->rdonly = !!(flags & TD_OPEN_RDONLY);
+	INIT_LIST_HEAD(&s->commit_pending);
+	INIT_LIST_HEAD(&s->committing);
+
+	s->name = strdup(name);
+	if (!s->name) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = posix_memalign((void **)&s->commit_buf, 4096,
+			     DD_MAX_OPS << SECTOR_SHIFT);
+	if (err) {
+		s->commit_buf = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	s->fd = dd_open_file(name, s->rdonly);
+	if (s->fd < 0) {
+		err = s->fd;
+		ERR(err, "%s: failed to open map\n", name);
+		goto fail;
+	}
+
+	err = dd_store_name(s, path, sizeof(path));
+	if (err)
+		goto fail;
+
+	err = dd_store_get(path, &s->store);
+	if (err)
+		goto fail;
+
+	err = dd_read_header(s->fd, &s->hdr, sizeof(s->hdr));
+	if (err < 0)
+		goto fail;
+
+	if (err) {
+		if (err != DD_HEADER_SIZE ||
+		    s->hdr.magic != DD_MAP_MAGIC ||
+		    s->hdr.version != DD_VERSION ||
+		    s->hdr.crc != dd_map_header_crc(&s->hdr) ||
+		    s->hdr.map_off < DD_HEADER_SIZE) {
+			ERR(-EINVAL, "%s: not a valid map\n", name);
+			err = -EINVAL;
+			goto fail;
+		}
+
+		if (s->hdr.store_id != s->store->hdr.id ||
+		    s->hdr.chunk_shift != s->store->hdr.chunk_shift) {
+			ERR(-EINVAL, "%s: made for another store than %s\n",
+			    name, s->store->name);
+			err = -EINVAL;
+			goto fail;
+		}
+
+		s->hdr.parent[DD_NAME_MAX - 1] = '\0';
+		s->formatted = 1;
+	} else if (s->rdonly) {
+		ERR(-EINVAL, "%s: empty map opened read-only\n", name);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	s->chunk_shift = s->store->hdr.chunk_shift - SECTOR_SHIFT;
+	s->chunk_secs  = 1 << s->chunk_shift;
+
+	return 0;
+
+fail:
+	dd_close(driver);
+	return err;
+}
+
+static int
+dd_load_map(td_dedup_t *s, uint64_t chunks)
+{
+	struct dd_store *st = s->store;
+	uint64_t i, bytes;
+	ssize_t n;
+	int err;
+
+	free(s->map);
+	free(s->map_dirty);
+	s->map       = NULL;
+	s->map_dirty = NULL;
+	s->n_mapped  = 0;
+
+	bytes = DD_ALIGN(chunks * sizeof(uint32_t), 4096);
+	err = posix_memalign((void **)&s->map, 4096, bytes);
+	if (err) {
+		s->map = NULL;
+		return -err;
+	}
+
+	s->map_dirty = calloc(bytes >> SECTOR_SHIFT, 1);
+	if (!s->map_dirty)
+		return -ENOMEM;
+
+	memset(s->map, 0, bytes);
+	n = pread(s->fd, s->map, bytes, s->hdr.map_off);
+	if (n < 0)
+		return -errno;
+
+	for (i = 0; i < chunks; i++) {
+		if (!s->map[i])
+			continue;
+
+		if (s->map[i] > st->n_slots || !st->entries[s->map[i] - 1].refs) {
+			ERR(-EINVAL, "%s: chunk %"PRIu64" maps to unused "
+			    "slot %u of %s\n", s->name, i, s->map[i] - 1,
+			    st->name);
+			return -EINVAL;
+		}
+
+		s->n_mapped++;
+	}
+
+	s->n_chunks  = chunks;
+	s->map_bytes = bytes;
+
+	return 0;
+}
+
+static int
+dd_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	return -EINVAL;
+}
+
+/*
+ * The map is bound to the image it was made for, as that is where its
+ * chunks are missing from. An empty map is rebound, and one for an
+ * image that grew is extended.
+ */
+static int
+dd_validate_parent(td_driver_t *driver,
+		   td_driver_t *pdriver, td_flag_t flags)
+{
+	td_dedup_t *s = driver->data;
+	struct dd_map_header *hdr = &s->hdr;
+	uint64_t chunks;
+	int same, err;
+
+	if ((tapdisk_disk_types[pdriver->type]->flags & DISK_TYPE_FILTER) ||
+	    pdriver->type == DISK_TYPE_LLPCACHE ||
+	    pdriver->type == DISK_TYPE_LLECACHE) {
+		ERR(-EINVAL, "%s: must be stacked right on an image\n",
+		    s->name);
+		return -EINVAL;
+	}
+
+	chunks = DD_ALIGN(pdriver->info.size, s->chunk_secs) >>
+		s->chunk_shift;
+
+	if (s->formatted) {
+		err = dd_load_map(s, hdr->chunks);
+		if (err)
+			return err;
+
+		same = !strncmp(hdr->parent, pdriver->name, DD_NAME_MAX - 1);
+		if (same && chunks == hdr->chunks)
+			goto out;
+
+		if (s->n_mapped && (!same || chunks < hdr->chunks)) {
+			ERR(-EINVAL, "%s: holds chunks of %s, not %s\n",
+			    s->name, hdr->parent, pdriver->name);
+			return -EINVAL;
+		}
+	}
+
+	if (s->rdonly) {
+		ERR(-EINVAL, "%s: made for %s, opened read-only\n",
+		    s->name, hdr->parent);
+		return -EINVAL;
+	}
+
+	if (!s->n_mapped && ftruncate(s->fd, DD_HEADER_SIZE))
+		return -errno;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic       = DD_MAP_MAGIC;
+	hdr->version     = DD_VERSION;
+	hdr->chunk_shift = s->store->hdr.chunk_shift;
+	hdr->store_id    = s->store->hdr.id;
+	hdr->chunks      = chunks;
+	hdr->map_off     = DD_HEADER_SIZE;
+	snprintf(hdr->parent, sizeof(hdr->parent), "%s", pdriver->name);
+	hdr->crc         = dd_map_header_crc(hdr);
+
+	if (ftruncate(s->fd, hdr->map_off +
+		      DD_ALIGN(chunks * sizeof(uint32_t), 4096)))
+		return -errno;
+
+	err = dd_write_header(s->fd, hdr, sizeof(*hdr));
+	if (err)
+		return err;
+
+	s->formatted = 1;
+
+	err = dd_load_map(s, chunks);
+	if (err)
+		return err;
+
+out:
+	INFO("%s: %"PRIu64" of %"PRIu64" chunks of %s in %s\n",
+	     s->name, s->n_mapped, s->n_chunks, pdriver->name,
+	     s->store->name);
+
+	return 0;
+}
+
+/*
+ * Asked while the VBD quiesces: chunks and reference updates in
+ * flight finish first.
+ */
+static int
+dd_busy(td_driver_t *driver)
+{
+	td_dedup_t *s = driver->data;
+
+	if (!s->store)
+		return 0;
+
+	return s->n_busy || s->commit_inflight || s->store->commit_inflight;
+}
+
+static void
+dd_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_dedup_t *s = driver->data;
+	struct dd_store *store = s->store;
+
+	tapdisk_stats_field(st, "store", "[");
+	tapdisk_stats_val(st, "llu", (unsigned long long)store->n_used);
+	tapdisk_stats_val(st, "llu", (unsigned long long)store->n_slots);
+	tapdisk_stats_val(st, "llu", (unsigned long long)store->n_cached);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "mapped", "llu",
+			    (unsigned long long)s->n_mapped);
+	tapdisk_stats_field(st, "hits", "llu", s->stats.hits);
+	tapdisk_stats_field(st, "stored", "llu", s->stats.stored);
+	tapdisk_stats_field(st, "passthru", "llu", s->stats.passthru);
+	tapdisk_stats_field(st, "forwarded", "llu", s->stats.forwarded);
+	tapdisk_stats_field(st, "cache_hits", "llu", s->stats.cache_hits);
+	tapdisk_stats_field(st, "reads", "llu", s->stats.reads);
+	tapdisk_stats_field(st, "rmw", "llu", s->stats.rmw);
+	tapdisk_stats_field(st, "collisions", "llu", s->stats.collisions);
+	tapdisk_stats_field(st, "busy", "llu", s->stats.busy);
+	tapdisk_stats_field(st, "errors", "llu", s->stats.errors);
+}
+
+struct tap_disk tapdisk_dedup = {
+	.disk_type                  = "tapdisk_dedup",
+	.flags                      = 0,
+	.private_data_size          = sizeof(td_dedup_t),
+	.td_open                    = dd_open,
+	.td_close                   = dd_close,
+	.td_queue_read              = dd_queue_read,
+	.td_queue_write             = dd_queue_write,
+	.td_queue_block_status      = dd_queue_block_status,
+	.td_get_parent_id           = dd_get_parent_id,
+	.td_validate_parent         = dd_validate_parent,
+	.td_stats                   = dd_stats,
+	.td_busy                    = dd_busy,
+};
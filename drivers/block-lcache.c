@@ -278,12 +278,13 @@ lcache_store_read(td_lcache_t *cache, td_lcache_req_t *req)
 	iov->secs    = req->treq.secs;
 
 	vreq         = &req->vreq;
-	vreq->op     = TD_OP_WRITE;
-	vreq->sec    = req->treq.sec;
-	vreq->iov    = iov;
-	vreq->iovcnt = 1;
-	vreq->cb     = __lcache_write_cb;
-	vreq->token  = cache;
+	vreq->op       = TD_OP_WRITE;
+	vreq->sec      = req->treq.sec;
+	vreq->iov      = iov;
+	vreq->iovcnt   = 1;
+	vreq->cb       = __lcache_write_cb;
+	vreq->token    = cache;
+	vreq->io_class = TD_VREQ_CLASS_BG;
 
 	vbd = req->treq.vreq->vbd;
 
@@ -33,12 +33,19 @@
 #endif
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
 
 #include "tapdisk.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
+#include "tapdisk-server.h"
+#include "tapdisk-stats.h"
+#include "tapdisk-dirty.h"
+#include "timeout-math.h"
 
 #define DBG(_f, _a...)  tlog_syslog(TLOG_DBG, _f, ##_a)
 #define INFO(_f, _a...) tlog_syslog(TLOG_INFO, _f, ##_a)
@@ -49,6 +56,63 @@
 #define BUG_ON(_cond)   if (unlikely(_cond)) { td_panic(); }
 #define WARN_ON(_p)     if (unlikely(_cond)) { WARN(_cond); }
 
+#define MIN(a, b)       ((a) < (b) ? (a) : (b))
+
+/*
+ * Recovery of a failed local cache. Writes which went to SHARED only
+ * mark their chunks dirty. After LL_PROBE_DELAY_MIN seconds, dirty
+ * chunks are copied back into LOCAL by a td_copier, read through the
+ * VBD and written at no more than LL_RESYNC_RATE; the first copy
+ * doubles as a probe. A failed copy backs off exponentially, up to
+ * LL_PROBE_DELAY_MAX. Once nothing is left dirty, LOCAL serves reads
+ * again.
+ */
+#define LL_CHUNK_SHIFT       11                /* sectors: 1MiB chunks */
+#define LL_CHUNK_SECS        (1ULL << LL_CHUNK_SHIFT)
+#define LL_TICK_US           100000
+#define LL_PROBE_DELAY_MIN   10                /* seconds */
+#define LL_PROBE_DELAY_MAX   (30 * 60)
+#define LL_RESYNC_RATE       (16ULL << 20)     /* bytes/s */
+
+/*
+ * Modes common to both caches. LLP_* and LLE_* below alias these.
+ */
+enum {
+	LL_LOCAL   = 1,
+	LL_SHARED  = 2,
+	LL_RECOVER = 3,
+};
+
+typedef struct ll_recovery              td_ll_recovery_t;
+
+struct ll_recovery {
+	int                    *mode;
+	td_vbd_t               *vbd;
+	td_image_t             *image;      /* the cache's own image */
+	td_sector_t             size;
+
+	struct td_copier       *copier;     /* chunks LOCAL lacks */
+	struct td_dirty_map     shadow;     /* chunks ever written to
+					     * SHARED, LLE only */
+	int                     use_shadow;
+
+	int                     local_writes;  /* in flight to LOCAL */
+	int                     shared_writes; /* degraded, in flight */
+
+	int                     probe_delay;   /* seconds */
+	struct timeval          probe_at;
+
+	void                  (*write)(td_ll_recovery_t *, td_request_t);
+
+	struct {
+		unsigned long long  degraded;
+		unsigned long long  probes;
+		unsigned long long  recovered;
+		unsigned long long  resynced;   /* sectors */
+		int                 error;
+	} stats;
+};
+
 int ll_write_error(int curr, int error)
 {
 	if (error && (!curr || curr == -ENOSPC))
@@ -66,6 +130,258 @@ void ll_log_switch(int type, int error,
 	     tapdisk_disk_types[shared->type]->name, shared->name);
 }
 
+static const char *ll_mode_names[] = {
+	[LL_LOCAL]   = "local",
+	[LL_SHARED]  = "shared",
+	[LL_RECOVER] = "recover",
+};
+
+static void
+ll_recovery_init(td_ll_recovery_t *rec, int *mode, td_sector_t size,
+		 int shadow, void (*write)(td_ll_recovery_t *, td_request_t))
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->mode        = mode;
+	rec->use_shadow  = shadow;
+	rec->size        = size;
+	rec->probe_delay = LL_PROBE_DELAY_MIN;
+	rec->write       = write;
+}
+
+static void
+ll_recovery_free(td_ll_recovery_t *rec)
+{
+	if (!rec->mode)
+		return;
+
+	td_copier_destroy(rec->copier);
+	rec->copier = NULL;
+	td_dirty_map_free(&rec->shadow);
+}
+
+/*
+ * Chunks a write touches: LOCAL misses them until copied back. Marked
+ * at issue, which keeps recovery from completing under the write, and
+ * again at completion, which makes a copy racing with it go again.
+ */
+static void
+ll_recovery_mark(td_ll_recovery_t *rec, td_sector_t sec, int secs)
+{
+	if (!rec->copier || !secs)
+		return;
+
+	if (rec->shadow.bits)
+		td_dirty_mark(&rec->shadow, sec, secs);
+
+	td_copier_mark(rec->copier, sec, secs);
+}
+
+/*
+ * Whether writes to this range must reach SHARED too, for the LLE
+ * overlay to stay current wherever it holds data.
+ */
+static int
+ll_recovery_shadowed(td_ll_recovery_t *rec, td_sector_t sec, int secs)
+{
+	if (!rec->shadow.bits || !secs)
+		return 0;
+
+	return td_dirty_any(&rec->shadow, sec, secs);
+}
+
+static void
+ll_recovery_backoff(td_ll_recovery_t *rec)
+{
+	struct timeval now, delay;
+
+	gettimeofday(&now, NULL);
+	delay = TV_SECS(rec->probe_delay);
+	TV_ADD(now, delay, rec->probe_at);
+}
+
+static const struct td_copy_ops ll_recovery_ops;
+
+/*
+ * LOCAL failed: fall back to SHARED and schedule a probe. Lacking
+ * memory for the bitmap, stay there, as before recovery existed.
+ */
+static void
+ll_recovery_degrade(td_ll_recovery_t *rec, td_vbd_t *vbd, td_image_t *image,
+		    int error)
+{
+	int err;
+
+	*rec->mode        = LL_SHARED;
+	rec->vbd          = vbd;
+	rec->image        = image;
+	rec->stats.error  = error;
+	rec->stats.degraded++;
+
+	ll_recovery_backoff(rec);
+
+	if (!rec->copier) {
+		/* one copy at a time: a stale one never overtakes a fresh one */
+		rec->copier = td_copier_create(vbd, "llcache", rec->size,
+					       LL_CHUNK_SHIFT, 1, 1,
+					       LL_RESYNC_RATE, LL_TICK_US,
+					       &ll_recovery_ops, rec);
+		if (rec->copier && rec->use_shadow &&
+		    td_dirty_map_init(&rec->shadow, rec->size,
+				      LL_CHUNK_SHIFT)) {
+			td_copier_destroy(rec->copier);
+			rec->copier = NULL;
+		}
+		if (!rec->copier) {
+			WARN("no memory to track %"PRIu64" chunks, "
+			     "staying on shared storage",
+			     (uint64_t)((rec->size + LL_CHUNK_SECS - 1) >>
+					LL_CHUNK_SHIFT));
+			return;
+		}
+	}
+
+	err = td_copier_start(rec->copier);
+	if (err)
+		WARN("failed to schedule recovery: %d", err);
+}
+
+/*
+ * A copy back into LOCAL failed: back to SHARED, and try again later.
+ */
+static void
+ll_recovery_fail(td_ll_recovery_t *rec, int error)
+{
+	if (*rec->mode == LL_RECOVER)
+		WARN("%s: resync failed: %s, retrying in %ds",
+		     rec->image->name, strerror(-error),
+		     MIN(rec->probe_delay * 2, LL_PROBE_DELAY_MAX));
+
+	*rec->mode        = LL_SHARED;
+	rec->stats.error  = error;
+	rec->probe_delay  = MIN(rec->probe_delay * 2, LL_PROBE_DELAY_MAX);
+	ll_recovery_backoff(rec);
+}
+
+static void
+ll_recovery_done(td_ll_recovery_t *rec)
+{
+	INFO("%s: local cache resynced, serving reads locally again\n",
+	     rec->image->name);
+
+	*rec->mode        = LL_LOCAL;
+	rec->probe_delay  = LL_PROBE_DELAY_MIN;
+	rec->stats.error  = 0;
+	rec->stats.recovered++;
+
+	td_copier_stop(rec->copier);
+}
+
+/*
+ * Copies the next dirty chunk back into LOCAL, if the last one is done.
+ */
+static void
+ll_recovery_copy(td_ll_recovery_t *rec)
+{
+	struct td_copier *c = rec->copier;
+
+	if (*rec->mode != LL_RECOVER || c->inflight)
+		return;
+
+	if (!c->map.ndirty) {
+		if (!rec->shared_writes)
+			ll_recovery_done(rec);
+		return;
+	}
+
+	td_copier_issue(c);
+}
+
+static int
+__ll_recovery_write(struct td_copier *c, td_request_t treq)
+{
+	td_ll_recovery_t *rec = c->private;
+
+	if (*rec->mode != LL_RECOVER)
+		return -ECANCELED;
+
+	treq.image = rec->image;
+	rec->write(rec, treq);
+
+	return 0;
+}
+
+static void
+__ll_recovery_done(struct td_copier *c, struct td_copy_chunk *chunk, int error)
+{
+	td_ll_recovery_t *rec = c->private;
+
+	if (error) {
+		if (error != -ECANCELED)
+			ll_recovery_fail(rec, error);
+		return;
+	}
+
+	rec->stats.resynced += chunk->iov.secs;
+	rec->stats.error     = 0;
+
+	ll_recovery_copy(rec);
+}
+
+static void
+__ll_recovery_tick(struct td_copier *c)
+{
+	td_ll_recovery_t *rec = c->private;
+	struct timeval now;
+
+	switch (*rec->mode) {
+	case LL_SHARED:
+		if (rec->local_writes || c->inflight)
+			break;
+
+		gettimeofday(&now, NULL);
+		if (TV_BEFORE(now, rec->probe_at))
+			break;
+
+		INFO("%s: probing local cache, %"PRIu64" chunks to resync\n",
+		     rec->image->name, c->map.ndirty);
+
+		*rec->mode = LL_RECOVER;
+		rec->stats.probes++;
+		/* fall through */
+
+	case LL_RECOVER:
+		ll_recovery_copy(rec);
+		break;
+	}
+}
+
+static const struct td_copy_ops ll_recovery_ops = {
+	.tick  = __ll_recovery_tick,
+	.write = __ll_recovery_write,
+	.done  = __ll_recovery_done,
+};
+
+static int
+ll_recovery_busy(td_ll_recovery_t *rec)
+{
+	return rec->copier && rec->copier->inflight;
+}
+
+static void
+ll_recovery_stats(td_ll_recovery_t *rec, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "mode", "s", ll_mode_names[*rec->mode]);
+	tapdisk_stats_field(st, "dirty", "llu",
+			    rec->copier ? rec->copier->map.ndirty : 0ULL);
+	tapdisk_stats_field(st, "chunk_secs", "llu", LL_CHUNK_SECS);
+	tapdisk_stats_field(st, "degraded", "llu", rec->stats.degraded);
+	tapdisk_stats_field(st, "probes", "llu", rec->stats.probes);
+	tapdisk_stats_field(st, "recovered", "llu", rec->stats.recovered);
+	tapdisk_stats_field(st, "resynced", "llu", rec->stats.resynced);
+	tapdisk_stats_field(st, "probe_delay", "d", rec->probe_delay);
+	tapdisk_stats_field(st, "error", "d", rec->stats.error);
+}
+
 /*
  * LLP: Local leaf persistent cache
  *      -- Persistent write caching in local storage.
@@ -93,7 +409,7 @@ void ll_log_switch(int type, int error,
  *
  */
 enum {
-	LLP_MIRROR = 1,
+	LLP_MIRROR = LL_LOCAL,
 	/*
 	 * LLP_MIRROR:
 	 *
@@ -107,14 +423,24 @@ enum {
 	 * the original issuer.
 	 */
 
-	LLP_SHARED = 2,
+	LLP_SHARED = LL_SHARED,
 	/*
 	 * LLP_SHARED:
 	 *
-	 * Writes are issued to SHARED only. As are reads.
+	 * Writes are issued to SHARED only. As are reads. Written
+	 * chunks are marked dirty.
 	 *
 	 * Failure to write SHARED is irrecoverable.
 	 */
+
+	LLP_RECOVER = LL_RECOVER,
+	/*
+	 * LLP_RECOVER:
+	 *
+	 * As LLP_SHARED, while dirty chunks are copied to LOCAL. The
+	 * driver transitions back to LLP_MIRROR once none are left,
+	 * or to LLP_SHARED if LOCAL fails again.
+	 */
 };
 
 typedef struct llpcache                 td_llpcache_t;
@@ -141,6 +467,7 @@ struct llpcache_request {
 struct llpcache {
 	td_image_t             *local;
 	int                     mode;
+	td_ll_recovery_t        rec;
 
 	td_llpcache_req_t       reqv[TD_LLPCACHE_MAX_REQ];
 	td_llpcache_req_t      *free[TD_LLPCACHE_MAX_REQ];
@@ -180,14 +507,34 @@ __llpcache_write_cb(td_vbd_request_t *vreq, int error,
 	mask = 1U << lvr->target;
 	BUG_ON(!(req->pending & mask))
 
-	if (lvr->target == LOCAL && error == -ENOSPC) {
-		td_image_t *shared =
-			container_of(req->treq.image->next.next,
-				    td_image_t, next);
-		ll_log_switch(DISK_TYPE_LLPCACHE, error,
-			      s->local, shared);
-		s->mode = LLP_SHARED;
-		error = 0;
+	/*
+	 * SHARED holds every write, so whatever LOCAL failed on, it
+	 * only costs a resync.
+	 */
+	if (lvr->target == LOCAL) {
+		s->rec.local_writes--;
+
+		if (error) {
+			if (s->mode == LLP_MIRROR) {
+				td_image_t *shared =
+					container_of(req->treq.image->next.next,
+						     td_image_t, next);
+				ll_log_switch(DISK_TYPE_LLPCACHE, error,
+					      s->local, shared);
+				ll_recovery_degrade(&s->rec,
+						    req->treq.vreq->vbd,
+						    req->treq.image, error);
+			}
+
+			ll_recovery_mark(&s->rec, req->treq.sec,
+					 req->treq.secs);
+			error = 0;
+		}
+	}
+
+	if (lvr->target == SHARED && req->mode != LLP_MIRROR) {
+		ll_recovery_mark(&s->rec, req->treq.sec, req->treq.secs);
+		s->rec.shared_writes--;
 	}
 
 	req->pending &= ~mask;
@@ -219,16 +566,17 @@ llpcache_requeue_treq(td_llpcache_t *s, td_llpcache_req_t *req, int target)
 	td_vbd_request_t *vreq;
 	int err;
 
-	lvr           = &req->lvr[target];
-	lvr->target   = target;
+	lvr            = &req->lvr[target];
+	lvr->target    = target;
 
-	vreq          = &lvr->vreq;
-	vreq->op      = TD_OP_WRITE;
-	vreq->sec     = req->treq.sec;
-	vreq->iov     = &req->iov;
-	vreq->iovcnt  = 1;
-	vreq->cb      = __llpcache_write_cb;
-	vreq->token   = s;
+	vreq           = &lvr->vreq;
+	vreq->op       = TD_OP_WRITE;
+	vreq->sec      = req->treq.sec;
+	vreq->iov      = &req->iov;
+	vreq->iovcnt   = 1;
+	vreq->cb       = __llpcache_write_cb;
+	vreq->token    = s;
+	vreq->io_class = TD_VREQ_CLASS_FG;
 
 	err = tapdisk_vbd_queue_request(req->treq.vreq->vbd, vreq);
 	if (err)
@@ -258,19 +606,27 @@ llpcache_fork_write(td_llpcache_t *s, td_request_t treq)
 	memset(req, 0, sizeof(td_llpcache_req_t));
 
 	req->treq     = treq;
+	req->mode     = s->mode;
 
 	iov           = &req->iov;
 	iov->base     = treq.buf;
 	iov->secs     = treq.secs;
 
-	err = llpcache_requeue_treq(s, req, LOCAL);
-	if (err)
-		goto fail;
+	if (req->mode == LLP_MIRROR) {
+		err = llpcache_requeue_treq(s, req, LOCAL);
+		if (err)
+			goto fail;
+		s->rec.local_writes++;
+	} else
+		ll_recovery_mark(&s->rec, treq.sec, treq.secs);
 
 	err = llpcache_requeue_treq(s, req, SHARED);
 	if (err)
 		goto fail;
 
+	if (req->mode != LLP_MIRROR)
+		s->rec.shared_writes++;
+
 	return;
 
 fail:
@@ -321,17 +677,29 @@ llpcache_queue_read(td_driver_t *driver, td_request_t treq)
 		td_queue_read(s->local, treq);
 		break;
 	case LLP_SHARED:
+	case LLP_RECOVER:
 		td_forward_request(treq);
+		break;
 	default:
 		BUG();
 	}
 }
 
+static void
+llpcache_recovery_write(td_ll_recovery_t *rec, td_request_t treq)
+{
+	td_llpcache_t *s = container_of(rec, td_llpcache_t, rec);
+
+	td_queue_write(s->local, treq);
+}
+
 static int
 llpcache_close(td_driver_t *driver)
 {
 	td_llpcache_t *s = driver->data;
 
+	ll_recovery_free(&s->rec);
+
 	if (s->local) {
 		tapdisk_image_close(s->local);
 		s->local = NULL;
@@ -358,6 +726,9 @@ llpcache_open(td_driver_t *driver, const char *name,
 
 	driver->info = s->local->driver->info;
 
+	ll_recovery_init(&s->rec, &s->mode, driver->info.size, 0,
+			 llpcache_recovery_write);
+
 	return 0;
 
 fail:
@@ -365,6 +736,22 @@ fail:
 	return err;
 }
 
+static int
+llpcache_busy(td_driver_t *driver)
+{
+	td_llpcache_t *s = driver->data;
+
+	return ll_recovery_busy(&s->rec);
+}
+
+static void
+llpcache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_llpcache_t *s = driver->data;
+
+	ll_recovery_stats(&s->rec, st);
+}
+
 static int
 llcache_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
 {
@@ -396,6 +783,8 @@ struct tap_disk tapdisk_llpcache = {
 	.td_queue_write             = llpcache_queue_write,
 	.td_get_parent_id           = llcache_get_parent_id,
 	.td_validate_parent         = llcache_validate_parent,
+	.td_busy                    = llpcache_busy,
+	.td_stats                   = llpcache_stats,
 };
 
 /*
@@ -418,12 +807,13 @@ struct tap_disk tapdisk_llpcache = {
  * discarded too.
  */
 enum {
-	LLE_LOCAL = 1,
+	LLE_LOCAL = LL_LOCAL,
 	/*
 	 * LLE_LOCAL:
 	 *
 	 * Writes are forwarded to LOCAL only. As are reads. This
-	 * reduces network overhead.
+	 * reduces network overhead. Writes to chunks SHARED ever held
+	 * data for go to SHARED as well, keeping it current there.
 	 *
 	 * Failure to write LOCAL is recoverable. The driver will
 	 * transition to LLE_SHARED.
@@ -432,14 +822,24 @@ enum {
 	 * to the original issuer.
 	 */
 
-	LLE_SHARED = 2,
+	LLE_SHARED = LL_SHARED,
 	/*
 	 * LLE_SHARED:
 	 *
-	 * Writes are issued to SHARED. As are reads.
+	 * Writes are issued to SHARED. As are reads. Written chunks
+	 * are marked dirty.
 	 *
 	 * Failure to write to SHARED is irrecoverable.
 	 */
+
+	LLE_RECOVER = LL_RECOVER,
+	/*
+	 * LLE_RECOVER:
+	 *
+	 * As LLE_SHARED, while dirty chunks are copied to LOCAL. The
+	 * driver transitions back to LLE_LOCAL once none are left, or
+	 * to LLE_SHARED if LOCAL fails again.
+	 */
 };
 
 typedef struct llecache                 td_llecache_t;
@@ -451,11 +851,14 @@ struct llecache_request {
 	td_request_t            treq;
 	int                     pending;
 	int                     error;
+	int                     shared_error;
+	int                     mirror;
 };
 
 struct llecache {
 	td_image_t             *shared;
 	int                     mode;
+	td_ll_recovery_t        rec;
 
 	td_llecache_req_t       reqv[TD_LLECACHE_MAX_REQ];
 	td_llecache_req_t      *free[TD_LLECACHE_MAX_REQ];
@@ -480,11 +883,22 @@ llecache_free_request(td_llecache_t *s, td_llecache_req_t *req)
 	s->free[s->n_free++] = req;
 }
 
+/*
+ * Copies go to LOCAL, next in the chain.
+ */
+static void
+llecache_recovery_write(td_ll_recovery_t *rec, td_request_t treq)
+{
+	td_forward_request(treq);
+}
+
 static int
 llecache_close(td_driver_t *driver)
 {
 	td_llecache_t *s = driver->data;
 
+	ll_recovery_free(&s->rec);
+
 	if (s->shared) {
 		tapdisk_image_close(s->shared);
 		s->shared = NULL;
@@ -511,6 +925,9 @@ llecache_open(td_driver_t *driver, const char *name,
 
 	driver->info = s->shared->driver->info;
 
+	ll_recovery_init(&s->rec, &s->mode, driver->info.size, 1,
+			 llecache_recovery_write);
+
 	return 0;
 
 fail:
@@ -519,7 +936,7 @@ fail:
 }
 
 static void
-__llecache_write_cb(td_request_t treq, int error)
+__llecache_shared_write_cb(td_request_t treq, int error)
 {
 	td_llecache_req_t *req = treq.cb_data;
 	td_llecache_t *s = req->s;
@@ -527,29 +944,121 @@ __llecache_write_cb(td_request_t treq, int error)
 	BUG_ON(req->pending < treq.secs);
 
 	req->pending -= treq.secs;
-	req->error    = ll_write_error(req->error, error);
+	req->error    = req->error ? : error;
 
 	if (req->pending)
 		return;
 
-	if (req->error == -ENOSPC) {
-		ll_log_switch(DISK_TYPE_LLECACHE, req->error,
-			      treq.image, s->shared);
+	ll_recovery_mark(&s->rec, req->treq.sec, req->treq.secs);
+	s->rec.shared_writes--;
 
-		s->mode = LLE_SHARED;
-		td_queue_write(s->shared, req->treq);
+	td_complete_request(req->treq, req->error);
+	llecache_free_request(s, req);
+}
 
-	} else
-		td_complete_request(req->treq, error);
+/*
+ * A write LOCAL will lack: issued to SHARED, and marked dirty.
+ */
+static void
+llecache_shared_write(td_llecache_t *s, td_request_t treq)
+{
+	td_llecache_req_t *req;
+	td_request_t clone;
 
+	req = llecache_alloc_request(s);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	memset(req, 0, sizeof(td_llecache_req_t));
+
+	req->treq       = treq;
+	req->pending    = treq.secs;
+	req->s          = s;
+
+	ll_recovery_mark(&s->rec, treq.sec, treq.secs);
+	s->rec.shared_writes++;
+
+	clone           = treq;
+	clone.cb        = __llecache_shared_write_cb;
+	clone.cb_data   = req;
+
+	td_queue_write(s->shared, clone);
+}
+
+static void
+llecache_write_done(td_llecache_t *s, td_llecache_req_t *req)
+{
+	td_request_t treq = req->treq;
+	int mirror = req->mirror;
+	int error;
+
+	s->rec.local_writes--;
+
+	if (req->error == -ENOSPC && !req->shared_error) {
+		if (s->mode == LLE_LOCAL) {
+			td_image_t *local =
+				container_of(treq.image->next.next,
+					     td_image_t, next);
+			ll_log_switch(DISK_TYPE_LLECACHE, req->error,
+				      local, s->shared);
+			ll_recovery_degrade(&s->rec, treq.vreq->vbd,
+					    treq.image, req->error);
+		}
+
+		llecache_free_request(s, req);
+
+		if (mirror) {
+			/* SHARED has it already. */
+			ll_recovery_mark(&s->rec, treq.sec, treq.secs);
+			td_complete_request(treq, 0);
+		} else
+			llecache_shared_write(s, treq);
+
+		return;
+	}
+
+	error = req->shared_error ? : req->error;
+
+	td_complete_request(treq, error);
 	llecache_free_request(s, req);
 }
 
+static void
+__llecache_write_cb(td_request_t treq, int error)
+{
+	td_llecache_req_t *req = treq.cb_data;
+
+	BUG_ON(req->pending < treq.secs);
+
+	req->pending -= treq.secs;
+	req->error    = ll_write_error(req->error, error);
+
+	if (!req->pending)
+		llecache_write_done(req->s, req);
+}
+
+static void
+__llecache_mirror_cb(td_request_t treq, int error)
+{
+	td_llecache_req_t *req = treq.cb_data;
+
+	BUG_ON(req->pending < treq.secs);
+
+	req->pending      -= treq.secs;
+	req->shared_error  = req->shared_error ? : error;
+
+	if (!req->pending)
+		llecache_write_done(req->s, req);
+}
+
 static void
 llecache_forward_write(td_llecache_t *s, td_request_t treq)
 {
 	td_llecache_req_t *req;
 	td_request_t clone;
+	int mirror;
 
 	req = llecache_alloc_request(s);
 	if (!req) {
@@ -559,15 +1068,25 @@ llecache_forward_write(td_llecache_t *s, td_request_t treq)
 
 	memset(req, 0, sizeof(td_llecache_req_t));
 
+	mirror          = ll_recovery_shadowed(&s->rec, treq.sec, treq.secs);
+
 	req->treq       = treq;
-	req->pending    = treq.secs;
+	req->pending    = mirror ? 2 * treq.secs : treq.secs;
 	req->s          = s;
+	req->mirror     = mirror;
+
+	s->rec.local_writes++;
 
 	clone           = treq;
 	clone.cb        = __llecache_write_cb;
 	clone.cb_data   = req;
 
 	td_forward_request(clone);
+
+	if (mirror) {
+		clone.cb = __llecache_mirror_cb;
+		td_queue_write(s->shared, clone);
+	}
 }
 
 static void
@@ -580,7 +1099,8 @@ llecache_queue_write(td_driver_t *driver, td_request_t treq)
 		llecache_forward_write(s, treq);
 		break;
 	case LLE_SHARED:
-		td_queue_write(s->shared, treq);
+	case LLE_RECOVER:
+		llecache_shared_write(s, treq);
 		break;
 	}
 }
@@ -595,6 +1115,7 @@ llecache_queue_read(td_driver_t *driver, td_request_t treq)
 		td_forward_request(treq);
 		break;
 	case LLE_SHARED:
+	case LLE_RECOVER:
 		td_queue_read(s->shared, treq);
 		break;
 	default:
@@ -602,6 +1123,22 @@ llecache_queue_read(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+static int
+llecache_busy(td_driver_t *driver)
+{
+	td_llecache_t *s = driver->data;
+
+	return ll_recovery_busy(&s->rec);
+}
+
+static void
+llecache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_llecache_t *s = driver->data;
+
+	ll_recovery_stats(&s->rec, st);
+}
+
 struct tap_disk tapdisk_llecache = {
 	.disk_type                  = "tapdisk_llecache",
 	.flags                      = 0,
@@ -612,4 +1149,6 @@ struct tap_disk tapdisk_llecache = {
 	.td_queue_write             = llecache_queue_write,
 	.td_get_parent_id           = llcache_get_parent_id,
 	.td_validate_parent         = llcache_validate_parent,
+	.td_busy                    = llecache_busy,
+	.td_stats                   = llecache_stats,
 };
@@ -0,0 +1,2522 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * block-qcow2.c: asynchronous qcow2 implementation.
+ *
+ * Guest clusters are located through the in-memory L1 table and a small
+ * LRU cache of L2 tables.  Requests hitting an L2 table which is not
+ * cached yet are parked on the cache slot until the table has been read,
+ * then resubmitted, in the same way block-vhd.c handles bitmap misses.
+ *
+ * A note on cluster allocation:
+ * Writes to clusters which are unallocated, zero or compressed require a
+ * new host cluster.  Up to QCOW2_ALLOCS allocations are in flight at a
+ * time, at most one per guest cluster, and only one may create the L2
+ * table behind a given L1 entry; other writes needing one are failed
+ * with -EBUSY and retried by the VBD.  An allocation proceeds in phases:
+ *   - COW: unless the write covers the whole cluster, the old contents
+ *     are read into a bounce buffer through the regular read path (which
+ *     forwards to the backing image where needed) and the guest data is
+ *     merged in.  Meanwhile, the refcounts of the new host clusters are
+ *     written, along with the refcount table entry of a new refcount
+ *     block.
+ *   - DATA: the data cluster and a freshly allocated L2 table (if the L1
+ *     entry was empty) are written in parallel.
+ *   - LINK: once all of the above is durable, the L2 entry (or the L1
+ *     entry, for a new L2 table) is written, making the cluster visible.
+ *   - UNREF: the refcounts of a compressed cluster or an unowned
+ *     preallocated zero cluster the entry pointed to are dropped.
+ * Refcount, refcount table, L1 and L2 updates are small sector writes
+ * made from the in-memory tables.  They go through a single queue, one
+ * at a time, so that no update overwrites a sector with a copy missing
+ * another's change, and so that the cached refcount block is never
+ * replaced while a write from it is in flight.  A failed refcount update
+ * fails all allocations from then on.
+ * A crash at any point before LINK leaves at worst leaked clusters, never
+ * a reference to a cluster with a zero refcount; one before UNREF leaves
+ * the old clusters leaked.  Host clusters are only ever appended at the
+ * end of the file; freed clusters are not reused.
+ *
+ * Internal snapshots, encryption and external data files are not
+ * supported; such images can only be opened read-only.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <endian.h>
+#include <libgen.h>
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-storage.h"
+
+#define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
+#define ERR(_s, _err, _f, _a...)     tlog_drv_error((_s)->driver, _err, _f, ##_a)
+
+#ifndef MIN
+#define MIN(a, b)                    ((a) < (b) ? (a) : (b))
+#endif
+
+/******QCOW2 DEFINES******/
+#define QCOW2_MAGIC                  (('Q' << 24) | ('F' << 16) | \
+				      ('I' << 8) | 0xfb)
+#define QCOW2_V2_HEADER_SIZE         72
+#define QCOW2_MIN_CLUSTER_BITS       9
+#define QCOW2_MAX_CLUSTER_BITS       21
+
+#define QCOW2_OFLAG_COPIED           (1ULL << 63)
+#define QCOW2_OFLAG_COMPRESSED       (1ULL << 62)
+#define QCOW2_OFLAG_ZERO             (1ULL << 0)
+#define QCOW2_OFFSET_MASK            0x00fffffffffffe00ULL
+#define QCOW2_REFT_OFFSET_MASK       0xfffffffffffffe00ULL
+
+#define QCOW2_INCOMPAT_DIRTY         (1ULL << 0)
+#define QCOW2_INCOMPAT_CORRUPT       (1ULL << 1)
+#define QCOW2_INCOMPAT_MASK          (QCOW2_INCOMPAT_DIRTY | \
+				      QCOW2_INCOMPAT_CORRUPT)
+
+#define QCOW2_EXT_END                0x00000000
+#define QCOW2_EXT_BACKING_FMT        0xe2792aca
+
+#define QCOW2_L2_CACHE_SIZE          32
+#define QCOW2_REQS_DATA              TAPDISK_DATA_REQUESTS
+
+#define QCOW2_OP_DATA_READ           1
+#define QCOW2_OP_DATA_WRITE          2
+#define QCOW2_OP_L2_READ             3
+#define QCOW2_OP_COMPRESSED_READ     4
+#define QCOW2_OP_BLOCK_STATUS        5
+#define QCOW2_OP_ALLOC_WRITE         6
+#define QCOW2_OP_META_WRITE          7
+
+/* cluster lookup results */
+#define QCOW2_CLUSTER_UNALLOCATED    0
+#define QCOW2_CLUSTER_ZERO           1
+#define QCOW2_CLUSTER_NORMAL         2
+#define QCOW2_CLUSTER_COMPRESSED     3
+#define QCOW2_CLUSTER_NOT_CACHED     4
+#define QCOW2_CLUSTER_READ_PENDING   5
+
+#define QCOW2_FLAG_OPEN_RDONLY       1
+#define QCOW2_FLAG_OPEN_QUIET        2
+
+#define QCOW2_FLAG_L2_READ_PENDING   1
+
+/* allocation phases */
+#define QCOW2_ALLOC_IDLE             0
+#define QCOW2_ALLOC_COW              1
+#define QCOW2_ALLOC_DATA             2
+#define QCOW2_ALLOC_LINK             3
+#define QCOW2_ALLOC_UNREF            4
+
+/* metadata update steps */
+#define QCOW2_META_NONE              0
+#define QCOW2_META_REFCOUNT          1
+#define QCOW2_META_REFT              2
+#define QCOW2_META_LINK              3
+#define QCOW2_META_UNREF             4
+
+#define QCOW2_ALLOCS                 8
+
+#define test_qcow2_flag(word, flag)  ((word) & (flag))
+#define set_qcow2_flag(word, flag)   ((word) |= (flag))
+#define clear_qcow2_flag(word, flag) ((word) &= ~(flag))
+
+struct qcow2_header {
+	uint32_t                  magic;
+	uint32_t                  version;
+	uint64_t                  backing_file_offset;
+	uint32_t                  backing_file_size;
+	uint32_t                  cluster_bits;
+	uint64_t                  size;
+	uint32_t                  crypt_method;
+	uint32_t                  l1_size;
+	uint64_t                  l1_table_offset;
+	uint64_t                  refcount_table_offset;
+	uint32_t                  refcount_table_clusters;
+	uint32_t                  nb_snapshots;
+	uint64_t                  snapshots_offset;
+
+	/* version 3 only */
+	uint64_t                  incompatible_features;
+	uint64_t                  compatible_features;
+	uint64_t                  autoclear_features;
+	uint32_t                  refcount_order;
+	uint32_t                  header_length;
+} __attribute__((packed));
+
+struct qcow2_state;
+struct qcow2_request;
+struct qcow2_alloc;
+
+struct qcow2_req_list {
+	struct qcow2_request     *head;
+	struct qcow2_request     *tail;
+};
+
+struct qcow2_request {
+	int                       error;
+	uint8_t                   op;
+	td_request_t              treq;
+	struct tiocb              tiocb;
+	struct qcow2_state       *state;
+	struct qcow2_alloc       *alloc;
+	struct qcow2_request     *next;
+
+	/* compressed reads */
+	char                     *cbuf;
+	uint32_t                  coff;
+	uint32_t                  csize;
+};
+
+struct qcow2_l2 {
+	uint64_t                  offset;      /* host offset of the table,
+						* 0 if the slot is free */
+	uint64_t                  seqno;       /* lru sequence number */
+	int                       status;
+	int                       locked;      /* allocations in the table */
+	uint64_t                 *table;       /* big-endian, as on disk */
+	struct qcow2_req_list     waiting;     /* requests waiting for the
+						* table to be read */
+	struct qcow2_request      req;
+};
+
+struct qcow2_alloc {
+	int                       phase;
+	int                       pending;
+	int                       error;
+	td_request_t              treq;        /* the guest write */
+	struct qcow2_state       *state;
+	struct qcow2_alloc       *next;        /* on the metadata queue */
+
+	uint64_t                  vcluster;
+	uint32_t                  l1_idx;
+	uint32_t                  l2_idx;
+	struct qcow2_l2          *l2;
+	int                       new_l2;
+	int                       reuse;       /* preallocated zero cluster */
+	uint64_t                  data_offset;
+
+	int                       meta;        /* next metadata step */
+	int                       new_refblock;
+	uint64_t                  reft_idx;
+	uint64_t                  refblock_offset;
+	uint64_t                  rc_first;    /* host clusters counted */
+	uint64_t                  rc_last;
+
+	int                       unref;       /* old host clusters held */
+	uint64_t                  unref_first;
+	uint64_t                  unref_last;
+
+	int                       cow_secs;
+
+	char                     *buf;         /* cluster bounce buffer */
+	char                     *sec_buf;     /* single metadata sector */
+
+	struct qcow2_request      reqs[3];
+};
+
+struct qcow2_meta_queue {
+	struct qcow2_alloc       *head;
+	struct qcow2_alloc       *tail;
+	struct qcow2_alloc       *busy;        /* update in flight */
+	int                       error;       /* sticky refcount failure */
+};
+
+struct qcow2_state {
+	int                       fd;
+	int                       flags;
+	char                     *name;
+	td_driver_t              *driver;
+
+	struct qcow2_header       hdr;
+
+	uint32_t                  cluster_bits;
+	uint32_t                  cluster_size;
+	uint32_t                  cluster_secs;
+	uint32_t                  l2_bits;
+	uint32_t                  l2_entries;
+	uint32_t                  csize_shift;
+	uint64_t                  csize_mask;
+
+	uint64_t                 *l1;          /* big-endian, as on disk */
+	uint64_t                 *reft;        /* big-endian, as on disk */
+	uint64_t                  reft_entries;
+
+	uint32_t                  rc_bytes;    /* bytes per refcount */
+	uint32_t                  rb_entries;  /* refcounts per block */
+	char                     *refblock;
+	int64_t                   refblock_idx;
+
+	uint64_t                  next_cluster;
+
+	char                     *backing;
+	char                     *backing_fmt;
+
+	uint64_t                  l2_lru;
+	struct qcow2_l2           l2_cache[QCOW2_L2_CACHE_SIZE];
+
+	int                       req_free_count;
+	struct qcow2_request     *req_free[QCOW2_REQS_DATA];
+	struct qcow2_request      req_list[QCOW2_REQS_DATA];
+
+	struct qcow2_alloc        alloc[QCOW2_ALLOCS];
+	struct qcow2_meta_queue   meta;
+
+	uint64_t                  queued;
+	uint64_t                  completed;
+	uint64_t                  reads;
+	uint64_t                  writes;
+	uint64_t                  l2_hits;
+	uint64_t                  l2_misses;
+	uint64_t                  allocs;
+	uint64_t                  cow_reads;
+};
+
+static void qcow2_complete(void *, struct tiocb *, int);
+static void qcow2_queue_read(td_driver_t *, td_request_t);
+static void qcow2_queue_write(td_driver_t *, td_request_t);
+static void qcow2_queue_block_status(td_driver_t *, td_request_t);
+static void qcow2_alloc_continue(struct qcow2_alloc *);
+
+static inline uint64_t
+qcow2_cluster_offset(struct qcow2_state *s, uint64_t offset)
+{
+	return offset & ~((uint64_t)s->cluster_size - 1);
+}
+
+static inline uint64_t
+qcow2_round_up(uint64_t val, uint64_t align)
+{
+	return (val + align - 1) & ~(align - 1);
+}
+
+static int
+qcow2_pread(struct qcow2_state *s, void *buf, size_t size, off_t offset)
+{
+	ssize_t n;
+	size_t done = 0;
+
+	while (done < size) {
+		n = pread(s->fd, (char *)buf + done, size - done, offset + done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (n == 0)
+			return -EIO;
+		done += n;
+	}
+
+	return 0;
+}
+
+static int
+qcow2_pwrite(struct qcow2_state *s, const void *buf, size_t size, off_t offset)
+{
+	ssize_t n;
+	size_t done = 0;
+
+	while (done < size) {
+		n = pwrite(s->fd, (const char *)buf + done,
+			   size - done, offset + done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += n;
+	}
+
+	return 0;
+}
+
+static uint64_t
+qcow2_get_refcount(struct qcow2_state *s, const char *block, uint32_t idx)
+{
+	const void *p = block + (size_t)idx * s->rc_bytes;
+
+	switch (s->rc_bytes) {
+	case 1:
+		return *(const uint8_t *)p;
+	case 2:
+		return be16toh(*(const uint16_t *)p);
+	case 4:
+		return be32toh(*(const uint32_t *)p);
+	default:
+		return be64toh(*(const uint64_t *)p);
+	}
+}
+
+static void
+qcow2_set_refcount(struct qcow2_state *s, char *block,
+		   uint32_t idx, uint64_t val)
+{
+	void *p = block + (size_t)idx * s->rc_bytes;
+
+	switch (s->rc_bytes) {
+	case 1:
+		*(uint8_t *)p = val;
+		break;
+	case 2:
+		*(uint16_t *)p = htobe16(val);
+		break;
+	case 4:
+		*(uint32_t *)p = htobe32(val);
+		break;
+	default:
+		*(uint64_t *)p = htobe64(val);
+		break;
+	}
+}
+
+static void
+qcow2_header_in(struct qcow2_header *h)
+{
+	h->magic                   = be32toh(h->magic);
+	h->version                 = be32toh(h->version);
+	h->backing_file_offset     = be64toh(h->backing_file_offset);
+	h->backing_file_size       = be32toh(h->backing_file_size);
+	h->cluster_bits            = be32toh(h->cluster_bits);
+	h->size                    = be64toh(h->size);
+	h->crypt_method            = be32toh(h->crypt_method);
+	h->l1_size                 = be32toh(h->l1_size);
+	h->l1_table_offset         = be64toh(h->l1_table_offset);
+	h->refcount_table_offset   = be64toh(h->refcount_table_offset);
+	h->refcount_table_clusters = be32toh(h->refcount_table_clusters);
+	h->nb_snapshots            = be32toh(h->nb_snapshots);
+	h->snapshots_offset        = be64toh(h->snapshots_offset);
+	h->incompatible_features   = be64toh(h->incompatible_features);
+	h->compatible_features     = be64toh(h->compatible_features);
+	h->autoclear_features      = be64toh(h->autoclear_features);
+	h->refcount_order          = be32toh(h->refcount_order);
+	h->header_length           = be32toh(h->header_length);
+}
+
+static int
+qcow2_read_extensions(struct qcow2_state *s, const char *buf)
+{
+	uint32_t off, type, len;
+
+	off = s->hdr.header_length;
+
+	while (off + 8 <= s->cluster_size) {
+		type = be32toh(*(const uint32_t *)(buf + off));
+		len  = be32toh(*(const uint32_t *)(buf + off + 4));
+		off += 8;
+
+		if (type == QCOW2_EXT_END)
+			break;
+
+		if (off + len > s->cluster_size)
+			return -EINVAL;
+
+		if (type == QCOW2_EXT_BACKING_FMT) {
+			s->backing_fmt = strndup(buf + off, len);
+			if (!s->backing_fmt)
+				return -ENOMEM;
+		}
+
+		off += qcow2_round_up(len, 8);
+	}
+
+	return 0;
+}
+
+static int
+qcow2_read_backing_name(struct qcow2_state *s, const char *buf)
+{
+	const struct qcow2_header *h = &s->hdr;
+
+	if (!h->backing_file_offset)
+		return 0;
+
+	if (h->backing_file_size > PATH_MAX ||
+	    h->backing_file_offset + h->backing_file_size > s->cluster_size)
+		return -EINVAL;
+
+	s->backing = strndup(buf + h->backing_file_offset,
+			     h->backing_file_size);
+
+	return s->backing ? 0 : -ENOMEM;
+}
+
+static int
+qcow2_read_header(struct qcow2_state *s)
+{
+	struct qcow2_header *h = &s->hdr;
+	void *buf;
+	int err;
+
+	/* the header, its extensions and the backing name live in cluster 0,
+	 * which is at least 512 bytes; read the smallest one first */
+	err = posix_memalign(&buf, 4096, 1 << QCOW2_MAX_CLUSTER_BITS);
+	if (err)
+		return -err;
+
+	err = qcow2_pread(s, buf, 1 << QCOW2_MIN_CLUSTER_BITS, 0);
+	if (err)
+		goto out;
+
+	memset(h, 0, sizeof(*h));
+	memcpy(h, buf, sizeof(*h));
+	qcow2_header_in(h);
+
+	err = -EINVAL;
+
+	if (h->magic != QCOW2_MAGIC) {
+		if (!test_qcow2_flag(s->flags, QCOW2_FLAG_OPEN_QUIET))
+			EPRINTF("%s: not a qcow2 image\n", s->name);
+		goto out;
+	}
+
+	if (h->version == 2) {
+		h->incompatible_features = 0;
+		h->compatible_features   = 0;
+		h->autoclear_features    = 0;
+		h->refcount_order        = 4;
+		h->header_length         = QCOW2_V2_HEADER_SIZE;
+	} else if (h->version != 3) {
+		EPRINTF("%s: unsupported qcow2 version %u\n",
+			s->name, h->version);
+		goto out;
+	}
+
+	if (h->cluster_bits < QCOW2_MIN_CLUSTER_BITS ||
+	    h->cluster_bits > QCOW2_MAX_CLUSTER_BITS) {
+		EPRINTF("%s: unsupported cluster size 2^%u\n",
+			s->name, h->cluster_bits);
+		goto out;
+	}
+
+	if (h->crypt_method) {
+		EPRINTF("%s: encrypted qcow2 images are not supported\n",
+			s->name);
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+
+	if (h->incompatible_features & ~QCOW2_INCOMPAT_MASK) {
+		EPRINTF("%s: unsupported incompatible features 0x%"PRIx64"\n",
+			s->name, h->incompatible_features);
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+
+	if (h->refcount_order > 6) {
+		EPRINTF("%s: invalid refcount order %u\n",
+			s->name, h->refcount_order);
+		goto out;
+	}
+
+	s->cluster_bits = h->cluster_bits;
+	s->cluster_size = 1U << h->cluster_bits;
+	s->cluster_secs = s->cluster_size >> SECTOR_SHIFT;
+	s->l2_bits      = h->cluster_bits - 3;
+	s->l2_entries   = 1U << s->l2_bits;
+	s->csize_shift  = 62 - (h->cluster_bits - 8);
+	s->csize_mask   = (1ULL << (h->cluster_bits - 8)) - 1;
+
+	if (h->header_length > s->cluster_size ||
+	    h->header_length < QCOW2_V2_HEADER_SIZE)
+		goto out;
+
+	if ((uint64_t)h->l1_size << (s->l2_bits + s->cluster_bits) <
+	    h->size) {
+		EPRINTF("%s: L1 table too small for disk size\n", s->name);
+		goto out;
+	}
+
+	err = qcow2_pread(s, buf, s->cluster_size, 0);
+	if (err)
+		goto out;
+
+	err = qcow2_read_extensions(s, buf);
+	if (err)
+		goto out;
+
+	err = qcow2_read_backing_name(s, buf);
+
+out:
+	free(buf);
+	return err;
+}
+
+static int
+qcow2_clear_autoclear(struct qcow2_state *s)
+{
+	void *buf;
+	int err;
+
+	/*
+	 * We do not maintain any of the autoclear features (e.g. persistent
+	 * bitmaps): as a writer, we must clear them before modifying the
+	 * image, so that other readers do not trust stale data.
+	 */
+	if (s->hdr.version < 3 || !s->hdr.autoclear_features)
+		return 0;
+
+	err = posix_memalign(&buf, 4096, 1 << QCOW2_MIN_CLUSTER_BITS);
+	if (err)
+		return -err;
+
+	err = qcow2_pread(s, buf, 1 << QCOW2_MIN_CLUSTER_BITS, 0);
+	if (err)
+		goto out;
+
+	((struct qcow2_header *)buf)->autoclear_features = 0;
+
+	err = qcow2_pwrite(s, buf, 1 << QCOW2_MIN_CLUSTER_BITS, 0);
+	if (!err)
+		s->hdr.autoclear_features = 0;
+
+out:
+	free(buf);
+	return err;
+}
+
+static int
+qcow2_read_tables(struct qcow2_state *s)
+{
+	struct qcow2_header *h = &s->hdr;
+	size_t size;
+	void *buf;
+	int err;
+
+	size = qcow2_round_up((size_t)h->l1_size * sizeof(uint64_t),
+			      SECTOR_SIZE);
+	if (!size)
+		size = SECTOR_SIZE;
+
+	err = posix_memalign(&buf, 4096, size);
+	if (err)
+		return -err;
+	memset(buf, 0, size);
+	s->l1 = buf;
+
+	if (h->l1_size) {
+		err = qcow2_pread(s, s->l1,
+				  qcow2_round_up((size_t)h->l1_size * 8,
+						 SECTOR_SIZE),
+				  h->l1_table_offset);
+		if (err) {
+			EPRINTF("%s: reading L1 table: %d\n", s->name, err);
+			return err;
+		}
+	}
+
+	if (test_qcow2_flag(s->flags, QCOW2_FLAG_OPEN_RDONLY))
+		return 0;
+
+	size = (size_t)h->refcount_table_clusters << s->cluster_bits;
+	if (!size)
+		return -EINVAL;
+
+	err = posix_memalign(&buf, 4096, size);
+	if (err)
+		return -err;
+	s->reft         = buf;
+	s->reft_entries = size / sizeof(uint64_t);
+
+	err = qcow2_pread(s, s->reft, size, h->refcount_table_offset);
+	if (err) {
+		EPRINTF("%s: reading refcount table: %d\n", s->name, err);
+		return err;
+	}
+
+	s->rc_bytes     = (1U << h->refcount_order) >> 3;
+	s->rb_entries   = s->cluster_size / s->rc_bytes;
+	s->refblock_idx = -1;
+
+	err = posix_memalign(&buf, 4096, s->cluster_size);
+	if (err)
+		return -err;
+	s->refblock = buf;
+
+	return 0;
+}
+
+static int
+qcow2_check_writable(struct qcow2_state *s)
+{
+	struct qcow2_header *h = &s->hdr;
+	struct stat st;
+
+	if (h->incompatible_features & QCOW2_INCOMPAT_CORRUPT) {
+		EPRINTF("%s: image is marked corrupt\n", s->name);
+		return -EINVAL;
+	}
+
+	if (h->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
+		EPRINTF("%s: image has dirty refcounts, repair it first\n",
+			s->name);
+		return -EINVAL;
+	}
+
+	if (h->nb_snapshots) {
+		EPRINTF("%s: writing to images with internal snapshots "
+			"is not supported\n", s->name);
+		return -EOPNOTSUPP;
+	}
+
+	if (h->refcount_order < 3) {
+		EPRINTF("%s: writing with %u-bit refcounts is not supported\n",
+			s->name, 1U << h->refcount_order);
+		return -EOPNOTSUPP;
+	}
+
+	if (fstat(s->fd, &st))
+		return -errno;
+
+	if (!S_ISREG(st.st_mode)) {
+		EPRINTF("%s: qcow2 images must be regular files\n", s->name);
+		return -EINVAL;
+	}
+
+	/* new clusters are appended to the end of the image */
+	s->next_cluster = qcow2_round_up(st.st_size, s->cluster_size);
+
+	return 0;
+}
+
+static void
+qcow2_free_l2_cache(struct qcow2_state *s)
+{
+	int i;
+
+	for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++) {
+		free(s->l2_cache[i].table);
+		s->l2_cache[i].table = NULL;
+	}
+}
+
+static int
+qcow2_initialize_l2_cache(struct qcow2_state *s)
+{
+	int i, err;
+	void *buf;
+
+	s->l2_lru = 0;
+
+	for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++) {
+		struct qcow2_l2 *l2 = &s->l2_cache[i];
+
+		memset(l2, 0, sizeof(*l2));
+
+		err = posix_memalign(&buf, 4096, s->cluster_size);
+		if (err) {
+			qcow2_free_l2_cache(s);
+			return -err;
+		}
+
+		l2->table     = buf;
+		l2->req.state = s;
+	}
+
+	return 0;
+}
+
+static void
+qcow2_free_alloc(struct qcow2_state *s)
+{
+	int i;
+
+	for (i = 0; i < QCOW2_ALLOCS; i++) {
+		struct qcow2_alloc *a = &s->alloc[i];
+
+		free(a->buf);
+		free(a->sec_buf);
+		a->buf = a->sec_buf = NULL;
+	}
+}
+
+static void
+qcow2_initialize_alloc(struct qcow2_state *s)
+{
+	int i;
+
+	memset(&s->meta, 0, sizeof(s->meta));
+
+	/* bounce buffers are allocated on first use */
+	for (i = 0; i < QCOW2_ALLOCS; i++) {
+		struct qcow2_alloc *a = &s->alloc[i];
+
+		memset(a, 0, sizeof(*a));
+		a->state = s;
+	}
+}
+
+static void
+qcow2_free(struct qcow2_state *s)
+{
+	qcow2_free_alloc(s);
+	qcow2_free_l2_cache(s);
+	free(s->l1);
+	free(s->reft);
+	free(s->refblock);
+	free(s->backing);
+	free(s->backing_fmt);
+	free(s->name);
+	if (s->fd != -1)
+		close(s->fd);
+}
+
+static int
+qcow2_open_fd(struct qcow2_state *s, td_flag_t flags)
+{
+	int o_flags;
+
+	o_flags = O_LARGEFILE |
+		(test_qcow2_flag(s->flags, QCOW2_FLAG_OPEN_RDONLY) ?
+		 O_RDONLY : O_RDWR);
+
+	if (!(test_qcow2_flag(s->flags, QCOW2_FLAG_OPEN_RDONLY) &&
+	      td_flag_test(flags, TD_OPEN_NO_O_DIRECT)))
+		o_flags |= O_DIRECT;
+
+	s->fd = open(s->name, o_flags);
+	if (s->fd == -1 && errno == EINVAL && (o_flags & O_DIRECT)) {
+		/* Maybe O_DIRECT isn't supported. */
+		s->fd = open(s->name, o_flags & ~O_DIRECT);
+		if (s->fd != -1)
+			DPRINTF("WARNING: Accessing image without "
+				"O_DIRECT! (%s)\n", s->name);
+	}
+
+	return s->fd == -1 ? -errno : 0;
+}
+
+static int
+qcow2_open(td_driver_t *driver, const char *name,
+	   struct td_vbd_encryption *encryption, td_flag_t flags)
+{
+	struct qcow2_state *s = driver->data;
+	int i, err;
+
+	memset(s, 0, sizeof(*s));
+	s->fd     = -1;
+	s->driver = driver;
+
+	if (td_flag_test(flags, TD_OPEN_RDONLY) ||
+	    td_flag_test(flags, TD_OPEN_QUERY))
+		set_qcow2_flag(s->flags, QCOW2_FLAG_OPEN_RDONLY);
+	if (td_flag_test(flags, TD_OPEN_QUIET) ||
+	    td_flag_test(flags, TD_OPEN_QUERY))
+		set_qcow2_flag(s->flags, QCOW2_FLAG_OPEN_QUIET);
+
+	if (encryption && encryption->encryption_key) {
+		EPRINTF("%s: encryption is not supported for qcow2\n", name);
+		return -EOPNOTSUPP;
+	}
+
+	err = tapdisk_namedup(&s->name, name);
+	if (err)
+		return err;
+
+	err = qcow2_open_fd(s, flags);
+	if (err) {
+		EPRINTF("Unable to open [%s] (%d)!\n", name, err);
+		goto fail;
+	}
+
+	err = qcow2_read_header(s);
+	if (err)
+		goto fail;
+
+	if (!test_qcow2_flag(s->flags, QCOW2_FLAG_OPEN_RDONLY)) {
+		err = qcow2_check_writable(s);
+		if (err)
+			goto fail;
+	}
+
+	err = qcow2_read_tables(s);
+	if (err)
+		goto fail;
+
+	if (!test_qcow2_flag(s->flags, QCOW2_FLAG_OPEN_RDONLY)) {
+		err = qcow2_clear_autoclear(s);
+		if (err)
+			goto fail;
+	}
+
+	err = qcow2_initialize_l2_cache(s);
+	if (err)
+		goto fail;
+
+	qcow2_initialize_alloc(s);
+
+	s->req_free_count = QCOW2_REQS_DATA;
+	for (i = 0; i < QCOW2_REQS_DATA; i++)
+		s->req_free[i] = s->req_list + i;
+
+	driver->storage          = tapdisk_storage_type(name);
+	driver->info.size        = s->hdr.size >> SECTOR_SHIFT;
+	driver->info.sector_size = SECTOR_SIZE;
+	driver->info.info        = 0;
+
+	if (!test_qcow2_flag(s->flags, QCOW2_FLAG_OPEN_QUIET))
+		DPRINTF("%s: qcow2 v%u, cluster %u, size %"PRIu64", "
+			"l1 %u, backing %s (%s)\n", s->name, s->hdr.version,
+			s->cluster_size, s->hdr.size, s->hdr.l1_size,
+			s->backing ? : "none",
+			s->backing_fmt ? : "probe");
+
+	return 0;
+
+fail:
+	qcow2_free(s);
+	memset(s, 0, sizeof(*s));
+	return err;
+}
+
+static int
+qcow2_close(td_driver_t *driver)
+{
+	struct qcow2_state *s = driver->data;
+
+	if (!test_qcow2_flag(s->flags, QCOW2_FLAG_OPEN_QUIET))
+		DPRINTF("%s: reads: %"PRIu64", writes: %"PRIu64", "
+			"allocs: %"PRIu64", l2 hits/misses: %"PRIu64"/%"PRIu64
+			"\n", s->name, s->reads, s->writes, s->allocs,
+			s->l2_hits, s->l2_misses);
+
+	if (!test_qcow2_flag(s->flags, QCOW2_FLAG_OPEN_RDONLY) &&
+	    s->allocs && fdatasync(s->fd))
+		EPRINTF("%s: fdatasync: %d (error ignored)\n",
+			s->name, -errno);
+
+	qcow2_free(s);
+	memset(s, 0, sizeof(*s));
+
+	return 0;
+}
+
+static int
+qcow2_probe_type(const char *path)
+{
+	uint32_t magic;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	n = pread(fd, &magic, sizeof(magic), 0);
+	close(fd);
+
+	if (n == sizeof(magic) && be32toh(magic) == QCOW2_MAGIC)
+		return DISK_TYPE_QCOW;
+
+	return DISK_TYPE_AIO;
+}
+
+static int
+qcow2_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	struct qcow2_state *s = driver->data;
+	char *parent, *dir, *tmp;
+	int type, flags, err;
+
+	flags = id->flags;
+	memset(id, 0, sizeof(td_disk_id_t));
+
+	if (!s->backing)
+		return TD_NO_PARENT;
+
+	if (s->backing[0] == '/') {
+		parent = strdup(s->backing);
+		if (!parent)
+			return -ENOMEM;
+	} else {
+		/* relative backing names are relative to the image */
+		tmp = strdup(s->name);
+		if (!tmp)
+			return -ENOMEM;
+		dir = dirname(tmp);
+		err = asprintf(&parent, "%s/%s", dir, s->backing);
+		free(tmp);
+		if (err == -1)
+			return -ENOMEM;
+	}
+
+	if (!s->backing_fmt)
+		type = qcow2_probe_type(parent);
+	else if (!strcmp(s->backing_fmt, "qcow2"))
+		type = DISK_TYPE_QCOW;
+	else if (!strcmp(s->backing_fmt, "raw"))
+		type = DISK_TYPE_AIO;
+	else if (!strcmp(s->backing_fmt, "vpc"))
+		type = DISK_TYPE_VHD;
+	else {
+		EPRINTF("%s: unsupported backing format %s\n",
+			s->name, s->backing_fmt);
+		type = -EOPNOTSUPP;
+	}
+
+	if (type < 0) {
+		free(parent);
+		return type;
+	}
+
+	id->name  = parent;
+	id->type  = type;
+	id->flags = flags|TD_OPEN_SHAREABLE|TD_OPEN_RDONLY;
+
+	return 0;
+}
+
+static int
+qcow2_validate_parent(td_driver_t *child_driver,
+		      td_driver_t *parent_driver, td_flag_t flags)
+{
+	switch (parent_driver->type) {
+	case DISK_TYPE_QCOW:
+	case DISK_TYPE_AIO:
+	case DISK_TYPE_VHD:
+	case DISK_TYPE_LCACHE:
+	case DISK_TYPE_NBD:
+		return 0;
+	}
+
+	EPRINTF("%s: unsupported parent type %d\n",
+		child_driver->name, parent_driver->type);
+	return -EINVAL;
+}
+
+static inline void
+clear_req_list(struct qcow2_req_list *list)
+{
+	list->head = list->tail = NULL;
+}
+
+static inline void
+add_to_tail(struct qcow2_req_list *list, struct qcow2_request *e)
+{
+	if (!list->head)
+		list->head = list->tail = e;
+	else
+		list->tail = list->tail->next = e;
+}
+
+static inline struct qcow2_request *
+alloc_qcow2_request(struct qcow2_state *s)
+{
+	struct qcow2_request *req;
+
+	if (!s->req_free_count)
+		return NULL;
+
+	req = s->req_free[--s->req_free_count];
+	memset(req, 0, sizeof(*req));
+	req->state = s;
+
+	return req;
+}
+
+static inline void
+free_qcow2_request(struct qcow2_state *s, struct qcow2_request *req)
+{
+	memset(req, 0, sizeof(*req));
+	s->req_free[s->req_free_count++] = req;
+}
+
+static inline void
+do_aio_read(struct qcow2_state *s, struct qcow2_request *req,
+	    char *buf, size_t size, uint64_t offset)
+{
+	td_prep_read(s->driver, &req->tiocb, s->fd, buf, size,
+		     offset, qcow2_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
+	s->queued++;
+}
+
+static inline void
+do_aio_write(struct qcow2_state *s, struct qcow2_request *req,
+	     char *buf, size_t size, uint64_t offset)
+{
+	td_prep_write(s->driver, &req->tiocb, s->fd, buf, size,
+		      offset, qcow2_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
+	s->queued++;
+}
+
+/*
+ * L2 table cache
+ */
+
+static inline int
+l2_in_use(struct qcow2_l2 *l2)
+{
+	return l2->locked || l2->waiting.head ||
+		test_qcow2_flag(l2->status, QCOW2_FLAG_L2_READ_PENDING);
+}
+
+static struct qcow2_l2 *
+get_l2(struct qcow2_state *s, uint64_t offset)
+{
+	int i;
+
+	for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++)
+		if (s->l2_cache[i].offset == offset)
+			return &s->l2_cache[i];
+
+	return NULL;
+}
+
+static inline void
+touch_l2(struct qcow2_state *s, struct qcow2_l2 *l2)
+{
+	l2->seqno = ++s->l2_lru;
+}
+
+static struct qcow2_l2 *
+alloc_l2(struct qcow2_state *s, uint64_t offset)
+{
+	struct qcow2_l2 *l2, *lru = NULL;
+	int i;
+
+	for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++) {
+		l2 = &s->l2_cache[i];
+
+		if (!l2->offset) {
+			lru = l2;
+			break;
+		}
+
+		if (l2_in_use(l2))
+			continue;
+
+		if (!lru || l2->seqno < lru->seqno)
+			lru = l2;
+	}
+
+	if (!lru)
+		return NULL;
+
+	lru->offset = offset;
+	lru->status = 0;
+	lru->locked = 0;
+	clear_req_list(&lru->waiting);
+	touch_l2(s, lru);
+
+	return lru;
+}
+
+static inline void
+free_l2(struct qcow2_l2 *l2)
+{
+	l2->offset = 0;
+	l2->status = 0;
+	l2->locked = 0;
+	clear_req_list(&l2->waiting);
+}
+
+static int
+schedule_l2_read(struct qcow2_state *s, uint64_t offset)
+{
+	struct qcow2_request *req;
+	struct qcow2_l2 *l2;
+
+	l2 = alloc_l2(s, offset);
+	if (!l2)
+		return -EBUSY;
+
+	req = &l2->req;
+	memset(req, 0, sizeof(*req));
+	req->state = s;
+	req->op    = QCOW2_OP_L2_READ;
+
+	set_qcow2_flag(l2->status, QCOW2_FLAG_L2_READ_PENDING);
+	do_aio_read(s, req, (char *)l2->table, s->cluster_size, offset);
+
+	s->l2_misses++;
+	DBG(TLOG_DBG, "%s: reading L2 table at 0x%"PRIx64"\n",
+	    s->name, offset);
+
+	return 0;
+}
+
+static int
+queue_on_l2(struct qcow2_state *s, uint8_t op, td_request_t treq,
+	    uint64_t l2_offset)
+{
+	struct qcow2_request *req;
+	struct qcow2_l2 *l2;
+
+	l2 = get_l2(s, l2_offset);
+	ASSERT(l2 && test_qcow2_flag(l2->status, QCOW2_FLAG_L2_READ_PENDING));
+
+	req = alloc_qcow2_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq = treq;
+	req->op   = op;
+
+	add_to_tail(&l2->waiting, req);
+
+	return 0;
+}
+
+/*
+ * Looks up the guest cluster containing @sec.  On return, *entry holds
+ * the host L2 entry (host-endian) and *l2_offset the host offset of the
+ * L2 table, 0 if the L1 entry is empty.
+ */
+static int
+lookup_cluster(struct qcow2_state *s, td_sector_t sec,
+	       uint64_t *entry, uint64_t *l2_offset, struct qcow2_l2 **_l2)
+{
+	uint64_t vcluster, l1_idx, l2_idx, l1e;
+	struct qcow2_l2 *l2;
+
+	vcluster = sec / s->cluster_secs;
+	l1_idx   = vcluster >> s->l2_bits;
+	l2_idx   = vcluster & (s->l2_entries - 1);
+
+	*entry     = 0;
+	*l2_offset = 0;
+	*_l2       = NULL;
+
+	if (l1_idx >= s->hdr.l1_size)
+		return -EINVAL;
+
+	l1e = be64toh(s->l1[l1_idx]) & QCOW2_OFFSET_MASK;
+	if (!l1e)
+		return QCOW2_CLUSTER_UNALLOCATED;
+
+	*l2_offset = l1e;
+
+	l2 = get_l2(s, l1e);
+	if (!l2)
+		return QCOW2_CLUSTER_NOT_CACHED;
+
+	touch_l2(s, l2);
+	*_l2 = l2;
+
+	if (test_qcow2_flag(l2->status, QCOW2_FLAG_L2_READ_PENDING))
+		return QCOW2_CLUSTER_READ_PENDING;
+
+	s->l2_hits++;
+	*entry = be64toh(l2->table[l2_idx]);
+
+	if (*entry & QCOW2_OFLAG_COMPRESSED)
+		return QCOW2_CLUSTER_COMPRESSED;
+
+	if (*entry & QCOW2_OFLAG_ZERO)
+		return QCOW2_CLUSTER_ZERO;
+
+	if (!(*entry & QCOW2_OFFSET_MASK))
+		return QCOW2_CLUSTER_UNALLOCATED;
+
+	return QCOW2_CLUSTER_NORMAL;
+}
+
+static inline int
+cluster_type(struct qcow2_state *s, uint64_t entry)
+{
+	if (entry & QCOW2_OFLAG_COMPRESSED)
+		return QCOW2_CLUSTER_COMPRESSED;
+	if (entry & QCOW2_OFLAG_ZERO)
+		return QCOW2_CLUSTER_ZERO;
+	if (!(entry & QCOW2_OFFSET_MASK))
+		return QCOW2_CLUSTER_UNALLOCATED;
+	return QCOW2_CLUSTER_NORMAL;
+}
+
+/*
+ * Returns the number of sectors starting at @sec, up to @secs, which
+ * resolve to clusters of the same type as the first one and, for normal
+ * clusters, to contiguous host offsets.  Never crosses an L2 table.
+ */
+static int
+cluster_span(struct qcow2_state *s, struct qcow2_l2 *l2,
+	     td_sector_t sec, int secs, int type, uint64_t entry)
+{
+	uint64_t vcluster, l2_idx, next;
+	int span;
+
+	span = s->cluster_secs - (sec % s->cluster_secs);
+	if (span >= secs || type == QCOW2_CLUSTER_COMPRESSED)
+		return MIN(span, secs);
+
+	vcluster = sec / s->cluster_secs;
+	l2_idx   = vcluster & (s->l2_entries - 1);
+	next     = entry & QCOW2_OFFSET_MASK;
+
+	while (span < secs && ++l2_idx < s->l2_entries) {
+		uint64_t e;
+
+		if (!l2) {
+			/* whole L2 table unallocated */
+			span += s->cluster_secs;
+			continue;
+		}
+
+		e = be64toh(l2->table[l2_idx]);
+		if (cluster_type(s, e) != type)
+			break;
+
+		if (type == QCOW2_CLUSTER_NORMAL) {
+			next += s->cluster_size;
+			if ((e & QCOW2_OFFSET_MASK) != next)
+				break;
+		}
+
+		span += s->cluster_secs;
+	}
+
+	return MIN(span, secs);
+}
+
+static inline uint64_t
+host_offset(struct qcow2_state *s, uint64_t entry, td_sector_t sec)
+{
+	return (entry & QCOW2_OFFSET_MASK) +
+		((sec % s->cluster_secs) << SECTOR_SHIFT);
+}
+
+static int
+schedule_data_read(struct qcow2_state *s, td_request_t treq, uint64_t offset)
+{
+	struct qcow2_request *req;
+
+	req = alloc_qcow2_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq = treq;
+	req->op   = QCOW2_OP_DATA_READ;
+
+	do_aio_read(s, req, treq.buf,
+		    (size_t)treq.secs << SECTOR_SHIFT, offset);
+
+	s->reads++;
+	return 0;
+}
+
+static int
+schedule_compressed_read(struct qcow2_state *s,
+			 td_request_t treq, uint64_t entry)
+{
+	struct qcow2_request *req;
+	uint64_t coffset, start;
+	uint32_t nb_csecs;
+	void *buf;
+	int err;
+
+	coffset  = entry & ((1ULL << s->csize_shift) - 1);
+	nb_csecs = ((entry >> s->csize_shift) & s->csize_mask) + 1;
+	start    = coffset & ~((uint64_t)SECTOR_SIZE - 1);
+
+	err = posix_memalign(&buf, 4096,
+			     ((size_t)nb_csecs + 1) << SECTOR_SHIFT);
+	if (err)
+		return -EBUSY;
+
+	req = alloc_qcow2_request(s);
+	if (!req) {
+		free(buf);
+		return -EBUSY;
+	}
+
+	req->treq  = treq;
+	req->op    = QCOW2_OP_COMPRESSED_READ;
+	req->cbuf  = buf;
+	req->coff  = coffset - start;
+	req->csize = ((uint32_t)nb_csecs << SECTOR_SHIFT) - req->coff;
+
+	do_aio_read(s, req, buf,
+		    qcow2_round_up(req->coff + req->csize, SECTOR_SIZE),
+		    start);
+
+	s->reads++;
+	return 0;
+}
+
+static void
+qcow2_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	struct qcow2_state *s = driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
+	    s->name, treq.sec, treq.secs, treq.sidx);
+
+	while (treq.secs) {
+		uint64_t entry, l2_offset;
+		struct qcow2_l2 *l2;
+		td_request_t clone;
+		int type, err = 0;
+
+		clone = treq;
+		clone.secs = MIN(clone.secs,
+				 s->cluster_secs - (clone.sec % s->cluster_secs));
+
+		type = lookup_cluster(s, clone.sec, &entry, &l2_offset, &l2);
+		switch (type) {
+		case QCOW2_CLUSTER_UNALLOCATED:
+			clone.secs = cluster_span(s, l2, clone.sec, treq.secs,
+						  type, entry);
+			td_forward_request(clone);
+			break;
+
+		case QCOW2_CLUSTER_ZERO:
+			clone.secs = cluster_span(s, l2, clone.sec, treq.secs,
+						  type, entry);
+			memset(clone.buf, 0, (size_t)clone.secs << SECTOR_SHIFT);
+			td_complete_request(clone, 0);
+			break;
+
+		case QCOW2_CLUSTER_NORMAL:
+			clone.secs = cluster_span(s, l2, clone.sec, treq.secs,
+						  type, entry);
+			err = schedule_data_read(s, clone,
+						 host_offset(s, entry, clone.sec));
+			break;
+
+		case QCOW2_CLUSTER_COMPRESSED:
+			err = schedule_compressed_read(s, clone, entry);
+			break;
+
+		case QCOW2_CLUSTER_NOT_CACHED:
+			err = schedule_l2_read(s, l2_offset);
+			if (err)
+				break;
+			/* fall through */
+		case QCOW2_CLUSTER_READ_PENDING:
+			err = queue_on_l2(s, QCOW2_OP_DATA_READ,
+					  clone, l2_offset);
+			break;
+
+		default:
+			err = type;
+			break;
+		}
+
+		if (err) {
+			clone.secs = treq.secs;
+			td_complete_request(clone, err);
+			break;
+		}
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		treq.buf  += (size_t)clone.secs << SECTOR_SHIFT;
+	}
+}
+
+static void
+qcow2_queue_block_status(td_driver_t *driver, td_request_t treq)
+{
+	struct qcow2_state *s = driver->data;
+
+	while (treq.secs) {
+		uint64_t entry, l2_offset;
+		struct qcow2_l2 *l2;
+		td_request_t clone;
+		int type, err = 0;
+
+		clone = treq;
+		clone.secs = MIN(clone.secs,
+				 s->cluster_secs - (clone.sec % s->cluster_secs));
+
+		type = lookup_cluster(s, clone.sec, &entry, &l2_offset, &l2);
+		switch (type) {
+		case QCOW2_CLUSTER_UNALLOCATED:
+			clone.secs = cluster_span(s, l2, clone.sec, treq.secs,
+						  type, entry);
+			td_forward_request(clone);
+			break;
+
+		case QCOW2_CLUSTER_ZERO:
+			clone.secs = cluster_span(s, l2, clone.sec, treq.secs,
+						  type, entry);
+			clone.status = TD_BLOCK_STATE_ZERO;
+			td_complete_request(clone, 0);
+			break;
+
+		case QCOW2_CLUSTER_NORMAL:
+		case QCOW2_CLUSTER_COMPRESSED:
+			clone.secs = cluster_span(s, l2, clone.sec, treq.secs,
+						  type, entry);
+			clone.status = TD_BLOCK_STATE_NONE;
+			td_complete_request(clone, 0);
+			break;
+
+		case QCOW2_CLUSTER_NOT_CACHED:
+			err = schedule_l2_read(s, l2_offset);
+			if (err)
+				break;
+			/* fall through */
+		case QCOW2_CLUSTER_READ_PENDING:
+			err = queue_on_l2(s, QCOW2_OP_BLOCK_STATUS,
+					  clone, l2_offset);
+			break;
+
+		default:
+			err = type;
+			break;
+		}
+
+		if (err) {
+			clone.secs = treq.secs;
+			td_complete_request(clone, err);
+			break;
+		}
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		treq.buf  += (size_t)clone.secs << SECTOR_SHIFT;
+	}
+}
+
+/*
+ * Cluster allocation
+ */
+
+static int
+qcow2_load_refblock(struct qcow2_state *s, uint64_t reft_idx)
+{
+	uint64_t offset;
+	int err;
+
+	offset = be64toh(s->reft[reft_idx]) & QCOW2_REFT_OFFSET_MASK;
+	ASSERT(offset);
+
+	/*
+	 * Synchronous, but we only ever allocate at the end of the file:
+	 * this happens at most once per refcount block worth of growth.
+	 */
+	err = qcow2_pread(s, s->refblock, s->cluster_size, offset);
+	if (err) {
+		ERR(s, err, "%s: reading refcount block at 0x%"PRIx64"\n",
+		    s->name, offset);
+		s->refblock_idx = -1;
+		return err;
+	}
+
+	s->refblock_idx = reft_idx;
+	return 0;
+}
+
+/*
+ * Reserves @n contiguous host clusters at the end of the image, and a
+ * new refcount block ahead of them if their refcounts need one.  Returns
+ * the host offset of the first cluster.  The refcounts themselves are
+ * written by the allocation's refcount update.
+ */
+static int
+qcow2_reserve_clusters(struct qcow2_alloc *a, int n, uint64_t *offset)
+{
+	struct qcow2_state *s = a->state;
+	uint64_t idx, rb, first;
+	int need;
+
+	idx = s->next_cluster >> s->cluster_bits;
+
+	/*
+	 * Keep all refcount updates, including a new refcount block
+	 * describing itself, within a single refcount block.
+	 */
+	for (;;) {
+		rb = idx / s->rb_entries;
+
+		if (rb >= s->reft_entries) {
+			ERR(s, -ENOSPC, "%s: refcount table full\n", s->name);
+			return -ENOSPC;
+		}
+
+		need = n + !(be64toh(s->reft[rb]) & QCOW2_REFT_OFFSET_MASK);
+		if ((idx + need - 1) / s->rb_entries == rb)
+			break;
+
+		idx = (rb + 1) * s->rb_entries;
+	}
+
+	a->reft_idx     = rb;
+	a->new_refblock = 0;
+	first           = idx;
+
+	if (!(be64toh(s->reft[rb]) & QCOW2_REFT_OFFSET_MASK)) {
+		/*
+		 * The new refcount block describes itself.  It is entered
+		 * in the in-memory table right away, so that allocations
+		 * reserved behind this one count their clusters in it; the
+		 * metadata queue writes it out before theirs.
+		 */
+		a->new_refblock    = 1;
+		a->refblock_offset = idx << s->cluster_bits;
+		s->reft[rb]        = htobe64(a->refblock_offset);
+		idx++;
+	}
+
+	a->rc_first = first;
+	a->rc_last  = idx + n - 1;
+
+	s->next_cluster = (idx + n) << s->cluster_bits;
+	*offset = idx << s->cluster_bits;
+
+	return 0;
+}
+
+static inline void
+alloc_write(struct qcow2_alloc *a, int i, char *buf,
+	    size_t size, uint64_t offset)
+{
+	struct qcow2_state *s = a->state;
+	struct qcow2_request *req = &a->reqs[i];
+
+	memset(req, 0, sizeof(*req));
+	req->state = s;
+	req->alloc = a;
+	req->op    = QCOW2_OP_ALLOC_WRITE;
+
+	a->pending++;
+	do_aio_write(s, req, buf, size, offset);
+}
+
+/*
+ * Metadata updates
+ */
+
+static void qcow2_meta_kick(struct qcow2_state *);
+
+static inline void
+meta_write(struct qcow2_alloc *a, char *buf, size_t size, uint64_t offset)
+{
+	struct qcow2_state *s = a->state;
+	struct qcow2_request *req = &a->reqs[2];
+	int io_class;
+
+	memset(req, 0, sizeof(*req));
+	req->state = s;
+	req->alloc = a;
+	req->op    = QCOW2_OP_META_WRITE;
+
+	/* every allocation waits on the queue: never hold it back */
+	io_class = tapdisk_server_set_io_class(TD_VREQ_CLASS_FG);
+	do_aio_write(s, req, buf, size, offset);
+	tapdisk_server_set_io_class(io_class);
+}
+
+/*
+ * Writes the sectors of the cached refcount block holding the refcounts
+ * of host clusters @first to @last.
+ */
+static void
+meta_write_refcounts(struct qcow2_alloc *a, uint64_t first, uint64_t last)
+{
+	struct qcow2_state *s = a->state;
+	uint64_t rb_offset;
+	uint32_t start, end;
+
+	start = ((first % s->rb_entries) * s->rc_bytes) & ~(SECTOR_SIZE - 1);
+	end   = qcow2_round_up((last % s->rb_entries + 1) * s->rc_bytes,
+			       SECTOR_SIZE);
+	rb_offset = be64toh(s->reft[s->refblock_idx]) & QCOW2_REFT_OFFSET_MASK;
+
+	meta_write(a, s->refblock + start, end - start, rb_offset + start);
+}
+
+static int
+qcow2_meta_refcount(struct qcow2_alloc *a)
+{
+	struct qcow2_state *s = a->state;
+	uint64_t c;
+	int err;
+
+	if (s->meta.error)
+		return s->meta.error;
+
+	if (a->new_refblock) {
+		memset(s->refblock, 0, s->cluster_size);
+		s->refblock_idx = a->reft_idx;
+
+		for (c = a->rc_first; c <= a->rc_last; c++)
+			qcow2_set_refcount(s, s->refblock,
+					   c % s->rb_entries, 1);
+
+		meta_write(a, s->refblock, s->cluster_size,
+			   a->refblock_offset);
+		a->meta = QCOW2_META_REFT;
+		return 1;
+	}
+
+	if (s->refblock_idx != (int64_t)a->reft_idx) {
+		err = qcow2_load_refblock(s, a->reft_idx);
+		if (err)
+			return err;
+	}
+
+	for (c = a->rc_first; c <= a->rc_last; c++) {
+		uint32_t e = c % s->rb_entries;
+
+		if (qcow2_get_refcount(s, s->refblock, e)) {
+			ERR(s, -EIO, "%s: cluster 0x%"PRIx64" past the end "
+			    "of the image is in use\n", s->name, c);
+			return -EIO;
+		}
+
+		qcow2_set_refcount(s, s->refblock, e, 1);
+	}
+
+	meta_write_refcounts(a, a->rc_first, a->rc_last);
+	a->meta = QCOW2_META_NONE;
+	return 1;
+}
+
+static int
+qcow2_meta_reft(struct qcow2_alloc *a)
+{
+	struct qcow2_state *s = a->state;
+	uint64_t sec;
+
+	sec = (a->reft_idx * sizeof(uint64_t)) & ~(SECTOR_SIZE - 1);
+	memcpy(a->sec_buf, (char *)s->reft + sec, SECTOR_SIZE);
+
+	meta_write(a, a->sec_buf, SECTOR_SIZE,
+		   s->hdr.refcount_table_offset + sec);
+	a->meta = QCOW2_META_NONE;
+	return 1;
+}
+
+static int
+qcow2_meta_link(struct qcow2_alloc *a)
+{
+	struct qcow2_state *s = a->state;
+	uint64_t sec, offset, entry;
+	uint64_t *table;
+	uint32_t idx;
+
+	if (a->new_l2) {
+		table  = s->l1;
+		idx    = a->l1_idx;
+		offset = s->hdr.l1_table_offset;
+		entry  = a->l2->offset;
+	} else {
+		table  = a->l2->table;
+		idx    = a->l2_idx;
+		offset = a->l2->offset;
+		entry  = a->data_offset;
+	}
+
+	sec = (idx * sizeof(uint64_t)) & ~(SECTOR_SIZE - 1);
+	memcpy(a->sec_buf, (char *)table + sec, SECTOR_SIZE);
+	((uint64_t *)a->sec_buf)[idx % (SECTOR_SIZE / 8)] =
+		htobe64(entry | QCOW2_OFLAG_COPIED);
+
+	meta_write(a, a->sec_buf, SECTOR_SIZE, offset + sec);
+	a->meta = QCOW2_META_NONE;
+	return 1;
+}
+
+/*
+ * Drops the refcounts of the host clusters the replaced entry held, one
+ * refcount block at a time.
+ */
+static int
+qcow2_meta_unref(struct qcow2_alloc *a)
+{
+	struct qcow2_state *s = a->state;
+	uint64_t rb, c, last;
+	int err;
+
+	while (a->unref_first <= a->unref_last) {
+		rb   = a->unref_first / s->rb_entries;
+		last = MIN(a->unref_last, (rb + 1) * s->rb_entries - 1);
+
+		if (rb >= s->reft_entries ||
+		    !(be64toh(s->reft[rb]) & QCOW2_REFT_OFFSET_MASK)) {
+			ERR(s, -EIO, "%s: clusters 0x%"PRIx64"-0x%"PRIx64" "
+			    "have no refcount block\n", s->name,
+			    a->unref_first, last);
+			a->unref_first = last + 1;
+			continue;
+		}
+
+		if (s->refblock_idx != (int64_t)rb) {
+			err = qcow2_load_refblock(s, rb);
+			if (err)
+				return err;
+		}
+
+		for (c = a->unref_first; c <= last; c++) {
+			uint32_t e = c % s->rb_entries;
+			uint64_t rc = qcow2_get_refcount(s, s->refblock, e);
+
+			if (!rc) {
+				ERR(s, -EIO, "%s: cluster 0x%"PRIx64" has no "
+				    "references to drop\n", s->name, c);
+				continue;
+			}
+
+			qcow2_set_refcount(s, s->refblock, e, rc - 1);
+		}
+
+		meta_write_refcounts(a, a->unref_first, last);
+		a->unref_first = last + 1;
+		return 1;
+	}
+
+	a->meta = QCOW2_META_NONE;
+	return 0;
+}
+
+/*
+ * Issues the next write of @a's metadata update.  Returns 1 if one is in
+ * flight, 0 once the update is complete.
+ */
+static int
+qcow2_meta_step(struct qcow2_alloc *a)
+{
+	switch (a->meta) {
+	case QCOW2_META_NONE:
+		return 0;
+	case QCOW2_META_REFCOUNT:
+		return qcow2_meta_refcount(a);
+	case QCOW2_META_REFT:
+		return qcow2_meta_reft(a);
+	case QCOW2_META_LINK:
+		return qcow2_meta_link(a);
+	case QCOW2_META_UNREF:
+		return qcow2_meta_unref(a);
+	default:
+		ASSERT(0);
+		return -EINVAL;
+	}
+}
+
+static void
+qcow2_meta_done(struct qcow2_alloc *a, int err)
+{
+	struct qcow2_state *s = a->state;
+
+	ASSERT(s->meta.busy == a);
+	s->meta.busy = NULL;
+
+	switch (a->phase) {
+	case QCOW2_ALLOC_LINK:
+		if (err)
+			break;
+
+		/* the new mapping is durable, expose it */
+		if (a->new_l2)
+			s->l1[a->l1_idx] =
+				htobe64(a->l2->offset | QCOW2_OFLAG_COPIED);
+		else
+			a->l2->table[a->l2_idx] =
+				htobe64(a->data_offset | QCOW2_OFLAG_COPIED);
+		break;
+
+	case QCOW2_ALLOC_UNREF:
+		/* the guest data is in place, the clusters merely leak */
+		if (err)
+			ERR(s, err, "%s: dropping refcounts of replaced "
+			    "cluster for lsec 0x%08"PRIx64"\n",
+			    s->name, a->treq.sec);
+		err = 0;
+		break;
+
+	default:
+		/*
+		 * The cached refcount block and table may be ahead of the
+		 * disk now: allocations reserved behind this one cannot be
+		 * made durable.
+		 */
+		if (err) {
+			ERR(s, err, "%s: refcount update failed, failing "
+			    "further allocations\n", s->name);
+			s->meta.error   = s->meta.error ? : -EIO;
+			s->refblock_idx = -1;
+		}
+		break;
+	}
+
+	a->error = a->error ? : err;
+	a->pending--;
+
+	qcow2_alloc_continue(a);
+	qcow2_meta_kick(s);
+}
+
+static void
+qcow2_meta_kick(struct qcow2_state *s)
+{
+	struct qcow2_alloc *a;
+	int ret;
+
+	while (!s->meta.busy && s->meta.head) {
+		a = s->meta.head;
+		s->meta.head = a->next;
+		if (!s->meta.head)
+			s->meta.tail = NULL;
+		a->next = NULL;
+
+		s->meta.busy = a;
+
+		ret = qcow2_meta_step(a);
+		if (ret <= 0)
+			qcow2_meta_done(a, ret);
+	}
+}
+
+static void
+qcow2_meta_queue(struct qcow2_alloc *a, int meta)
+{
+	struct qcow2_state *s = a->state;
+
+	a->meta = meta;
+	a->next = NULL;
+	a->pending++;
+
+	if (!s->meta.head)
+		s->meta.head = s->meta.tail = a;
+	else
+		s->meta.tail = s->meta.tail->next = a;
+
+	qcow2_meta_kick(s);
+}
+
+/*
+ * Allocation phases
+ */
+
+static void
+qcow2_alloc_finish(struct qcow2_alloc *a)
+{
+	struct qcow2_state *s = a->state;
+	td_request_t treq = a->treq;
+	int err = a->error;
+
+	a->l2->locked--;
+	if (a->new_l2 && err)
+		free_l2(a->l2);
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", host: 0x%"PRIx64", err: %d\n",
+	    s->name, treq.sec, a->data_offset, err);
+
+	a->phase = QCOW2_ALLOC_IDLE;
+	a->l2    = NULL;
+
+	if (!err)
+		s->allocs++;
+
+	td_complete_request(treq, err);
+}
+
+static void
+qcow2_alloc_data(struct qcow2_alloc *a)
+{
+	struct qcow2_state *s = a->state;
+
+	a->phase = QCOW2_ALLOC_DATA;
+
+	if (a->new_l2) {
+		a->l2->table[a->l2_idx] =
+			htobe64(a->data_offset | QCOW2_OFLAG_COPIED);
+		alloc_write(a, 1, (char *)a->l2->table,
+			    s->cluster_size, a->l2->offset);
+	}
+
+	alloc_write(a, 0, a->buf, s->cluster_size, a->data_offset);
+}
+
+static void
+qcow2_alloc_continue(struct qcow2_alloc *a)
+{
+	if (a->pending)
+		return;
+
+	if (a->error) {
+		qcow2_alloc_finish(a);
+		return;
+	}
+
+	switch (a->phase) {
+	case QCOW2_ALLOC_DATA:
+		a->phase = QCOW2_ALLOC_LINK;
+		qcow2_meta_queue(a, QCOW2_META_LINK);
+		break;
+	case QCOW2_ALLOC_LINK:
+		if (a->unref) {
+			a->phase = QCOW2_ALLOC_UNREF;
+			qcow2_meta_queue(a, QCOW2_META_UNREF);
+			break;
+		}
+		/* fall through */
+	case QCOW2_ALLOC_UNREF:
+		qcow2_alloc_finish(a);
+		break;
+	default:
+		ASSERT(0);
+	}
+}
+
+static void
+__qcow2_cow_read_cb(td_request_t clone, int err)
+{
+	struct qcow2_alloc *a = clone.cb_data;
+	struct qcow2_state *s = a->state;
+
+	ASSERT(a->phase == QCOW2_ALLOC_COW);
+	ASSERT(a->cow_secs >= clone.secs);
+
+	a->cow_secs -= clone.secs;
+	a->error     = a->error ? : err;
+
+	if (a->cow_secs)
+		return;
+
+	a->pending--;
+
+	if (!a->error) {
+		td_request_t *treq = &a->treq;
+		size_t off;
+
+		off = (treq->sec % s->cluster_secs) << SECTOR_SHIFT;
+		memcpy(a->buf + off, treq->buf,
+		       (size_t)treq->secs << SECTOR_SHIFT);
+
+		qcow2_alloc_data(a);
+	}
+
+	qcow2_alloc_continue(a);
+}
+
+/*
+ * Finds an idle allocation for guest cluster @vcluster, unless another
+ * one is already filling it, or creating the L2 table it needs.
+ */
+static struct qcow2_alloc *
+qcow2_get_alloc(struct qcow2_state *s, uint64_t vcluster, uint32_t l1_idx)
+{
+	struct qcow2_alloc *a, *idle = NULL;
+	void *buf;
+	int i;
+
+	for (i = 0; i < QCOW2_ALLOCS; i++) {
+		a = &s->alloc[i];
+
+		if (a->phase == QCOW2_ALLOC_IDLE) {
+			idle = idle ? : a;
+			continue;
+		}
+
+		if (a->vcluster == vcluster ||
+		    (a->new_l2 && a->l1_idx == l1_idx))
+			return NULL;
+	}
+
+	a = idle;
+	if (!a)
+		return NULL;
+
+	if (!a->buf) {
+		if (posix_memalign(&buf, 4096, s->cluster_size))
+			return NULL;
+		a->buf = buf;
+	}
+
+	if (!a->sec_buf) {
+		if (posix_memalign(&buf, 4096, SECTOR_SIZE))
+			return NULL;
+		a->sec_buf = buf;
+	}
+
+	return a;
+}
+
+static int
+qcow2_alloc_cluster(struct qcow2_state *s, td_request_t treq,
+		    struct qcow2_l2 *l2, uint64_t entry)
+{
+	struct qcow2_alloc *a;
+	uint64_t vcluster, offset;
+	td_sector_t start, end;
+	int n, err;
+
+	if (s->meta.error)
+		return s->meta.error;
+
+	vcluster = treq.sec / s->cluster_secs;
+
+	a = qcow2_get_alloc(s, vcluster, vcluster >> s->l2_bits);
+	if (!a)
+		return -EBUSY;
+
+	a->treq         = treq;
+	a->error        = 0;
+	a->pending      = 0;
+	a->vcluster     = vcluster;
+	a->l1_idx       = vcluster >> s->l2_bits;
+	a->l2_idx       = vcluster & (s->l2_entries - 1);
+	a->l2           = l2;
+	a->new_l2       = !l2;
+	a->meta         = QCOW2_META_NONE;
+	a->new_refblock = 0;
+	a->reuse        = 0;
+	a->unref        = 0;
+	a->data_offset  = 0;
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		uint64_t coffset, size;
+
+		/* all host clusters the compressed data touches */
+		coffset = entry & ((1ULL << s->csize_shift) - 1) &
+			~((uint64_t)SECTOR_SIZE - 1);
+		size    = (((entry >> s->csize_shift) & s->csize_mask) + 1)
+			<< SECTOR_SHIFT;
+
+		a->unref       = 1;
+		a->unref_first = coffset >> s->cluster_bits;
+		a->unref_last  = (coffset + size - 1) >> s->cluster_bits;
+	} else if ((entry & QCOW2_OFLAG_ZERO) && (entry & QCOW2_OFFSET_MASK)) {
+		/* zero clusters may come with a preallocated host cluster */
+		if (entry & QCOW2_OFLAG_COPIED) {
+			a->reuse       = 1;
+			a->data_offset = entry & QCOW2_OFFSET_MASK;
+		} else {
+			a->unref       = 1;
+			a->unref_first = (entry & QCOW2_OFFSET_MASK) >>
+				s->cluster_bits;
+			a->unref_last  = a->unref_first;
+		}
+	}
+
+	/* find a cache slot for the new table before reserving clusters */
+	if (a->new_l2) {
+		a->l2 = alloc_l2(s, 0);
+		if (!a->l2)
+			return -EBUSY;
+	}
+
+	n = a->new_l2 + !a->reuse;
+	if (n) {
+		err = qcow2_reserve_clusters(a, n, &offset);
+		if (err)
+			return err;
+
+		if (a->new_l2) {
+			a->l2->offset = offset;
+			memset(a->l2->table, 0, s->cluster_size);
+			offset += s->cluster_size;
+		}
+
+		if (!a->reuse)
+			a->data_offset = offset;
+	}
+
+	a->l2->locked++;
+	a->phase   = QCOW2_ALLOC_COW;
+	a->pending = 1;		/* until the allocation is under way */
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x, l1: %u, "
+	    "l2: %u, host: 0x%"PRIx64", new l2: %d, new refblock: %d\n",
+	    s->name, treq.sec, treq.secs, a->l1_idx, a->l2_idx,
+	    a->data_offset, a->new_l2, a->new_refblock);
+
+	if (n)
+		qcow2_meta_queue(a, QCOW2_META_REFCOUNT);
+
+	if (a->error)
+		goto out;
+
+	start = vcluster * s->cluster_secs;
+	end   = MIN(start + s->cluster_secs, s->driver->info.size);
+
+	if (treq.sec == start && treq.sec + treq.secs >= end) {
+		memset(a->buf, 0, s->cluster_size);
+		memcpy(a->buf, treq.buf, (size_t)treq.secs << SECTOR_SHIFT);
+		qcow2_alloc_data(a);
+		goto out;
+	}
+
+	/*
+	 * Partial cluster write: fetch the old contents, from this image
+	 * or its backing chain, through the regular read path.
+	 */
+	memset(a->buf, 0, s->cluster_size);
+
+	treq.sec     = start;
+	treq.secs    = end - start;
+	treq.buf     = a->buf;
+	treq.op      = TD_OP_READ;
+	treq.cb      = __qcow2_cow_read_cb;
+	treq.cb_data = a;
+
+	a->cow_secs = treq.secs;
+	a->pending++;
+	s->cow_reads++;
+
+	qcow2_queue_read(s->driver, treq);
+
+out:
+	a->pending--;
+	qcow2_alloc_continue(a);
+	return 0;
+}
+
+static int
+schedule_data_write(struct qcow2_state *s, td_request_t treq, uint64_t offset)
+{
+	struct qcow2_request *req;
+
+	req = alloc_qcow2_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq = treq;
+	req->op   = QCOW2_OP_DATA_WRITE;
+
+	do_aio_write(s, req, treq.buf,
+		     (size_t)treq.secs << SECTOR_SHIFT, offset);
+
+	s->writes++;
+	return 0;
+}
+
+static void
+qcow2_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	struct qcow2_state *s = driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
+	    s->name, treq.sec, treq.secs, treq.sidx);
+
+	while (treq.secs) {
+		uint64_t entry, l2_offset;
+		struct qcow2_l2 *l2;
+		td_request_t clone;
+		int type, err = 0;
+
+		clone = treq;
+		clone.secs = MIN(clone.secs,
+				 s->cluster_secs - (clone.sec % s->cluster_secs));
+
+		type = lookup_cluster(s, clone.sec, &entry, &l2_offset, &l2);
+		switch (type) {
+		case QCOW2_CLUSTER_NORMAL:
+			clone.secs = cluster_span(s, l2, clone.sec, treq.secs,
+						  type, entry);
+			err = schedule_data_write(s, clone,
+						  host_offset(s, entry, clone.sec));
+			break;
+
+		case QCOW2_CLUSTER_UNALLOCATED:
+		case QCOW2_CLUSTER_ZERO:
+		case QCOW2_CLUSTER_COMPRESSED:
+			err = qcow2_alloc_cluster(s, clone, l2, entry);
+			break;
+
+		case QCOW2_CLUSTER_NOT_CACHED:
+			err = schedule_l2_read(s, l2_offset);
+			if (err)
+				break;
+			/* fall through */
+		case QCOW2_CLUSTER_READ_PENDING:
+			err = queue_on_l2(s, QCOW2_OP_DATA_WRITE,
+					  clone, l2_offset);
+			break;
+
+		default:
+			err = type;
+			break;
+		}
+
+		if (err) {
+			clone.secs = treq.secs;
+			td_complete_request(clone, err);
+			break;
+		}
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		treq.buf  += (size_t)clone.secs << SECTOR_SHIFT;
+	}
+}
+
+/*
+ * Completions
+ */
+
+static void
+finish_l2_read(struct qcow2_request *req)
+{
+	struct qcow2_state *s = req->state;
+	struct qcow2_l2 *l2 = container_of(req, struct qcow2_l2, req);
+	struct qcow2_request *r, *next;
+	int err = req->error;
+
+	r = l2->waiting.head;
+	clear_req_list(&l2->waiting);
+	clear_qcow2_flag(l2->status, QCOW2_FLAG_L2_READ_PENDING);
+
+	if (err)
+		free_l2(l2);
+
+	while (r) {
+		td_request_t treq = r->treq;
+		uint8_t op = r->op;
+
+		next = r->next;
+		free_qcow2_request(s, r);
+
+		if (err)
+			td_complete_request(treq, err);
+		else if (op == QCOW2_OP_DATA_READ)
+			qcow2_queue_read(s->driver, treq);
+		else if (op == QCOW2_OP_DATA_WRITE)
+			qcow2_queue_write(s->driver, treq);
+		else
+			qcow2_queue_block_status(s->driver, treq);
+
+		r = next;
+	}
+}
+
+static int
+qcow2_inflate(struct qcow2_state *s, struct qcow2_request *req, char *out)
+{
+	z_stream strm;
+	int ret;
+
+	memset(&strm, 0, sizeof(strm));
+	strm.next_in   = (Bytef *)req->cbuf + req->coff;
+	strm.avail_in  = req->csize;
+	strm.next_out  = (Bytef *)out;
+	strm.avail_out = s->cluster_size;
+
+	ret = inflateInit2(&strm, -12);
+	if (ret != Z_OK)
+		return -ENOMEM;
+
+	ret = inflate(&strm, Z_FINISH);
+	inflateEnd(&strm);
+
+	if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+	    strm.avail_out)
+		return -EIO;
+
+	return 0;
+}
+
+static void
+finish_compressed_read(struct qcow2_request *req)
+{
+	struct qcow2_state *s = req->state;
+	td_request_t treq = req->treq;
+	int err = req->error;
+	char *out = NULL;
+
+	if (!err) {
+		out = malloc(s->cluster_size);
+		err = out ? qcow2_inflate(s, req, out) : -ENOMEM;
+	}
+
+	if (!err)
+		memcpy(treq.buf,
+		       out + ((treq.sec % s->cluster_secs) << SECTOR_SHIFT),
+		       (size_t)treq.secs << SECTOR_SHIFT);
+	else
+		ERR(s, err, "%s: decompressing lsec 0x%08"PRIx64"\n",
+		    s->name, treq.sec);
+
+	free(out);
+	free(req->cbuf);
+	free_qcow2_request(s, req);
+
+	td_complete_request(treq, err);
+}
+
+static void
+finish_alloc_write(struct qcow2_request *req)
+{
+	struct qcow2_state *s = req->state;
+	struct qcow2_alloc *a = req->alloc;
+
+	if (req->error)
+		ERR(s, req->error, "%s: allocation phase %d failed\n",
+		    s->name, a->phase);
+
+	a->error = a->error ? : req->error;
+	a->pending--;
+
+	qcow2_alloc_continue(a);
+}
+
+static void
+finish_meta_write(struct qcow2_request *req)
+{
+	struct qcow2_state *s = req->state;
+	struct qcow2_alloc *a = req->alloc;
+	int ret;
+
+	if (req->error) {
+		ERR(s, req->error, "%s: metadata update in allocation "
+		    "phase %d failed\n", s->name, a->phase);
+		qcow2_meta_done(a, req->error);
+		return;
+	}
+
+	ret = qcow2_meta_step(a);
+	if (ret <= 0)
+		qcow2_meta_done(a, ret);
+}
+
+static void
+qcow2_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct qcow2_request *req = arg;
+	struct qcow2_state *s = req->state;
+	td_request_t treq;
+
+	s->completed++;
+	req->error = err;
+
+	switch (req->op) {
+	case QCOW2_OP_DATA_READ:
+	case QCOW2_OP_DATA_WRITE:
+		if (err)
+			ERR(s, err, "%s: op: %u, lsec: %"PRIu64", secs: %u\n",
+			    s->name, req->op, req->treq.sec, req->treq.secs);
+		treq = req->treq;
+		free_qcow2_request(s, req);
+		td_complete_request(treq, err);
+		break;
+
+	case QCOW2_OP_L2_READ:
+		finish_l2_read(req);
+		break;
+
+	case QCOW2_OP_COMPRESSED_READ:
+		finish_compressed_read(req);
+		break;
+
+	case QCOW2_OP_ALLOC_WRITE:
+		finish_alloc_write(req);
+		break;
+
+	case QCOW2_OP_META_WRITE:
+		finish_meta_write(req);
+		break;
+
+	default:
+		ASSERT(0);
+	}
+}
+
+static void
+qcow2_debug(td_driver_t *driver)
+{
+	struct qcow2_state *s = driver->data;
+	int i;
+
+	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64
+	    ", FREE REQS: %d/%d\n", s->name, s->queued, s->completed,
+	    s->req_free_count, QCOW2_REQS_DATA);
+	DBG(TLOG_WARN, "READS: %"PRIu64", WRITES: %"PRIu64", ALLOCS: %"PRIu64
+	    ", COW READS: %"PRIu64", NEXT: 0x%"PRIx64"\n", s->reads, s->writes,
+	    s->allocs, s->cow_reads, s->next_cluster);
+	DBG(TLOG_WARN, "META: busy: %p, head: %p, err: %d\n",
+	    s->meta.busy, s->meta.head, s->meta.error);
+
+	for (i = 0; i < QCOW2_ALLOCS; i++) {
+		struct qcow2_alloc *a = &s->alloc[i];
+		if (a->phase != QCOW2_ALLOC_IDLE)
+			DBG(TLOG_WARN, "ALLOC %d: phase: %d, pending: %d, "
+			    "meta: %d, err: %d, lsec: 0x%08"PRIx64", "
+			    "host: 0x%"PRIx64"\n", i, a->phase, a->pending,
+			    a->meta, a->error, a->treq.sec, a->data_offset);
+	}
+
+	for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++) {
+		struct qcow2_l2 *l2 = &s->l2_cache[i];
+		if (l2->offset)
+			DBG(TLOG_WARN, "L2 %d: offset: 0x%"PRIx64", "
+			    "status: 0x%x, locked: %d, waiting: %p\n", i,
+			    l2->offset, l2->status, l2->locked,
+			    l2->waiting.head);
+	}
+}
+
+static void
+qcow2_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct qcow2_state *s = driver->data;
+
+	tapdisk_stats_field(st, "reqs", "{");
+	tapdisk_stats_field(st, "max", "d", QCOW2_REQS_DATA);
+	tapdisk_stats_field(st, "pending", "d",
+			    QCOW2_REQS_DATA - s->req_free_count);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "l2_cache", "{");
+	tapdisk_stats_field(st, "hits", "llu", s->l2_hits);
+	tapdisk_stats_field(st, "misses", "llu", s->l2_misses);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "allocs", "llu", s->allocs);
+	tapdisk_stats_field(st, "cow_reads", "llu", s->cow_reads);
+}
+
+struct tap_disk tapdisk_qcow = {
+	.disk_type          = "tapdisk_qcow",
+	.flags              = 0,
+	.private_data_size  = sizeof(struct qcow2_state),
+	.td_open            = qcow2_open,
+	.td_close           = qcow2_close,
+	.td_queue_read      = qcow2_queue_read,
+	.td_queue_block_status
+			    = qcow2_queue_block_status,
+	.td_queue_write     = qcow2_queue_write,
+	.td_get_parent_id   = qcow2_get_parent_id,
+	.td_validate_parent = qcow2_validate_parent,
+	.td_debug           = qcow2_debug,
+	.td_stats           = qcow2_stats,
+};
@@ -0,0 +1,571 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Read-ahead filter. Tracks a few concurrent sequential read streams,
+ * and once a stream looks sequential, prefetches ahead of it with a
+ * window doubling on every further sequential read. Prefetched data
+ * is kept in a fixed pool of buffers (the memory budget) and handed to
+ * the guest reads that follow; writes drop whatever they overlap.
+ *
+ * Prefetches are issued as VBD requests of their own, in the
+ * background class, so they queue, retry and quiesce like guest I/O
+ * without competing with it. They are told apart from guest reads by
+ * their token when they come back through this filter.
+ *
+ * Writes are tracked until they complete below. A prefetch is not
+ * issued over a write still in flight, and one already issued when an
+ * overlapping write arrives is discarded, so a prefetch can never
+ * capture data from before a write the guest has already sent.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tapdisk.h"
+#include "tapdisk-utils.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-vbd.h"
+
+#define DBG(_f, _a...) tlog_syslog(TLOG_DBG, _f, ##_a)
+#define INFO(_f, _a...) tlog_syslog(TLOG_INFO, _f, ##_a)
+
+#define MIN(a, b)       ((a) < (b) ? (a) : (b))
+#define MAX(a, b)       ((a) > (b) ? (a) : (b))
+
+#define RA_STREAMS              8
+#define RA_TRIGGER              2     /* sequential reads before prefetching */
+#define RA_STREAM_GAP           64    /* sectors skipped, still sequential */
+#define RA_MIN_WINDOW           128   /* sectors: 64KiB */
+#define RA_MAX_WINDOW           8192  /* sectors: 4MiB */
+#define RA_SLOT_SECS            2048  /* sectors: 1MiB per buffer */
+#define RA_SLOT_SIZE            ((size_t)RA_SLOT_SECS << SECTOR_SHIFT)
+#define RA_MAX_WAITERS          8
+#define RA_DEFAULT_BUDGET       16    /* MiB */
+#define RA_MAX_SLOTS            256
+
+typedef struct td_readahead td_readahead_t;
+typedef struct ra_slot ra_slot_t;
+
+struct ra_stream {
+	td_sector_t             next;
+	td_sector_t             ra_next;
+	int                     hits;
+	int                     window;
+	uint64_t                seqno;
+};
+
+enum {
+	RA_SLOT_FREE = 0,
+	RA_SLOT_PENDING,
+	RA_SLOT_VALID,
+};
+
+struct ra_slot {
+	td_readahead_t         *ra;
+	int                     state;
+	int                     stale;
+
+	td_sector_t             sec;
+	int                     secs;
+	td_sector_t             served;
+	uint64_t                seqno;
+
+	char                   *buf;
+	struct td_iovec         iov;
+	td_vbd_request_t        vreq;
+
+	td_request_t            waiters[RA_MAX_WAITERS];
+	int                     n_waiters;
+};
+
+struct ra_write {
+	td_request_t            treq;
+	int                     secs;     /* still in flight */
+	struct list_head        entry;
+};
+
+struct td_readahead {
+	uint64_t                seqno;
+
+	struct list_head        writes;
+
+	struct ra_stream        streams[RA_STREAMS];
+
+	int                     n_slots;
+	ra_slot_t               slots[RA_MAX_SLOTS];
+
+	struct {
+		unsigned long long      hits;
+		unsigned long long      waits;
+		unsigned long long      misses;
+		unsigned long long      prefetches;
+		unsigned long long      prefetched;
+		unsigned long long      wasted;
+		unsigned long long      deferred;
+		unsigned long long      errors;
+	} stats;
+};
+
+static void
+ra_slot_release(td_readahead_t *ra, ra_slot_t *slot)
+{
+	if (slot->state == RA_SLOT_VALID && slot->served < slot->sec + slot->secs)
+		ra->stats.wasted += slot->sec + slot->secs - slot->served;
+
+	slot->state     = RA_SLOT_FREE;
+	slot->stale     = 0;
+	slot->n_waiters = 0;
+}
+
+static ra_slot_t *
+ra_find_slot(td_readahead_t *ra, td_sector_t sec, int secs)
+{
+	ra_slot_t *slot;
+	int i;
+
+	for (i = 0; i < ra->n_slots; i++) {
+		slot = &ra->slots[i];
+		if (slot->state == RA_SLOT_FREE || slot->stale)
+			continue;
+		if (slot->sec <= sec && sec + secs <= slot->sec + slot->secs)
+			return slot;
+	}
+
+	return NULL;
+}
+
+/*
+ * A free buffer, or else the least recently used one holding data.
+ * Buffers still being filled are never taken.
+ */
+static ra_slot_t *
+ra_get_slot(td_readahead_t *ra)
+{
+	ra_slot_t *slot, *lru = NULL;
+	int i;
+
+	for (i = 0; i < ra->n_slots; i++) {
+		slot = &ra->slots[i];
+		if (slot->state == RA_SLOT_FREE)
+			return slot;
+		if (slot->state == RA_SLOT_VALID &&
+		    (!lru || slot->seqno < lru->seqno))
+			lru = slot;
+	}
+
+	if (lru)
+		ra_slot_release(ra, lru);
+
+	return lru;
+}
+
+static void
+ra_slot_serve(td_readahead_t *ra, ra_slot_t *slot, td_request_t treq)
+{
+	size_t off = (size_t)(treq.sec - slot->sec) << SECTOR_SHIFT;
+
+	memcpy(treq.buf, slot->buf + off, (size_t)treq.secs << SECTOR_SHIFT);
+	td_complete_request(treq, 0);
+
+	slot->seqno  = ++ra->seqno;
+	slot->served = MAX(slot->served, treq.sec + treq.secs);
+
+	/* sequential readers don't come back: recycle it right away */
+	if (slot->served >= slot->sec + slot->secs)
+		ra_slot_release(ra, slot);
+}
+
+static void
+__ra_prefetch_cb(td_vbd_request_t *vreq, int err, void *token, int final)
+{
+	ra_slot_t *slot = container_of(vreq, ra_slot_t, vreq);
+	td_readahead_t *ra = token;
+	td_request_t waiters[RA_MAX_WAITERS];
+	int i, n;
+
+	n = slot->n_waiters;
+	memcpy(waiters, slot->waiters, n * sizeof(td_request_t));
+	slot->n_waiters = 0;
+
+	if (err || slot->stale) {
+		if (err)
+			ra->stats.errors++;
+		ra_slot_release(ra, slot);
+
+		for (i = 0; i < n; i++)
+			td_forward_request(waiters[i]);
+		return;
+	}
+
+	slot->state = RA_SLOT_VALID;
+	slot->seqno = ++ra->seqno;
+
+	for (i = 0; i < n; i++) {
+		/* an earlier waiter may have consumed the buffer */
+		if (slot->state == RA_SLOT_VALID)
+			ra_slot_serve(ra, slot, waiters[i]);
+		else
+			td_forward_request(waiters[i]);
+	}
+}
+
+static int
+ra_write_pending(td_readahead_t *ra, td_sector_t sec, int secs)
+{
+	struct ra_write *w;
+
+	list_for_each_entry(w, &ra->writes, entry)
+		if (w->treq.sec < sec + secs &&
+		    sec < w->treq.sec + w->treq.secs)
+			return 1;
+
+	return 0;
+}
+
+static int
+ra_prefetch(td_readahead_t *ra, td_vbd_t *vbd, td_sector_t sec, int secs)
+{
+	td_vbd_request_t *vreq;
+	ra_slot_t *slot;
+	int err;
+
+	/* it could read what the write is about to replace */
+	if (ra_write_pending(ra, sec, secs)) {
+		ra->stats.deferred++;
+		return -EBUSY;
+	}
+
+	slot = ra_get_slot(ra);
+	if (!slot)
+		return -EBUSY;
+
+	if (!slot->buf) {
+		err = posix_memalign((void **)&slot->buf, 4096, RA_SLOT_SIZE);
+		if (err) {
+			slot->buf = NULL;
+			return -err;
+		}
+	}
+
+	slot->state  = RA_SLOT_PENDING;
+	slot->stale  = 0;
+	slot->sec    = sec;
+	slot->secs   = secs;
+	slot->served = sec;
+
+	slot->iov.base = slot->buf;
+	slot->iov.secs = secs;
+
+	vreq         = &slot->vreq;
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = sec;
+	vreq->iov    = &slot->iov;
+	vreq->iovcnt = 1;
+	vreq->io_class = TD_VREQ_CLASS_BG;
+	vreq->cb     = __ra_prefetch_cb;
+	vreq->token  = ra;
+	vreq->name   = "readahead";
+
+	err = tapdisk_vbd_queue_request(vbd, vreq);
+	if (err) {
+		slot->state = RA_SLOT_FREE;
+		return err;
+	}
+
+	ra->stats.prefetches++;
+	ra->stats.prefetched += secs;
+
+	return 0;
+}
+
+/*
+ * Matches the read against the known streams, replacing the least
+ * recently used one if it starts a new stream.
+ */
+static struct ra_stream *
+ra_track_stream(td_readahead_t *ra, td_sector_t sec, int secs)
+{
+	struct ra_stream *st, *lru = NULL;
+	int i;
+
+	for (i = 0; i < RA_STREAMS; i++) {
+		st = &ra->streams[i];
+		if (st->hits >= 0 && st->seqno &&
+		    sec >= st->next && sec - st->next <= RA_STREAM_GAP) {
+			st->hits++;
+			if (st->hits > RA_TRIGGER)
+				st->window = MIN(st->window * 2, RA_MAX_WINDOW);
+			goto out;
+		}
+		if (!lru || st->seqno < lru->seqno)
+			lru = st;
+	}
+
+	st          = lru;
+	st->hits    = 0;
+	st->window  = RA_MIN_WINDOW;
+	st->ra_next = sec + secs;
+
+out:
+	st->next  = sec + secs;
+	st->seqno = ++ra->seqno;
+	return st;
+}
+
+static void
+ra_advance(td_readahead_t *ra, td_driver_t *driver, td_vbd_t *vbd,
+	   struct ra_stream *st)
+{
+	td_sector_t size = driver->info.size;
+	int secs, window;
+
+	if (st->hits < RA_TRIGGER)
+		return;
+
+	/* leave room in the budget for other streams */
+	window = MIN(st->window, MAX(ra->n_slots / 2, 1) * RA_SLOT_SECS);
+
+	st->ra_next = MAX(st->ra_next, st->next);
+
+	while (st->ra_next < st->next + window && st->ra_next < size) {
+		secs = MIN(RA_SLOT_SECS, size - st->ra_next);
+		if (ra_prefetch(ra, vbd, st->ra_next, secs))
+			break;
+		st->ra_next += secs;
+	}
+}
+
+static void
+ra_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	td_readahead_t *ra = driver->data;
+	struct ra_stream *st;
+	ra_slot_t *slot;
+
+	/* our own prefetch on its way down */
+	if (treq.vreq->token == ra) {
+		td_forward_request(treq);
+		return;
+	}
+
+	st   = ra_track_stream(ra, treq.sec, treq.secs);
+	slot = ra_find_slot(ra, treq.sec, treq.secs);
+
+	if (slot && slot->state == RA_SLOT_VALID) {
+		ra->stats.hits++;
+		ra_slot_serve(ra, slot, treq);
+	} else if (slot && slot->n_waiters < RA_MAX_WAITERS) {
+		ra->stats.waits++;
+		slot->waiters[slot->n_waiters++] = treq;
+	} else {
+		ra->stats.misses++;
+		td_forward_request(treq);
+	}
+
+	ra_advance(ra, driver, treq.vreq->vbd, st);
+}
+
+static void
+__ra_write_done(td_request_t treq, int err)
+{
+	struct ra_write *w = treq.cb_data;
+
+	w->secs -= treq.secs;
+	if (!w->secs)
+		list_del(&w->entry);
+
+	treq.cb      = w->treq.cb;
+	treq.cb_data = w->treq.cb_data;
+	td_complete_request(treq, err);
+
+	if (!w->secs)
+		free(w);
+}
+
+static void
+ra_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	td_readahead_t *ra = driver->data;
+	struct ra_write *w;
+	td_request_t clone;
+	ra_slot_t *slot;
+	int i;
+
+	w = malloc(sizeof(*w));
+	if (!w) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	for (i = 0; i < ra->n_slots; i++) {
+		slot = &ra->slots[i];
+		if (slot->state == RA_SLOT_FREE ||
+		    slot->sec >= treq.sec + treq.secs ||
+		    treq.sec >= slot->sec + slot->secs)
+			continue;
+
+		if (slot->state == RA_SLOT_PENDING)
+			slot->stale = 1;
+		else
+			ra_slot_release(ra, slot);
+	}
+
+	w->treq = treq;
+	w->secs = treq.secs;
+	list_add_tail(&w->entry, &ra->writes);
+
+	clone         = treq;
+	clone.cb      = __ra_write_done;
+	clone.cb_data = w;
+	td_forward_request(clone);
+}
+
+static void
+ra_queue_block_status(td_driver_t *driver, td_request_t treq)
+{
+	td_forward_request(treq);
+}
+
+static int
+ra_close(td_driver_t *driver)
+{
+	td_readahead_t *ra = driver->data;
+	ra_slot_t *slot;
+	int i;
+
+	for (i = 0; i < ra->n_slots; i++) {
+		slot = &ra->slots[i];
+
+		/* prefetches the VBD never got to issue */
+		if (slot->state == RA_SLOT_PENDING)
+			list_del(&slot->vreq.next);
+
+		free(slot->buf);
+		slot->buf = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * The name is the memory budget in MiB; anything else selects the
+ * default.
+ */
+static int
+ra_open(td_driver_t *driver, const char *name,
+	struct td_vbd_encryption *encryption, td_flag_t flags)
+{
+	td_readahead_t *ra = driver->data;
+	unsigned long budget;
+	int i;
+
+	memset(ra, 0, sizeof(*ra));
+	INIT_LIST_HEAD(&ra->writes);
+
+	budget = name ? strtoul(name, NULL, 10) : 0;
+	if (!budget)
+		budget = RA_DEFAULT_BUDGET;
+
+	ra->n_slots = MIN(MAX(budget, 1), RA_MAX_SLOTS);
+	for (i = 0; i < ra->n_slots; i++)
+		ra->slots[i].ra = ra;
+
+	INFO("readahead: %d streams, %d x %zu byte buffers\n",
+	     RA_STREAMS, ra->n_slots, RA_SLOT_SIZE);
+
+	return 0;
+}
+
+static int
+ra_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	return -EINVAL;
+}
+
+static int
+ra_validate_parent(td_driver_t *driver,
+		   td_driver_t *pdriver, td_flag_t flags)
+{
+	return 0;
+}
+
+static void
+ra_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_readahead_t *ra = driver->data;
+	int i, pending = 0, valid = 0, streams = 0;
+
+	for (i = 0; i < ra->n_slots; i++) {
+		pending += ra->slots[i].state == RA_SLOT_PENDING;
+		valid   += ra->slots[i].state == RA_SLOT_VALID;
+	}
+
+	for (i = 0; i < RA_STREAMS; i++)
+		streams += ra->streams[i].hits >= RA_TRIGGER;
+
+	tapdisk_stats_field(st, "buffers", "[");
+	tapdisk_stats_val(st, "d", ra->n_slots);
+	tapdisk_stats_val(st, "d", pending);
+	tapdisk_stats_val(st, "d", valid);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "streams", "d", streams);
+	tapdisk_stats_field(st, "hits", "llu", ra->stats.hits);
+	tapdisk_stats_field(st, "waits", "llu", ra->stats.waits);
+	tapdisk_stats_field(st, "misses", "llu", ra->stats.misses);
+	tapdisk_stats_field(st, "prefetches", "llu", ra->stats.prefetches);
+	tapdisk_stats_field(st, "prefetched", "llu", ra->stats.prefetched);
+	tapdisk_stats_field(st, "wasted", "llu", ra->stats.wasted);
+	tapdisk_stats_field(st, "deferred", "llu", ra->stats.deferred);
+	tapdisk_stats_field(st, "errors", "llu", ra->stats.errors);
+}
+
+struct tap_disk tapdisk_readahead = {
+	.disk_type                  = "tapdisk_readahead",
+	.flags                      = 0,
+	.private_data_size          = sizeof(td_readahead_t),
+	.td_open                    = ra_open,
+	.td_close                   = ra_close,
+	.td_queue_read              = ra_queue_read,
+	.td_queue_write             = ra_queue_write,
+	.td_queue_block_status      = ra_queue_block_status,
+	.td_get_parent_id           = ra_get_parent_id,
+	.td_validate_parent         = ra_validate_parent,
+	.td_stats                   = ra_stats,
+};
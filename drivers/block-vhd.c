@@ -44,9 +44,16 @@
  *   - BAT and bitmap updates: data writes are grouped in transactions
  *     as above, but a special extra write is included in the transaction,
  *     which zeros out the newly allocated bitmap on disk.  When the data
- *     writes and the zero-bitmap write complete, the BAT and bitmap writes
- *     are started in parallel.  The transaction is completed only after both
- *     the BAT and bitmap writes successfully return.
+ *     writes and the zero-bitmap write complete, the bitmap is written,
+ *     and only then the BAT.  The transaction is completed only after the
+ *     BAT write successfully returns.  Preallocated blocks are zeroed
+ *     already, so there the BAT write goes out along with the data.
+ *
+ * Several blocks may be allocated at once.  Each reserves its space from
+ * next_db up front, and waits for a BAT write once its bitmap is on disk.
+ * Allocations falling in the same BAT sector are committed by a single
+ * write, and at most one write per BAT sector is in flight, so later
+ * writes always carry the entries of earlier ones.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -75,6 +82,7 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-storage.h"
+#include "tapdisk-syncer.h"
 #include "block-crypto.h"
 
 unsigned int SPB;
@@ -88,10 +96,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%u, BBLK: 0x%04x\n",				\
+		    "%u, ALLOCATING: %d\n",				\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.allocating);					\
 	} while(0)
 
 #if (DEBUGGING == 1)
@@ -112,7 +120,13 @@ unsigned int SPB;
 #define VHD_CACHE_SIZE               32
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
+#define VHD_BAT_WRITES               8     /* bat sectors written at once */
+#define VHD_MAX_ALLOCATIONS          (VHD_CACHE_SIZE / 2)
+#define VHD_PROV_WRITES              4     /* zeroing writes in flight */
+#define VHD_PROV_BLOCKS              4     /* blocks kept zeroed ahead */
+#define VHD_PROV_BLOCKS_MAX          1024
+#define VHD_REQS_META                (VHD_CACHE_SIZE + VHD_BAT_WRITES + \
+				      VHD_PROV_WRITES)
 #define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
 #define VHD_OP_BAT_WRITE             0
@@ -123,6 +137,7 @@ unsigned int SPB;
 #define VHD_OP_ZERO_BM_WRITE         5
 #define VHD_OP_REDUNDANT_BM_WRITE    6
 #define VHD_OP_BLOCK_STATUS          7
+#define VHD_OP_PROVISION             8
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -139,14 +154,13 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_PREALLOCATE    32
 #define VHD_FLAG_OPEN_NO_O_DIRECT    64
 #define VHD_FLAG_OPEN_LOCAL_CACHE    128
-
-#define VHD_FLAG_BAT_LOCKED          1
-#define VHD_FLAG_BAT_WRITE_STARTED   2
+#define VHD_FLAG_OPEN_BUFFERED       256
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_ALLOCATING       16
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
@@ -155,8 +169,9 @@ unsigned int SPB;
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
+#define VHD_FLAG_TX_WAIT_BAT         4
 
-typedef uint8_t vhd_flag_t;
+typedef uint16_t vhd_flag_t;
 
 struct vhd_state;
 struct vhd_request;
@@ -181,21 +196,43 @@ struct vhd_request {
 	vhd_flag_t                flags;
 	td_request_t              treq;
 	char			 *orig_buf;
+	uint64_t                  offset;      /* of writes, in bytes */
 	struct tiocb              tiocb;
+	struct td_sync_waiter     waiter;
 	struct vhd_state         *state;
 	struct vhd_request       *next;
 	struct vhd_transaction   *tx;
 };
 
+struct vhd_bat_write {
+	struct vhd_request        req;
+	char                     *buf;
+	uint32_t                  sector;      /* bat sector being written */
+	struct vhd_bitmap        *blks;        /* allocations it commits */
+};
+
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
-	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
-	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
-	char                     *bat_buf;
+	int                       allocating;  /* blocks being allocated */
+	struct vhd_bitmap        *queue;       /* allocations waiting for
+						* a bat write */
+	struct vhd_bat_write      writes[VHD_BAT_WRITES];
+};
+
+struct vhd_prov_write {
+	struct vhd_request        req;
+	uint64_t                  start;       /* first sector zeroed */
+	int                       busy;
+	int                       done;
+};
+
+struct vhd_prov_state {
+	uint64_t                  ready;       /* zeroed up to this sector */
+	uint64_t                  next;        /* zeroing issued up to here */
+	int                       target;      /* blocks to keep ready */
+	int                       error;
+	struct vhd_prov_write     writes[VHD_PROV_WRITES];
 };
 
 struct vhd_bitmap {
@@ -218,6 +255,13 @@ struct vhd_bitmap {
 					        * be serviced until this bitmap
 					        * is read from disk */
 	struct vhd_request        req;
+
+	uint64_t                  pbw_offset;  /* sector of the block being
+						* allocated, until its bat
+						* entry is on disk */
+	struct vhd_request        alloc_req;   /* zeroes the new bitmap */
+	struct vhd_bitmap        *bat_next;    /* next allocation in the
+						* same bat queue or write */
 };
 
 struct vhd_state {
@@ -225,6 +269,8 @@ struct vhd_state {
 
         /* VHD stuff */
 	vhd_context_t             vhd;
+	struct td_syncer          syncer;      /* group commit, when
+						* buffered */
 	uint32_t                  spp;         /* sectors per page */
 	uint32_t                  spb;         /* sectors per block */
 	uint64_t                  first_db;    /* pointer to datablock 0 */
@@ -236,6 +282,7 @@ struct vhd_state {
 	uint64_t                  next_db;
 
 	struct vhd_bat_state      bat;
+	struct vhd_prov_state     prov;
 
 	uint64_t                  bm_lru;      /* lru sequence number */
 	uint32_t                  bm_secs;     /* size of bitmap, in sectors */
@@ -457,8 +504,35 @@ vhd_free_bat(struct vhd_state *s)
 {
 	free(s->bat.bat.bat);
 	free(s->bat.batmap.map);
-	free(s->bat.bat_buf);
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	free(s->bat.writes[0].buf);
+	memset(&s->bat, 0, sizeof(s->bat));
+}
+
+/*
+ * Blocks to keep zeroed ahead, unless TAPDISK_VHD_PROVISION_BLOCKS
+ * holds a number from 1 to VHD_PROV_BLOCKS_MAX.
+ */
+static int
+vhd_provision_target(struct vhd_state *s)
+{
+	unsigned long val;
+	const char *env;
+	char *end;
+
+	env = getenv("TAPDISK_VHD_PROVISION_BLOCKS");
+	if (!env)
+		return VHD_PROV_BLOCKS;
+
+	errno = 0;
+	val   = strtoul(env, &end, 10);
+	if (errno || end == env || *end || !val || val > VHD_PROV_BLOCKS_MAX) {
+		EPRINTF("%s: ignoring TAPDISK_VHD_PROVISION_BLOCKS=%s, "
+			"expected 1-%d\n", s->vhd.file, env,
+			VHD_PROV_BLOCKS_MAX);
+		return VHD_PROV_BLOCKS;
+	}
+
+	return val;
 }
 
 static int
@@ -467,7 +541,8 @@ vhd_initialize_bat(struct vhd_state *s)
 	int err, batmap_required, i;
 	void *buf;
 
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	memset(&s->bat, 0, sizeof(s->bat));
+	memset(&s->prov, 0, sizeof(s->prov));
 
 	err = vhd_read_bat(&s->vhd, &s->bat.bat);
 	if (err) {
@@ -482,6 +557,10 @@ vhd_initialize_bat(struct vhd_state *s)
 		err = find_next_free_block(s);
 		if (err)
 			goto fail;
+
+		s->prov.target     = vhd_provision_target(s);
+		s->prov.ready      = s->next_db;
+		s->prov.next       = s->next_db;
 	}
 
 	if (vhd_has_batmap(&s->vhd)) {
@@ -501,11 +580,13 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
-	err = posix_memalign(&buf, VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE,
+			     VHD_BAT_WRITES * VHD_SECTOR_SIZE);
 	if (err)
 		goto fail;
 
-	s->bat.bat_buf = buf;
+	for (i = 0; i < VHD_BAT_WRITES; i++)
+		s->bat.writes[i].buf = (char *)buf + i * VHD_SECTOR_SIZE;
 
 	return 0;
 
@@ -806,6 +887,9 @@ __vhd_open(td_driver_t *driver, const char *name,
 	    test_vhd_flag(flags, VHD_FLAG_OPEN_NO_O_DIRECT))
 		set_vhd_flag(o_flags, VHD_OPEN_CACHED);
 
+	if (test_vhd_flag(flags, VHD_FLAG_OPEN_BUFFERED))
+		set_vhd_flag(o_flags, VHD_OPEN_BUFFERED);
+
 	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT))
 		set_vhd_flag(o_flags, VHD_OPEN_STRICT);
 
@@ -819,6 +903,18 @@ __vhd_open(td_driver_t *driver, const char *name,
 		}
 	}
 
+	/*
+	 * Only writes to a buffered image proper need syncing: a leaf
+	 * cache opened without O_DIRECT holds nothing it cannot lose.
+	 */
+	td_syncer_init(&s->syncer, s->vhd.fd,
+		       test_vhd_flag(flags, VHD_FLAG_OPEN_BUFFERED) &&
+		       !test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY));
+	if (s->syncer.mode == TD_IO_MODE_DSYNC &&
+	    !test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY))
+		DPRINTF("WARNING: %s opened with O_DSYNC, every write is a "
+			"stable write; consider buffered I/O\n", name);
+
 	err = vhd_check_version(s);
 	if (err)
 		goto fail;
@@ -894,6 +990,8 @@ _vhd_open(td_driver_t *driver, const char *name,
 			      VHD_FLAG_OPEN_NO_CACHE);
 	if (flags & TD_OPEN_LOCAL_CACHE)
 		vhd_flags |= VHD_FLAG_OPEN_LOCAL_CACHE;
+	if (flags & TD_OPEN_BUFFERED)
+		vhd_flags |= VHD_FLAG_OPEN_BUFFERED;
 
 	/* pre-allocate for all but NFS and LVM storage */
 	driver->storage = tapdisk_storage_type(name);
@@ -966,6 +1064,7 @@ _vhd_close(td_driver_t *driver)
 	}
 
  free:
+	td_syncer_close(&s->syncer);
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
@@ -1139,35 +1238,6 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
-{
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
-}
-
-static inline void
-lock_bat(struct vhd_state *s)
-{
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
-static inline void
-unlock_bat(struct vhd_state *s)
-{
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
-static inline int
-bat_locked(struct vhd_state *s)
-{
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
@@ -1180,6 +1250,9 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	memset(bm->map, 0, vhd_sectors_to_bytes(s->bm_secs));
 	memset(bm->shadow, 0, vhd_sectors_to_bytes(s->bm_secs));
 	init_vhd_request(s, &bm->req);
+	init_vhd_request(s, &bm->alloc_req);
+	bm->pbw_offset = 0;
+	bm->bat_next   = NULL;
 }
 
 static inline struct vhd_bitmap *
@@ -1215,6 +1288,12 @@ bitmap_locked(struct vhd_bitmap *bm)
 	return test_vhd_flag(bm->status, VHD_FLAG_BM_LOCKED);
 }
 
+static inline int
+bitmap_allocating(struct vhd_bitmap *bm)
+{
+	return test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOCATING);
+}
+
 static inline int
 bitmap_valid(struct vhd_bitmap *bm)
 {
@@ -1226,6 +1305,7 @@ bitmap_in_use(struct vhd_bitmap *bm)
 {
 	return (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING)  ||
 		test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING) ||
+		test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOCATING)    ||
 		test_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT) ||
 		bm->waiting.head || bm->tx.requests.head || bm->queue.head);
 }
@@ -1372,8 +1452,16 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
-		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		if (op != VHD_OP_DATA_WRITE)
+			return VHD_BM_BAT_CLEAR;
+
+		bm = get_bitmap(s, blk);
+		if (bm && bitmap_allocating(bm))
+			return VHD_BM_BAT_CLEAR;
+
+		/* a failed allocation still draining, or too many at once */
+		if ((bm && bitmap_in_use(bm)) ||
+		    s->bat.allocating >= VHD_MAX_ALLOCATIONS)
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1470,6 +1558,7 @@ do_aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 {
 	struct tiocb *tiocb = &req->tiocb;
 
+	req->offset = offset;
 	td_prep_write(s->driver, tiocb, s->vhd.fd, req->treq.buf,
 		      vhd_sectors_to_bytes(req->treq.secs),
 		      offset, vhd_complete, req);
@@ -1481,70 +1570,217 @@ do_aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
-/**
- * Reserves a new extent.
- *
- * @returns a 64-bit unsigned integer where the error code is stored in the
- * upper 32 bits and the reserved block number is stored in the lower 32 bits.
- * If an error is returned (the upper 32 bits are not zero), the lower 32 bits
- * are undefined.
+/*
+ * Reserves space for a new block at next_db, recording where its bitmap
+ * goes in bm->pbw_offset.  lb_end is set to the first sector reserved,
+ * which may precede the bitmap by a gap.  Space is never handed back: a
+ * failed allocation may still have data writes in flight to it.
  */
-static inline uint64_t
-reserve_new_block(struct vhd_state *s, uint32_t blk)
+static inline int
+new_block_gap(struct vhd_state *s)
 {
-	int gap = 0;
-
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
-
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
+		return s->spp - ((s->next_db + s->bm_secs) % s->spp);
+
+	return 0;
+}
+
+static int
+reserve_new_block(struct vhd_state *s, struct vhd_bitmap *bm, uint64_t *lb_end)
+{
+	int gap = new_block_gap(s);
+
+	ASSERT(!bitmap_allocating(bm));
 
 	if (s->next_db + gap > UINT_MAX)
-		return (uint64_t)ENOSPC << 32;
+		return -ENOSPC;
+
+	*lb_end        = s->next_db;
+	bm->pbw_offset = s->next_db + gap;
+	s->next_db     = bm->pbw_offset + s->bm_secs + s->spb;
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	set_vhd_flag(bm->status, VHD_FLAG_BM_ALLOCATING);
+	s->bat.allocating++;
 
-	return s->next_db;
+	return 0;
 }
 
-static int
-schedule_bat_write(struct vhd_state *s)
+static void
+finish_allocation(struct vhd_state *s, struct vhd_bitmap *bm, int error)
+{
+	ASSERT(bitmap_allocating(bm));
+
+	if (!error)
+		bat_entry(s, bm->blk) = bm->pbw_offset;
+
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_ALLOCATING);
+	bm->pbw_offset = 0;
+	s->bat.allocating--;
+}
+
+/*
+ * Preallocating images keep a few blocks past next_db zeroed ahead of
+ * time, so allocating one only takes a bat update.  Zeroing is done with
+ * asynchronous writes, never from the event loop: fallocate has no aio
+ * form.  Zeroed space only counts as ready once everything below it is.
+ */
+static void
+vhd_provision(struct vhd_state *s)
+{
+	int i;
+	uint64_t goal, secs;
+	struct vhd_request *req;
+	struct vhd_prov_write *w;
+	struct vhd_prov_state *p = &s->prov;
+
+	if (p->error)
+		return;
+
+	goal = s->next_db +
+		(uint64_t)p->target * (s->spb + s->bm_secs + s->spp);
+
+	for (i = 0; i < VHD_PROV_WRITES && p->next < goal; i++) {
+		w = &p->writes[i];
+		if (w->busy)
+			continue;
+
+		secs = MIN(goal - p->next, s->spb);
+		req  = &w->req;
+		init_vhd_request(s, req);
+
+		req->op        = VHD_OP_PROVISION;
+		req->treq.secs = secs;
+		req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(secs));
+		req->next      = NULL;
+
+		w->start = p->next;
+		w->busy  = 1;
+		w->done  = 0;
+		p->next += secs;
+
+		do_aio_write(s, req, vhd_sectors_to_bytes(w->start));
+	}
+}
+
+static inline int
+vhd_provision_busy(struct vhd_state *s)
+{
+	int i;
+
+	for (i = 0; i < VHD_PROV_WRITES; i++)
+		if (s->prov.writes[i].busy)
+			return 1;
+
+	return 0;
+}
+
+static inline int
+new_block_provisioned(struct vhd_state *s)
+{
+	return s->next_db + new_block_gap(s) + s->bm_secs + s->spb <=
+		s->prov.ready;
+}
+
+static void
+schedule_bat_write(struct vhd_state *s, struct vhd_bat_write *w)
 {
 	int i;
-	uint32_t blk;
 	char *buf;
+	uint32_t first;
 	uint64_t offset;
+	struct vhd_bitmap *bm;
 	struct vhd_request *req;
 
-	ASSERT(bat_locked(s));
-
-	req = &s->bat.req;
-	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+	req   = &w->req;
+	buf   = w->buf;
+	first = w->sector * 128;
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(buf, &bat_entry(s, first), 512);
 
-	((uint32_t *)buf)[blk % 128] = s->bat.pbw_offset;
+	for (bm = w->blks; bm; bm = bm->bat_next)
+		((uint32_t *)buf)[bm->blk % 128] = bm->pbw_offset;
 
 	for (i = 0; i < 128; i++)
 		BE32_OUT(&((uint32_t *)buf)[i]);
 
-	offset         = s->vhd.header.table_offset + ((uint64_t)blk - (blk % 128)) * 4;
+	offset         = s->vhd.header.table_offset + (uint64_t)first * 4;
 	req->treq.secs = 1;
 	req->treq.buf  = buf;
 	req->op        = VHD_OP_BAT_WRITE;
 	req->next      = NULL;
 
 	do_aio_write(s, req, offset);
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	DBG(TLOG_DBG, "bat sector: 0x%04x, table_offset: 0x%08"PRIx64"\n",
+	    w->sector, offset);
+}
 
-	return 0;
+/*
+ * Starts a write for every bat sector with allocations waiting on it,
+ * unless one is already in flight for the same sector.
+ */
+static void
+schedule_bat_writes(struct vhd_state *s)
+{
+	int i, busy;
+	uint32_t sector;
+	struct vhd_bat_write *w;
+	struct vhd_bitmap *bm, **prev, **pp;
+
+	prev = &s->bat.queue;
+	while ((bm = *prev)) {
+		sector = bm->blk / 128;
+		busy   = 0;
+		w      = NULL;
+
+		for (i = 0; i < VHD_BAT_WRITES; i++) {
+			if (!s->bat.writes[i].blks) {
+				if (!w)
+					w = &s->bat.writes[i];
+			} else if (s->bat.writes[i].sector == sector)
+				busy = 1;
+		}
+
+		if (!w)
+			return;
+
+		if (busy) {
+			prev = &bm->bat_next;
+			continue;
+		}
+
+		w->sector = sector;
+
+		pp = prev;
+		while ((bm = *pp)) {
+			if (bm->blk / 128 != sector) {
+				pp = &bm->bat_next;
+				continue;
+			}
+
+			*pp          = bm->bat_next;
+			bm->bat_next = w->blks;
+			w->blks      = bm;
+		}
+
+		schedule_bat_write(s, w);
+	}
+}
+
+static void
+queue_bat_write(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pp;
+
+	for (pp = &s->bat.queue; *pp; pp = &(*pp)->bat_next)
+		;
+
+	bm->bat_next = NULL;
+	*pp = bm;
+
+	schedule_bat_writes(s);
 }
 
 static void
@@ -1552,19 +1788,19 @@ schedule_zero_bm_write(struct vhd_state *s,
 		       struct vhd_bitmap *bm, uint64_t lb_end)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &bm->alloc_req;
 
 	init_vhd_request(s, req);
 
 	offset         = vhd_sectors_to_bytes(lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = (td_sector_t)s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = (td_sector_t)bm->blk * s->spb;
+	req->treq.secs = (bm->pbw_offset - lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    bm->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
@@ -1628,15 +1864,16 @@ update_bat(struct vhd_state *s, uint32_t blk)
 	struct vhd_bitmap *bm;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		return 0;
-	}
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
 	bm = get_bitmap(s, blk);
+	if (bm && bitmap_allocating(bm))
+		return 0;
+
+	if (s->bat.allocating >= VHD_MAX_ALLOCATIONS)
+		return -EBUSY;
+
 	if (!bm) {
 		/* install empty bitmap in cache */
 		err = alloc_vhd_bitmap(s, &bm, blk);
@@ -1646,12 +1883,10 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
-	if (lb_end >> 32) {
-		unlock_bat(s);
-		return -(lb_end >> 32);
-	}
+	err = reserve_new_block(s, bm, &lb_end);
+	if (err)
+		return err;
+
 	schedule_zero_bm_write(s, bm, lb_end);
 	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 
@@ -1661,59 +1896,38 @@ update_bat(struct vhd_state *s, uint32_t blk)
 static int
 allocate_block(struct vhd_state *s, uint32_t blk)
 {
-	int err, gap;
-	uint64_t offset, size;
+	int err;
+	uint64_t lb_end;
 	struct vhd_bitmap *bm;
-	ssize_t count;
-	uint64_t next_db;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
+	/* empty bitmap could already be in
+	 * cache if earlier bat update failed */
+	bm = get_bitmap(s, blk);
+	if (bm && bitmap_allocating(bm))
 		return 0;
-	}
 
-	gap     = 0;
-	offset  = vhd_sectors_to_bytes(s->next_db);
-	next_db = s->next_db;
-
-	/* data region of segment should begin on page boundary */
-	if ((next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((next_db + s->bm_secs) % s->spp));
-		next_db += gap;
-	}
-
-	if (next_db > UINT_MAX)
-		return -ENOSPC;
-
-	s->next_db = next_db;
-
-	s->bat.pbw_blk = blk;
-	s->bat.pbw_offset = s->next_db;
+	if (s->bat.allocating >= VHD_MAX_ALLOCATIONS)
+		return -EBUSY;
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+	/* blocks are only ever allocated from zeroed space */
+	if (!new_block_provisioned(s)) {
+		err = s->prov.error;
+		if (err) {
+			if (vhd_provision_busy(s))
+				return -EBUSY;
 
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(s, -errno, "lseek failed\n");
-		return -errno;
-	}
+			/* report it once, then try zeroing again */
+			s->prov.error = 0;
+			return err;
+		}
 
-	size  = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	count = write(s->vhd.fd, vhd_zeros(size), size);
-	if (count != size) {
-		err = count < 0 ? -errno : -ENOSPC;
-		ERR(s, -errno,
-		    "write failed (%zd, offset %"PRIu64")\n", count, offset);
-		return err;
+		vhd_provision(s);
+		if (!new_block_provisioned(s))
+			return -EBUSY;
 	}
 
-	/* empty bitmap could already be in
-	 * cache if earlier bat update failed */
-	bm = get_bitmap(s, blk);
 	if (!bm) {
 		/* install empty bitmap in cache */
 		err = alloc_vhd_bitmap(s, &bm, blk);
@@ -1723,10 +1937,24 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
+	err = reserve_new_block(s, bm, &lb_end);
+	if (err)
+		return err;
+
+	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
+	    blk, bm->pbw_offset);
+
+	/* the bat write joins the transaction; it is never issued itself */
+	init_vhd_request(s, &bm->alloc_req);
+	bm->alloc_req.op        = VHD_OP_BAT_WRITE;
+	bm->alloc_req.treq.sec  = (td_sector_t)blk * s->spb;
+
 	lock_bitmap(bm);
-	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
+	add_to_transaction(&bm->tx, &bm->alloc_req);
+	queue_bat_write(s, bm);
+
+	/* top up for the next one */
+	vhd_provision(s);
 
 	return 0;
 }
@@ -1821,7 +2049,8 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 				goto fail;
 			}
 
-			offset = s->bat.pbw_offset;
+			bm     = get_bitmap(s, blk);
+			offset = bm->pbw_offset;
 		}
 
 		offset += s->bm_secs + sec;
@@ -1939,8 +2168,8 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	}
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		ASSERT(bitmap_allocating(bm));
+		offset = bm->pbw_offset;
 	}
 
 	offset = vhd_sectors_to_bytes(offset);
@@ -2309,32 +2538,6 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 		finish_data_transaction(s, bm);
 }
 
-static void
-finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
-{
-	struct vhd_transaction *tx = &bm->tx;
-
-	if (!bat_locked(s))
-		return;
-
-	if (s->bat.pbw_blk != bm->blk)
-		return;
-
-	if (!s->bat.req.error)
-		goto release;
-
-	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
-		goto release;
-
-	tx->closed = 1;
-	return;
-
- release:
-	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
-}
-
 static void
 finish_bitmap_transaction(struct vhd_state *s,
 			  struct vhd_bitmap *bm, int error)
@@ -2346,15 +2549,20 @@ finish_bitmap_transaction(struct vhd_state *s,
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE) &&
+	    test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
+		ASSERT(bitmap_allocating(bm));
+
+		if (!tx->error) {
+			/* data and bitmap are on disk: link the block */
+			set_vhd_flag(tx->status, VHD_FLAG_TX_WAIT_BAT);
+			queue_bat_write(s, bm);
 			return;
 		}
+
+		/* nothing on disk points at the block yet */
+		finish_allocation(s, bm, tx->error);
+		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
 	}
 
 	if (tx->error) {
@@ -2374,8 +2582,6 @@ finish_bitmap_transaction(struct vhd_state *s,
 
 	if (!bitmap_in_use(bm))
 		unlock_bitmap(bm);
-
-	finish_bat_transaction(s, bm);
 }
 
 static void
@@ -2399,42 +2605,54 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 static void
 finish_bat_write(struct vhd_request *req)
 {
-	struct vhd_bitmap *bm;
+	int i;
+	struct vhd_bat_write *w;
+	struct vhd_bitmap *bm, *next;
 	struct vhd_transaction *tx;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	w = NULL;
+	for (i = 0; i < VHD_BAT_WRITES; i++)
+		if (&s->bat.writes[i].req == req)
+			w = &s->bat.writes[i];
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	ASSERT(w && w->blks);
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+	DBG(TLOG_DBG, "bat sector: 0x%04x, err %d\n", w->sector, req->error);
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+	next    = w->blks;
+	w->blks = NULL;
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
-		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
-			finish_bitmap_transaction(s, bm, req->error);
+	while ((bm = next)) {
+		next         = bm->bat_next;
+		bm->bat_next = NULL;
+		tx           = &bm->tx;
+
+		ASSERT(bitmap_valid(bm) && bitmap_allocating(bm));
+		ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+
+		finish_allocation(s, bm, req->error);
+		if (req->error && !tx->error)
+			tx->error = req->error;
+
+		if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
+			tx->finished++;
+			remove_from_req_list(&tx->requests, &bm->alloc_req);
+			if (transaction_completed(tx))
+				finish_data_transaction(s, bm);
+		} else {
+			clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
+			if (test_vhd_flag(tx->status, VHD_FLAG_TX_WAIT_BAT)) {
+				clear_vhd_flag(tx->status, VHD_FLAG_TX_WAIT_BAT);
+				finish_bitmap_transaction(s, bm, req->error);
+			}
+		}
 	}
 
-	finish_bat_transaction(s, bm);
+	schedule_bat_writes(s);
 }
 
 static void
@@ -2452,25 +2670,67 @@ finish_zero_bm_write(struct vhd_request *req)
 	bm  = get_bitmap(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
+	ASSERT(bitmap_allocating(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
+		finish_allocation(s, bm, req->error);
 		tx->error = req->error;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-	} else
-		schedule_bat_write(s);
+	}
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
 }
 
+static void
+finish_provision(struct vhd_request *req)
+{
+	int i, advanced;
+	struct vhd_prov_write *w;
+	struct vhd_state *s = req->state;
+	struct vhd_prov_state *p = &s->prov;
+
+	s->returned++;
+	TRACE(s);
+
+	for (i = 0; i < VHD_PROV_WRITES; i++)
+		if (&p->writes[i].req == req)
+			p->writes[i].done = 1;
+
+	if (req->error && !p->error)
+		p->error = req->error;
+
+	do {
+		advanced = 0;
+		for (i = 0; i < VHD_PROV_WRITES; i++) {
+			w = &p->writes[i];
+			if (w->busy && w->done && !w->req.error &&
+			    w->start == p->ready) {
+				p->ready += w->req.treq.secs;
+				w->busy   = 0;
+				advanced  = 1;
+			}
+		}
+	} while (advanced);
+
+	if (!p->error) {
+		vhd_provision(s);
+		return;
+	}
+
+	/* drop what can't become ready; zero it again once idle */
+	for (i = 0; i < VHD_PROV_WRITES; i++)
+		if (p->writes[i].done)
+			p->writes[i].busy = 0;
+
+	if (!vhd_provision_busy(s))
+		p->next = p->ready;
+}
+
 static int
 finish_redundant_bm_write(struct vhd_request *req)
 {
@@ -2619,17 +2879,11 @@ finish_data_write(struct vhd_request *req)
 	}
 }
 
-void
-vhd_complete(void *arg, struct tiocb *tiocb, int err)
+static void
+__vhd_complete(struct vhd_request *req)
 {
-	struct vhd_request *req = (struct vhd_request *)arg;
 	struct vhd_state *s = req->state;
 
-	s->completed++;
-	TRACE(s);
-
-	req->error = err;
-
 	if (req->error)
 		ERR(s, req->error, "%s: op: %u, lsec: %"PRIu64", secs: %u, "
 		    "blk: %"PRIu64", blk_offset: %u",
@@ -2666,12 +2920,64 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bat_write(req);
 		break;
 
+	case VHD_OP_PROVISION:
+		finish_provision(req);
+		break;
+
 	default:
 		ASSERT(0);
 		break;
 	}
 }
 
+static void
+vhd_write_synced(struct td_sync_waiter *waiter, int err)
+{
+	struct vhd_request *req =
+		container_of(waiter, struct vhd_request, waiter);
+
+	req->error = err;
+	__vhd_complete(req);
+}
+
+void
+vhd_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct vhd_request *req = (struct vhd_request *)arg;
+	struct vhd_state *s = req->state;
+
+	s->completed++;
+	TRACE(s);
+
+	req->error = err;
+
+	switch (req->op) {
+	case VHD_OP_DATA_READ:
+	case VHD_OP_BITMAP_READ:
+		__vhd_complete(req);
+		break;
+
+	default:
+		/*
+		 * Data, bitmap and bat updates are ordered by completion.
+		 * Buffered, a write only completes once synced, so that
+		 * order holds on disk too.
+		 */
+		td_syncer_complete(&s->syncer, &req->waiter, vhd_write_synced,
+				   req->offset,
+				   vhd_sectors_to_bytes(req->treq.secs), err);
+		break;
+	}
+}
+
+static int
+vhd_busy(td_driver_t *driver)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	return vhd_provision_busy(s);
+}
+
 void 
 vhd_debug(td_driver_t *driver)
 {
@@ -2735,9 +3041,23 @@ vhd_debug(td_driver_t *driver)
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: allocating: %d, queued: %p\n",
+	    s->bat.allocating, s->bat.queue);
+	DBG(TLOG_WARN, "PROVISION: next_db: 0x%08"PRIx64", ready: 0x%08"PRIx64
+	    ", next: 0x%08"PRIx64", error: %d\n", s->next_db,
+	    s->prov.ready, s->prov.next, s->prov.error);
+	for (i = 0; i < VHD_BAT_WRITES; i++) {
+		struct vhd_bat_write *w = &s->bat.writes[i];
+		struct vhd_bitmap *bm;
+
+		if (!w->blks)
+			continue;
+
+		for (bm = w->blks; bm; bm = bm->bat_next)
+			DBG(TLOG_WARN, "%d: sector: 0x%04x, blk: 0x%04x, "
+			    "pbw_off: 0x%08"PRIx64"\n", i, w->sector,
+			    bm->blk, bm->pbw_offset);
+	}
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2745,6 +3065,16 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+static void
+vhd_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	tapdisk_stats_field(st, "io", "{");
+	td_syncer_stats(&s->syncer, st);
+	tapdisk_stats_leave(st, '}');
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
@@ -2758,4 +3088,6 @@ struct tap_disk tapdisk_vhd = {
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
+	.td_busy            = vhd_busy,
 };
@@ -0,0 +1,1169 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * VHDX images (see libvhdx.h). The BAT is kept in memory, as are the
+ * 4KiB pages of sector bitmaps once touched. Payload blocks are
+ * allocated at the end of the file, 1MiB aligned, and written before
+ * the BAT entry pointing at them. On differencing images, a partial
+ * write to an absent block makes it partially present: its sector
+ * bitmap goes out first, the BAT entry in a second round, so a present
+ * entry never refers to bits that were not written.
+ *
+ * Bitmap bits cover logical sectors, which may be 4KiB. Writes to part
+ * of one on a differencing image are widened to whole logical sectors,
+ * the rest read from this image or its parent first; such writes to
+ * the same logical sectors wait for each other.
+ *
+ * Metadata pages are committed in rounds, one in flight, like the cz
+ * map. They are written in place rather than through the log, in an
+ * order that keeps the image consistent; the log is replayed on open.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libvhdx.h"
+#include "tapdisk.h"
+#include "tapdisk-utils.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
+
+#define DBG(_f, _a...)       tlog_syslog(TLOG_DBG, _f, ##_a)
+#define INFO(_f, _a...)      tlog_syslog(TLOG_INFO, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+#define MIN(a, b)            ((a) < (b) ? (a) : (b))
+
+#define VHDX_MAX_OPS         64
+#define VHDX_PAGE_SIZE       VHDX_BITMAP_PAGE_SIZE
+#define VHDX_PAGE_BITS       (VHDX_PAGE_SIZE * 8)
+#define VHDX_BITMAP_PAGES    (VHDX_BITMAP_BLOCK_SIZE / VHDX_PAGE_SIZE)
+
+/*
+ * A request dirties at most two BAT pages and, since a bitmap page
+ * covers at least 16MiB, two bitmap pages.
+ */
+#define VHDX_MAX_DIRTY       (4 * VHDX_MAX_OPS)
+
+typedef struct td_vhdx td_vhdx_t;
+
+struct vhdx_waiter {
+	struct list_head        next;
+	td_request_t            treq;
+};
+
+/*
+ * Data I/O within a block. An op allocating its block owns it:
+ * requests for the same block wait behind it.
+ */
+struct vhdx_op {
+	td_vhdx_t              *s;
+	int                     busy;
+	int                     owner;
+	uint64_t                block;
+	td_request_t            treq;
+
+	uint64_t                offset;     /* of the block in the file */
+	uint64_t                old;        /* BAT entry before */
+	int                     set_bits;   /* commit sector bitmap first */
+	int                     state;      /* then this BAT state, or -1 */
+	struct tiocb            tiocb;
+
+	struct list_head        waiters;
+	struct list_head        commit;
+};
+
+/*
+ * A write widened to whole logical sectors, SEC and SECS, in BUF.
+ */
+struct vhdx_rmw {
+	td_vhdx_t              *s;
+	struct list_head        next;
+	td_request_t            treq;
+	td_sector_t             sec;
+	int                     secs;
+	char                   *buf;
+	int                     writing;
+	int                     pending;    /* sectors */
+	int                     err;
+};
+
+struct vhdx_dirty {
+	uint64_t                off;
+	char                   *page;
+};
+
+struct td_vhdx {
+	td_driver_t            *driver;
+	vhdx_context_t          ctx;
+
+	uint64_t                block_secs;
+	int                     lsec_secs;  /* per logical sector */
+	uint64_t                next_off;   /* allocation point */
+
+	char                 ***bitmaps;    /* [bitmap block][page] */
+
+	struct vhdx_op          ops[VHDX_MAX_OPS];
+
+	struct vhdx_dirty       dirty[VHDX_MAX_DIRTY];
+	int                     n_dirty;
+
+	struct list_head        commit_pending;
+	struct list_head        committing;
+	int                     commit_inflight;
+	int                     commit_err;
+	char                   *commit_buf;
+	struct tiocb            commit_tiocb[VHDX_MAX_DIRTY];
+
+	struct list_head        rmws;       /* in flight */
+	struct list_head        blocked;    /* waiting for them */
+	int                     unblocking;
+
+	struct {
+		unsigned long long      allocated;
+		unsigned long long      bitmap_loads;
+		unsigned long long      forwarded;
+		unsigned long long      commits;
+		unsigned long long      rmw;
+		unsigned long long      busy;
+		unsigned long long      errors;
+	} stats;
+};
+
+static void vhdx_dispatch(td_vhdx_t *, td_request_t);
+
+static inline uint64_t *
+vhdx_bat_slot(td_vhdx_t *s, uint64_t block)
+{
+	return &s->ctx.bat[vhdx_bat_index(&s->ctx, block)];
+}
+
+static void
+vhdx_dirty(td_vhdx_t *s, uint64_t off, char *page)
+{
+	int i;
+
+	for (i = 0; i < s->n_dirty; i++)
+		if (s->dirty[i].off == off)
+			return;
+
+	s->dirty[s->n_dirty].off  = off;
+	s->dirty[s->n_dirty].page = page;
+	s->n_dirty++;
+}
+
+static void
+vhdx_bat_set(td_vhdx_t *s, uint64_t index, uint64_t entry)
+{
+	uint64_t page = (index * sizeof(uint64_t)) & ~(VHDX_PAGE_SIZE - 1);
+
+	s->ctx.bat[index] = entry;
+	vhdx_dirty(s, s->ctx.bat_region.file_offset + page,
+		   (char *)s->ctx.bat + page);
+}
+
+/*
+ * Sector bitmap pages, read in on first use.
+ */
+static int
+vhdx_bitmap_page(td_vhdx_t *s, uint64_t block, uint64_t lsec,
+		 char **page, uint64_t *off)
+{
+	uint64_t chunk = block / s->ctx.chunk_ratio, entry, bit;
+	char **pages;
+	int idx, err;
+	ssize_t n;
+
+	entry = s->ctx.bat[vhdx_bitmap_index(&s->ctx, block)];
+	if (vhdx_bat_state(entry) != SB_BLOCK_PRESENT) {
+		ERR(-EIO, "%s: block %"PRIu64" has no sector bitmap\n",
+		    s->ctx.file, block);
+		return -EIO;
+	}
+
+	bit = vhdx_bitmap_block_offset(&s->ctx, block) * 8 + lsec;
+	idx = bit / VHDX_PAGE_BITS;
+	*off = vhdx_bat_offset(entry) + (uint64_t)idx * VHDX_PAGE_SIZE;
+
+	pages = s->bitmaps[chunk];
+	if (!pages) {
+		pages = calloc(VHDX_BITMAP_PAGES, sizeof(char *));
+		if (!pages)
+			return -ENOMEM;
+		s->bitmaps[chunk] = pages;
+	}
+
+	if (!pages[idx]) {
+		err = posix_memalign((void **)&pages[idx], VHDX_PAGE_SIZE,
+				     VHDX_PAGE_SIZE);
+		if (err) {
+			pages[idx] = NULL;
+			return -err;
+		}
+
+		n = pread(s->ctx.fd, pages[idx], VHDX_PAGE_SIZE, *off);
+		if (n != VHDX_PAGE_SIZE) {
+			err = n < 0 ? -errno : -EIO;
+			free(pages[idx]);
+			pages[idx] = NULL;
+			return err;
+		}
+
+		s->stats.bitmap_loads++;
+	}
+
+	*page = pages[idx];
+	return bit % VHDX_PAGE_BITS;
+}
+
+static int
+vhdx_bitmap_test(td_vhdx_t *s, uint64_t block, uint64_t lsec)
+{
+	uint64_t off;
+	char *page;
+	int bit;
+
+	bit = vhdx_bitmap_page(s, block, lsec, &page, &off);
+	if (bit < 0)
+		return bit;
+
+	return !!(page[bit >> 3] & (1 << (bit & 7)));
+}
+
+static int
+vhdx_bitmap_set(td_vhdx_t *s, uint64_t block, uint64_t lsec, uint64_t n)
+{
+	uint64_t off, end = lsec + n;
+	char *page;
+	int bit;
+
+	for (; lsec < end; lsec++) {
+		bit = vhdx_bitmap_page(s, block, lsec, &page, &off);
+		if (bit < 0)
+			return bit;
+
+		page[bit >> 3] |= 1 << (bit & 7);
+		vhdx_dirty(s, off, page);
+	}
+
+	return 0;
+}
+
+static struct vhdx_op *
+vhdx_find_owner(td_vhdx_t *s, uint64_t block)
+{
+	int i;
+
+	for (i = 0; i < VHDX_MAX_OPS; i++)
+		if (s->ops[i].busy && s->ops[i].owner &&
+		    s->ops[i].block == block)
+			return &s->ops[i];
+
+	return NULL;
+}
+
+static struct vhdx_op *
+vhdx_get_op(td_vhdx_t *s, td_request_t treq)
+{
+	struct vhdx_op *op = NULL;
+	int i;
+
+	for (i = 0; i < VHDX_MAX_OPS; i++)
+		if (!s->ops[i].busy) {
+			op = &s->ops[i];
+			break;
+		}
+
+	if (!op) {
+		s->stats.busy++;
+		return NULL;
+	}
+
+	op->s        = s;
+	op->busy     = 1;
+	op->owner    = 0;
+	op->block    = treq.sec / s->block_secs;
+	op->treq     = treq;
+	op->old      = *vhdx_bat_slot(s, op->block);
+	op->offset   = vhdx_bat_offset(op->old);
+	op->set_bits = 0;
+	op->state    = -1;
+	INIT_LIST_HEAD(&op->waiters);
+	INIT_LIST_HEAD(&op->commit);
+
+	return op;
+}
+
+static void
+vhdx_op_done(td_vhdx_t *s, struct vhdx_op *op, int err)
+{
+	struct vhdx_waiter *w, *tmp;
+	struct list_head waiters;
+
+	if (err)
+		s->stats.errors++;
+
+	td_complete_request(op->treq, err);
+
+	INIT_LIST_HEAD(&waiters);
+	list_splice_tail(&op->waiters, &waiters);
+	INIT_LIST_HEAD(&op->waiters);
+	op->busy = 0;
+
+	list_for_each_entry_safe(w, tmp, &waiters, next) {
+		list_del(&w->next);
+		vhdx_dispatch(s, w->treq);
+		free(w);
+	}
+}
+
+static void
+__vhdx_commit_done(void *arg, struct tiocb *tiocb, int err);
+
+static void
+vhdx_commit_kick(td_vhdx_t *s)
+{
+	int i, n;
+
+	if (s->commit_inflight || !s->n_dirty)
+		return;
+
+	list_splice_tail(&s->commit_pending, &s->committing);
+	INIT_LIST_HEAD(&s->commit_pending);
+
+	n = s->n_dirty;
+	s->n_dirty = 0;
+	s->commit_inflight = n;
+	s->stats.commits++;
+
+	for (i = 0; i < n; i++) {
+		char *buf = s->commit_buf + (size_t)i * VHDX_PAGE_SIZE;
+
+		memcpy(buf, s->dirty[i].page, VHDX_PAGE_SIZE);
+		td_prep_write(s->driver, &s->commit_tiocb[i], s->ctx.fd, buf,
+			      VHDX_PAGE_SIZE, s->dirty[i].off,
+			      __vhdx_commit_done, s);
+	}
+
+	for (i = 0; i < n; i++)
+		td_queue_tiocb(s->driver, &s->commit_tiocb[i]);
+}
+
+/*
+ * Makes the op's metadata changes of the next round.
+ */
+static void
+vhdx_op_commit(td_vhdx_t *s, struct vhdx_op *op)
+{
+	td_request_t *treq = &op->treq;
+	uint64_t lsec;
+	int err;
+
+	if (op->set_bits) {
+		lsec = (treq->sec % s->block_secs) / s->lsec_secs;
+		err  = vhdx_bitmap_set(s, op->block, lsec,
+				       treq->secs / s->lsec_secs);
+		if (err) {
+			vhdx_op_done(s, op, err);
+			return;
+		}
+	} else
+		vhdx_bat_set(s, vhdx_bat_index(&s->ctx, op->block),
+			     vhdx_bat_entry(op->state, op->offset));
+
+	list_add_tail(&op->commit, &s->commit_pending);
+	vhdx_commit_kick(s);
+}
+
+static void
+__vhdx_commit_done(void *arg, struct tiocb *tiocb, int err)
+{
+	td_vhdx_t *s = arg;
+	struct vhdx_op *op, *tmp;
+	struct list_head done;
+
+	if (err)
+		s->commit_err = s->commit_err ? : err;
+
+	if (--s->commit_inflight)
+		return;
+
+	err = s->commit_err;
+	s->commit_err = 0;
+
+	if (err)
+		ERR(err, "%s: metadata update failed\n", s->ctx.file);
+
+	INIT_LIST_HEAD(&done);
+	list_splice_tail(&s->committing, &done);
+	INIT_LIST_HEAD(&s->committing);
+
+	list_for_each_entry_safe(op, tmp, &done, commit) {
+		list_del_init(&op->commit);
+
+		if (err) {
+			if (op->state >= 0 && !op->set_bits)
+				s->ctx.bat[vhdx_bat_index(&s->ctx, op->block)] =
+					op->old;
+			vhdx_op_done(s, op, err);
+			continue;
+		}
+
+		if (op->set_bits && op->state >= 0) {
+			op->set_bits = 0;
+			vhdx_op_commit(s, op);
+			continue;
+		}
+
+		vhdx_op_done(s, op, 0);
+	}
+
+	vhdx_commit_kick(s);
+}
+
+static void
+__vhdx_data_done(void *arg, struct tiocb *tiocb, int err)
+{
+	struct vhdx_op *op = arg;
+	td_vhdx_t *s = op->s;
+
+	if (err || (!op->set_bits && op->state < 0)) {
+		vhdx_op_done(s, op, err);
+		return;
+	}
+
+	vhdx_op_commit(s, op);
+}
+
+static void
+vhdx_op_queue(td_vhdx_t *s, struct vhdx_op *op)
+{
+	td_request_t *treq = &op->treq;
+	uint64_t off;
+
+	off = op->offset + (treq->sec % s->block_secs) * SECTOR_SIZE;
+
+	if (treq->op == TD_OP_WRITE)
+		td_prep_write(s->driver, &op->tiocb, s->ctx.fd, treq->buf,
+			      (size_t)treq->secs << SECTOR_SHIFT, off,
+			      __vhdx_data_done, op);
+	else
+		td_prep_read(s->driver, &op->tiocb, s->ctx.fd, treq->buf,
+			     (size_t)treq->secs << SECTOR_SHIFT, off,
+			     __vhdx_data_done, op);
+
+	td_queue_tiocb(s->driver, &op->tiocb);
+}
+
+static void
+vhdx_io(td_vhdx_t *s, td_request_t treq)
+{
+	struct vhdx_op *op;
+
+	op = vhdx_get_op(s, treq);
+	if (!op) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	vhdx_op_queue(s, op);
+}
+
+/*
+ * Extends the file by @size at the allocation point. Fresh space reads
+ * as zeroes, so new blocks need no zeroing.
+ */
+static int64_t
+vhdx_alloc_space(td_vhdx_t *s, uint64_t size)
+{
+	uint64_t off = s->next_off;
+
+	if (ftruncate(s->ctx.fd, off + size))
+		return -errno;
+
+	s->next_off += size;
+	return off;
+}
+
+static void
+vhdx_allocate(td_vhdx_t *s, td_request_t treq, int state)
+{
+	uint64_t sbi, entry;
+	struct vhdx_op *op;
+	int64_t off;
+
+	op = vhdx_get_op(s, treq);
+	if (!op) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	op->owner = 1;
+	op->state = PAYLOAD_BLOCK_FULLY_PRESENT;
+
+	/* anything else reads as zeroes, so fresh space will do */
+	if (state == PAYLOAD_BLOCK_NOT_PRESENT && vhdx_has_parent(&s->ctx) &&
+	    treq.secs != s->block_secs) {
+		sbi   = vhdx_bitmap_index(&s->ctx, op->block);
+		entry = s->ctx.bat[sbi];
+
+		if (vhdx_bat_state(entry) != SB_BLOCK_PRESENT) {
+			off = vhdx_alloc_space(s, VHDX_BITMAP_BLOCK_SIZE);
+			if (off < 0) {
+				vhdx_op_done(s, op, off);
+				return;
+			}
+
+			vhdx_bat_set(s, sbi, vhdx_bat_entry(SB_BLOCK_PRESENT,
+							    off));
+		}
+
+		op->set_bits = 1;
+		op->state    = PAYLOAD_BLOCK_PARTIALLY_PRESENT;
+	}
+
+	off = vhdx_alloc_space(s, s->ctx.block_size);
+	if (off < 0) {
+		vhdx_op_done(s, op, off);
+		return;
+	}
+
+	op->offset = off;
+	s->stats.allocated++;
+
+	vhdx_op_queue(s, op);
+}
+
+/*
+ * Splits a read of a partially present block into runs of present
+ * sectors, read here, and absent ones, read from the parent.
+ */
+static void
+vhdx_read_partial(td_vhdx_t *s, td_request_t treq)
+{
+	uint64_t block = treq.sec / s->block_secs;
+	uint64_t base = block * s->block_secs;
+	td_sector_t sec, end, next;
+	td_request_t clone;
+	int present, bit;
+
+	sec = treq.sec;
+	end = treq.sec + treq.secs;
+
+	while (sec < end) {
+		present = vhdx_bitmap_test(s, block,
+					   (sec - base) / s->lsec_secs);
+		if (present < 0)
+			goto fail;
+
+		next = sec;
+		do {
+			next = base + ((next - base) / s->lsec_secs + 1) *
+				s->lsec_secs;
+			if (next >= end) {
+				next = end;
+				break;
+			}
+
+			bit = vhdx_bitmap_test(s, block,
+					       (next - base) / s->lsec_secs);
+			if (bit < 0)
+				goto fail;
+		} while (bit == present);
+
+		clone      = treq;
+		clone.sec  = sec;
+		clone.secs = next - sec;
+		clone.buf  = treq.buf + ((size_t)(sec - treq.sec) << SECTOR_SHIFT);
+
+		if (present)
+			vhdx_io(s, clone);
+		else {
+			s->stats.forwarded += clone.secs;
+			td_forward_request(clone);
+		}
+
+		sec = next;
+	}
+
+	return;
+
+fail:
+	treq.buf  += (size_t)(sec - treq.sec) << SECTOR_SHIFT;
+	treq.secs -= sec - treq.sec;
+	treq.sec   = sec;
+	s->stats.errors++;
+	td_complete_request(treq, -EIO);
+}
+
+static void
+vhdx_status(td_vhdx_t *s, td_request_t treq)
+{
+	switch (vhdx_bat_state(*vhdx_bat_slot(s, treq.sec / s->block_secs))) {
+	case PAYLOAD_BLOCK_NOT_PRESENT:
+		if (vhdx_has_parent(&s->ctx)) {
+			td_forward_request(treq);
+			return;
+		}
+		/* fall through */
+	case PAYLOAD_BLOCK_UNDEFINED:
+	case PAYLOAD_BLOCK_ZERO:
+	case PAYLOAD_BLOCK_UNMAPPED:
+		treq.status = TD_BLOCK_STATE_HOLE | TD_BLOCK_STATE_ZERO;
+		break;
+	default:
+		treq.status = TD_BLOCK_STATE_NONE;
+		break;
+	}
+
+	td_complete_request(treq, 0);
+}
+
+/*
+ * Serves a request within a single block.
+ */
+static void
+vhdx_dispatch(td_vhdx_t *s, td_request_t treq)
+{
+	uint64_t block = treq.sec / s->block_secs;
+	struct vhdx_waiter *w;
+	struct vhdx_op *op;
+	int state;
+
+	op = vhdx_find_owner(s, block);
+	if (op) {
+		w = malloc(sizeof(*w));
+		if (!w) {
+			td_complete_request(treq, -EBUSY);
+			return;
+		}
+
+		w->treq = treq;
+		list_add_tail(&w->next, &op->waiters);
+		return;
+	}
+
+	if (treq.op == TD_OP_BLOCK_STATUS) {
+		vhdx_status(s, treq);
+		return;
+	}
+
+	state = vhdx_bat_state(*vhdx_bat_slot(s, block));
+
+	switch (state) {
+	case PAYLOAD_BLOCK_FULLY_PRESENT:
+		vhdx_io(s, treq);
+		return;
+
+	case PAYLOAD_BLOCK_PARTIALLY_PRESENT:
+		if (treq.op == TD_OP_READ) {
+			vhdx_read_partial(s, treq);
+			return;
+		}
+
+		op = vhdx_get_op(s, treq);
+		if (!op) {
+			td_complete_request(treq, -EBUSY);
+			return;
+		}
+
+		op->set_bits = 1;
+		vhdx_op_queue(s, op);
+		return;
+	}
+
+	if (treq.op == TD_OP_WRITE) {
+		vhdx_allocate(s, treq, state);
+		return;
+	}
+
+	if (state == PAYLOAD_BLOCK_NOT_PRESENT && vhdx_has_parent(&s->ctx)) {
+		s->stats.forwarded += treq.secs;
+		td_forward_request(treq);
+		return;
+	}
+
+	memset(treq.buf, 0, (size_t)treq.secs << SECTOR_SHIFT);
+	td_complete_request(treq, 0);
+}
+
+static void
+vhdx_queue_request(td_driver_t *driver, td_request_t treq)
+{
+	td_vhdx_t *s = driver->data;
+	td_request_t clone;
+	td_sector_t end;
+
+	while (treq.secs) {
+		end = (treq.sec / s->block_secs + 1) * s->block_secs;
+
+		clone      = treq;
+		clone.secs = MIN((td_sector_t)treq.secs, end - treq.sec);
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		if (treq.buf)
+			treq.buf += (size_t)clone.secs << SECTOR_SHIFT;
+
+		vhdx_dispatch(s, clone);
+	}
+}
+
+static void
+vhdx_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	vhdx_queue_request(driver, treq);
+}
+
+static void vhdx_unblock(td_vhdx_t *);
+
+static int
+vhdx_rmw_overlap(struct vhdx_rmw *a, struct vhdx_rmw *b)
+{
+	return a->sec < b->sec + b->secs && b->sec < a->sec + a->secs;
+}
+
+static void
+vhdx_rmw_finish(struct vhdx_rmw *rmw)
+{
+	td_vhdx_t *s = rmw->s;
+
+	if (rmw->err)
+		s->stats.errors++;
+
+	td_complete_request(rmw->treq, rmw->err);
+
+	list_del(&rmw->next);
+	free(rmw->buf);
+	free(rmw);
+
+	vhdx_unblock(s);
+}
+
+static void
+__vhdx_rmw_done(td_request_t treq, int err);
+
+/*
+ * Drops @secs of what the current phase waits for: once the reads are
+ * in, the guest's data goes over them and the whole is written.
+ */
+static void
+vhdx_rmw_put(struct vhdx_rmw *rmw, int secs, int err)
+{
+	td_request_t *treq = &rmw->treq;
+	td_request_t clone;
+
+	if (err)
+		rmw->err = rmw->err ? : err;
+
+	rmw->pending -= secs;
+	if (rmw->pending)
+		return;
+
+	if (rmw->writing || rmw->err) {
+		vhdx_rmw_finish(rmw);
+		return;
+	}
+
+	memcpy(rmw->buf + ((size_t)(treq->sec - rmw->sec) << SECTOR_SHIFT),
+	       treq->buf, (size_t)treq->secs << SECTOR_SHIFT);
+
+	clone         = *treq;
+	clone.sec     = rmw->sec;
+	clone.secs    = rmw->secs;
+	clone.buf     = rmw->buf;
+	clone.cb      = __vhdx_rmw_done;
+	clone.cb_data = rmw;
+
+	rmw->writing = 1;
+	rmw->pending = rmw->secs + 1;
+	vhdx_queue_request(rmw->s->driver, clone);
+	vhdx_rmw_put(rmw, 1, 0);
+}
+
+static void
+__vhdx_rmw_done(td_request_t treq, int err)
+{
+	vhdx_rmw_put(treq.cb_data, treq.secs, err);
+}
+
+static void
+vhdx_rmw_read(struct vhdx_rmw *rmw, td_sector_t sec)
+{
+	td_vhdx_t *s = rmw->s;
+	td_request_t clone;
+
+	clone         = rmw->treq;
+	clone.op      = TD_OP_READ;
+	clone.sec     = sec;
+	clone.secs    = s->lsec_secs;
+	clone.buf     = rmw->buf + ((size_t)(sec - rmw->sec) << SECTOR_SHIFT);
+	clone.cb      = __vhdx_rmw_done;
+	clone.cb_data = rmw;
+
+	rmw->pending += clone.secs;
+	vhdx_queue_request(s->driver, clone);
+}
+
+/*
+ * Reads the logical sectors at either end the guest only partly
+ * writes, from here or the parent.
+ */
+static void
+vhdx_rmw_start(td_vhdx_t *s, struct vhdx_rmw *rmw)
+{
+	td_sector_t end = rmw->sec + rmw->secs;
+	td_request_t *treq = &rmw->treq;
+	int head;
+
+	list_add_tail(&rmw->next, &s->rmws);
+	s->stats.rmw++;
+
+	rmw->pending = 1;
+
+	head = treq->sec != rmw->sec;
+	if (head)
+		vhdx_rmw_read(rmw, rmw->sec);
+
+	if (treq->sec + treq->secs != end &&
+	    (!head || end - s->lsec_secs != rmw->sec))
+		vhdx_rmw_read(rmw, end - s->lsec_secs);
+
+	vhdx_rmw_put(rmw, 1, 0);
+}
+
+static int
+vhdx_rmw_blocked(td_vhdx_t *s, struct vhdx_rmw *rmw)
+{
+	struct vhdx_rmw *r;
+
+	list_for_each_entry(r, &s->rmws, next)
+		if (vhdx_rmw_overlap(r, rmw))
+			return 1;
+
+	list_for_each_entry(r, &s->blocked, next) {
+		if (r == rmw)
+			break;
+		if (vhdx_rmw_overlap(r, rmw))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Starts blocked writes, in order, as far as they no longer overlap
+ * any in flight or before them. Writes finishing while one is started
+ * are seen on the next pass.
+ */
+static void
+vhdx_unblock(td_vhdx_t *s)
+{
+	struct vhdx_rmw *rmw;
+	int started;
+
+	if (s->unblocking)
+		return;
+
+	s->unblocking = 1;
+
+	do {
+		started = 0;
+
+		list_for_each_entry(rmw, &s->blocked, next) {
+			if (vhdx_rmw_blocked(s, rmw))
+				continue;
+
+			list_del(&rmw->next);
+			vhdx_rmw_start(s, rmw);
+			started = 1;
+			break;
+		}
+	} while (started);
+
+	s->unblocking = 0;
+}
+
+static void
+vhdx_rmw_write(td_vhdx_t *s, td_request_t treq)
+{
+	struct vhdx_rmw *rmw;
+	td_sector_t end;
+	int err;
+
+	rmw = calloc(1, sizeof(*rmw));
+	if (!rmw) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	end = treq.sec + treq.secs;
+	end = (end + s->lsec_secs - 1) / s->lsec_secs * s->lsec_secs;
+
+	rmw->s    = s;
+	rmw->treq = treq;
+	rmw->sec  = treq.sec / s->lsec_secs * s->lsec_secs;
+	rmw->secs = end - rmw->sec;
+
+	err = posix_memalign((void **)&rmw->buf, VHDX_PAGE_SIZE,
+			     (size_t)rmw->secs << SECTOR_SHIFT);
+	if (err) {
+		free(rmw);
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	list_add_tail(&rmw->next, &s->blocked);
+	vhdx_unblock(s);
+}
+
+/*
+ * Sector bitmaps track logical sectors: on differencing images with
+ * 4KiB logical sectors, writes to part of one read the rest first.
+ */
+static void
+vhdx_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	td_vhdx_t *s = driver->data;
+
+	if (td_flag_test(s->driver->state, TD_DRIVER_RDONLY)) {
+		td_complete_request(treq, -EPERM);
+		return;
+	}
+
+	if (vhdx_has_parent(&s->ctx) &&
+	    (treq.sec % s->lsec_secs || treq.secs % s->lsec_secs)) {
+		vhdx_rmw_write(s, treq);
+		return;
+	}
+
+	vhdx_queue_request(driver, treq);
+}
+
+static void
+vhdx_queue_block_status(td_driver_t *driver, td_request_t treq)
+{
+	vhdx_queue_request(driver, treq);
+}
+
+static int
+vhdx_close_image(td_driver_t *driver)
+{
+	td_vhdx_t *s = driver->data;
+	struct vhdx_rmw *rmw, *tmp;
+	uint64_t i;
+	int j;
+
+	list_for_each_entry_safe(rmw, tmp, &s->blocked, next) {
+		list_del(&rmw->next);
+		td_complete_request(rmw->treq, -EIO);
+		free(rmw->buf);
+		free(rmw);
+	}
+
+	if (s->bitmaps) {
+		for (i = 0; i < s->ctx.bitmap_blocks; i++) {
+			if (!s->bitmaps[i])
+				continue;
+			for (j = 0; j < VHDX_BITMAP_PAGES; j++)
+				free(s->bitmaps[i][j]);
+			free(s->bitmaps[i]);
+		}
+		free(s->bitmaps);
+	}
+
+	free(s->commit_buf);
+	vhdx_close(&s->ctx);
+	memset(s, 0, sizeof(*s));
+
+	return 0;
+}
+
+static int
+vhdx_open_image(td_driver_t *driver, const char *name,
+		struct td_vbd_encryption *encryption, td_flag_t flags)
+{
+	td_vhdx_t *s = driver->data;
+	struct stat st;
+	int err;
+
+	memset(s, 0, sizeof(*s));
+	s->driver = driver;
+	INIT_LIST_HEAD(&s->commit_pending);
+	INIT_LIST_HEAD(&s->committing);
+	INIT_LIST_HEAD(&s->rmws);
+	INIT_LIST_HEAD(&s->blocked);
+
+	err = vhdx_open(&s->ctx, name, (flags & TD_OPEN_RDONLY) ?
+			VHDX_OPEN_RDONLY : VHDX_OPEN_RDWR);
+	if (err) {
+		ERR(err, "%s: failed to open vhdx image\n", name);
+		return err;
+	}
+
+	s->block_secs = s->ctx.block_size >> SECTOR_SHIFT;
+	s->lsec_secs  = s->ctx.logical_sector_size >> SECTOR_SHIFT;
+
+	s->bitmaps = calloc(s->ctx.bitmap_blocks, sizeof(char **));
+	if (!s->bitmaps) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = posix_memalign((void **)&s->commit_buf, VHDX_PAGE_SIZE,
+			     VHDX_MAX_DIRTY * VHDX_PAGE_SIZE);
+	if (err) {
+		s->commit_buf = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	if (fstat(s->ctx.fd, &st)) {
+		err = -errno;
+		goto fail;
+	}
+
+	s->next_off = ((uint64_t)st.st_size + VHDX_MiB - 1) &
+		~(VHDX_MiB - 1);
+
+	/* children of this image are stale once it is written */
+	if (!(flags & TD_OPEN_RDONLY)) {
+		err = vhdx_update_header(&s->ctx, 1);
+		if (err)
+			goto fail;
+	}
+
+	driver->info.size        = s->ctx.size >> SECTOR_SHIFT;
+	driver->info.sector_size = SECTOR_SIZE;
+	driver->info.info        = 0;
+
+	INFO("%s: %"PRIu64" blocks of %u bytes, logical sectors of %u%s\n",
+	     name, s->ctx.data_blocks, s->ctx.block_size,
+	     s->ctx.logical_sector_size,
+	     s->ctx.log_replayed ? ", log replayed" : "");
+
+	return 0;
+
+fail:
+	vhdx_close_image(driver);
+	return err;
+}
+
+static int
+vhdx_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	td_vhdx_t *s = driver->data;
+	int flags = id->flags;
+
+	memset(id, 0, sizeof(*id));
+
+	if (!vhdx_has_parent(&s->ctx))
+		return TD_NO_PARENT;
+
+	id->name = strdup(s->ctx.parent);
+	if (!id->name)
+		return -ENOMEM;
+
+	id->type  = DISK_TYPE_VHDX;
+	id->flags = flags | TD_OPEN_SHAREABLE | TD_OPEN_RDONLY;
+
+	return 0;
+}
+
+static int
+vhdx_validate_parent(td_driver_t *driver,
+		     td_driver_t *pdriver, td_flag_t flags)
+{
+	td_vhdx_t *s = driver->data, *p;
+	char guid[40];
+
+	/* a cache in between passes reads through unchanged */
+	if (pdriver->type == DISK_TYPE_LCACHE)
+		return 0;
+
+	if (pdriver->type != DISK_TYPE_VHDX)
+		return -EINVAL;
+
+	p = pdriver->data;
+	vhdx_guid_to_string(&p->ctx.header.data_write_guid, guid);
+
+	if (strcasecmp(guid, s->ctx.parent_linkage)) {
+		ERR(-EINVAL, "%s: parent %s was modified (%s, expected %s)\n",
+		    s->ctx.file, p->ctx.file, guid, s->ctx.parent_linkage);
+		return -EINVAL;
+	}
+
+	if (p->ctx.size != s->ctx.size ||
+	    p->ctx.logical_sector_size != s->ctx.logical_sector_size)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void
+vhdx_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_vhdx_t *s = driver->data;
+
+	tapdisk_stats_field(st, "blocks", "llu",
+			    (unsigned long long)s->ctx.data_blocks);
+	tapdisk_stats_field(st, "allocated", "llu", s->stats.allocated);
+	tapdisk_stats_field(st, "bitmap_loads", "llu", s->stats.bitmap_loads);
+	tapdisk_stats_field(st, "forwarded", "llu", s->stats.forwarded);
+	tapdisk_stats_field(st, "commits", "llu", s->stats.commits);
+	tapdisk_stats_field(st, "rmw", "llu", s->stats.rmw);
+	tapdisk_stats_field(st, "busy", "llu", s->stats.busy);
+	tapdisk_stats_field(st, "errors", "llu", s->stats.errors);
+}
+
+struct tap_disk tapdisk_vhdx = {
+	.disk_type                  = "tapdisk_vhdx",
+	.flags                      = 0,
+	.private_data_size          = sizeof(td_vhdx_t),
+	.td_open                    = vhdx_open_image,
+	.td_close                   = vhdx_close_image,
+	.td_queue_read              = vhdx_queue_read,
+	.td_queue_write             = vhdx_queue_write,
+	.td_queue_block_status      = vhdx_queue_block_status,
+	.td_get_parent_id           = vhdx_get_parent_id,
+	.td_validate_parent         = vhdx_validate_parent,
+	.td_stats                   = vhdx_stats,
+};
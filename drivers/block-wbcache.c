@@ -0,0 +1,1510 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Write-back cache filter. Guest writes are appended to a log file on
+ * fast local storage and acknowledged once their log record is
+ * durable. The log is destaged to the image below in the background,
+ * in batches sorted and merged by sector. Reads are put together from
+ * the newest log records and the image below.
+ *
+ * The log file is a superblock followed by a circular record area.
+ * Each record has a header with its sequence number, its extent, and
+ * checksums over header and data. The superblock checkpoints the
+ * oldest record not yet destaged, and on open records are replayed
+ * from there for as long as sequence numbers follow on and checksums
+ * match. Writes are acknowledged in log order, so a replay never
+ * stops short of an acknowledged record.
+ *
+ * Destage writes go straight to the parent driver rather than through
+ * the VBD queue, so the log can drain while the VBD quiesces; until it
+ * is empty, the filter reports itself busy.
+ *
+ * The name is the log file, e.g. "wbc:/var/run/blktap/vm.log" as the
+ * first line of an x-chain. A missing or unformatted file is
+ * formatted, TAPDISK_WBC_SIZE_MB bytes large if it is smaller.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "tapdisk.h"
+#include "tapdisk-utils.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
+#include "timeout-math.h"
+
+#define DBG(_f, _a...)       tlog_syslog(TLOG_DBG, _f, ##_a)
+#define INFO(_f, _a...)      tlog_syslog(TLOG_INFO, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+#define MIN(a, b)            ((a) < (b) ? (a) : (b))
+
+#define WBC_SB_MAGIC         0x53434257 /* "WBCS" */
+#define WBC_REC_MAGIC        0x52434257 /* "WBCR" */
+#define WBC_VERSION          1
+
+#define WBC_SB_SIZE          4096       /* records start right after */
+#define WBC_HDR_SIZE         512
+#define WBC_NAME_MAX         256
+#define WBC_DEFAULT_SIZE_MB  1024
+#define WBC_MIN_SIZE         (8ULL << 20)
+
+#define WBC_REGION_SHIFT     11         /* index buckets cover 1MiB */
+#define WBC_BUCKETS          4096
+
+#define WBC_BATCH_RECS       256
+#define WBC_BATCH_BYTES      (16 << 20)
+#define WBC_RUN_SECS         2048       /* merged destage writes <= 1MiB */
+#define WBC_INTERVAL_US      100000
+#define WBC_DESTAGE_DELAY_US 1000000    /* let hot blocks settle first */
+#define WBC_MAX_ERRORS       16         /* failed batches before a drain gives up */
+
+enum {
+	WBC_REC_DATA = 1,
+	WBC_REC_SKIP,                   /* unused space: wrap or failed write */
+};
+
+struct wbc_super {
+	uint32_t                magic;
+	uint32_t                version;
+	uint32_t                epoch;
+	uint32_t                pad;
+	uint64_t                log_end;
+	uint64_t                tail;
+	uint64_t                tail_seq;
+	char                    parent[WBC_NAME_MAX];
+	uint32_t                crc;
+} __attribute__((packed));
+
+struct wbc_rec_hdr {
+	uint32_t                magic;
+	uint32_t                type;
+	uint32_t                epoch;
+	uint32_t                secs;
+	uint64_t                seq;
+	uint64_t                sec;
+	uint32_t                data_crc;
+	uint32_t                hdr_crc;
+} __attribute__((packed));
+
+typedef struct td_wbcache td_wbcache_t;
+struct wbc_rec;
+struct wbc_batch;
+
+struct wbc_link {
+	struct list_head        next;
+	struct wbc_rec         *rec;
+};
+
+struct wbc_run {
+	struct wbc_batch       *batch;
+	td_sector_t             sec;
+	int                     secs;
+	int                     pending;
+	int                     err;
+	char                   *buf;
+};
+
+struct wbc_rec {
+	td_wbcache_t           *s;
+	struct list_head        next;       /* log order */
+	struct list_head        unacked;
+
+	int                     type;
+	uint64_t                seq;
+	uint64_t                off;
+	uint64_t                len;        /* in the log, header included */
+	td_sector_t             sec;
+	int                     secs;
+	struct timeval          ts;
+
+	int                     written;
+	int                     acked;
+	int                     err;
+	int                     superseded;
+	int                     batched;
+	int                     destaged;
+	int                     readers;
+
+	char                   *buf;        /* until acknowledged */
+	td_request_t            treq;
+	struct tiocb            tiocb;
+	struct wbc_run         *run;
+
+	int                     n_links;
+	struct wbc_link        *links;
+};
+
+struct wbc_batch {
+	td_wbcache_t           *s;
+	struct wbc_rec         *last;
+	int                     pending;
+	int                     err;
+
+	int                     n_recs;
+	struct wbc_rec         *recs[WBC_BATCH_RECS];
+	int                     n_runs;
+	struct wbc_run          runs[WBC_BATCH_RECS];
+};
+
+struct wbc_read {
+	td_wbcache_t           *s;
+	struct wbc_rec         *rec;
+	td_request_t            treq;
+	struct tiocb            tiocb;
+};
+
+struct wbc_waiter {
+	struct list_head        next;
+	td_request_t            treq;
+};
+
+struct td_wbcache {
+	td_driver_t            *driver;
+	td_driver_t            *parent;
+	char                   *name;
+	int                     fd;
+	char                   *sb_buf;
+
+	uint32_t                epoch;
+	char                    parent_name[WBC_NAME_MAX];
+	uint64_t                log_end;
+	uint64_t                head;
+	uint64_t                tail;
+	uint64_t                tail_seq;
+	uint64_t                seq;
+	uint64_t                used;
+	int                     failed;
+
+	struct list_head        records;
+	struct list_head        unacked;
+	struct list_head        waiters;
+	struct list_head        buckets[WBC_BUCKETS];
+
+	struct wbc_batch       *batch;
+	int                     reads;
+	int                     draining;
+	int                     errors;
+	event_id_t              timer;
+
+	struct {
+		unsigned long long      writes;
+		unsigned long long      waits;
+		unsigned long long      log_hits;
+		unsigned long long      misses;
+		unsigned long long      replayed;
+		unsigned long long      superseded;
+		unsigned long long      batches;
+		unsigned long long      runs;
+		unsigned long long      destaged;
+		unsigned long long      errors;
+	} stats;
+};
+
+static void wbc_kick(td_wbcache_t *);
+
+#define wbc_area(_s)         ((_s)->log_end - WBC_SB_SIZE)
+
+static inline struct list_head *
+wbc_bucket(td_wbcache_t *s, td_sector_t sec)
+{
+	return &s->buckets[(sec >> WBC_REGION_SHIFT) % WBC_BUCKETS];
+}
+
+static uint32_t
+wbc_crc(const void *buf, size_t size)
+{
+	return crc32(0L, buf, size);
+}
+
+static uint32_t
+wbc_hdr_crc(const struct wbc_rec_hdr *hdr)
+{
+	return wbc_crc(hdr, offsetof(struct wbc_rec_hdr, hdr_crc));
+}
+
+/*
+ * The index maps each 1MiB region to the live records overlapping
+ * it, newest first: records are linked in as they are logged.
+ */
+static int
+wbc_index_insert(td_wbcache_t *s, struct wbc_rec *rec)
+{
+	td_sector_t r, first, last;
+	int i;
+
+	first = rec->sec >> WBC_REGION_SHIFT;
+	last  = (rec->sec + rec->secs - 1) >> WBC_REGION_SHIFT;
+
+	rec->n_links = MIN(last - first + 1, WBC_BUCKETS);
+	rec->links   = calloc(rec->n_links, sizeof(struct wbc_link));
+	if (!rec->links) {
+		rec->n_links = 0;
+		return -ENOMEM;
+	}
+
+	for (i = 0, r = first; i < rec->n_links; i++, r++) {
+		rec->links[i].rec = rec;
+		list_add(&rec->links[i].next,
+			 wbc_bucket(s, r << WBC_REGION_SHIFT));
+	}
+
+	return 0;
+}
+
+static void
+wbc_index_remove(struct wbc_rec *rec)
+{
+	int i;
+
+	for (i = 0; i < rec->n_links; i++)
+		list_del(&rec->links[i].next);
+
+	free(rec->links);
+	rec->links   = NULL;
+	rec->n_links = 0;
+}
+
+static struct wbc_rec *
+wbc_index_lookup(td_wbcache_t *s, td_sector_t sec)
+{
+	struct wbc_link *link;
+	struct wbc_rec *rec;
+
+	list_for_each_entry(link, wbc_bucket(s, sec), next) {
+		rec = link->rec;
+		if (rec->sec <= sec && sec < rec->sec + rec->secs)
+			return rec;
+	}
+
+	return NULL;
+}
+
+/*
+ * Older records entirely overwritten by a durable one need neither
+ * serving nor destaging any more.
+ */
+static void
+wbc_index_supersede(td_wbcache_t *s, struct wbc_rec *rec)
+{
+	struct wbc_link *link;
+	struct wbc_rec *old;
+	td_sector_t first;
+	int i;
+
+	first = rec->sec >> WBC_REGION_SHIFT;
+
+	for (i = 0; i < rec->n_links; i++) {
+	again:
+		list_for_each_entry(link,
+			wbc_bucket(s, (first + i) << WBC_REGION_SHIFT), next) {
+			old = link->rec;
+			if (old == rec || !old->acked || old->seq > rec->seq)
+				continue;
+			if (old->sec < rec->sec ||
+			    old->sec + old->secs > rec->sec + rec->secs)
+				continue;
+
+			old->superseded = 1;
+			wbc_index_remove(old);
+			s->stats.superseded++;
+			goto again;
+		}
+	}
+}
+
+static void
+wbc_rec_free(struct wbc_rec *rec)
+{
+	wbc_index_remove(rec);
+	free(rec->buf);
+	free(rec);
+}
+
+static void
+wbc_fill_hdr(td_wbcache_t *s, struct wbc_rec *rec, const void *data)
+{
+	struct wbc_rec_hdr *hdr = (struct wbc_rec_hdr *)rec->buf;
+
+	memset(rec->buf, 0, WBC_HDR_SIZE);
+	hdr->magic    = WBC_REC_MAGIC;
+	hdr->type     = rec->type;
+	hdr->epoch    = s->epoch;
+	hdr->seq      = rec->seq;
+	hdr->sec      = rec->sec;
+	hdr->secs     = rec->type == WBC_REC_DATA ? rec->secs :
+		(rec->len - WBC_HDR_SIZE) >> SECTOR_SHIFT;
+	hdr->data_crc = data ?
+		wbc_crc(data, (size_t)rec->secs << SECTOR_SHIFT) : 0;
+	hdr->hdr_crc  = wbc_hdr_crc(hdr);
+}
+
+static int
+wbc_write_super(td_wbcache_t *s, uint64_t tail, uint64_t tail_seq)
+{
+	struct wbc_super *sb = (struct wbc_super *)s->sb_buf;
+	ssize_t n;
+
+	memset(s->sb_buf, 0, WBC_SB_SIZE);
+	sb->magic    = WBC_SB_MAGIC;
+	sb->version  = WBC_VERSION;
+	sb->epoch    = s->epoch;
+	sb->log_end  = s->log_end;
+	sb->tail     = tail;
+	sb->tail_seq = tail_seq;
+	memcpy(sb->parent, s->parent_name, sizeof(sb->parent));
+	sb->crc      = wbc_crc(sb, offsetof(struct wbc_super, crc));
+
+	n = pwrite(s->fd, s->sb_buf, WBC_SB_SIZE, 0);
+	if (n != WBC_SB_SIZE)
+		return n < 0 ? -errno : -EIO;
+
+	s->tail     = tail;
+	s->tail_seq = tail_seq;
+	return 0;
+}
+
+/*
+ * Destaged records leave the log in order, once nobody reads from
+ * them any more. Their space is reused only after the superblock
+ * no longer points at them.
+ */
+static void
+wbc_advance_tail(td_wbcache_t *s)
+{
+	struct wbc_rec *rec, *tmp, *stop = NULL;
+	uint64_t tail, tail_seq;
+	int err;
+
+	list_for_each_entry(rec, &s->records, next)
+		if (!rec->destaged || rec->readers) {
+			stop = rec;
+			break;
+		}
+
+	tail     = stop ? stop->off : s->head;
+	tail_seq = stop ? stop->seq : s->seq;
+	if (tail_seq == s->tail_seq)
+		return;
+
+	err = wbc_write_super(s, tail, tail_seq);
+	if (err) {
+		ERR(err, "%s: failed to checkpoint log\n", s->name);
+		return;
+	}
+
+	list_for_each_entry_safe(rec, tmp, &s->records, next) {
+		if (rec == stop)
+			break;
+		s->used -= rec->len;
+		list_del(&rec->next);
+		wbc_rec_free(rec);
+	}
+}
+
+static void
+wbc_ack(td_wbcache_t *s)
+{
+	struct wbc_rec *rec, *tmp;
+
+	list_for_each_entry_safe(rec, tmp, &s->unacked, unacked) {
+		if (!rec->written)
+			break;
+
+		list_del(&rec->unacked);
+		rec->acked = 1;
+		free(rec->buf);
+		rec->buf = NULL;
+
+		/* wrap records carry no guest write */
+		if (!rec->secs)
+			continue;
+
+		/* replay stops short of anything logged after a bad record */
+		if (s->failed && !rec->err)
+			rec->err = -EIO;
+
+		if (!rec->err)
+			wbc_index_supersede(s, rec);
+
+		td_complete_request(rec->treq, rec->err);
+	}
+}
+
+
+/*
+ * A record that failed to reach the log is turned into a skip record,
+ * so that replay steps over it to the ones logged after it. If even
+ * that fails, the log is no good beyond this point.
+ */
+static void
+wbc_rec_fail(td_wbcache_t *s, struct wbc_rec *rec, int err)
+{
+	ssize_t n;
+
+	ERR(err, "%s: log write of %d secs @ %"PRIu64" failed\n",
+	    s->name, rec->secs, rec->sec);
+
+	rec->err = err;
+	if (rec->type != WBC_REC_DATA)
+		goto fail;
+
+	wbc_index_remove(rec);
+	rec->type = WBC_REC_SKIP;
+	wbc_fill_hdr(s, rec, NULL);
+
+	n = pwrite(s->fd, rec->buf, WBC_HDR_SIZE, rec->off);
+	if (n == WBC_HDR_SIZE)
+		return;
+
+fail:
+	if (!s->failed)
+		ERR(-EIO, "%s: log is unusable, failing writes\n", s->name);
+	s->failed = 1;
+}
+
+static void
+__wbc_write_done(void *arg, struct tiocb *tiocb, int err)
+{
+	struct wbc_rec *rec = arg;
+	td_wbcache_t *s = rec->s;
+
+	if (err)
+		wbc_rec_fail(s, rec, err);
+
+	rec->written = 1;
+	gettimeofday(&rec->ts, NULL);
+
+	wbc_ack(s);
+	wbc_kick(s);
+}
+
+static int
+wbc_append_rec(td_wbcache_t *s, int type, td_request_t *treq)
+{
+	struct wbc_rec *rec;
+	size_t bytes;
+	int err;
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return -ENOMEM;
+
+	rec->s    = s;
+	rec->type = type;
+	rec->seq  = s->seq;
+	rec->off  = s->head;
+
+	if (type == WBC_REC_DATA) {
+		rec->treq = *treq;
+		rec->sec  = treq->sec;
+		rec->secs = treq->secs;
+		rec->len  = WBC_HDR_SIZE + ((uint64_t)treq->secs << SECTOR_SHIFT);
+		bytes     = rec->len;
+	} else {
+		rec->len  = s->log_end - s->head;
+		bytes     = WBC_HDR_SIZE;
+	}
+
+	err = posix_memalign((void **)&rec->buf, 4096, bytes);
+	if (err) {
+		free(rec);
+		return -err;
+	}
+
+	if (type == WBC_REC_DATA) {
+		err = wbc_index_insert(s, rec);
+		if (err) {
+			wbc_rec_free(rec);
+			return err;
+		}
+
+		memcpy(rec->buf + WBC_HDR_SIZE, treq->buf,
+		       (size_t)treq->secs << SECTOR_SHIFT);
+		wbc_fill_hdr(s, rec, rec->buf + WBC_HDR_SIZE);
+	} else
+		wbc_fill_hdr(s, rec, NULL);
+
+	s->seq++;
+	s->used += rec->len;
+	s->head += rec->len;
+	if (s->head == s->log_end)
+		s->head = WBC_SB_SIZE;
+
+	list_add_tail(&rec->next, &s->records);
+	list_add_tail(&rec->unacked, &s->unacked);
+
+	td_prep_write(s->driver, &rec->tiocb, s->fd, rec->buf, bytes,
+		      rec->off, __wbc_write_done, rec);
+	td_queue_tiocb(s->driver, &rec->tiocb);
+
+	return 0;
+}
+
+/*
+ * Logs a guest write, wrapping around the end of the log with a skip
+ * record as needed. Returns -ENOSPC, leaving the request alone, while
+ * the log is too full; completes it on any other outcome.
+ */
+static int
+wbc_append(td_wbcache_t *s, td_request_t treq)
+{
+	uint64_t len, pad;
+	int err;
+
+	if (s->failed) {
+		err = -EIO;
+		goto fail;
+	}
+
+	len = WBC_HDR_SIZE + ((uint64_t)treq.secs << SECTOR_SHIFT);
+	if (len > wbc_area(s)) {
+		err = -EFBIG;
+		goto fail;
+	}
+
+	pad = s->head + len > s->log_end ? s->log_end - s->head : 0;
+	if (s->used + pad + len > wbc_area(s))
+		return -ENOSPC;
+
+	if (pad) {
+		err = wbc_append_rec(s, WBC_REC_SKIP, NULL);
+		if (err)
+			goto fail;
+	}
+
+	err = wbc_append_rec(s, WBC_REC_DATA, &treq);
+	if (err)
+		goto fail;
+
+	s->stats.writes++;
+	return 0;
+
+fail:
+	td_complete_request(treq, err);
+	return 0;
+}
+
+static void
+wbc_resume_waiters(td_wbcache_t *s)
+{
+	struct wbc_waiter *w, *tmp;
+
+	list_for_each_entry_safe(w, tmp, &s->waiters, next) {
+		if (wbc_append(s, w->treq) == -ENOSPC)
+			break;
+		list_del(&w->next);
+		free(w);
+	}
+}
+
+static void
+wbc_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	td_wbcache_t *s = driver->data;
+	struct wbc_waiter *w;
+
+	/* in order behind writes already waiting for log space */
+	if (list_empty(&s->waiters) && wbc_append(s, treq) != -ENOSPC)
+		return;
+
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	w->treq = treq;
+	list_add_tail(&w->next, &s->waiters);
+	s->stats.waits++;
+
+	wbc_kick(s);
+}
+
+static void
+__wbc_read_done(void *arg, struct tiocb *tiocb, int err)
+{
+	struct wbc_read *rd = arg;
+	td_wbcache_t *s = rd->s;
+
+	rd->rec->readers--;
+	s->reads--;
+
+	td_complete_request(rd->treq, err);
+	free(rd);
+
+	wbc_advance_tail(s);
+}
+
+static void
+wbc_read_log(td_wbcache_t *s, struct wbc_rec *rec, td_request_t treq)
+{
+	size_t off = (size_t)(treq.sec - rec->sec) << SECTOR_SHIFT;
+	struct wbc_read *rd;
+
+	s->stats.log_hits += treq.secs;
+
+	/* not acknowledged yet: still in memory */
+	if (rec->buf) {
+		memcpy(treq.buf, rec->buf + WBC_HDR_SIZE + off,
+		       (size_t)treq.secs << SECTOR_SHIFT);
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	rd = calloc(1, sizeof(*rd));
+	if (!rd) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	rd->s    = s;
+	rd->rec  = rec;
+	rd->treq = treq;
+
+	rec->readers++;
+	s->reads++;
+
+	td_prep_read(s->driver, &rd->tiocb, s->fd, treq.buf,
+		     (size_t)treq.secs << SECTOR_SHIFT,
+		     rec->off + WBC_HDR_SIZE + off, __wbc_read_done, rd);
+	td_queue_tiocb(s->driver, &rd->tiocb);
+}
+
+/*
+ * Splits a request into runs served by the same log record, or by
+ * none.
+ */
+static void
+wbc_split(td_wbcache_t *s, td_request_t treq,
+	  void (*hit)(td_wbcache_t *, struct wbc_rec *, td_request_t))
+{
+	struct wbc_rec *rec;
+	td_request_t clone;
+	td_sector_t sec, end;
+	int secs;
+
+	sec = treq.sec;
+	end = treq.sec + treq.secs;
+
+	while (sec < end) {
+		rec  = wbc_index_lookup(s, sec);
+		secs = 1;
+		while (sec + secs < end &&
+		       wbc_index_lookup(s, sec + secs) == rec)
+			secs++;
+
+		clone      = treq;
+		clone.sec  = sec;
+		clone.secs = secs;
+		if (treq.buf)
+			clone.buf = treq.buf +
+				((size_t)(sec - treq.sec) << SECTOR_SHIFT);
+
+		if (rec)
+			hit(s, rec, clone);
+		else {
+			s->stats.misses += secs;
+			td_forward_request(clone);
+		}
+
+		sec += secs;
+	}
+}
+
+static void
+wbc_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	wbc_split(driver->data, treq, wbc_read_log);
+}
+
+static void
+wbc_status_log(td_wbcache_t *s, struct wbc_rec *rec, td_request_t treq)
+{
+	treq.status = TD_BLOCK_STATE_NONE;
+	td_complete_request(treq, 0);
+}
+
+static void
+wbc_queue_block_status(td_driver_t *driver, td_request_t treq)
+{
+	wbc_split(driver->data, treq, wbc_status_log);
+}
+
+static void
+wbc_batch_done(td_wbcache_t *s, struct wbc_batch *b)
+{
+	struct wbc_rec *rec;
+	int i;
+
+	list_for_each_entry(rec, &s->records, next) {
+		if (!rec->batched)
+			continue;
+
+		rec->batched = 0;
+		if (!b->err) {
+			rec->destaged = 1;
+			wbc_index_remove(rec);
+		}
+
+		if (rec == b->last)
+			break;
+	}
+
+	for (i = 0; i < b->n_runs; i++)
+		free(b->runs[i].buf);
+
+	if (b->err) {
+		ERR(b->err, "%s: destage failed\n", s->name);
+		s->stats.errors++;
+		s->errors++;
+	} else {
+		s->stats.batches++;
+		s->stats.runs += b->n_runs;
+		s->errors = 0;
+	}
+
+	free(b);
+	s->batch = NULL;
+
+	wbc_advance_tail(s);
+	wbc_resume_waiters(s);
+	wbc_kick(s);
+}
+
+static void
+wbc_batch_put(td_wbcache_t *s, struct wbc_batch *b)
+{
+	if (!--b->pending)
+		wbc_batch_done(s, b);
+}
+
+static void
+__wbc_destage_write_done(td_request_t treq, int err)
+{
+	struct wbc_run *run = treq.cb_data;
+	struct wbc_batch *b = run->batch;
+
+	if (err)
+		b->err = b->err ? : err;
+	else
+		b->s->stats.destaged += run->secs;
+
+	wbc_batch_put(b->s, b);
+}
+
+static void
+wbc_destage_run(td_wbcache_t *s, struct wbc_run *run)
+{
+	td_request_t treq;
+
+	if (run->err) {
+		run->batch->err = run->batch->err ? : run->err;
+		wbc_batch_put(s, run->batch);
+		return;
+	}
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op      = TD_OP_WRITE;
+	treq.buf     = run->buf;
+	treq.sec     = run->sec;
+	treq.secs    = run->secs;
+	treq.cb      = __wbc_destage_write_done;
+	treq.cb_data = run;
+
+	s->parent->ops->td_queue_write(s->parent, treq);
+}
+
+static void
+__wbc_destage_read_done(void *arg, struct tiocb *tiocb, int err)
+{
+	struct wbc_rec *rec = arg;
+	struct wbc_run *run = rec->run;
+
+	rec->run = NULL;
+	if (err)
+		run->err = run->err ? : err;
+
+	if (!--run->pending)
+		wbc_destage_run(rec->s, run);
+}
+
+static int
+wbc_rec_cmp(const void *a, const void *b)
+{
+	const struct wbc_rec *x = *(struct wbc_rec **)a;
+	const struct wbc_rec *y = *(struct wbc_rec **)b;
+
+	return x->sec < y->sec ? -1 : x->sec > y->sec;
+}
+
+static int
+wbc_batch_overlaps(struct wbc_batch *b, struct wbc_rec *rec)
+{
+	struct wbc_rec *r;
+	int i;
+
+	for (i = 0; i < b->n_recs; i++) {
+		r = b->recs[i];
+		if (r->sec < rec->sec + rec->secs &&
+		    rec->sec < r->sec + r->secs)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Takes the oldest acknowledged records, up to the first one that
+ * overlaps another already taken, so a batch can be written in any
+ * order. Superseded and skip records come along for free.
+ */
+static void
+wbc_batch_collect(td_wbcache_t *s, struct wbc_batch *b)
+{
+	struct wbc_rec *rec;
+	uint64_t bytes = 0, size;
+
+	list_for_each_entry(rec, &s->records, next) {
+		if (rec->destaged)
+			continue;
+		if (!rec->acked)
+			break;
+
+		if (rec->type == WBC_REC_DATA && !rec->superseded) {
+			size = (uint64_t)rec->secs << SECTOR_SHIFT;
+			if (b->n_recs == WBC_BATCH_RECS ||
+			    (b->n_recs && bytes + size > WBC_BATCH_BYTES) ||
+			    wbc_batch_overlaps(b, rec))
+				break;
+
+			b->recs[b->n_recs++] = rec;
+			bytes += size;
+		}
+
+		rec->batched = 1;
+		b->last      = rec;
+	}
+}
+
+/*
+ * Merges the sorted records into runs of adjacent sectors, read back
+ * from the log into one buffer per run and written below in one go.
+ */
+static int
+wbc_batch_plan(td_wbcache_t *s, struct wbc_batch *b)
+{
+	struct wbc_run *run = NULL;
+	struct wbc_rec *rec;
+	int i, err;
+
+	qsort(b->recs, b->n_recs, sizeof(b->recs[0]), wbc_rec_cmp);
+
+	for (i = 0; i < b->n_recs; i++) {
+		rec = b->recs[i];
+
+		if (!run || run->sec + run->secs != rec->sec ||
+		    run->secs + rec->secs > WBC_RUN_SECS) {
+			run        = &b->runs[b->n_runs++];
+			run->batch = b;
+			run->sec   = rec->sec;
+			run->secs  = 0;
+		}
+
+		run->secs += rec->secs;
+		run->pending++;
+		rec->run   = run;
+	}
+
+	for (i = 0; i < b->n_runs; i++) {
+		run = &b->runs[i];
+		err = posix_memalign((void **)&run->buf, 4096,
+				     (size_t)run->secs << SECTOR_SHIFT);
+		if (err) {
+			run->buf = NULL;
+			return -err;
+		}
+	}
+
+	return 0;
+}
+
+static void
+wbc_batch_start(td_wbcache_t *s)
+{
+	struct wbc_batch *b;
+	struct wbc_rec *rec;
+	struct wbc_run *run;
+	int i, err;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return;
+
+	b->s     = s;
+	s->batch = b;
+
+	wbc_batch_collect(s, b);
+	if (!b->last) {
+		free(b);
+		s->batch = NULL;
+		return;
+	}
+
+	err = wbc_batch_plan(s, b);
+	if (err) {
+		b->err = err;
+		b->pending = 1;
+		wbc_batch_put(s, b);
+		return;
+	}
+
+	/* one reference per run, and one held while issuing */
+	b->pending = b->n_runs + 1;
+
+	for (i = 0; i < b->n_recs; i++) {
+		rec = b->recs[i];
+		run = rec->run;
+
+		td_prep_read(s->driver, &rec->tiocb, s->fd,
+			     run->buf +
+			     ((size_t)(rec->sec - run->sec) << SECTOR_SHIFT),
+			     (size_t)rec->secs << SECTOR_SHIFT,
+			     rec->off + WBC_HDR_SIZE,
+			     __wbc_destage_read_done, rec);
+		td_queue_tiocb(s->driver, &rec->tiocb);
+	}
+
+	wbc_batch_put(s, b);
+}
+
+static int
+wbc_destage_due(td_wbcache_t *s)
+{
+	struct wbc_rec *rec;
+	struct timeval now;
+	long long age;
+
+	if (!list_empty(&s->waiters) || s->draining ||
+	    s->used * 2 >= wbc_area(s))
+		return 1;
+
+	list_for_each_entry(rec, &s->records, next) {
+		if (rec->destaged)
+			continue;
+		if (!rec->acked)
+			return 0;
+
+		gettimeofday(&now, NULL);
+		age = timeval_to_us(&now) - timeval_to_us(&rec->ts);
+		return age >= WBC_DESTAGE_DELAY_US;
+	}
+
+	return 0;
+}
+
+/*
+ * Destage when the log fills up, when writes have settled, or when
+ * draining. After a failed batch, only the timer retries.
+ */
+static void
+wbc_kick(td_wbcache_t *s)
+{
+	if (s->batch || !s->parent || s->errors)
+		return;
+
+	if (wbc_destage_due(s))
+		wbc_batch_start(s);
+}
+
+static void
+__wbc_timeout(event_id_t id, char mode, void *private)
+{
+	td_wbcache_t *s = private;
+
+	if (s->batch || !s->parent)
+		return;
+
+	if (s->draining && s->errors >= WBC_MAX_ERRORS)
+		return;
+
+	if (wbc_destage_due(s))
+		wbc_batch_start(s);
+}
+
+static int
+wbc_dirty(td_wbcache_t *s)
+{
+	struct wbc_rec *rec;
+
+	list_for_each_entry(rec, &s->records, next)
+		if (!rec->destaged)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Asked while the VBD quiesces: destage everything, without delay,
+ * unless the image below keeps failing.
+ */
+static int
+wbc_busy(td_driver_t *driver)
+{
+	td_wbcache_t *s = driver->data;
+
+	if (!s->draining)
+		INFO("%s: draining log\n", s->name);
+
+	s->draining = 1;
+	wbc_kick(s);
+
+	if (s->batch || s->reads)
+		return 1;
+
+	if (s->errors >= WBC_MAX_ERRORS || !s->parent)
+		return 0;
+
+	return wbc_dirty(s);
+}
+
+static int
+wbc_format(td_wbcache_t *s)
+{
+	const char *env;
+	struct stat st;
+	off_t size;
+	int err;
+
+	err = fstat(s->fd, &st);
+	if (err)
+		return -errno;
+
+	size = lseek(s->fd, 0, SEEK_END);
+	if (size < 0)
+		return -errno;
+
+	if (size < WBC_MIN_SIZE && S_ISREG(st.st_mode)) {
+		env  = getenv("TAPDISK_WBC_SIZE_MB");
+		size = (off_t)(env ? atoi(env) : WBC_DEFAULT_SIZE_MB) << 20;
+
+		err = ftruncate(s->fd, size);
+		if (err)
+			return -errno;
+	}
+
+	if (size < WBC_MIN_SIZE) {
+		ERR(-ENOSPC, "%s: %lld bytes is too small for a log\n",
+		    s->name, (long long)size);
+		return -ENOSPC;
+	}
+
+	/*
+	 * Sequence numbers start from the clock, so records a reformatted
+	 * file may still hold never line up with new ones.
+	 */
+	s->epoch    = 1;
+	s->log_end  = size & ~((off_t)WBC_SB_SIZE - 1);
+	s->tail     = WBC_SB_SIZE;
+	s->tail_seq = (uint64_t)time(NULL) << 20;
+	s->head     = s->tail;
+	s->seq      = s->tail_seq;
+	s->parent_name[0] = '\0';
+
+	INFO("%s: formatted %"PRIu64" byte log\n", s->name, s->log_end);
+	return 0;
+}
+
+/*
+ * Rebuilds the log from the checkpointed tail. Records must follow on
+ * in sequence, from no newer a session than the superblock's, and
+ * match their checksums; the first one that doesn't ends the log.
+ */
+static int
+wbc_replay(td_wbcache_t *s, uint32_t sb_epoch)
+{
+	struct wbc_rec_hdr *hdr;
+	struct wbc_rec *rec;
+	char *buf = NULL, *data = NULL;
+	size_t size, data_size = 0;
+	uint64_t off, seq, len;
+	uint32_t epoch = 0;
+	int err;
+
+	err = posix_memalign((void **)&buf, 4096, WBC_HDR_SIZE);
+	if (err)
+		return -err;
+
+	hdr = (struct wbc_rec_hdr *)buf;
+	off = s->tail;
+	seq = s->tail_seq;
+
+	for (;;) {
+		if (off == s->log_end)
+			off = WBC_SB_SIZE;
+
+		if (s->used + WBC_HDR_SIZE > wbc_area(s))
+			break;
+
+		if (pread(s->fd, buf, WBC_HDR_SIZE, off) != WBC_HDR_SIZE)
+			break;
+
+		if (hdr->magic != WBC_REC_MAGIC ||
+		    hdr->hdr_crc != wbc_hdr_crc(hdr) ||
+		    hdr->seq != seq ||
+		    hdr->epoch < epoch || hdr->epoch > sb_epoch ||
+		    (hdr->type != WBC_REC_DATA && hdr->type != WBC_REC_SKIP))
+			break;
+
+		len = WBC_HDR_SIZE + ((uint64_t)hdr->secs << SECTOR_SHIFT);
+		if (off + len > s->log_end || s->used + len > wbc_area(s))
+			break;
+
+		if (hdr->type == WBC_REC_DATA) {
+			size = (size_t)hdr->secs << SECTOR_SHIFT;
+			if (!size)
+				break;
+
+			if (size > data_size) {
+				free(data);
+				err = posix_memalign((void **)&data, 4096, size);
+				if (err) {
+					data = NULL;
+					err  = -err;
+					goto out;
+				}
+				data_size = size;
+			}
+
+			if (pread(s->fd, data, size, off + WBC_HDR_SIZE) != size ||
+			    wbc_crc(data, size) != hdr->data_crc)
+				break;
+		}
+
+		rec = calloc(1, sizeof(*rec));
+		if (!rec) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		rec->s       = s;
+		rec->type    = hdr->type;
+		rec->seq     = seq;
+		rec->off     = off;
+		rec->len     = len;
+		rec->written = 1;
+		rec->acked   = 1;
+		gettimeofday(&rec->ts, NULL);
+
+		if (rec->type == WBC_REC_DATA) {
+			rec->sec  = hdr->sec;
+			rec->secs = hdr->secs;
+
+			err = wbc_index_insert(s, rec);
+			if (err) {
+				free(rec);
+				goto out;
+			}
+
+			wbc_index_supersede(s, rec);
+			s->stats.replayed++;
+		}
+
+		list_add_tail(&rec->next, &s->records);
+
+		s->used += len;
+		off     += len;
+		epoch    = hdr->epoch;
+		seq++;
+	}
+
+	s->head = off == s->log_end ? WBC_SB_SIZE : off;
+	s->seq  = seq;
+	err     = 0;
+
+out:
+	free(data);
+	free(buf);
+	return err;
+}
+
+static int
+wbc_load(td_wbcache_t *s)
+{
+	struct wbc_super *sb = (struct wbc_super *)s->sb_buf;
+	off_t size;
+	int err;
+
+	if (pread(s->fd, s->sb_buf, WBC_SB_SIZE, 0) != WBC_SB_SIZE ||
+	    sb->magic != WBC_SB_MAGIC) {
+		err = wbc_format(s);
+		if (err)
+			return err;
+		goto out;
+	}
+
+	size = lseek(s->fd, 0, SEEK_END);
+
+	if (sb->version != WBC_VERSION ||
+	    sb->crc != wbc_crc(sb, offsetof(struct wbc_super, crc)) ||
+	    sb->log_end > size || sb->log_end < WBC_MIN_SIZE ||
+	    sb->tail < WBC_SB_SIZE || sb->tail >= sb->log_end) {
+		ERR(-EINVAL, "%s: bad superblock\n", s->name);
+		return -EINVAL;
+	}
+
+	s->epoch    = sb->epoch + 1;
+	s->log_end  = sb->log_end;
+	s->tail     = sb->tail;
+	s->tail_seq = sb->tail_seq;
+	memcpy(s->parent_name, sb->parent, sizeof(s->parent_name));
+	s->parent_name[sizeof(s->parent_name) - 1] = '\0';
+
+	err = wbc_replay(s, sb->epoch);
+	if (err)
+		return err;
+
+out:
+	/* a new session: stale records after the head are left behind */
+	return wbc_write_super(s, s->tail, s->tail_seq);
+}
+
+static int
+wbc_close(td_driver_t *driver)
+{
+	td_wbcache_t *s = driver->data;
+	struct wbc_waiter *w, *wt;
+	struct wbc_rec *rec, *tmp;
+
+	if (s->timer >= 0) {
+		tapdisk_server_unregister_event(s->timer);
+		s->timer = -1;
+	}
+
+	if (wbc_dirty(s))
+		INFO("%s: closing with log not destaged, "
+		     "%"PRIu64" bytes in use\n", s->name, s->used);
+
+	list_for_each_entry_safe(w, wt, &s->waiters, next) {
+		list_del(&w->next);
+		td_complete_request(w->treq, -EIO);
+		free(w);
+	}
+
+	list_for_each_entry_safe(rec, tmp, &s->records, next) {
+		list_del(&rec->next);
+		wbc_rec_free(rec);
+	}
+
+	if (s->fd >= 0)
+		close(s->fd);
+	s->fd = -1;
+
+	free(s->sb_buf);
+	s->sb_buf = NULL;
+	free(s->name);
+	s->name = NULL;
+
+	return 0;
+}
+
+static int
+wbc_open(td_driver_t *driver, const char *name,
+	 struct td_vbd_encryption *encryption, td_flag_t flags)
+{
+	td_wbcache_t *s = driver->data;
+	int i, o_flags, err;
+	event_id_t id;
+
+	memset(s, 0, sizeof(*s));
+	s->driver = driver;
+	s->fd     = -1;
+	s->timer  = -1;
+
+	INIT_LIST_HEAD(&s->records);
+	INIT_LIST_HEAD(&s->unacked);
+	INIT_LIST_HEAD(&s->waiters);
+	for (i = 0; i < WBC_BUCKETS; i++)
+		INIT_LIST_HEAD(&s->buckets[i]);
+
+	if (flags & TD_OPEN_RDONLY) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	s->name = strdup(name);
+	if (!s->name) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = posix_memalign((void **)&s->sb_buf, 4096, WBC_SB_SIZE);
+	if (err) {
+		s->sb_buf = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	o_flags = O_RDWR | O_CREAT | O_DIRECT | O_DSYNC | O_LARGEFILE;
+	s->fd = open(name, o_flags, 0600);
+	if (s->fd == -1 && errno == EINVAL) {
+		/* Maybe O_DIRECT isn't supported. */
+		o_flags &= ~O_DIRECT;
+		s->fd = open(name, o_flags, 0600);
+	}
+	if (s->fd == -1) {
+		err = -errno;
+		ERR(err, "%s: failed to open log\n", name);
+		goto fail;
+	}
+
+	err = wbc_load(s);
+	if (err)
+		goto fail;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+					   TV_USECS(WBC_INTERVAL_US),
+					   __wbc_timeout, s);
+	if (id < 0) {
+		err = id;
+		goto fail;
+	}
+	s->timer = id;
+
+	INFO("%s: %llu records replayed, %"PRIu64" of %"PRIu64" "
+	     "bytes in use\n", s->name, s->stats.replayed,
+	     s->used, wbc_area(s));
+
+	return 0;
+
+fail:
+	wbc_close(driver);
+	return err;
+}
+
+static int
+wbc_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	return -EINVAL;
+}
+
+/*
+ * The log belongs to the image it was written for: a log still holding
+ * writes for another one is refused. Destage writes are handed to the
+ * parent driver directly, which must therefore be an image proper.
+ */
+static int
+wbc_validate_parent(td_driver_t *driver,
+		    td_driver_t *pdriver, td_flag_t flags)
+{
+	td_wbcache_t *s = driver->data;
+	int err;
+
+	if ((tapdisk_disk_types[pdriver->type]->flags & DISK_TYPE_FILTER) ||
+	    pdriver->type == DISK_TYPE_LLPCACHE ||
+	    pdriver->type == DISK_TYPE_LLECACHE) {
+		ERR(-EINVAL, "%s: must be stacked right on an image\n",
+		    s->name);
+		return -EINVAL;
+	}
+
+	if (strncmp(s->parent_name, pdriver->name, WBC_NAME_MAX - 1)) {
+		if (s->parent_name[0] && wbc_dirty(s)) {
+			ERR(-EINVAL, "%s: holds writes for %s, not %s\n",
+			    s->name, s->parent_name, pdriver->name);
+			return -EINVAL;
+		}
+
+		snprintf(s->parent_name, sizeof(s->parent_name),
+			 "%s", pdriver->name);
+
+		err = wbc_write_super(s, s->tail, s->tail_seq);
+		if (err)
+			return err;
+	}
+
+	s->parent = pdriver;
+
+	return 0;
+}
+
+static void
+wbc_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_wbcache_t *s = driver->data;
+
+	tapdisk_stats_field(st, "log", "[");
+	tapdisk_stats_val(st, "llu", (unsigned long long)s->used);
+	tapdisk_stats_val(st, "llu", (unsigned long long)wbc_area(s));
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "draining", "d", s->draining);
+	tapdisk_stats_field(st, "failed", "d", s->failed);
+	tapdisk_stats_field(st, "writes", "llu", s->stats.writes);
+	tapdisk_stats_field(st, "waits", "llu", s->stats.waits);
+	tapdisk_stats_field(st, "log_hits", "llu", s->stats.log_hits);
+	tapdisk_stats_field(st, "misses", "llu", s->stats.misses);
+	tapdisk_stats_field(st, "replayed", "llu", s->stats.replayed);
+	tapdisk_stats_field(st, "superseded", "llu", s->stats.superseded);
+	tapdisk_stats_field(st, "batches", "llu", s->stats.batches);
+	tapdisk_stats_field(st, "runs", "llu", s->stats.runs);
+	tapdisk_stats_field(st, "destaged", "llu", s->stats.destaged);
+	tapdisk_stats_field(st, "errors", "llu", s->stats.errors);
+}
+
+struct tap_disk tapdisk_wbcache = {
+	.disk_type                  = "tapdisk_wbcache",
+	.flags                      = 0,
+	.private_data_size          = sizeof(td_wbcache_t),
+	.td_open                    = wbc_open,
+	.td_close                   = wbc_close,
+	.td_queue_read              = wbc_queue_read,
+	.td_queue_write             = wbc_queue_write,
+	.td_queue_block_status      = wbc_queue_block_status,
+	.td_get_parent_id           = wbc_get_parent_id,
+	.td_validate_parent         = wbc_validate_parent,
+	.td_stats                   = wbc_stats,
+	.td_busy                    = wbc_busy,
+};
@@ -47,6 +47,7 @@ union uioc {
 struct tiocb {
 	td_queue_callback_t   cb;
 	void                 *arg;
+	int                   io_class; /* enum td_vreq_class */
 
         union uioc	      uiocb;
 	struct tiocb         *next;
@@ -56,6 +56,8 @@
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
 
 #define libaio_backend_queue_count(q) ((q)->queued)
+#define LIO_BG_RATIO                  8
+
 #define libaio_backend_queue_empty(q) ((q)->queued == 0)
 #define libaio_backend_queue_full(q)  \
 	(((q)->tiocbs_pending + (q)->queued) >= (q)->size)
@@ -84,6 +86,13 @@ typedef struct _libaio_queue {
 	struct tlist          deferred;
 	int                   tiocbs_deferred;
 
+	/* tiocbs of the background classes wait on their own list, and
+	 * leave the last 'reserve' slots to foreground I/O. Once they
+	 * have been passed over LIO_BG_RATIO times, one goes ahead. */
+	struct tlist          deferred_bg;
+	int                   reserve;
+	int                   fg_run;
+
 	/* optional tapdisk filter */
 	struct tfilter       *filter;
 
@@ -127,10 +136,25 @@ deferred_tiocbs(libaio_queue *queue)
 	return (queue->deferred.head != NULL);
 }
 
+static inline int
+deferred_bg_tiocbs(libaio_queue *queue)
+{
+	return (queue->deferred_bg.head != NULL);
+}
+
+static inline int
+bg_may_queue(libaio_queue *queue)
+{
+	return queue->tiocbs_pending + queue->queued <
+		queue->size - queue->reserve ||
+		queue->fg_run >= LIO_BG_RATIO;
+}
+
 static inline void
 defer_tiocb(libaio_queue *queue, struct tiocb *tiocb)
 {
-	struct tlist *list = &queue->deferred;
+	struct tlist *list = tiocb->io_class ?
+		&queue->deferred_bg : &queue->deferred;
 
 	if (!list->head)
 		list->head = list->tail = tiocb;
@@ -142,10 +166,8 @@ defer_tiocb(libaio_queue *queue, struct tiocb *tiocb)
 }
 
 static inline void
-queue_deferred_tiocb(libaio_queue *queue)
+queue_deferred_tiocb(libaio_queue *queue, struct tlist *list)
 {
-	struct tlist *list = &queue->deferred;
-
 	if (list->head) {
 		struct tiocb *tiocb = list->head;
 
@@ -153,6 +175,7 @@ queue_deferred_tiocb(libaio_queue *queue)
 		if (!list->head)
 			list->tail = NULL;
 
+		tiocb->next = NULL;
 		queue_tiocb(queue, tiocb);
 		queue->tiocbs_deferred--;
 	}
@@ -161,8 +184,18 @@ queue_deferred_tiocb(libaio_queue *queue)
 static inline void
 queue_deferred_tiocbs(libaio_queue *queue)
 {
-	while (!libaio_backend_queue_full(queue) && deferred_tiocbs(queue))
-		queue_deferred_tiocb(queue);
+	while (!libaio_backend_queue_full(queue)) {
+		if (deferred_bg_tiocbs(queue) && bg_may_queue(queue) &&
+		    (queue->fg_run >= LIO_BG_RATIO || !deferred_tiocbs(queue))) {
+			queue_deferred_tiocb(queue, &queue->deferred_bg);
+			queue->fg_run = 0;
+		} else if (deferred_tiocbs(queue)) {
+			queue_deferred_tiocb(queue, &queue->deferred);
+			if (deferred_bg_tiocbs(queue))
+				queue->fg_run++;
+		} else
+			break;
+	}
 }
 
 /*
@@ -171,7 +204,7 @@ queue_deferred_tiocbs(libaio_queue *queue)
 static void
 complete_tiocb(libaio_queue *queue, struct tiocb *tiocb, unsigned long res)
 {
-	int err;
+	int err, io_class;
 	struct iocb *iocb = &(tiocb->uiocb.io);
 
 	if (res == iocb_nbytes(iocb))
@@ -181,7 +214,10 @@ complete_tiocb(libaio_queue *queue, struct tiocb *tiocb, unsigned long res)
 	else
 		err = -EIO;
 
+	/* follow-up I/O, e.g. metadata updates, is foreground */
+	io_class = tapdisk_server_set_io_class(TD_VREQ_CLASS_FG);
 	tiocb->cb(tiocb->arg, tiocb, err);
+	tapdisk_server_set_io_class(io_class);
 }
 
 static int
@@ -591,8 +627,9 @@ libaio_backend_init_queue(tqueue *q, int size,
 
 	memset(queue, 0, sizeof(libaio_queue));
 
-	queue->size   = size;
-	queue->filter = filter;
+	queue->size    = size;
+	queue->reserve = size / 4;
+	queue->filter  = filter;
 
 	if (!size)
 		return 0;
@@ -640,6 +677,17 @@ libaio_backend_debug_queue(tqueue q)
 			     iocb_nbytes(io), iocb_offset(io));
 		}
 	}
+
+	tiocb = queue->deferred_bg.head;
+	if (tiocb) {
+		WARN("deferred, background (fg_run %d):\n", queue->fg_run);
+		for (; tiocb != NULL; tiocb = tiocb->next) {
+			struct iocb *io = &(tiocb->uiocb.io);
+			WARN("%s of %lu bytes at %lld\n",
+			     iocb_opcode(io),
+			     iocb_nbytes(io), iocb_offset(io));
+		}
+	}
 }
 
 static void
@@ -664,9 +712,20 @@ libaio_backend_queue_tiocb(tqueue q, struct tiocb *tiocb)
 {
 	libaio_queue* queue = (libaio_queue*)q;
 
-	if (!libaio_backend_queue_full(queue))
+	if (tiocb->io_class) {
+		if (!libaio_backend_queue_full(queue) &&
+		    !deferred_bg_tiocbs(queue) && bg_may_queue(queue))
+			queue_tiocb(queue, tiocb);
+		else
+			defer_tiocb(queue, tiocb);
+		return;
+	}
+
+	if (!libaio_backend_queue_full(queue)) {
 		queue_tiocb(queue, tiocb);
-	else
+		if (deferred_bg_tiocbs(queue))
+			queue->fg_run++;
+	} else
 		defer_tiocb(queue, tiocb);
 }
 
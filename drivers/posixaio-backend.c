@@ -199,7 +199,7 @@ queue_deferred_tiocbs(posix_aio_queue *queue)
 static void
 complete_tiocb(posix_aio_queue *queue, struct tiocb *tiocb)
 {
-	int err;
+	int err, io_class;
 	unsigned long actual_res;
 	struct aiocb *aiocb = &(tiocb->uiocb.aio);
 	unsigned long res = aiocb->aio_nbytes;
@@ -212,7 +212,10 @@ complete_tiocb(posix_aio_queue *queue, struct tiocb *tiocb)
 	else
 		err = -EIO;
 
+	/* follow-up I/O, e.g. metadata updates, is foreground */
+	io_class = tapdisk_server_set_io_class(TD_VREQ_CLASS_FG);
 	tiocb->cb(tiocb->arg, tiocb, err);
+	tapdisk_server_set_io_class(io_class);
 }
 
 struct lio {
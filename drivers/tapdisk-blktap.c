@@ -353,10 +353,11 @@ tapdisk_blktap_parse_request(td_blktap_t *tap,
 	snprintf(req->name, sizeof(req->name),
 		 "tap-%d.%d", tap->minor, req->id);
 
-	vreq->op    = op;
-	vreq->name  = req->name;
-	vreq->token = tap;
-	vreq->cb    = __tapdisk_blktap_request_cb;
+	vreq->op       = op;
+	vreq->name     = req->name;
+	vreq->token    = tap;
+	vreq->cb       = __tapdisk_blktap_request_cb;
+	vreq->io_class = TD_VREQ_CLASS_FG;
 
 	tapdisk_blktap_vector_request(tap, msg, req);
 
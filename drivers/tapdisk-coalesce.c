@@ -0,0 +1,570 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Online leaf coalesce, see tapdisk-coalesce.h.
+ *
+ * What the leaf holds is found from its BAT and sector bitmaps, read
+ * through a private libvhd handle a few entries per tick. Copies are
+ * read through the VBD, like any other request, and written to a second,
+ * writable instance of the parent image. Only the leaf ever serves the
+ * sectors copied, so the read-only instance in the chain never sees
+ * them. The dirty bitmap and the copies belong to a td_copier; guest
+ * writes mark what they touch again, and the switch only happens once
+ * the VBD is quiesced with the bitmap clean.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-image.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-dirty.h"
+#include "tapdisk-coalesce.h"
+
+#define DBG(_f, _a...)       tlog_syslog(TLOG_DBG, _f, ##_a)
+#define INFO(_f, _a...)      tlog_syslog(TLOG_INFO, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+#define COALESCE_BLOCK_SECS  (1ULL << TD_COALESCE_BLOCK_SHIFT)
+
+#define COALESCE_BUSY_STATES (TD_VBD_DEAD |			\
+			      TD_VBD_CLOSED |			\
+			      TD_VBD_QUIESCE_REQUESTED |	\
+			      TD_VBD_QUIESCED |			\
+			      TD_VBD_PAUSE_REQUESTED |		\
+			      TD_VBD_PAUSED)
+
+/*
+ * Drops everything but the state and the stats, once no copy is left
+ * in flight.
+ */
+static void
+coalesce_release(struct td_vbd_coalesce *cs)
+{
+	td_copier_stop(cs->copier);
+
+	if (cs->target) {
+		tapdisk_image_close(cs->target);
+		cs->target = NULL;
+	}
+
+	if (cs->vhd_open) {
+		vhd_close(&cs->vhd);
+		cs->vhd_open = 0;
+	}
+
+	cs->leaf   = NULL;
+	cs->parent = NULL;
+}
+
+static void
+coalesce_fail(struct td_vbd_coalesce *cs, int err)
+{
+	td_vbd_t *vbd = cs->vbd;
+
+	if (cs->state >= TD_COALESCE_DONE)
+		return;
+
+	if (err == -ECANCELED)
+		INFO("%s: coalesce aborted\n", vbd->name);
+	else
+		ERR(err, "%s: coalesce failed\n", vbd->name);
+
+	cs->state = TD_COALESCE_FAILED;
+	cs->error = err;
+}
+
+/*
+ * Marks the next few allocated leaf blocks dirty, at the granularity of
+ * the copy bitmap. Blocks the batmap knows to be full skip the sector
+ * bitmap read.
+ */
+static int
+coalesce_scan(struct td_vbd_coalesce *cs)
+{
+	struct td_dirty_map *dirty = &cs->copier->map;
+	vhd_context_t *vhd = &cs->vhd;
+	uint64_t before;
+	uint32_t blk, i, j, n;
+	int err, full;
+	char *map;
+
+	before = dirty->ndirty;
+
+	for (n = 0;
+	     n < TD_COALESCE_SCAN_BLOCKS && cs->scan < vhd->bat.entries;
+	     n++, cs->scan++) {
+		td_sector_t sec;
+
+		blk = cs->scan;
+		if (vhd->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+
+		sec  = (td_sector_t)blk * vhd->spb;
+		full = vhd_has_batmap(vhd) &&
+			vhd_batmap_test(vhd, &vhd->batmap, blk);
+		if (full) {
+			td_dirty_mark(dirty, sec, vhd->spb);
+			continue;
+		}
+
+		err = vhd_read_bitmap(vhd, blk, &map);
+		if (err)
+			return err;
+
+		for (i = 0; i < vhd->spb; i += COALESCE_BLOCK_SECS)
+			for (j = i; j < MIN(i + COALESCE_BLOCK_SECS, vhd->spb); j++)
+				if (vhd_bitmap_test(vhd, map, j)) {
+					td_dirty_mark(dirty, sec + i, 1);
+					break;
+				}
+
+		free(map);
+	}
+
+	cs->stats.allocated += dirty->ndirty - before;
+
+	if (cs->scan >= vhd->bat.entries) {
+		INFO("%s: coalesce scan done, %llu blocks to copy\n",
+		     cs->vbd->name, cs->stats.allocated);
+		vhd_close(vhd);
+		cs->vhd_open = 0;
+		cs->state    = TD_COALESCE_COPYING;
+	}
+
+	return 0;
+}
+
+void
+tapdisk_vbd_coalesce_mark(td_vbd_t *vbd, td_sector_t sec, int secs)
+{
+	struct td_vbd_coalesce *cs = vbd->coalesce;
+
+	if (!cs || cs->state >= TD_COALESCE_DONE)
+		return;
+
+	td_copier_mark(cs->copier, sec, secs);
+}
+
+static int
+__coalesce_write(struct td_copier *c, td_request_t treq)
+{
+	struct td_vbd_coalesce *cs = c->private;
+
+	if (cs->state != TD_COALESCE_COPYING || !cs->target)
+		return -ECANCELED;
+
+	treq.image = cs->target;
+	td_queue_write(treq.image, treq);
+
+	return 0;
+}
+
+static void
+__coalesce_done(struct td_copier *c, struct td_copy_chunk *chunk, int err)
+{
+	struct td_vbd_coalesce *cs = c->private;
+
+	/*
+	 * -EBUSY only means the parent ran out of requests: copy again
+	 * later. Anything else is the parent at fault, so give up.
+	 */
+	if (err && chunk->writing && err != -EBUSY) {
+		ERR(err, "%s: coalesce write of block %"PRIu64" failed\n",
+		    cs->vbd->name, chunk->block);
+		coalesce_fail(cs, err);
+	}
+}
+
+/*
+ * With the VBD quiesced, replaces the leaf and the read-only parent by
+ * the writable parent. Guest requests queued meanwhile are issued
+ * against the new chain once the queue restarts.
+ */
+static int
+coalesce_switch(struct td_vbd_coalesce *cs)
+{
+	td_vbd_t *vbd = cs->vbd;
+	td_image_t *leaf, *parent, *target;
+	char *name;
+	int err;
+
+	leaf   = list_entry(vbd->images.next, td_image_t, next);
+	parent = list_entry(leaf->next.next, td_image_t, next);
+	target = cs->target;
+
+	if (leaf != cs->leaf || parent != cs->parent)
+		return -ESTALE;
+
+	err = asprintf(&name, "%s:%s",
+		       tapdisk_disk_types[target->type]->name, target->name);
+	if (err < 0)
+		return -ENOMEM;
+
+	list_del(&leaf->next);
+	list_del(&parent->next);
+	list_add(&target->next, &vbd->images);
+	cs->target = NULL;
+
+	tapdisk_image_close(leaf);
+	tapdisk_image_close(parent);
+
+	INFO("%s: coalesced into parent, %llu blocks copied, "
+	     "now running on %s\n", vbd->name, cs->copier->stats.copied, name);
+
+	free(vbd->name);
+	vbd->name  = name;
+	cs->state  = TD_COALESCE_DONE;
+
+	return 0;
+}
+
+static void
+coalesce_restart_queue(td_vbd_t *vbd)
+{
+	tapdisk_vbd_start_queue(vbd);
+	tapdisk_vbd_check_state(vbd);
+}
+
+/*
+ * Called once the bitmap went clean: waits for the VBD to quiesce, then
+ * either switches or, if a last write slipped in, goes back to copying.
+ * A pause racing the switch wins, and frees the coalesce on its way.
+ */
+static void
+coalesce_try_switch(struct td_vbd_coalesce *cs)
+{
+	td_vbd_t *vbd = cs->vbd;
+	int err;
+
+	if (td_flag_test(vbd->state, TD_VBD_DEAD |
+			 TD_VBD_CLOSED |
+			 TD_VBD_PAUSE_REQUESTED |
+			 TD_VBD_PAUSED))
+		return;
+
+	if (!td_flag_test(vbd->state, TD_VBD_QUIESCED) &&
+	    tapdisk_vbd_quiesce_queue(vbd))
+		return;
+
+	if (cs->copier->map.ndirty) {
+		DBG("%s: %"PRIu64" blocks dirtied while quiescing\n",
+		    vbd->name, cs->copier->map.ndirty);
+		cs->state = TD_COALESCE_COPYING;
+	} else {
+		err = coalesce_switch(cs);
+		if (err)
+			coalesce_fail(cs, err);
+	}
+
+	coalesce_restart_queue(vbd);
+}
+
+static void
+__coalesce_tick(struct td_copier *c)
+{
+	struct td_vbd_coalesce *cs = c->private;
+	td_vbd_t *vbd = cs->vbd;
+	int err;
+
+	switch (cs->state) {
+	case TD_COALESCE_SCANNING:
+		if (td_flag_test(vbd->state, COALESCE_BUSY_STATES))
+			break;
+
+		err = coalesce_scan(cs);
+		if (err)
+			coalesce_fail(cs, err);
+		break;
+
+	case TD_COALESCE_COPYING:
+		if (td_flag_test(vbd->state, COALESCE_BUSY_STATES))
+			break;
+
+		td_copier_issue(c);
+
+		if (!c->map.ndirty && !c->inflight) {
+			cs->state = TD_COALESCE_SWITCHING;
+			coalesce_try_switch(cs);
+		}
+		break;
+
+	case TD_COALESCE_SWITCHING:
+		coalesce_try_switch(cs);
+		break;
+
+	case TD_COALESCE_DONE:
+	case TD_COALESCE_FAILED:
+		break;
+	}
+
+	if (cs->state >= TD_COALESCE_DONE && !c->inflight)
+		coalesce_release(cs);
+}
+
+static const struct td_copy_ops coalesce_copy_ops = {
+	.tick  = __coalesce_tick,
+	.write = __coalesce_write,
+	.done  = __coalesce_done,
+};
+
+static struct td_vbd_coalesce *
+tapdisk_vbd_coalesce_create(td_vbd_t *vbd, td_image_t *leaf,
+			    td_image_t *parent)
+{
+	struct td_vbd_coalesce *cs;
+	const char *env;
+	uint64_t rate;
+
+	cs = calloc(1, sizeof(*cs));
+	if (!cs)
+		return NULL;
+
+	rate = TD_COALESCE_DEFAULT_RATE;
+	env = getenv("TAPDISK_COALESCE_RATE_MB");
+	if (env && strtoull(env, NULL, 10))
+		rate = strtoull(env, NULL, 10) << 20;
+
+	cs->vbd    = vbd;
+	cs->leaf   = leaf;
+	cs->parent = parent;
+	cs->copier = td_copier_create(vbd, "coalesce", leaf->info.size,
+				      TD_COALESCE_BLOCK_SHIFT,
+				      TD_COALESCE_CHUNK_BLOCKS,
+				      TD_COALESCE_MAX_INFLIGHT,
+				      rate, TD_COALESCE_INTERVAL_US,
+				      &coalesce_copy_ops, cs);
+	if (!cs->copier) {
+		free(cs);
+		return NULL;
+	}
+
+	return cs;
+}
+
+/*
+ * Writes already in flight may be allocating leaf blocks the scan will
+ * miss, mark them up front.
+ */
+static void
+coalesce_mark_pending(struct td_vbd_coalesce *cs)
+{
+	td_vbd_t *vbd = cs->vbd;
+	td_vbd_request_t *vreq;
+	uint64_t secs;
+	int i;
+
+	list_for_each_entry(vreq, &vbd->pending_requests, next) {
+		if (vreq->op != TD_OP_WRITE)
+			continue;
+
+		for (secs = 0, i = 0; i < vreq->iovcnt; i++)
+			secs += vreq->iov[i].secs;
+
+		td_dirty_mark(&cs->copier->map, vreq->sec, secs);
+	}
+}
+
+int
+tapdisk_vbd_coalesce_start(td_vbd_t *vbd)
+{
+	struct td_vbd_coalesce *cs = vbd->coalesce;
+	td_image_t *leaf, *parent;
+	int err;
+
+	if (cs) {
+		if (cs->state < TD_COALESCE_DONE || cs->copier->inflight)
+			return -EBUSY;
+		tapdisk_vbd_coalesce_free(vbd);
+	}
+
+	if (td_flag_test(vbd->state, COALESCE_BUSY_STATES))
+		return -EBUSY;
+
+	if (vbd->secondary || vbd->retired || vbd->resync)
+		return -EBUSY;
+
+	if (list_empty(&vbd->images))
+		return -ENODEV;
+
+	leaf = list_entry(vbd->images.next, td_image_t, next);
+	if (list_is_last(&leaf->next, &vbd->images)) {
+		EPRINTF("%s: no parent to coalesce into\n", vbd->name);
+		return -EINVAL;
+	}
+
+	parent = list_entry(leaf->next.next, td_image_t, next);
+	if (leaf->type != DISK_TYPE_VHD || parent->type != DISK_TYPE_VHD) {
+		EPRINTF("%s: can only coalesce a vhd leaf into a vhd parent\n",
+			vbd->name);
+		return -EINVAL;
+	}
+
+	if (leaf->info.size != parent->info.size) {
+		EPRINTF("%s: leaf and parent differ in size\n", vbd->name);
+		return -EINVAL;
+	}
+
+	if (parent->driver->refcnt > 1) {
+		EPRINTF("%s: parent %s is shared\n", vbd->name, parent->name);
+		return -EBUSY;
+	}
+
+	cs = tapdisk_vbd_coalesce_create(vbd, leaf, parent);
+	if (!cs)
+		return -ENOMEM;
+
+	err = vhd_open(&cs->vhd, leaf->name, VHD_OPEN_RDONLY);
+	if (err) {
+		ERR(err, "%s: failed to open leaf %s\n", vbd->name, leaf->name);
+		goto fail;
+	}
+	cs->vhd_open = 1;
+
+	err = vhd_get_bat(&cs->vhd);
+	if (err)
+		goto fail;
+
+	if (vhd_has_batmap(&cs->vhd)) {
+		err = vhd_get_batmap(&cs->vhd);
+		if (err)
+			goto fail;
+	}
+
+	err = tapdisk_image_open(parent->type, parent->name,
+				 parent->flags &
+				 ~(TD_OPEN_RDONLY | TD_OPEN_SHAREABLE),
+				 &vbd->encryption, &cs->target);
+	if (err) {
+		ERR(err, "%s: failed to reopen parent %s writable\n",
+		    vbd->name, parent->name);
+		goto fail;
+	}
+
+	err = td_copier_start(cs->copier);
+	if (err) {
+		ERR(err, "%s: failed to schedule coalesce\n", vbd->name);
+		goto fail;
+	}
+
+	coalesce_mark_pending(cs);
+	vbd->coalesce = cs;
+
+	INFO("%s: coalescing %s into %s\n", vbd->name,
+	     leaf->name, parent->name);
+
+	return 0;
+
+fail:
+	coalesce_release(cs);
+	td_copier_destroy(cs->copier);
+	free(cs);
+	return err;
+}
+
+int
+tapdisk_vbd_coalesce_abort(td_vbd_t *vbd)
+{
+	struct td_vbd_coalesce *cs = vbd->coalesce;
+
+	if (!cs || cs->state >= TD_COALESCE_DONE)
+		return -ENOENT;
+
+	/* don't leave the queue stalled on a switch that won't happen */
+	if (cs->state == TD_COALESCE_SWITCHING &&
+	    !td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED |
+			  TD_VBD_PAUSED))
+		coalesce_restart_queue(vbd);
+
+	coalesce_fail(cs, -ECANCELED);
+
+	return 0;
+}
+
+int
+tapdisk_vbd_coalesce_busy(td_vbd_t *vbd)
+{
+	struct td_vbd_coalesce *cs = vbd->coalesce;
+
+	return cs ? td_copier_busy(cs->copier) : 0;
+}
+
+void
+tapdisk_vbd_coalesce_free(td_vbd_t *vbd)
+{
+	struct td_vbd_coalesce *cs = vbd->coalesce;
+
+	if (!cs)
+		return;
+
+	coalesce_release(cs);
+	td_copier_destroy(cs->copier);
+	free(cs);
+	vbd->coalesce = NULL;
+}
+
+void
+tapdisk_vbd_coalesce_stats(td_vbd_t *vbd, td_stats_t *st)
+{
+	struct td_vbd_coalesce *cs = vbd->coalesce;
+	struct td_copier *c = cs->copier;
+	static const char *states[] = {
+		[TD_COALESCE_SCANNING]  = "scanning",
+		[TD_COALESCE_COPYING]   = "copying",
+		[TD_COALESCE_SWITCHING] = "switching",
+		[TD_COALESCE_DONE]      = "done",
+		[TD_COALESCE_FAILED]    = "failed",
+	};
+
+	tapdisk_stats_field(st, "state", "s", states[cs->state]);
+	tapdisk_stats_field(st, "error", "d", cs->error);
+	tapdisk_stats_field(st, "blocks", "llu", c->map.nbits);
+	tapdisk_stats_field(st, "dirty", "llu", c->map.ndirty);
+	tapdisk_stats_field(st, "inflight", "d", c->inflight);
+	tapdisk_stats_field(st, "rate", "llu", c->rate);
+	tapdisk_stats_field(st, "allocated", "llu", cs->stats.allocated);
+	tapdisk_stats_field(st, "passes", "llu", c->map.passes);
+	tapdisk_stats_field(st, "copied", "llu", c->stats.copied);
+	tapdisk_stats_field(st, "redirtied", "llu", c->stats.redirtied);
+	tapdisk_stats_field(st, "held", "llu", c->stats.held);
+	tapdisk_stats_field(st, "errors", "llu", c->stats.errors);
+}
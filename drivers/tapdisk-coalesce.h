@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TAPDISK_COALESCE_H_
+#define _TAPDISK_COALESCE_H_
+
+#include "tapdisk.h"
+#include "scheduler.h"
+#include "libvhd.h"
+
+/*
+ * Online coalesce of a VHD leaf into its parent. The sectors allocated
+ * in the leaf are copied down in the background, rate limited and
+ * interleaved with guest I/O, while guest writes keep landing in the
+ * leaf and mark what they touch for another copy. Once nothing is left
+ * to copy, the VBD is briefly quiesced and the parent, reopened
+ * writable, replaces both images at the head of the chain.
+ *
+ * The parent must not be shared with any other VBD or host. Unhiding
+ * the parent and deleting the old leaf is left to the toolstack, as
+ * with an offline coalesce.
+ */
+
+#define TD_COALESCE_BLOCK_SHIFT      7    /* sectors: 64KiB blocks */
+#define TD_COALESCE_CHUNK_BLOCKS     16   /* at most 1MiB per copy */
+#define TD_COALESCE_MAX_INFLIGHT     4
+#define TD_COALESCE_SCAN_BLOCKS      256  /* leaf BAT entries per tick */
+#define TD_COALESCE_INTERVAL_US      100000
+#define TD_COALESCE_DEFAULT_RATE     (32ULL << 20) /* bytes/s */
+
+enum td_coalesce_state {
+	TD_COALESCE_SCANNING = 0,
+	TD_COALESCE_COPYING,
+	TD_COALESCE_SWITCHING,
+	TD_COALESCE_DONE,
+	TD_COALESCE_FAILED,
+};
+
+struct td_copier;
+
+struct td_vbd_coalesce {
+	td_vbd_t                       *vbd;
+	enum td_coalesce_state          state;
+	int                             error;
+
+	td_image_t                     *leaf;
+	td_image_t                     *parent;
+	td_image_t                     *target;
+
+	vhd_context_t                   vhd;
+	int                             vhd_open;
+	uint32_t                        scan;
+
+	struct td_copier               *copier;
+
+	struct {
+		unsigned long long      allocated;
+	} stats;
+};
+
+/*
+ * Starts coalescing the leaf of @vbd into its parent. Fails with -EBUSY
+ * if a coalesce is already running or the VBD mirrors to a secondary,
+ * and -EINVAL unless the leaf and its parent are both VHDs of equal size.
+ */
+int tapdisk_vbd_coalesce_start(td_vbd_t *vbd);
+
+/*
+ * Stops a running coalesce. The chain is left as it was; whatever was
+ * copied already stays in the parent, which is harmless.
+ */
+int tapdisk_vbd_coalesce_abort(td_vbd_t *vbd);
+
+/*
+ * Records a guest write, which lands in the leaf and needs copying down.
+ */
+void tapdisk_vbd_coalesce_mark(td_vbd_t *vbd, td_sector_t sec, int secs);
+
+/*
+ * Returns non-zero while copies to the parent are in flight.
+ */
+int tapdisk_vbd_coalesce_busy(td_vbd_t *vbd);
+
+void tapdisk_vbd_coalesce_free(td_vbd_t *vbd);
+
+void tapdisk_vbd_coalesce_stats(td_vbd_t *vbd, td_stats_t *st);
+
+#endif /* _TAPDISK_COALESCE_H_ */
@@ -59,6 +59,10 @@
 #include "tapdisk-stats.h"
 #include "tapdisk-control.h"
 #include "tapdisk-nbdserver.h"
+#include "tapdisk-uring.h"
+#include "tapdisk-coalesce.h"
+#include "tapdisk-ublk.h"
+#include "tapdisk-nbdkernel.h"
 #include "td-blkif.h"
 #include "timeout-math.h"
 #include "util.h"
@@ -765,6 +769,14 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 		flags |= TD_OPEN_REUSE_PARENT;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_STANDBY)
 		flags |= TD_OPEN_STANDBY;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_RESYNC)
+		flags |= TD_OPEN_RESYNC;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ASYNC_MIRROR)
+		flags |= TD_OPEN_ASYNC_MIRROR;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_READAHEAD)
+		flags |= TD_OPEN_READAHEAD;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_BUFFERED_IO)
+		flags |= TD_OPEN_BUFFERED;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_SECONDARY) {
 		char *name = strdup(request->u.params.secondary);
 		if (!name) {
@@ -845,6 +857,17 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 		goto fail_close;
 	}
 
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_LOCAL_RING) {
+		err = tapdisk_vbd_start_uring(vbd);
+		if (err) {
+			tapdisk_nbdserver_free(vbd->nbdserver);
+			vbd->nbdserver = NULL;
+			tapdisk_nbdserver_free(vbd->nbdserver_new);
+			vbd->nbdserver_new = NULL;
+			goto fail_close;
+		}
+	}
+
 	err = 0;
 
 out:
@@ -957,6 +980,10 @@ tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
 	if (err)
 		goto out;
 
+	if (vbd->nbdkernel) {
+		tapdisk_nbdkernel_detach(vbd->nbdkernel);
+		vbd->nbdkernel = NULL;
+	}
 	if (vbd->nbdserver) {
 		tapdisk_nbdserver_free(vbd->nbdserver);
 		vbd->nbdserver = NULL;
@@ -965,6 +992,14 @@ tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
 		tapdisk_nbdserver_free(vbd->nbdserver_new);
 		vbd->nbdserver_new = NULL;
 	}
+	if (vbd->uring) {
+		tapdisk_uring_server_close(vbd->uring);
+		vbd->uring = NULL;
+	}
+	if (vbd->ublk) {
+		tapdisk_ublk_destroy(vbd->ublk);
+		vbd->ublk = NULL;
+	}
 
 	tapdisk_vbd_close_vdi(vbd);
 
@@ -1073,6 +1108,11 @@ tapdisk_control_resume_vbd(struct tapdisk_ctl_conn *conn,
 		/* TODO If an error occurs below we're not undoing this. */
 	}
 
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_RESYNC)
+		vbd->flags |= TD_OPEN_RESYNC;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ASYNC_MIRROR)
+		vbd->flags |= TD_OPEN_ASYNC_MIRROR;
+
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ADD_LOG) {
 		char *logpath = malloc(TAPDISK_MESSAGE_MAX_PATH_LENGTH + 1);
 		if (!logpath) {
@@ -1307,6 +1347,176 @@ out:
     return err;
 }
 
+static int
+tapdisk_control_coalesce(struct tapdisk_ctl_conn *conn,
+			 tapdisk_message_t *request, tapdisk_message_t * const response)
+{
+	td_vbd_t *vbd;
+	int err;
+
+	ASSERT(conn);
+	ASSERT(request);
+	ASSERT(response);
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ABORT)
+		err = tapdisk_vbd_coalesce_abort(vbd);
+	else
+		err = tapdisk_vbd_coalesce_start(vbd);
+
+out:
+	response->cookie = request->cookie;
+	if (!err)
+		response->type = TAPDISK_MESSAGE_COALESCE_RSP;
+	return err;
+}
+
+static int
+tapdisk_control_ublk_create(struct tapdisk_ctl_conn *conn,
+			    tapdisk_message_t *request, tapdisk_message_t * const response)
+{
+	td_vbd_t *vbd;
+	int err;
+
+	ASSERT(conn);
+	ASSERT(request);
+	ASSERT(response);
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	if (list_empty(&vbd->images)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (vbd->ublk) {
+		err = -EEXIST;
+		goto out;
+	}
+
+	err = tapdisk_ublk_create(vbd, request->u.ublk.nr_queues,
+				  request->u.ublk.queue_depth, &vbd->ublk);
+
+out:
+	response->cookie = request->cookie;
+	if (!err) {
+		response->type = TAPDISK_MESSAGE_UBLK_CREATE_RSP;
+		response->u.ublk.dev_id = tapdisk_ublk_dev_id(vbd->ublk);
+	}
+	return err;
+}
+
+static int
+tapdisk_control_ublk_destroy(struct tapdisk_ctl_conn *conn,
+			     tapdisk_message_t *request, tapdisk_message_t * const response)
+{
+	td_vbd_t *vbd;
+	int err = 0;
+
+	ASSERT(conn);
+	ASSERT(request);
+	ASSERT(response);
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	if (!vbd->ublk) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	tapdisk_ublk_destroy(vbd->ublk);
+	vbd->ublk = NULL;
+
+out:
+	response->cookie = request->cookie;
+	if (!err)
+		response->type = TAPDISK_MESSAGE_UBLK_DESTROY_RSP;
+	return err;
+}
+
+static int
+tapdisk_control_nbd_attach(struct tapdisk_ctl_conn *conn,
+			   tapdisk_message_t *request, tapdisk_message_t * const response)
+{
+	td_vbd_t *vbd;
+	int err;
+
+	ASSERT(conn);
+	ASSERT(request);
+	ASSERT(response);
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	if (list_empty(&vbd->images)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (vbd->nbdkernel) {
+		err = -EEXIST;
+		goto out;
+	}
+
+	err = tapdisk_nbdkernel_attach(vbd, request->u.nbd.connections,
+				       request->u.nbd.index, &vbd->nbdkernel);
+
+out:
+	response->cookie = request->cookie;
+	if (!err) {
+		response->type = TAPDISK_MESSAGE_NBD_ATTACH_RSP;
+		response->u.nbd.index = tapdisk_nbdkernel_index(vbd->nbdkernel);
+	}
+	return err;
+}
+
+static int
+tapdisk_control_nbd_detach(struct tapdisk_ctl_conn *conn,
+			   tapdisk_message_t *request, tapdisk_message_t * const response)
+{
+	td_vbd_t *vbd;
+	int err = 0;
+
+	ASSERT(conn);
+	ASSERT(request);
+	ASSERT(response);
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	if (!vbd->nbdkernel) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	tapdisk_nbdkernel_detach(vbd->nbdkernel);
+	vbd->nbdkernel = NULL;
+
+out:
+	response->cookie = request->cookie;
+	if (!err)
+		response->type = TAPDISK_MESSAGE_NBD_DETACH_RSP;
+	return err;
+}
 
 struct tapdisk_control_info message_infos[] = {
 	[TAPDISK_MESSAGE_PID] = {
@@ -1364,7 +1574,27 @@ struct tapdisk_control_info message_infos[] = {
 	[TAPDISK_MESSAGE_EXIT] = {
 		.handler = NULL,
 		.flags = 0
-	}
+	},
+	[TAPDISK_MESSAGE_COALESCE] = {
+		.handler = tapdisk_control_coalesce,
+		.flags   = TAPDISK_MSG_VERBOSE,
+	},
+	[TAPDISK_MESSAGE_UBLK_CREATE] = {
+		.handler = tapdisk_control_ublk_create,
+		.flags   = TAPDISK_MSG_VERBOSE,
+	},
+	[TAPDISK_MESSAGE_UBLK_DESTROY] = {
+		.handler = tapdisk_control_ublk_destroy,
+		.flags   = TAPDISK_MSG_VERBOSE,
+	},
+	[TAPDISK_MESSAGE_NBD_ATTACH] = {
+		.handler = tapdisk_control_nbd_attach,
+		.flags   = TAPDISK_MSG_VERBOSE,
+	},
+	[TAPDISK_MESSAGE_NBD_DETACH] = {
+		.handler = tapdisk_control_nbd_detach,
+		.flags   = TAPDISK_MSG_VERBOSE,
+	},
 };
 
 static int
@@ -1382,7 +1612,7 @@ tapdisk_control_receive_request(struct tapdisk_ctl_conn *conn)
 	if (err)
 		goto invalid;
 
-	if (conn->request.type > TAPDISK_MESSAGE_EXIT)
+	if (conn->request.type >= ARRAY_SIZE(message_infos))
 		goto invalid;
 
 	conn->info = &message_infos[conn->request.type];
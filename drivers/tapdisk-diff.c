@@ -28,6 +28,20 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/*
+ * Compares two images through tapdisk, the way a guest would see them.
+ *
+ * Each window of the images is first probed with block status requests
+ * on both sides; only ranges holding data in either image are read, as
+ * holes read as zeros. When the first image is a VHD, blocks its BAT
+ * doesn't allocate are not compared either. Probes and reads for many
+ * ranges are kept in flight at once, and completions are compared in
+ * whatever order they arrive.
+ *
+ * By default the lowest differing sector is reported; with -a, every
+ * differing range is.
+ */
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -35,89 +49,112 @@
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
 #include <unistd.h>
 
 #include "list.h"
 #include "scheduler.h"
+#include "tapdisk.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-server.h"
 #include "tapdisk-disktype.h"
 #include "timeout-math.h"
 #include "libvhd.h"
 
-#define POLL_READ                        0
-#define POLL_WRITE                       1
-
 #define SPB_SHIFT (VHD_BLOCK_SHIFT - SECTOR_SHIFT)
 
-/* 
- * we have to use half the max number of requests because we're using the same 
- * tapdisk server for both streams and all the parents will be shared. If we 
- * issue more than MAX_REQUESTS/2 requests, the vhd_state will run out of 
- * vhd_request's and return EBUSY, which we don't handle here. However, even 
- * with MAX_REQUESTS/2 we can still run out of vhd_request's because of 
- * splitting: if some sectors spanned by a segment are in a parent, a segment 
- * could be split into at most N/2 vhd_request's, where N is the number of 
- * sectors per segment. Therefore, if we use 11 segments, we need to divide 
- * MAX_REQUESTS by 11/2=6 on top of that. If we don't, we'd have to handle 
- * EBUSY by retrying here.
- */
-#define MAX_SEGMENTS 8
-#define MAX_STREAM_REQUESTS (MAX_REQUESTS / 2 / (MAX_SEGMENTS / 2))
+#define TD_DIFF_REQ_SECS                 512   /* 256KiB reads */
+#define TD_DIFF_MAX_REQS                 32    /* read pairs in flight */
+#define TD_DIFF_PROBE_SECS               8192  /* 4MiB status windows */
+#define TD_DIFF_MAX_PROBES               8
+#define TD_DIFF_MAX_QUEUED               (TD_DIFF_MAX_REQS * 4)
 
-struct tapdisk_stream_poll {
-	int                              pipe[2];
-	int                              set;
-};
+/* reads as zeros */
+#define TD_DIFF_EMPTY                    (TD_BLOCK_STATE_HOLE | \
+					  TD_BLOCK_STATE_ZERO)
 
-struct tapdisk_stream_request {
-	uint64_t                         sec;
-	uint32_t                         secs;
-	uint64_t                         seqno;
-	blkif_request_t                  blkif_req;
+typedef struct td_diff_range td_diff_range_t;
+typedef struct td_diff_probe td_diff_probe_t;
+typedef struct td_diff_read td_diff_read_t;
+
+struct td_diff_range {
+	td_sector_t                      sec;
+	td_sector_t                      secs;
 	struct list_head                 next;
 };
 
-struct tapdisk_stream {
+struct td_diff_image {
+	td_uuid_t                        id;
 	td_vbd_t                        *vbd;
+	int                              no_status;
+};
 
-	unsigned int                     id;
+struct td_diff_probe {
+	td_sector_t                      sec;
+	int                              secs;
+	int                              pending;
+	int                              err[2];
+	tapdisk_extents_t                extents[2];
+	struct td_iovec                  iov[2];
+	td_vbd_request_t                 vreq[2];
+	struct list_head                 next;
+};
 
+struct td_diff_read {
+	td_sector_t                      sec;
+	int                              secs;
+	int                              pending;
 	int                              err;
+	char                            *buf[2];
+	struct td_iovec                  iov[2];
+	td_vbd_request_t                 vreq[2];
+	struct list_head                 next;
+};
 
-	uint64_t                         cur;
-	uint64_t                         start;
-	uint64_t                         end;
+struct td_diff {
+	struct td_diff_image             image[2];
+	vhd_context_t                    vhd;
+	int                              has_bat;
+	int                              all;
+	int                              err;
+	int                              closing;
 
-	uint64_t                         started;
-	uint64_t                         completed;
+	td_sector_t                      size;
+	td_sector_t                      limit;
+	td_sector_t                      probe_sec;
 
-	struct tapdisk_stream_poll       poll;
-	event_id_t                       enqueue_event_id;
+	struct list_head                 queued;
+	int                              n_queued;
 
-	struct list_head                 free_list;
-	struct list_head                 pending_list;
-	struct list_head                 completed_list;
+	td_diff_probe_t                  probes[TD_DIFF_MAX_PROBES];
+	struct list_head                 free_probes;
+	int                              probes_busy;
 
-	struct tapdisk_stream_request    requests[MAX_STREAM_REQUESTS];
-};
+	td_diff_read_t                   reads[TD_DIFF_MAX_REQS];
+	struct list_head                 free_reads;
+	int                              reads_busy;
 
-static unsigned int tapdisk_stream_count;
+	td_diff_range_t                 *diffs;
+	int                              n_diffs;
+	int                              max_diffs;
 
-static void tapdisk_stream_close_image(struct tapdisk_stream *);
+	uint64_t                         compared;
+};
 
 static char *program;
-static struct tapdisk_stream stream1, stream2;
-static vhd_context_t vhd1;
+static struct td_diff diff;
+
+static void td_diff_pump(struct td_diff *);
 
 static void
 usage(FILE *stream)
 {
-	printf("usage: %s <-n type:/path/to/image> <-m type:/path/to/image>\n",
-			program);
+	fprintf(stream, "usage: %s [-a] <-n type:/path/to/image> "
+		"<-m type:/path/to/image>\n", program);
+	fprintf(stream, "  -a  report every differing range, as "
+		"'<sector> <count>' lines\n");
 }
 
 static int
@@ -142,456 +179,462 @@ open_vhd(const char *path, vhd_context_t *vhd)
 	return 0;
 }
 
-static inline void
-tapdisk_stream_poll_initialize(struct tapdisk_stream_poll *p)
-{
-	p->set = 0;
-	p->pipe[POLL_READ] = p->pipe[POLL_WRITE] = -1;
-}
-
-static int
-tapdisk_stream_poll_open(struct tapdisk_stream_poll *p)
+static inline int
+td_diff_allocated(struct td_diff *d, td_sector_t sec)
 {
-	int err;
-
-	tapdisk_stream_poll_initialize(p);
-
-	err = pipe(p->pipe);
-	if (err)
-		return -errno;
-
-	err = fcntl(p->pipe[POLL_READ], F_SETFL, O_NONBLOCK);
-	if (err)
-		goto out;
-
-	err = fcntl(p->pipe[POLL_WRITE], F_SETFL, O_NONBLOCK);
-	if (err)
-		goto out;
-
-	return 0;
-
-out:
-	close(p->pipe[POLL_READ]);
-	close(p->pipe[POLL_WRITE]);
-	tapdisk_stream_poll_initialize(p);
-	return -errno;
+	return !d->has_bat ||
+		d->vhd.bat.bat[sec >> SPB_SHIFT] != DD_BLK_UNUSED;
 }
 
 static void
-tapdisk_stream_poll_close(struct tapdisk_stream_poll *p)
-{
-	if (p->pipe[POLL_READ] != -1)
-		close(p->pipe[POLL_READ]);
-	if (p->pipe[POLL_WRITE] != -1)
-		close(p->pipe[POLL_WRITE]);
-	tapdisk_stream_poll_initialize(p);
-}
-
-static inline void
-tapdisk_stream_poll_clear(struct tapdisk_stream_poll *p)
-{
-	int gcc, dummy;
-
-	gcc = read(p->pipe[POLL_READ], &dummy, sizeof(dummy));
-	p->set = 0;
-}
-
-static inline void
-tapdisk_stream_poll_set(struct tapdisk_stream_poll *p)
+td_diff_free_extents(tapdisk_extents_t *extents)
 {
-	int dummy = 0;
+	tapdisk_extent_t *e, *next;
 
-	if (!p->set) {
-		int gcc = write(p->pipe[POLL_WRITE], &dummy, sizeof(dummy));
-		p->set = 1;
+	for (e = extents->head; e; e = next) {
+		next = e->next;
+		free(e);
 	}
-}
 
-static inline int
-tapdisk_stream_stop(struct tapdisk_stream *s)
-{
-	return ((s->cur == s->end || s->err) &&
-			list_empty(&s->pending_list) && 
-			list_empty(&s->completed_list));
+	memset(extents, 0, sizeof(*extents));
 }
 
-static inline void
-tapdisk_stream_initialize_request(struct tapdisk_stream_request *req)
-{
-	memset(req, 0, sizeof(*req));
-	INIT_LIST_HEAD(&req->next);
-}
-
-static inline int
-tapdisk_stream_request_idx(struct tapdisk_stream *s,
-			   struct tapdisk_stream_request *req)
+/*
+ * Queues a range for reading, split into requests, and leaving out
+ * blocks the first image's BAT doesn't allocate.
+ */
+static int
+td_diff_queue_range(struct td_diff *d, td_sector_t sec, td_sector_t end)
 {
-	return (req - s->requests);
-}
+	td_diff_range_t *r;
+	td_sector_t blk_end;
+	int secs;
 
-static inline struct tapdisk_stream_request *
-tapdisk_stream_get_request(struct tapdisk_stream *s)
-{
-	struct tapdisk_stream_request *req;
+	while (sec < end) {
+		blk_end = ((sec >> SPB_SHIFT) + 1) << SPB_SHIFT;
 
-	if (list_empty(&s->free_list))
-		return NULL;
+		if (!td_diff_allocated(d, sec)) {
+			sec = blk_end;
+			continue;
+		}
 
-	req = list_entry(s->free_list.next,
-			 struct tapdisk_stream_request, next);
+		secs = MIN(end, blk_end) - sec;
+		secs = MIN(secs, TD_DIFF_REQ_SECS);
 
-	list_del_init(&req->next);
-	tapdisk_stream_initialize_request(req);
+		r = list_entry(d->queued.prev, td_diff_range_t, next);
+		if (d->n_queued && r->sec + r->secs == sec &&
+		    r->secs + secs <= TD_DIFF_REQ_SECS) {
+			r->secs += secs;
+			sec     += secs;
+			continue;
+		}
 
-	return req;
-}
+		r = malloc(sizeof(*r));
+		if (!r)
+			return -ENOMEM;
 
-static inline void
-tapdisk_stream_queue_completed(struct tapdisk_stream *s,
-			       struct tapdisk_stream_request *sreq)
-{
-	struct tapdisk_stream_request *itr;
+		r->sec  = sec;
+		r->secs = secs;
+		list_add_tail(&r->next, &d->queued);
+		d->n_queued++;
 
-	list_for_each_entry(itr, &s->completed_list, next)
-		if (sreq->seqno < itr->seqno) {
-			list_add_tail(&sreq->next, &itr->next);
-			return;
-		}
+		sec += secs;
+	}
 
-	list_add_tail(&sreq->next, &s->completed_list);
+	return 0;
 }
 
-static int 
-tapdisk_result_compare(struct tapdisk_stream_request *sreq1,
-		struct tapdisk_stream_request  *sreq2)
+static int
+td_diff_cmp_range(const void *a, const void *b)
 {
-	unsigned long idx1, idx2;
-	char *buf1, *buf2;
-	int result;
-
-	assert(sreq1->seqno == sreq2->seqno);
-	assert(sreq1->secs == sreq2->secs);
-	idx1 = (unsigned long)tapdisk_stream_request_idx(&stream1, 
-			sreq1);
-	idx2 = (unsigned long)tapdisk_stream_request_idx(&stream2,
-			sreq2);
-	buf1 = (char *)MMAP_VADDR(stream1.vbd->ring.vstart, idx1, 0);
-	buf2 = (char *)MMAP_VADDR(stream2.vbd->ring.vstart, idx2, 0);
-
-	result = memcmp(buf1, buf2, sreq1->secs << SECTOR_SHIFT);
-	return result;
+	const td_diff_range_t *ra = a, *rb = b;
+
+	return ra->sec < rb->sec ? -1 : ra->sec > rb->sec;
 }
 
+/*
+ * Both sides of a window are probed: read whatever holds data in
+ * either image.
+ */
 static int
-tapdisk_stream_process_data(void)
+td_diff_probe_done(struct td_diff *d, td_diff_probe_t *p)
 {
-	struct tapdisk_stream_request *sreq1, *sreq2, *tmp1, *tmp2;
-	int advance_both;
-	int result = 0;
-
-	sreq1 = list_entry(stream1.completed_list.next,
-			struct tapdisk_stream_request, next);
-	sreq2 = list_entry(stream2.completed_list.next,
-			struct tapdisk_stream_request, next);
-	tmp1 = list_entry(sreq1->next.next,
-			struct tapdisk_stream_request, next);
-	tmp2 = list_entry(sreq2->next.next,
-			struct tapdisk_stream_request, next);
-	while (result == 0 &&
-			&sreq1->next != &stream1.completed_list &&
-			&sreq2->next != &stream2.completed_list) {
-		//printf("checking: %llu|%llu\n", sreq1->seqno, sreq2->seqno);
-		advance_both = 1;
-		if (sreq1->seqno < sreq2->seqno) {
-			advance_both = 0;
-			goto advance1;
+	td_sector_t end = p->sec + p->secs, sec, s, e;
+	td_diff_range_t *ranges;
+	tapdisk_extent_t *x;
+	int i, n, err;
+
+	for (i = 0; i < 2; i++)
+		if (p->err[i])
+			return td_diff_queue_range(d, p->sec, end);
+
+	n = p->extents[0].count + p->extents[1].count;
+	if (!n)
+		return 0;
+
+	ranges = calloc(n, sizeof(*ranges));
+	if (!ranges)
+		return -ENOMEM;
+
+	n = 0;
+	for (i = 0; i < 2; i++)
+		for (x = p->extents[i].head; x; x = x->next) {
+			if (x->flag & TD_DIFF_EMPTY)
+				continue;
+
+			ranges[n].sec  = x->start;
+			ranges[n].secs = x->length;
+			n++;
 		}
-		if (sreq1->seqno > sreq2->seqno)
-			goto advance2;
-
-		result = tapdisk_result_compare(sreq1, sreq2);
-
-		stream1.completed++;
-		stream2.completed++;
-		
-		list_del_init(&sreq1->next);
-		list_add_tail(&sreq1->next, &stream1.free_list);
-		list_del_init(&sreq2->next);
-		list_add_tail(&sreq2->next, &stream2.free_list);
-
-advance1:
-		sreq1 = tmp1;
-		tmp1 = list_entry(tmp1->next.next, 
-				struct tapdisk_stream_request, next);
-		if (!advance_both)
+
+	qsort(ranges, n, sizeof(*ranges), td_diff_cmp_range);
+
+	err = 0;
+	sec = p->sec;
+
+	for (i = 0; i < n && !err; i++) {
+		s = ranges[i].sec > sec ? ranges[i].sec : sec;
+		e = MIN(ranges[i].sec + ranges[i].secs, end);
+		if (s >= e)
 			continue;
-advance2:
-		sreq2 = tmp2;
-		tmp2 = list_entry(tmp2->next.next, 
-				struct tapdisk_stream_request, next);
+
+		err = td_diff_queue_range(d, s, e);
+		sec = e;
 	}
 
-	return result;
+	free(ranges);
+	return err;
 }
 
 static void
-tapdisk_stream_dequeue(void *arg, blkif_response_t *rsp)
+td_diff_record(struct td_diff *d, td_sector_t sec, td_sector_t secs)
 {
-	struct tapdisk_stream *s = (struct tapdisk_stream *)arg;
-	struct tapdisk_stream_request *sreq = s->requests + rsp->id;
-
-	list_del_init(&sreq->next);
-
-	if (rsp->status == BLKIF_RSP_OKAY)
-		tapdisk_stream_queue_completed(s, sreq);
-	else {
-		s->err = EIO;
-		list_add_tail(&sreq->next, &s->free_list);
-		fprintf(stderr, "error reading sector %llu (stream %d)\n",
-				sreq->sec, (s == &stream2) + 1);
-	}
+	td_diff_range_t *r;
 
-	if (tapdisk_stream_process_data()) {
-		fprintf(stderr, "mismatch at sector %llu\n",
-				sreq->sec);
-		stream1.err = EINVAL;
-		stream2.err = EINVAL;
+	if (!d->all) {
+		if (sec < d->limit)
+			d->limit = sec;
+		return;
 	}
 
-	tapdisk_stream_poll_set(&stream1.poll);
-	tapdisk_stream_poll_set(&stream2.poll);
-}
-
-static inline int
-tapdisk_stream_enqueue_copy(struct tapdisk_stream *s, 
-		struct tapdisk_stream_request *r)
-{
-	td_vbd_t *vbd;
-	blkif_request_t *breq;
-	td_vbd_request_t *vreq;
-	struct tapdisk_stream_request *sreq;
-	int idx;
-
-	vbd = stream2.vbd;
-	sreq = tapdisk_stream_get_request(s);
-	if (!sreq)
-		return 1;
-
-	idx                 = tapdisk_stream_request_idx(s, sreq);
-
-	sreq->sec           = r->sec;
-	sreq->secs          = r->secs;
-	sreq->seqno         = r->seqno;
-
-	breq                = &sreq->blkif_req;
-	breq->id            = idx;
-	breq->nr_segments   = r->blkif_req.nr_segments;
-	breq->sector_number = r->blkif_req.sector_number;
-	breq->operation     = BLKIF_OP_READ;
-
-	for (int i = 0; i < r->blkif_req.nr_segments; i++) {
-		struct blkif_request_segment *seg = breq->seg + i;
-		seg->first_sect = r->blkif_req.seg[i].first_sect;
-		seg->last_sect  = r->blkif_req.seg[i].last_sect;
+	if (d->n_diffs) {
+		r = &d->diffs[d->n_diffs - 1];
+		if (r->sec + r->secs == sec) {
+			r->secs += secs;
+			return;
+		}
 	}
-	s->cur += sreq->secs;
 
-	vreq = vbd->request_list + idx;
-	assert(list_empty(&vreq->next));
-	assert(vreq->secs_pending == 0);
+	if (d->n_diffs == d->max_diffs) {
+		int max = d->max_diffs ? d->max_diffs * 2 : 64;
 
-	memcpy(&vreq->req, breq, sizeof(*breq));
-	s->started++;
-	vbd->received++;
-	vreq->vbd = vbd;
+		r = realloc(d->diffs, max * sizeof(*r));
+		if (!r) {
+			fprintf(stderr, "out of memory recording differences\n");
+			d->err = ENOMEM;
+			d->limit = 0;
+			return;
+		}
 
-	tapdisk_vbd_move_request(vreq, &vbd->new_requests);
-	list_add_tail(&sreq->next, &s->pending_list);
+		d->diffs     = r;
+		d->max_diffs = max;
+	}
 
-	return 0;
+	r = &d->diffs[d->n_diffs++];
+	r->sec  = sec;
+	r->secs = secs;
 }
 
 static void
-tapdisk_stream_enqueue1(void)
+td_diff_compare(struct td_diff *d, td_diff_read_t *r)
 {
-	td_vbd_t *vbd;
-	int i, idx, psize, blk;
-	struct tapdisk_stream *s = &stream1;
-
-	vbd = s->vbd;
-	psize = getpagesize();
-
-	while (s->cur < s->end && !s->err) {
-		blkif_request_t *breq;
-		td_vbd_request_t *vreq;
-		struct tapdisk_stream_request *sreq;
-
-		/* skip any blocks that are not present in this image */
-		blk = s->cur >> SPB_SHIFT;
-		while (s->cur < s->end && vhd1.bat.bat[blk] == DD_BLK_UNUSED) {
-			//printf("skipping block %d\n", blk);
-			blk++;
-			s->cur = blk << SPB_SHIFT;
-		}
+	size_t size = (size_t)r->secs << SECTOR_SHIFT;
+	td_sector_t start = 0;
+	int i, differ = 0;
 
-		if (s->cur >= s->end)
-			break;
+	d->compared += r->secs;
 
-		sreq = tapdisk_stream_get_request(s);
-		if (!sreq)
-			break;
+	if (!memcmp(r->buf[0], r->buf[1], size))
+		return;
 
-		idx                 = tapdisk_stream_request_idx(s, sreq);
+	for (i = 0; i <= r->secs; i++) {
+		int cur = i < r->secs &&
+			memcmp(r->buf[0] + ((size_t)i << SECTOR_SHIFT),
+			       r->buf[1] + ((size_t)i << SECTOR_SHIFT),
+			       1 << SECTOR_SHIFT);
 
-		sreq->sec           = s->cur;
-		sreq->secs          = 0;
-		sreq->seqno         = s->started++;
+		if (cur && !differ)
+			start = r->sec + i;
+		else if (!cur && differ)
+			td_diff_record(d, start, r->sec + i - start);
 
-		breq                = &sreq->blkif_req;
-		breq->id            = idx;
-		breq->nr_segments   = 0;
-		breq->sector_number = sreq->sec;
-		breq->operation     = BLKIF_OP_READ;
+		differ = cur;
+	}
+}
 
-		for (i = 0; i < MAX_SEGMENTS; i++) {
-			uint32_t secs;
-			struct blkif_request_segment *seg = breq->seg + i;
+static void
+__td_diff_read_cb(td_vbd_request_t *vreq, int error, void *token, int final)
+{
+	td_diff_read_t *r = token;
+	struct td_diff *d = &diff;
+	int side = vreq == &r->vreq[1];
+
+	if (error) {
+		fprintf(stderr, "error reading sector %"PRIu64" of image %d: "
+			"%d\n", r->sec, side + 1, error);
+		r->err = r->err ? : EIO;
+	}
 
-			secs = MIN(s->end - s->cur, psize >> SECTOR_SHIFT);
-			secs = MIN(((blk + 1) << SPB_SHIFT) - s->cur, secs);
-			if (!secs)
-				break;
+	if (--r->pending)
+		return;
 
-			sreq->secs += secs;
-			s->cur     += secs;
+	if (r->err) {
+		d->err   = r->err;
+		d->limit = 0;
+	} else
+		td_diff_compare(d, r);
 
-			seg->first_sect = 0;
-			seg->last_sect  = secs - 1;
-			breq->nr_segments++;
-		}
+	list_add(&r->next, &d->free_reads);
+	d->reads_busy--;
 
-		vreq = vbd->request_list + idx;
+	td_diff_pump(d);
+}
 
-		assert(list_empty(&vreq->next));
-		assert(vreq->secs_pending == 0);
+static void
+__td_diff_probe_cb(td_vbd_request_t *vreq, int error, void *token, int final)
+{
+	td_diff_probe_t *p = token;
+	struct td_diff *d = &diff;
+	int side = vreq == &p->vreq[1], err;
+
+	if (error) {
+		/* read it all, and don't ask again if it can't tell */
+		if (error == -EOPNOTSUPP)
+			d->image[side].no_status = 1;
+		p->err[side] = error;
+	}
 
-		memcpy(&vreq->req, breq, sizeof(*breq));
-		vbd->received++;
-		vreq->vbd = vbd;
+	if (--p->pending)
+		return;
 
-		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
-		list_add_tail(&sreq->next, &s->pending_list);
+	err = td_diff_probe_done(d, p);
+	if (err) {
+		fprintf(stderr, "failed to queue sectors %"PRIu64"-%"PRIu64
+			": %d\n", p->sec, p->sec + p->secs, err);
+		d->err   = -err;
+		d->limit = 0;
 	}
 
-	tapdisk_vbd_issue_requests(vbd);
+	td_diff_free_extents(&p->extents[0]);
+	td_diff_free_extents(&p->extents[1]);
+	list_add(&p->next, &d->free_probes);
+	d->probes_busy--;
+
+	td_diff_pump(d);
 }
 
 static void
-tapdisk_stream_enqueue2(void)
+td_diff_issue_read(struct td_diff *d, td_diff_read_t *r, td_diff_range_t *q)
 {
-	td_vbd_t *vbd;
-	int i, blk;
-	struct tapdisk_stream_request *itr;
-	struct tapdisk_stream *s = &stream2;
-
-	vbd = s->vbd;
-
-	/* issue the same requests that we issued on stream1 */
-	list_for_each_entry(itr, &stream1.completed_list, next) {
-		if (itr->sec < s->cur)
-			continue;
-		if (tapdisk_stream_enqueue_copy(s, itr))
-			goto done;
+	int i, err;
+
+	r->sec     = q->sec;
+	r->secs    = q->secs;
+	r->pending = 2;
+	r->err     = 0;
+	d->reads_busy++;
+
+	for (i = 0; i < 2; i++) {
+		td_vbd_request_t *vreq = &r->vreq[i];
+
+		r->iov[i].base = r->buf[i];
+		r->iov[i].secs = r->secs;
+
+		memset(vreq, 0, sizeof(*vreq));
+		vreq->op       = TD_OP_READ;
+		vreq->io_class = TD_VREQ_CLASS_BG;
+		vreq->sec      = r->sec;
+		vreq->iov      = &r->iov[i];
+		vreq->iovcnt   = 1;
+		vreq->token    = r;
+		vreq->cb       = __td_diff_read_cb;
+
+		err = tapdisk_vbd_queue_request(d->image[i].vbd, vreq);
+		if (err)
+			__td_diff_read_cb(vreq, err, r, 1);
 	}
+}
 
-	list_for_each_entry(itr, &stream1.pending_list, next) {
-		if (itr->sec < s->cur)
-			continue;
-		if (tapdisk_stream_enqueue_copy(s, itr))
-			goto done;
+static void
+td_diff_issue_probe(struct td_diff *d, td_diff_probe_t *p,
+		    td_sector_t sec, int secs)
+{
+	int i, err;
+
+	p->sec     = sec;
+	p->secs    = secs;
+	p->pending = 2;
+	d->probes_busy++;
+
+	for (i = 0; i < 2; i++) {
+		td_vbd_request_t *vreq = &p->vreq[i];
+
+		p->err[i] = 0;
+		memset(&p->extents[i], 0, sizeof(p->extents[i]));
+
+		/* status requests carry no data */
+		p->iov[i].base = NULL;
+		p->iov[i].secs = secs;
+
+		memset(vreq, 0, sizeof(*vreq));
+		vreq->op       = TD_OP_BLOCK_STATUS;
+		vreq->io_class = TD_VREQ_CLASS_BG;
+		vreq->sec      = sec;
+		vreq->iov      = &p->iov[i];
+		vreq->iovcnt   = 1;
+		vreq->data     = &p->extents[i];
+		vreq->token    = p;
+		vreq->cb       = __td_diff_probe_cb;
+
+		err = tapdisk_vbd_queue_request(d->image[i].vbd, vreq);
+		if (err)
+			__td_diff_probe_cb(vreq, err, p, 1);
 	}
-
-	stream2.cur = stream1.cur;
-
-done:
-	tapdisk_vbd_issue_requests(vbd);
 }
 
-static inline int
-tapdisk_diff_done(void)
+static void
+td_diff_close_image(struct td_diff *d, int i)
 {
-	return (tapdisk_stream_stop(&stream1) && tapdisk_stream_stop(&stream2));
+	td_vbd_t *vbd = d->image[i].vbd;
+
+	if (vbd) {
+		tapdisk_vbd_close_vdi(vbd);
+		tapdisk_server_remove_vbd(vbd);
+		tapdisk_vbd_free(vbd);
+		d->image[i].vbd = NULL;
+	}
 }
 
 static void
-tapdisk_diff_stop(void)
+__td_diff_close(event_id_t id, char mode, void *private)
 {
-	tapdisk_stream_close_image(&stream1);
-	tapdisk_stream_close_image(&stream2);
+	struct td_diff *d = private;
+
+	tapdisk_server_unregister_event(id);
+
+	td_diff_close_image(d, 1);
+	td_diff_close_image(d, 0);
 }
 
+/*
+ * Keeps probes and reads in flight, up to the lowest difference found
+ * unless all of them are wanted.
+ */
 static void
-tapdisk_stream_enqueue(event_id_t id, char mode, void *arg)
+td_diff_pump(struct td_diff *d)
 {
-	struct tapdisk_stream *s = (struct tapdisk_stream *)arg;
+	td_diff_probe_t *p;
+	td_diff_range_t *q;
+	td_diff_read_t *r;
+	td_sector_t sec;
+	int secs, err;
+
+	while (d->n_queued && !list_empty(&d->free_reads)) {
+		q = list_entry(d->queued.next, td_diff_range_t, next);
+		list_del(&q->next);
+		d->n_queued--;
+
+		if (q->sec < d->limit) {
+			r = list_entry(d->free_reads.next, td_diff_read_t,
+				       next);
+			list_del(&r->next);
+			td_diff_issue_read(d, r, q);
+		}
 
-	tapdisk_stream_poll_clear(&s->poll);
+		free(q);
+	}
 
-	if (tapdisk_diff_done()) {
-		tapdisk_diff_stop();
-		return;
+	while (d->probe_sec < d->limit &&
+	       d->n_queued < TD_DIFF_MAX_QUEUED) {
+		sec = d->probe_sec;
+
+		if (!td_diff_allocated(d, sec)) {
+			d->probe_sec = ((sec >> SPB_SHIFT) + 1) << SPB_SHIFT;
+			continue;
+		}
+
+		secs = MIN(d->limit - sec, TD_DIFF_PROBE_SECS -
+			   (sec & (TD_DIFF_PROBE_SECS - 1)));
+
+		if (d->image[0].no_status || d->image[1].no_status) {
+			d->probe_sec += secs;
+			err = td_diff_queue_range(d, sec, sec + secs);
+			if (err) {
+				d->err   = -err;
+				d->limit = 0;
+			}
+			continue;
+		}
+
+		if (list_empty(&d->free_probes))
+			break;
+
+		p = list_entry(d->free_probes.next, td_diff_probe_t, next);
+		list_del(&p->next);
+
+		d->probe_sec += secs;
+		td_diff_issue_probe(d, p, sec, secs);
 	}
 
-	if (s == &stream1) 
-		tapdisk_stream_enqueue1();
-	else if (s == &stream2)
-		tapdisk_stream_enqueue2();
-	else
-		assert(0);
-
-	if (tapdisk_diff_done()) {
-		// we have to check again for the case when stream1 had no 
-		// blocks at all
-		tapdisk_diff_stop();
+	if (d->n_queued && !list_empty(&d->free_reads)) {
+		td_diff_pump(d);
 		return;
 	}
+
+	if (d->probe_sec < d->limit || d->n_queued ||
+	    d->probes_busy || d->reads_busy || d->closing)
+		return;
+
+	d->closing = 1;
+	tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1, TV_ZERO,
+				      __td_diff_close, d);
 }
 
 static int
-tapdisk_stream_open_image(struct tapdisk_stream *s, const char *name)
+td_diff_open_image(struct td_diff *d, int i, const char *name)
 {
-	int err;
 	td_disk_info_t info;
+	int err;
 
-	s->id = tapdisk_stream_count++;
+	d->image[i].id = i;
 
-	err = tapdisk_vbd_initialize(-1, -1, s->id);
+	err = tapdisk_vbd_initialize(-1, -1, i);
 	if (err)
 		goto out;
 
-	s->vbd = tapdisk_server_get_vbd(s->id);
-	if (!s->vbd) {
+	d->image[i].vbd = tapdisk_server_get_vbd(i);
+	if (!d->image[i].vbd) {
 		err = ENODEV;
 		goto out;
 	}
 
-	tapdisk_vbd_set_callback(s->vbd, tapdisk_stream_dequeue, s);
-
-	err = tapdisk_vbd_open_vdi(s->vbd, name, TD_OPEN_RDONLY, -1);
+	err = tapdisk_vbd_open_vdi(d->image[i].vbd, name, TD_OPEN_RDONLY, -1);
 	if (err)
 		goto out;
 
-	err = tapdisk_vbd_get_disk_info(s->vbd, &info);
+	err = tapdisk_vbd_get_disk_info(d->image[i].vbd, &info);
 	if (err) {
 		fprintf(stderr, "failed getting image size: %d\n", err);
-		return err;
+		goto out;
 	}
 
-	s->start = 0;
-	s->cur   = s->start;
-	s->end   = info.size;
-
-	err = 0;
+	if (!i)
+		d->size = info.size;
+	else if (info.size != d->size) {
+		fprintf(stderr, "Image sizes differ: %"PRIu64" != %"PRIu64"\n",
+			d->size, info.size);
+		err = EINVAL;
+	}
 
 out:
 	if (err)
@@ -599,131 +642,100 @@ out:
 	return err;
 }
 
-static void
-tapdisk_stream_close_image(struct tapdisk_stream *s)
-{
-	td_vbd_t *vbd;
-
-	vbd = tapdisk_server_get_vbd(s->id);
-	if (vbd) {
-		tapdisk_vbd_close_vdi(vbd);
-		tapdisk_server_remove_vbd(vbd);
-		free((void *)vbd->ring.vstart);
-		tapdisk_vbd_free(vbd);
-		s->vbd = NULL;
-	}
-}
-
 static int
-tapdisk_stream_initialize_requests(struct tapdisk_stream *s)
+td_diff_create_reqs(struct td_diff *d)
 {
-	size_t size;
-	td_ring_t *ring;
-	int err, i, psize;
-
-	ring  = &s->vbd->ring;
-	psize = getpagesize();
-	size  = psize * BLKTAP_MMAP_REGION_SIZE;
+	size_t size = TD_DIFF_REQ_SECS << SECTOR_SHIFT;
+	int i, j, err;
+
+	for (i = 0; i < TD_DIFF_MAX_REQS; i++) {
+		td_diff_read_t *r = &d->reads[i];
+
+		for (j = 0; j < 2; j++) {
+			err = posix_memalign((void **)&r->buf[j], 4096, size);
+			if (err) {
+				r->buf[j] = NULL;
+				return err;
+			}
+		}
 
-	/* sneaky -- set up ring->vstart so tapdisk_vbd will use our buffers */
-	err = posix_memalign((void **)&ring->vstart, psize, size);
-	if (err) {
-		fprintf(stderr, "failed to allocate buffers: %d\n", err);
-		ring->vstart = 0;
-		return err;
+		list_add_tail(&r->next, &d->free_reads);
 	}
 
-	for (i = 0; i < MAX_STREAM_REQUESTS; i++) {
-		struct tapdisk_stream_request *req = s->requests + i;
-		tapdisk_stream_initialize_request(req);
-		list_add_tail(&req->next, &s->free_list);
-	}
+	for (i = 0; i < TD_DIFF_MAX_PROBES; i++)
+		list_add_tail(&d->probes[i].next, &d->free_probes);
 
 	return 0;
 }
 
-static int
-tapdisk_stream_register_enqueue_event(struct tapdisk_stream *s)
+static void
+td_diff_destroy(struct td_diff *d)
 {
-	int err;
-	struct tapdisk_stream_poll *p = &s->poll;
+	td_diff_range_t *q, *tmp;
+	int i;
 
-	err = tapdisk_stream_poll_open(p);
-	if (err)
-		goto out;
-
-	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-					    p->pipe[POLL_READ], TV_ZERO,
-					    tapdisk_stream_enqueue, s);
-	if (err < 0)
-		goto out;
+	td_diff_close_image(d, 1);
+	td_diff_close_image(d, 0);
 
-	s->enqueue_event_id = err;
-	err = 0;
-
-out:
-	if (err)
-		fprintf(stderr, "failed to register event: %d\n", err);
-	return err;
-}
+	list_for_each_entry_safe(q, tmp, &d->queued, next) {
+		list_del(&q->next);
+		free(q);
+	}
 
-static void
-tapdisk_stream_unregister_enqueue_event(struct tapdisk_stream *s)
-{
-	if (s->enqueue_event_id) {
-		tapdisk_server_unregister_event(s->enqueue_event_id);
-		s->enqueue_event_id = 0;
+	for (i = 0; i < TD_DIFF_MAX_REQS; i++) {
+		free(d->reads[i].buf[0]);
+		free(d->reads[i].buf[1]);
 	}
-	tapdisk_stream_poll_close(&s->poll);
-}
 
-static inline void
-tapdisk_stream_initialize(struct tapdisk_stream *s)
-{
-	memset(s, 0, sizeof(*s));
-	INIT_LIST_HEAD(&s->free_list);
-	INIT_LIST_HEAD(&s->pending_list);
-	INIT_LIST_HEAD(&s->completed_list);
+	free(d->diffs);
+
+	if (d->has_bat)
+		vhd_close(&d->vhd);
 }
 
 static int
-tapdisk_stream_open(struct tapdisk_stream *s, const char *arg)
+td_diff_report(struct td_diff *d)
 {
-	int err;
+	uint64_t secs = 0;
+	int i, j;
 
-	tapdisk_stream_initialize(s);
+	if (d->err)
+		return d->err;
 
-	err = tapdisk_stream_open_image(s, arg);
-	if (err)
-		return err;
+	if (!d->all) {
+		if (d->limit == d->size)
+			return 0;
 
-	err = tapdisk_stream_initialize_requests(s);
-	if (err)
-		return err;
+		fprintf(stderr, "mismatch at sector %"PRIu64"\n", d->limit);
+		return EINVAL;
+	}
 
-	err = tapdisk_stream_register_enqueue_event(s);
-	if (err)
-		return err;
+	/* reads complete out of order */
+	qsort(d->diffs, d->n_diffs, sizeof(*d->diffs), td_diff_cmp_range);
 
-	tapdisk_stream_enqueue(s->enqueue_event_id, 
-			       SCHEDULER_POLL_READ_FD, s);
+	for (i = 0, j = 0; i < d->n_diffs; i++) {
+		td_diff_range_t *r = &d->diffs[i];
 
-	return 0;
-}
+		if (j && d->diffs[j - 1].sec + d->diffs[j - 1].secs == r->sec)
+			d->diffs[j - 1].secs += r->secs;
+		else
+			d->diffs[j++] = *r;
+	}
+	d->n_diffs = j;
 
-static void
-tapdisk_stream_release(struct tapdisk_stream *s)
-{
-	tapdisk_stream_close_image(s);
-	tapdisk_stream_unregister_enqueue_event(s);
-}
+	for (i = 0; i < d->n_diffs; i++) {
+		printf("%"PRIu64" %"PRIu64"\n",
+		       d->diffs[i].sec, d->diffs[i].secs);
+		secs += d->diffs[i].secs;
+	}
 
-static int
-tapdisk_stream_run(struct tapdisk_stream *s)
-{
-	tapdisk_stream_enqueue(s->enqueue_event_id, SCHEDULER_POLL_READ_FD, s);
-	tapdisk_server_run();
-	return s->err;
+	if (!d->n_diffs)
+		return 0;
+
+	fprintf(stderr, "%d ranges, %"PRIu64" sectors differ, "
+		"%"PRIu64" of %"PRIu64" sectors compared\n",
+		d->n_diffs, secs, d->compared, d->size);
+	return EINVAL;
 }
 
 int
@@ -731,14 +743,19 @@ main(int argc, char *argv[])
 {
 	int c, err, type1;
 	const char *arg1 = NULL, *arg2 = NULL;
-	const disk_info_t *info;
+	struct td_diff *d = &diff;
 	const char *path1;
 
-	err    = 0;
+	err = 0;
 
 	program = basename(argv[0]);
-	
-	while ((c = getopt(argc, argv, "n:m:h")) != -1) {
+
+	memset(d, 0, sizeof(*d));
+	INIT_LIST_HEAD(&d->queued);
+	INIT_LIST_HEAD(&d->free_probes);
+	INIT_LIST_HEAD(&d->free_reads);
+
+	while ((c = getopt(argc, argv, "n:m:ah")) != -1) {
 		switch (c) {
 		case 'n':
 			arg1 = optarg;
@@ -746,6 +763,9 @@ main(int argc, char *argv[])
 		case 'm':
 			arg2 = optarg;
 			break;
+		case 'a':
+			d->all = 1;
+			break;
 		case 'h':
 			usage(stdout);
 			return 0;
@@ -759,55 +779,41 @@ main(int argc, char *argv[])
 
 	type1 = tapdisk_disktype_parse_params(arg1, &path1);
 	if (type1 < 0)
-		return type1;
+		return -type1;
 
-	if (type1 != DISK_TYPE_VHD) {
-		printf("error: first VDI is not VHD\n");
-		return EINVAL;
+	if (type1 == DISK_TYPE_VHD) {
+		err = open_vhd(path1, &d->vhd);
+		if (err)
+			return -err;
+		d->has_bat = 1;
 	}
 
-	err = open_vhd(path1, &vhd1);
-	if (err)
-		return err;
-
 	tapdisk_start_logging("tapdisk-diff", "daemon");
 
 	err = tapdisk_server_initialize(NULL, NULL);
 	if (err)
 		goto out;
 
-	err = tapdisk_stream_open(&stream1, arg1);
-	if (err) {
-		fprintf(stderr, "Failed to open %s: %s\n", 
-			arg1, strerror(-err));
+	err = td_diff_open_image(d, 0, arg1);
+	if (!err)
+		err = td_diff_open_image(d, 1, arg2);
+	if (!err)
+		err = td_diff_create_reqs(d);
+	if (err)
 		goto out;
-	}
-
-	err = tapdisk_stream_open(&stream2, arg2);
-	if (err) {
-		fprintf(stderr, "Failed to open %s: %s\n", 
-			arg2, strerror(-err));
-		goto out1;
-	}
 
-	if (stream1.end != stream2.end) {
-		fprintf(stderr, "Image sizes differ: %"PRIu64" != %"PRIu64"\n",
-				stream1.end, stream2.end);
-		err = EINVAL;
-		goto out2;
-	}
+	d->limit = d->size;
+	td_diff_pump(d);
 
 	tapdisk_server_run();
-	
-out2:
-	tapdisk_stream_release(&stream2);
-out1:
-	tapdisk_stream_release(&stream1);
+
+	err = td_diff_report(d);
+
 out:
-	vhd_close(&vhd1);
+	td_diff_destroy(d);
 	tapdisk_stop_logging();
 
-	return err ? : stream1.err;
+	return err;
 
 fail_usage:
 	usage(stderr);
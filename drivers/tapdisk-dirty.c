@@ -0,0 +1,534 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Dirty block maps and the throttled copier, see tapdisk-dirty.h.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-dirty.h"
+#include "timeout-math.h"
+
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+#define MIN(a, b)            ((a) < (b) ? (a) : (b))
+#define MAX(a, b)            ((a) > (b) ? (a) : (b))
+
+#define BITS_PER_LONG        TD_DIRTY_BITS_PER_LONG
+#define BITS_TO_LONGS(bits)  (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+#define COPY_BUSY_STATES     (TD_VBD_DEAD |			\
+			      TD_VBD_CLOSED |			\
+			      TD_VBD_QUIESCE_REQUESTED |	\
+			      TD_VBD_QUIESCED |			\
+			      TD_VBD_PAUSE_REQUESTED |		\
+			      TD_VBD_PAUSED)
+
+int
+td_dirty_map_init(struct td_dirty_map *map, td_sector_t size, int shift)
+{
+	memset(map, 0, sizeof(*map));
+
+	map->shift = shift;
+	map->nbits = (size + (1ULL << shift) - 1) >> shift;
+	map->bits  = calloc(BITS_TO_LONGS(map->nbits), sizeof(unsigned long));
+	if (!map->bits)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void
+td_dirty_map_free(struct td_dirty_map *map)
+{
+	free(map->bits);
+	map->bits   = NULL;
+	map->ndirty = 0;
+}
+
+void
+td_dirty_set_range(struct td_dirty_map *map, uint64_t block, uint64_t count)
+{
+	uint64_t end = block + count;
+
+	for (; block < end && block < map->nbits; block++)
+		td_dirty_set(map, block);
+}
+
+void
+td_dirty_clear_range(struct td_dirty_map *map, uint64_t block, uint64_t count)
+{
+	uint64_t end = block + count;
+
+	for (; block < end && block < map->nbits; block++)
+		td_dirty_clear(map, block);
+}
+
+void
+td_dirty_sec_range(struct td_dirty_map *map, td_sector_t sec, uint64_t secs,
+		   uint64_t *block, uint64_t *count)
+{
+	uint64_t end;
+
+	end    = (sec + secs + (1ULL << map->shift) - 1) >> map->shift;
+	*block = sec >> map->shift;
+	*count = end - *block;
+}
+
+void
+td_dirty_mark(struct td_dirty_map *map, td_sector_t sec, uint64_t secs)
+{
+	uint64_t block, count;
+
+	td_dirty_sec_range(map, sec, secs, &block, &count);
+	td_dirty_set_range(map, block, count);
+}
+
+int
+td_dirty_any(struct td_dirty_map *map, td_sector_t sec, uint64_t secs)
+{
+	uint64_t block, count, end;
+
+	td_dirty_sec_range(map, sec, secs, &block, &count);
+
+	for (end = block + count; block < end && block < map->nbits; block++)
+		if (td_dirty_test(map, block))
+			return 1;
+
+	return 0;
+}
+
+uint64_t
+td_dirty_next_run(struct td_dirty_map *map, uint64_t max, uint64_t *block)
+{
+	uint64_t nr, i, count, word;
+
+	if (!map->ndirty)
+		return 0;
+
+	nr = map->cursor < map->nbits ? map->cursor : 0;
+
+	for (i = 0; i < map->nbits; ) {
+		word = map->bits[nr / BITS_PER_LONG];
+		if (!word && !(nr % BITS_PER_LONG)) {
+			i  += BITS_PER_LONG;
+			nr += BITS_PER_LONG;
+		} else if (td_dirty_test(map, nr))
+			break;
+		else {
+			i++;
+			nr++;
+		}
+
+		if (nr >= map->nbits) {
+			nr = 0;
+			map->passes++;
+		}
+	}
+
+	if (i >= map->nbits)
+		return 0;
+
+	for (count = 0; count < max && nr + count < map->nbits; count++)
+		if (!td_dirty_test(map, nr + count))
+			break;
+
+	*block = nr;
+	return count;
+}
+
+static void
+copier_release(struct td_copier *c)
+{
+	int i;
+
+	for (i = 0; i < c->max_inflight; i++)
+		free(c->chunks[i].buf);
+
+	free(c->chunks);
+	td_dirty_map_free(&c->map);
+	free(c);
+}
+
+struct td_copier *
+td_copier_create(td_vbd_t *vbd, const char *name, td_sector_t size, int shift,
+		 int chunk_blocks, int max_inflight, uint64_t rate, int interval,
+		 const struct td_copy_ops *ops, void *private)
+{
+	struct td_copier *c;
+	int i, err;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	c->vbd          = vbd;
+	c->name         = name;
+	c->size         = size;
+	c->chunk_blocks = chunk_blocks;
+	c->max_inflight = max_inflight;
+	c->rate         = rate;
+	c->interval     = interval;
+	c->timer        = -1;
+	c->ops          = ops;
+	c->private      = private;
+
+	err = td_dirty_map_init(&c->map, size, shift);
+	if (err) {
+		free(c);
+		return NULL;
+	}
+
+	c->chunks = calloc(max_inflight, sizeof(struct td_copy_chunk));
+	if (!c->chunks) {
+		copier_release(c);
+		return NULL;
+	}
+
+	for (i = 0; i < max_inflight; i++)
+		c->chunks[i].copier = c;
+
+	return c;
+}
+
+static void
+__copier_tick(event_id_t id, char mode, void *private)
+{
+	struct td_copier *c = private;
+
+	c->budget = MIN(c->budget, 0) + c->rate * c->interval / 1000000;
+
+	c->ops->tick(c);
+}
+
+int
+td_copier_start(struct td_copier *c)
+{
+	event_id_t id;
+
+	if (c->timer >= 0)
+		return 0;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+					   TV_USECS(c->interval),
+					   __copier_tick, c);
+	if (id < 0)
+		return id;
+
+	c->timer = id;
+	return 0;
+}
+
+void
+td_copier_stop(struct td_copier *c)
+{
+	if (c->timer >= 0) {
+		tapdisk_server_unregister_event(c->timer);
+		c->timer = -1;
+	}
+}
+
+void
+td_copier_destroy(struct td_copier *c)
+{
+	struct td_copy_chunk *chunk;
+	int i;
+
+	if (!c)
+		return;
+
+	td_copier_stop(c);
+	c->ops     = NULL;
+	c->private = NULL;
+
+	/* copies the VBD holds but did not issue come back cancelled */
+	for (i = 0; i < c->max_inflight; i++) {
+		chunk = &c->chunks[i];
+
+		if (chunk->busy && !chunk->writing)
+			tapdisk_vbd_cancel_request(c->vbd, &chunk->vreq);
+	}
+
+	c->detached = 1;
+	if (!c->inflight)
+		copier_release(c);
+}
+
+void
+td_copier_mark(struct td_copier *c, td_sector_t sec, int secs)
+{
+	td_dirty_mark(&c->map, sec, secs);
+	td_copier_mark_busy(c, sec, secs);
+}
+
+void
+td_copier_mark_busy(struct td_copier *c, td_sector_t sec, int secs)
+{
+	struct td_copy_chunk *chunk;
+	uint64_t block, count;
+	int i;
+
+	td_dirty_sec_range(&c->map, sec, secs, &block, &count);
+
+	for (i = 0; i < c->max_inflight; i++) {
+		uint64_t start, end;
+
+		chunk = &c->chunks[i];
+		if (!chunk->busy)
+			continue;
+
+		start = MAX(block, chunk->block);
+		end   = MIN(block + count, chunk->block + chunk->count);
+		if (start < end) {
+			td_dirty_set_range(&c->map, start, end - start);
+			c->stats.redirtied += end - start;
+		}
+	}
+}
+
+static void
+copy_chunk_put(struct td_copy_chunk *chunk, int err)
+{
+	struct td_copier *c = chunk->copier;
+
+	if (err) {
+		td_dirty_set_range(&c->map, chunk->block, chunk->count);
+		c->stats.errors++;
+	} else
+		c->stats.copied += chunk->count;
+
+	chunk->busy = 0;
+	c->inflight--;
+
+	if (c->ops && c->ops->done)
+		c->ops->done(c, chunk, err);
+
+	/* destroyed with copies in flight, the last one out cleans up */
+	if (c->detached && !c->inflight)
+		copier_release(c);
+}
+
+static void
+__copy_write_done(td_request_t treq, int err)
+{
+	struct td_copy_chunk *chunk = treq.cb_data;
+
+	/*
+	 * The destination may split the write and complete it
+	 * piecewise; the chunk is done once all of it is.
+	 */
+	chunk->pending -= treq.secs;
+	if (err && !chunk->error) {
+		chunk->error = err;
+		chunk->image = treq.image;
+	}
+
+	if (chunk->pending > 0)
+		return;
+
+	copy_chunk_put(chunk, chunk->error);
+}
+
+static void
+__copy_read_done(td_vbd_request_t *vreq, int err, void *token, int final)
+{
+	struct td_copy_chunk *chunk = token;
+	struct td_copier *c = chunk->copier;
+	td_request_t treq;
+	int io_class;
+
+	if (!err && !c->ops)
+		err = -ECANCELED;
+
+	if (err) {
+		copy_chunk_put(chunk, err);
+		return;
+	}
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op      = TD_OP_WRITE;
+	treq.buf     = chunk->buf;
+	treq.sec     = vreq->sec;
+	treq.secs    = chunk->iov.secs;
+	treq.cb      = __copy_write_done;
+	treq.cb_data = chunk;
+	treq.vreq    = vreq;
+
+	chunk->writing = 1;
+	chunk->pending = treq.secs;
+	chunk->error   = 0;
+
+	io_class = tapdisk_server_set_io_class(vreq->io_class);
+	err = c->ops->write(c, treq);
+	tapdisk_server_set_io_class(io_class);
+
+	if (err) {
+		chunk->writing = 0;
+		copy_chunk_put(chunk, err);
+	}
+}
+
+static int
+copy_chunk_issue(struct td_copier *c, struct td_copy_chunk *chunk,
+		 uint64_t block, uint64_t count)
+{
+	td_vbd_request_t *vreq;
+	td_sector_t sec, end;
+	int err;
+
+	if (!chunk->buf) {
+		err = posix_memalign(&chunk->buf, 4096,
+				     ((td_sector_t)c->chunk_blocks <<
+				      c->map.shift) << SECTOR_SHIFT);
+		if (err) {
+			chunk->buf = NULL;
+			return -err;
+		}
+	}
+
+	sec = block << c->map.shift;
+	end = MIN((block + count) << c->map.shift, c->size);
+
+	chunk->block     = block;
+	chunk->count     = count;
+	chunk->writing   = 0;
+	chunk->image     = NULL;
+	chunk->iov.base  = chunk->buf;
+	chunk->iov.secs  = end - sec;
+
+	vreq = &chunk->vreq;
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op       = TD_OP_READ;
+	vreq->io_class = TD_VREQ_CLASS_BG;
+	vreq->sec      = sec;
+	vreq->iov      = &chunk->iov;
+	vreq->iovcnt   = 1;
+	vreq->cb       = __copy_read_done;
+	vreq->token    = chunk;
+	vreq->name     = chunk->name;
+	snprintf(chunk->name, sizeof(chunk->name), "%s-%"PRIu64,
+		 c->name, block);
+
+	err = tapdisk_vbd_queue_request(c->vbd, vreq);
+	if (err)
+		return err;
+
+	td_dirty_clear_range(&c->map, block, count);
+
+	chunk->busy = 1;
+	c->inflight++;
+	c->budget -= (end - sec) << SECTOR_SHIFT;
+
+	return 0;
+}
+
+/*
+ * Whether a guest write to [sec, end) is in flight below the VBD.
+ */
+static int
+copier_write_pending(struct td_copier *c, td_sector_t sec, td_sector_t end)
+{
+	td_vbd_request_t *vreq;
+	td_sector_t secs;
+	int i;
+
+	list_for_each_entry(vreq, &c->vbd->pending_requests, next) {
+		if (vreq->op != TD_OP_WRITE)
+			continue;
+
+		for (secs = 0, i = 0; i < vreq->iovcnt; i++)
+			secs += vreq->iov[i].secs;
+
+		if (vreq->sec < end && sec < vreq->sec + secs)
+			return 1;
+	}
+
+	return 0;
+}
+
+void
+td_copier_issue(struct td_copier *c)
+{
+	uint64_t block, count;
+	int i, err;
+
+	if (td_flag_test(c->vbd->state, COPY_BUSY_STATES))
+		return;
+
+	for (i = 0; i < c->max_inflight && c->budget > 0; i++) {
+		struct td_copy_chunk *chunk = &c->chunks[i];
+
+		if (chunk->busy)
+			continue;
+
+		count = td_dirty_next_run(&c->map, c->chunk_blocks, &block);
+		if (!count)
+			break;
+
+		if (copier_write_pending(c, block << c->map.shift,
+					 (block + count) << c->map.shift)) {
+			c->map.cursor = block + count;
+			c->stats.held++;
+			continue;
+		}
+
+		err = copy_chunk_issue(c, chunk, block, count);
+		if (err) {
+			ERR(err, "%s: failed to issue %s copy\n",
+			    c->vbd->name, c->name);
+			break;
+		}
+
+		c->map.cursor = block + count;
+	}
+}
+
+int
+td_copier_busy(struct td_copier *c)
+{
+	int i;
+
+	for (i = 0; i < c->max_inflight; i++)
+		if (c->chunks[i].busy && c->chunks[i].writing)
+			return 1;
+
+	return 0;
+}
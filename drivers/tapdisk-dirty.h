@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TAPDISK_DIRTY_H_
+#define _TAPDISK_DIRTY_H_
+
+#include "tapdisk.h"
+#include "scheduler.h"
+
+/*
+ * Dirty block maps, and the throttled background copy draining them,
+ * shared by mirror resync, online coalesce and llcache recovery.
+ *
+ * A map tracks a disk in blocks of 1 << shift sectors. A copier owns a
+ * map and a few chunk buffers: on every tick it reads the next runs of
+ * dirty blocks through the VBD, in the background class and within its
+ * byte budget, and hands them to its owner for writing. What to do
+ * with the copied data, and when to stop, is up to the owner.
+ */
+
+struct td_dirty_map {
+	unsigned long                  *bits;
+	uint64_t                        nbits;
+	uint64_t                        ndirty;
+	uint64_t                        cursor;
+	int                             shift;
+	unsigned long long              passes;
+};
+
+#define TD_DIRTY_BITS_PER_LONG       (sizeof(unsigned long) * 8)
+
+int td_dirty_map_init(struct td_dirty_map *map, td_sector_t size, int shift);
+void td_dirty_map_free(struct td_dirty_map *map);
+
+static inline int
+td_dirty_test(struct td_dirty_map *map, uint64_t nr)
+{
+	return (map->bits[nr / TD_DIRTY_BITS_PER_LONG] >>
+		(nr % TD_DIRTY_BITS_PER_LONG)) & 1;
+}
+
+static inline void
+td_dirty_set(struct td_dirty_map *map, uint64_t nr)
+{
+	if (!td_dirty_test(map, nr)) {
+		map->bits[nr / TD_DIRTY_BITS_PER_LONG] |=
+			1UL << (nr % TD_DIRTY_BITS_PER_LONG);
+		map->ndirty++;
+	}
+}
+
+static inline void
+td_dirty_clear(struct td_dirty_map *map, uint64_t nr)
+{
+	if (td_dirty_test(map, nr)) {
+		map->bits[nr / TD_DIRTY_BITS_PER_LONG] &=
+			~(1UL << (nr % TD_DIRTY_BITS_PER_LONG));
+		map->ndirty--;
+	}
+}
+
+void td_dirty_set_range(struct td_dirty_map *map,
+			uint64_t block, uint64_t count);
+void td_dirty_clear_range(struct td_dirty_map *map,
+			  uint64_t block, uint64_t count);
+
+/*
+ * The blocks covering [sec, sec + secs).
+ */
+void td_dirty_sec_range(struct td_dirty_map *map, td_sector_t sec,
+			uint64_t secs, uint64_t *block, uint64_t *count);
+
+/*
+ * Marks, or tests for, any dirty block in [sec, sec + secs).
+ */
+void td_dirty_mark(struct td_dirty_map *map, td_sector_t sec, uint64_t secs);
+int td_dirty_any(struct td_dirty_map *map, td_sector_t sec, uint64_t secs);
+
+/*
+ * Finds the next run of at most @max dirty blocks at or after the
+ * cursor, wrapping around once. Returns the run length, 0 if the map
+ * is clean.
+ */
+uint64_t td_dirty_next_run(struct td_dirty_map *map, uint64_t max,
+			   uint64_t *block);
+
+struct td_copier;
+
+struct td_copy_chunk {
+	struct td_copier               *copier;
+	int                             busy;
+	int                             writing;
+
+	uint64_t                        block;
+	uint64_t                        count;
+	int                             pending;  /* sectors */
+	int                             error;
+	td_image_t                     *image;    /* written to, if failed */
+
+	void                           *buf;
+	struct td_iovec                 iov;
+	td_vbd_request_t                vreq;
+	char                            name[32];
+};
+
+struct td_copy_ops {
+	/*
+	 * Every tick, once the budget was refilled.
+	 */
+	void (*tick)(struct td_copier *);
+
+	/*
+	 * A chunk was read: queue @treq to the destination, which
+	 * completes it, possibly piecewise. Returning an error drops
+	 * the chunk instead.
+	 */
+	int  (*write)(struct td_copier *, td_request_t treq);
+
+	/*
+	 * A chunk is done, copied or not. Its blocks were marked dirty
+	 * again if not; chunk->writing tells a read from a write error.
+	 */
+	void (*done)(struct td_copier *, struct td_copy_chunk *, int err);
+};
+
+struct td_copier {
+	td_vbd_t                       *vbd;
+	const char                     *name;
+	td_sector_t                     size;
+	struct td_dirty_map             map;
+
+	int                             chunk_blocks;
+	int                             max_inflight;
+	int                             inflight;
+	struct td_copy_chunk           *chunks;
+
+	uint64_t                        rate;     /* bytes/s */
+	int                             interval; /* usecs */
+	int64_t                         budget;
+	event_id_t                      timer;
+
+	const struct td_copy_ops       *ops;
+	void                           *private;
+	int                             detached;
+
+	struct {
+		unsigned long long      copied;   /* blocks */
+		unsigned long long      redirtied;
+		unsigned long long      held;
+		unsigned long long      errors;
+	} stats;
+};
+
+struct td_copier *td_copier_create(td_vbd_t *vbd, const char *name,
+				   td_sector_t size, int shift,
+				   int chunk_blocks, int max_inflight,
+				   uint64_t rate, int interval,
+				   const struct td_copy_ops *ops,
+				   void *private);
+
+/*
+ * Stops the copier. Copies the VBD holds but did not issue are
+ * cancelled; those in flight complete on their own, without calling
+ * back, and the copier goes with the last one.
+ */
+void td_copier_destroy(struct td_copier *c);
+
+/*
+ * Starts or stops ticking.
+ */
+int td_copier_start(struct td_copier *c);
+void td_copier_stop(struct td_copier *c);
+
+/*
+ * Records a write to [sec, sec + secs). td_copier_mark() marks it all
+ * dirty, td_copier_mark_busy() only what a copy in flight may be
+ * overwriting with older data.
+ */
+void td_copier_mark(struct td_copier *c, td_sector_t sec, int secs);
+void td_copier_mark_busy(struct td_copier *c, td_sector_t sec, int secs);
+
+/*
+ * Issues copies of the next dirty runs, as far as free chunks and the
+ * budget go. Runs overlapping a guest write in flight are held back
+ * until the write completed: the read could miss it, and the copy then
+ * overtake it at the destination, with the bits already clear.
+ */
+void td_copier_issue(struct td_copier *c);
+
+/*
+ * Returns non-zero while copies are being written.
+ */
+int td_copier_busy(struct td_copier *c);
+
+#endif /* _TAPDISK_DIRTY_H_ */
@@ -78,7 +78,7 @@ static const disk_info_t ram_disk = {
 
 static const disk_info_t qcow_disk = {
        "qcow",
-       "qcow disk (qcow)",
+       "qcow2 image (qcow)",
        0,
 };
 
@@ -136,6 +136,36 @@ static const disk_info_t nbd_disk = {
 	0,
 };
 
+static const disk_info_t readahead_disk = {
+	"ra",
+	"sequential read-ahead (ra)",
+	DISK_TYPE_FILTER,
+};
+
+static const disk_info_t wbcache_disk = {
+	"wbc",
+	"write-back cache, local log (wbc)",
+	DISK_TYPE_FILTER,
+};
+
+static const disk_info_t cz_disk = {
+	"cz",
+	"compressed image (cz)",
+	0,
+};
+
+static const disk_info_t dedup_disk = {
+	"dedup",
+	"deduplicating filter, shared store (dedup)",
+	DISK_TYPE_FILTER,
+};
+
+static const disk_info_t vhdx_disk = {
+	"vhdx",
+	"virtual server image v2 (vhdx)",
+	0,
+};
+
 const disk_info_t *tapdisk_disk_types[] = {
 	[DISK_TYPE_AIO]	= &aio_disk,
 	[DISK_TYPE_SYNC]	= &sync_disk,
@@ -153,6 +183,11 @@ const disk_info_t *tapdisk_disk_types[] = {
 	[DISK_TYPE_LLPCACHE]    = &llpcache_disk,
 	[DISK_TYPE_LLECACHE]    = &llecache_disk,
 	[DISK_TYPE_NBD]         = &nbd_disk,
+	[DISK_TYPE_READAHEAD]   = &readahead_disk,
+	[DISK_TYPE_WBCACHE]     = &wbcache_disk,
+	[DISK_TYPE_CZ]          = &cz_disk,
+	[DISK_TYPE_DEDUP]       = &dedup_disk,
+	[DISK_TYPE_VHDX]        = &vhdx_disk,
 	0,
 };
 
@@ -164,9 +199,7 @@ extern struct tap_disk tapdisk_vhdsync;
 #endif
 extern struct tap_disk tapdisk_vhd;
 extern struct tap_disk tapdisk_ram;
-#if 0
 extern struct tap_disk tapdisk_qcow;
-#endif
 extern struct tap_disk tapdisk_block_cache;
 extern struct tap_disk tapdisk_vhd_index;
 extern struct tap_disk tapdisk_log;
@@ -175,6 +208,11 @@ extern struct tap_disk tapdisk_llpcache;
 extern struct tap_disk tapdisk_llecache;
 extern struct tap_disk tapdisk_valve;
 extern struct tap_disk tapdisk_nbd;
+extern struct tap_disk tapdisk_readahead;
+extern struct tap_disk tapdisk_wbcache;
+extern struct tap_disk tapdisk_cz;
+extern struct tap_disk tapdisk_dedup;
+extern struct tap_disk tapdisk_vhdx;
 
 const struct tap_disk *tapdisk_disk_drivers[] = {
 	[DISK_TYPE_AIO]         = &tapdisk_aio,
@@ -185,9 +223,7 @@ const struct tap_disk *tapdisk_disk_drivers[] = {
 #endif
 	[DISK_TYPE_VHD]         = &tapdisk_vhd,
 	[DISK_TYPE_RAM]         = &tapdisk_ram,
-#if 0
 	[DISK_TYPE_QCOW]        = &tapdisk_qcow,
-#endif
 	[DISK_TYPE_BLOCK_CACHE] = &tapdisk_block_cache,
 	[DISK_TYPE_VINDEX]      = &tapdisk_vhd_index,
 	[DISK_TYPE_LOG]         = &tapdisk_log,
@@ -196,6 +232,11 @@ const struct tap_disk *tapdisk_disk_drivers[] = {
 	[DISK_TYPE_LLECACHE]    = &tapdisk_llecache,
 	[DISK_TYPE_VALVE]       = &tapdisk_valve,
 	[DISK_TYPE_NBD]         = &tapdisk_nbd,
+	[DISK_TYPE_READAHEAD]   = &tapdisk_readahead,
+	[DISK_TYPE_WBCACHE]     = &tapdisk_wbcache,
+	[DISK_TYPE_CZ]          = &tapdisk_cz,
+	[DISK_TYPE_DEDUP]       = &tapdisk_dedup,
+	[DISK_TYPE_VHDX]        = &tapdisk_vhdx,
 	0,
 };
 
@@ -48,6 +48,11 @@
 #define DISK_TYPE_VALVE       14
 #define DISK_TYPE_NBD         15
 /*#define DISK_TYPE_NTNX        16 - Deprecated */
+#define DISK_TYPE_READAHEAD   17
+#define DISK_TYPE_WBCACHE     18
+#define DISK_TYPE_CZ          19
+#define DISK_TYPE_DEDUP       20
+#define DISK_TYPE_VHDX        21
 
 #define DISK_TYPE_NAME_MAX    32
 
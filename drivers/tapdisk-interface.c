@@ -165,10 +165,21 @@ td_validate_parent(td_image_t *image, td_image_t *parent)
 	return driver->ops->td_validate_parent(driver, pdriver, 0);
 }
 
+/*
+ * I/O prepared while a request is queued takes the class of the VBD
+ * request it serves. Anything else, such as metadata I/O issued from
+ * completions, is foreground.
+ */
+static inline int
+td_request_io_class(td_request_t treq)
+{
+	return treq.vreq ? treq.vreq->io_class : TD_VREQ_CLASS_FG;
+}
+
 void
 td_queue_write(td_image_t *image, td_request_t treq)
 {
-	int err;
+	int err, io_class;
 	td_driver_t *driver;
 
 	driver = image->driver;
@@ -191,7 +202,9 @@ td_queue_write(td_image_t *image, td_request_t treq)
 	if (err)
 		goto fail;
 
+	io_class = tapdisk_server_set_io_class(td_request_io_class(treq));
 	driver->ops->td_queue_write(driver, treq);
+	tapdisk_server_set_io_class(io_class);
 
 	return;
 
@@ -202,7 +215,7 @@ fail:
 void
 td_queue_read(td_image_t *image, td_request_t treq)
 {
-	int err;
+	int err, io_class;
 	td_driver_t *driver;
 
 	driver = image->driver;
@@ -225,7 +238,9 @@ td_queue_read(td_image_t *image, td_request_t treq)
 	if (err)
 		goto fail;
 
+	io_class = tapdisk_server_set_io_class(td_request_io_class(treq));
 	driver->ops->td_queue_read(driver, treq);
+	tapdisk_server_set_io_class(io_class);
 
 	return;
 
@@ -236,7 +251,7 @@ fail:
 void
 td_queue_block_status(td_image_t *image, td_request_t *treq)
 {
-	int err;
+	int err, io_class;
 	td_driver_t *driver;
 
 	driver = image->driver;
@@ -259,7 +274,9 @@ td_queue_block_status(td_image_t *image, td_request_t *treq)
 	if (err)
 		goto fail;
 
+	io_class = tapdisk_server_set_io_class(td_request_io_class(*treq));
 	driver->ops->td_queue_block_status(driver, *treq);
+	tapdisk_server_set_io_class(io_class);
 
 	return;
 
@@ -276,7 +293,11 @@ td_forward_request(td_request_t treq)
 void
 td_complete_request(td_request_t treq, int res)
 {
+	int io_class;
+
+	io_class = tapdisk_server_set_io_class(TD_VREQ_CLASS_FG);
 	treq.cb(treq, res);
+	tapdisk_server_set_io_class(io_class);
 }
 
 void
@@ -312,6 +333,21 @@ td_debug(td_image_t *image)
 	tapdisk_driver_debug(driver);
 }
 
+int
+td_busy(td_image_t *image)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return 0;
+
+	if (!driver->ops->td_busy)
+		return 0;
+
+	return driver->ops->td_busy(driver);
+}
+
 __noreturn void
 td_panic(void)
 {
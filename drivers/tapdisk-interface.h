@@ -50,6 +50,7 @@ void td_forward_request(td_request_t);
 void td_complete_request(td_request_t, int);
 
 void td_debug(td_image_t *);
+int td_busy(td_image_t *);
 
 void td_queue_tiocb(td_driver_t *, struct tiocb *);
 void td_prep_read(td_driver_t *, struct tiocb *, int, char *, size_t,
@@ -0,0 +1,415 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Asynchronous, bounded-lag mirroring to the VBD secondary, see
+ * tapdisk-mirror.h.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-image.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-resync.h"
+#include "tapdisk-mirror.h"
+#include "timeout-math.h"
+
+#define INFO(_f, _a...)      tlog_syslog(TLOG_INFO, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+#define MIRROR_RETRY_US      1000
+
+static void tapdisk_vbd_mirror_dispatch(struct td_vbd_mirror *m);
+
+static inline unsigned long long
+entry_bytes(struct td_mirror_entry *entry)
+{
+	return (unsigned long long)entry->treq.secs << SECTOR_SHIFT;
+}
+
+static void
+mirror_entry_finish(struct td_mirror_entry *entry, int err)
+{
+	struct td_vbd_mirror *m = entry->mirror;
+
+	m->lag_bytes -= entry_bytes(entry);
+
+	if (entry->sync)
+		tapdisk_vbd_complete_td_request(entry->treq, err);
+	else
+		free(entry->treq.buf);
+
+	free(entry);
+}
+
+/*
+ * The secondary will never see this write: remember it for a later
+ * resync, if enabled, and let any waiter go.
+ */
+static void
+mirror_entry_drop(struct td_mirror_entry *entry)
+{
+	struct td_vbd_mirror *m = entry->mirror;
+	td_vbd_t *vbd = m->vbd;
+
+	if (td_flag_test(vbd->flags, TD_OPEN_RESYNC))
+		tapdisk_vbd_resync_degrade(vbd, entry->treq.sec,
+					   entry->treq.secs);
+
+	m->stats.dropped++;
+	mirror_entry_finish(entry, 0);
+}
+
+static void
+mirror_fail(struct td_vbd_mirror *m, td_image_t *image, int err)
+{
+	td_vbd_t *vbd = m->vbd;
+	struct td_mirror_entry *entry, *tmp;
+
+	ERR(err, "%s: async mirror write failed, disabling mirroring\n",
+	    vbd->name);
+	m->stats.errors++;
+
+	if (image && image == vbd->secondary)
+		tapdisk_vbd_retire_secondary(vbd, image);
+
+	list_for_each_entry_safe(entry, tmp, &m->queued, next) {
+		list_del(&entry->next);
+		mirror_entry_drop(entry);
+	}
+}
+
+static void
+__mirror_retry(event_id_t id, char mode, void *private)
+{
+	struct td_vbd_mirror *m = private;
+
+	tapdisk_server_unregister_event(m->retry);
+	m->retry   = -1;
+	m->stalled = 0;
+
+	tapdisk_vbd_mirror_dispatch(m);
+}
+
+static void
+mirror_schedule_retry(struct td_vbd_mirror *m)
+{
+	event_id_t id;
+
+	if (m->retry >= 0 || m->n_inflight)
+		return;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+					   TV_USECS(MIRROR_RETRY_US),
+					   __mirror_retry, m);
+	if (id < 0) {
+		mirror_fail(m, m->vbd->secondary, id);
+		return;
+	}
+
+	m->retry = id;
+}
+
+static void
+__mirror_write_done(td_request_t treq, int err)
+{
+	struct td_mirror_entry *entry = treq.cb_data;
+	struct td_vbd_mirror *m = entry->mirror;
+
+	list_del(&entry->next);
+	m->n_inflight--;
+
+	/*
+	 * The secondary pushed back: hold off until another copy
+	 * completes, or the retry fires. Dispatching right away could
+	 * just get the same answer, over and over.
+	 */
+	if (err == -EBUSY) {
+		entry->issued = 0;
+		list_add(&entry->next, &m->queued);
+		m->stalled = 1;
+		mirror_schedule_retry(m);
+		return;
+	}
+
+	m->stalled = 0;
+
+	if (err) {
+		mirror_fail(m, treq.image, err);
+		mirror_entry_drop(entry);
+		goto out;
+	}
+
+	m->stats.completed++;
+	mirror_entry_finish(entry, 0);
+
+out:
+	tapdisk_vbd_mirror_dispatch(m);
+}
+
+static int
+mirror_entry_blocked(struct td_vbd_mirror *m, struct td_mirror_entry *entry)
+{
+	struct td_mirror_entry *prev;
+	td_sector_t start, end;
+
+	start = entry->treq.sec;
+	end   = start + entry->treq.secs;
+
+	list_for_each_entry(prev, &m->inflight, next)
+		if (prev->treq.sec < end &&
+		    start < prev->treq.sec + prev->treq.secs)
+			return 1;
+
+	return 0;
+}
+
+static void
+tapdisk_vbd_mirror_dispatch(struct td_vbd_mirror *m)
+{
+	td_vbd_t *vbd = m->vbd;
+	struct td_mirror_entry *entry;
+	td_request_t treq;
+
+	if (m->dispatching)
+		return;
+	m->dispatching = 1;
+
+	while (!m->stalled && !list_empty(&m->queued) &&
+	       m->n_inflight < TD_MIRROR_MAX_INFLIGHT) {
+		entry = list_entry(m->queued.next,
+				   struct td_mirror_entry, next);
+
+		if (vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR ||
+		    !vbd->secondary) {
+			list_del(&entry->next);
+			mirror_entry_drop(entry);
+			continue;
+		}
+
+		/* keep overlapping writes in order */
+		if (mirror_entry_blocked(m, entry))
+			break;
+
+		list_move_tail(&entry->next, &m->inflight);
+		m->n_inflight++;
+		entry->issued = 1;
+
+		treq         = entry->treq;
+		treq.image   = vbd->secondary;
+		treq.cb      = __mirror_write_done;
+		treq.cb_data = entry;
+
+		td_queue_write(treq.image, treq);
+	}
+
+	m->dispatching = 0;
+}
+
+int
+tapdisk_vbd_mirror_queue(td_vbd_t *vbd, td_request_t treq, int sync)
+{
+	struct td_vbd_mirror *m = vbd->mirror;
+	struct td_mirror_entry *entry;
+	void *buf = NULL;
+	int err;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	if (!sync) {
+		err = posix_memalign(&buf, 4096, treq.secs << SECTOR_SHIFT);
+		if (err) {
+			free(entry);
+			buf = NULL;
+			err = -err;
+			goto fail;
+		}
+		memcpy(buf, treq.buf, treq.secs << SECTOR_SHIFT);
+		treq.buf = buf;
+	}
+
+	entry->mirror = m;
+	entry->treq   = treq;
+	entry->sync   = sync;
+	gettimeofday(&entry->ts, NULL);
+
+	list_add_tail(&entry->next, &m->queued);
+
+	m->lag_bytes += entry_bytes(entry);
+	if (m->lag_bytes > m->stats.max_lag_bytes)
+		m->stats.max_lag_bytes = m->lag_bytes;
+	if (sync)
+		m->stats.sync++;
+	else
+		m->stats.async++;
+
+	tapdisk_vbd_mirror_dispatch(m);
+	return 0;
+
+fail:
+	/*
+	 * Nothing was queued: treat it like a failed mirror write, so the
+	 * secondary cannot silently miss it.
+	 */
+	if (td_flag_test(vbd->flags, TD_OPEN_RESYNC))
+		tapdisk_vbd_resync_degrade(vbd, treq.sec, treq.secs);
+	mirror_fail(m, vbd->secondary, err);
+	if (sync)
+		tapdisk_vbd_complete_td_request(treq, 0);
+	return err;
+}
+
+int
+tapdisk_vbd_mirror_lagging(td_vbd_t *vbd)
+{
+	struct td_vbd_mirror *m = vbd->mirror;
+	struct td_mirror_entry *oldest;
+	struct timeval now, age;
+	const struct list_head *list;
+
+	if (!m)
+		return 1;
+
+	if (m->lag_bytes >= m->max_lag_bytes)
+		return 1;
+
+	list = !list_empty(&m->inflight) ? &m->inflight : &m->queued;
+	if (list_empty(list))
+		return 0;
+
+	oldest = list_entry(list->next, struct td_mirror_entry, next);
+	gettimeofday(&now, NULL);
+	TV_SUB(now, oldest->ts, age);
+
+	return age.tv_sec * 1000 + age.tv_usec / 1000 >= m->max_lag_ms;
+}
+
+int
+tapdisk_vbd_mirror_busy(td_vbd_t *vbd)
+{
+	struct td_vbd_mirror *m = vbd->mirror;
+
+	return m && (!list_empty(&m->queued) || !list_empty(&m->inflight));
+}
+
+int
+tapdisk_vbd_mirror_create(td_vbd_t *vbd)
+{
+	struct td_vbd_mirror *m;
+	const char *env;
+
+	if (vbd->mirror)
+		return 0;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return -ENOMEM;
+
+	m->vbd   = vbd;
+	m->retry = -1;
+	INIT_LIST_HEAD(&m->queued);
+	INIT_LIST_HEAD(&m->inflight);
+
+	m->max_lag_bytes = TD_MIRROR_DEFAULT_LAG_BYTES;
+	env = getenv("TAPDISK_MIRROR_MAX_LAG_MB");
+	if (env && strtoull(env, NULL, 10))
+		m->max_lag_bytes = strtoull(env, NULL, 10) << 20;
+
+	m->max_lag_ms = TD_MIRROR_DEFAULT_LAG_MS;
+	env = getenv("TAPDISK_MIRROR_MAX_LAG_MS");
+	if (env && strtoul(env, NULL, 10))
+		m->max_lag_ms = strtoul(env, NULL, 10);
+
+	INFO("%s: asynchronous mirroring, max lag %llu bytes / %lu ms\n",
+	     vbd->name, m->max_lag_bytes, m->max_lag_ms);
+
+	vbd->mirror = m;
+	return 0;
+}
+
+void
+tapdisk_vbd_mirror_free(td_vbd_t *vbd)
+{
+	struct td_vbd_mirror *m = vbd->mirror;
+	struct td_mirror_entry *entry, *tmp;
+
+	if (!m)
+		return;
+
+	list_for_each_entry_safe(entry, tmp, &m->queued, next) {
+		list_del(&entry->next);
+		mirror_entry_drop(entry);
+	}
+
+	if (m->retry >= 0)
+		tapdisk_server_unregister_event(m->retry);
+
+	free(m);
+	vbd->mirror = NULL;
+}
+
+void
+tapdisk_vbd_mirror_stats(td_vbd_t *vbd, td_stats_t *st)
+{
+	struct td_vbd_mirror *m = vbd->mirror;
+	int queued = 0;
+	struct td_mirror_entry *entry;
+
+	list_for_each_entry(entry, &m->queued, next)
+		queued++;
+
+	tapdisk_stats_field(st, "queued", "d", queued);
+	tapdisk_stats_field(st, "inflight", "d", m->n_inflight);
+	tapdisk_stats_field(st, "lag_bytes", "llu", m->lag_bytes);
+	tapdisk_stats_field(st, "max_lag_bytes", "llu", m->max_lag_bytes);
+	tapdisk_stats_field(st, "max_lag_ms", "lu", m->max_lag_ms);
+	tapdisk_stats_field(st, "async", "llu", m->stats.async);
+	tapdisk_stats_field(st, "sync", "llu", m->stats.sync);
+	tapdisk_stats_field(st, "completed", "llu", m->stats.completed);
+	tapdisk_stats_field(st, "dropped", "llu", m->stats.dropped);
+	tapdisk_stats_field(st, "errors", "llu", m->stats.errors);
+	tapdisk_stats_field(st, "peak_lag_bytes", "llu", m->stats.max_lag_bytes);
+}
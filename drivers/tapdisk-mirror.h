@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TAPDISK_MIRROR_H_
+#define _TAPDISK_MIRROR_H_
+
+#include "tapdisk.h"
+#include "scheduler.h"
+
+/*
+ * Asynchronous mirroring: guest writes complete as soon as the primary
+ * has them, while a copy is queued for the secondary. Copies are issued
+ * in order, and a copy never overtakes an earlier overlapping one. Once
+ * the queue reaches its lag limit, in bytes or in age, new writes fall
+ * back to waiting for the secondary, which throttles the guest until
+ * the queue drains below the limit again.
+ */
+
+#define TD_MIRROR_MAX_INFLIGHT       32
+#define TD_MIRROR_DEFAULT_LAG_BYTES  (64ULL << 20)
+#define TD_MIRROR_DEFAULT_LAG_MS     5000
+
+struct td_vbd_mirror;
+
+struct td_mirror_entry {
+	struct td_vbd_mirror           *mirror;
+	struct list_head                next;
+
+	td_request_t                    treq;
+	int                             sync;
+	int                             issued;
+	struct timeval                  ts;
+};
+
+struct td_vbd_mirror {
+	td_vbd_t                       *vbd;
+
+	struct list_head                queued;
+	struct list_head                inflight;
+	int                             n_inflight;
+	int                             dispatching;
+	int                             stalled;
+	event_id_t                      retry;
+
+	unsigned long long              lag_bytes;
+	unsigned long long              max_lag_bytes;
+	unsigned long                   max_lag_ms;
+
+	struct {
+		unsigned long long      async;
+		unsigned long long      sync;
+		unsigned long long      completed;
+		unsigned long long      dropped;
+		unsigned long long      errors;
+		unsigned long long      max_lag_bytes;
+	} stats;
+};
+
+int tapdisk_vbd_mirror_create(td_vbd_t *vbd);
+void tapdisk_vbd_mirror_free(td_vbd_t *vbd);
+
+/*
+ * Returns non-zero if the next write has to wait for the secondary.
+ */
+int tapdisk_vbd_mirror_lagging(td_vbd_t *vbd);
+
+/*
+ * Queues the mirror copy of @treq. With @sync set, @treq is completed
+ * back to the VBD once the secondary has it; otherwise the data is
+ * copied and the caller completes on the primary alone.
+ */
+int tapdisk_vbd_mirror_queue(td_vbd_t *vbd, td_request_t treq, int sync);
+
+/*
+ * Returns non-zero while mirror copies are still queued or in flight.
+ */
+int tapdisk_vbd_mirror_busy(td_vbd_t *vbd);
+
+void tapdisk_vbd_mirror_stats(td_vbd_t *vbd, td_stats_t *st);
+
+#endif /* _TAPDISK_MIRROR_H_ */
@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Kernel NBD attach. The kernel end of each socketpair is handed to the
+ * nbd driver with NBD_CMD_CONNECT, the other end becomes a client of the
+ * VBD's new-style NBD server, already in the transmission phase. Local
+ * consumers then get a block device without an nbd-client process or a
+ * TCP stack in the way.
+ *
+ * Netlink is spoken directly, without libnl: the transactions are few,
+ * synchronous, and only happen from the control path.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/nbd-netlink.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-nbdserver.h"
+#include "tapdisk-nbdkernel.h"
+#include "tapdisk-protocol-new.h"
+#include "list.h"
+
+#define BUG_ON(_cond)    if (unlikely(_cond)) { td_panic(); }
+
+#define DBG(_f, _a...)       tlog_syslog(TLOG_DBG, _f, ##_a)
+#define INFO(_f, _a...)      tlog_syslog(TLOG_INFO, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+#define TD_NBDKERNEL_MSG_SIZE       4096
+
+struct td_nbdkernel {
+	td_vbd_t               *vbd;
+	td_nbdserver_t         *server;
+	int                     index;
+	int                     conns;
+	int                     connected;
+};
+
+struct td_nl_msg {
+	struct nlmsghdr        *nlh;
+	char                    buf[TD_NBDKERNEL_MSG_SIZE];
+};
+
+static void
+td_nl_msg_init(struct td_nl_msg *msg, uint16_t family, uint8_t cmd,
+	       uint8_t version)
+{
+	struct genlmsghdr *genl;
+
+	memset(msg->buf, 0, sizeof(msg->buf));
+
+	msg->nlh              = (struct nlmsghdr *)msg->buf;
+	msg->nlh->nlmsg_len   = NLMSG_LENGTH(GENL_HDRLEN);
+	msg->nlh->nlmsg_type  = family;
+	msg->nlh->nlmsg_flags = NLM_F_REQUEST|NLM_F_ACK;
+
+	genl          = NLMSG_DATA(msg->nlh);
+	genl->cmd     = cmd;
+	genl->version = version;
+}
+
+static struct nlattr *
+td_nl_msg_put(struct td_nl_msg *msg, int type, const void *data, int len)
+{
+	struct nlmsghdr *nlh = msg->nlh;
+	struct nlattr *nla;
+	size_t off;
+
+	off = NLMSG_ALIGN(nlh->nlmsg_len);
+	BUG_ON(off + NLA_HDRLEN + NLA_ALIGN(len) > sizeof(msg->buf));
+
+	nla           = (struct nlattr *)(msg->buf + off);
+	nla->nla_type = type;
+	nla->nla_len  = NLA_HDRLEN + len;
+	if (len)
+		memcpy((char *)nla + NLA_HDRLEN, data, len);
+
+	nlh->nlmsg_len = off + NLA_ALIGN(nla->nla_len);
+
+	return nla;
+}
+
+static void
+td_nl_msg_put_u32(struct td_nl_msg *msg, int type, uint32_t val)
+{
+	td_nl_msg_put(msg, type, &val, sizeof(val));
+}
+
+static void
+td_nl_msg_put_u64(struct td_nl_msg *msg, int type, uint64_t val)
+{
+	td_nl_msg_put(msg, type, &val, sizeof(val));
+}
+
+static struct nlattr *
+td_nl_msg_nest_start(struct td_nl_msg *msg, int type)
+{
+	return td_nl_msg_put(msg, type | NLA_F_NESTED, NULL, 0);
+}
+
+static void
+td_nl_msg_nest_end(struct td_nl_msg *msg, struct nlattr *nest)
+{
+	nest->nla_len = msg->buf + msg->nlh->nlmsg_len - (char *)nest;
+}
+
+typedef void (*td_nl_attr_cb_t)(const struct nlattr *, void *);
+
+static void
+td_nl_for_each_attr(const struct nlmsghdr *nlh, td_nl_attr_cb_t cb,
+		    void *data)
+{
+	const struct nlattr *nla;
+	int rem;
+
+	nla = (const struct nlattr *)((char *)NLMSG_DATA(nlh) + GENL_HDRLEN);
+	rem = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+	while (rem >= (int)sizeof(*nla) &&
+	       nla->nla_len >= sizeof(*nla) && nla->nla_len <= rem) {
+		cb(nla, data);
+		rem -= NLA_ALIGN(nla->nla_len);
+		nla  = (const struct nlattr *)
+			((char *)nla + NLA_ALIGN(nla->nla_len));
+	}
+}
+
+/*
+ * Sends @msg and reads replies until the kernel acks it. Replies other
+ * than the ack have their attributes passed to @cb.
+ */
+static int
+td_nl_transact(int fd, struct td_nl_msg *msg, td_nl_attr_cb_t cb,
+	       void *data)
+{
+	char buf[TD_NBDKERNEL_MSG_SIZE];
+	struct nlmsghdr *nlh;
+	ssize_t len;
+
+	len = send(fd, msg->buf, msg->nlh->nlmsg_len, 0);
+	if (len < 0)
+		return -errno;
+
+	for (;;) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = NLMSG_DATA(nlh);
+				return e->error;
+			}
+
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return 0;
+
+			if (cb)
+				td_nl_for_each_attr(nlh, cb, data);
+		}
+	}
+}
+
+static void
+td_nl_family_id_cb(const struct nlattr *nla, void *data)
+{
+	if ((nla->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_FAMILY_ID)
+		*(uint16_t *)data = *(uint16_t *)((char *)nla + NLA_HDRLEN);
+}
+
+static int
+td_nl_open(uint16_t *family)
+{
+	struct td_nl_msg msg;
+	int fd, err;
+
+	fd = socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (fd < 0)
+		return -errno;
+
+	*family = 0;
+
+	td_nl_msg_init(&msg, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 1);
+	td_nl_msg_put(&msg, CTRL_ATTR_FAMILY_NAME, NBD_GENL_FAMILY_NAME,
+		      sizeof(NBD_GENL_FAMILY_NAME));
+
+	err = td_nl_transact(fd, &msg, td_nl_family_id_cb, family);
+	if (!err && !*family)
+		err = -ENOENT;
+	if (err) {
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+static void
+tapdisk_nbdkernel_index_cb(const struct nlattr *nla, void *data)
+{
+	if ((nla->nla_type & NLA_TYPE_MASK) == NBD_ATTR_INDEX)
+		*(int *)data = *(uint32_t *)((char *)nla + NLA_HDRLEN);
+}
+
+static int
+tapdisk_nbdkernel_connect(td_nbdkernel_t *nbd, const int *fds)
+{
+	td_disk_info_t *info = &nbd->vbd->disk_info;
+	struct nlattr *socks, *item;
+	struct td_nl_msg msg;
+	uint64_t flags;
+	uint16_t family;
+	int fd, i, err;
+
+	fd = td_nl_open(&family);
+	if (fd < 0) {
+		ERR(fd, "nbd netlink family unavailable, "
+		    "is the nbd module loaded?\n");
+		return fd;
+	}
+
+	/* the server does no trim */
+	flags = NBD_FLAG_HAS_FLAGS|NBD_FLAG_SEND_FLUSH;
+	if (td_flag_test(nbd->vbd->flags, TD_OPEN_RDONLY))
+		flags |= NBD_FLAG_READ_ONLY;
+
+	td_nl_msg_init(&msg, family, NBD_CMD_CONNECT, NBD_GENL_VERSION);
+	if (nbd->index >= 0)
+		td_nl_msg_put_u32(&msg, NBD_ATTR_INDEX, nbd->index);
+	td_nl_msg_put_u64(&msg, NBD_ATTR_SIZE_BYTES,
+			  info->size << SECTOR_SHIFT);
+	td_nl_msg_put_u64(&msg, NBD_ATTR_BLOCK_SIZE_BYTES, info->sector_size);
+	td_nl_msg_put_u64(&msg, NBD_ATTR_SERVER_FLAGS, flags);
+
+	socks = td_nl_msg_nest_start(&msg, NBD_ATTR_SOCKETS);
+	for (i = 0; i < nbd->conns; i++) {
+		item = td_nl_msg_nest_start(&msg, NBD_SOCK_ITEM);
+		td_nl_msg_put_u32(&msg, NBD_SOCK_FD, fds[i]);
+		td_nl_msg_nest_end(&msg, item);
+	}
+	td_nl_msg_nest_end(&msg, socks);
+
+	err = td_nl_transact(fd, &msg, tapdisk_nbdkernel_index_cb,
+			     &nbd->index);
+	if (err)
+		ERR(err, "NBD_CMD_CONNECT failed\n");
+	else
+		nbd->connected = 1;
+
+	close(fd);
+	return err;
+}
+
+static int
+tapdisk_nbdkernel_disconnect(td_nbdkernel_t *nbd)
+{
+	struct td_nl_msg msg;
+	uint16_t family;
+	int fd, err;
+
+	fd = td_nl_open(&family);
+	if (fd < 0)
+		return fd;
+
+	td_nl_msg_init(&msg, family, NBD_CMD_DISCONNECT, NBD_GENL_VERSION);
+	td_nl_msg_put_u32(&msg, NBD_ATTR_INDEX, nbd->index);
+
+	err = td_nl_transact(fd, &msg, NULL, NULL);
+
+	close(fd);
+	return err;
+}
+
+void
+tapdisk_nbdkernel_detach(td_nbdkernel_t *nbd)
+{
+	td_nbdserver_client_t *client, *next;
+	int err;
+
+	/*
+	 * Drop our ends first: the driver sends NBD_CMD_DISC on each
+	 * socket while disconnecting, and must not block on a socket we
+	 * have stopped reading from. Attached clients are all ours, there
+	 * is one kernel device per VBD at most.
+	 */
+	list_for_each_entry_safe(client, next, &nbd->server->clients,
+				 clientlist)
+		if (client->attached && !client->dead)
+			tapdisk_nbdserver_free_client(client);
+
+	if (nbd->connected) {
+		err = tapdisk_nbdkernel_disconnect(nbd);
+		if (err)
+			ERR(err, "failed to disconnect /dev/nbd%d\n",
+			    nbd->index);
+		else
+			INFO("/dev/nbd%d disconnected\n", nbd->index);
+	}
+
+	free(nbd);
+}
+
+int
+tapdisk_nbdkernel_attach(td_vbd_t *vbd, int conns, int index,
+			 td_nbdkernel_t **_nbd)
+{
+	int fds[TD_NBDKERNEL_CONNS_MAX];
+	td_nbdserver_client_t *client;
+	td_nbdkernel_t *nbd;
+	int sv[2], i, err;
+
+	if (!conns)
+		conns = TD_NBDKERNEL_CONNS_DEFAULT;
+	if (conns < 0 || conns > TD_NBDKERNEL_CONNS_MAX)
+		return -EINVAL;
+
+	if (!vbd->nbdserver_new)
+		return -ENODEV;
+
+	nbd = calloc(1, sizeof(*nbd));
+	if (!nbd)
+		return -ENOMEM;
+
+	nbd->vbd    = vbd;
+	nbd->server = vbd->nbdserver_new;
+	nbd->index  = index;
+
+	for (i = 0; i < conns; i++)
+		fds[i] = -1;
+
+	for (i = 0; i < conns; i++) {
+		err = socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv);
+		if (err) {
+			err = -errno;
+			goto fail;
+		}
+
+		fds[i] = sv[0];
+
+		/* a local block device, not an export */
+		client = tapdisk_nbdserver_attach_fd(nbd->server, sv[1],
+						     TD_VREQ_CLASS_FG);
+		if (!client) {
+			close(sv[1]);
+			err = -ENOMEM;
+			goto fail;
+		}
+
+		nbd->conns++;
+	}
+
+	err = tapdisk_nbdkernel_connect(nbd, fds);
+	if (err)
+		goto fail;
+
+	/* the driver holds its own references to the sockets */
+	for (i = 0; i < conns; i++)
+		close(fds[i]);
+
+	INFO("VBD %d attached to /dev/nbd%d, %d connections\n",
+	     vbd->uuid, nbd->index, conns);
+
+	*_nbd = nbd;
+	return 0;
+
+fail:
+	for (i = 0; i < conns; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	tapdisk_nbdkernel_detach(nbd);
+	return err;
+}
+
+int
+tapdisk_nbdkernel_index(td_nbdkernel_t *nbd)
+{
+	return nbd->index;
+}
+
+void
+tapdisk_nbdkernel_stats(td_nbdkernel_t *nbd, td_stats_t *st)
+{
+	td_nbdserver_client_t *client;
+	int live = 0;
+
+	list_for_each_entry(client, &nbd->server->clients, clientlist)
+		if (client->attached && !client->dead)
+			live++;
+
+	tapdisk_stats_field(st, "index", "d", nbd->index);
+	tapdisk_stats_field(st, "connections", "d", nbd->conns);
+	tapdisk_stats_field(st, "live", "d", live);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_NBDKERNEL_H_
+#define _TAPDISK_NBDKERNEL_H_
+
+/*
+ * Kernel NBD attach: connects /dev/nbd<index> to the VBD's new-style NBD
+ * server over in-process socketpairs, configured through the nbd generic
+ * netlink family. Each connection is one blk-mq hardware queue of the
+ * kernel device.
+ */
+
+typedef struct td_nbdkernel td_nbdkernel_t;
+
+#include "tapdisk-vbd.h"
+#include "scheduler.h"
+
+#define TD_NBDKERNEL_CONNS_DEFAULT  1
+#define TD_NBDKERNEL_CONNS_MAX      16
+
+/**
+ * Attaches @conns connections (zero for the default) to /dev/nbd<@index>,
+ * or to the first free device if @index is negative.
+ */
+int tapdisk_nbdkernel_attach(td_vbd_t *vbd, int conns, int index,
+			     td_nbdkernel_t **nbd);
+
+/**
+ * Disconnects the kernel device and drops the connections.
+ */
+void tapdisk_nbdkernel_detach(td_nbdkernel_t *nbd);
+
+int tapdisk_nbdkernel_index(td_nbdkernel_t *nbd);
+
+void tapdisk_nbdkernel_stats(td_nbdkernel_t *nbd, td_stats_t *st);
+
+#endif /* _TAPDISK_NBDKERNEL_H_ */
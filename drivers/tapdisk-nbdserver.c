@@ -314,13 +314,53 @@ tapdisk_nbdserver_set_free_request(td_nbdserver_client_t *client,
 	client->reqs_free[client->n_reqs_free++] = req;
 }
 
+static void
+tapdisk_nbdserver_finish_flush(td_nbdserver_client_t *client)
+{
+	struct nbd_reply reply;
+
+	client->flushing = false;
+
+	if (client->dead || client->client_fd < 0)
+		return;
+
+	reply.magic = htonl(NBD_REPLY_MAGIC);
+	reply.error = 0;
+	memcpy(reply.handle, client->flush_handle, sizeof(reply.handle));
+
+	if (send_fully_or_fail(client->client_fd, &reply, sizeof(reply)) < 0)
+		ERR("Short send/error in flush reply");
+
+	tapdisk_server_mask_event(client->client_event_id, 0);
+}
+
+/*
+ * Writes are only acknowledged once they are stable, so a flush need
+ * only wait for the requests received before it, as a blkif barrier
+ * does. Nothing more is read from the client meanwhile.
+ */
+static void
+tapdisk_nbdserver_flush(td_nbdserver_client_t *client, const char *handle)
+{
+	memcpy(client->flush_handle, handle, sizeof(client->flush_handle));
+	client->flushing = true;
+
+	if (tapdisk_nbdserver_reqs_pending(client))
+		tapdisk_server_mask_event(client->client_event_id, 1);
+	else
+		tapdisk_nbdserver_finish_flush(client);
+}
+
 void
 tapdisk_nbdserver_free_request(td_nbdserver_client_t *client,
 			       td_nbdserver_req_t *req, bool free_client_if_dead)
 {
 	tapdisk_nbdserver_set_free_request(client, req);
 
-	if (unlikely(client->n_reqs_free == (client->n_reqs / 4))) {
+	if (unlikely(client->flushing)) {
+		if (!tapdisk_nbdserver_reqs_pending(client))
+			tapdisk_nbdserver_finish_flush(client);
+	} else if (unlikely(client->n_reqs_free == (client->n_reqs / 4))) {
 		/* free requests, unmask the events */
 		tapdisk_server_mask_event(client->client_event_id, 0);
 	}
@@ -816,6 +856,9 @@ tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
 	client->paused = 0;
 	client->dead = false;
 	client->structured_reply = false;
+	client->attached = false;
+	client->io_class = server->io_class;
+	client->flushing = false;
 
 	return client;
 
@@ -839,11 +882,17 @@ tapdisk_nbdserver_free_client(td_nbdserver_client_t *client)
 	INFO("Freeing client, max used requests %d", client->max_used_reqs);
 
 	if (likely(!tapdisk_nbdserver_reqs_pending(client))) {
+		if (client->attached && client->client_fd >= 0)
+			close(client->client_fd);
 		list_del(&client->clientlist);
 		tapdisk_nbdserver_reqs_free(client);
 		free(client);
-	} else
+	} else {
+		/* make late replies fail rather than block */
+		if (client->attached && client->client_fd >= 0)
+			shutdown(client->client_fd, SHUT_RDWR);
 		client->dead = true;
+	}
 }
 
 static void
@@ -1164,6 +1213,34 @@ tapdisk_nbdserver_newclient_fd_new_fixed(td_nbdserver_t *server, int new_fd)
 	}
 }
 
+td_nbdserver_client_t *
+tapdisk_nbdserver_attach_fd(td_nbdserver_t *server, int fd, int io_class)
+{
+	td_nbdserver_client_t *client;
+
+	ASSERT(server);
+	ASSERT(fd >= 0);
+
+	client = tapdisk_nbdserver_alloc_client(server);
+	if (client == NULL) {
+		ERR("Error allocating client");
+		return NULL;
+	}
+
+	client->client_fd = fd;
+	client->attached = true;
+	client->io_class = io_class;
+
+	if (tapdisk_nbdserver_enable_client(client) < 0) {
+		ERR("Error enabling client");
+		client->client_fd = -1;
+		tapdisk_nbdserver_free_client(client);
+		return NULL;
+	}
+
+	return client;
+}
+
 static void
 tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd)
 {
@@ -1211,6 +1288,7 @@ static td_vbd_request_t *create_request_vreq(
 	vreq->token = client;
 	vreq->name = req->id;
 	vreq->vbd = server->vbd;
+	vreq->io_class = client->io_class;
 
 	return vreq;
 
@@ -1282,7 +1360,15 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 		}
 
 		break;
+	case TAPDISK_NBD_CMD_FLUSH:
+		tapdisk_nbdserver_flush(client, request.handle);
+		return;
 	case TAPDISK_NBD_CMD_DISC:
+		if (client->attached) {
+			INFO("Kernel NBD connection closed");
+			tapdisk_nbdserver_free_client(client);
+			return;
+		}
 		INFO("Received close message. Sending reconnect header");
 		tapdisk_nbdserver_free_client(client);
 		INFO("About to send initial connection message");
@@ -1406,7 +1492,8 @@ tapdisk_nbdserver_newclient_unix(event_id_t id, char mode, void *data)
 }
 
 td_nbdserver_t *
-tapdisk_nbdserver_alloc(td_vbd_t *vbd, td_disk_info_t info, nbd_protocol_style_t style)
+tapdisk_nbdserver_alloc(td_vbd_t *vbd, td_disk_info_t info,
+		nbd_protocol_style_t style, int io_class)
 {
 	td_nbdserver_t *server;
 	char fdreceiver_path[TAPDISK_NBDSERVER_MAX_PATH_LEN];
@@ -1425,6 +1512,7 @@ tapdisk_nbdserver_alloc(td_vbd_t *vbd, td_disk_info_t info, nbd_protocol_style_t
 	server->unix_listening_fd = -1;
 	server->unix_listening_event_id = -1;
 	server->style = style;
+	server->io_class = io_class;
 	INIT_LIST_HEAD(&server->clients);
 
 	switch (style) {
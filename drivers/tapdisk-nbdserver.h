@@ -129,6 +129,11 @@ struct td_nbdserver {
 	stats_t                 nbd_stats;
 
 	nbd_protocol_style_t	style;
+
+	/**
+	 * Class of the VBD requests made for clients, enum td_vreq_class.
+	 */
+	int                     io_class;
 };
 
 struct td_nbdserver_client {
@@ -153,10 +158,32 @@ struct td_nbdserver_client {
 	 */
 	bool                    structured_reply;
 
+	/**
+	 * Connection handed to the kernel NBD driver: there is no
+	 * handshake, and the client owns its socket.
+	 */
+	bool                    attached;
+
+	/**
+	 * Class of the VBD requests made for this client.
+	 */
+	int                     io_class;
+
+	/**
+	 * An NBD_CMD_FLUSH waiting for the requests before it.
+	 */
+	bool                    flushing;
+	char                    flush_handle[8];
+
 	int                     max_used_reqs;
 };
 
-td_nbdserver_t *tapdisk_nbdserver_alloc(td_vbd_t *, td_disk_info_t, nbd_protocol_style_t);
+/**
+ * Allocates an NBD server for the VBD. Requests from its clients are
+ * issued in class @io_class (enum td_vreq_class).
+ */
+td_nbdserver_t *tapdisk_nbdserver_alloc(td_vbd_t *, td_disk_info_t,
+		nbd_protocol_style_t, int io_class);
 
 /**
  * Listen for connections on a TCP socket at the specified port.
@@ -188,6 +215,14 @@ int tapdisk_nbdserver_reqs_init(td_nbdserver_client_t *client, int n_reqs);
 void tapdisk_nbdserver_free_client(td_nbdserver_client_t *client);
 td_nbdserver_client_t *tapdisk_nbdserver_alloc_client(td_nbdserver_t *server);
 
+/**
+ * Serves @fd as a client already in the transmission phase, as the kernel
+ * NBD driver expects, issuing its requests in class @io_class. The socket
+ * is closed when the client goes away.
+ */
+td_nbdserver_client_t *tapdisk_nbdserver_attach_fd(td_nbdserver_t *server,
+		int fd, int io_class);
+
 /**
  * Tells whether the NBD client is being server by the NBD server.
  */
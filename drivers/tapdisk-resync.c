@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * CBT-style online resync for the mirror secondary, see tapdisk-resync.h.
+ *
+ * The dirty bitmap and the copies belong to a td_copier: copies are read
+ * through the VBD, like any other request, and written straight to the
+ * secondary image. While copying, guest writes are mirrored, so only
+ * those racing a copy in flight need marking again.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-image.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-dirty.h"
+#include "tapdisk-resync.h"
+
+#define DBG(_f, _a...)       tlog_syslog(TLOG_DBG, _f, ##_a)
+#define INFO(_f, _a...)      tlog_syslog(TLOG_INFO, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+static void
+__resync_tick(struct td_copier *c)
+{
+	struct td_vbd_resync *rs = c->private;
+
+	if (rs->state != TD_RESYNC_COPYING) {
+		td_copier_stop(c);
+		return;
+	}
+
+	td_copier_issue(c);
+
+	if (!c->map.ndirty && !c->inflight) {
+		INFO("%s: secondary resynchronized, %llu blocks copied\n",
+		     rs->vbd->name, c->stats.copied);
+		rs->state = TD_RESYNC_IDLE;
+		td_copier_stop(c);
+	}
+}
+
+static int
+__resync_write(struct td_copier *c, td_request_t treq)
+{
+	struct td_vbd_resync *rs = c->private;
+	td_vbd_t *vbd = rs->vbd;
+
+	if (rs->state != TD_RESYNC_COPYING ||
+	    vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR ||
+	    !vbd->secondary)
+		return -ENODEV;
+
+	treq.image = vbd->secondary;
+	td_queue_write(treq.image, treq);
+
+	return 0;
+}
+
+static void
+__resync_done(struct td_copier *c, struct td_copy_chunk *chunk, int err)
+{
+	struct td_vbd_resync *rs = c->private;
+	td_vbd_t *vbd = rs->vbd;
+
+	if (!err || !chunk->writing)
+		return;
+
+	ERR(err, "%s: resync write of block %"PRIu64" failed\n",
+	    vbd->name, chunk->block);
+
+	if (chunk->image && chunk->image == vbd->secondary)
+		tapdisk_vbd_retire_secondary(vbd, chunk->image);
+	if (rs->state == TD_RESYNC_COPYING) {
+		rs->state = TD_RESYNC_DEGRADED;
+		rs->stats.degraded++;
+	}
+}
+
+static const struct td_copy_ops resync_copy_ops = {
+	.tick  = __resync_tick,
+	.write = __resync_write,
+	.done  = __resync_done,
+};
+
+static struct td_vbd_resync *
+tapdisk_vbd_resync_create(td_vbd_t *vbd)
+{
+	struct td_vbd_resync *rs;
+	td_image_t *leaf;
+	const char *env;
+	uint64_t rate;
+
+	if (list_empty(&vbd->images))
+		return NULL;
+	leaf = list_entry(vbd->images.next, td_image_t, next);
+
+	rs = calloc(1, sizeof(*rs));
+	if (!rs)
+		return NULL;
+
+	rate = TD_RESYNC_DEFAULT_RATE;
+	env = getenv("TAPDISK_RESYNC_RATE_MB");
+	if (env && strtoull(env, NULL, 10))
+		rate = strtoull(env, NULL, 10) << 20;
+
+	rs->vbd    = vbd;
+	rs->copier = td_copier_create(vbd, "resync", leaf->info.size,
+				      TD_RESYNC_BLOCK_SHIFT,
+				      TD_RESYNC_CHUNK_BLOCKS,
+				      TD_RESYNC_MAX_INFLIGHT,
+				      rate, TD_RESYNC_INTERVAL_US,
+				      &resync_copy_ops, rs);
+	if (!rs->copier) {
+		free(rs);
+		return NULL;
+	}
+
+	return rs;
+}
+
+int
+tapdisk_vbd_resync_degrade(td_vbd_t *vbd, td_sector_t sec, int secs)
+{
+	struct td_vbd_resync *rs = vbd->resync;
+
+	if (!rs) {
+		rs = tapdisk_vbd_resync_create(vbd);
+		if (!rs) {
+			EPRINTF("%s: cannot track writes for resync\n",
+				vbd->name);
+			return -ENOMEM;
+		}
+		vbd->resync = rs;
+	}
+
+	if (rs->state != TD_RESYNC_DEGRADED) {
+		INFO("%s: secondary degraded, tracking writes "
+		     "(%"PRIu64" blocks dirty)\n", vbd->name,
+		     rs->copier->map.ndirty);
+		rs->state = TD_RESYNC_DEGRADED;
+		rs->stats.degraded++;
+	}
+
+	td_dirty_mark(&rs->copier->map, sec, secs);
+
+	return 0;
+}
+
+void
+tapdisk_vbd_resync_mark(td_vbd_t *vbd, td_sector_t sec, int secs)
+{
+	struct td_vbd_resync *rs = vbd->resync;
+
+	if (!rs || rs->state == TD_RESYNC_IDLE)
+		return;
+
+	if (rs->state == TD_RESYNC_DEGRADED) {
+		td_dirty_mark(&rs->copier->map, sec, secs);
+		return;
+	}
+
+	/*
+	 * Copying: the write is mirrored, so only blocks a copy may be
+	 * overwriting with older data need another pass.
+	 */
+	td_copier_mark_busy(rs->copier, sec, secs);
+}
+
+void
+tapdisk_vbd_resync_start(td_vbd_t *vbd)
+{
+	struct td_vbd_resync *rs = vbd->resync;
+	int err;
+
+	if (!rs || rs->state == TD_RESYNC_IDLE)
+		return;
+
+	if (vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR || !vbd->secondary)
+		return;
+
+	INFO("%s: resyncing secondary, %"PRIu64" blocks dirty\n",
+	     vbd->name, rs->copier->map.ndirty);
+
+	rs->state              = TD_RESYNC_COPYING;
+	rs->copier->map.cursor = 0;
+	rs->copier->budget     = 0;
+
+	err = td_copier_start(rs->copier);
+	if (err) {
+		ERR(err, "%s: failed to schedule resync\n", vbd->name);
+		rs->state = TD_RESYNC_DEGRADED;
+	}
+}
+
+int
+tapdisk_vbd_resync_busy(td_vbd_t *vbd)
+{
+	struct td_vbd_resync *rs = vbd->resync;
+
+	return rs ? td_copier_busy(rs->copier) : 0;
+}
+
+void
+tapdisk_vbd_resync_free(td_vbd_t *vbd)
+{
+	struct td_vbd_resync *rs = vbd->resync;
+
+	if (!rs)
+		return;
+
+	td_copier_destroy(rs->copier);
+	free(rs);
+	vbd->resync = NULL;
+}
+
+void
+tapdisk_vbd_resync_stats(td_vbd_t *vbd, td_stats_t *st)
+{
+	struct td_vbd_resync *rs = vbd->resync;
+	struct td_copier *c = rs->copier;
+	static const char *states[] = {
+		[TD_RESYNC_IDLE]     = "idle",
+		[TD_RESYNC_DEGRADED] = "degraded",
+		[TD_RESYNC_COPYING]  = "copying",
+	};
+
+	tapdisk_stats_field(st, "state", "s", states[rs->state]);
+	tapdisk_stats_field(st, "blocks", "llu", c->map.nbits);
+	tapdisk_stats_field(st, "dirty", "llu", c->map.ndirty);
+	tapdisk_stats_field(st, "inflight", "d", c->inflight);
+	tapdisk_stats_field(st, "rate", "llu", c->rate);
+	tapdisk_stats_field(st, "degraded", "llu", rs->stats.degraded);
+	tapdisk_stats_field(st, "passes", "llu", c->map.passes);
+	tapdisk_stats_field(st, "copied", "llu", c->stats.copied);
+	tapdisk_stats_field(st, "redirtied", "llu", c->stats.redirtied);
+	tapdisk_stats_field(st, "held", "llu", c->stats.held);
+	tapdisk_stats_field(st, "errors", "llu", c->stats.errors);
+}
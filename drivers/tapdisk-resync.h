@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TAPDISK_RESYNC_H_
+#define _TAPDISK_RESYNC_H_
+
+#include "tapdisk.h"
+#include "scheduler.h"
+
+/*
+ * Online resync of a mirror secondary. While the secondary is absent,
+ * writes are tracked in a dirty bitmap at block-log (CBT) granularity.
+ * Once a secondary is attached again, only the dirty blocks are copied
+ * over, in the background and rate limited, until both sides converge.
+ */
+
+#define TD_RESYNC_BLOCK_SHIFT        7    /* sectors: 64KiB blocks */
+#define TD_RESYNC_CHUNK_BLOCKS       16   /* at most 1MiB per copy */
+#define TD_RESYNC_MAX_INFLIGHT       4
+#define TD_RESYNC_INTERVAL_US        100000
+#define TD_RESYNC_DEFAULT_RATE       (64ULL << 20) /* bytes/s */
+
+enum td_resync_state {
+	TD_RESYNC_IDLE = 0,
+	TD_RESYNC_DEGRADED,
+	TD_RESYNC_COPYING,
+};
+
+struct td_copier;
+
+struct td_vbd_resync {
+	td_vbd_t                       *vbd;
+	enum td_resync_state            state;
+	struct td_copier               *copier;
+
+	struct {
+		unsigned long long      degraded;
+	} stats;
+};
+
+/*
+ * The secondary failed or was dropped: start (or keep) tracking writes,
+ * marking [sec, sec + secs) dirty right away.
+ */
+int tapdisk_vbd_resync_degrade(td_vbd_t *vbd, td_sector_t sec, int secs);
+
+/*
+ * Records a guest write. A no-op unless the secondary is degraded or the
+ * write overlaps a block being copied.
+ */
+void tapdisk_vbd_resync_mark(td_vbd_t *vbd, td_sector_t sec, int secs);
+
+/*
+ * Starts copying dirty blocks if a mirror secondary is attached.
+ */
+void tapdisk_vbd_resync_start(td_vbd_t *vbd);
+
+/*
+ * Returns non-zero while copies to the secondary are in flight.
+ */
+int tapdisk_vbd_resync_busy(td_vbd_t *vbd);
+
+void tapdisk_vbd_resync_free(td_vbd_t *vbd);
+
+void tapdisk_vbd_resync_stats(td_vbd_t *vbd, td_stats_t *st);
+
+#endif /* _TAPDISK_RESYNC_H_ */
@@ -33,8 +33,18 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
-#include "blktap-xenif.h"
 #include "tapdisk-ring.h"
 
 static int
@@ -43,8 +53,8 @@ tapdisk_uring_create_ctlfd(td_uring_t *ring)
 	int fd, err;
 	struct sockaddr_un saddr;
 
-	if (strnlen(ring->ctlfd_path, sizeof(saddr.sun_family)) >=
-	    sizeof(saddr.sun_family))
+	if (strnlen(ring->ctlfd_path, sizeof(saddr.sun_path)) >=
+	    sizeof(saddr.sun_path))
 		return -ENAMETOOLONG;
 
 	fd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -61,7 +71,7 @@ tapdisk_uring_create_ctlfd(td_uring_t *ring)
 		goto fail;
 	}
 
-	err = bind(fd, &saddr, sizeof(struct sockaddr_un));
+	err = bind(fd, (struct sockaddr *)&saddr, sizeof(struct sockaddr_un));
 	if (err == -1) {
 		err = -errno;
 		goto fail;
@@ -84,9 +94,11 @@ fail:
 static void
 tapdisk_uring_destroy_ctlfd(td_uring_t *ring)
 {
-	if (ring->ctlfd) {
+	tapdisk_uring_hangup(ring);
+
+	if (ring->ctlfd >= 0) {
 		close(ring->ctlfd);
-		ring->ctlfd = 0;
+		ring->ctlfd = -1;
 	}
 
 	if (ring->ctlfd_path) {
@@ -114,13 +126,13 @@ tapdisk_uring_connect_ctlfd(td_uring_t *ring)
 	saddr.sun_family = AF_UNIX;
 	memcpy(saddr.sun_path, ring->ctlfd_path, strlen(ring->ctlfd_path));
 
-	err = connect(fd, &saddr, sizeof(saddr));
+	err = connect(fd, (struct sockaddr *)&saddr, sizeof(saddr));
 	if (err == -1) {
 		err = -errno;
 		goto fail;
 	}
 
-	ring->ctlfd = fd;
+	ring->connfd = fd;
 	return 0;
 
 fail:
@@ -131,8 +143,10 @@ fail:
 static void
 tapdisk_uring_disconnect_ctlfd(td_uring_t *ring)
 {
-	if (ring->ctlfd)
-		close(ring->ctlfd);
+	if (ring->connfd >= 0) {
+		close(ring->connfd);
+		ring->connfd = -1;
+	}
 	free(ring->ctlfd_path);
 	ring->ctlfd_path = NULL;
 }
@@ -140,9 +154,10 @@ tapdisk_uring_disconnect_ctlfd(td_uring_t *ring)
 static int
 tapdisk_uring_create_shmem(td_uring_t *ring)
 {
+	td_uring_header_t *header;
 	int fd, err;
 
-	fd = shm_open(ring->shmem_path, O_CREAT | O_RDWR, 0750);
+	fd = shm_open(ring->shmem_path, O_CREAT | O_RDWR, 0600);
 	if (fd == -1)
 		return -errno;
 
@@ -160,6 +175,15 @@ tapdisk_uring_create_shmem(td_uring_t *ring)
 		goto out;
 	}
 
+	header = ring->shmem;
+	memset(header, 0, sizeof(td_uring_header_t));
+	memcpy(header->cookie, TD_URING_COOKIE, sizeof(header->cookie));
+	header->version    = TD_URING_CURRENT_VERSION;
+	header->shmem_size = ring->shmem_size;
+	header->ring_size  = ring->ring_size;
+	header->data_size  = ring->data_size;
+	header->sectors    = ring->sectors;
+
 	err = 0;
 
 out:
@@ -188,7 +212,7 @@ tapdisk_uring_connect_shmem(td_uring_t *ring)
 	int fd, err;
 	td_uring_header_t header, *p;
 
-	fd = shm_open(ring->shmem_path, O_RDWR);
+	fd = shm_open(ring->shmem_path, O_RDWR, 0);
 	if (fd == -1)
 		return -errno;
 
@@ -203,7 +227,7 @@ tapdisk_uring_connect_shmem(td_uring_t *ring)
 	munmap(p, sizeof(td_uring_header_t));
 
 	if (memcmp(header.cookie,
-		   TAPDISK_URING_COOKIE, sizeof(header.cookie))) {
+		   TD_URING_COOKIE, sizeof(header.cookie))) {
 		err = -EINVAL;
 		goto out;
 	}
@@ -213,14 +237,21 @@ tapdisk_uring_connect_shmem(td_uring_t *ring)
 		goto out;
 	}
 
+	if (header.shmem_size != sizeof(td_uring_header_t) +
+	    header.ring_size + header.data_size) {
+		err = -EINVAL;
+		goto out;
+	}
+
 	ring->ring_size  = header.ring_size;
 	ring->data_size  = header.data_size;
 	ring->shmem_size = header.shmem_size;
+	ring->sectors    = header.sectors;
 
 	ring->shmem = mmap(NULL, ring->shmem_size,
 			   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	if (ring->shmem == MAP_FAILED) {
-		rint->shmem = NULL;
+		ring->shmem = NULL;
 		err = -errno;
 		goto out;
 	}
@@ -235,38 +266,72 @@ out:
 static void
 tapdisk_uring_disconnect_shmem(td_uring_t *ring)
 {
-	if (ring->shmem)
+	if (ring->shmem) {
 		munmap(ring->shmem, ring->shmem_size);
+		ring->shmem = NULL;
+	}
 	free(ring->shmem_path);
 	ring->shmem_path = NULL;
 }
 
-int
-tapdisk_uring_create(td_uring_t *ring, const char *location,
-		    uint32_t ring_size, uint32_t data_size)
+static int
+tapdisk_uring_names(td_uring_t *ring, const char *location)
 {
-	int fd, err;
-
-	memset(ring, 0, sizeof(td_uring_t));
+	char *tmp;
+	int err;
 
-	ring->ring_size  = ring_size;
-	ring->data_size  = data_size;
-	ring->shmem_size = ring_size + data_size + sizeof(td_uring_header_t);
+	tmp = strdup(location);
+	if (!tmp)
+		return -ENOMEM;
 
-	err = asprintf(&ring->shmem_path, "%s.shm", location);
+	/* shm object names must not contain slashes */
+	err = asprintf(&ring->shmem_path, "/%s.shm", basename(tmp));
+	free(tmp);
 	if (err == -1) {
 		ring->shmem_path = NULL;
-		err = -errno;
-		goto fail;
+		return -ENOMEM;
 	}
 
 	err = asprintf(&ring->ctlfd_path, "%s.cfd", location);
 	if (err == -1) {
 		ring->ctlfd_path = NULL;
-		err = -errno;
-		goto fail;
+		return -ENOMEM;
 	}
 
+	return 0;
+}
+
+static void
+tapdisk_uring_map_areas(td_uring_t *ring)
+{
+	ring->ring_area = ring->shmem + sizeof(td_uring_header_t);
+	ring->data_area = ring->ring_area + ring->ring_size;
+}
+
+int
+tapdisk_uring_create(td_uring_t *ring, const char *location,
+		    uint32_t ring_size, uint32_t data_size, uint64_t sectors)
+{
+	int err;
+
+	memset(ring, 0, sizeof(td_uring_t));
+	ring->ctlfd  = -1;
+	ring->connfd = -1;
+
+	if (ring_size < sizeof(td_uring_sring_t) ||
+	    ring_size & (getpagesize() - 1) ||
+	    data_size & (getpagesize() - 1))
+		return -EINVAL;
+
+	ring->ring_size  = ring_size;
+	ring->data_size  = data_size;
+	ring->sectors    = sectors;
+	ring->shmem_size = ring_size + data_size + sizeof(td_uring_header_t);
+
+	err = tapdisk_uring_names(ring, location);
+	if (err)
+		goto fail;
+
 	err = tapdisk_uring_create_ctlfd(ring);
 	if (err)
 		goto fail;
@@ -275,8 +340,11 @@ tapdisk_uring_create(td_uring_t *ring, const char *location,
 	if (err)
 		goto fail;
 
-	ring->ring_area = (unsigned long)ring->shmem + sizeof(td_uring_header_t);
-	ring->data_area = (unsigned long)ring->ring_area + ring->ring_size;
+	tapdisk_uring_map_areas(ring);
+
+	SHARED_RING_INIT((td_uring_sring_t *)ring->ring_area);
+	BACK_RING_INIT(&ring->back, (td_uring_sring_t *)ring->ring_area,
+		       ring->ring_size);
 
 	return 0;
 
@@ -293,27 +361,85 @@ tapdisk_uring_destroy(td_uring_t *ring)
 	return 0;
 }
 
+/*
+ * Accepts a client on the control socket. Only one client is served at
+ * a time; the ring is reset for each new connection, the caller must
+ * make sure no requests of a previous client are still in flight and
+ * turn the client away with tapdisk_uring_reject() otherwise.
+ */
 int
-tapdisk_uring_connect(td_uring_t *ring, const char *location)
+tapdisk_uring_accept(td_uring_t *ring)
 {
-	int fd, err;
+	int fd, flags;
 
-	memset(ring, 0, sizeof(td_uring_t));
+	fd = accept(ring->ctlfd, NULL, NULL);
+	if (fd == -1)
+		return -errno;
 
-	err = asprintf(&ring->shmem_path, "%s.shm", location);
-	if (err == -1) {
-		ring->shmem_path = NULL;
-		err = -errno;
-		goto fail;
+	if (ring->connfd >= 0) {
+		close(fd);
+		return -EBUSY;
 	}
 
-	err = asprintf(&ring->ctlfd_path, "%s.cfd", location);
-	if (err == -1) {
-		ring->ctlfd_path = NULL;
-		err = -errno;
-		goto fail;
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		flags = -errno;
+		close(fd);
+		return flags;
+	}
+
+	ring->connfd = fd;
+	ring->rx_off = 0;
+	ring->tx_off = 0;
+
+	SHARED_RING_INIT((td_uring_sring_t *)ring->ring_area);
+	BACK_RING_INIT(&ring->back, (td_uring_sring_t *)ring->ring_area,
+		       ring->ring_size);
+
+	return 0;
+}
+
+/*
+ * Accepts and drops a pending client, leaving the ring untouched.
+ */
+int
+tapdisk_uring_reject(td_uring_t *ring)
+{
+	int fd;
+
+	fd = accept(ring->ctlfd, NULL, NULL);
+	if (fd == -1)
+		return -errno;
+
+	close(fd);
+	return 0;
+}
+
+void
+tapdisk_uring_hangup(td_uring_t *ring)
+{
+	if (ring->connfd >= 0) {
+		close(ring->connfd);
+		ring->connfd = -1;
 	}
 
+	ring->rx_off = 0;
+	ring->tx_off = 0;
+}
+
+int
+tapdisk_uring_connect(td_uring_t *ring, const char *location)
+{
+	int err;
+
+	memset(ring, 0, sizeof(td_uring_t));
+	ring->ctlfd  = -1;
+	ring->connfd = -1;
+
+	err = tapdisk_uring_names(ring, location);
+	if (err)
+		goto fail;
+
 	err = tapdisk_uring_connect_ctlfd(ring);
 	if (err)
 		goto fail;
@@ -322,9 +448,16 @@ tapdisk_uring_connect(td_uring_t *ring, const char *location)
 	if (err)
 		goto fail;
 
-	err = 0;
+	tapdisk_uring_map_areas(ring);
+
+	FRONT_RING_INIT(&ring->front, (td_uring_sring_t *)ring->ring_area,
+			ring->ring_size);
+
+	return 0;
 
 fail:
+	tapdisk_uring_disconnect(ring);
+	return err;
 }
 
 int
@@ -335,113 +468,145 @@ tapdisk_uring_disconnect(td_uring_t *ring)
 	return 0;
 }
 
+/*
+ * Messages are exchanged on a non-blocking socket: a message cut short
+ * by the socket buffer is kept in the ring and completed by later calls,
+ * so neither side ever waits on its peer from the event loop.
+ */
+
 static int
-tapdisk_ring_read_message(int fd, td_uring_message_t *message, int timeout)
+tapdisk_uring_flush(td_uring_t *ring)
 {
-	fd_set readfds;
-	int ret, len, offset;
-	struct timeval tv, *t;
+	int ret, len;
+
+	len = sizeof(td_uring_message_t);
+
+	while (ring->tx_off < len) {
+		ret = send(ring->connfd, (char *)&ring->tx + ring->tx_off,
+			   len - ring->tx_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return -EAGAIN;
+			ring->tx_off = 0;
+			return -errno;
+		}
+		ring->tx_off += ret;
+	}
 
-	t      = NULL;
-	offset = 0;
-	len    = sizeof(td_uring_message_t);
+	ring->tx_off = 0;
+	return 0;
+}
 
-	if (timeout) {
-		tv.tv_sec  = timeout;
-		tv.tv_usec = 0;
-		t = &tv;
-	}
+/*
+ * Drains the control socket. Returns the number of kicks received,
+ * -EAGAIN if no complete message was pending and -EIO if the peer went
+ * away.
+ */
+int
+tapdisk_uring_recv(td_uring_t *ring)
+{
+	char buf[256], *p;
+	int ret, len, n, kicks;
 
-	while (offset < len) {
-		FD_ZERO(&readfds);
-		FD_SET(fd, &readfds);
+	if (ring->connfd < 0)
+		return -ENOTCONN;
 
-		/* we don't bother reinitializing tv. at worst, it will wait a
-		 * bit more time than expected. */
+	len   = sizeof(td_uring_message_t);
+	kicks = 0;
 
-		ret = select(fd + 1, &readfds, NULL, NULL, t);
-		if (ret == -1)
-			break;
-		else if (FD_ISSET(fd, &readfds)) {
-			ret = read(fd, message + offset, len - offset);
-			if (ret <= 0)
+	for (;;) {
+		ret = recv(ring->connfd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
 				break;
-			offset += ret;
-		} else
-			break;
+			return -errno;
+		}
+
+		if (!ret)
+			return -EIO;
+
+		for (p = buf; ret > 0; p += n, ret -= n) {
+			n = len - ring->rx_off;
+			if (n > ret)
+				n = ret;
+
+			memcpy((char *)&ring->rx + ring->rx_off, p, n);
+			ring->rx_off += n;
+			if (ring->rx_off < len)
+				continue;
+
+			ring->rx_off = 0;
+			if (ring->rx.type != TD_URING_MESSAGE_KICK)
+				return -EINVAL;
+			kicks++;
+		}
 	}
 
-	if (offset != len)
-		return -EIO;
-
-	return 0;
+	return kicks ? : -EAGAIN;
 }
 
-static int
-tapdisk_ring_write_message(int fd, td_uring_message_t *message, int timeout)
+/*
+ * Waits up to @timeout seconds (0: forever) for a notification from the
+ * peer. Returns -EIO if the peer went away.
+ */
+int
+tapdisk_uring_poll(td_uring_t *ring, int timeout)
 {
-	fd_set writefds;
-	int ret, len, offset;
+	fd_set readfds;
 	struct timeval tv, *t;
+	int ret;
 
-	t      = NULL;
-	offset = 0;
-	len    = sizeof(td_uring_message_t);
-
+	t = NULL;
 	if (timeout) {
 		tv.tv_sec  = timeout;
 		tv.tv_usec = 0;
 		t = &tv;
 	}
 
-	while (offset < len) {
-		FD_ZERO(&writefds);
-		FD_SET(fd, &writefds);
+	for (;;) {
+		ret = tapdisk_uring_recv(ring);
+		if (ret != -EAGAIN)
+			return ret < 0 ? ret : 0;
+
+		FD_ZERO(&readfds);
+		FD_SET(ring->connfd, &readfds);
 
 		/* we don't bother reinitializing tv. at worst, it will wait a
 		 * bit more time than expected. */
 
-		ret = select(fd + 1, NULL, &writefds, NULL, t);
-		if (ret == -1)
-			break;
-		else if (FD_ISSET(fd, &writefds)) {
-			ret = write(fd, message + offset, len - offset);
-			if (ret <= 0)
-				break;
-			offset += ret;
-		} else
-			break;
+		ret = select(ring->connfd + 1, &readfds, NULL, NULL, t);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return -ETIMEDOUT;
 	}
-
-	if (offset != len)
-		return -EIO;
-
-	return 0;
-}
-
-int
-tapdisk_uring_poll(td_uring_t *ring)
-{
-	int err;
-	td_uring_message_t message;
-
-	err = tapdisk_uring_read_message(ring->ctlfd, &message, 1);
-	if (err)
-		return err;
-
-	if (message.type != TAPDISK_URING_MESSAGE_KICK)
-		return -EINVAL;
-
-	return 0;
 }
 
+/*
+ * Notifies the peer without blocking. A kick is only a hint to look at
+ * the ring, so when the socket buffer is full it is coalesced with the
+ * kicks the peer has yet to read: returns -EAGAIN in that case, 0 if
+ * the kick went out.
+ */
 int
 tapdisk_uring_kick(td_uring_t *ring)
 {
-	td_uring_message_t message;
+	if (ring->connfd < 0)
+		return -ENOTCONN;
+
+	/* the tail of an earlier kick still pending covers this one */
+	if (ring->tx_off)
+		return tapdisk_uring_flush(ring);
 
-	memset(&message, 0, sizeof(td_uring_message_t));
-	message.type = TAPDISK_URING_MESSAGE_KICK;
+	memset(&ring->tx, 0, sizeof(td_uring_message_t));
+	ring->tx.type = TD_URING_MESSAGE_KICK;
 
-	return tapdisk_uring_write_message(ring->ctlfd, &message, 1);
+	return tapdisk_uring_flush(ring);
 }
@@ -33,23 +33,41 @@
 
 #include <inttypes.h>
 
+#include "blktap.h"
+#include "blktap-xenif.h"
 #include <xen/io/ring.h>
 
+/*
+ * A shared-memory request ring for local (non-Xen) clients.
+ *
+ * The server creates a POSIX shared memory object holding a header page,
+ * the request ring and a data area, and listens on a UNIX control socket
+ * used for notifications. Clients address their I/O buffers by offset
+ * into the data area, which they manage themselves.
+ *
+ * Both names are derived from a single location: the control socket is
+ * <location>.cfd, the shared memory object is /<basename(location)>.shm.
+ * tapdisk serves VBDs at TD_URING_PATH<pid>.<minor>.
+ */
+
+#define TD_URING_PATH               BLKTAP2_CONTROL_DIR"/uring"
+#define TD_URING_COOKIE             "tduring"
+#define TD_URING_CURRENT_VERSION    1
+
+#define TD_URING_MESSAGE_KICK       1
+
+#define TD_URING_OP_READ            0
+#define TD_URING_OP_WRITE           1
+
+#define TD_URING_RSP_OKAY           0
+#define TD_URING_RSP_ERROR          1
+#define TD_URING_RSP_EOPNOTSUPP     2
+
 typedef struct td_uring             td_uring_t;
 typedef struct td_uring_header      td_uring_header_t;
 typedef struct td_uring_request     td_uring_request_t;
 typedef struct td_uring_response    td_uring_response_t;
-
-struct td_uring {
-	int                         ctlfd;
-
-	char                       *shmem_path;
-	char                       *ctlfd_path;
-
-	void                       *shmem;
-	void                       *ring_area;
-	void                       *data_area;
-};
+typedef struct td_uring_message     td_uring_message_t;
 
 struct td_uring_header {
 	char                        cookie[8];
@@ -57,6 +75,7 @@ struct td_uring_header {
 	uint32_t                    shmem_size;
 	uint32_t                    ring_size;
 	uint32_t                    data_size;
+	uint64_t                    sectors;
 	char                        reserved[4064];
 };
 
@@ -74,16 +93,53 @@ struct td_uring_response {
 	uint8_t                     status;
 };
 
+struct td_uring_message {
+	uint8_t                     type;
+};
+
 DEFINE_RING_TYPES(td_uring, td_uring_request_t, td_uring_response_t);
 
+struct td_uring {
+	int                         ctlfd;     /* listening socket (server) */
+	int                         connfd;    /* connected peer */
+
+	td_uring_message_t          rx;        /* partially received */
+	int                         rx_off;
+	td_uring_message_t          tx;        /* partially sent */
+	int                         tx_off;
+
+	char                       *shmem_path;
+	char                       *ctlfd_path;
+
+	uint32_t                    shmem_size;
+	uint32_t                    ring_size;
+	uint32_t                    data_size;
+	uint64_t                    sectors;   /* size of the disk */
+
+	void                       *shmem;
+	void                       *ring_area;
+	void                       *data_area;
+
+	union {
+		td_uring_front_ring_t front;
+		td_uring_back_ring_t  back;
+	};
+};
+
 int tapdisk_uring_create(td_uring_t *, const char *location,
-			uint32_t ring_size, uint32_t data_size);
+			uint32_t ring_size, uint32_t data_size,
+			uint64_t sectors);
 int tapdisk_uring_destroy(td_uring_t *);
 
+int tapdisk_uring_accept(td_uring_t *);
+int tapdisk_uring_reject(td_uring_t *);
+void tapdisk_uring_hangup(td_uring_t *);
+
 int tapdisk_uring_connect(td_uring_t *, const char *location);
 int tapdisk_uring_disconnect(td_uring_t *);
 
-int tapdisk_uring_poll(td_uring_t *);
+int tapdisk_uring_recv(td_uring_t *);
+int tapdisk_uring_poll(td_uring_t *, int timeout);
 int tapdisk_uring_kick(td_uring_t *);
 
 #endif
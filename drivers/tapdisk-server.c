@@ -76,6 +76,7 @@ typedef struct tapdisk_server {
 	char                        *name;
 	char                        *ident;
 	int                          facility;
+	int                          io_class;
 
 	/* Memory mode state */
 	struct {
@@ -166,6 +167,7 @@ tapdisk_server_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t
 	long long offset, td_queue_callback_t cb, void *arg)
 {
 	server.rw_backend->prep(tiocb, fd, rw, buf, size, offset, cb, arg);
+	tiocb->io_class = server.io_class;
 }
 
 void
@@ -179,6 +181,16 @@ tapdisk_server_prep_tiocb_ro(struct tiocb *tiocb, int fd, int rw, char *buf, siz
 	long long offset, td_queue_callback_t cb, void *arg)
 {
 	server.ro_backend->prep(tiocb, fd, rw, buf, size, offset, cb, arg);
+	tiocb->io_class = server.io_class;
+}
+
+int
+tapdisk_server_set_io_class(int io_class)
+{
+	int prev = server.io_class;
+
+	server.io_class = io_class;
+	return prev;
 }
 
 void
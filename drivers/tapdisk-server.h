@@ -72,6 +72,13 @@ void tapdisk_server_queue_tiocb(struct tiocb *);
 void tapdisk_server_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 	long long, td_queue_callback_t, void *);
 
+/*
+ * Sets the request class stamped on tiocbs prepared from now on, and
+ * returns the previous one. Whoever dispatches on behalf of a request
+ * sets it for the duration.
+ */
+int tapdisk_server_set_io_class(int);
+
 void tapdisk_server_check_state(void);
 
 event_id_t tapdisk_server_register_event(char, int, struct timeval, event_cb_t, void *);
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Group commit for buffered images, see tapdisk-syncer.h.
+ *
+ * The fdatasync itself is synchronous: it runs from a zero timeout
+ * event, after the completions reaped in this pass of the event loop
+ * have all been parked, and blocks the loop while it lasts. Everything
+ * that completed meanwhile rides along with the next one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "tapdisk.h"
+#include "util.h"
+#include "tapdisk-log.h"
+#include "tapdisk-server.h"
+#include "tapdisk-syncer.h"
+#include "timeout-math.h"
+
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+static const char *td_io_mode_names[] = {
+	[TD_IO_MODE_DIRECT]   = "direct",
+	[TD_IO_MODE_DSYNC]    = "dsync",
+	[TD_IO_MODE_BUFFERED] = "buffered",
+};
+
+const char *
+td_io_mode_name(enum td_io_mode mode)
+{
+	if (mode < 0 || mode >= ARRAY_SIZE(td_io_mode_names))
+		return "unknown";
+
+	return td_io_mode_names[mode];
+}
+
+void
+td_syncer_init(struct td_syncer *syncer, int fd, int group_commit)
+{
+	int flags;
+
+	memset(syncer, 0, sizeof(*syncer));
+	syncer->fd    = fd;
+	syncer->event = -1;
+	INIT_LIST_HEAD(&syncer->waiters);
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || (flags & O_DIRECT))
+		syncer->mode = TD_IO_MODE_DIRECT;
+	else if ((flags & O_DSYNC) == O_DSYNC)
+		syncer->mode = TD_IO_MODE_DSYNC;
+	else
+		syncer->mode = TD_IO_MODE_BUFFERED;
+
+	syncer->group_commit =
+		group_commit && syncer->mode == TD_IO_MODE_BUFFERED;
+}
+
+static void
+td_syncer_flush(struct td_syncer *syncer)
+{
+	struct td_sync_waiter *waiter, *next;
+	struct list_head batch;
+	struct timeval t0, t1, diff;
+	unsigned long long us;
+	int err;
+
+	if (syncer->dirty && !syncer->error) {
+		gettimeofday(&t0, NULL);
+
+		err = fdatasync(syncer->fd);
+		if (err) {
+			err = -errno;
+			ERR(err, "fdatasync failed, failing %d writes and "
+			    "all further ones\n", syncer->pending);
+			syncer->error = err;
+		}
+
+		gettimeofday(&t1, NULL);
+		TV_SUB(t1, t0, diff);
+		us = diff.tv_sec * 1000000ULL + diff.tv_usec;
+
+		syncer->syncs++;
+		syncer->sync_us += us;
+		if (us > syncer->max_sync_us)
+			syncer->max_sync_us = us;
+	}
+
+	syncer->dirty   = 0;
+	syncer->pending = 0;
+
+	/*
+	 * Callbacks may well issue more writes; those park on the
+	 * syncer's list, for the next batch.
+	 */
+	INIT_LIST_HEAD(&batch);
+	list_splice(&syncer->waiters, &batch);
+	INIT_LIST_HEAD(&syncer->waiters);
+
+	list_for_each_entry_safe(waiter, next, &batch, entry) {
+		list_del(&waiter->entry);
+		waiter->cb(waiter, syncer->error);
+	}
+}
+
+static void
+__td_syncer_run(event_id_t id, char mode, void *private)
+{
+	struct td_syncer *syncer = private;
+
+	tapdisk_server_unregister_event(syncer->event);
+	syncer->event = -1;
+
+	td_syncer_flush(syncer);
+}
+
+void
+td_syncer_complete(struct td_syncer *syncer, struct td_sync_waiter *waiter,
+		   td_sync_cb_t cb, off_t off, size_t len, int err)
+{
+	event_id_t id;
+
+	if (!syncer->group_commit || err) {
+		cb(waiter, err);
+		return;
+	}
+
+	if (syncer->error) {
+		cb(waiter, syncer->error);
+		return;
+	}
+
+	/*
+	 * Get writeback going while the batch fills up; whatever this
+	 * fails on, the fdatasync will report.
+	 */
+	sync_file_range(syncer->fd, off, len, SYNC_FILE_RANGE_WRITE);
+
+	waiter->cb = cb;
+	list_add_tail(&waiter->entry, &syncer->waiters);
+	syncer->dirty = 1;
+	syncer->writes++;
+	if (++syncer->pending > syncer->max_batch)
+		syncer->max_batch = syncer->pending;
+
+	if (syncer->event >= 0)
+		return;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1,
+					   TV_ZERO, __td_syncer_run, syncer);
+	if (id < 0) {
+		ERR(id, "failed to schedule a sync, syncing inline\n");
+		td_syncer_flush(syncer);
+		return;
+	}
+
+	syncer->event = id;
+}
+
+void
+td_syncer_close(struct td_syncer *syncer)
+{
+	if (syncer->event >= 0) {
+		tapdisk_server_unregister_event(syncer->event);
+		syncer->event = -1;
+	}
+
+	if (!list_empty(&syncer->waiters) || syncer->dirty)
+		td_syncer_flush(syncer);
+}
+
+void
+td_syncer_stats(struct td_syncer *syncer, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "mode", "s", td_io_mode_name(syncer->mode));
+	tapdisk_stats_field(st, "group_commit", "d", syncer->group_commit);
+	tapdisk_stats_field(st, "error", "d", syncer->error);
+	tapdisk_stats_field(st, "syncs", "llu", syncer->syncs);
+	tapdisk_stats_field(st, "writes", "llu", syncer->writes);
+	tapdisk_stats_field(st, "pending", "d", syncer->pending);
+	tapdisk_stats_field(st, "max_batch", "u", syncer->max_batch);
+	tapdisk_stats_field(st, "sync_us", "llu", syncer->sync_us);
+	tapdisk_stats_field(st, "max_sync_us", "llu", syncer->max_sync_us);
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TAPDISK_SYNCER_H_
+#define _TAPDISK_SYNCER_H_
+
+#include <sys/types.h>
+
+#include "list.h"
+#include "scheduler.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Group commit for images opened without O_DIRECT. Writes land in the
+ * page cache and are only acknowledged once an fdatasync issued after
+ * their completion has returned, so every acknowledged write is stable,
+ * as it would be with O_DSYNC. All writes completing in the same pass of
+ * the event loop share one fdatasync, and each completion starts
+ * writeback of its range straight away.
+ *
+ * A failed fdatasync fails its whole batch, and every write after it:
+ * once the page cache has dropped dirty pages, nothing later can be
+ * known to be stable.
+ */
+
+enum td_io_mode {
+	TD_IO_MODE_DIRECT = 0,   /* O_DIRECT */
+	TD_IO_MODE_DSYNC,        /* O_DSYNC, every write is a stable write */
+	TD_IO_MODE_BUFFERED,     /* page cache, batched fdatasync */
+};
+
+struct td_sync_waiter;
+
+typedef void (*td_sync_cb_t)(struct td_sync_waiter *, int err);
+
+struct td_sync_waiter {
+	struct list_head                entry;
+	td_sync_cb_t                    cb;
+};
+
+struct td_syncer {
+	int                             fd;
+	enum td_io_mode                 mode;
+	int                             group_commit;
+	int                             error;
+
+	event_id_t                      event;
+	struct list_head                waiters;
+	int                             pending;
+	int                             dirty;
+
+	unsigned long long              syncs;
+	unsigned long long              writes;
+	unsigned int                    max_batch;
+	unsigned long long              sync_us;
+	unsigned long long              max_sync_us;
+};
+
+/**
+ * Sets up @syncer for @fd. The mode is read from the file status flags,
+ * so a libvhd O_DSYNC fallback shows up as such. Writes are only held
+ * back for a sync with @group_commit set and a buffered @fd; caches
+ * opened without O_DIRECT on purpose leave it clear.
+ */
+void td_syncer_init(struct td_syncer *syncer, int fd, int group_commit);
+
+/**
+ * Syncs whatever is still dirty and drops the event, if any. There must
+ * be no waiters left.
+ */
+void td_syncer_close(struct td_syncer *syncer);
+
+/**
+ * Hands a completed write of @len bytes at @off to the syncer: @cb runs
+ * once it is stable, or right away if the file is not buffered or the
+ * write failed (@err).
+ */
+void td_syncer_complete(struct td_syncer *syncer,
+			struct td_sync_waiter *waiter, td_sync_cb_t cb,
+			off_t off, size_t len, int err);
+
+static inline int
+td_syncer_buffered(const struct td_syncer *syncer)
+{
+	return syncer->group_commit;
+}
+
+const char *td_io_mode_name(enum td_io_mode mode);
+
+void td_syncer_stats(struct td_syncer *syncer, td_stats_t *st);
+
+#endif /* _TAPDISK_SYNCER_H_ */
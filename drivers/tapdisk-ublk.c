@@ -0,0 +1,998 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * ublk frontend. The ublk driver queues block requests into a shared
+ * descriptor array per hardware queue, and hands them to us by
+ * completing a FETCH_REQ URING_CMD for the request's tag. We answer with
+ * COMMIT_AND_FETCH_REQ, which completes the block request and re-arms
+ * the tag in one go. Data is staged in a per-tag buffer the driver
+ * copies to and from.
+ *
+ * There is no liburing dependency, the few io_uring operations needed
+ * are done on the raw rings.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-ublk.h"
+#include "timeout-math.h"
+
+#define BUG_ON(_cond)    if (unlikely(_cond)) { td_panic(); }
+
+#define DBG(_f, _a...)       tlog_syslog(TLOG_DBG, _f, ##_a)
+#define INFO(_f, _a...)      tlog_syslog(TLOG_INFO, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+#ifdef HAVE_LINUX_UBLK_CMD_H
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/ublk_cmd.h>
+
+/*
+ * Newer kernels may be built without the legacy opcodes, older ones only
+ * know those. Go with whatever the uapi headers we build against offer.
+ */
+#ifdef UBLK_U_CMD_ADD_DEV
+#define TD_UBLK_CMD_ADD_DEV         UBLK_U_CMD_ADD_DEV
+#define TD_UBLK_CMD_DEL_DEV         UBLK_U_CMD_DEL_DEV
+#define TD_UBLK_CMD_START_DEV       UBLK_U_CMD_START_DEV
+#define TD_UBLK_CMD_STOP_DEV        UBLK_U_CMD_STOP_DEV
+#define TD_UBLK_CMD_SET_PARAMS      UBLK_U_CMD_SET_PARAMS
+#define TD_UBLK_IO_FETCH_REQ        UBLK_U_IO_FETCH_REQ
+#define TD_UBLK_IO_COMMIT_AND_FETCH UBLK_U_IO_COMMIT_AND_FETCH_REQ
+#define TD_UBLK_DEV_FLAGS           UBLK_F_CMD_IOCTL_ENCODE
+#else
+#define TD_UBLK_CMD_ADD_DEV         UBLK_CMD_ADD_DEV
+#define TD_UBLK_CMD_DEL_DEV         UBLK_CMD_DEL_DEV
+#define TD_UBLK_CMD_START_DEV       UBLK_CMD_START_DEV
+#define TD_UBLK_CMD_STOP_DEV        UBLK_CMD_STOP_DEV
+#define TD_UBLK_CMD_SET_PARAMS      UBLK_CMD_SET_PARAMS
+#define TD_UBLK_IO_FETCH_REQ        UBLK_IO_FETCH_REQ
+#define TD_UBLK_IO_COMMIT_AND_FETCH UBLK_IO_COMMIT_AND_FETCH_REQ
+#define TD_UBLK_DEV_FLAGS           0
+#endif
+
+#ifndef UBLK_IO_OP_READ
+#define UBLK_IO_OP_READ             0
+#define UBLK_IO_OP_WRITE            1
+#define UBLK_IO_OP_FLUSH            2
+#endif
+
+#define MAX(a, b)                   ((a) > (b) ? (a) : (b))
+
+#define TD_UBLK_PAGE_ALIGN(_x) \
+	(((_x) + getpagesize() - 1) & ~((size_t)getpagesize() - 1))
+
+struct td_ublk_ring {
+	int                     fd;
+	unsigned int            entries;
+	size_t                  sqe_size;
+
+	unsigned int           *sq_head;
+	unsigned int           *sq_tail;
+	unsigned int           *sq_mask;
+	unsigned int           *sq_array;
+	unsigned int            sq_tail_pvt;
+	void                   *sqes;
+
+	unsigned int           *cq_head;
+	unsigned int           *cq_tail;
+	unsigned int           *cq_mask;
+	struct io_uring_cqe    *cqes;
+
+	void                   *sq_ring;
+	size_t                  sq_ring_len;
+	void                   *cq_ring;
+	size_t                  cq_ring_len;
+	size_t                  sqes_len;
+};
+
+typedef struct td_ublk_queue td_ublk_queue_t;
+typedef struct td_ublk_req td_ublk_req_t;
+
+struct td_ublk_req {
+	td_vbd_request_t        vreq;
+	struct td_iovec         iov;
+	td_ublk_queue_t        *q;
+	int                     tag;
+	char                    name[32];
+
+	/* order of arrival on the queue */
+	unsigned long long      seq;
+	int                     busy;
+	int                     flush;
+};
+
+struct td_ublk_queue {
+	td_ublk_t              *ublk;
+	int                     q_id;
+
+	struct td_ublk_ring     ring;
+	event_id_t              event;
+
+	struct ublksrv_io_desc *iods;
+	size_t                  iods_len;
+	char                   *bufs;
+	td_ublk_req_t          *reqs;
+
+	/* URING_CMDs held by the driver */
+	int                     cmds;
+	/* requests queued on the VBD */
+	int                     busy;
+	/* flushes waiting for requests before them */
+	int                     flushes;
+	unsigned long long      seq;
+};
+
+struct td_ublk {
+	td_vbd_t               *vbd;
+	int                     dev_id;
+	int                     nr_queues;
+	int                     depth;
+	size_t                  buf_size;
+
+	int                     ctrl_fd;
+	struct td_ublk_ring     ctrl;
+	event_id_t              ctrl_event;
+	int                     ctrl_pending;
+	int                     ctrl_result;
+
+	int                     cdev_fd;
+	int                     added;
+	int                     started;
+	int                     stopping;
+
+	td_ublk_queue_t        *queues;
+
+	struct {
+		unsigned long long  in;
+		unsigned long long  out;
+		unsigned long long  errors;
+		unsigned long long  submits;
+	} stats;
+};
+
+static void
+td_ublk_ring_exit(struct td_ublk_ring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_len);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+static int
+td_ublk_ring_init(struct td_ublk_ring *ring, unsigned int entries,
+		  unsigned int flags)
+{
+	struct io_uring_params p;
+	void *ptr;
+	int err;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	p.flags = flags;
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		err = -errno;
+		ring->fd = -1;
+		return err;
+	}
+
+	ring->entries     = p.sq_entries;
+	ring->sqe_size    = sizeof(struct io_uring_sqe);
+	if (flags & IORING_SETUP_SQE128)
+		ring->sqe_size *= 2;
+
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len    = p.sq_entries * ring->sqe_size;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_len = ring->cq_ring_len =
+			MAX(ring->sq_ring_len, ring->cq_ring_len);
+
+	ptr = mmap(NULL, ring->sq_ring_len, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ring->sq_ring = ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else {
+		ptr = mmap(NULL, ring->cq_ring_len, PROT_READ|PROT_WRITE,
+			   MAP_SHARED|MAP_POPULATE, ring->fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto fail;
+		ring->cq_ring = ptr;
+	}
+
+	ptr = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ring->sqes = ptr;
+
+	ring->sq_head  = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail  = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask  = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head  = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail  = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask  = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes     = ring->cq_ring + p.cq_off.cqes;
+
+	ring->sq_tail_pvt = *ring->sq_tail;
+
+	return 0;
+
+fail:
+	err = -errno;
+	td_ublk_ring_exit(ring);
+	return err;
+}
+
+static struct io_uring_sqe *
+td_ublk_ring_get_sqe(struct td_ublk_ring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, idx;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_tail_pvt - head >= ring->entries)
+		return NULL;
+
+	idx = ring->sq_tail_pvt & *ring->sq_mask;
+	sqe = ring->sqes + idx * ring->sqe_size;
+	memset(sqe, 0, ring->sqe_size);
+
+	ring->sq_array[idx] = idx;
+	ring->sq_tail_pvt++;
+
+	return sqe;
+}
+
+/*
+ * Publishes queued SQEs, and optionally blocks for one completion.
+ * Returns the number of SQEs handed to the kernel.
+ */
+static int
+td_ublk_ring_submit(struct td_ublk_ring *ring, int wait)
+{
+	unsigned int pending, flags;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_tail_pvt, __ATOMIC_RELEASE);
+
+	pending = ring->sq_tail_pvt -
+		__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (!pending && !wait)
+		return 0;
+
+	flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, pending,
+			      wait ? 1 : 0, flags, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : ret;
+}
+
+static struct io_uring_cqe *
+td_ublk_ring_peek_cqe(struct td_ublk_ring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+static void
+td_ublk_ring_cqe_seen(struct td_ublk_ring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static void
+tapdisk_ublk_ctrl_reap(td_ublk_t *ublk)
+{
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = td_ublk_ring_peek_cqe(&ublk->ctrl))) {
+		ublk->ctrl_result  = cqe->res;
+		ublk->ctrl_pending = 0;
+		td_ublk_ring_cqe_seen(&ublk->ctrl);
+	}
+}
+
+static void
+tapdisk_ublk_ctrl_event(event_id_t id, char mode, void *data)
+{
+	tapdisk_ublk_ctrl_reap(data);
+}
+
+/*
+ * START_DEV and STOP_DEV only return once the driver is done with the
+ * disk, which includes partition scans and draining I/O: we must keep
+ * serving our queues meanwhile. Those are issued @async, and waited for
+ * from the event loop.
+ */
+static int
+tapdisk_ublk_ctrl_cmd(td_ublk_t *ublk, unsigned int op,
+		      void *buf, size_t len, uint64_t data, int async)
+{
+	struct ublksrv_ctrl_cmd *cmd;
+	struct io_uring_sqe *sqe;
+	int err;
+
+	sqe = td_ublk_ring_get_sqe(&ublk->ctrl);
+	if (!sqe)
+		return -EBUSY;
+
+	sqe->opcode    = IORING_OP_URING_CMD;
+	sqe->fd        = ublk->ctrl_fd;
+	sqe->cmd_op    = op;
+	sqe->user_data = op;
+
+	cmd            = (struct ublksrv_ctrl_cmd *)sqe->cmd;
+	cmd->dev_id    = ublk->dev_id;
+	cmd->queue_id  = (__u16)-1;
+	cmd->addr      = (uintptr_t)buf;
+	cmd->len       = len;
+	cmd->data[0]   = data;
+
+	ublk->ctrl_pending = 1;
+
+	err = td_ublk_ring_submit(&ublk->ctrl, !async);
+	if (err < 0) {
+		ublk->ctrl_pending = 0;
+		return err;
+	}
+
+	if (async)
+		while (ublk->ctrl_pending)
+			tapdisk_server_iterate();
+	else
+		tapdisk_ublk_ctrl_reap(ublk);
+
+	return ublk->ctrl_pending ? -EIO : ublk->ctrl_result;
+}
+
+static int
+tapdisk_ublk_submit(td_ublk_queue_t *q)
+{
+	int err;
+
+	err = td_ublk_ring_submit(&q->ring, 0);
+	if (err > 0)
+		q->ublk->stats.submits++;
+	if (err < 0)
+		ERR(err, "ublk %d queue %d: submit failed\n",
+		    q->ublk->dev_id, q->q_id);
+
+	return err;
+}
+
+static void
+tapdisk_ublk_queue_cmd(td_ublk_queue_t *q, unsigned int op, int tag,
+		       int result)
+{
+	struct ublksrv_io_cmd *cmd;
+	struct io_uring_sqe *sqe;
+
+	/* one SQE per tag at most, and the ring has a slot per tag */
+	sqe = td_ublk_ring_get_sqe(&q->ring);
+	BUG_ON(!sqe);
+
+	sqe->opcode    = IORING_OP_URING_CMD;
+	sqe->fd        = q->ublk->cdev_fd;
+	sqe->cmd_op    = op;
+	sqe->user_data = tag;
+
+	cmd            = (struct ublksrv_io_cmd *)sqe->cmd;
+	cmd->q_id      = q->q_id;
+	cmd->tag       = tag;
+	cmd->result    = result;
+	cmd->addr      = (uintptr_t)(q->bufs + tag * q->ublk->buf_size);
+
+	q->cmds++;
+}
+
+static void
+tapdisk_ublk_commit(td_ublk_queue_t *q, int tag, int result)
+{
+	td_ublk_t *ublk = q->ublk;
+
+	if (result < 0)
+		ublk->stats.errors++;
+	ublk->stats.out++;
+
+	tapdisk_ublk_queue_cmd(q, TD_UBLK_IO_COMMIT_AND_FETCH, tag, result);
+}
+
+/*
+ * Writes complete once they are stable, so a flush need only wait for
+ * the requests which reached the queue before it, as a blkif barrier
+ * does. Requests after it go ahead meanwhile.
+ */
+static void
+tapdisk_ublk_complete_flushes(td_ublk_queue_t *q)
+{
+	unsigned long long oldest = q->seq;
+	td_ublk_req_t *req;
+	int tag;
+
+	for (tag = 0; tag < q->ublk->depth; tag++) {
+		req = &q->reqs[tag];
+		if (req->busy && req->seq < oldest)
+			oldest = req->seq;
+	}
+
+	for (tag = 0; tag < q->ublk->depth; tag++) {
+		req = &q->reqs[tag];
+		if (req->flush && req->seq < oldest) {
+			req->flush = 0;
+			q->flushes--;
+			tapdisk_ublk_commit(q, tag, 0);
+		}
+	}
+}
+
+static void
+__tapdisk_ublk_request_cb(td_vbd_request_t *vreq, int error,
+			  void *token, int final)
+{
+	td_ublk_req_t *req = container_of(vreq, td_ublk_req_t, vreq);
+	td_ublk_queue_t *q = token;
+	int result;
+
+	q->busy--;
+	req->busy = 0;
+
+	/* the driver wants the byte count on success */
+	result = error ? error : req->iov.secs << SECTOR_SHIFT;
+	tapdisk_ublk_commit(q, req->tag, result);
+
+	if (q->flushes)
+		tapdisk_ublk_complete_flushes(q);
+
+	if (final)
+		tapdisk_ublk_submit(q);
+}
+
+static int
+tapdisk_ublk_parse_request(td_ublk_queue_t *q, td_ublk_req_t *req,
+			   const struct ublksrv_io_desc *iod)
+{
+	td_vbd_request_t *vreq = &req->vreq;
+	td_ublk_t *ublk = q->ublk;
+	uint64_t end;
+	int op;
+
+	switch (ublksrv_get_op(iod)) {
+	case UBLK_IO_OP_READ:
+		op = TD_OP_READ;
+		break;
+	case UBLK_IO_OP_WRITE:
+		op = TD_OP_WRITE;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	if (!iod->nr_sectors ||
+	    iod->nr_sectors > ublk->buf_size >> SECTOR_SHIFT)
+		return -EINVAL;
+
+	end = iod->start_sector + iod->nr_sectors;
+	if (end > ublk->vbd->disk_info.size || end < iod->start_sector)
+		return -EINVAL;
+
+	snprintf(req->name, sizeof(req->name),
+		 "ublk-%d.%d.%d", ublk->dev_id, q->q_id, req->tag);
+
+	req->iov.base  = q->bufs + req->tag * ublk->buf_size;
+	req->iov.secs  = iod->nr_sectors;
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op       = op;
+	vreq->sec      = iod->start_sector;
+	vreq->iov      = &req->iov;
+	vreq->iovcnt   = 1;
+	vreq->name     = req->name;
+	vreq->token    = q;
+	vreq->cb       = __tapdisk_ublk_request_cb;
+	vreq->io_class = TD_VREQ_CLASS_FG;
+
+	return 0;
+}
+
+static void
+tapdisk_ublk_get_request(td_ublk_queue_t *q, int tag)
+{
+	const struct ublksrv_io_desc *iod = &q->iods[tag];
+	td_ublk_req_t *req = &q->reqs[tag];
+	td_ublk_t *ublk = q->ublk;
+	int err;
+
+	ublk->stats.in++;
+	req->seq = q->seq++;
+
+	if (ublksrv_get_op(iod) == UBLK_IO_OP_FLUSH) {
+		req->flush = 1;
+		q->flushes++;
+		tapdisk_ublk_complete_flushes(q);
+		return;
+	}
+
+	err = tapdisk_ublk_parse_request(q, req, iod);
+	if (!err) {
+		q->busy++;
+		req->busy = 1;
+		err = tapdisk_vbd_queue_request(ublk->vbd, &req->vreq);
+		if (err) {
+			q->busy--;
+			req->busy = 0;
+		}
+	}
+	if (err)
+		tapdisk_ublk_commit(q, tag, err);
+}
+
+static void
+tapdisk_ublk_queue_event(event_id_t id, char mode, void *data)
+{
+	td_ublk_queue_t *q = data;
+	struct io_uring_cqe *cqe;
+	int tag, res;
+
+	while ((cqe = td_ublk_ring_peek_cqe(&q->ring))) {
+		tag = cqe->user_data;
+		res = cqe->res;
+		td_ublk_ring_cqe_seen(&q->ring);
+
+		q->cmds--;
+
+		if (res == UBLK_IO_RES_OK) {
+			tapdisk_ublk_get_request(q, tag);
+			continue;
+		}
+
+		/* the device is going away, the tag stays unarmed */
+		if (res != UBLK_IO_RES_ABORT)
+			ERR(res, "ublk %d queue %d tag %d: command failed\n",
+			    q->ublk->dev_id, q->q_id, tag);
+	}
+
+	tapdisk_ublk_submit(q);
+}
+
+static void
+tapdisk_ublk_queue_free(td_ublk_queue_t *q)
+{
+	if (q->event >= 0) {
+		tapdisk_server_unregister_event(q->event);
+		q->event = -1;
+	}
+
+	/* closing the ring cancels the commands the driver still holds */
+	td_ublk_ring_exit(&q->ring);
+
+	if (q->iods) {
+		munmap(q->iods, q->iods_len);
+		q->iods = NULL;
+	}
+
+	free(q->bufs);
+	q->bufs = NULL;
+
+	free(q->reqs);
+	q->reqs = NULL;
+}
+
+static int
+tapdisk_ublk_queue_init(td_ublk_t *ublk, td_ublk_queue_t *q, int q_id)
+{
+	size_t stride;
+	off_t offset;
+	void *ptr;
+	int i, err;
+
+	q->ublk  = ublk;
+	q->q_id  = q_id;
+	q->event = -1;
+
+	err = td_ublk_ring_init(&q->ring, ublk->depth, 0);
+	if (err)
+		goto fail;
+
+	stride      = TD_UBLK_PAGE_ALIGN(UBLK_MAX_QUEUE_DEPTH *
+					 sizeof(struct ublksrv_io_desc));
+	offset      = UBLKSRV_CMD_BUF_OFFSET + q_id * stride;
+	q->iods_len = TD_UBLK_PAGE_ALIGN(ublk->depth *
+					 sizeof(struct ublksrv_io_desc));
+
+	ptr = mmap(NULL, q->iods_len, PROT_READ,
+		   MAP_SHARED|MAP_POPULATE, ublk->cdev_fd, offset);
+	if (ptr == MAP_FAILED) {
+		err = -errno;
+		goto fail;
+	}
+	q->iods = ptr;
+
+	err = posix_memalign(&ptr, getpagesize(),
+			     ublk->depth * ublk->buf_size);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+	q->bufs = ptr;
+
+	q->reqs = calloc(ublk->depth, sizeof(td_ublk_req_t));
+	if (!q->reqs) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	q->event = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						 q->ring.fd, TV_ZERO,
+						 tapdisk_ublk_queue_event, q);
+	if (q->event < 0) {
+		err = q->event;
+		q->event = -1;
+		goto fail;
+	}
+
+	for (i = 0; i < ublk->depth; i++) {
+		q->reqs[i].q   = q;
+		q->reqs[i].tag = i;
+		tapdisk_ublk_queue_cmd(q, TD_UBLK_IO_FETCH_REQ, i, 0);
+	}
+
+	err = tapdisk_ublk_submit(q);
+	if (err < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	ERR(err, "ublk %d: failed to set up queue %d\n", ublk->dev_id, q_id);
+	tapdisk_ublk_queue_free(q);
+	return err;
+}
+
+/* the char device shows up asynchronously, through udev */
+static int
+tapdisk_ublk_open_cdev(td_ublk_t *ublk)
+{
+	char path[64];
+	int i;
+
+	snprintf(path, sizeof(path), TD_UBLK_CHAR_PATH"%d", ublk->dev_id);
+
+	for (i = 0; i < 100; i++) {
+		ublk->cdev_fd = open(path, O_RDWR);
+		if (ublk->cdev_fd >= 0)
+			return 0;
+		if (errno != ENOENT)
+			break;
+		usleep(10000);
+	}
+
+	ublk->cdev_fd = -1;
+	return -errno;
+}
+
+static int
+tapdisk_ublk_add(td_ublk_t *ublk)
+{
+	struct ublksrv_ctrl_dev_info info;
+	struct ublk_params params;
+	td_disk_info_t *disk = &ublk->vbd->disk_info;
+	int err;
+
+	memset(&info, 0, sizeof(info));
+	info.nr_hw_queues     = ublk->nr_queues;
+	info.queue_depth      = ublk->depth;
+	info.max_io_buf_bytes = ublk->buf_size;
+	info.dev_id           = ublk->dev_id;
+	info.ublksrv_pid      = getpid();
+	info.flags            = TD_UBLK_DEV_FLAGS;
+
+	err = tapdisk_ublk_ctrl_cmd(ublk, TD_UBLK_CMD_ADD_DEV,
+				    &info, sizeof(info), 0, 0);
+	if (err) {
+		ERR(err, "failed to add ublk device\n");
+		return err;
+	}
+
+	ublk->dev_id = info.dev_id;
+	ublk->added  = 1;
+
+	memset(&params, 0, sizeof(params));
+	params.len                     = sizeof(params);
+	params.types                   = UBLK_PARAM_TYPE_BASIC;
+	params.basic.logical_bs_shift  = ffs(disk->sector_size) - 1;
+	params.basic.physical_bs_shift = 12;
+	params.basic.io_opt_shift      = 12;
+	params.basic.io_min_shift      = ffs(disk->sector_size) - 1;
+	params.basic.max_sectors       = ublk->buf_size >> SECTOR_SHIFT;
+	params.basic.dev_sectors       = disk->size;
+	if (td_flag_test(ublk->vbd->flags, TD_OPEN_RDONLY))
+		params.basic.attrs    |= UBLK_ATTR_READ_ONLY;
+
+	err = tapdisk_ublk_ctrl_cmd(ublk, TD_UBLK_CMD_SET_PARAMS,
+				    &params, sizeof(params), 0, 0);
+	if (err)
+		ERR(err, "ublk %d: failed to set parameters\n", ublk->dev_id);
+
+	return err;
+}
+
+void
+tapdisk_ublk_destroy(td_ublk_t *ublk)
+{
+	int i, err;
+
+	ublk->stopping = 1;
+
+	if (ublk->started) {
+		err = tapdisk_ublk_ctrl_cmd(ublk, TD_UBLK_CMD_STOP_DEV,
+					    NULL, 0, 0, 1);
+		if (err)
+			ERR(err, "ublk %d: failed to stop device\n",
+			    ublk->dev_id);
+		ublk->started = 0;
+	}
+
+	if (ublk->queues) {
+		/* requests in flight still reference the queue buffers */
+		for (i = 0; i < ublk->nr_queues; i++)
+			while (ublk->queues[i].busy)
+				tapdisk_server_iterate();
+
+		for (i = 0; i < ublk->nr_queues; i++)
+			tapdisk_ublk_queue_free(&ublk->queues[i]);
+
+		free(ublk->queues);
+		ublk->queues = NULL;
+	}
+
+	if (ublk->cdev_fd >= 0) {
+		close(ublk->cdev_fd);
+		ublk->cdev_fd = -1;
+	}
+
+	if (ublk->added) {
+		err = tapdisk_ublk_ctrl_cmd(ublk, TD_UBLK_CMD_DEL_DEV,
+					    NULL, 0, 0, 0);
+		if (err)
+			ERR(err, "ublk %d: failed to delete device\n",
+			    ublk->dev_id);
+		else
+			INFO("ublk device %s%d removed\n",
+			     TD_UBLK_BLOCK_PATH, ublk->dev_id);
+		ublk->added = 0;
+	}
+
+	if (ublk->ctrl_event >= 0) {
+		tapdisk_server_unregister_event(ublk->ctrl_event);
+		ublk->ctrl_event = -1;
+	}
+
+	td_ublk_ring_exit(&ublk->ctrl);
+
+	if (ublk->ctrl_fd >= 0)
+		close(ublk->ctrl_fd);
+
+	free(ublk);
+}
+
+int
+tapdisk_ublk_create(td_vbd_t *vbd, int nr_queues, int depth,
+		    td_ublk_t **_ublk)
+{
+	td_ublk_t *ublk;
+	int i, err;
+
+	if (!nr_queues)
+		nr_queues = TD_UBLK_QUEUES_DEFAULT;
+	if (!depth)
+		depth = TD_UBLK_DEPTH_DEFAULT;
+
+	if (nr_queues < 0 || nr_queues > TD_UBLK_QUEUES_MAX ||
+	    depth < 0 || depth > TD_UBLK_DEPTH_MAX)
+		return -EINVAL;
+
+	ublk = calloc(1, sizeof(*ublk));
+	if (!ublk)
+		return -ENOMEM;
+
+	ublk->vbd        = vbd;
+	ublk->dev_id     = -1;
+	ublk->nr_queues  = nr_queues;
+	ublk->depth      = depth;
+	ublk->buf_size   = TD_UBLK_MAX_SECTORS << SECTOR_SHIFT;
+	ublk->ctrl.fd    = -1;
+	ublk->ctrl_event = -1;
+	ublk->cdev_fd    = -1;
+
+	ublk->ctrl_fd = open(TD_UBLK_CONTROL_PATH, O_RDWR);
+	if (ublk->ctrl_fd < 0) {
+		err = -errno;
+		ERR(err, "failed to open %s\n", TD_UBLK_CONTROL_PATH);
+		goto fail;
+	}
+
+	err = td_ublk_ring_init(&ublk->ctrl, 4, IORING_SETUP_SQE128);
+	if (err) {
+		ERR(err, "failed to set up ublk control ring\n");
+		goto fail;
+	}
+
+	ublk->ctrl_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      ublk->ctrl.fd, TV_ZERO,
+					      tapdisk_ublk_ctrl_event, ublk);
+	if (ublk->ctrl_event < 0) {
+		err = ublk->ctrl_event;
+		ublk->ctrl_event = -1;
+		goto fail;
+	}
+
+	err = tapdisk_ublk_add(ublk);
+	if (err)
+		goto fail;
+
+	err = tapdisk_ublk_open_cdev(ublk);
+	if (err) {
+		ERR(err, "failed to open %s%d\n",
+		    TD_UBLK_CHAR_PATH, ublk->dev_id);
+		goto fail;
+	}
+
+	ublk->queues = calloc(nr_queues, sizeof(td_ublk_queue_t));
+	if (!ublk->queues) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < nr_queues; i++)
+		ublk->queues[i].event = -1;
+
+	for (i = 0; i < nr_queues; i++) {
+		err = tapdisk_ublk_queue_init(ublk, &ublk->queues[i], i);
+		if (err)
+			goto fail;
+	}
+
+	err = tapdisk_ublk_ctrl_cmd(ublk, TD_UBLK_CMD_START_DEV,
+				    NULL, 0, getpid(), 1);
+	if (err) {
+		ERR(err, "ublk %d: failed to start device\n", ublk->dev_id);
+		goto fail;
+	}
+
+	ublk->started = 1;
+
+	INFO("VBD %d exported as %s%d, %d queues of %d\n",
+	     vbd->uuid, TD_UBLK_BLOCK_PATH, ublk->dev_id, nr_queues, depth);
+
+	*_ublk = ublk;
+	return 0;
+
+fail:
+	tapdisk_ublk_destroy(ublk);
+	return err;
+}
+
+int
+tapdisk_ublk_dev_id(td_ublk_t *ublk)
+{
+	return ublk->dev_id;
+}
+
+void
+tapdisk_ublk_stats(td_ublk_t *ublk, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "dev_id", "d", ublk->dev_id);
+	tapdisk_stats_field(st, "queues", "d", ublk->nr_queues);
+	tapdisk_stats_field(st, "depth", "d", ublk->depth);
+
+	tapdisk_stats_field(st, "reqs", "[");
+	tapdisk_stats_val(st, "llu", ublk->stats.in);
+	tapdisk_stats_val(st, "llu", ublk->stats.out);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "errors", "llu", ublk->stats.errors);
+	tapdisk_stats_field(st, "submits", "llu", ublk->stats.submits);
+}
+
+#else /* HAVE_LINUX_UBLK_CMD_H */
+
+struct td_ublk {
+	int                     dev_id;
+};
+
+int
+tapdisk_ublk_create(td_vbd_t *vbd, int nr_queues, int depth,
+		    td_ublk_t **_ublk)
+{
+	ERR(-ENOSYS, "built without ublk support\n");
+	return -ENOSYS;
+}
+
+void
+tapdisk_ublk_destroy(td_ublk_t *ublk)
+{
+}
+
+int
+tapdisk_ublk_dev_id(td_ublk_t *ublk)
+{
+	return -1;
+}
+
+void
+tapdisk_ublk_stats(td_ublk_t *ublk, td_stats_t *st)
+{
+}
+
+#endif /* HAVE_LINUX_UBLK_CMD_H */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_UBLK_H_
+#define _TAPDISK_UBLK_H_
+
+/*
+ * ublk frontend: exposes a VBD as /dev/ublkb<id> through the mainline
+ * ublk driver. Requests are fetched and committed with io_uring
+ * URING_CMDs, one ring per hardware queue, all serviced from the
+ * tapdisk event loop.
+ */
+
+typedef struct td_ublk td_ublk_t;
+
+#include "tapdisk-vbd.h"
+#include "scheduler.h"
+
+#define TD_UBLK_CONTROL_PATH        "/dev/ublk-control"
+#define TD_UBLK_CHAR_PATH           "/dev/ublkc"
+#define TD_UBLK_BLOCK_PATH          "/dev/ublkb"
+
+#define TD_UBLK_QUEUES_DEFAULT      1
+#define TD_UBLK_QUEUES_MAX          16
+#define TD_UBLK_DEPTH_DEFAULT       64
+#define TD_UBLK_DEPTH_MAX           1024
+#define TD_UBLK_MAX_SECTORS         256
+
+/**
+ * Adds a ublk device backed by @vbd with @nr_queues hardware queues of
+ * @depth tags each, and starts serving it. Zero picks the defaults. On
+ * success, the device is /dev/ublkb<dev_id>.
+ */
+int tapdisk_ublk_create(td_vbd_t *vbd, int nr_queues, int depth,
+			td_ublk_t **ublk);
+
+/**
+ * Stops and deletes the device. Waits for requests in flight.
+ */
+void tapdisk_ublk_destroy(td_ublk_t *ublk);
+
+int tapdisk_ublk_dev_id(td_ublk_t *ublk);
+
+void tapdisk_ublk_stats(td_ublk_t *ublk, td_stats_t *st);
+
+#endif /* _TAPDISK_UBLK_H_ */
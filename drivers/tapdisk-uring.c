@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Local VBD frontend on top of the shared-memory td_uring: lets a process
+ * on the same host drive a VBD without blktap, blkback or grant tables.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-server.h"
+#include "tapdisk-uring.h"
+#include "timeout-math.h"
+
+#define BUG_ON(_cond)    if (unlikely(_cond)) { td_panic(); }
+
+#define DBG(_f, _a...)       tlog_syslog(TLOG_DBG, _f, ##_a)
+#define INFO(_f, _a...)      tlog_syslog(TLOG_INFO, _f, ##_a)
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+struct td_uring_server_req {
+	td_vbd_request_t        vreq;
+	uint64_t                id;
+	uint8_t                 op;
+	char                    name[32];
+	struct td_iovec         iov;
+};
+
+static td_uring_server_req_t *
+tapdisk_uring_server_alloc_request(td_uring_server_t *server)
+{
+	td_uring_server_req_t *req = NULL;
+
+	if (likely(server->n_reqs_free))
+		req = server->reqs_free[--server->n_reqs_free];
+
+	return req;
+}
+
+static void
+tapdisk_uring_server_free_request(td_uring_server_t *server,
+				  td_uring_server_req_t *req)
+{
+	BUG_ON(server->n_reqs_free >= server->n_reqs);
+	server->reqs_free[server->n_reqs_free++] = req;
+}
+
+static inline int
+tapdisk_uring_server_busy(td_uring_server_t *server)
+{
+	return server->n_reqs_free < server->n_reqs;
+}
+
+static void
+tapdisk_uring_server_reqs_free(td_uring_server_t *server)
+{
+	free(server->reqs);
+	server->reqs = NULL;
+
+	free(server->reqs_free);
+	server->reqs_free = NULL;
+}
+
+static int
+tapdisk_uring_server_reqs_init(td_uring_server_t *server, int n_reqs)
+{
+	int i, err;
+
+	server->reqs = calloc(n_reqs, sizeof(td_uring_server_req_t));
+	if (!server->reqs) {
+		err = -errno;
+		goto fail;
+	}
+
+	server->reqs_free = calloc(n_reqs, sizeof(td_uring_server_req_t *));
+	if (!server->reqs_free) {
+		err = -errno;
+		goto fail;
+	}
+
+	server->n_reqs      = n_reqs;
+	server->n_reqs_free = 0;
+
+	for (i = 0; i < n_reqs; i++)
+		tapdisk_uring_server_free_request(server, &server->reqs[i]);
+
+	return 0;
+
+fail:
+	tapdisk_uring_server_reqs_free(server);
+	return err;
+}
+
+static int
+tapdisk_uring_server_error_status(int error)
+{
+	switch (error) {
+	case 0:
+		return TD_URING_RSP_OKAY;
+	case -EOPNOTSUPP:
+		return TD_URING_RSP_EOPNOTSUPP;
+	default:
+		return TD_URING_RSP_ERROR;
+	}
+}
+
+static void
+tapdisk_uring_server_push_responses(td_uring_server_t *server)
+{
+	int notify, err;
+
+	RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&server->ring.back, notify);
+	if (!notify)
+		return;
+
+	err = tapdisk_uring_kick(&server->ring);
+	if (!err)
+		server->stats.kicks.out++;
+	else if (err == -EAGAIN)
+		server->stats.kicks.coalesced++;
+}
+
+static void
+tapdisk_uring_server_put_response(td_uring_server_t *server, uint64_t id,
+				  uint8_t op, int error, int final)
+{
+	td_uring_back_ring_t *back = &server->ring.back;
+	td_uring_response_t *rsp;
+
+	/* the client went away, nobody is listening */
+	if (server->ring.connfd < 0)
+		return;
+
+	rsp = RING_GET_RESPONSE(back, back->rsp_prod_pvt);
+
+	rsp->id     = id;
+	rsp->op     = op;
+	rsp->status = tapdisk_uring_server_error_status(error);
+
+	back->rsp_prod_pvt++;
+	server->stats.reqs.out++;
+
+	if (final)
+		tapdisk_uring_server_push_responses(server);
+}
+
+static void
+tapdisk_uring_server_complete_request(td_uring_server_t *server,
+				      td_uring_server_req_t *req,
+				      int error, int final)
+{
+	if (error)
+		server->stats.reqs.errors++;
+
+	tapdisk_uring_server_put_response(server, req->id, req->op,
+					  error, final);
+	tapdisk_uring_server_free_request(server, req);
+}
+
+static void
+__tapdisk_uring_server_request_cb(td_vbd_request_t *vreq, int error,
+				  void *token, int final)
+{
+	td_uring_server_req_t *req =
+		container_of(vreq, td_uring_server_req_t, vreq);
+	td_uring_server_t *server = token;
+
+	tapdisk_uring_server_complete_request(server, req, error, final);
+}
+
+static int
+tapdisk_uring_server_parse_request(td_uring_server_t *server,
+				   const td_uring_request_t *msg,
+				   td_uring_server_req_t *req)
+{
+	td_vbd_request_t *vreq = &req->vreq;
+	td_vbd_t *vbd = server->vbd;
+	uint64_t end;
+	int op;
+
+	memset(req, 0, sizeof(*req));
+
+	req->id = msg->id;
+	req->op = msg->op;
+
+	switch (msg->op) {
+	case TD_URING_OP_READ:
+		op = TD_OP_READ;
+		break;
+	case TD_URING_OP_WRITE:
+		op = TD_OP_WRITE;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	if (!msg->secs || msg->offset & (SECTOR_SIZE - 1))
+		return -EINVAL;
+
+	end = (uint64_t)msg->offset + ((uint64_t)msg->secs << SECTOR_SHIFT);
+	if (end > server->ring.data_size)
+		return -EINVAL;
+
+	if (msg->sec + msg->secs > vbd->disk_info.size ||
+	    msg->sec + msg->secs < msg->sec)
+		return -EINVAL;
+
+	snprintf(req->name, sizeof(req->name),
+		 "uring-%d.%"PRIu64, vbd->uuid, req->id);
+
+	req->iov.base = server->ring.data_area + msg->offset;
+	req->iov.secs = msg->secs;
+
+	vreq->op       = op;
+	vreq->sec      = msg->sec;
+	vreq->iov      = &req->iov;
+	vreq->iovcnt   = 1;
+	vreq->name     = req->name;
+	vreq->token    = server;
+	vreq->cb       = __tapdisk_uring_server_request_cb;
+	vreq->io_class = TD_VREQ_CLASS_FG;
+
+	return 0;
+}
+
+static void
+tapdisk_uring_server_hangup(td_uring_server_t *server)
+{
+	if (server->conn_event >= 0) {
+		tapdisk_server_unregister_event(server->conn_event);
+		server->conn_event = -1;
+	}
+
+	if (server->ring.connfd >= 0) {
+		INFO("uring client disconnected from VBD %d\n",
+		     server->vbd->uuid);
+		tapdisk_uring_hangup(&server->ring);
+	}
+}
+
+static void
+tapdisk_uring_server_get_requests(td_uring_server_t *server)
+{
+	td_uring_back_ring_t *back = &server->ring.back;
+	RING_IDX rp, rc;
+	int more, err;
+
+	do {
+		rp = back->sring->req_prod;
+		xen_rmb();
+
+		if (rp - back->req_cons > RING_SIZE(back)) {
+			ERR(-EINVAL, "uring request producer overflow "
+			    "(%u, cons %u), disconnecting\n",
+			    rp, back->req_cons);
+			tapdisk_uring_server_hangup(server);
+			return;
+		}
+
+		for (rc = back->req_cons; rc != rp; rc++) {
+			td_uring_request_t msg;
+			td_uring_server_req_t *req;
+
+			/* the ring is writable by the client, take a copy */
+			msg = *RING_GET_REQUEST(back, rc);
+			back->req_cons = rc + 1;
+
+			server->stats.reqs.in++;
+
+			req = tapdisk_uring_server_alloc_request(server);
+			if (!req) {
+				ERR(-EFAULT, "uring client exceeded ring size, "
+				    "disconnecting\n");
+				tapdisk_uring_server_hangup(server);
+				return;
+			}
+
+			err = tapdisk_uring_server_parse_request(server,
+								 &msg, req);
+			if (!err)
+				err = tapdisk_vbd_queue_request(server->vbd,
+								&req->vreq);
+			if (err)
+				tapdisk_uring_server_complete_request(server,
+								      req, err,
+								      1);
+		}
+
+		RING_FINAL_CHECK_FOR_REQUESTS(back, more);
+	} while (more);
+}
+
+static void
+tapdisk_uring_server_conn_event(event_id_t id, char mode, void *data)
+{
+	td_uring_server_t *server = data;
+	int kicks;
+
+	kicks = tapdisk_uring_recv(&server->ring);
+	if (kicks == -EAGAIN)
+		return;
+
+	if (kicks < 0) {
+		tapdisk_uring_server_hangup(server);
+		return;
+	}
+
+	server->stats.kicks.in += kicks;
+	tapdisk_uring_server_get_requests(server);
+}
+
+static void
+tapdisk_uring_server_listen_event(event_id_t id, char mode, void *data)
+{
+	td_uring_server_t *server = data;
+	int err;
+
+	/*
+	 * Requests of a previous client still in flight would otherwise
+	 * complete into the new client's ring: turn the client away before
+	 * the ring is reset.
+	 */
+	if (tapdisk_uring_server_busy(server)) {
+		err = tapdisk_uring_reject(&server->ring);
+		ERR(err ? : -EBUSY, "previous uring client still has "
+		    "requests in flight\n");
+		return;
+	}
+
+	err = tapdisk_uring_accept(&server->ring);
+	if (err) {
+		ERR(err, "failed to accept uring client\n");
+		return;
+	}
+
+	server->conn_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      server->ring.connfd, TV_ZERO,
+					      tapdisk_uring_server_conn_event,
+					      server);
+	if (server->conn_event < 0) {
+		ERR(server->conn_event, "failed to register uring client\n");
+		server->conn_event = -1;
+		tapdisk_uring_hangup(&server->ring);
+		return;
+	}
+
+	server->stats.connects++;
+	INFO("uring client connected to VBD %d\n", server->vbd->uuid);
+}
+
+void
+tapdisk_uring_server_close(td_uring_server_t *server)
+{
+	if (server->listen_event >= 0) {
+		tapdisk_server_unregister_event(server->listen_event);
+		server->listen_event = -1;
+	}
+
+	tapdisk_uring_server_hangup(server);
+
+	/* requests in flight still reference the data area */
+	while (tapdisk_uring_server_busy(server))
+		tapdisk_server_iterate();
+
+	tapdisk_uring_destroy(&server->ring);
+	tapdisk_uring_server_reqs_free(server);
+	free(server);
+}
+
+int
+tapdisk_uring_server_open(const char *location, td_vbd_t *vbd,
+			  td_uring_server_t **_server)
+{
+	td_uring_server_t *server;
+	int err;
+
+	server = calloc(1, sizeof(*server));
+	if (!server)
+		return -ENOMEM;
+
+	server->vbd          = vbd;
+	server->listen_event = -1;
+	server->conn_event   = -1;
+	server->ring.ctlfd   = -1;
+	server->ring.connfd  = -1;
+
+	err = tapdisk_uring_create(&server->ring, location,
+				   TAPDISK_URING_RING_SIZE,
+				   TAPDISK_URING_DATA_SIZE,
+				   vbd->disk_info.size);
+	if (err) {
+		ERR(err, "failed to create uring at %s\n", location);
+		goto fail;
+	}
+
+	err = tapdisk_uring_server_reqs_init(server,
+					     RING_SIZE(&server->ring.back));
+	if (err)
+		goto fail;
+
+	server->listen_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      server->ring.ctlfd, TV_ZERO,
+					      tapdisk_uring_server_listen_event,
+					      server);
+	if (server->listen_event < 0) {
+		err = server->listen_event;
+		server->listen_event = -1;
+		goto fail;
+	}
+
+	INFO("uring for VBD %d listening on %s.cfd\n", vbd->uuid, location);
+
+	*_server = server;
+	return 0;
+
+fail:
+	tapdisk_uring_server_close(server);
+	return err;
+}
+
+void
+tapdisk_uring_server_stats(td_uring_server_t *server, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "connected", "d", server->ring.connfd >= 0);
+	tapdisk_stats_field(st, "connects", "llu", server->stats.connects);
+
+	tapdisk_stats_field(st, "reqs", "[");
+	tapdisk_stats_val(st, "llu", server->stats.reqs.in);
+	tapdisk_stats_val(st, "llu", server->stats.reqs.out);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "errors", "llu", server->stats.reqs.errors);
+
+	tapdisk_stats_field(st, "kicks", "[");
+	tapdisk_stats_val(st, "llu", server->stats.kicks.in);
+	tapdisk_stats_val(st, "llu", server->stats.kicks.out);
+	tapdisk_stats_val(st, "llu", server->stats.kicks.coalesced);
+	tapdisk_stats_leave(st, ']');
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_URING_H_
+#define _TAPDISK_URING_H_
+
+typedef struct td_uring_server td_uring_server_t;
+typedef struct td_uring_server_req td_uring_server_req_t;
+
+#include "tapdisk-ring.h"
+#include "tapdisk-vbd.h"
+#include "scheduler.h"
+
+#define TAPDISK_URING_RING_SIZE      (4 << 12)
+#define TAPDISK_URING_DATA_SIZE      (16 << 20)
+
+struct td_uring_server_stats {
+	struct {
+		unsigned long long      in;
+		unsigned long long      out;
+		unsigned long long      errors;
+	} reqs;
+	struct {
+		unsigned long long      in;
+		unsigned long long      out;
+		unsigned long long      coalesced;
+	} kicks;
+	unsigned long long              connects;
+};
+
+struct td_uring_server {
+	td_vbd_t                       *vbd;
+	td_uring_t                      ring;
+
+	event_id_t                      listen_event;
+	event_id_t                      conn_event;
+
+	int                             n_reqs;
+	td_uring_server_req_t          *reqs;
+	int                             n_reqs_free;
+	td_uring_server_req_t         **reqs_free;
+
+	struct td_uring_server_stats    stats;
+};
+
+int tapdisk_uring_server_open(const char *, td_vbd_t *, td_uring_server_t **);
+void tapdisk_uring_server_close(td_uring_server_t *);
+
+void tapdisk_uring_server_stats(td_uring_server_t *, td_stats_t *);
+
+#endif /* _TAPDISK_URING_H_ */
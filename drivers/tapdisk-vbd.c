@@ -57,6 +57,12 @@
 #include "tapdisk-stats.h"
 #include "tapdisk-storage.h"
 #include "tapdisk-nbdserver.h"
+#include "tapdisk-uring.h"
+#include "tapdisk-ublk.h"
+#include "tapdisk-nbdkernel.h"
+#include "tapdisk-resync.h"
+#include "tapdisk-coalesce.h"
+#include "tapdisk-mirror.h"
 #include "td-stats.h"
 #include "tapdisk-utils.h"
 
@@ -177,6 +183,22 @@ tapdisk_vbd_next_image(td_image_t *image)
 	return list_entry(image->next.next, td_image_t, next);
 }
 
+/*
+ * Images holding acknowledged writes of their own, e.g. a write-back
+ * cache still destaging, keep the VBD from quiescing.
+ */
+static int
+tapdisk_vbd_images_busy(td_vbd_t *vbd)
+{
+	td_image_t *image;
+	int busy = 0;
+
+	tapdisk_for_each_image(image, &vbd->images)
+		busy |= !!td_busy(image);
+
+	return busy;
+}
+
 static int
 tapdisk_vbd_validate_chain(td_vbd_t *vbd)
 {
@@ -266,6 +288,7 @@ tapdisk_vbd_close_vdi(td_vbd_t *vbd)
         EPRINTF("failed to destroy stats file: %s\n", strerror(-err));
     }
 
+	tapdisk_vbd_coalesce_free(vbd);
 	tapdisk_image_close_chain(&vbd->images);
 
 	if (vbd->secondary &&
@@ -407,6 +430,8 @@ tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 		vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
 		vbd->secondary = NULL;
 		vbd->nbd_mirror_failed = 0;
+		tapdisk_vbd_resync_free(vbd);
+		tapdisk_vbd_mirror_free(vbd);
 		return 0;
 	}
 
@@ -440,14 +465,30 @@ tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 		goto fail;
 	}
 
+	if (td_flag_test(vbd->flags, TD_OPEN_ASYNC_MIRROR) &&
+	    !td_flag_test(vbd->flags, TD_OPEN_STANDBY)) {
+		err = tapdisk_vbd_mirror_create(vbd);
+		if (err)
+			goto fail;
+	}
+
 	vbd->secondary = second;
-	leaf->flags |= TD_IGNORE_ENOSPC;
 	if (td_flag_test(vbd->flags, TD_OPEN_STANDBY)) {
 		DPRINTF("In standby mode\n");
 		vbd->secondary_mode = TD_VBD_SECONDARY_STANDBY;
+		leaf->flags |= TD_IGNORE_ENOSPC;
+	} else if (vbd->mirror) {
+		/*
+		 * The secondary may lag behind, so it cannot take over
+		 * from the leaf on ENOSPC.
+		 */
+		DPRINTF("In asynchronous mirror mode\n");
+		vbd->secondary_mode = TD_VBD_SECONDARY_MIRROR;
+		list_add(&second->next, &leaf->next);
 	} else {
 		DPRINTF("In mirror mode\n");
 		vbd->secondary_mode = TD_VBD_SECONDARY_MIRROR;
+		leaf->flags |= TD_IGNORE_ENOSPC;
 		/*
 		 * we actually need this image to also be part of the chain, 
 		 * since it may already contain data
@@ -572,6 +613,43 @@ fail:
 	return err;
 }
 
+static int
+tapdisk_vbd_add_readahead(td_vbd_t *vbd)
+{
+	td_image_t *ra, *leaf;
+	td_driver_t *driver;
+	int err;
+
+	leaf = tapdisk_vbd_first_image(vbd);
+
+	ra = tapdisk_image_allocate("readahead", DISK_TYPE_READAHEAD,
+				    leaf->flags);
+	if (!ra)
+		return -ENOMEM;
+
+	driver = tapdisk_driver_allocate(ra->type, ra->name, ra->flags);
+	if (!driver) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	driver->info = leaf->driver->info;
+	ra->driver   = driver;
+
+	err = td_open(ra, &vbd->encryption);
+	if (err)
+		goto fail;
+
+	/* on top of the chain, where it sees every guest read */
+	list_add(&ra->next, &vbd->images);
+	DPRINTF("Added readahead filter\n");
+	return 0;
+
+fail:
+	tapdisk_image_free(ra);
+	return err;
+}
+
 int 
 tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_devnum)
 {
@@ -625,6 +703,12 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
 			goto fail;
 	}
 
+	if (td_flag_test(vbd->flags, TD_OPEN_READAHEAD)) {
+		err = tapdisk_vbd_add_readahead(vbd);
+		if (err)
+			goto fail;
+	}
+
 	err = tapdisk_vbd_validate_chain(vbd);
 	if (err)
 		goto fail;
@@ -639,6 +723,8 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
 		}
 	}
 
+	tapdisk_vbd_resync_start(vbd);
+
 	err = vbd_stats_create(vbd);
 	if (err)
 		goto fail;
@@ -747,9 +833,16 @@ tapdisk_vbd_shutdown(td_vbd_t *vbd)
 {
 	int new, pending, failed, completed;
 
-	if (!list_empty(&vbd->pending_requests))
+	if (!list_empty(&vbd->pending_requests) ||
+	    tapdisk_vbd_resync_busy(vbd) ||
+	    tapdisk_vbd_mirror_busy(vbd) ||
+	    tapdisk_vbd_coalesce_busy(vbd) ||
+	    tapdisk_vbd_images_busy(vbd))
 		return -EAGAIN;
 
+	tapdisk_vbd_resync_free(vbd);
+	tapdisk_vbd_mirror_free(vbd);
+
 	tapdisk_vbd_queue_count(vbd, &new, &pending, &failed, &completed);
 
 	DPRINTF("%s: state: 0x%08x, new: 0x%02x, pending: 0x%02x, "
@@ -784,7 +877,11 @@ tapdisk_vbd_close(td_vbd_t *vbd)
 	/*
 	 * don't close if any requests are pending in the aio layer
 	 */
-	if (!list_empty(&vbd->pending_requests))
+	if (!list_empty(&vbd->pending_requests) ||
+	    tapdisk_vbd_resync_busy(vbd) ||
+	    tapdisk_vbd_mirror_busy(vbd) ||
+	    tapdisk_vbd_coalesce_busy(vbd) ||
+	    tapdisk_vbd_images_busy(vbd))
 		goto fail;
 
 	/* 
@@ -876,7 +973,11 @@ tapdisk_vbd_lock(td_vbd_t *vbd)
 int
 tapdisk_vbd_quiesce_queue(td_vbd_t *vbd)
 {
-	if (!list_empty(&vbd->pending_requests)) {
+	if (!list_empty(&vbd->pending_requests) ||
+	    tapdisk_vbd_resync_busy(vbd) ||
+	    tapdisk_vbd_mirror_busy(vbd) ||
+	    tapdisk_vbd_coalesce_busy(vbd) ||
+	    tapdisk_vbd_images_busy(vbd)) {
 		td_flag_set(vbd->state, TD_VBD_QUIESCE_REQUESTED);
 		return -EAGAIN;
 	}
@@ -1209,6 +1310,9 @@ static void
 tapdisk_vbd_complete_vbd_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
 	if (!vreq->submitting && !vreq->secs_pending) {
+		if (vreq->list_head == &vbd->pending_requests)
+			vbd->classes[vreq->io_class].inflight--;
+
 		if (vreq->error &&
 		    tapdisk_vbd_request_should_retry(vbd, vreq))
 			tapdisk_vbd_move_request(vreq, &vbd->failed_requests);
@@ -1478,16 +1582,15 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 			 (image == vbd->retired))) {
 		ERROR("Got non-zero res %d for NBD secondary - disabling "
 		      "mirroring: %s", res, vreq->name);
-		vbd->nbd_mirror_failed = 1;
 		res = 0; /* Pretend the writes have completed successfully */
 
 		/* It was the secondary that timed out - disable secondary */
-		list_del_init(&image->next);
-		vbd->retired = image;
-		if (vbd->secondary_mode != TD_VBD_SECONDARY_DISABLED) {
-			vbd->secondary = NULL;
-			vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
-		}
+		tapdisk_vbd_retire_secondary(vbd, image);
+
+		/* Remember what it missed, for a later resync */
+		if (td_flag_test(vbd->flags, TD_OPEN_RESYNC) &&
+		    treq.op == TD_OP_WRITE)
+			tapdisk_vbd_resync_degrade(vbd, treq.sec, treq.secs);
 	}
 
 	DBG(TLOG_DBG, "%s: req %s seg %d sec 0x%08"PRIx64
@@ -1498,11 +1601,27 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 	__tapdisk_vbd_complete_td_request(vbd, vreq, treq, res);
 }
 
+void
+tapdisk_vbd_retire_secondary(td_vbd_t *vbd, td_image_t *image)
+{
+	vbd->nbd_mirror_failed = 1;
+
+	list_del_init(&image->next);
+	vbd->retired = image;
+	if (vbd->secondary_mode != TD_VBD_SECONDARY_DISABLED) {
+		vbd->secondary = NULL;
+		vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
+	}
+}
+
 static inline void
-queue_mirror_req(td_vbd_t *vbd, td_request_t clone)
+queue_mirror_req(td_vbd_t *vbd, td_request_t clone, int sync)
 {
 	clone.image = vbd->secondary;
-	td_queue_write(vbd->secondary, clone);
+	if (vbd->mirror)
+		tapdisk_vbd_mirror_queue(vbd, clone, sync);
+	else
+		td_queue_write(vbd->secondary, clone);
 }
 
 int
@@ -1512,7 +1631,7 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	td_request_t treq;
 	bzero(&treq, sizeof(treq));
 	td_sector_t sec;
-	int i, err;
+	int i, err, mirror, mirror_sync;
 
 	sec    = vreq->sec;
 	image  = tapdisk_vbd_first_image(vbd);
@@ -1523,6 +1642,7 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	vreq->last_try = vbd->ts;
 
 	tapdisk_vbd_move_request(vreq, &vbd->pending_requests);
+	vbd->classes[vreq->io_class].inflight++;
 
 	err = tapdisk_vbd_check_queue(vbd);
 	if (err) {
@@ -1549,10 +1669,18 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		treq.vreq           = vreq;
 
 
+		/*
+		 * In asynchronous mode, the request only waits for the
+		 * secondary once the mirror lags too far behind.
+		 */
+		mirror      = vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR &&
+			vreq->op == TD_OP_WRITE;
+		mirror_sync = mirror &&
+			(!vbd->mirror || tapdisk_vbd_mirror_lagging(vbd));
+
 		vreq->secs_pending += iov->secs;
 		vbd->secs_pending  += iov->secs;
-		if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR &&
-		    vreq->op == TD_OP_WRITE) {
+		if (mirror_sync) {
 			vreq->secs_pending += iov->secs;
 			vbd->secs_pending  += iov->secs;
 		}
@@ -1570,8 +1698,12 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 			 * lose that write and cause the process to hang with 
 			 * unacknowledged writes
 			 */
-			if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR)
-				queue_mirror_req(vbd, treq);
+			if (mirror)
+				queue_mirror_req(vbd, treq, mirror_sync);
+			if (vbd->resync)
+				tapdisk_vbd_resync_mark(vbd, treq.sec, treq.secs);
+			if (vbd->coalesce)
+				tapdisk_vbd_coalesce_mark(vbd, treq.sec, treq.secs);
 			td_queue_write(treq.image, treq);
 			break;
 
@@ -1672,25 +1804,139 @@ tapdisk_vbd_count_new_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		td_sector_count_add(&vbd->secs, iov->secs, write);
 }
 
+static const struct {
+	int                         inflight;
+	long                        deadline_ms;
+} tapdisk_vbd_class_limits[TD_VREQ_CLASSES] = {
+	[TD_VREQ_CLASS_FG]     = { 0, 0 },
+	[TD_VREQ_CLASS_EXPORT] = { TD_VBD_EXPORT_INFLIGHT,
+				   TD_VBD_EXPORT_DEADLINE_MS },
+	[TD_VREQ_CLASS_BG]     = { TD_VBD_BG_INFLIGHT,
+				   TD_VBD_BG_DEADLINE_MS },
+};
+
+static const char *tapdisk_vbd_class_names[TD_VREQ_CLASSES] = {
+	[TD_VREQ_CLASS_FG]     = "foreground",
+	[TD_VREQ_CLASS_EXPORT] = "export",
+	[TD_VREQ_CLASS_BG]     = "background",
+};
+
+/*
+ * Foreground requests always go. The others go while no foreground
+ * request is in flight, within their in-flight limit, or once they
+ * have waited out their deadline.
+ */
+static int
+tapdisk_vbd_may_issue(td_vbd_t *vbd, td_vbd_request_t *vreq, long long wait)
+{
+	int cls = vreq->io_class;
+
+	if (cls == TD_VREQ_CLASS_FG ||
+	    !vbd->classes[TD_VREQ_CLASS_FG].inflight ||
+	    vbd->classes[cls].inflight < tapdisk_vbd_class_limits[cls].inflight)
+		return 1;
+
+	if (wait >= tapdisk_vbd_class_limits[cls].deadline_ms * 1000) {
+		vbd->classes[cls].expired++;
+		return 1;
+	}
+
+	vbd->classes[cls].deferred++;
+	return 0;
+}
+
+static td_sector_t
+tapdisk_vbd_request_secs(td_vbd_request_t *vreq)
+{
+	td_sector_t secs = 0;
+	int i;
+
+	for (i = 0; i < vreq->iovcnt; i++)
+		secs += vreq->iov[i].secs;
+
+	return secs;
+}
+
+/*
+ * A request may not pass an earlier one still waiting to be issued
+ * if their ranges overlap and either of them writes.
+ */
+static int
+tapdisk_vbd_request_blocked(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	td_vbd_request_t *prev;
+	td_sector_t end;
+
+	end = vreq->sec + tapdisk_vbd_request_secs(vreq);
+
+	list_for_each_entry(prev, &vbd->new_requests, next) {
+		if (prev == vreq)
+			break;
+
+		if (prev->op != TD_OP_WRITE && vreq->op != TD_OP_WRITE)
+			continue;
+
+		if (prev->sec < end &&
+		    vreq->sec < prev->sec + tapdisk_vbd_request_secs(prev))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Foreground requests are issued first, then whatever is left, in
+ * order, as far as the other classes may issue. Requests never pass
+ * an earlier overlapping one. Returns -EAGAIN if requests were held
+ * back, so the server doesn't spin on them; completions bring it back.
+ */
 static int
 tapdisk_vbd_issue_new_requests(td_vbd_t *vbd)
 {
-	int err;
+	int err, pass, held;
 	td_vbd_request_t *vreq, *tmp;
+	struct timeval now;
+	long long wait;
 
-	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
-		err = tapdisk_vbd_issue_request(vbd, vreq);
-		/*
-		 * if this request failed, but was not completed,
-		 * we'll back off for a while.
-		 */
-		if (err && !tapdisk_vbd_request_completed(vbd, vreq))
-			return err;
+	gettimeofday(&now, NULL);
+	held = 0;
+
+	for (pass = 0; pass < 2; pass++) {
+		tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
+			if (!pass && vreq->io_class != TD_VREQ_CLASS_FG)
+				continue;
+
+			if (tapdisk_vbd_request_blocked(vbd, vreq)) {
+				if (pass) {
+					vbd->classes[vreq->io_class].deferred++;
+					held = 1;
+				}
+				continue;
+			}
+
+			wait = timeval_to_us(&now) - timeval_to_us(&vreq->ts);
+			if (!tapdisk_vbd_may_issue(vbd, vreq, wait)) {
+				held = 1;
+				continue;
+			}
 
-		tapdisk_vbd_count_new_request(vbd, vreq);
+			vbd->classes[vreq->io_class].issued++;
+			if (wait > (long long)vbd->classes[vreq->io_class].max_wait_us)
+				vbd->classes[vreq->io_class].max_wait_us = wait;
+
+			err = tapdisk_vbd_issue_request(vbd, vreq);
+			/*
+			 * if this request failed, but was not completed,
+			 * we'll back off for a while.
+			 */
+			if (err && !tapdisk_vbd_request_completed(vbd, vreq))
+				return err;
+
+			tapdisk_vbd_count_new_request(vbd, vreq);
+		}
 	}
 
-	return 0;
+	return held ? -EAGAIN : 0;
 }
 
 int
@@ -1760,11 +2006,36 @@ tapdisk_vbd_queue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	vreq->vbd = vbd;
 
 	list_add_tail(&vreq->next, &vbd->new_requests);
+	vreq->list_head = &vbd->new_requests;
 	vbd->received++;
 
 	return 0;
 }
 
+/*
+ * Takes back a request the VBD holds but has not issued (new, failed
+ * and waiting for a retry, or completed and not yet returned), and
+ * returns it to its owner right away, -ECANCELED unless it already
+ * completed. Requests in flight cannot be taken back: -EBUSY.
+ */
+int
+tapdisk_vbd_cancel_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	if (vreq->list_head == &vbd->new_requests ||
+	    vreq->list_head == &vbd->failed_requests)
+		vreq->error = -ECANCELED;
+	else if (vreq->list_head != &vbd->completed_requests)
+		return -EBUSY;
+
+	list_del_init(&vreq->next);
+	vreq->list_head = NULL;
+
+	vreq->cb(vreq, vreq->error, vreq->token, 1);
+	vbd->returned++;
+
+	return 0;
+}
+
 void
 tapdisk_vbd_kick(td_vbd_t *vbd)
 {
@@ -1815,7 +2086,9 @@ tapdisk_vbd_start_nbdservers(td_vbd_t *vbd)
 	if (err)
 		return err;
 
-	vbd->nbdserver = tapdisk_nbdserver_alloc(vbd, info, TAPDISK_NBD_PROTOCOL_OLD);
+	/* old-style clients are guest datapaths, new-style ones exports */
+	vbd->nbdserver = tapdisk_nbdserver_alloc(vbd, info,
+			TAPDISK_NBD_PROTOCOL_OLD, TD_VREQ_CLASS_FG);
 	if (!vbd->nbdserver) {
 		EPRINTF("Error starting nbd server");
 		return -1;
@@ -1828,7 +2101,8 @@ tapdisk_vbd_start_nbdservers(td_vbd_t *vbd)
 		return err;
 	}
 
-	vbd->nbdserver_new = tapdisk_nbdserver_alloc(vbd, info, TAPDISK_NBD_PROTOCOL_NEW);
+	vbd->nbdserver_new = tapdisk_nbdserver_alloc(vbd, info,
+			TAPDISK_NBD_PROTOCOL_NEW, TD_VREQ_CLASS_EXPORT);
 	if (!vbd->nbdserver_new) {
 		EPRINTF("Error starting new-style nbd server");
 		return -1;
@@ -1844,6 +2118,26 @@ tapdisk_vbd_start_nbdservers(td_vbd_t *vbd)
 	return 0;
 }
 
+int
+tapdisk_vbd_start_uring(td_vbd_t *vbd)
+{
+	char *location;
+	int err;
+
+	err = asprintf(&location, "%s%d.%d",
+		       TD_URING_PATH, getpid(), vbd->uuid);
+	if (err == -1)
+		return -ENOMEM;
+
+	err = tapdisk_uring_server_open(location, vbd, &vbd->uring);
+	if (err)
+		EPRINTF("failed to start uring frontend on %s: %s\n",
+			location, strerror(-err));
+
+	free(location);
+	return err;
+}
+
 
 static int
 tapdisk_vbd_reqs_outstanding(td_vbd_t *vbd)
@@ -1863,8 +2157,11 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 {
 	td_image_t *image, *next;
     struct td_xenblkif *blkif;
+	int i;
 	const bool read_caching =
 		TD_OPEN_NO_O_DIRECT == (vbd->flags & TD_OPEN_NO_O_DIRECT);
+	const bool buffered_io =
+		TD_OPEN_BUFFERED == (vbd->flags & TD_OPEN_BUFFERED);
 
 	tapdisk_stats_enter(st, '{');
 	tapdisk_stats_field(st, "name", "s", vbd->name);
@@ -1885,6 +2182,59 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 		tapdisk_stats_leave(st, '}');
 	}
 
+	if (vbd->uring) {
+		tapdisk_stats_field(st, "uring", "{");
+		tapdisk_uring_server_stats(vbd->uring, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (vbd->ublk) {
+		tapdisk_stats_field(st, "ublk", "{");
+		tapdisk_ublk_stats(vbd->ublk, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (vbd->nbdkernel) {
+		tapdisk_stats_field(st, "nbdkernel", "{");
+		tapdisk_nbdkernel_stats(vbd->nbdkernel, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (vbd->mirror) {
+		tapdisk_stats_field(st, "mirror", "{");
+		tapdisk_vbd_mirror_stats(vbd, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (vbd->resync) {
+		tapdisk_stats_field(st, "resync", "{");
+		tapdisk_vbd_resync_stats(vbd, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (vbd->coalesce) {
+		tapdisk_stats_field(st, "coalesce", "{");
+		tapdisk_vbd_coalesce_stats(vbd, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	tapdisk_stats_field(st, "classes", "{");
+	for (i = 0; i < TD_VREQ_CLASSES; i++) {
+		tapdisk_stats_field(st, tapdisk_vbd_class_names[i], "{");
+		tapdisk_stats_field(st, "inflight", "d",
+				    vbd->classes[i].inflight);
+		tapdisk_stats_field(st, "issued", "llu",
+				    vbd->classes[i].issued);
+		tapdisk_stats_field(st, "deferred", "llu",
+				    vbd->classes[i].deferred);
+		tapdisk_stats_field(st, "expired", "llu",
+				    vbd->classes[i].expired);
+		tapdisk_stats_field(st, "max_wait_us", "llu",
+				    vbd->classes[i].max_wait_us);
+		tapdisk_stats_leave(st, '}');
+	}
+	tapdisk_stats_leave(st, '}');
+
     /*
      * TODO Is this used by any one?
      */
@@ -1911,6 +2261,10 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 			"read_caching",
 			"s",  read_caching ? "true": "false");
 
+	tapdisk_stats_field(st,
+			"buffered_io",
+			"s",  buffered_io ? "true": "false");
+
 	tapdisk_stats_leave(st, '}');
 }
 
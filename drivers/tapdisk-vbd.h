@@ -43,6 +43,16 @@
 #define TD_VBD_MAX_RETRIES          100
 #define TD_VBD_RETRY_INTERVAL       1
 
+/*
+ * While foreground requests are in flight, other classes only get a few
+ * requests of their own in flight, unless one has waited out its
+ * deadline.
+ */
+#define TD_VBD_EXPORT_INFLIGHT      4
+#define TD_VBD_EXPORT_DEADLINE_MS   50
+#define TD_VBD_BG_INFLIGHT          1
+#define TD_VBD_BG_DEADLINE_MS       500
+
 /*
  * VBD states
  */
@@ -62,6 +72,9 @@
 #define TD_VBD_SECONDARY_STANDBY    2
 
 struct td_nbdserver;
+struct td_uring_server;
+struct td_ublk;
+struct td_nbdkernel;
 
 struct td_vbd_rrd {
 
@@ -150,9 +163,50 @@ struct td_vbd_handle {
 	uint64_t                    errors;
 	td_sector_count_t           secs;
 
+	/**
+	 * dispatch state and counters, per request class
+	 */
+	struct {
+		int                 inflight;
+		uint64_t            issued;
+		uint64_t            deferred;
+		uint64_t            expired;
+		uint64_t            max_wait_us;
+	} classes[TD_VREQ_CLASSES];
+
 	struct td_nbdserver        *nbdserver;
 	struct td_nbdserver        *nbdserver_new;
 
+	/**
+	 * kernel NBD device attached to nbdserver_new, if any
+	 */
+	struct td_nbdkernel        *nbdkernel;
+
+	/**
+	 * local shared-memory frontend, if requested at open
+	 */
+	struct td_uring_server     *uring;
+
+	/**
+	 * mainline ublk block device, if one was created
+	 */
+	struct td_ublk             *ublk;
+
+	/**
+	 * dirty tracking and background copy for the mirror secondary
+	 */
+	struct td_vbd_resync       *resync;
+
+	/**
+	 * write log for asynchronous mirroring to the secondary
+	 */
+	struct td_vbd_mirror       *mirror;
+
+	/**
+	 * background copy of the leaf into its parent, if requested
+	 */
+	struct td_vbd_coalesce     *coalesce;
+
 	/**
 	 * We keep a copy of the disk info because we might receive a disk info
 	 * request while we're in the paused state.
@@ -212,6 +266,7 @@ int tapdisk_vbd_attach(td_vbd_t *, const char *, int);
 void tapdisk_vbd_detach(td_vbd_t *);
 
 int tapdisk_vbd_queue_request(td_vbd_t *, td_vbd_request_t *);
+int tapdisk_vbd_cancel_request(td_vbd_t *, td_vbd_request_t *);
 void tapdisk_vbd_forward_request(td_request_t);
 
 int tapdisk_vbd_get_disk_info(td_vbd_t *, td_disk_info_t *);
@@ -242,9 +297,15 @@ int tapdisk_vbd_recheck_state(td_vbd_t *);
 void tapdisk_vbd_check_progress(td_vbd_t *);
 void tapdisk_vbd_debug(td_vbd_t *);
 int tapdisk_vbd_start_nbdservers(td_vbd_t *);
+int tapdisk_vbd_start_uring(td_vbd_t *);
 void tapdisk_vbd_stats(td_vbd_t *, td_stats_t *);
 void tapdisk_vbd_complete_block_status_request(td_request_t, int);
 
+/**
+ * Takes a failed secondary out of the chain and disables mirroring.
+ */
+void tapdisk_vbd_retire_secondary(td_vbd_t *, td_image_t *);
+
 /**
  * Tells whether the VBD contains at least one dead ring.
  */
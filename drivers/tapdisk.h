@@ -106,6 +106,10 @@ enum TD_OPS{
 #define TD_OPEN_STANDBY              0x00800
 #define TD_IGNORE_ENOSPC             0x01000
 #define TD_OPEN_NO_O_DIRECT          0x02000
+#define TD_OPEN_RESYNC               0x04000
+#define TD_OPEN_ASYNC_MIRROR         0x08000
+#define TD_OPEN_READAHEAD            0x10000
+#define TD_OPEN_BUFFERED             0x20000
 
 #define TD_CREATE_SPARSE             0x00001
 #define TD_CREATE_MULTITYPE          0x00002
@@ -153,11 +157,23 @@ struct td_iovec {
 	unsigned int                secs;
 };
 
+/*
+ * Request classes, most latency-sensitive first. Guest I/O is foreground;
+ * the zero default keeps every producer there unless it says otherwise.
+ */
+enum td_vreq_class {
+	TD_VREQ_CLASS_FG = 0,
+	TD_VREQ_CLASS_EXPORT,
+	TD_VREQ_CLASS_BG,
+	TD_VREQ_CLASSES,
+};
+
 struct td_vbd_request {
 	int                         op;
 	td_sector_t                 sec;
 	struct td_iovec            *iov;
 	int                         iovcnt;
+	int                         io_class;
 
 	td_vreq_callback_t          cb;
 	void                       *token;
@@ -220,6 +236,13 @@ struct tap_disk {
 	void (*td_debug)             (td_driver_t *);
 	void (*td_stats)             (td_driver_t *, td_stats_t *);
 
+	/**
+	 * Optional. Polled while the VBD quiesces or shuts down: returns
+	 * nonzero for as long as the driver still holds writes it has
+	 * acknowledged but not yet passed on to its parent.
+	 */
+	int (*td_busy)               (td_driver_t *);
+
     /**
      * Callback to produce RRD output.
 	 *
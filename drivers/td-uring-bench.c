@@ -0,0 +1,514 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * td-uring-bench: fio-style load generator for the tapdisk uring
+ * frontend (tap-ctl open -U). Worker threads share the ring; each owns
+ * a fixed number of slots in the data area, one per request in flight.
+ * A reaper thread consumes responses and wakes the workers.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "tapdisk-ring.h"
+
+#define SECTOR_SHIFT     9
+#define LAT_BUCKETS      32      /* log2(usecs) */
+
+struct bench_opts {
+	int                 threads;
+	int                 depth;
+	uint32_t            bs;          /* bytes */
+	int                 read_pct;
+	int                 random;
+	int                 runtime;     /* seconds */
+	uint64_t            span;        /* sectors, 0: whole disk */
+};
+
+struct bench_worker {
+	int                 id;
+	pthread_t           thread;
+	pthread_cond_t      cond;
+
+	int                 inflight;
+	int                *free_slots;
+	int                 n_free;
+	struct timespec    *start;       /* per slot */
+	uint8_t            *slot_op;
+
+	unsigned int        seed;
+	uint64_t            next_sec;    /* sequential cursor */
+	uint64_t            first_sec;
+	uint64_t            last_sec;
+
+	uint64_t            ios[2];      /* read, write */
+	uint64_t            errors;
+	uint64_t            lat_total;   /* usecs */
+	uint64_t            lat_max;
+	uint64_t            lat_hist[LAT_BUCKETS];
+};
+
+static td_uring_t            ring;
+static struct bench_opts     opts;
+static struct bench_worker  *workers;
+static pthread_mutex_t       lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int          stop;
+static int                   running;
+static struct timespec       t_end;
+
+static uint64_t
+ts_delta_us(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000ULL +
+		(b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+static uint64_t
+bench_pick_sector(struct bench_worker *w)
+{
+	uint64_t secs = opts.bs >> SECTOR_SHIFT;
+	uint64_t nblocks, sec;
+
+	nblocks = (w->last_sec - w->first_sec) / secs;
+
+	if (opts.random) {
+		uint64_t r = ((uint64_t)rand_r(&w->seed) << 31) ^
+			rand_r(&w->seed);
+		return w->first_sec + (r % nblocks) * secs;
+	}
+
+	sec = w->next_sec;
+	w->next_sec += secs;
+	if (w->next_sec + secs > w->last_sec)
+		w->next_sec = w->first_sec;
+
+	return sec;
+}
+
+/* called with the lock held */
+static int
+bench_submit(struct bench_worker *w)
+{
+	td_uring_request_t *req;
+	int slot, notify, write, err;
+
+	slot = w->free_slots[--w->n_free];
+	write = (rand_r(&w->seed) % 100) >= opts.read_pct;
+
+	req = RING_GET_REQUEST(&ring.front, ring.front.req_prod_pvt);
+	req->op     = write ? TD_URING_OP_WRITE : TD_URING_OP_READ;
+	req->id     = ((uint64_t)w->id << 32) | slot;
+	req->sec    = bench_pick_sector(w);
+	req->secs   = opts.bs >> SECTOR_SHIFT;
+	req->offset = (w->id * opts.depth + slot) * opts.bs;
+
+	ring.front.req_prod_pvt++;
+	w->slot_op[slot] = write;
+	w->inflight++;
+	clock_gettime(CLOCK_MONOTONIC, &w->start[slot]);
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&ring.front, notify);
+	if (notify) {
+		err = tapdisk_uring_kick(&ring);
+		if (err && err != -EAGAIN)
+			return err;
+	}
+
+	return 0;
+}
+
+static void *
+bench_worker_run(void *arg)
+{
+	struct bench_worker *w = arg;
+	int err = 0;
+
+	pthread_mutex_lock(&lock);
+
+	while (!stop && !err) {
+		while (!stop && !w->n_free)
+			pthread_cond_wait(&w->cond, &lock);
+
+		while (!stop && w->n_free && !err)
+			err = bench_submit(w);
+	}
+
+	if (err) {
+		fprintf(stderr, "worker %d: kick failed: %s\n",
+			w->id, strerror(-err));
+		stop = 1;
+	}
+
+	while (w->inflight)
+		pthread_cond_wait(&w->cond, &lock);
+
+	if (!--running)
+		clock_gettime(CLOCK_MONOTONIC, &t_end);
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+static void *
+bench_timer_run(void *arg)
+{
+	int i;
+
+	sleep(opts.runtime);
+
+	pthread_mutex_lock(&lock);
+	stop = 1;
+	for (i = 0; i < opts.threads; i++)
+		pthread_cond_signal(&workers[i].cond);
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/* called with the lock held */
+static void
+bench_complete(const td_uring_response_t *rsp, const struct timespec *now)
+{
+	struct bench_worker *w;
+	uint64_t lat;
+	int slot, bucket;
+
+	w    = &workers[rsp->id >> 32];
+	slot = rsp->id & 0xffffffff;
+
+	lat = ts_delta_us(&w->start[slot], now);
+	for (bucket = 0; bucket < LAT_BUCKETS - 1 && (lat >> bucket) > 1;
+	     bucket++)
+		;
+
+	w->lat_hist[bucket]++;
+	w->lat_total += lat;
+	if (lat > w->lat_max)
+		w->lat_max = lat;
+
+	if (rsp->status != TD_URING_RSP_OKAY)
+		w->errors++;
+	else
+		w->ios[w->slot_op[slot]]++;
+
+	w->free_slots[w->n_free++] = slot;
+	w->inflight--;
+	pthread_cond_signal(&w->cond);
+}
+
+static void
+bench_reap(void)
+{
+	struct timespec now;
+	RING_IDX rp, rc;
+	int more, err;
+
+	pthread_mutex_lock(&lock);
+
+	while (running) {
+		rp = ring.front.sring->rsp_prod;
+		xen_rmb();
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (rc = ring.front.rsp_cons; rc != rp; rc++)
+			bench_complete(RING_GET_RESPONSE(&ring.front, rc),
+				       &now);
+		ring.front.rsp_cons = rc;
+
+		RING_FINAL_CHECK_FOR_RESPONSES(&ring.front, more);
+		if (more)
+			continue;
+
+		pthread_mutex_unlock(&lock);
+		err = tapdisk_uring_poll(&ring, 1);
+		pthread_mutex_lock(&lock);
+
+		if (err && err != -ETIMEDOUT) {
+			fprintf(stderr, "lost connection: %s\n",
+				strerror(-err));
+			exit(1);
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+bench_report(double elapsed)
+{
+	uint64_t ios[2] = { 0, 0 }, errors = 0, lat_total = 0, lat_max = 0;
+	uint64_t hist[LAT_BUCKETS], n, acc;
+	int i, b, p50 = -1, p99 = -1;
+
+	memset(hist, 0, sizeof(hist));
+
+	for (i = 0; i < opts.threads; i++) {
+		struct bench_worker *w = &workers[i];
+		uint64_t wios = w->ios[0] + w->ios[1];
+
+		printf("thread %d: read %"PRIu64" write %"PRIu64
+		       " errors %"PRIu64" iops %.0f\n", i, w->ios[0],
+		       w->ios[1], w->errors, wios / elapsed);
+
+		ios[0]    += w->ios[0];
+		ios[1]    += w->ios[1];
+		errors    += w->errors;
+		lat_total += w->lat_total;
+		if (w->lat_max > lat_max)
+			lat_max = w->lat_max;
+		for (b = 0; b < LAT_BUCKETS; b++)
+			hist[b] += w->lat_hist[b];
+	}
+
+	n = ios[0] + ios[1] + errors;
+	for (acc = 0, b = 0; b < LAT_BUCKETS && n; b++) {
+		acc += hist[b];
+		if (p50 < 0 && acc * 100 >= n * 50)
+			p50 = b;
+		if (p99 < 0 && acc * 100 >= n * 99)
+			p99 = b;
+	}
+
+	printf("read:  %"PRIu64" ios, %.0f iops, %.1f MiB/s\n", ios[0],
+	       ios[0] / elapsed, ios[0] * (double)opts.bs / elapsed / (1 << 20));
+	printf("write: %"PRIu64" ios, %.0f iops, %.1f MiB/s\n", ios[1],
+	       ios[1] / elapsed, ios[1] * (double)opts.bs / elapsed / (1 << 20));
+	printf("errors: %"PRIu64"\n", errors);
+	if (n)
+		printf("lat (usec): avg %"PRIu64", max %"PRIu64
+		       ", p50 < %llu, p99 < %llu\n", lat_total / n, lat_max,
+		       2ULL << p50, 2ULL << p99);
+}
+
+static uint32_t
+parse_size(const char *s)
+{
+	char *end;
+	unsigned long v;
+
+	v = strtoul(s, &end, 0);
+	switch (*end) {
+	case 'k': case 'K':
+		v <<= 10;
+		break;
+	case 'm': case 'M':
+		v <<= 20;
+		break;
+	}
+
+	return v;
+}
+
+static void
+usage(FILE *stream, const char *prog)
+{
+	fprintf(stream, "usage: %s <-l location | -p pid -m minor> "
+		"[-j threads] [-d depth per thread] [-b block size] "
+		"[-M read percentage] [-r random] [-t runtime seconds] "
+		"[-s span in sectors]\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *location = NULL;
+	struct timespec t0;
+	pthread_t timer;
+	double elapsed;
+	int c, i, err, pid = -1, minor = -1;
+	uint64_t secs, chunk;
+
+	opts.threads  = 1;
+	opts.depth    = 8;
+	opts.bs       = 4096;
+	opts.read_pct = 100;
+	opts.random   = 0;
+	opts.runtime  = 10;
+	opts.span     = 0;
+
+	while ((c = getopt(argc, argv, "l:p:m:j:d:b:M:rt:s:h")) != -1) {
+		switch (c) {
+		case 'l':
+			location = optarg;
+			break;
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'j':
+			opts.threads = atoi(optarg);
+			break;
+		case 'd':
+			opts.depth = atoi(optarg);
+			break;
+		case 'b':
+			opts.bs = parse_size(optarg);
+			break;
+		case 'M':
+			opts.read_pct = atoi(optarg);
+			break;
+		case 'r':
+			opts.random = 1;
+			break;
+		case 't':
+			opts.runtime = atoi(optarg);
+			break;
+		case 's':
+			opts.span = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(stdout, argv[0]);
+			return 0;
+		default:
+			goto usage;
+		}
+	}
+
+	if (!location) {
+		if (pid < 0 || minor < 0)
+			goto usage;
+		if (asprintf(&location, "%s%d.%d",
+			     TD_URING_PATH, pid, minor) == -1)
+			return ENOMEM;
+	}
+
+	if (opts.threads < 1 || opts.depth < 1 || !opts.bs ||
+	    opts.bs & ((1 << SECTOR_SHIFT) - 1) ||
+	    opts.read_pct < 0 || opts.read_pct > 100 || opts.runtime < 1)
+		goto usage;
+
+	err = tapdisk_uring_connect(&ring, location);
+	if (err) {
+		fprintf(stderr, "failed to connect to %s: %s\n",
+			location, strerror(-err));
+		return -err;
+	}
+
+	if ((uint64_t)opts.threads * opts.depth > RING_SIZE(&ring.front)) {
+		fprintf(stderr, "threads * depth exceeds ring size %u\n",
+			RING_SIZE(&ring.front));
+		return EINVAL;
+	}
+
+	if ((uint64_t)opts.threads * opts.depth * opts.bs > ring.data_size) {
+		fprintf(stderr, "threads * depth * bs exceeds data area "
+			"size %u\n", ring.data_size);
+		return EINVAL;
+	}
+
+	secs = opts.span && opts.span < ring.sectors ? opts.span : ring.sectors;
+	chunk = secs / opts.threads;
+	if (chunk < (opts.bs >> SECTOR_SHIFT)) {
+		fprintf(stderr, "disk too small for %d threads\n",
+			opts.threads);
+		return EINVAL;
+	}
+
+	workers = calloc(opts.threads, sizeof(*workers));
+	if (!workers)
+		return ENOMEM;
+
+	for (i = 0; i < opts.threads; i++) {
+		struct bench_worker *w = &workers[i];
+		int s;
+
+		w->id         = i;
+		w->seed       = time(NULL) ^ (i << 16);
+		w->free_slots = calloc(opts.depth, sizeof(int));
+		w->start      = calloc(opts.depth, sizeof(struct timespec));
+		w->slot_op    = calloc(opts.depth, sizeof(uint8_t));
+		if (!w->free_slots || !w->start || !w->slot_op)
+			return ENOMEM;
+
+		for (s = 0; s < opts.depth; s++)
+			w->free_slots[w->n_free++] = s;
+
+		/* random I/O covers the span, sequential streams split it */
+		w->first_sec = opts.random ? 0 : chunk * i;
+		w->last_sec  = opts.random ? secs : chunk * (i + 1);
+		w->next_sec  = w->first_sec;
+
+		pthread_cond_init(&w->cond, NULL);
+	}
+
+	printf("%s: %"PRIu64" sectors, %d threads, depth %d, bs %u, "
+	       "%d%% reads, %s\n", location, ring.sectors, opts.threads,
+	       opts.depth, opts.bs, opts.read_pct,
+	       opts.random ? "random" : "sequential");
+
+	running = opts.threads;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (i = 0; i < opts.threads; i++) {
+		err = pthread_create(&workers[i].thread, NULL,
+				     bench_worker_run, &workers[i]);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			return err;
+		}
+	}
+
+	err = pthread_create(&timer, NULL, bench_timer_run, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		return err;
+	}
+
+	bench_reap();
+
+	elapsed = ts_delta_us(&t0, &t_end) / 1000000.0;
+
+	pthread_join(timer, NULL);
+	for (i = 0; i < opts.threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	bench_report(elapsed);
+	tapdisk_uring_disconnect(&ring);
+
+	return 0;
+
+usage:
+	usage(stderr, argv[0]);
+	return EINVAL;
+}
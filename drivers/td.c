@@ -45,6 +45,8 @@
 #include "libvhd.h"
 #include "vhd-util.h"
 #include "tapdisk-utils.h"
+#include "tapdisk-disktype.h"
+#include "block-cz.h"
 
 #if 1
 #define DFPRINTF(_f, _a...) fprintf ( stdout, _f , ## _a )
@@ -100,12 +102,14 @@ struct command commands[TD_CMD_INVALID] = {
 typedef enum {
 	TD_TYPE_VHD         = 0,
 	TD_TYPE_AIO,
+	TD_TYPE_CZ,
 	TD_TYPE_INVALID,
 } td_disk_t;
 
 const char *td_disk_types[TD_TYPE_INVALID] = {
 	"vhd",
 	"aio",
+	"cz",
 };
 
 #define print_commands()						\
@@ -244,6 +248,15 @@ td_create(int type, int argc, char *argv[])
 		return vhd_util_create(cargc, cargv);
 	}
 
+	if (type == TD_TYPE_CZ) {
+		if (!sparse || fixedsize) {
+			fprintf(stderr, "cz images are always sparse\n");
+			return EINVAL;
+		}
+
+		return -tdcz_create(name, size, NULL, -1, 0);
+	}
+
 	/* generic create */
 	if (sparse) {
 		fprintf(stderr, "Cannot create sparse %s image\n",
@@ -281,6 +294,50 @@ td_create(int type, int argc, char *argv[])
 	return EINVAL;
 }
 
+/*
+ * A cz child of a raw (-m), cz or vhd parent, as large as the parent.
+ */
+static int
+td_snapshot_cz(const char *name, const char *backing, int rawparent)
+{
+	int fd, err, ptype;
+	uint64_t size, secs;
+	uint32_t ssize;
+
+	if (rawparent) {
+		fd = open(backing, O_RDONLY | O_LARGEFILE);
+		if (fd == -1)
+			return errno;
+
+		err = tapdisk_get_image_size(fd, &secs, &ssize);
+		close(fd);
+		if (err)
+			return -err;
+
+		ptype = DISK_TYPE_AIO;
+		size  = secs * ssize;
+
+	} else if (!tdcz_query(backing, &size, NULL, NULL)) {
+		ptype = DISK_TYPE_CZ;
+
+	} else {
+		vhd_context_t vhd;
+
+		err = vhd_open(&vhd, backing, VHD_OPEN_RDONLY);
+		if (err) {
+			fprintf(stderr, "%s is neither cz nor vhd: %d\n",
+				backing, err);
+			return -err;
+		}
+
+		ptype = DISK_TYPE_VHD;
+		size  = vhd.footer.curr_size;
+		vhd_close(&vhd);
+	}
+
+	return -tdcz_create(name, size, backing, ptype, 0);
+}
+
 int
 td_snapshot(int type, int argc, char *argv[])
 {
@@ -290,7 +347,7 @@ td_snapshot(int type, int argc, char *argv[])
 	char *name, *backing, *limit = NULL;
 	int fixedsize = 0, rawparent = 0;
 
-	if (type != TD_TYPE_VHD) {
+	if (type != TD_TYPE_VHD && type != TD_TYPE_CZ) {
 		fprintf(stderr, "Cannot create snapshot of %s image type\n",
 			td_disk_types[type]);
 		return EINVAL;
@@ -335,6 +392,15 @@ td_snapshot(int type, int argc, char *argv[])
 		return errno;
 	}
 
+	if (type == TD_TYPE_CZ) {
+		if (fixedsize || limit) {
+			fprintf(stderr, "-b and -l don't apply to cz images\n");
+			return EINVAL;
+		}
+
+		return td_snapshot_cz(name, backing, rawparent);
+	}
+
 	cargc = 0;
 	memset(cargv, 0, sizeof(cargv));
 	cargv[cargc++] = "snapshot";
@@ -509,6 +575,35 @@ td_query(int type, int argc, char *argv[])
 
 		vhd_close(&vhd);
 
+	} else if (type == TD_TYPE_CZ) {
+		uint64_t bytes;
+		char *pname;
+
+		err = tdcz_query(name, &bytes, &pname, NULL);
+		if (err) {
+			printf("failed opening %s: %d\n", name, err);
+			return -err;
+		}
+
+		if (size)
+			printf("%"PRIu64"\n", bytes >> 20);
+
+		if (parent) {
+			if (pname)
+				printf("%s\n", pname);
+			else
+				printf("%s has no parent\n", name);
+		}
+
+		if (fields) {
+			int i;
+
+			for (i = 0; i < TD_FIELD_INVALID; i++)
+				printf("%s: 0\n", td_vdi_fields[i].name);
+		}
+
+		free(pname);
+
 	} else if (type == TD_TYPE_AIO) {
 		if (size) {
 			int fd;
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VHD_AIO_H_
+#define _VHD_AIO_H_
+
+#include <inttypes.h>
+#include <sys/uio.h>
+
+#include "libvhd.h"
+
+/*
+ * Asynchronous, batched data I/O on VHD images.
+ *
+ * A vhd_aio_t is a submission/completion queue shared by any number of
+ * open contexts. Requests are prepared against a context, submitted in
+ * batches and completed through their callback from vhd_aio_reap() or
+ * vhd_aio_drain(). Requests beyond the queue depth wait inside the
+ * queue and are issued as earlier ones complete. Buffers follow the
+ * same alignment rules as the synchronous calls (O_DIRECT).
+ *
+ * The prep calls fill in everything but cb and data, which the caller
+ * sets before submitting. Callbacks may submit further requests but
+ * must not reap. vhd_aio_exec() runs a prepared request synchronously;
+ * vhd_read_bitmap, vhd_read_block and vhd_read_at are built on it.
+ */
+
+#define VHD_AIO_READ               0
+#define VHD_AIO_WRITE              1
+
+#define VHD_AIO_IOV_INLINE         4
+
+typedef struct vhd_aio             vhd_aio_t;
+typedef struct vhd_aio_request     vhd_aio_request_t;
+
+typedef void (*vhd_aio_cb_t)(vhd_aio_request_t *, int err);
+
+struct vhd_aio_request {
+	int                        op;
+	int                        fd;
+	const struct iovec        *iov;
+	int                        iovcnt;
+	off64_t                    offset;
+	size_t                     size;
+
+	vhd_aio_cb_t               cb;
+	void                      *data;
+
+	/* private */
+	struct iovec               _iov[VHD_AIO_IOV_INLINE];
+	size_t                     _zero;    /* bytes past EOF, zero-filled */
+	void                      *_iocb;
+	vhd_aio_request_t         *_next;
+};
+
+int vhd_aio_create(vhd_aio_t **, int depth);
+void vhd_aio_destroy(vhd_aio_t *);
+
+int vhd_aio_submit(vhd_aio_t *, vhd_aio_request_t **, int nr);
+int vhd_aio_reap(vhd_aio_t *, int min_nr, struct timespec *timeout);
+int vhd_aio_drain(vhd_aio_t *);
+int vhd_aio_pending(vhd_aio_t *);
+
+void vhd_aio_prep(vhd_aio_request_t *, vhd_context_t *, int op,
+		  const struct iovec *, int iovcnt, off64_t offset);
+void vhd_aio_prep_buf(vhd_aio_request_t *, vhd_context_t *, int op,
+		      void *buf, size_t size, off64_t offset);
+int vhd_aio_prep_bitmap(vhd_aio_request_t *, vhd_context_t *, int op,
+			uint32_t block, void *map);
+int vhd_aio_prep_block(vhd_aio_request_t *, vhd_context_t *, int op,
+		       uint32_t block, uint32_t from, void *buf, size_t size);
+
+int vhd_aio_exec(vhd_aio_request_t *);
+
+#endif
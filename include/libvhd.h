@@ -83,6 +83,8 @@
 #define VHD_OPEN_CACHED            0x00020
 #define VHD_OPEN_IO_WRITE_SPARSE   0x00040
 #define VHD_OPEN_USE_BKP_FOOTER    0x00080
+#define VHD_OPEN_BUFFERED          0x00100 /* no O_DIRECT, nor O_DSYNC:
+					    * the caller syncs */
 
 #define VHD_FLAG_CREAT_FILE_SIZE_FIXED   0x00001
 #define VHD_FLAG_CREAT_PARENT_RAW        0x00002
@@ -297,10 +299,14 @@ int vhd_snapshot(const char *snapshot, uint64_t bytes, const char *parent,
 
 int vhd_hidden(vhd_context_t *, int *);
 int vhd_chain_depth(vhd_context_t *, int *);
+int vhd_chain_depth_fast(vhd_context_t *, int *);
+int vhd_set_chain_depth(vhd_context_t *, int);
 int vhd_marker(vhd_context_t *, char *);   
 int vhd_set_marker(vhd_context_t *, char); 
 int vhd_get_keyhash(vhd_context_t *, struct vhd_keyhash *);
 int vhd_set_keyhash(vhd_context_t *, const struct vhd_keyhash *);
+int vhd_get_chain_hint(vhd_context_t *, struct vhd_chain_hint *);
+int vhd_set_chain_hint(vhd_context_t *, const struct vhd_chain_hint *);
 
 off64_t vhd_position(vhd_context_t *);
 int vhd_seek(vhd_context_t *, off64_t, int);
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VHDX_LIB_H_
+#define _VHDX_LIB_H_
+
+/*
+ * VHDX images, as described by the VHDX format specification v1.0.
+ *
+ * The first MiB holds the file identifier, two copies of the header and
+ * two copies of the region table. The region table locates the metadata
+ * region, which describes the virtual disk, and the BAT. The BAT has one
+ * entry per payload block, interleaved with one entry per sector bitmap
+ * block: every chunk of chunk_ratio payload blocks is followed by the
+ * entry of the bitmap block that tells, for differencing images, which
+ * sectors of those payload blocks are present. Every block is 1MiB
+ * aligned in the file. Metadata updates may be journalled in the log,
+ * which must be replayed before the image is used.
+ */
+
+#include <stdint.h>
+#include <endian.h>
+#include <sys/types.h>
+
+#if BYTE_ORDER != LITTLE_ENDIAN
+#error "VHDX support assumes a little-endian host"
+#endif
+
+#define VHDX_KiB                     (1ULL << 10)
+#define VHDX_MiB                     (1ULL << 20)
+#define VHDX_TiB                     (1ULL << 40)
+
+#define VHDX_FILE_SIGNATURE          0x656c696678646876ULL /* "vhdxfile" */
+#define VHDX_HEADER_SIGNATURE        0x64616568            /* "head" */
+#define VHDX_REGION_SIGNATURE        0x69676572            /* "regi" */
+#define VHDX_LOG_SIGNATURE           0x65676f6c            /* "loge" */
+#define VHDX_LOG_ZERO_SIGNATURE      0x6f72657a            /* "zero" */
+#define VHDX_LOG_DESC_SIGNATURE      0x63736564            /* "desc" */
+#define VHDX_LOG_DATA_SIGNATURE      0x61746164            /* "data" */
+#define VHDX_METADATA_SIGNATURE      0x617461646174656dULL /* "metadata" */
+
+#define VHDX_HEADER1_OFFSET          (64 * VHDX_KiB)
+#define VHDX_HEADER2_OFFSET          (128 * VHDX_KiB)
+#define VHDX_REGION1_OFFSET          (192 * VHDX_KiB)
+#define VHDX_REGION2_OFFSET          (256 * VHDX_KiB)
+#define VHDX_HEADER_SECTION_SIZE     VHDX_MiB
+
+#define VHDX_HEADER_SIZE             (4 * VHDX_KiB)
+#define VHDX_REGION_TABLE_SIZE       (64 * VHDX_KiB)
+#define VHDX_REGION_MAX_ENTRIES      2047
+#define VHDX_METADATA_TABLE_SIZE     (64 * VHDX_KiB)
+#define VHDX_METADATA_MAX_ENTRIES    2047
+#define VHDX_LOG_SECTOR_SIZE         (4 * VHDX_KiB)
+#define VHDX_LOG_DEFAULT_SIZE        VHDX_MiB
+
+#define VHDX_MIN_BLOCK_SIZE          VHDX_MiB
+#define VHDX_MAX_BLOCK_SIZE          (256 * VHDX_MiB)
+#define VHDX_DEFAULT_BLOCK_SIZE      (32 * VHDX_MiB)
+#define VHDX_MAX_SIZE                (64 * VHDX_TiB)
+#define VHDX_BITMAP_BLOCK_SIZE       VHDX_MiB
+#define VHDX_BITMAP_PAGE_SIZE        (4 * VHDX_KiB)
+
+/* BAT entries: state in the low bits, MiB file offset in the high ones */
+#define VHDX_BAT_STATE_MASK          0x7ULL
+#define VHDX_BAT_OFFSET_MASK         0xfffffffffff00000ULL
+
+#define PAYLOAD_BLOCK_NOT_PRESENT    0
+#define PAYLOAD_BLOCK_UNDEFINED      1
+#define PAYLOAD_BLOCK_ZERO           2
+#define PAYLOAD_BLOCK_UNMAPPED       3
+#define PAYLOAD_BLOCK_FULLY_PRESENT  6
+#define PAYLOAD_BLOCK_PARTIALLY_PRESENT 7
+
+#define SB_BLOCK_NOT_PRESENT         0
+#define SB_BLOCK_PRESENT             6
+
+/* file parameters flags */
+#define VHDX_PARAMS_LEAVE_BLOCKS_ALLOCATED 0x1
+#define VHDX_PARAMS_HAS_PARENT       0x2
+
+/* metadata entry flags */
+#define VHDX_META_IS_USER            0x1
+#define VHDX_META_IS_VIRTUAL_DISK    0x2
+#define VHDX_META_IS_REQUIRED        0x4
+
+#define VHDX_OPEN_RDONLY             0x00001
+#define VHDX_OPEN_RDWR               0x00002
+#define VHDX_OPEN_NOREPLAY           0x00004 /* leave a dirty log alone */
+
+typedef struct vhdx_guid {
+	uint32_t                     data1;
+	uint16_t                     data2;
+	uint16_t                     data3;
+	uint8_t                      data4[8];
+} __attribute__((packed)) vhdx_guid_t;
+
+#define VHDX_GUID(_a, _b, _c, _d0, _d1, _d2, _d3, _d4, _d5, _d6, _d7)	\
+	{ _a, _b, _c, { _d0, _d1, _d2, _d3, _d4, _d5, _d6, _d7 } }
+
+struct vhdx_file_identifier {
+	uint64_t                     signature;
+	uint16_t                     creator[256];
+} __attribute__((packed));
+
+struct vhdx_header {
+	uint32_t                     signature;
+	uint32_t                     checksum;
+	uint64_t                     sequence_number;
+	vhdx_guid_t                  file_write_guid;
+	vhdx_guid_t                  data_write_guid;
+	vhdx_guid_t                  log_guid;
+	uint16_t                     log_version;
+	uint16_t                     version;
+	uint32_t                     log_length;
+	uint64_t                     log_offset;
+	uint8_t                      reserved[4016];
+} __attribute__((packed));
+
+struct vhdx_region_table_header {
+	uint32_t                     signature;
+	uint32_t                     checksum;
+	uint32_t                     entry_count;
+	uint32_t                     reserved;
+} __attribute__((packed));
+
+struct vhdx_region_entry {
+	vhdx_guid_t                  guid;
+	uint64_t                     file_offset;
+	uint32_t                     length;
+	uint32_t                     required;
+} __attribute__((packed));
+
+struct vhdx_log_entry_header {
+	uint32_t                     signature;
+	uint32_t                     checksum;
+	uint32_t                     entry_length;
+	uint32_t                     tail;
+	uint64_t                     sequence_number;
+	uint32_t                     descriptor_count;
+	uint32_t                     reserved;
+	vhdx_guid_t                  log_guid;
+	uint64_t                     flushed_file_offset;
+	uint64_t                     last_file_offset;
+} __attribute__((packed));
+
+struct vhdx_log_descriptor {
+	uint32_t                     signature;
+	uint32_t                     trailing_bytes; /* zero_length for "zero" */
+	uint64_t                     leading_bytes;  /* ... continued */
+	uint64_t                     file_offset;
+	uint64_t                     sequence_number;
+} __attribute__((packed));
+
+struct vhdx_log_data_sector {
+	uint32_t                     signature;
+	uint32_t                     sequence_high;
+	uint8_t                      data[4084];
+	uint32_t                     sequence_low;
+} __attribute__((packed));
+
+struct vhdx_metadata_table_header {
+	uint64_t                     signature;
+	uint16_t                     reserved;
+	uint16_t                     entry_count;
+	uint32_t                     reserved2[5];
+} __attribute__((packed));
+
+struct vhdx_metadata_entry {
+	vhdx_guid_t                  item_id;
+	uint32_t                     offset;
+	uint32_t                     length;
+	uint32_t                     flags;
+	uint32_t                     reserved;
+} __attribute__((packed));
+
+struct vhdx_file_parameters {
+	uint32_t                     block_size;
+	uint32_t                     flags;
+} __attribute__((packed));
+
+struct vhdx_parent_locator_header {
+	vhdx_guid_t                  locator_type;
+	uint16_t                     reserved;
+	uint16_t                     key_value_count;
+} __attribute__((packed));
+
+struct vhdx_parent_locator_entry {
+	uint32_t                     key_offset;
+	uint32_t                     value_offset;
+	uint16_t                     key_length;
+	uint16_t                     value_length;
+} __attribute__((packed));
+
+typedef struct vhdx_context {
+	int                          fd;
+	char                        *file;
+	int                          oflags;
+
+	struct vhdx_header           header;
+	int                          header_slot;    /* 0 or 1 */
+
+	struct vhdx_region_entry     bat_region;
+	struct vhdx_region_entry     meta_region;
+
+	uint64_t                     size;           /* virtual, in bytes */
+	uint32_t                     block_size;
+	uint32_t                     logical_sector_size;
+	uint32_t                     physical_sector_size;
+	uint32_t                     params_flags;
+	vhdx_guid_t                  disk_id;
+
+	uint32_t                     chunk_ratio;
+	uint64_t                     data_blocks;
+	uint64_t                     bitmap_blocks;
+	uint64_t                     bat_entries;
+	uint64_t                    *bat;            /* BAT region image */
+
+	char                        *parent_linkage; /* "{guid}" */
+	char                        *parent;         /* parent file name */
+
+	int                          log_replayed;
+	int                          log_dirty;      /* NOREPLAY, not replayed */
+} vhdx_context_t;
+
+static inline int
+vhdx_has_parent(const vhdx_context_t *ctx)
+{
+	return !!(ctx->params_flags & VHDX_PARAMS_HAS_PARENT);
+}
+
+static inline uint64_t
+vhdx_bat_index(const vhdx_context_t *ctx, uint64_t block)
+{
+	return block + block / ctx->chunk_ratio;
+}
+
+static inline uint64_t
+vhdx_bitmap_index(const vhdx_context_t *ctx, uint64_t block)
+{
+	uint64_t chunk = block / ctx->chunk_ratio;
+	return chunk * (ctx->chunk_ratio + 1) + ctx->chunk_ratio;
+}
+
+static inline int
+vhdx_bat_state(uint64_t entry)
+{
+	return entry & VHDX_BAT_STATE_MASK;
+}
+
+static inline uint64_t
+vhdx_bat_offset(uint64_t entry)
+{
+	return entry & VHDX_BAT_OFFSET_MASK;
+}
+
+static inline uint64_t
+vhdx_bat_entry(int state, uint64_t offset)
+{
+	return (offset & VHDX_BAT_OFFSET_MASK) | (uint64_t)state;
+}
+
+/*
+ * Offset of the sector bitmap of @block within its sector bitmap block.
+ */
+static inline uint64_t
+vhdx_bitmap_block_offset(const vhdx_context_t *ctx, uint64_t block)
+{
+	uint64_t secs = ctx->block_size / ctx->logical_sector_size;
+	return (block % ctx->chunk_ratio) * (secs >> 3);
+}
+
+uint32_t vhdx_checksum(const void *buf, size_t len, size_t crc_offset);
+
+void vhdx_guid_generate(vhdx_guid_t *guid);
+int vhdx_guid_is_zero(const vhdx_guid_t *guid);
+void vhdx_guid_to_string(const vhdx_guid_t *guid, char *out /* 39 bytes */);
+int vhdx_guid_from_string(const char *str, vhdx_guid_t *guid);
+
+int vhdx_open(vhdx_context_t *ctx, const char *file, int flags);
+void vhdx_close(vhdx_context_t *ctx);
+
+int vhdx_validate_header(const struct vhdx_header *header);
+int vhdx_update_header(vhdx_context_t *ctx, int data_write);
+
+int vhdx_create(const char *name, uint64_t bytes, uint32_t block_size,
+		uint32_t logical_sector_size, const char *parent);
+int vhdx_snapshot(const char *name, const char *parent, uint32_t block_size);
+
+#endif
@@ -138,6 +138,39 @@ int tap_ctl_pause(const int id, const int minor, struct timeval *timeout);
 int tap_ctl_unpause(const int id, const int minor, const char *params,
 		int flags, char *secondary, const char *logpath);
 
+/**
+ * Starts coalescing the VBD's leaf into its parent in the background, or
+ * stops a running coalesce. Progress shows up under "coalesce" in the
+ * VBD's stats.
+ */
+int tap_ctl_coalesce(const int id, const int minor, const int abort);
+
+/**
+ * Exposes the VBD as a mainline ublk block device, /dev/ublkb<dev_id>,
+ * with @nr_queues hardware queues of @depth requests each. Zero picks
+ * tapdisk's defaults.
+ */
+int tap_ctl_ublk_create(const int id, const int minor, const int nr_queues,
+		const int depth, int *dev_id);
+
+/**
+ * Removes the VBD's ublk device.
+ */
+int tap_ctl_ublk_destroy(const int id, const int minor);
+
+/**
+ * Attaches /dev/nbd<*index> to the VBD over @connections in-process
+ * connections, one kernel queue each. A negative *index picks a free
+ * device; the one used is returned in *index.
+ */
+int tap_ctl_nbd_attach(const int id, const int minor, const int connections,
+		int *index);
+
+/**
+ * Disconnects the VBD's kernel NBD device.
+ */
+int tap_ctl_nbd_detach(const int id, const int minor);
+
 ssize_t tap_ctl_stats(pid_t pid, int minor, char *buf, size_t size);
 int tap_ctl_stats_fwrite(pid_t pid, int minor, FILE *out);
 
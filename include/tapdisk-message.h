@@ -56,6 +56,12 @@
 #define TAPDISK_MESSAGE_FLAG_STANDBY     0x100
 #define TAPDISK_MESSAGE_FLAG_NO_O_DIRECT 0x200
 #define TAPDISK_MESSAGE_FLAG_OPEN_ENCRYPTED 0x400
+#define TAPDISK_MESSAGE_FLAG_LOCAL_RING  0x800
+#define TAPDISK_MESSAGE_FLAG_RESYNC      0x1000
+#define TAPDISK_MESSAGE_FLAG_ASYNC_MIRROR 0x2000
+#define TAPDISK_MESSAGE_FLAG_READAHEAD   0x4000
+#define TAPDISK_MESSAGE_FLAG_ABORT       0x8000
+#define TAPDISK_MESSAGE_FLAG_BUFFERED_IO 0x10000
 
 typedef struct tapdisk_message           tapdisk_message_t;
 typedef uint32_t                         tapdisk_message_flag_t;
@@ -66,6 +72,8 @@ typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
 typedef struct tapdisk_message_stat      tapdisk_message_stat_t;
+typedef struct tapdisk_message_ublk      tapdisk_message_ublk_t;
+typedef struct tapdisk_message_nbd       tapdisk_message_nbd_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -111,6 +119,17 @@ struct tapdisk_message_stat {
 	size_t                           length;
 };
 
+struct tapdisk_message_ublk {
+	uint16_t                         nr_queues;
+	uint16_t                         queue_depth;
+	int32_t                          dev_id;
+};
+
+struct tapdisk_message_nbd {
+	uint16_t                         connections;
+	int32_t                          index;
+};
+
 /**
  * Tapdisk message containing all the necessary information required for the
  * tapdisk to connect to a guest's blkfront.
@@ -198,6 +217,8 @@ struct tapdisk_message {
 		tapdisk_message_list_t     list;
 		tapdisk_message_stat_t     info;
 		tapdisk_message_blkif_t    blkif;
+		tapdisk_message_ublk_t     ublk;
+		tapdisk_message_nbd_t      nbd;
         tapdisk_message_resume_t   resume;
 	} u;
 };
@@ -233,9 +254,19 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_DISK_INFO,
 	TAPDISK_MESSAGE_DISK_INFO_RSP,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_COALESCE, /* 31 */
+	TAPDISK_MESSAGE_COALESCE_RSP,
+	TAPDISK_MESSAGE_UBLK_CREATE, /* 33 */
+	TAPDISK_MESSAGE_UBLK_CREATE_RSP,
+	TAPDISK_MESSAGE_UBLK_DESTROY,
+	TAPDISK_MESSAGE_UBLK_DESTROY_RSP,
+	TAPDISK_MESSAGE_NBD_ATTACH, /* 37 */
+	TAPDISK_MESSAGE_NBD_ATTACH_RSP,
+	TAPDISK_MESSAGE_NBD_DETACH,
+	TAPDISK_MESSAGE_NBD_DETACH_RSP,
 };
 
-#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_EXIT
+#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_NBD_DETACH_RSP
 
 static inline char *
 tapdisk_message_name(enum tapdisk_message_id id)
@@ -328,6 +359,36 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_COALESCE:
+		return "coalesce";
+
+	case TAPDISK_MESSAGE_COALESCE_RSP:
+		return "coalesce response";
+
+	case TAPDISK_MESSAGE_UBLK_CREATE:
+		return "ublk create";
+
+	case TAPDISK_MESSAGE_UBLK_CREATE_RSP:
+		return "ublk create response";
+
+	case TAPDISK_MESSAGE_UBLK_DESTROY:
+		return "ublk destroy";
+
+	case TAPDISK_MESSAGE_UBLK_DESTROY_RSP:
+		return "ublk destroy response";
+
+	case TAPDISK_MESSAGE_NBD_ATTACH:
+		return "nbd attach";
+
+	case TAPDISK_MESSAGE_NBD_ATTACH_RSP:
+		return "nbd attach response";
+
+	case TAPDISK_MESSAGE_NBD_DETACH:
+		return "nbd detach";
+
+	case TAPDISK_MESSAGE_NBD_DETACH_RSP:
+		return "nbd detach response";
+
 	default:
 		return "unknown";
 	}
@@ -47,4 +47,6 @@ int vhd_util_revert(int argc, char **argv);
 int vhd_util_key(int argc, char **argv);
 int vhd_util_copy(int argc, char **argv);
 
+int vhdx_util_check(int argc, char **argv);
+
 #endif
@@ -162,6 +162,17 @@ struct vhd_keyhash {
   uint8_t hash[32];       /* SHA256 sum of nonce appended by keyhash     */
 };
 
+/*
+ * Cached depth of the chain below an image, valid for as long as the
+ * image keeps the parent it was computed against.
+ */
+struct vhd_chain_hint {
+  uint8_t cookie;         /* 1 if the hint is set, 0 otherwise           */
+  uint8_t depth;          /* chain depth, this image included            */
+  uint8_t prt_uuid[16];   /* parent uuid the depth was computed against  */
+  uint8_t prt_ts[4];      /* parent timestamp, big-endian                */
+};
+
 struct dd_batmap_hdr {
   char        cookie[8];       /* should contain "tdbatmap"                    */
   uint64_t    batmap_offset;   /* byte offset to batmap                        */
@@ -170,7 +181,8 @@ struct dd_batmap_hdr {
   uint32_t    checksum;        /* batmap checksum -- 1's complement of batmap  */
   char        marker;          /* generic marker field                         */
   struct vhd_keyhash keyhash;  /* nonce & SHA256 hash of encryption key   */
-  char   res[418];        /* reserved                                     */
+  struct vhd_chain_hint chain; /* cached chain depth                           */
+  char   res[396];        /* reserved                                     */
 };
 
 static const char VHD_BATMAP_COOKIE[9] = "tdbatmap";
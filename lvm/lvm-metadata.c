@@ -0,0 +1,1319 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Native reader for LVM2 on-disk metadata.
+ *
+ * Each PV carries a label in one of its first four sectors, pointing at
+ * one or more metadata areas. A metadata area starts with a header
+ * locating the current copy of the VG metadata, a text description
+ * within a circular buffer. Every PV with a metadata area holds a copy;
+ * the one with the highest sequence number wins.
+ *
+ * Parsed metadata is cached under LVM_CACHE_DIR, keyed on the sequence
+ * number and checksum of the text, so that a scan of an unchanged VG
+ * reads no more than a few sectors per device.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lvm-util.h"
+#include "lvm-util-priv.h"
+#include "util.h"
+
+#define EPRINTF(_f, _a...)					\
+	do {							\
+		syslog(LOG_INFO, "%s: " _f, __func__, ##_a);	\
+	} while (0)
+
+#define LVM_SECTOR_SIZE          512
+#define LVM_LABEL_SCAN_SECTORS   4
+#define LVM_LABEL_ID             "LABELONE"
+#define LVM_LABEL_TYPE           "LVM2 001"
+#define LVM_MDA_MAGIC            " LVM2 x[5A%r0N*>"
+#define LVM_MDA_HEADER_SIZE      512
+#define LVM_MDA_VERSION          1
+#define LVM_RAW_LOCN_IGNORED     0x1
+#define LVM_INITIAL_CRC          0xf597a6cf
+#define LVM_ID_LEN               32
+#define LVM_IO_ALIGN             4096
+#define LVM_TEXT_HEAD            4096
+#define LVM_TEXT_MAX             (128 << 20)
+
+#define LVM_CACHE_MAGIC          "lvm-util-cache 1"
+
+struct lvm_label_header {
+	char                     id[8];
+	uint64_t                 sector_xl;
+	uint32_t                 crc_xl;
+	uint32_t                 offset_xl;
+	char                     type[8];
+} __attribute__((packed));
+
+struct lvm_disk_locn {
+	uint64_t                 offset;
+	uint64_t                 size;
+} __attribute__((packed));
+
+struct lvm_pv_header {
+	char                     pv_uuid[LVM_ID_LEN];
+	uint64_t                 device_size_xl;
+	struct lvm_disk_locn     disk_areas_xl[0];
+} __attribute__((packed));
+
+struct lvm_raw_locn {
+	uint64_t                 offset;
+	uint64_t                 size;
+	uint32_t                 checksum;
+	uint32_t                 flags;
+} __attribute__((packed));
+
+struct lvm_mda_header {
+	uint32_t                 checksum_xl;
+	char                     magic[16];
+	uint32_t                 version;
+	uint64_t                 start;
+	uint64_t                 size;
+	struct lvm_raw_locn      raw_locns[0];
+} __attribute__((packed));
+
+/*
+ * A labelled device, and where its copy of the metadata is.
+ */
+struct lvm_pv_dev {
+	char                     name[MAX_NAME_SIZE];
+	char                     uuid[LVM_ID_LEN + 1];
+
+	int                      has_mda;
+	uint64_t                 mda_start;
+	uint64_t                 mda_size;
+	uint64_t                 text_offset;  /* within the area */
+	uint64_t                 text_size;
+	uint32_t                 text_checksum;
+
+	char                     vg_name[MAX_NAME_SIZE];
+	uint64_t                 seqno;
+};
+
+/*
+ * The parts of the metadata lvm_scan_vg reports, with PVs referred to
+ * by uuid: device names are not part of the metadata.
+ */
+struct lvm_md_pv {
+	char                     uuid[LVM_ID_LEN + 1];
+	char                     key[MAX_NAME_SIZE];
+	uint64_t                 pe_start;     /* bytes */
+};
+
+struct lvm_md_lv {
+	char                     name[MAX_NAME_SIZE];
+	uint64_t                 extents;
+	uint32_t                 segments;
+	int                      type;
+	int                      pv;           /* of the first segment */
+	uint64_t                 pv_extent;
+	uint64_t                 seg_extents;
+};
+
+struct lvm_md {
+	uint64_t                 seqno;
+	uint32_t                 checksum;
+	uint64_t                 extent_size;  /* bytes */
+	int                      pv_cnt;
+	struct lvm_md_pv        *pvs;
+	int                      lv_cnt;
+	struct lvm_md_lv        *lvs;
+};
+
+const char *lvm_cache_dir = LVM_CACHE_DIR;
+
+/*
+ * CRC-32 (0xedb88320), without the final inversion, seeded with
+ * LVM_INITIAL_CRC by the callers.
+ */
+uint32_t
+lvm_calc_crc(uint32_t crc, const void *buf, size_t size)
+{
+	static uint32_t table[256];
+	const uint8_t *p = buf;
+	uint32_t i, j, c;
+
+	if (!table[1])
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (j = 0; j < 8; j++)
+				c = (c >> 1) ^ (c & 1 ? 0xedb88320 : 0);
+			table[i] = c;
+		}
+
+	while (size--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+static int
+lvm_copy_name(char *dst, const char *src, size_t size)
+{
+	if (strnlen(src, size) == size)
+		return -ENAMETOOLONG;
+
+	safe_strncpy(dst, src, size);
+	return 0;
+}
+
+/*
+ * Reads @len bytes at @off, whatever the alignment: the devices are
+ * opened O_DIRECT, so that metadata written by other hosts is seen.
+ */
+static int
+lvm_pread(int fd, void *dst, size_t len, uint64_t off)
+{
+	uint64_t start = off & ~((uint64_t)LVM_IO_ALIGN - 1);
+	size_t size = (off + len - start + LVM_IO_ALIGN - 1) &
+		~((size_t)LVM_IO_ALIGN - 1);
+	ssize_t n;
+	char *buf;
+	int err;
+
+	err = posix_memalign((void **)&buf, LVM_IO_ALIGN, size);
+	if (err)
+		return -err;
+
+	n = pread(fd, buf, size, start);
+	if (n < 0)
+		err = -errno;
+	else if ((uint64_t)n < off - start + len)
+		err = -EIO;
+	else
+		memcpy(dst, buf + (off - start), len);
+
+	free(buf);
+	return err;
+}
+
+static int
+lvm_open_device(const char *name)
+{
+	int fd;
+
+	fd = open(name, O_RDONLY | O_DIRECT | O_LARGEFILE);
+	if (fd == -1 && errno == EINVAL)
+		fd = open(name, O_RDONLY | O_LARGEFILE);
+
+	return fd;
+}
+
+/*
+ * Reads up to @len bytes of the current metadata text of @pv.
+ */
+static int
+lvm_read_text(int fd, const struct lvm_pv_dev *pv, size_t len, char **_text)
+{
+	uint64_t off = pv->text_offset, first;
+	char *text;
+	int err;
+
+	*_text = NULL;
+
+	if (pv->text_size > LVM_TEXT_MAX)
+		return -EINVAL;
+
+	if (len > pv->text_size)
+		len = pv->text_size;
+
+	text = malloc(len + 1);
+	if (!text)
+		return -ENOMEM;
+
+	/* the text wraps around to the start of the buffer */
+	first = pv->mda_size - off;
+	if (first > len)
+		first = len;
+
+	err = lvm_pread(fd, text, first, pv->mda_start + off);
+	if (!err && first < len)
+		err = lvm_pread(fd, text + first, len - first,
+				pv->mda_start + LVM_MDA_HEADER_SIZE);
+	if (err)
+		goto fail;
+
+	text[len] = '\0';
+	*_text = text;
+	return 0;
+
+fail:
+	free(text);
+	return err;
+}
+
+/*
+ * The VG name and sequence number, from the head of the text.
+ */
+static int
+lvm_parse_text_head(struct lvm_pv_dev *pv, const char *text)
+{
+	const char *p;
+	size_t n;
+
+	for (p = text; *p && (isspace(*p) || *p == '#'); p++)
+		if (*p == '#')
+			p += strcspn(p, "\n") - 1;
+
+	n = strcspn(p, " \t\n{");
+	if (!n || n >= sizeof(pv->vg_name))
+		return -EINVAL;
+
+	memcpy(pv->vg_name, p, n);
+	pv->vg_name[n] = '\0';
+
+	p = strstr(p, "seqno");
+	if (!p || sscanf(p, "seqno = %"SCNu64, &pv->seqno) != 1)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int
+lvm_probe_mda(int fd, struct lvm_pv_dev *pv, uint64_t start, uint64_t size)
+{
+	struct lvm_mda_header *mh;
+	struct lvm_raw_locn *rl;
+	char buf[LVM_MDA_HEADER_SIZE], *head;
+	int err;
+
+	err = lvm_pread(fd, buf, sizeof(buf), start);
+	if (err)
+		return err;
+
+	mh = (struct lvm_mda_header *)buf;
+	if (memcmp(mh->magic, LVM_MDA_MAGIC, sizeof(mh->magic)) ||
+	    le32toh(mh->version) != LVM_MDA_VERSION ||
+	    le64toh(mh->start) != start ||
+	    le32toh(mh->checksum_xl) !=
+	    lvm_calc_crc(LVM_INITIAL_CRC, buf + sizeof(mh->checksum_xl),
+			 sizeof(buf) - sizeof(mh->checksum_xl)))
+		return -EINVAL;
+
+	rl = mh->raw_locns;
+	if (!rl->offset || (le32toh(rl->flags) & LVM_RAW_LOCN_IGNORED))
+		return -ENOENT;
+
+	pv->mda_start     = start;
+	pv->mda_size      = le64toh(mh->size);
+	pv->text_offset   = le64toh(rl->offset);
+	pv->text_size     = le64toh(rl->size);
+	pv->text_checksum = le32toh(rl->checksum);
+
+	if (pv->text_offset < LVM_MDA_HEADER_SIZE ||
+	    pv->text_offset >= pv->mda_size ||
+	    pv->text_size > pv->mda_size - LVM_MDA_HEADER_SIZE || size < pv->mda_size)
+		return -EINVAL;
+
+	err = lvm_read_text(fd, pv, LVM_TEXT_HEAD, &head);
+	if (err)
+		return err;
+
+	err = lvm_parse_text_head(pv, head);
+	free(head);
+	if (err)
+		return err;
+
+	pv->has_mda = 1;
+	return 0;
+}
+
+/*
+ * Looks for a PV label on @name. Returns 0 for a PV, -ENOENT for
+ * anything else.
+ */
+static int
+lvm_probe_device(const char *name, struct lvm_pv_dev *pv)
+{
+	char buf[LVM_LABEL_SCAN_SECTORS * LVM_SECTOR_SIZE], *sec = NULL;
+	struct lvm_label_header *lh;
+	struct lvm_pv_header *ph;
+	struct lvm_disk_locn *dl;
+	int i, fd, err, areas;
+
+	memset(pv, 0, sizeof(*pv));
+
+	err = lvm_copy_name(pv->name, name, sizeof(pv->name));
+	if (err)
+		return err;
+
+	fd = lvm_open_device(name);
+	if (fd == -1)
+		return -errno;
+
+	err = lvm_pread(fd, buf, sizeof(buf), 0);
+	if (err)
+		goto out;
+
+	err = -ENOENT;
+	for (i = 0; i < LVM_LABEL_SCAN_SECTORS; i++) {
+		sec = buf + i * LVM_SECTOR_SIZE;
+		lh  = (struct lvm_label_header *)sec;
+
+		if (!memcmp(lh->id, LVM_LABEL_ID, sizeof(lh->id)) &&
+		    !memcmp(lh->type, LVM_LABEL_TYPE, sizeof(lh->type)) &&
+		    le64toh(lh->sector_xl) == i &&
+		    le32toh(lh->crc_xl) ==
+		    lvm_calc_crc(LVM_INITIAL_CRC, &lh->offset_xl,
+				 LVM_SECTOR_SIZE -
+				 offsetof(struct lvm_label_header, offset_xl)))
+			break;
+	}
+	if (i == LVM_LABEL_SCAN_SECTORS)
+		goto out;
+
+	if (le32toh(lh->offset_xl) + sizeof(*ph) > LVM_SECTOR_SIZE) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	ph = (struct lvm_pv_header *)(sec + le32toh(lh->offset_xl));
+	memcpy(pv->uuid, ph->pv_uuid, LVM_ID_LEN);
+
+	/* data areas, then metadata areas, each list ending with a null */
+	dl    = ph->disk_areas_xl;
+	areas = 0;
+	while ((char *)(dl + 1) <= sec + LVM_SECTOR_SIZE) {
+		if (!dl->offset) {
+			if (++areas == 2)
+				break;
+		} else if (areas == 1 &&
+			   !lvm_probe_mda(fd, pv, le64toh(dl->offset),
+					  le64toh(dl->size)))
+			break;
+		dl++;
+	}
+
+	err = 0;
+
+out:
+	close(fd);
+	return err;
+}
+
+/*
+ * Configuration text: sections of key = value settings, values being
+ * strings, numbers or arrays of them.
+ */
+enum {
+	LVM_CFT_SECTION,
+	LVM_CFT_STRING,
+	LVM_CFT_NUMBER,
+	LVM_CFT_ARRAY,
+};
+
+struct lvm_cft {
+	char                    *key;
+	int                      type;
+	char                    *str;
+	int64_t                  num;
+	struct lvm_cft          *child;
+	struct lvm_cft          *next;
+};
+
+struct lvm_parser {
+	const char              *p;
+	int                      depth;
+};
+
+static void
+lvm_cft_free(struct lvm_cft *n)
+{
+	struct lvm_cft *next;
+
+	for (; n; n = next) {
+		next = n->next;
+		lvm_cft_free(n->child);
+		free(n->key);
+		free(n->str);
+		free(n);
+	}
+}
+
+static void
+lvm_skip_space(struct lvm_parser *ps)
+{
+	for (;;) {
+		while (isspace(*ps->p))
+			ps->p++;
+		if (*ps->p != '#')
+			return;
+		ps->p += strcspn(ps->p, "\n");
+	}
+}
+
+static char *
+lvm_parse_ident(struct lvm_parser *ps)
+{
+	const char *s = ps->p;
+
+	while (isalnum(*ps->p) || strchr("_.+-/", *ps->p))
+		ps->p++;
+
+	return ps->p == s ? NULL : strndup(s, ps->p - s);
+}
+
+static char *
+lvm_parse_string(struct lvm_parser *ps)
+{
+	char *str, *d;
+	const char *s;
+
+	s = ++ps->p;
+	while (*ps->p && *ps->p != '"')
+		ps->p += (*ps->p == '\\' && ps->p[1]) ? 2 : 1;
+	if (*ps->p != '"')
+		return NULL;
+
+	str = malloc(ps->p - s + 1);
+	if (!str)
+		return NULL;
+
+	for (d = str; s < ps->p; s++) {
+		if (*s == '\\')
+			s++;
+		*d++ = *s;
+	}
+	*d = '\0';
+
+	ps->p++;
+	return str;
+}
+
+static struct lvm_cft *
+lvm_parse_value(struct lvm_parser *ps)
+{
+	struct lvm_cft *n, **tail;
+	char *end;
+
+	n = calloc(1, sizeof(*n));
+	if (!n)
+		return NULL;
+
+	lvm_skip_space(ps);
+
+	if (*ps->p == '"') {
+		n->type = LVM_CFT_STRING;
+		n->str  = lvm_parse_string(ps);
+		if (!n->str)
+			goto fail;
+		return n;
+	}
+
+	if (*ps->p == '[') {
+		n->type = LVM_CFT_ARRAY;
+		tail    = &n->child;
+		ps->p++;
+
+		for (;;) {
+			lvm_skip_space(ps);
+			if (*ps->p == ']')
+				break;
+
+			*tail = lvm_parse_value(ps);
+			if (!*tail)
+				goto fail;
+			tail = &(*tail)->next;
+
+			lvm_skip_space(ps);
+			if (*ps->p == ',')
+				ps->p++;
+			else if (*ps->p != ']')
+				goto fail;
+		}
+
+		ps->p++;
+		return n;
+	}
+
+	n->type = LVM_CFT_NUMBER;
+	n->num  = strtoll(ps->p, &end, 10);
+	if (end == ps->p)
+		goto fail;
+
+	/* floats are of no interest here */
+	ps->p = end;
+	if (*ps->p == '.')
+		strtod(ps->p, (char **)&ps->p);
+
+	return n;
+
+fail:
+	lvm_cft_free(n);
+	return NULL;
+}
+
+static int
+lvm_parse_section(struct lvm_parser *ps, int nested, struct lvm_cft **out)
+{
+	struct lvm_cft *head = NULL, **tail = &head, *n;
+	char *key;
+	int err;
+
+	if (++ps->depth > 16)
+		goto fail;
+
+	for (;;) {
+		lvm_skip_space(ps);
+
+		if (!*ps->p) {
+			if (nested)
+				goto fail;
+			break;
+		}
+
+		if (*ps->p == '}') {
+			if (!nested)
+				goto fail;
+			ps->p++;
+			break;
+		}
+
+		key = lvm_parse_ident(ps);
+		if (!key)
+			goto fail;
+
+		lvm_skip_space(ps);
+
+		n = NULL;
+		if (*ps->p == '{') {
+			ps->p++;
+			n = calloc(1, sizeof(*n));
+			if (n) {
+				n->type = LVM_CFT_SECTION;
+				err = lvm_parse_section(ps, 1, &n->child);
+				if (err) {
+					free(n);
+					n = NULL;
+				}
+			}
+		} else if (*ps->p == '=') {
+			ps->p++;
+			n = lvm_parse_value(ps);
+		}
+
+		if (!n) {
+			free(key);
+			goto fail;
+		}
+
+		n->key = key;
+		*tail  = n;
+		tail   = &n->next;
+	}
+
+	ps->depth--;
+	*out = head;
+	return 0;
+
+fail:
+	lvm_cft_free(head);
+	ps->depth--;
+	*out = NULL;
+	return -EINVAL;
+}
+
+static struct lvm_cft *
+lvm_cft_find(struct lvm_cft *section, const char *key, int type)
+{
+	struct lvm_cft *n;
+
+	for (n = section ? section->child : NULL; n; n = n->next)
+		if (!strcmp(n->key, key))
+			return n->type == type ? n : NULL;
+
+	return NULL;
+}
+
+static int
+lvm_cft_number(struct lvm_cft *section, const char *key, uint64_t *val)
+{
+	struct lvm_cft *n = lvm_cft_find(section, key, LVM_CFT_NUMBER);
+
+	if (!n || n->num < 0)
+		return -EINVAL;
+
+	*val = n->num;
+	return 0;
+}
+
+static int
+lvm_cft_has_flag(struct lvm_cft *section, const char *key, const char *flag)
+{
+	struct lvm_cft *n = lvm_cft_find(section, key, LVM_CFT_ARRAY);
+
+	for (n = n ? n->child : NULL; n; n = n->next)
+		if (n->type == LVM_CFT_STRING && !strcmp(n->str, flag))
+			return 1;
+
+	return 0;
+}
+
+static void
+lvm_strip_uuid(char *dst, const char *id)
+{
+	int i;
+
+	for (i = 0; *id && i < LVM_ID_LEN; id++)
+		if (*id != '-')
+			dst[i++] = *id;
+	dst[i] = '\0';
+}
+
+static void
+lvm_md_free(struct lvm_md *md)
+{
+	free(md->pvs);
+	free(md->lvs);
+	memset(md, 0, sizeof(*md));
+}
+
+static int
+lvm_md_parse_pvs(struct lvm_md *md, struct lvm_cft *pvs)
+{
+	struct lvm_cft *n, *id;
+	struct lvm_md_pv *pv;
+	uint64_t pe_start;
+	int err;
+
+	for (n = pvs->child; n; n = n->next)
+		if (n->type == LVM_CFT_SECTION)
+			md->pv_cnt++;
+
+	md->pvs = calloc(md->pv_cnt, sizeof(*md->pvs));
+	if (!md->pvs)
+		return -ENOMEM;
+
+	pv = md->pvs;
+	for (n = pvs->child; n; n = n->next) {
+		if (n->type != LVM_CFT_SECTION)
+			continue;
+
+		id = lvm_cft_find(n, "id", LVM_CFT_STRING);
+		if (!id || lvm_cft_number(n, "pe_start", &pe_start))
+			return -EINVAL;
+
+		err = lvm_copy_name(pv->key, n->key, sizeof(pv->key));
+		if (err)
+			return err;
+
+		lvm_strip_uuid(pv->uuid, id->str);
+		pv->pe_start = pe_start * LVM_SECTOR_SIZE;
+		pv++;
+	}
+
+	return 0;
+}
+
+static int
+lvm_md_find_pv(struct lvm_md *md, const char *key)
+{
+	int i;
+
+	for (i = 0; i < md->pv_cnt; i++)
+		if (!strcmp(md->pvs[i].key, key))
+			return i;
+
+	return -1;
+}
+
+static int
+lvm_md_parse_lv(struct lvm_md *md, struct lvm_md_lv *lv, struct lvm_cft *sec)
+{
+	uint64_t start, count, stripes, segs;
+	struct lvm_cft *n, *type, *area;
+	int err, first = 0;
+
+	err = lvm_copy_name(lv->name, sec->key, sizeof(lv->name));
+	if (err)
+		return err;
+
+	if (lvm_cft_number(sec, "segment_count", &segs))
+		return -EINVAL;
+
+	lv->segments = segs;
+	lv->type     = LVM_SEG_TYPE_UNKNOWN;
+	lv->pv       = -1;
+
+	for (n = sec->child; n; n = n->next) {
+		if (n->type != LVM_CFT_SECTION || strncmp(n->key, "segment", 7))
+			continue;
+
+		if (lvm_cft_number(n, "start_extent", &start) ||
+		    lvm_cft_number(n, "extent_count", &count))
+			return -EINVAL;
+
+		lv->extents += count;
+
+		if (start || first++)
+			continue;
+
+		lv->seg_extents = count;
+
+		type = lvm_cft_find(n, "type", LVM_CFT_STRING);
+		if (type && !strcmp(type->str, "striped") &&
+		    !lvm_cft_number(n, "stripe_count", &stripes) &&
+		    stripes == 1)
+			lv->type = LVM_SEG_TYPE_LINEAR;
+
+		/* stripes = [ "pv0", 0, ... ] */
+		area = lvm_cft_find(n, "stripes", LVM_CFT_ARRAY);
+		area = area ? area->child : NULL;
+		if (area && area->type == LVM_CFT_STRING && area->next &&
+		    area->next->type == LVM_CFT_NUMBER) {
+			lv->pv        = lvm_md_find_pv(md, area->str);
+			lv->pv_extent = area->next->num;
+			if (lv->pv < 0)
+				return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int
+lvm_md_lv_compare(const void *a, const void *b)
+{
+	const struct lvm_md_lv *x = a, *y = b;
+	return strcmp(x->name, y->name);
+}
+
+/*
+ * Picks out the VG description from the text. Like lvs, only visible
+ * LVs are reported, sorted by name.
+ */
+static int
+lvm_md_parse(const char *text, const char *vg_name, struct lvm_md *md)
+{
+	struct lvm_cft *root, *vg, *pvs, *lvs, *n;
+	struct lvm_parser ps = { .p = text, .depth = 0 };
+	uint64_t extent_size;
+	int err = -EINVAL;
+
+	root = calloc(1, sizeof(*root));
+	if (!root)
+		return -ENOMEM;
+
+	root->type = LVM_CFT_SECTION;
+	if (lvm_parse_section(&ps, 0, &root->child)) {
+		EPRINTF("malformed metadata for VG %s\n", vg_name);
+		goto out;
+	}
+
+	vg = lvm_cft_find(root, vg_name, LVM_CFT_SECTION);
+	if (!vg) {
+		EPRINTF("no metadata for VG %s\n", vg_name);
+		goto out;
+	}
+
+	if (lvm_cft_number(vg, "seqno", &md->seqno) ||
+	    lvm_cft_number(vg, "extent_size", &extent_size))
+		goto out;
+	md->extent_size = extent_size * LVM_SECTOR_SIZE;
+
+	pvs = lvm_cft_find(vg, "physical_volumes", LVM_CFT_SECTION);
+	if (!pvs)
+		goto out;
+
+	err = lvm_md_parse_pvs(md, pvs);
+	if (err)
+		goto out;
+
+	lvs = lvm_cft_find(vg, "logical_volumes", LVM_CFT_SECTION);
+	for (n = lvs ? lvs->child : NULL; n; n = n->next)
+		if (n->type == LVM_CFT_SECTION &&
+		    lvm_cft_has_flag(n, "status", "VISIBLE"))
+			md->lv_cnt++;
+
+	err = -ENOMEM;
+	md->lvs = calloc(md->lv_cnt ? : 1, sizeof(*md->lvs));
+	if (!md->lvs)
+		goto out;
+
+	md->lv_cnt = 0;
+	for (n = lvs ? lvs->child : NULL; n; n = n->next) {
+		if (n->type != LVM_CFT_SECTION ||
+		    !lvm_cft_has_flag(n, "status", "VISIBLE"))
+			continue;
+
+		err = lvm_md_parse_lv(md, md->lvs + md->lv_cnt, n);
+		if (err) {
+			EPRINTF("bad metadata for LV %s\n", n->key);
+			goto out;
+		}
+		md->lv_cnt++;
+	}
+
+	qsort(md->lvs, md->lv_cnt, sizeof(*md->lvs), lvm_md_lv_compare);
+	err = 0;
+
+out:
+	if (err)
+		lvm_md_free(md);
+	lvm_cft_free(root);
+	return err;
+}
+
+static int
+lvm_cache_path(const char *vg_name, char **path)
+{
+	return asprintf(path, "%s/%s", lvm_cache_dir, vg_name) == -1 ?
+		-ENOMEM : 0;
+}
+
+/*
+ * Loads the cached metadata of @vg_name if it is still current.
+ */
+static int
+lvm_cache_load(const char *vg_name, uint64_t seqno, uint32_t checksum,
+	       struct lvm_md *md)
+{
+	char magic[32], name[MAX_NAME_SIZE];
+	struct lvm_md_pv *pv;
+	struct lvm_md_lv *lv;
+	FILE *f = NULL;
+	char *path;
+	int i, err;
+
+	memset(md, 0, sizeof(*md));
+
+	err = lvm_cache_path(vg_name, &path);
+	if (err)
+		return err;
+
+	err = -ENOENT;
+	f   = fopen(path, "r");
+	if (!f)
+		goto out;
+
+	if (!fgets(magic, sizeof(magic), f) ||
+	    strncmp(magic, LVM_CACHE_MAGIC"\n", sizeof(magic)) ||
+	    fscanf(f, "vg %255s %"SCNu64" %"SCNu32" %"SCNu64" %d %d\n",
+		   name, &md->seqno, &md->checksum, &md->extent_size,
+		   &md->pv_cnt, &md->lv_cnt) != 6 ||
+	    strcmp(name, vg_name) || md->seqno != seqno ||
+	    md->checksum != checksum || md->pv_cnt < 0 || md->lv_cnt < 0)
+		goto out;
+
+	err = -ENOMEM;
+	md->pvs = calloc(md->pv_cnt ? : 1, sizeof(*md->pvs));
+	md->lvs = calloc(md->lv_cnt ? : 1, sizeof(*md->lvs));
+	if (!md->pvs || !md->lvs)
+		goto out;
+
+	err = -EINVAL;
+	for (i = 0; i < md->pv_cnt; i++) {
+		pv = md->pvs + i;
+		if (fscanf(f, "pv %32s %255s %"SCNu64"\n",
+			   pv->uuid, pv->key, &pv->pe_start) != 3)
+			goto out;
+	}
+
+	for (i = 0; i < md->lv_cnt; i++) {
+		lv = md->lvs + i;
+		if (fscanf(f, "lv %255s %"SCNu64" %"SCNu32" %d %d %"SCNu64
+			   " %"SCNu64"\n", lv->name, &lv->extents,
+			   &lv->segments, &lv->type, &lv->pv, &lv->pv_extent,
+			   &lv->seg_extents) != 7 ||
+		    lv->pv >= md->pv_cnt)
+			goto out;
+	}
+
+	err = 0;
+
+out:
+	if (err)
+		lvm_md_free(md);
+	if (f)
+		fclose(f);
+	free(path);
+	return err;
+}
+
+/*
+ * Best effort: the cache only saves work.
+ */
+static void
+lvm_cache_store(const char *vg_name, const struct lvm_md *md)
+{
+	const struct lvm_md_pv *pv;
+	const struct lvm_md_lv *lv;
+	char *path, *tmp = NULL;
+	FILE *f;
+	int i, fd;
+
+	if (lvm_cache_path(vg_name, &path))
+		return;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) == -1) {
+		tmp = NULL;
+		goto out;
+	}
+
+	mkdir(lvm_cache_dir, 0700);
+
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		goto out;
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+
+	fprintf(f, LVM_CACHE_MAGIC"\n");
+	fprintf(f, "vg %s %"PRIu64" %"PRIu32" %"PRIu64" %d %d\n",
+		vg_name, md->seqno, md->checksum, md->extent_size,
+		md->pv_cnt, md->lv_cnt);
+
+	for (i = 0; i < md->pv_cnt; i++) {
+		pv = md->pvs + i;
+		fprintf(f, "pv %s %s %"PRIu64"\n",
+			pv->uuid, pv->key, pv->pe_start);
+	}
+
+	for (i = 0; i < md->lv_cnt; i++) {
+		lv = md->lvs + i;
+		fprintf(f, "lv %s %"PRIu64" %"PRIu32" %d %d %"PRIu64" %"PRIu64
+			"\n", lv->name, lv->extents, lv->segments, lv->type,
+			lv->pv, lv->pv_extent, lv->seg_extents);
+	}
+
+	if (fclose(f) || rename(tmp, path))
+		unlink(tmp);
+
+out:
+	free(tmp);
+	free(path);
+}
+
+static int
+lvm_md_to_vg(const char *vg_name, const struct lvm_md *md,
+	     const struct lvm_pv_dev *devs, int n_devs, struct vg *vg)
+{
+	const struct lvm_md_lv *mlv;
+	struct lv_segment *seg;
+	struct lv *lv;
+	int i, j, err;
+
+	memset(vg, 0, sizeof(*vg));
+
+	err = lvm_copy_name(vg->name, vg_name, sizeof(vg->name) - 1);
+	if (err)
+		return err;
+
+	err = -ENOMEM;
+	vg->pvs = calloc(md->pv_cnt ? : 1, sizeof(struct pv));
+	vg->lvs = calloc(md->lv_cnt ? : 1, sizeof(struct lv));
+	if (!vg->pvs || !vg->lvs)
+		goto fail;
+
+	vg->extent_size = md->extent_size;
+	vg->pv_cnt      = md->pv_cnt;
+	vg->lv_cnt      = md->lv_cnt;
+
+	for (i = 0; i < md->pv_cnt; i++) {
+		for (j = 0; j < n_devs; j++)
+			if (!strcmp(devs[j].uuid, md->pvs[i].uuid))
+				break;
+
+		if (j == n_devs) {
+			EPRINTF("PV %s of VG %s not found\n",
+				md->pvs[i].uuid, vg_name);
+			err = -ENODEV;
+			goto fail;
+		}
+
+		safe_strncpy(vg->pvs[i].name, devs[j].name,
+			     sizeof(vg->pvs[i].name));
+		vg->pvs[i].start = md->pvs[i].pe_start;
+	}
+
+	for (i = 0; i < md->lv_cnt; i++) {
+		mlv = md->lvs + i;
+		lv  = vg->lvs + i;
+		seg = &lv->first_segment;
+
+		safe_strncpy(lv->name, mlv->name, sizeof(lv->name));
+		lv->size     = mlv->extents * md->extent_size;
+		lv->segments = mlv->segments;
+
+		seg->type    = mlv->type;
+		seg->pe_size = mlv->seg_extents * md->extent_size;
+		if (mlv->pv >= 0) {
+			safe_strncpy(seg->device, vg->pvs[mlv->pv].name,
+				     sizeof(seg->device));
+			seg->pe_start = mlv->pv_extent * md->extent_size +
+				vg->pvs[mlv->pv].start;
+		}
+	}
+
+	return 0;
+
+fail:
+	lvm_free_vg(vg);
+	return err;
+}
+
+int
+lvm_scan_vg_devices(const char *vg_name, char **devices, int n_devices,
+		    struct vg *vg)
+{
+	struct lvm_pv_dev *devs, *best = NULL;
+	int i, n = 0, fd, err;
+	struct lvm_md md;
+	char *text;
+
+	memset(&md, 0, sizeof(md));
+
+	devs = calloc(n_devices ? : 1, sizeof(*devs));
+	if (!devs)
+		return -ENOMEM;
+
+	for (i = 0; i < n_devices; i++) {
+		if (lvm_probe_device(devices[i], &devs[n]))
+			continue;
+
+		if (devs[n].has_mda && !strcmp(devs[n].vg_name, vg_name) &&
+		    (!best || devs[n].seqno > best->seqno))
+			best = &devs[n];
+		n++;
+	}
+
+	err = -ENOENT;
+	if (!best)
+		goto out;
+
+	err = lvm_cache_load(vg_name, best->seqno, best->text_checksum, &md);
+	if (!err)
+		goto found;
+
+	fd = lvm_open_device(best->name);
+	if (fd == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	err = lvm_read_text(fd, best, best->text_size, &text);
+	close(fd);
+	if (err)
+		goto out;
+
+	if (lvm_calc_crc(LVM_INITIAL_CRC, text, best->text_size) !=
+	    best->text_checksum) {
+		EPRINTF("%s: metadata checksum mismatch\n", best->name);
+		free(text);
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = lvm_md_parse(text, vg_name, &md);
+	free(text);
+	if (err)
+		goto out;
+
+	if (md.seqno != best->seqno) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	md.checksum = best->text_checksum;
+	lvm_cache_store(vg_name, &md);
+
+found:
+	err = lvm_md_to_vg(vg_name, &md, devs, n, vg);
+
+out:
+	lvm_md_free(&md);
+	free(devs);
+	return err;
+}
+
+static int
+lvm_sysfs_read(const char *dev, const char *attr, char *buf, size_t size)
+{
+	char *path;
+	FILE *f;
+	int err = -ENOENT;
+
+	if (asprintf(&path, "/sys/class/block/%s/%s", dev, attr) == -1)
+		return -ENOMEM;
+
+	f = fopen(path, "r");
+	if (f) {
+		if (fgets(buf, size, f)) {
+			buf[strcspn(buf, "\n")] = '\0';
+			err = 0;
+		}
+		fclose(f);
+	}
+
+	free(path);
+	return err;
+}
+
+static int
+lvm_has_holders(const char *dev)
+{
+	struct dirent *d;
+	char *path;
+	DIR *dir;
+	int held = 0;
+
+	if (asprintf(&path, "/sys/class/block/%s/holders", dev) == -1)
+		return 0;
+
+	dir = opendir(path);
+	if (dir) {
+		while ((d = readdir(dir)))
+			if (d->d_name[0] != '.') {
+				held = 1;
+				break;
+			}
+		closedir(dir);
+	}
+
+	free(path);
+	return held;
+}
+
+/*
+ * Block devices that may be PVs, named as the LVM tools would. Devices
+ * held by another (multipath components, md members) are left out in
+ * favour of their holder, as are LVs. LVM's own device filters are not
+ * applied: only devices with a PV label matter anyway.
+ */
+int
+lvm_list_devices(char ***_devices, int *_n)
+{
+	char line[256], name[128], dm[MAX_NAME_SIZE], **devices = NULL, **tmp;
+	unsigned long long blocks;
+	int n = 0, err = 0;
+	char *dev, *p;
+	FILE *f;
+
+	f = fopen("/proc/partitions", "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, " %*u %*u %llu %127s", &blocks, name) != 2 ||
+		    !blocks || lvm_has_holders(name))
+			continue;
+
+		if (!strncmp(name, "dm-", 3)) {
+			if (!lvm_sysfs_read(name, "dm/uuid", dm, sizeof(dm)) &&
+			    !strncmp(dm, "LVM-", 4))
+				continue;
+			if (lvm_sysfs_read(name, "dm/name", dm, sizeof(dm)))
+				continue;
+			err = asprintf(&dev, "/dev/mapper/%s", dm);
+		} else {
+			for (p = name; *p; p++)
+				if (*p == '!')
+					*p = '/';
+			err = asprintf(&dev, "/dev/%s", name);
+		}
+
+		if (err == -1) {
+			err = -ENOMEM;
+			break;
+		}
+		err = 0;
+
+		tmp = realloc(devices, (n + 1) * sizeof(char *));
+		if (!tmp) {
+			free(dev);
+			err = -ENOMEM;
+			break;
+		}
+
+		devices      = tmp;
+		devices[n++] = dev;
+	}
+
+	fclose(f);
+
+	if (err) {
+		lvm_free_devices(devices, n);
+		return err;
+	}
+
+	*_devices = devices;
+	*_n       = n;
+	return 0;
+}
+
+void
+lvm_free_devices(char **devices, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		free(devices[i]);
+	free(devices);
+}
+
+int
+lvm_scan_vg_native(const char *vg_name, struct vg *vg)
+{
+	char **devices;
+	int n, err;
+
+	err = lvm_list_devices(&devices, &n);
+	if (err)
+		return err;
+
+	err = lvm_scan_vg_devices(vg_name, devices, n, vg);
+	lvm_free_devices(devices, n);
+
+	return err;
+}
@@ -30,12 +30,34 @@
 
 #ifndef _LVM_UTIL_PRIV_H
 #define _LVM_UTIL_PRIV_H
+#include <stddef.h>
 #include "lvm-util.h"
 
+#define LVM_CACHE_DIR "/var/run/blktap/lvm"
+
+extern const char *lvm_cache_dir;
+
 int
 lvm_scan_vg(const char *vg_name, struct vg *vg);
 
 void
 lvm_free_vg(struct vg *vg);
 
+/* native metadata reader */
+uint32_t
+lvm_calc_crc(uint32_t crc, const void *buf, size_t size);
+
+int
+lvm_list_devices(char ***devices, int *n);
+
+void
+lvm_free_devices(char **devices, int n);
+
+int
+lvm_scan_vg_devices(const char *vg_name, char **devices, int n_devices,
+		    struct vg *vg);
+
+int
+lvm_scan_vg_native(const char *vg_name, struct vg *vg);
+
 #endif /*_LVM_UTIL_PRIV_H*/
@@ -39,6 +39,7 @@
 #include <syslog.h>
 
 #include "lvm-util.h"
+#include "lvm-util-priv.h"
 #include "util.h"
 
 #define EPRINTF(_f, _a...)					\
@@ -316,8 +317,8 @@ lvm_free_vg(struct vg *vg)
 	memset(vg, 0, sizeof(*vg));
 }
 
-int
-lvm_scan_vg(const char *vg_name, struct vg *vg)
+static int
+lvm_scan_vg_tools(const char *vg_name, struct vg *vg)
 {
 	int err;
 
@@ -335,3 +336,22 @@ lvm_scan_vg(const char *vg_name, struct vg *vg)
 
 	return 0;
 }
+
+/*
+ * Reads the metadata off the PVs, falling back to the LVM tools for
+ * what the native reader can't make sense of.
+ */
+int
+lvm_scan_vg(const char *vg_name, struct vg *vg)
+{
+	int err;
+
+	err = lvm_scan_vg_native(vg_name, vg);
+	if (!err)
+		return 0;
+
+	EPRINTF("native scan of %s failed: %d, running lvm tools\n",
+		vg_name, err);
+
+	return lvm_scan_vg_tools(vg_name, vg);
+}
@@ -69,6 +69,13 @@ void test_tap_ctl_list_success_one_td_no_minor_no_path(void **state);
 void test_tap_ctl_list_success_one_td_one_minor_no_path(void **state);
 void test_tap_ctl_list_success(void **state);
 
+/* tap-ctl ublk tests */
+void test_tap_ctl_ublk_create_success(void **state);
+void test_tap_ctl_ublk_create_error_response(void **state);
+void test_tap_ctl_ublk_create_unexpected_response(void **state);
+void test_tap_ctl_ublk_destroy_success(void **state);
+void test_tap_ctl_ublk_destroy_error_response(void **state);
+
 static const struct CMUnitTest tap_ctl_allocate_tests[] = {
 	cmocka_unit_test(test_tap_ctl_allocate_prep_dir_no_access),
 	cmocka_unit_test(test_tap_ctl_allocate_no_device_info),
@@ -103,4 +110,12 @@ static const struct CMUnitTest tap_ctl_list_tests[] = {
 	cmocka_unit_test(test_tap_ctl_list_success)
 };
 
+static const struct CMUnitTest tap_ctl_ublk_tests[] = {
+	cmocka_unit_test(test_tap_ctl_ublk_create_success),
+	cmocka_unit_test(test_tap_ctl_ublk_create_error_response),
+	cmocka_unit_test(test_tap_ctl_ublk_create_unexpected_response),
+	cmocka_unit_test(test_tap_ctl_ublk_destroy_success),
+	cmocka_unit_test(test_tap_ctl_ublk_destroy_error_response)
+};
+
 #endif /* __TEST_SUITES_H__ */
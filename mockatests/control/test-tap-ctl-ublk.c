@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2017, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include <wrappers.h>
+#include "control-wrappers.h"
+#include "util.h"
+#include "test-suites.h"
+
+#include "tap-ctl.h"
+#include "blktap2.h"
+
+void test_tap_ctl_ublk_create_success(void **state)
+{
+	int result;
+	int dev_id = -1;
+	int test_pid = 1345;
+	int test_minor = 17;
+	int ipc_socket = 7;
+	char *expected_sock_name = "/var/run/blktap-control/ctl1345";
+	struct mock_ipc_params *ipc_params;
+	tapdisk_message_t write_message;
+	tapdisk_message_t read_message;
+
+	memset(&write_message, 0, sizeof(write_message));
+	write_message.type = TAPDISK_MESSAGE_UBLK_CREATE;
+	write_message.cookie = test_minor;
+	write_message.u.ublk.nr_queues = 2;
+	write_message.u.ublk.queue_depth = 64;
+
+	memset(&read_message, 0, sizeof(read_message));
+	read_message.type = TAPDISK_MESSAGE_UBLK_CREATE_RSP;
+	read_message.cookie = test_minor;
+	read_message.u.ublk.dev_id = 3;
+
+	ipc_params = setup_ipc(
+		expected_sock_name, ipc_socket,
+		&write_message, &read_message, 1);
+
+	/* Call test API */
+	result = tap_ctl_ublk_create(test_pid, test_minor, 2, 64, &dev_id);
+
+	assert_int_equal(0, result);
+	assert_int_equal(3, dev_id);
+
+	free_ipc_params(ipc_params);
+}
+
+void test_tap_ctl_ublk_create_error_response(void **state)
+{
+	int result;
+	int dev_id = -1;
+	int test_pid = 1345;
+	int test_minor = 17;
+	int ipc_socket = 7;
+	char *expected_sock_name = "/var/run/blktap-control/ctl1345";
+	struct mock_ipc_params *ipc_params;
+	tapdisk_message_t write_message;
+	tapdisk_message_t read_message;
+
+	memset(&write_message, 0, sizeof(write_message));
+	write_message.type = TAPDISK_MESSAGE_UBLK_CREATE;
+	write_message.cookie = test_minor;
+	write_message.u.ublk.nr_queues = 1;
+	write_message.u.ublk.queue_depth = 128;
+
+	memset(&read_message, 0, sizeof(read_message));
+	read_message.type = TAPDISK_MESSAGE_ERROR;
+	read_message.cookie = test_minor;
+	read_message.u.response.error = EEXIST;
+
+	ipc_params = setup_ipc(
+		expected_sock_name, ipc_socket,
+		&write_message, &read_message, 1);
+
+	/* Call test API */
+	result = tap_ctl_ublk_create(test_pid, test_minor, 1, 128, &dev_id);
+
+	assert_int_equal(-EEXIST, result);
+	assert_int_equal(-1, dev_id);
+
+	free_ipc_params(ipc_params);
+}
+
+void test_tap_ctl_ublk_create_unexpected_response(void **state)
+{
+	int result;
+	int test_pid = 1345;
+	int test_minor = 17;
+	int ipc_socket = 7;
+	char *expected_sock_name = "/var/run/blktap-control/ctl1345";
+	struct mock_ipc_params *ipc_params;
+	tapdisk_message_t write_message;
+	tapdisk_message_t read_message;
+
+	memset(&write_message, 0, sizeof(write_message));
+	write_message.type = TAPDISK_MESSAGE_UBLK_CREATE;
+	write_message.cookie = test_minor;
+	write_message.u.ublk.nr_queues = 1;
+	write_message.u.ublk.queue_depth = 128;
+
+	memset(&read_message, 0, sizeof(read_message));
+	read_message.type = TAPDISK_MESSAGE_UBLK_DESTROY_RSP;
+	read_message.cookie = test_minor;
+
+	ipc_params = setup_ipc(
+		expected_sock_name, ipc_socket,
+		&write_message, &read_message, 1);
+
+	/* Call test API */
+	result = tap_ctl_ublk_create(test_pid, test_minor, 1, 128, NULL);
+
+	assert_int_equal(-EINVAL, result);
+
+	free_ipc_params(ipc_params);
+}
+
+void test_tap_ctl_ublk_destroy_success(void **state)
+{
+	int result;
+	int test_pid = 1345;
+	int test_minor = 17;
+	int ipc_socket = 7;
+	char *expected_sock_name = "/var/run/blktap-control/ctl1345";
+	struct mock_ipc_params *ipc_params;
+	tapdisk_message_t write_message;
+	tapdisk_message_t read_message;
+
+	memset(&write_message, 0, sizeof(write_message));
+	write_message.type = TAPDISK_MESSAGE_UBLK_DESTROY;
+	write_message.cookie = test_minor;
+
+	memset(&read_message, 0, sizeof(read_message));
+	read_message.type = TAPDISK_MESSAGE_UBLK_DESTROY_RSP;
+	read_message.cookie = test_minor;
+
+	ipc_params = setup_ipc(
+		expected_sock_name, ipc_socket,
+		&write_message, &read_message, 1);
+
+	/* Call test API */
+	result = tap_ctl_ublk_destroy(test_pid, test_minor);
+
+	assert_int_equal(0, result);
+
+	free_ipc_params(ipc_params);
+}
+
+void test_tap_ctl_ublk_destroy_error_response(void **state)
+{
+	int result;
+	int test_pid = 1345;
+	int test_minor = 17;
+	int ipc_socket = 7;
+	char *expected_sock_name = "/var/run/blktap-control/ctl1345";
+	struct mock_ipc_params *ipc_params;
+	tapdisk_message_t write_message;
+	tapdisk_message_t read_message;
+
+	memset(&write_message, 0, sizeof(write_message));
+	write_message.type = TAPDISK_MESSAGE_UBLK_DESTROY;
+	write_message.cookie = test_minor;
+
+	memset(&read_message, 0, sizeof(read_message));
+	read_message.type = TAPDISK_MESSAGE_ERROR;
+	read_message.cookie = test_minor;
+	read_message.u.response.error = ENODEV;
+
+	ipc_params = setup_ipc(
+		expected_sock_name, ipc_socket,
+		&write_message, &read_message, 1);
+
+	/* Call test API */
+	result = tap_ctl_ublk_destroy(test_pid, test_minor);
+
+	assert_int_equal(-ENODEV, result);
+
+	free_ipc_params(ipc_params);
+}
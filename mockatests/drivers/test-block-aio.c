@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE /* Needed for SEEK_DATA */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test-suites.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "block-aio.h"
+
+extern struct tap_disk tapdisk_aio;
+
+#define IMAGE_SECS	2048		/* 1MiB */
+#define DATA_SEC	512		/* 4KiB of data at 256KiB */
+#define DATA_SECS	8
+
+struct aio_test {
+	char		path[64];
+	td_driver_t	driver;
+	struct tiocb   *queued;
+	struct {
+		td_sector_t sec;
+		int	    secs;
+		int	    status;
+		int	    err;
+	} done[16];
+	int		ndone;
+};
+
+static struct aio_test *current;
+
+static void
+test_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
+		long long offset, td_queue_callback_t cb, void *arg)
+{
+	memset(tiocb, 0, sizeof(*tiocb));
+	tiocb->cb  = cb;
+	tiocb->arg = arg;
+}
+
+static void
+test_queue_tiocb(struct tiocb *tiocb)
+{
+	current->queued = tiocb;
+}
+
+static void
+test_request_done(td_request_t treq, int err)
+{
+	struct aio_test *t = treq.cb_data;
+
+	assert_in_range(t->ndone, 0, 15);
+	t->done[t->ndone].sec    = treq.sec;
+	t->done[t->ndone].secs   = treq.secs;
+	t->done[t->ndone].status = treq.status;
+	t->done[t->ndone].err    = err;
+	t->ndone++;
+}
+
+static void
+test_block_status(struct aio_test *t, td_sector_t sec, int secs)
+{
+	td_request_t treq;
+
+	bzero(&treq, sizeof(treq));
+	treq.op      = TD_OP_BLOCK_STATUS;
+	treq.sec     = sec;
+	treq.secs    = secs;
+	treq.cb      = test_request_done;
+	treq.cb_data = t;
+
+	t->ndone = 0;
+	tapdisk_aio.td_queue_block_status(&t->driver, treq);
+}
+
+static struct tiocb *
+test_write(struct aio_test *t, td_sector_t sec, int secs)
+{
+	td_request_t treq;
+
+	bzero(&treq, sizeof(treq));
+	treq.op      = TD_OP_WRITE;
+	treq.sec     = sec;
+	treq.secs    = secs;
+	treq.cb      = test_request_done;
+	treq.cb_data = t;
+
+	t->queued = NULL;
+	tapdisk_aio.td_queue_write(&t->driver, treq);
+	assert_non_null(t->queued);
+
+	return t->queued;
+}
+
+/*
+ * A 1MiB sparse image with a single 4KiB data extent in the middle.
+ * Returns 0 when the filesystem does not report the hole, so the
+ * caller can skip.
+ */
+static int
+test_open_image(struct aio_test *t)
+{
+	char buf[DATA_SECS << SECTOR_SHIFT];
+	int fd, err;
+
+	bzero(t, sizeof(*t));
+	current = t;
+
+	strcpy(t->path, "/tmp/test-block-aio-XXXXXX");
+	fd = mkstemp(t->path);
+	assert_true(fd >= 0);
+
+	assert_int_equal(ftruncate(fd, IMAGE_SECS << SECTOR_SHIFT), 0);
+	memset(buf, 0xa5, sizeof(buf));
+	assert_int_equal(pwrite(fd, buf, sizeof(buf),
+				DATA_SEC << SECTOR_SHIFT), sizeof(buf));
+	assert_int_equal(fsync(fd), 0);
+
+	if (lseek(fd, 0, SEEK_DATA) != DATA_SEC << SECTOR_SHIFT) {
+		close(fd);
+		unlink(t->path);
+		return 0;
+	}
+	close(fd);
+
+	t->driver.ops        = &tapdisk_aio;
+	t->driver.data       = calloc(1, tapdisk_aio.private_data_size);
+	t->driver.prep_func  = test_prep_tiocb;
+	t->driver.queue_func = test_queue_tiocb;
+	assert_non_null(t->driver.data);
+
+	err = tapdisk_aio.td_open(&t->driver, t->path, NULL,
+				  TD_OPEN_RDONLY | TD_OPEN_BUFFERED);
+	assert_int_equal(err, 0);
+	assert_int_equal(t->driver.info.size, IMAGE_SECS);
+
+	return 1;
+}
+
+static void
+test_close_image(struct aio_test *t)
+{
+	tapdisk_aio.td_close(&t->driver);
+	free(t->driver.data);
+	unlink(t->path);
+	current = NULL;
+}
+
+static void
+assert_extent(struct aio_test *t, int i,
+	      td_sector_t sec, int secs, int status)
+{
+	assert_int_equal(t->done[i].err, 0);
+	assert_int_equal(t->done[i].sec, sec);
+	assert_int_equal(t->done[i].secs, secs);
+	assert_int_equal(t->done[i].status, status);
+}
+
+#define HOLE (TD_BLOCK_STATE_HOLE | TD_BLOCK_STATE_ZERO)
+#define DATA TD_BLOCK_STATE_NONE
+
+void
+test_aio_block_status_splits_extents(void **state)
+{
+	struct aio_test t;
+	struct tdaio_state *prv;
+
+	if (!test_open_image(&t))
+		return;
+	prv = t.driver.data;
+
+	test_block_status(&t, 0, IMAGE_SECS);
+
+	assert_int_equal(t.ndone, 3);
+	assert_extent(&t, 0, 0, DATA_SEC, HOLE);
+	assert_extent(&t, 1, DATA_SEC, DATA_SECS, DATA);
+	assert_extent(&t, 2, DATA_SEC + DATA_SECS,
+		      IMAGE_SECS - DATA_SEC - DATA_SECS, HOLE);
+	assert_int_equal(prv->extent_misses, 3);
+	assert_int_equal(prv->extent_hits, 0);
+
+	test_close_image(&t);
+}
+
+void
+test_aio_block_status_cache_hits(void **state)
+{
+	struct aio_test t;
+	struct tdaio_state *prv;
+
+	if (!test_open_image(&t))
+		return;
+	prv = t.driver.data;
+
+	test_block_status(&t, 0, IMAGE_SECS);
+	test_block_status(&t, 0, IMAGE_SECS);
+
+	assert_int_equal(t.ndone, 3);
+	assert_int_equal(prv->extent_misses, 3);
+	assert_int_equal(prv->extent_hits, 3);
+
+	/* a query starting mid-extent is clipped to the cached extent */
+	test_block_status(&t, 100, 500);
+
+	assert_int_equal(t.ndone, 3);
+	assert_extent(&t, 0, 100, DATA_SEC - 100, HOLE);
+	assert_extent(&t, 1, DATA_SEC, DATA_SECS, DATA);
+	assert_extent(&t, 2, DATA_SEC + DATA_SECS,
+		      600 - DATA_SEC - DATA_SECS, HOLE);
+	assert_int_equal(prv->extent_misses, 3);
+	assert_int_equal(prv->extent_hits, 6);
+
+	test_close_image(&t);
+}
+
+void
+test_aio_write_invalidates_hole(void **state)
+{
+	struct aio_test t;
+	struct tdaio_state *prv;
+	struct tiocb *tiocb;
+
+	if (!test_open_image(&t))
+		return;
+	prv = t.driver.data;
+
+	test_block_status(&t, 0, IMAGE_SECS);
+	assert_int_equal(prv->extent_misses, 3);
+
+	/* queueing a write drops the hole it lands in */
+	tiocb = test_write(&t, 0, 8);
+
+	test_block_status(&t, 0, 8);
+	assert_int_equal(prv->extent_misses, 4);
+
+	/*
+	 * That probe raced the write and cached a hole again; the
+	 * completion must drop it too.
+	 */
+	t.ndone = 0;
+	tiocb->cb(tiocb->arg, tiocb, 0);
+	assert_int_equal(t.ndone, 1);
+	assert_int_equal(t.done[0].err, 0);
+
+	test_block_status(&t, 0, 8);
+	assert_int_equal(prv->extent_misses, 5);
+
+	/* the data extent is unaffected by writes */
+	tiocb = test_write(&t, DATA_SEC, DATA_SECS);
+	tiocb->cb(tiocb->arg, tiocb, 0);
+
+	test_block_status(&t, DATA_SEC, DATA_SECS);
+	assert_int_equal(prv->extent_misses, 5);
+	assert_extent(&t, 0, DATA_SEC, DATA_SECS, DATA);
+
+	test_close_image(&t);
+}
+
+void
+test_aio_block_status_without_seek_hole(void **state)
+{
+	struct aio_test t;
+	struct tdaio_state *prv;
+
+	if (!test_open_image(&t))
+		return;
+	prv = t.driver.data;
+
+	prv->seek_hole = 0;
+	test_block_status(&t, 0, IMAGE_SECS);
+
+	assert_int_equal(t.ndone, 1);
+	assert_extent(&t, 0, 0, IMAGE_SECS, DATA);
+	assert_int_equal(prv->extent_misses, 0);
+
+	test_close_image(&t);
+}
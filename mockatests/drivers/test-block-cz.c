@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "block-cz.h"
+
+extern struct tap_disk tapdisk_cz;
+
+#define CZ_TEST_SIZE	(1 << 20)
+#define CZ_TEST_CHUNK	128		/* sectors, the default 64KiB */
+#define CZ_TEST_DATA	8192		/* header and map */
+
+struct cz_test {
+	char			dir[TEST_DIR_LEN];
+	char			path[PATH_MAX];
+	td_driver_t		driver;
+	char			buf[CZ_TEST_CHUNK << SECTOR_SHIFT];
+	struct test_req		req;
+};
+
+static void
+cz_test_open(struct cz_test *t)
+{
+	assert_int_equal(test_driver_open(&t->driver, &tapdisk_cz,
+					  t->path, 0), 0);
+	assert_int_equal(t->driver.info.size, CZ_TEST_SIZE >> SECTOR_SHIFT);
+}
+
+static void
+cz_test_reopen(struct cz_test *t)
+{
+	test_driver_close(&t->driver);
+	cz_test_open(t);
+}
+
+int
+cz_test_setup(void **state)
+{
+	struct cz_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+	n_forwarded = 0;
+
+	test_dir_create(t->dir, "test-block-cz");
+	test_dir_path(t->path, sizeof(t->path), t->dir, "cz.img");
+
+	assert_int_equal(tdcz_create(t->path, CZ_TEST_SIZE, NULL, -1, 0), 0);
+	cz_test_open(t);
+
+	*state = t;
+	return 0;
+}
+
+int
+cz_test_teardown(void **state)
+{
+	struct cz_test *t = *state;
+
+	test_driver_close(&t->driver);
+	test_dir_remove(t->dir);
+	free(t);
+
+	return 0;
+}
+
+static off_t
+cz_test_file_size(struct cz_test *t)
+{
+	struct stat st;
+
+	assert_int_equal(stat(t->path, &st), 0);
+	return st.st_size;
+}
+
+static td_request_t
+cz_test_request(struct cz_test *t, int op, td_sector_t sec, int secs)
+{
+	return test_request(&t->req, op, t->buf, sec, secs);
+}
+
+static void
+cz_test_write(struct cz_test *t, td_sector_t sec, int secs)
+{
+	tapdisk_cz.td_queue_write(&t->driver,
+				  cz_test_request(t, TD_OP_WRITE, sec, secs));
+}
+
+static void
+cz_test_read(struct cz_test *t, td_sector_t sec, int secs)
+{
+	memset(t->buf, 0xee, sizeof(t->buf));
+	tapdisk_cz.td_queue_read(&t->driver,
+				 cz_test_request(t, TD_OP_READ, sec, secs));
+}
+
+static int
+cz_test_status(struct cz_test *t, td_sector_t sec)
+{
+	tapdisk_cz.td_queue_block_status(&t->driver,
+					 cz_test_request(t, TD_OP_BLOCK_STATUS,
+							 sec, 1));
+	return t->req.ndone ? t->req.status : -1;
+}
+
+/*
+ * Compressible contents, seeded with the sector number so that data
+ * read from the wrong place shows.
+ */
+static void
+cz_test_fill(char *buf, td_sector_t sec, int secs, int seed)
+{
+	test_fill(buf, secs, seed + sec);
+}
+
+static void
+cz_test_check(const char *buf, td_sector_t sec, int secs, int seed)
+{
+	test_check(buf, secs, seed + sec);
+}
+
+void
+test_cz_write_read_compressed(void **state)
+{
+	struct cz_test *t = *state;
+
+	cz_test_fill(t->buf, CZ_TEST_CHUNK, CZ_TEST_CHUNK, 1);
+	cz_test_write(t, CZ_TEST_CHUNK, CZ_TEST_CHUNK);
+
+	/* the data, then the map sector */
+	assert_int_equal(test_io_run(), 2);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, 0);
+
+	/* 64KiB of compressible data takes up a single unit */
+	assert_int_equal(cz_test_file_size(t), CZ_TEST_DATA + 4096);
+
+	/* served from the cache */
+	cz_test_read(t, CZ_TEST_CHUNK + 8, 8);
+	assert_int_equal(test_io_run(), 0);
+	assert_int_equal(t->req.ndone, 1);
+	cz_test_check(t->buf, CZ_TEST_CHUNK + 8, 8, 1);
+
+	/* and from disk once reopened */
+	cz_test_reopen(t);
+
+	cz_test_read(t, CZ_TEST_CHUNK, CZ_TEST_CHUNK);
+	assert_int_equal(t->req.ndone, 0);
+	assert_int_equal(test_io_run(), 1);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, 0);
+	cz_test_check(t->buf, CZ_TEST_CHUNK, CZ_TEST_CHUNK, 1);
+}
+
+void
+test_cz_zero_and_unwritten_chunks(void **state)
+{
+	struct cz_test *t = *state;
+	td_request_t treq;
+
+	memset(t->buf, 0, sizeof(t->buf));
+	cz_test_write(t, 2 * CZ_TEST_CHUNK, CZ_TEST_CHUNK);
+
+	/* zeroes take no space, only a map update */
+	assert_int_equal(test_io_run(), 1);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(cz_test_file_size(t), CZ_TEST_DATA);
+
+	assert_int_equal(cz_test_status(t, 2 * CZ_TEST_CHUNK),
+			 TD_BLOCK_STATE_HOLE | TD_BLOCK_STATE_ZERO);
+
+	cz_test_read(t, 2 * CZ_TEST_CHUNK, 8);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->buf[0], 0);
+
+	/* chunks never written are the parent's business */
+	assert_int_equal(cz_test_status(t, 3 * CZ_TEST_CHUNK), -1);
+	assert_int_equal(n_forwarded, 1);
+	treq = pop_forwarded();
+	assert_int_equal(treq.op, TD_OP_BLOCK_STATUS);
+
+	cz_test_read(t, 3 * CZ_TEST_CHUNK, 8);
+	assert_int_equal(n_forwarded, 1);
+	treq = pop_forwarded();
+	assert_int_equal(treq.op, TD_OP_READ);
+	assert_int_equal(treq.sec, 3 * CZ_TEST_CHUNK);
+	assert_int_equal(treq.secs, 8);
+
+	/* requests are split at chunk boundaries */
+	cz_test_read(t, 3 * CZ_TEST_CHUNK - 8, 16);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(n_forwarded, 1);
+	treq = pop_forwarded();
+	assert_int_equal(treq.sec, 3 * CZ_TEST_CHUNK);
+}
+
+void
+test_cz_partial_write_merges_parent_data(void **state)
+{
+	struct cz_test *t = *state;
+	td_request_t treq;
+
+	cz_test_fill(t->buf, 4 * CZ_TEST_CHUNK + 16, 8, 7);
+	cz_test_write(t, 4 * CZ_TEST_CHUNK + 16, 8);
+
+	/* the rest of the chunk comes from the parent */
+	assert_int_equal(n_forwarded, 1);
+	treq = pop_forwarded();
+	assert_int_equal(treq.op, TD_OP_READ);
+	assert_int_equal(treq.sec, 4 * CZ_TEST_CHUNK);
+	assert_int_equal(treq.secs, CZ_TEST_CHUNK);
+
+	/* past the end of the parent, in pieces */
+	cz_test_fill(treq.buf, treq.sec, 64, 3);
+	treq.secs = 64;
+	treq.cb(treq, 0);
+	assert_int_equal(test_io_run(), 0);
+
+	memset(treq.buf + (64 << SECTOR_SHIFT), 0, 64 << SECTOR_SHIFT);
+	treq.sec += 64;
+	treq.cb(treq, 0);
+	assert_int_equal(test_io_run(), 2);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, 0);
+
+	cz_test_reopen(t);
+
+	cz_test_read(t, 4 * CZ_TEST_CHUNK, CZ_TEST_CHUNK);
+	test_io_run();
+	assert_int_equal(t->req.ndone, 1);
+	cz_test_check(t->buf, 4 * CZ_TEST_CHUNK, 16, 3);
+	cz_test_check(t->buf + (16 << SECTOR_SHIFT),
+		      4 * CZ_TEST_CHUNK + 16, 8, 7);
+	cz_test_check(t->buf + (24 << SECTOR_SHIFT),
+		      4 * CZ_TEST_CHUNK + 24, 40, 3);
+	assert_int_equal(t->buf[64 << SECTOR_SHIFT], 0);
+}
+
+void
+test_cz_rewrite_keeps_cache_coherent(void **state)
+{
+	struct cz_test *t = *state;
+	int i;
+
+	cz_test_fill(t->buf, 0, CZ_TEST_CHUNK, 1);
+	cz_test_write(t, 0, CZ_TEST_CHUNK);
+	test_io_run();
+
+	cz_test_read(t, 0, CZ_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 0);
+	cz_test_check(t->buf, 0, CZ_TEST_CHUNK, 1);
+
+	/* a partial rewrite shows through the cache */
+	cz_test_fill(t->buf, 8, 8, 2);
+	cz_test_write(t, 8, 8);
+	test_io_run();
+	assert_int_equal(t->req.err, 0);
+
+	cz_test_read(t, 0, 24);
+	assert_int_equal(test_io_run(), 0);
+	cz_test_check(t->buf, 0, 8, 1);
+	cz_test_check(t->buf + (8 << SECTOR_SHIFT), 8, 8, 2);
+	cz_test_check(t->buf + (16 << SECTOR_SHIFT), 16, 8, 1);
+
+	/* failed ones do not, whether the data or the map write failed */
+	for (i = 0; i < 2; i++) {
+		cz_test_fill(t->buf, 16, 8, 3);
+		test_io_fail_write(i, -EIO);
+		cz_test_write(t, 16, 8);
+		test_io_run();
+		assert_int_equal(t->req.ndone, 1);
+		assert_int_equal(t->req.err, -EIO);
+
+		cz_test_read(t, 0, 24);
+		test_io_run();
+		assert_int_equal(t->req.ndone, 1);
+		cz_test_check(t->buf, 0, 8, 1);
+		cz_test_check(t->buf + (8 << SECTOR_SHIFT), 8, 8, 2);
+		cz_test_check(t->buf + (16 << SECTOR_SHIFT), 16, 8, 1);
+	}
+
+	/* the map on disk went back to the old copy too */
+	cz_test_reopen(t);
+
+	cz_test_read(t, 0, 24);
+	test_io_run();
+	cz_test_check(t->buf + (8 << SECTOR_SHIFT), 8, 8, 2);
+	cz_test_check(t->buf + (16 << SECTOR_SHIFT), 16, 8, 1);
+}
+
+void
+test_cz_requests_wait_for_their_chunk(void **state)
+{
+	struct cz_test *t = *state;
+	char first[8 << SECTOR_SHIFT];
+	td_request_t treq;
+
+	memset(t->buf, 0, sizeof(t->buf));
+	cz_test_write(t, 0, CZ_TEST_CHUNK);
+
+	/* both queued behind the first write */
+	cz_test_fill(first, 0, 8, 4);
+	treq     = cz_test_request(t, TD_OP_WRITE, 0, 8);
+	treq.buf = first;
+	tapdisk_cz.td_queue_write(&t->driver, treq);
+
+	cz_test_fill(t->buf, 4, 8, 5);
+	tapdisk_cz.td_queue_write(&t->driver,
+				  cz_test_request(t, TD_OP_WRITE, 4, 8));
+
+	test_io_run();
+	assert_int_equal(t->req.err, 0);
+
+	cz_test_read(t, 0, 16);
+	test_io_run();
+	cz_test_check(t->buf, 0, 4, 4);
+	cz_test_check(t->buf + (4 << SECTOR_SHIFT), 4, 8, 5);
+	assert_int_equal(t->buf[12 << SECTOR_SHIFT], 0);
+}
+
+void
+test_cz_rewrites_reuse_space(void **state)
+{
+	struct cz_test *t = *state;
+	int i, j;
+
+	srand(1);
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < sizeof(t->buf); j++)
+			t->buf[j] = rand();
+
+		cz_test_write(t, 0, CZ_TEST_CHUNK);
+		test_io_run();
+		assert_int_equal(t->req.err, 0);
+	}
+
+	/* incompressible, stored raw, in at most two places in turn */
+	assert_in_range(cz_test_file_size(t), CZ_TEST_DATA + 65536,
+			CZ_TEST_DATA + 2 * 65536);
+}
@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
+
+extern struct tap_disk tapdisk_dedup;
+
+#define DD_TEST_SIZE	(2 << 20)
+#define DD_TEST_CHUNK	128		/* sectors, 64KiB */
+#define DD_TEST_SLOTS	16		/* in a 1MiB store */
+#define DD_TEST_DATA	8192		/* store header and index */
+
+struct dd_test_vbd {
+	char			path[PATH_MAX];
+	td_driver_t		driver;
+	td_driver_t		parent;
+	char			buf[DD_TEST_CHUNK << SECTOR_SHIFT];
+	struct test_req		req;
+};
+
+struct dd_test {
+	char			dir[TEST_DIR_LEN];
+	char			store[PATH_MAX];
+	struct dd_test_vbd	a, b;
+};
+
+static int
+dd_test_open(struct dd_test_vbd *v, const char *parent)
+{
+	assert_int_equal(test_driver_open(&v->driver, &tapdisk_dedup,
+					  v->path, 0), 0);
+
+	v->parent.name      = (char *)parent;
+	v->parent.type      = DISK_TYPE_AIO;
+	v->parent.info.size = DD_TEST_SIZE >> SECTOR_SHIFT;
+	v->driver.info      = v->parent.info;
+
+	return tapdisk_dedup.td_validate_parent(&v->driver, &v->parent, 0);
+}
+
+static void
+dd_test_reopen(struct dd_test *t)
+{
+	test_driver_close(&t->a.driver);
+	test_driver_close(&t->b.driver);
+	assert_int_equal(dd_test_open(&t->a, "a.img"), 0);
+	assert_int_equal(dd_test_open(&t->b, "b.img"), 0);
+}
+
+int
+dedup_test_setup(void **state)
+{
+	struct dd_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+	n_forwarded = 0;
+
+	setenv("TAPDISK_DEDUP_STORE_MB", "1", 1);
+	setenv("TAPDISK_DEDUP_CHUNK_KB", "64", 1);
+	setenv("TAPDISK_DEDUP_CACHE_MB", "1", 1);
+	unsetenv("TAPDISK_DEDUP_STORE");
+
+	test_dir_create(t->dir, "test-block-dedup");
+	test_dir_path(t->store, sizeof(t->store), t->dir, "dedup.store");
+	test_dir_path(t->a.path, sizeof(t->a.path), t->dir, "a.map");
+	test_dir_path(t->b.path, sizeof(t->b.path), t->dir, "b.map");
+
+	assert_int_equal(dd_test_open(&t->a, "a.img"), 0);
+	assert_int_equal(dd_test_open(&t->b, "b.img"), 0);
+
+	*state = t;
+	return 0;
+}
+
+int
+dedup_test_teardown(void **state)
+{
+	struct dd_test *t = *state;
+
+	test_driver_close(&t->a.driver);
+	test_driver_close(&t->b.driver);
+	test_dir_remove(t->dir);
+	free(t);
+
+	return 0;
+}
+
+static off_t
+dd_test_store_size(struct dd_test *t)
+{
+	struct stat st;
+
+	assert_int_equal(stat(t->store, &st), 0);
+	return st.st_size;
+}
+
+static void
+dd_test_write(struct dd_test_vbd *v, td_sector_t sec, int secs)
+{
+	tapdisk_dedup.td_queue_write(&v->driver,
+				     test_request(&v->req, TD_OP_WRITE,
+						  v->buf, sec, secs));
+}
+
+static void
+dd_test_read(struct dd_test_vbd *v, td_sector_t sec, int secs)
+{
+	memset(v->buf, 0xee, sizeof(v->buf));
+	tapdisk_dedup.td_queue_read(&v->driver,
+				    test_request(&v->req, TD_OP_READ,
+						 v->buf, sec, secs));
+}
+
+/*
+ * Stores a whole chunk with new contents: the data, the index, then
+ * the map.
+ */
+static void
+dd_test_store(struct dd_test_vbd *v, uint64_t chunk, int seed)
+{
+	test_fill(v->buf, DD_TEST_CHUNK, seed);
+	dd_test_write(v, chunk * DD_TEST_CHUNK, DD_TEST_CHUNK);
+
+	assert_int_equal(test_io_run(), 3);
+	assert_int_equal(v->req.ndone, 1);
+	assert_int_equal(v->req.err, 0);
+}
+
+void
+test_dedup_identical_chunks_stored_once(void **state)
+{
+	struct dd_test *t = *state;
+
+	dd_test_store(&t->a, 1, 1);
+	assert_int_equal(dd_test_store_size(t),
+			 DD_TEST_DATA + (DD_TEST_CHUNK << SECTOR_SHIFT));
+
+	/* the same contents on another VBD are only referenced */
+	test_fill(t->b.buf, DD_TEST_CHUNK, 1);
+	dd_test_write(&t->b, 5 * DD_TEST_CHUNK, DD_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 2);
+	assert_int_equal(t->b.req.ndone, 1);
+	assert_int_equal(t->b.req.err, 0);
+	assert_int_equal(dd_test_store_size(t),
+			 DD_TEST_DATA + (DD_TEST_CHUNK << SECTOR_SHIFT));
+
+	/* and read from the one cached copy */
+	dd_test_read(&t->b, 5 * DD_TEST_CHUNK + 8, 8);
+	assert_int_equal(test_io_run(), 0);
+	assert_int_equal(t->b.req.ndone, 1);
+	test_check(t->b.buf, 8, 1 + 8);
+
+	/* rewriting what is there already changes nothing */
+	test_fill(t->a.buf, DD_TEST_CHUNK, 1);
+	dd_test_write(&t->a, DD_TEST_CHUNK, DD_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 0);
+	assert_int_equal(t->a.req.ndone, 1);
+	assert_int_equal(t->a.req.err, 0);
+
+	/* a VBD changing its copy leaves the other one's alone */
+	test_fill(t->a.buf, DD_TEST_CHUNK, 2);
+	dd_test_write(&t->a, DD_TEST_CHUNK, DD_TEST_CHUNK);
+
+	/* stored, then the old copy's reference goes */
+	assert_int_equal(test_io_run(), 4);
+	assert_int_equal(t->a.req.ndone, 1);
+	assert_int_equal(t->a.req.err, 0);
+
+	dd_test_read(&t->a, DD_TEST_CHUNK, DD_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 0);
+	test_check(t->a.buf, DD_TEST_CHUNK, 2);
+
+	dd_test_read(&t->b, 5 * DD_TEST_CHUNK, DD_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 0);
+	test_check(t->b.buf, DD_TEST_CHUNK, 1);
+
+	assert_int_equal(n_forwarded, 0);
+}
+
+void
+test_dedup_reopen_reads_from_store(void **state)
+{
+	struct dd_test *t = *state;
+
+	dd_test_store(&t->a, 0, 1);
+	test_fill(t->b.buf, DD_TEST_CHUNK, 1);
+	dd_test_write(&t->b, 3 * DD_TEST_CHUNK, DD_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 2);
+
+	dd_test_reopen(t);
+
+	/* read from the store once, then shared */
+	dd_test_read(&t->a, 0, 16);
+	assert_int_equal(t->a.req.ndone, 0);
+	assert_int_equal(test_io_run(), 1);
+	assert_int_equal(t->a.req.ndone, 1);
+	assert_int_equal(t->a.req.err, 0);
+	test_check(t->a.buf, 16, 1);
+
+	dd_test_read(&t->b, 3 * DD_TEST_CHUNK, DD_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 0);
+	assert_int_equal(t->b.req.ndone, 1);
+	test_check(t->b.buf, DD_TEST_CHUNK, 1);
+
+	/* a map holding chunks is refused on another image */
+	test_driver_close(&t->b.driver);
+	assert_int_equal(dd_test_open(&t->b, "c.img"), -EINVAL);
+
+	assert_int_equal(n_forwarded, 0);
+}
+
+void
+test_dedup_partial_writes(void **state)
+{
+	struct dd_test *t = *state;
+	td_request_t treq;
+
+	/* chunks not stored pass through, a run of them at once */
+	dd_test_read(&t->a, DD_TEST_CHUNK - 8, 2 * DD_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 0);
+	assert_int_equal(n_forwarded, 1);
+	treq = pop_forwarded();
+	assert_int_equal(treq.sec, DD_TEST_CHUNK - 8);
+	assert_int_equal(treq.secs, 2 * DD_TEST_CHUNK);
+
+	test_fill(t->a.buf, 8, 1);
+	dd_test_write(&t->a, 8, 8);
+	assert_int_equal(test_io_run(), 0);
+	assert_int_equal(n_forwarded, 1);
+	treq = pop_forwarded();
+	assert_int_equal(treq.op, TD_OP_WRITE);
+	assert_int_equal(treq.sec, 8);
+	assert_int_equal(treq.secs, 8);
+
+	/* and are merged into a stored chunk, which is stored anew */
+	dd_test_store(&t->a, 2, 1);
+	dd_test_store(&t->b, 2, 1 + 0x80);
+
+	test_fill(t->a.buf, 8, 3);
+	dd_test_write(&t->a, 2 * DD_TEST_CHUNK + 8, 8);
+	assert_int_equal(test_io_run(), 4);
+	assert_int_equal(t->a.req.ndone, 1);
+	assert_int_equal(t->a.req.err, 0);
+
+	dd_test_read(&t->a, 2 * DD_TEST_CHUNK, DD_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 0);
+	test_check(t->a.buf, 8, 1);
+	test_check(t->a.buf + (8 << SECTOR_SHIFT), 8, 3);
+	test_check(t->a.buf + (16 << SECTOR_SHIFT), DD_TEST_CHUNK - 16,
+		   1 + 16);
+
+	/* which the other VBD does not see */
+	dd_test_read(&t->b, 2 * DD_TEST_CHUNK, DD_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 0);
+	test_check(t->b.buf, DD_TEST_CHUNK, 1 + 0x80);
+
+	assert_int_equal(n_forwarded, 0);
+}
+
+void
+test_dedup_full_store_passes_through(void **state)
+{
+	struct dd_test *t = *state;
+	td_request_t treq;
+	int i;
+
+	for (i = 0; i < DD_TEST_SLOTS; i++)
+		dd_test_store(&t->a, i, i);
+
+	/* a new chunk goes to the image below */
+	test_fill(t->a.buf, DD_TEST_CHUNK, 0x40);
+	dd_test_write(&t->a, 20 * DD_TEST_CHUNK, DD_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 0);
+	assert_int_equal(n_forwarded, 1);
+	treq = pop_forwarded();
+	assert_int_equal(treq.sec, 20 * DD_TEST_CHUNK);
+	assert_int_equal(treq.secs, DD_TEST_CHUNK);
+	test_check(treq.buf, DD_TEST_CHUNK, 0x40);
+	treq.cb(treq, 0);
+	assert_int_equal(t->a.req.ndone, 1);
+	assert_int_equal(test_io_run(), 0);
+
+	/* a stored one too, and its slot is let go of once it is there */
+	test_fill(t->a.buf, DD_TEST_CHUNK, 0x41);
+	dd_test_write(&t->a, 0, DD_TEST_CHUNK);
+	assert_int_equal(n_forwarded, 1);
+	treq = pop_forwarded();
+	treq.cb(treq, 0);
+	assert_int_equal(t->a.req.ndone, 0);
+
+	/* the map, then the index */
+	assert_int_equal(test_io_run(), 2);
+	assert_int_equal(t->a.req.ndone, 1);
+	assert_int_equal(t->a.req.err, 0);
+
+	dd_test_read(&t->a, 0, 8);
+	assert_int_equal(n_forwarded, 1);
+	pop_forwarded();
+
+	/* for the next new chunk to use */
+	dd_test_store(&t->a, 21, 0x42);
+
+	assert_int_equal(dd_test_store_size(t),
+			 DD_TEST_DATA +
+			 (DD_TEST_SLOTS * DD_TEST_CHUNK << SECTOR_SHIFT));
+}
+
+void
+test_dedup_failed_writes_keep_old_copy(void **state)
+{
+	struct dd_test *t = *state;
+	int i;
+
+	dd_test_store(&t->a, 0, 1);
+
+	/* the data, the index or the map write failing */
+	for (i = 0; i < 3; i++) {
+		test_fill(t->a.buf, DD_TEST_CHUNK, 2 + i);
+		test_io_fail_write(i, -EIO);
+		dd_test_write(&t->a, 0, DD_TEST_CHUNK);
+		test_io_run();
+		assert_int_equal(t->a.req.ndone, 1);
+		assert_int_equal(t->a.req.err, -EIO);
+
+		dd_test_read(&t->a, 0, DD_TEST_CHUNK);
+		test_io_run();
+		assert_int_equal(t->a.req.ndone, 1);
+		assert_int_equal(t->a.req.err, 0);
+		test_check(t->a.buf, DD_TEST_CHUNK, 1);
+	}
+
+	/* the old copy is what is on disk */
+	dd_test_reopen(t);
+
+	dd_test_read(&t->a, 0, DD_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 1);
+	assert_int_equal(t->a.req.ndone, 1);
+	test_check(t->a.buf, DD_TEST_CHUNK, 1);
+
+	/* and the contents that failed to go in can still be stored */
+	test_fill(t->b.buf, DD_TEST_CHUNK, 2);
+	dd_test_write(&t->b, 0, DD_TEST_CHUNK);
+	test_io_run();
+	assert_int_equal(t->b.req.ndone, 1);
+	assert_int_equal(t->b.req.err, 0);
+
+	dd_test_read(&t->b, 0, DD_TEST_CHUNK);
+	assert_int_equal(test_io_run(), 0);
+	test_check(t->b.buf, DD_TEST_CHUNK, 2);
+
+	assert_int_equal(n_forwarded, 0);
+}
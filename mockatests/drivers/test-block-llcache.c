@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-interface.h"
+#include "scheduler.h"
+
+extern struct tap_disk tapdisk_llecache;
+
+/* gettimeofday() is wrapped in test-scheduler.c */
+extern struct timeval fake_gettimeofday;
+
+#define LL_TEST_SECS	(4 << 11)	/* four 1MiB chunks */
+#define LL_TEST_CHUNK	(1 << 11)
+#define LL_TEST_MAX	8
+
+/*
+ * An LLE cache over a bare VBD: LOCAL is next in the chain, reached by
+ * td_forward_request(), SHARED a test disk which keeps the reads queued
+ * to it, and gets writes through td_queue_write(). Copies back into
+ * LOCAL are read through the VBD, and left on its new requests list.
+ */
+struct ll_test {
+	td_vbd_t		vbd;
+	td_vbd_request_t	vreq;
+	td_image_t		image;
+	td_image_t		local;
+	td_driver_t		driver;
+
+	td_image_t		shared;
+	td_driver_t		shared_driver;
+	td_request_t		reads[LL_TEST_MAX];
+	int			n_reads;
+
+	char			buf[8 << SECTOR_SHIFT];
+	struct test_req		req;
+};
+
+static struct ll_test *ll_test;
+
+static void
+ll_test_disk_read(td_driver_t *driver, td_request_t treq)
+{
+	assert_in_range(ll_test->n_reads, 0, LL_TEST_MAX - 1);
+	ll_test->reads[ll_test->n_reads++] = treq;
+}
+
+static struct tap_disk ll_test_disk = {
+	.disk_type     = "test",
+	.td_queue_read = ll_test_disk_read,
+};
+
+int
+llcache_test_setup(void **state)
+{
+	struct ll_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+	ll_test = t;
+
+	test_vbd_init(&t->vbd);
+	t->vreq.vbd = &t->vbd;
+
+	n_queued_writes = 0;
+	n_forwarded     = 0;
+	fake_gettimeofday = (struct timeval){ .tv_sec = 1000 };
+
+	t->image.type   = DISK_TYPE_LLECACHE;
+	t->image.name   = "lle";
+	t->image.driver = &t->driver;
+	list_add_tail(&t->image.next, &t->vbd.images);
+
+	t->local.type = DISK_TYPE_VHD;
+	t->local.name = "local";
+	list_add_tail(&t->local.next, &t->vbd.images);
+
+	t->shared_driver.ops       = &ll_test_disk;
+	t->shared_driver.info.size = LL_TEST_SECS;
+	td_flag_set(t->shared_driver.state, TD_DRIVER_OPEN);
+	t->shared.type      = DISK_TYPE_VHD;
+	t->shared.name      = "shared";
+	t->shared.driver    = &t->shared_driver;
+	t->shared.info.size = LL_TEST_SECS;
+
+	mock_image = &t->shared;
+	assert_int_equal(test_driver_open(&t->driver, &tapdisk_llecache,
+					  "shared", 0), 0);
+	assert_int_equal(t->driver.info.size, LL_TEST_SECS);
+
+	*state = t;
+	return 0;
+}
+
+int
+llcache_test_teardown(void **state)
+{
+	struct ll_test *t = *state;
+
+	test_driver_close(&t->driver);
+	free(t);
+	mock_image = NULL;
+	ll_test    = NULL;
+
+	return 0;
+}
+
+static td_request_t
+ll_test_request(struct ll_test *t, int op, td_sector_t sec, int secs)
+{
+	td_request_t treq;
+
+	treq       = test_request(&t->req, op, t->buf, sec, secs);
+	treq.image = &t->image;
+	treq.vreq  = &t->vreq;
+
+	return treq;
+}
+
+static void
+ll_test_write(struct ll_test *t, td_sector_t sec, int secs)
+{
+	tapdisk_llecache.td_queue_write(&t->driver,
+					ll_test_request(t, TD_OP_WRITE,
+							sec, secs));
+}
+
+/*
+ * Where a read goes: 0 to LOCAL, 1 to SHARED.
+ */
+static int
+ll_test_read_target(struct ll_test *t, td_sector_t sec)
+{
+	td_request_t treq;
+
+	n_forwarded = 0;
+	t->n_reads  = 0;
+
+	tapdisk_llecache.td_queue_read(&t->driver,
+				       ll_test_request(t, TD_OP_READ, sec, 8));
+
+	assert_int_equal(n_forwarded + t->n_reads, 1);
+	if (n_forwarded) {
+		treq = pop_forwarded();
+		treq.cb(treq, 0);
+		return 0;
+	}
+
+	t->n_reads = 0;
+	t->reads[0].cb(t->reads[0], 0);
+	return 1;
+}
+
+static void
+ll_test_complete_forwarded(int err)
+{
+	td_request_t treq = pop_forwarded();
+
+	treq.cb(treq, err);
+}
+
+static void
+ll_test_complete_write(int err)
+{
+	td_request_t treq = pop_queued_write();
+
+	treq.cb(treq, err);
+}
+
+static int
+ll_test_copy_reads(struct ll_test *t)
+{
+	td_vbd_request_t *vreq;
+	int n = 0;
+
+	list_for_each_entry(vreq, &t->vbd.new_requests, next)
+		n++;
+
+	return n;
+}
+
+static void
+ll_test_complete_copy_read(struct ll_test *t, int err)
+{
+	td_vbd_request_t *vreq;
+
+	assert_false(list_empty(&t->vbd.new_requests));
+	vreq = list_entry(t->vbd.new_requests.next, td_vbd_request_t, next);
+	list_del_init(&vreq->next);
+	vreq->list_head = NULL;
+
+	vreq->cb(vreq, err, vreq->token, 1);
+}
+
+static void
+ll_test_tick(int secs)
+{
+	fake_gettimeofday.tv_sec += secs;
+	registered_cb(0, SCHEDULER_POLL_TIMEOUT, registered_data);
+}
+
+/*
+ * Fails a write to LOCAL with ENOSPC: the cache falls back to SHARED,
+ * where the write goes instead.
+ */
+static void
+ll_test_degrade(struct ll_test *t, td_sector_t sec)
+{
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_TIMEOUT);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+
+	ll_test_write(t, sec, 8);
+	assert_int_equal(n_forwarded, 1);
+	ll_test_complete_forwarded(-ENOSPC);
+
+	assert_int_equal(t->req.ndone, 0);
+	assert_int_equal(n_queued_writes, 1);
+	assert_ptr_equal(queued_writes[0].image, &t->shared);
+	ll_test_complete_write(0);
+
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, 0);
+}
+
+void
+test_llcache_degrades_and_recovers(void **state)
+{
+	struct ll_test *t = *state;
+
+	assert_int_equal(ll_test_read_target(t, 0), 0);
+
+	ll_test_degrade(t, LL_TEST_CHUNK + 8);
+	assert_int_equal(ll_test_read_target(t, 0), 1);
+
+	/* writes go to SHARED as well from now on */
+	ll_test_write(t, 3 * LL_TEST_CHUNK, 8);
+	assert_int_equal(n_forwarded, 0);
+	ll_test_complete_write(0);
+	assert_int_equal(t->req.ndone, 1);
+
+	/* nothing is probed for a while */
+	ll_test_tick(1);
+	assert_int_equal(ll_test_copy_reads(t), 0);
+
+	/* then the chunks written are copied back, one at a time */
+	ll_test_tick(10);
+	assert_int_equal(ll_test_copy_reads(t), 1);
+	assert_int_equal(ll_test_read_target(t, 0), 1);
+
+	ll_test_complete_copy_read(t, 0);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(forwarded[0].sec, LL_TEST_CHUNK);
+	assert_int_equal(forwarded[0].secs, LL_TEST_CHUNK);
+	ll_test_complete_forwarded(0);
+
+	assert_int_equal(ll_test_copy_reads(t), 1);
+	ll_test_complete_copy_read(t, 0);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(forwarded[0].sec, 3 * LL_TEST_CHUNK);
+	ll_test_complete_forwarded(0);
+
+	/* and LOCAL serves reads again */
+	assert_int_equal(ll_test_copy_reads(t), 0);
+	assert_int_equal(ll_test_read_target(t, 0), 0);
+
+	/* keeping SHARED current where it holds data */
+	ll_test_write(t, 3 * LL_TEST_CHUNK + 64, 8);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(n_queued_writes, 1);
+	ll_test_complete_forwarded(0);
+	assert_int_equal(t->req.ndone, 0);
+	ll_test_complete_write(0);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, 0);
+
+	ll_test_write(t, 2 * LL_TEST_CHUNK, 8);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(n_queued_writes, 0);
+	ll_test_complete_forwarded(0);
+	assert_int_equal(t->req.ndone, 1);
+}
+
+void
+test_llcache_failed_probe_backs_off(void **state)
+{
+	struct ll_test *t = *state;
+
+	ll_test_degrade(t, 0);
+
+	ll_test_tick(10);
+	ll_test_complete_copy_read(t, 0);
+	ll_test_complete_forwarded(-ENOSPC);
+
+	/* LOCAL is still failing: twice as long before the next try */
+	assert_int_equal(ll_test_read_target(t, 0), 1);
+
+	ll_test_tick(10);
+	assert_int_equal(ll_test_copy_reads(t), 0);
+
+	ll_test_tick(10);
+	assert_int_equal(ll_test_copy_reads(t), 1);
+	ll_test_complete_copy_read(t, 0);
+	ll_test_complete_forwarded(0);
+
+	assert_int_equal(ll_test_read_target(t, 0), 0);
+}
+
+void
+test_llcache_writes_during_recovery(void **state)
+{
+	struct ll_test *t = *state;
+
+	ll_test_degrade(t, 0);
+
+	ll_test_tick(10);
+	assert_int_equal(ll_test_copy_reads(t), 1);
+
+	/* the chunk being copied is written again */
+	ll_test_write(t, 16, 8);
+	assert_int_equal(n_forwarded, 0);
+	assert_int_equal(n_queued_writes, 1);
+
+	/* so the copy is stale, and made again right away */
+	ll_test_complete_copy_read(t, 0);
+	ll_test_complete_forwarded(0);
+	assert_int_equal(ll_test_copy_reads(t), 1);
+
+	/* which races with the write still: once more, on the next tick */
+	ll_test_complete_write(0);
+	assert_int_equal(t->req.ndone, 1);
+
+	ll_test_complete_copy_read(t, 0);
+	ll_test_complete_forwarded(0);
+	assert_int_equal(ll_test_copy_reads(t), 0);
+	assert_int_equal(ll_test_read_target(t, 0), 1);
+
+	ll_test_tick(1);
+	assert_int_equal(ll_test_copy_reads(t), 1);
+	ll_test_complete_copy_read(t, 0);
+	assert_int_equal(forwarded[0].sec, 0);
+	ll_test_complete_forwarded(0);
+
+	assert_int_equal(ll_test_read_target(t, 0), 0);
+}
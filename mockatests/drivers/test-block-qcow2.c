@@ -0,0 +1,636 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+
+extern struct tap_disk tapdisk_qcow;
+
+#define QCOW2_TEST_CLUSTER	4096
+#define QCOW2_TEST_SECS		(QCOW2_TEST_CLUSTER >> SECTOR_SHIFT)
+#define QCOW2_TEST_L2_SECS	(512 * QCOW2_TEST_SECS)	/* per L1 entry */
+#define QCOW2_TEST_L1_SIZE	33
+#define QCOW2_TEST_RC_ENTRIES	(QCOW2_TEST_CLUSTER / 2)
+
+/* host clusters of the image as created */
+#define QCOW2_TEST_REFT		1
+#define QCOW2_TEST_REFBLOCK	2
+#define QCOW2_TEST_L1		3
+#define QCOW2_TEST_L2		4
+#define QCOW2_TEST_END		5
+
+#define QCOW2_TEST_COPIED	(1ULL << 63)
+#define QCOW2_TEST_COMPRESSED	(1ULL << 62)
+#define QCOW2_TEST_ZERO		1ULL
+
+/*
+ * A v3 image with 4KiB clusters and 16-bit refcounts, the first L2
+ * table allocated and all of it unallocated. It has no backing file
+ * named: reads of unallocated clusters are collected by the
+ * td_forward_request() wrapper for the test to complete.
+ */
+struct qcow2_test {
+	char			dir[TEST_DIR_LEN];
+	char			path[PATH_MAX];
+	int			fd;
+	td_driver_t		driver;
+	char		       *buf;
+	struct test_req		req;
+};
+
+static void
+qcow2_test_pwrite(struct qcow2_test *t, const void *buf, size_t size,
+		  uint64_t offset)
+{
+	assert_int_equal(pwrite(t->fd, buf, size, offset), size);
+}
+
+static uint64_t
+qcow2_test_get64(struct qcow2_test *t, uint64_t offset)
+{
+	uint64_t val;
+
+	assert_int_equal(pread(t->fd, &val, sizeof(val), offset), sizeof(val));
+	return be64toh(val);
+}
+
+static void
+qcow2_test_set64(struct qcow2_test *t, uint64_t offset, uint64_t val)
+{
+	val = htobe64(val);
+	qcow2_test_pwrite(t, &val, sizeof(val), offset);
+}
+
+static uint64_t
+qcow2_test_refcount(struct qcow2_test *t, uint64_t cluster)
+{
+	uint64_t rb;
+	uint16_t rc;
+
+	rb = qcow2_test_get64(t, QCOW2_TEST_REFT * QCOW2_TEST_CLUSTER +
+			      cluster / QCOW2_TEST_RC_ENTRIES * 8);
+	if (!rb)
+		return 0;
+
+	assert_int_equal(pread(t->fd, &rc, sizeof(rc),
+			       rb + cluster % QCOW2_TEST_RC_ENTRIES * 2),
+			 sizeof(rc));
+	return be16toh(rc);
+}
+
+static void
+qcow2_test_set_refcount(struct qcow2_test *t, uint64_t cluster, uint16_t rc)
+{
+	rc = htobe16(rc);
+	qcow2_test_pwrite(t, &rc, sizeof(rc),
+			  QCOW2_TEST_REFBLOCK * QCOW2_TEST_CLUSTER +
+			  cluster * 2);
+}
+
+static uint64_t
+qcow2_test_l1(struct qcow2_test *t, int idx)
+{
+	return qcow2_test_get64(t, QCOW2_TEST_L1 * QCOW2_TEST_CLUSTER +
+				idx * 8);
+}
+
+/*
+ * The L2 entry of guest cluster @vcluster, as on disk.
+ */
+static uint64_t
+qcow2_test_l2(struct qcow2_test *t, uint64_t vcluster)
+{
+	uint64_t l2;
+
+	l2 = qcow2_test_l1(t, vcluster / 512) & ~QCOW2_TEST_COPIED;
+	if (!l2)
+		return 0;
+
+	return qcow2_test_get64(t, l2 + vcluster % 512 * 8);
+}
+
+static void
+qcow2_test_set_l2(struct qcow2_test *t, uint64_t vcluster, uint64_t entry)
+{
+	assert_true(vcluster < 512);
+	qcow2_test_set64(t, QCOW2_TEST_L2 * QCOW2_TEST_CLUSTER +
+			 vcluster * 8, entry);
+}
+
+/*
+ * Extends the image to @clusters host clusters.
+ */
+static void
+qcow2_test_grow(struct qcow2_test *t, int clusters)
+{
+	assert_int_equal(ftruncate(t->fd, clusters * QCOW2_TEST_CLUSTER), 0);
+}
+
+static void
+qcow2_test_create(struct qcow2_test *t)
+{
+	char buf[QCOW2_TEST_CLUSTER];
+	uint32_t *h32 = (uint32_t *)buf;
+	int i;
+
+	t->fd = open(t->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	assert_true(t->fd >= 0);
+	qcow2_test_grow(t, QCOW2_TEST_END);
+
+	memset(buf, 0, sizeof(buf));
+	h32[0] = htobe32(0x514649fb);	/* magic */
+	h32[1] = htobe32(3);		/* version */
+	h32[5] = htobe32(12);		/* cluster bits */
+	*(uint64_t *)(buf + 24) =
+		htobe64((uint64_t)QCOW2_TEST_L1_SIZE * QCOW2_TEST_L2_SECS
+			<< SECTOR_SHIFT);
+	*(uint32_t *)(buf + 36) = htobe32(QCOW2_TEST_L1_SIZE);
+	*(uint64_t *)(buf + 40) =
+		htobe64(QCOW2_TEST_L1 * QCOW2_TEST_CLUSTER);
+	*(uint64_t *)(buf + 48) =
+		htobe64(QCOW2_TEST_REFT * QCOW2_TEST_CLUSTER);
+	*(uint32_t *)(buf + 56) = htobe32(1);
+	*(uint32_t *)(buf + 96) = htobe32(4);		/* refcount order */
+	*(uint32_t *)(buf + 100) = htobe32(104);	/* header length */
+	qcow2_test_pwrite(t, buf, sizeof(buf), 0);
+
+	qcow2_test_set64(t, QCOW2_TEST_REFT * QCOW2_TEST_CLUSTER,
+			 QCOW2_TEST_REFBLOCK * QCOW2_TEST_CLUSTER);
+	for (i = 0; i < QCOW2_TEST_END; i++)
+		qcow2_test_set_refcount(t, i, 1);
+	qcow2_test_set64(t, QCOW2_TEST_L1 * QCOW2_TEST_CLUSTER,
+			 QCOW2_TEST_L2 * QCOW2_TEST_CLUSTER |
+			 QCOW2_TEST_COPIED);
+}
+
+static void
+qcow2_test_reopen(struct qcow2_test *t)
+{
+	test_driver_close(&t->driver);
+	assert_int_equal(test_driver_open(&t->driver, &tapdisk_qcow,
+					  t->path, 0), 0);
+}
+
+int
+qcow2_test_setup(void **state)
+{
+	struct qcow2_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+	n_forwarded = 0;
+
+	test_dir_create(t->dir, "test-block-qcow2");
+	test_dir_path(t->path, sizeof(t->path), t->dir, "disk.qcow2");
+	qcow2_test_create(t);
+
+	/* the image is opened O_DIRECT */
+	assert_int_equal(posix_memalign((void **)&t->buf, 4096,
+					4 * QCOW2_TEST_CLUSTER), 0);
+
+	assert_int_equal(test_driver_open(&t->driver, &tapdisk_qcow,
+					  t->path, 0), 0);
+
+	*state = t;
+	return 0;
+}
+
+int
+qcow2_test_teardown(void **state)
+{
+	struct qcow2_test *t = *state;
+
+	test_driver_close(&t->driver);
+	close(t->fd);
+	test_dir_remove(t->dir);
+	free(t->buf);
+	free(t);
+
+	return 0;
+}
+
+static void
+qcow2_test_write(struct qcow2_test *t, struct test_req *req, char *buf,
+		 td_sector_t sec, int secs, int seed)
+{
+	test_fill(buf, secs, seed);
+	tapdisk_qcow.td_queue_write(&t->driver,
+				    test_request(req, TD_OP_WRITE,
+						 buf, sec, secs));
+}
+
+static void
+qcow2_test_read(struct qcow2_test *t, td_sector_t sec, int secs)
+{
+	memset(t->buf, 0xee, (size_t)secs << SECTOR_SHIFT);
+	tapdisk_qcow.td_queue_read(&t->driver,
+				   test_request(&t->req, TD_OP_READ,
+						t->buf, sec, secs));
+}
+
+/*
+ * Completes the oldest read forwarded to the backing image, which
+ * holds @seed plus the sector number everywhere.
+ */
+static void
+qcow2_test_backing_read(int seed)
+{
+	td_request_t treq;
+
+	treq = pop_forwarded();
+	assert_int_equal(treq.op, TD_OP_READ);
+
+	test_fill(treq.buf, treq.secs, seed + treq.sec);
+	treq.cb(treq, 0);
+}
+
+/*
+ * Brings the first L2 table into the cache.
+ */
+static void
+qcow2_test_load_l2(struct qcow2_test *t)
+{
+	qcow2_test_read(t, 0, 1);
+	assert_int_equal(test_io_run(), 1);
+	qcow2_test_backing_read(0);
+	assert_int_equal(t->req.ndone, 1);
+}
+
+void
+test_qcow2_alloc_full_cluster(void **state)
+{
+	struct qcow2_test *t = *state;
+	uint64_t l2;
+
+	/* in the existing L2 table: the refcount, the data, the link */
+	qcow2_test_load_l2(t);
+	qcow2_test_write(t, &t->req, t->buf, 0, QCOW2_TEST_SECS, 1);
+	assert_int_equal(n_forwarded, 0);
+	assert_int_equal(test_io_run(), 3);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, 0);
+
+	assert_int_equal(qcow2_test_l2(t, 0),
+			 QCOW2_TEST_END * QCOW2_TEST_CLUSTER |
+			 QCOW2_TEST_COPIED);
+	assert_int_equal(qcow2_test_refcount(t, QCOW2_TEST_END), 1);
+
+	/* in a new one: the table goes out along with the data */
+	qcow2_test_write(t, &t->req, t->buf, QCOW2_TEST_L2_SECS,
+			 QCOW2_TEST_SECS, 2);
+	assert_int_equal(test_io_run(), 4);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, 0);
+
+	l2 = (QCOW2_TEST_END + 1) * QCOW2_TEST_CLUSTER;
+	assert_int_equal(qcow2_test_l1(t, 1), l2 | QCOW2_TEST_COPIED);
+	assert_int_equal(qcow2_test_l2(t, 512),
+			 (l2 + QCOW2_TEST_CLUSTER) | QCOW2_TEST_COPIED);
+	assert_int_equal(qcow2_test_refcount(t, QCOW2_TEST_END + 1), 1);
+	assert_int_equal(qcow2_test_refcount(t, QCOW2_TEST_END + 2), 1);
+	assert_int_equal(qcow2_test_refcount(t, QCOW2_TEST_END + 3), 0);
+
+	qcow2_test_reopen(t);
+
+	qcow2_test_read(t, 0, QCOW2_TEST_SECS);
+	assert_int_equal(test_io_run(), 2);
+	assert_int_equal(t->req.err, 0);
+	test_check(t->buf, QCOW2_TEST_SECS, 1);
+
+	qcow2_test_read(t, QCOW2_TEST_L2_SECS, QCOW2_TEST_SECS);
+	assert_int_equal(test_io_run(), 2);
+	assert_int_equal(t->req.err, 0);
+	test_check(t->buf, QCOW2_TEST_SECS, 2);
+	assert_int_equal(n_forwarded, 0);
+}
+
+void
+test_qcow2_cow_from_backing(void **state)
+{
+	struct qcow2_test *t = *state;
+
+	/* the rest of the cluster comes from the backing image first */
+	qcow2_test_load_l2(t);
+	qcow2_test_write(t, &t->req, t->buf, QCOW2_TEST_SECS + 3, 2, 0x40);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(forwarded[0].sec, QCOW2_TEST_SECS);
+	assert_int_equal(forwarded[0].secs, QCOW2_TEST_SECS);
+
+	/* the refcount goes out meanwhile */
+	assert_int_equal(test_io_run(), 1);
+	assert_int_equal(t->req.ndone, 0);
+
+	qcow2_test_backing_read(1);
+	assert_int_equal(test_io_run(), 2);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, 0);
+
+	qcow2_test_reopen(t);
+
+	qcow2_test_read(t, QCOW2_TEST_SECS, QCOW2_TEST_SECS);
+	assert_int_equal(test_io_run(), 2);
+	assert_int_equal(n_forwarded, 0);
+	assert_int_equal(t->req.err, 0);
+	test_check(t->buf, 3, 1 + QCOW2_TEST_SECS);
+	test_check(t->buf + (3 << SECTOR_SHIFT), 2, 0x40);
+	test_check(t->buf + (5 << SECTOR_SHIFT), QCOW2_TEST_SECS - 5,
+		   6 + QCOW2_TEST_SECS);
+}
+
+void
+test_qcow2_concurrent_allocs(void **state)
+{
+	struct qcow2_test *t = *state;
+	struct test_req req[4];
+	char *buf[4];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		buf[i] = t->buf + i * QCOW2_TEST_CLUSTER;
+
+	qcow2_test_load_l2(t);
+
+	/* neighbours in one L2 sector, both in flight at once */
+	qcow2_test_write(t, &req[0], buf[0], 0, QCOW2_TEST_SECS, 1);
+	qcow2_test_write(t, &req[1], buf[1], QCOW2_TEST_SECS,
+			 QCOW2_TEST_SECS, 2);
+	assert_int_equal(req[0].ndone + req[1].ndone, 0);
+
+	/* but only one per cluster */
+	qcow2_test_write(t, &req[2], buf[2], 1, 1, 3);
+	assert_int_equal(req[2].ndone, 1);
+	assert_int_equal(req[2].err, -EBUSY);
+
+	/* and only one creating an L2 table */
+	qcow2_test_write(t, &req[2], buf[2], QCOW2_TEST_L2_SECS,
+			 QCOW2_TEST_SECS, 3);
+	qcow2_test_write(t, &req[3], buf[3], QCOW2_TEST_L2_SECS +
+			 QCOW2_TEST_SECS, QCOW2_TEST_SECS, 4);
+	assert_int_equal(req[2].ndone, 0);
+	assert_int_equal(req[3].ndone, 1);
+	assert_int_equal(req[3].err, -EBUSY);
+
+	test_io_run();
+	for (i = 0; i < 3; i++) {
+		assert_int_equal(req[i].ndone, 1);
+		assert_int_equal(req[i].err, 0);
+	}
+
+	/* neither link undid the other */
+	assert_true(qcow2_test_l2(t, 0) & QCOW2_TEST_COPIED);
+	assert_true(qcow2_test_l2(t, 1) & QCOW2_TEST_COPIED);
+	assert_int_not_equal(qcow2_test_l2(t, 0), qcow2_test_l2(t, 1));
+	assert_true(qcow2_test_l2(t, 512) & QCOW2_TEST_COPIED);
+	for (i = QCOW2_TEST_END; i < QCOW2_TEST_END + 4; i++)
+		assert_int_equal(qcow2_test_refcount(t, i), 1);
+
+	qcow2_test_reopen(t);
+
+	qcow2_test_read(t, 0, 2 * QCOW2_TEST_SECS);
+	assert_int_equal(test_io_run(), 3);
+	assert_int_equal(t->req.err, 0);
+	test_check(t->buf, QCOW2_TEST_SECS, 1);
+	test_check(t->buf + QCOW2_TEST_CLUSTER, QCOW2_TEST_SECS, 2);
+}
+
+/*
+ * Deflates a cluster filled by test_fill() with @seed to @offset, and
+ * returns the L2 entry for it.
+ */
+static uint64_t
+qcow2_test_compress(struct qcow2_test *t, uint64_t offset, int seed)
+{
+	char in[QCOW2_TEST_CLUSTER], out[QCOW2_TEST_CLUSTER];
+	z_stream strm;
+	uint64_t secs;
+
+	test_fill(in, QCOW2_TEST_SECS, seed);
+
+	memset(&strm, 0, sizeof(strm));
+	assert_int_equal(deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+				      Z_DEFLATED, -12, 9,
+				      Z_DEFAULT_STRATEGY), Z_OK);
+	strm.next_in   = (Bytef *)in;
+	strm.avail_in  = sizeof(in);
+	strm.next_out  = (Bytef *)out;
+	strm.avail_out = sizeof(out);
+	assert_int_equal(deflate(&strm, Z_FINISH), Z_STREAM_END);
+	deflateEnd(&strm);
+
+	qcow2_test_pwrite(t, out, strm.total_out, offset);
+
+	/* sectors spanned, minus one, above the offset */
+	secs = (offset + strm.total_out - 1) / SECTOR_SIZE -
+		offset / SECTOR_SIZE;
+
+	return QCOW2_TEST_COMPRESSED | secs << (62 - 4) | offset;
+}
+
+void
+test_qcow2_overwrite_compressed(void **state)
+{
+	struct qcow2_test *t = *state;
+	uint64_t shared = QCOW2_TEST_END * QCOW2_TEST_CLUSTER;
+
+	/* two compressed clusters sharing a host cluster, the second
+	 * spilling over into the next */
+	qcow2_test_grow(t, QCOW2_TEST_END + 2);
+	qcow2_test_set_l2(t, 0, qcow2_test_compress(t, shared, 1));
+	qcow2_test_set_l2(t, 1, qcow2_test_compress(t, shared +
+						    QCOW2_TEST_CLUSTER - 8,
+						    2));
+	qcow2_test_set_refcount(t, QCOW2_TEST_END, 2);
+	qcow2_test_set_refcount(t, QCOW2_TEST_END + 1, 1);
+	qcow2_test_reopen(t);
+
+	qcow2_test_read(t, QCOW2_TEST_SECS, QCOW2_TEST_SECS);
+	test_io_run();
+	assert_int_equal(t->req.err, 0);
+	test_check(t->buf, QCOW2_TEST_SECS, 2);
+
+	/* the old contents are read back for the rest of the cluster */
+	qcow2_test_write(t, &t->req, t->buf, QCOW2_TEST_SECS, 1, 0x40);
+	test_io_run();
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, 0);
+
+	assert_int_equal(qcow2_test_l2(t, 1),
+			 (QCOW2_TEST_END + 2) * QCOW2_TEST_CLUSTER |
+			 QCOW2_TEST_COPIED);
+	assert_int_equal(qcow2_test_refcount(t, QCOW2_TEST_END), 1);
+	assert_int_equal(qcow2_test_refcount(t, QCOW2_TEST_END + 1), 0);
+	assert_int_equal(qcow2_test_refcount(t, QCOW2_TEST_END + 2), 1);
+
+	qcow2_test_read(t, 0, 2 * QCOW2_TEST_SECS);
+	test_io_run();
+	assert_int_equal(t->req.err, 0);
+	test_check(t->buf, QCOW2_TEST_SECS, 1);
+	test_check(t->buf + QCOW2_TEST_CLUSTER, 1, 0x40);
+	test_check(t->buf + QCOW2_TEST_CLUSTER + SECTOR_SIZE,
+		   QCOW2_TEST_SECS - 1, 3);
+}
+
+void
+test_qcow2_overwrite_zero_clusters(void **state)
+{
+	struct qcow2_test *t = *state;
+	uint64_t owned  = QCOW2_TEST_END * QCOW2_TEST_CLUSTER;
+	uint64_t shared = (QCOW2_TEST_END + 1) * QCOW2_TEST_CLUSTER;
+	char zero[SECTOR_SIZE] = { 0 };
+	int i;
+
+	qcow2_test_grow(t, QCOW2_TEST_END + 2);
+	qcow2_test_set_l2(t, 0, owned | QCOW2_TEST_ZERO | QCOW2_TEST_COPIED);
+	qcow2_test_set_l2(t, 1, shared | QCOW2_TEST_ZERO);
+	qcow2_test_set_refcount(t, QCOW2_TEST_END, 1);
+	qcow2_test_set_refcount(t, QCOW2_TEST_END + 1, 1);
+	qcow2_test_reopen(t);
+
+	/* a preallocated cluster we own is written in place */
+	qcow2_test_write(t, &t->req, t->buf, 2, 1, 1);
+	assert_int_equal(test_io_run(), 3);
+	assert_int_equal(t->req.err, 0);
+	assert_int_equal(qcow2_test_l2(t, 0), owned | QCOW2_TEST_COPIED);
+	assert_int_equal(qcow2_test_refcount(t, QCOW2_TEST_END), 1);
+
+	/* one we don't is replaced, and released */
+	qcow2_test_write(t, &t->req, t->buf, QCOW2_TEST_SECS + 2, 1, 2);
+	assert_int_equal(test_io_run(), 4);
+	assert_int_equal(t->req.err, 0);
+	assert_int_equal(qcow2_test_l2(t, 1),
+			 (QCOW2_TEST_END + 2) * QCOW2_TEST_CLUSTER |
+			 QCOW2_TEST_COPIED);
+	assert_int_equal(qcow2_test_refcount(t, QCOW2_TEST_END + 1), 0);
+	assert_int_equal(qcow2_test_refcount(t, QCOW2_TEST_END + 2), 1);
+
+	/* the rest of both clusters still reads as zeroes */
+	qcow2_test_read(t, 0, 2 * QCOW2_TEST_SECS);
+	test_io_run();
+	assert_int_equal(t->req.err, 0);
+	for (i = 0; i < 2 * QCOW2_TEST_SECS; i++) {
+		char *sec = t->buf + ((size_t)i << SECTOR_SHIFT);
+
+		if (i == 2)
+			test_check(sec, 1, 1);
+		else if (i == QCOW2_TEST_SECS + 2)
+			test_check(sec, 1, 2);
+		else
+			assert_memory_equal(sec, zero, SECTOR_SIZE);
+	}
+}
+
+void
+test_qcow2_l2_cache_full(void **state)
+{
+	struct qcow2_test *t = *state;
+	struct test_req req[QCOW2_TEST_L1_SIZE - 1];
+	uint64_t end;
+	int i;
+
+	/* tables for all L1 entries but the last, all zero clusters */
+	end = QCOW2_TEST_END + QCOW2_TEST_L1_SIZE - 2;
+	qcow2_test_grow(t, end);
+	for (i = 1; i < QCOW2_TEST_L1_SIZE - 1; i++) {
+		uint64_t l2 = (QCOW2_TEST_END + i - 1) * QCOW2_TEST_CLUSTER;
+
+		qcow2_test_set64(t, QCOW2_TEST_L1 * QCOW2_TEST_CLUSTER + i * 8,
+				 l2 | QCOW2_TEST_COPIED);
+		qcow2_test_set64(t, l2, QCOW2_TEST_ZERO);
+		qcow2_test_set_refcount(t, QCOW2_TEST_END + i - 1, 1);
+	}
+	qcow2_test_reopen(t);
+
+	/* keep every cache slot busy reading its table */
+	for (i = 0; i < QCOW2_TEST_L1_SIZE - 1; i++)
+		tapdisk_qcow.td_queue_read(&t->driver,
+					   test_request(&req[i], TD_OP_READ,
+							t->buf,
+							i * QCOW2_TEST_L2_SECS,
+							1));
+
+	/* no slot for the new table: nothing reserved either */
+	qcow2_test_write(t, &t->req, t->buf + QCOW2_TEST_CLUSTER,
+			 (QCOW2_TEST_L1_SIZE - 1) * QCOW2_TEST_L2_SECS,
+			 QCOW2_TEST_SECS, 1);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, -EBUSY);
+
+	test_io_run();
+	for (i = 0; i < QCOW2_TEST_L1_SIZE - 1; i++)
+		assert_int_equal(req[i].err, 0);
+
+	qcow2_test_write(t, &t->req, t->buf + QCOW2_TEST_CLUSTER,
+			 (QCOW2_TEST_L1_SIZE - 1) * QCOW2_TEST_L2_SECS,
+			 QCOW2_TEST_SECS, 1);
+	test_io_run();
+	assert_int_equal(t->req.err, 0);
+	assert_int_equal(qcow2_test_l1(t, QCOW2_TEST_L1_SIZE - 1),
+			 end * QCOW2_TEST_CLUSTER | QCOW2_TEST_COPIED);
+	assert_int_equal(qcow2_test_refcount(t, end), 1);
+	assert_int_equal(qcow2_test_refcount(t, end + 1), 1);
+}
+
+void
+test_qcow2_failed_refcount_update(void **state)
+{
+	struct qcow2_test *t = *state;
+
+	/* the refcount update goes out first */
+	qcow2_test_load_l2(t);
+	test_io_fail_write(0, -EIO);
+	qcow2_test_write(t, &t->req, t->buf, 0, QCOW2_TEST_SECS, 1);
+	test_io_run();
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, -EIO);
+	assert_int_equal(qcow2_test_l2(t, 0), 0);
+
+	/* later allocations cannot trust the refcounts any more */
+	qcow2_test_write(t, &t->req, t->buf, QCOW2_TEST_SECS,
+			 QCOW2_TEST_SECS, 2);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, -EIO);
+	assert_int_equal(test_io_run(), 0);
+}
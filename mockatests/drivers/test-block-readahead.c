@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+
+extern struct tap_disk tapdisk_readahead;
+
+#define RA_TEST_SECS	(1 << 20)
+#define RA_TEST_SLOT	2048		/* sectors per prefetch buffer */
+
+/*
+ * The filter over a bare VBD. Guest requests it passes on are
+ * collected by the td_forward_request() wrapper; its prefetches are
+ * left on the VBD new requests list.
+ */
+struct ra_test {
+	td_vbd_t		vbd;
+	td_vbd_request_t	guest;
+	td_driver_t		driver;
+	char			buf[64 << SECTOR_SHIFT];
+	int			ndone;
+	int			err;
+};
+
+int
+ra_test_setup(void **state)
+{
+	struct ra_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+
+	test_vbd_init(&t->vbd);
+	t->guest.vbd = &t->vbd;
+	n_forwarded  = 0;
+
+	t->driver.info.size = RA_TEST_SECS;
+	assert_int_equal(test_driver_open(&t->driver, &tapdisk_readahead,
+					  "4", 0), 0);
+
+	*state = t;
+	return 0;
+}
+
+int
+ra_test_teardown(void **state)
+{
+	struct ra_test *t = *state;
+
+	test_driver_close(&t->driver);
+	free(t);
+
+	return 0;
+}
+
+static void
+ra_test_done(td_request_t treq, int err)
+{
+	struct ra_test *t = treq.cb_data;
+
+	t->ndone++;
+	t->err = err;
+}
+
+static td_request_t
+ra_test_request(struct ra_test *t, int op, td_sector_t sec, int secs)
+{
+	td_request_t treq;
+
+	bzero(&treq, sizeof(treq));
+	treq.op      = op;
+	treq.sec     = sec;
+	treq.secs    = secs;
+	treq.buf     = t->buf;
+	treq.cb      = ra_test_done;
+	treq.cb_data = t;
+	treq.vreq    = &t->guest;
+
+	return treq;
+}
+
+static void
+ra_test_read(struct ra_test *t, td_sector_t sec, int secs)
+{
+	tapdisk_readahead.td_queue_read(&t->driver,
+					ra_test_request(t, TD_OP_READ,
+							sec, secs));
+}
+
+static void
+ra_test_write(struct ra_test *t, td_sector_t sec, int secs)
+{
+	tapdisk_readahead.td_queue_write(&t->driver,
+					 ra_test_request(t, TD_OP_WRITE,
+							 sec, secs));
+}
+
+/*
+ * Sequential reads of 8 sectors from 0, until the filter prefetches
+ * from 24.
+ */
+static void
+ra_test_stream(struct ra_test *t)
+{
+	td_sector_t sec;
+
+	for (sec = 0; sec < 24; sec += 8)
+		ra_test_read(t, sec, 8);
+
+	assert_int_equal(n_forwarded, 3);
+	n_forwarded = 0;
+}
+
+static td_vbd_request_t *
+ra_test_prefetch(struct ra_test *t)
+{
+	td_vbd_request_t *vreq;
+
+	if (list_empty(&t->vbd.new_requests))
+		return NULL;
+
+	vreq = list_entry(t->vbd.new_requests.next, td_vbd_request_t, next);
+	list_del_init(&vreq->next);
+	vreq->list_head = NULL;
+
+	return vreq;
+}
+
+/*
+ * Fills the prefetch buffer with the low byte of each sector number,
+ * and completes it.
+ */
+static void
+ra_test_complete_prefetch(td_vbd_request_t *vreq, int err)
+{
+	char *buf = vreq->iov->base;
+	int i;
+
+	for (i = 0; i < vreq->iov->secs; i++)
+		memset(buf + ((size_t)i << SECTOR_SHIFT),
+		       (vreq->sec + i) & 0xff, SECTOR_SIZE);
+
+	vreq->cb(vreq, err, vreq->token, 1);
+}
+
+void
+test_readahead_sequential_reads_prefetch(void **state)
+{
+	struct ra_test *t = *state;
+	td_vbd_request_t *vreq;
+	td_request_t treq;
+
+	/* a random read prefetches nothing */
+	ra_test_read(t, 5000, 8);
+	assert_int_equal(n_forwarded, 1);
+	assert_true(list_empty(&t->vbd.new_requests));
+	n_forwarded = 0;
+
+	ra_test_stream(t);
+
+	vreq = ra_test_prefetch(t);
+	assert_non_null(vreq);
+	assert_null(ra_test_prefetch(t));
+	assert_int_equal(vreq->op, TD_OP_READ);
+	assert_int_equal(vreq->io_class, TD_VREQ_CLASS_BG);
+	assert_int_equal(vreq->sec, 24);
+	assert_int_equal(vreq->iov->secs, RA_TEST_SLOT);
+
+	/* the prefetch itself is passed on when it comes down */
+	treq = ra_test_request(t, TD_OP_READ, vreq->sec, vreq->iov->secs);
+	treq.vreq = vreq;
+	tapdisk_readahead.td_queue_read(&t->driver, treq);
+	assert_int_equal(n_forwarded, 1);
+	n_forwarded = 0;
+
+	ra_test_complete_prefetch(vreq, 0);
+
+	/* the next reads are served from the buffer */
+	ra_test_read(t, 24, 8);
+	ra_test_read(t, 32, 8);
+	assert_int_equal(n_forwarded, 0);
+	assert_int_equal(t->ndone, 2);
+	assert_int_equal(t->err, 0);
+	assert_int_equal(t->buf[0], 32);
+	assert_int_equal(t->buf[7 << SECTOR_SHIFT], 39);
+}
+
+void
+test_readahead_reads_wait_for_prefetch(void **state)
+{
+	struct ra_test *t = *state;
+	td_vbd_request_t *vreq;
+
+	ra_test_stream(t);
+	vreq = ra_test_prefetch(t);
+
+	ra_test_read(t, 24, 8);
+	assert_int_equal(n_forwarded, 0);
+	assert_int_equal(t->ndone, 0);
+
+	ra_test_complete_prefetch(vreq, 0);
+	assert_int_equal(t->ndone, 1);
+	assert_int_equal(t->buf[0], 24);
+}
+
+void
+test_readahead_failed_prefetch_forwards_waiters(void **state)
+{
+	struct ra_test *t = *state;
+	td_vbd_request_t *vreq;
+
+	ra_test_stream(t);
+	vreq = ra_test_prefetch(t);
+
+	ra_test_read(t, 24, 8);
+	ra_test_complete_prefetch(vreq, -EIO);
+
+	assert_int_equal(t->ndone, 0);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(forwarded[0].sec, 24);
+}
+
+void
+test_readahead_write_drops_prefetched_data(void **state)
+{
+	struct ra_test *t = *state;
+	td_vbd_request_t *vreq;
+	td_request_t treq;
+
+	ra_test_stream(t);
+	vreq = ra_test_prefetch(t);
+	ra_test_complete_prefetch(vreq, 0);
+
+	ra_test_write(t, 40, 8);
+	assert_int_equal(n_forwarded, 1);
+	treq = pop_forwarded();
+	assert_int_equal(treq.op, TD_OP_WRITE);
+
+	/* the write completes back to the guest */
+	treq.cb(treq, 0);
+	assert_int_equal(t->ndone, 1);
+
+	/* the buffer it overlapped is gone */
+	ra_test_read(t, 24, 8);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(t->ndone, 1);
+}
+
+void
+test_readahead_write_discards_pending_prefetch(void **state)
+{
+	struct ra_test *t = *state;
+	td_vbd_request_t *vreq;
+	td_request_t treq;
+
+	ra_test_stream(t);
+	vreq = ra_test_prefetch(t);
+
+	/* a read waiting on the prefetch, then a write over it */
+	ra_test_read(t, 24, 8);
+	ra_test_write(t, 1000, 8);
+	treq = pop_forwarded();
+	treq.cb(treq, 0);
+	t->ndone = 0;
+
+	/* later reads don't wait on it any more */
+	ra_test_read(t, 32, 8);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(forwarded[0].sec, 32);
+	n_forwarded = 0;
+
+	/* its data may predate the write: the waiter reads below */
+	ra_test_complete_prefetch(vreq, 0);
+	assert_int_equal(t->ndone, 0);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(forwarded[0].sec, 24);
+}
+
+void
+test_readahead_defers_prefetch_over_pending_write(void **state)
+{
+	struct ra_test *t = *state;
+	td_vbd_request_t *vreq;
+	td_request_t write;
+
+	ra_test_write(t, 100, 8);
+	write = pop_forwarded();
+
+	ra_test_stream(t);
+	assert_null(ra_test_prefetch(t));
+
+	/* split completion: in flight until the last part is done */
+	write.secs = 4;
+	write.cb(write, 0);
+	ra_test_read(t, 24, 8);
+	n_forwarded = 0;
+	assert_null(ra_test_prefetch(t));
+
+	write.sec += 4;
+	write.cb(write, 0);
+	assert_int_equal(t->ndone, 2);
+
+	ra_test_read(t, 32, 8);
+	n_forwarded = 0;
+	vreq = ra_test_prefetch(t);
+	assert_non_null(vreq);
+	assert_int_equal(vreq->sec, 40);
+}
+
+void
+test_readahead_close_drops_queued_prefetches(void **state)
+{
+	struct ra_test *t = *state;
+
+	ra_test_stream(t);
+	assert_false(list_empty(&t->vbd.new_requests));
+
+	test_driver_close(&t->driver);
+	assert_true(list_empty(&t->vbd.new_requests));
+}
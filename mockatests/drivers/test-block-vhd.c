@@ -0,0 +1,499 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE /* Needed for off64_t in libvhd.h */
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-storage.h"
+#include "libvhd.h"
+#include "util.h"
+
+extern struct tap_disk tapdisk_vhd;
+
+#define VHD_TEST_SPB	(VHD_BLOCK_SIZE >> VHD_SECTOR_SHIFT)
+#define VHD_TEST_BLKS	130	/* two BAT sectors */
+#define VHD_TEST_SECS	8	/* per write */
+#define VHD_TEST_REQS	4
+
+/*
+ * A dynamic image with 2MiB blocks.  On storage which is not
+ * preallocated new blocks take the full transactional path; otherwise
+ * they are taken from space zeroed ahead of time.
+ */
+struct vhd_test {
+	char			dir[TEST_DIR_LEN];
+	char			path[PATH_MAX];
+	uint64_t		table_offset;
+	td_driver_t		driver;
+	char		       *buf;
+	struct test_req		req[VHD_TEST_REQS];
+};
+
+/*
+ * As test_driver_open(), but the driver wants to know there is no key.
+ */
+static void
+vhd_test_open(struct vhd_test *t)
+{
+	struct td_vbd_encryption encryption = { 0 };
+
+	t->driver.ops  = &tapdisk_vhd;
+	t->driver.data = calloc(1, tapdisk_vhd.private_data_size);
+	assert_non_null(t->driver.data);
+	test_io_attach(&t->driver);
+
+	assert_int_equal(tapdisk_vhd.td_open(&t->driver, t->path,
+					     &encryption, 0), 0);
+}
+
+static int
+vhd_test_create(void **state, int storage_type)
+{
+	struct vhd_test *t;
+	vhd_context_t vhd;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+
+	test_dir_create(t->dir, "test-block-vhd");
+	test_dir_path(t->path, sizeof(t->path), t->dir, "disk.vhd");
+	assert_int_equal(vhd_create(t->path, (uint64_t)VHD_TEST_BLKS *
+				    VHD_BLOCK_SIZE, HD_TYPE_DYNAMIC, 0, 0), 0);
+
+	assert_int_equal(vhd_open(&vhd, t->path, VHD_OPEN_RDONLY), 0);
+	t->table_offset = vhd.header.table_offset;
+	vhd_close(&vhd);
+
+	/* the image is opened O_DIRECT */
+	assert_int_equal(posix_memalign((void **)&t->buf, 4096,
+					VHD_TEST_REQS * VHD_TEST_SECS *
+					VHD_SECTOR_SIZE), 0);
+
+	mock_storage_type = storage_type;
+	vhd_test_open(t);
+
+	*state = t;
+	return 0;
+}
+
+int
+vhd_test_setup(void **state)
+{
+	return vhd_test_create(state, TAPDISK_STORAGE_TYPE_NFS);
+}
+
+/*
+ * Preallocated, keeping a single block zeroed ahead.
+ */
+int
+vhd_prov_test_setup(void **state)
+{
+	setenv("TAPDISK_VHD_PROVISION_BLOCKS", "1", 1);
+	return vhd_test_create(state, TAPDISK_STORAGE_TYPE_EXT);
+}
+
+int
+vhd_test_teardown(void **state)
+{
+	struct vhd_test *t = *state;
+
+	test_driver_close(&t->driver);
+	mock_storage_type = 0;
+	unsetenv("TAPDISK_VHD_PROVISION_BLOCKS");
+	test_dir_remove(t->dir);
+	free(t->buf);
+	free(t);
+
+	return 0;
+}
+
+static char *
+vhd_test_buf(struct vhd_test *t, int i)
+{
+	return t->buf + (size_t)i * VHD_TEST_SECS * VHD_SECTOR_SIZE;
+}
+
+static void
+vhd_test_write(struct vhd_test *t, int i, td_sector_t sec, int seed)
+{
+	test_fill(vhd_test_buf(t, i), VHD_TEST_SECS, seed);
+	memset(&t->req[i], 0, sizeof(t->req[i]));
+	tapdisk_vhd.td_queue_write(&t->driver,
+				   test_request(&t->req[i], TD_OP_WRITE,
+						vhd_test_buf(t, i), sec,
+						VHD_TEST_SECS));
+}
+
+static void
+vhd_test_check(struct vhd_test *t, td_sector_t sec, int seed)
+{
+	memset(t->req, 0, sizeof(t->req[0]));
+	tapdisk_vhd.td_queue_read(&t->driver,
+				  test_request(&t->req[0], TD_OP_READ,
+					       t->buf, sec, VHD_TEST_SECS));
+	test_io_run();
+	assert_int_equal(t->req[0].ndone, 1);
+	assert_int_equal(t->req[0].err, 0);
+	test_check(t->buf, VHD_TEST_SECS, seed);
+}
+
+static void
+vhd_test_reopen(struct vhd_test *t)
+{
+	test_driver_close(&t->driver);
+	vhd_test_open(t);
+}
+
+/*
+ * The BAT sector written by the I/O at @offset, or -1 if it is not a
+ * BAT write.
+ */
+static int
+vhd_test_bat_sector(struct vhd_test *t, long long offset)
+{
+	if (offset < t->table_offset ||
+	    offset >= t->table_offset + 2 * VHD_SECTOR_SIZE)
+		return -1;
+
+	return (offset - t->table_offset) / VHD_SECTOR_SIZE;
+}
+
+/*
+ * The BAT entry of @blk, as on disk.
+ */
+static uint32_t
+vhd_test_bat(struct vhd_test *t, uint32_t blk)
+{
+	uint32_t entry;
+	int fd;
+
+	fd = open(t->path, O_RDONLY);
+	assert_true(fd >= 0);
+	assert_int_equal(pread(fd, &entry, sizeof(entry),
+			       t->table_offset + blk * sizeof(entry)),
+			 sizeof(entry));
+	close(fd);
+
+	return be32toh(entry);
+}
+
+/*
+ * Data and the zeroed bitmap first, then the bitmap, and only then
+ * the BAT entry linking them in. The write is done once it is.
+ */
+void
+test_vhd_alloc_write_order(void **state)
+{
+	struct vhd_test *t = *state;
+	long long data, offset;
+	size_t size;
+	int rw;
+
+	vhd_test_write(t, 0, VHD_TEST_SECS, 1);
+
+	/* the zeroed bitmap, with any padding before it, and the data */
+	assert_true(test_io_queued(1, &rw, &data, &size));
+	assert_false(test_io_queued(2, NULL, NULL, NULL));
+	assert_true(rw);
+	assert_int_equal(size, VHD_TEST_SECS * VHD_SECTOR_SIZE);
+
+	assert_int_equal(test_io_step(), 1);
+	assert_true(test_io_queued(0, NULL, &offset, NULL));
+	assert_int_equal(offset, data);
+	assert_false(test_io_queued(1, NULL, NULL, NULL));
+
+	/* the bitmap once the data is on disk */
+	assert_int_equal(test_io_step(), 1);
+	assert_true(test_io_queued(0, &rw, &offset, &size));
+	assert_false(test_io_queued(1, NULL, NULL, NULL));
+	assert_true(rw);
+	assert_int_equal(offset,
+			 data - (VHD_TEST_SECS + 1) * VHD_SECTOR_SIZE);
+	assert_int_equal(size, VHD_SECTOR_SIZE);
+	assert_int_equal(t->req[0].ndone, 0);
+
+	/* the BAT once the bitmap is */
+	assert_int_equal(test_io_step(), 1);
+	assert_true(test_io_queued(0, &rw, &offset, &size));
+	assert_false(test_io_queued(1, NULL, NULL, NULL));
+	assert_int_equal(vhd_test_bat_sector(t, offset), 0);
+	assert_int_equal(size, VHD_SECTOR_SIZE);
+	assert_int_equal(t->req[0].ndone, 0);
+	assert_int_equal(vhd_test_bat(t, 0), DD_BLK_UNUSED);
+
+	assert_int_equal(test_io_step(), 1);
+	assert_int_equal(t->req[0].ndone, 1);
+	assert_int_equal(t->req[0].err, 0);
+	assert_int_equal(vhd_test_bat(t, 0),
+			 data / VHD_SECTOR_SIZE - VHD_TEST_SECS - 1);
+
+	vhd_test_reopen(t);
+	vhd_test_check(t, VHD_TEST_SECS, 1);
+}
+
+/*
+ * Three blocks sharing a BAT sector and one in the next: both sectors
+ * are written at once, never twice at once, and the two allocations
+ * queued behind the first write of a sector share the next.
+ */
+void
+test_vhd_concurrent_allocs(void **state)
+{
+	struct vhd_test *t = *state;
+	const uint32_t blks[VHD_TEST_REQS] = { 0, 1, 2, 128 };
+	int i, j, rw, sector, writes, busy[2], max_busy;
+	long long offset;
+
+	for (i = 0; i < VHD_TEST_REQS; i++)
+		vhd_test_write(t, i, (td_sector_t)blks[i] * VHD_TEST_SPB, i);
+
+	writes = max_busy = 0;
+	while (test_io_queued(0, &rw, &offset, NULL)) {
+		busy[0] = busy[1] = 0;
+		for (j = 0; test_io_queued(j, NULL, &offset, NULL); j++) {
+			sector = vhd_test_bat_sector(t, offset);
+			if (sector >= 0)
+				assert_int_equal(busy[sector]++, 0);
+		}
+		max_busy = MAX(max_busy, busy[0] + busy[1]);
+
+		test_io_queued(0, &rw, &offset, NULL);
+		if (vhd_test_bat_sector(t, offset) >= 0)
+			writes++;
+
+		assert_int_equal(test_io_step(), 1);
+	}
+
+	assert_int_equal(writes, 3);
+	assert_int_equal(max_busy, 2);
+
+	for (i = 0; i < VHD_TEST_REQS; i++) {
+		assert_int_equal(t->req[i].ndone, 1);
+		assert_int_equal(t->req[i].err, 0);
+		assert_int_not_equal(vhd_test_bat(t, blks[i]), DD_BLK_UNUSED);
+		for (j = 0; j < i; j++)
+			assert_int_not_equal(vhd_test_bat(t, blks[i]),
+					     vhd_test_bat(t, blks[j]));
+	}
+
+	vhd_test_reopen(t);
+	for (i = 0; i < VHD_TEST_REQS; i++)
+		vhd_test_check(t, (td_sector_t)blks[i] * VHD_TEST_SPB, i);
+}
+
+/*
+ * A failed BAT write fails its own allocation only: the one queued
+ * behind it goes out with the next write of the sector, and the failed
+ * block can be allocated again.
+ */
+void
+test_vhd_failed_bat_write(void **state)
+{
+	struct vhd_test *t = *state;
+	long long offset;
+	uint32_t failed;
+	int rw;
+
+	vhd_test_write(t, 0, 0, 1);
+	vhd_test_write(t, 1, VHD_TEST_SPB, 2);
+
+	/* until the first BAT write is next, with block 1 waiting on it */
+	while (test_io_queued(0, &rw, &offset, NULL) &&
+	       vhd_test_bat_sector(t, offset) < 0)
+		assert_int_equal(test_io_step(), 1);
+	assert_false(test_io_queued(1, NULL, NULL, NULL));
+	assert_int_equal(t->req[0].ndone + t->req[1].ndone, 0);
+
+	test_io_fail_write(0, -EIO);
+	test_io_run();
+
+	assert_int_equal(t->req[0].ndone, 1);
+	assert_int_equal(t->req[0].err, -EIO);
+	assert_int_equal(t->req[1].ndone, 1);
+	assert_int_equal(t->req[1].err, 0);
+	assert_int_equal(vhd_test_bat(t, 0), DD_BLK_UNUSED);
+	failed = vhd_test_bat(t, 1);
+	assert_int_not_equal(failed, DD_BLK_UNUSED);
+
+	vhd_test_write(t, 0, 0, 3);
+	test_io_run();
+	assert_int_equal(t->req[0].ndone, 1);
+	assert_int_equal(t->req[0].err, 0);
+	assert_true(vhd_test_bat(t, 0) > vhd_test_bat(t, 1));
+
+	vhd_test_reopen(t);
+	vhd_test_check(t, 0, 3);
+	vhd_test_check(t, VHD_TEST_SPB, 2);
+}
+
+static off_t
+vhd_test_size(struct vhd_test *t)
+{
+	struct stat st;
+
+	assert_int_equal(stat(t->path, &st), 0);
+	return st.st_size;
+}
+
+/*
+ * Zeroing writes issued by a first allocation, which has to wait for
+ * them.  One block past next_db takes two 2MiB writes.
+ */
+static int
+vhd_test_provision(struct vhd_test *t)
+{
+	int rw, i;
+
+	vhd_test_write(t, 0, 0, 1);
+	assert_int_equal(t->req[0].ndone, 1);
+	assert_int_equal(t->req[0].err, -EBUSY);
+
+	for (i = 0; test_io_queued(i, &rw, NULL, NULL); i++)
+		assert_true(rw);
+
+	return test_io_run();
+}
+
+/*
+ * A block is only allocated once the space it takes is zeroed: until
+ * then its writes are retried, and none of them add zeroing.
+ */
+void
+test_vhd_provision_gate(void **state)
+{
+	struct vhd_test *t = *state;
+	size_t size;
+	int rw;
+
+	vhd_test_write(t, 0, 0, 1);
+	assert_int_equal(t->req[0].ndone, 1);
+	assert_int_equal(t->req[0].err, -EBUSY);
+	assert_true(test_io_queued(0, &rw, NULL, &size));
+	assert_true(test_io_queued(1, NULL, NULL, NULL));
+	assert_false(test_io_queued(2, NULL, NULL, NULL));
+	assert_true(rw);
+	assert_int_equal(size, VHD_BLOCK_SIZE);
+
+	vhd_test_write(t, 1, VHD_TEST_SECS, 2);
+	assert_int_equal(t->req[1].ndone, 1);
+	assert_int_equal(t->req[1].err, -EBUSY);
+	assert_false(test_io_queued(2, NULL, NULL, NULL));
+
+	assert_int_equal(test_io_run(), 2);
+
+	/* ready now, and the next block is zeroed behind it */
+	vhd_test_write(t, 0, 0, 1);
+	assert_int_equal(t->req[0].ndone, 0);
+	test_io_run();
+	assert_int_equal(t->req[0].ndone, 1);
+	assert_int_equal(t->req[0].err, 0);
+	assert_int_not_equal(vhd_test_bat(t, 0), DD_BLK_UNUSED);
+
+	vhd_test_write(t, 1, VHD_TEST_SPB, 2);
+	test_io_run();
+	assert_int_equal(t->req[1].ndone, 1);
+	assert_int_equal(t->req[1].err, 0);
+	assert_true(vhd_test_bat(t, 1) > vhd_test_bat(t, 0));
+
+	vhd_test_reopen(t);
+	vhd_test_check(t, 0, 1);
+	vhd_test_check(t, VHD_TEST_SPB, 2);
+}
+
+/*
+ * Zeroed space nothing was allocated from is dropped on close.
+ */
+void
+test_vhd_provision_truncate(void **state)
+{
+	struct vhd_test *t = *state;
+	vhd_context_t vhd;
+	off64_t eod;
+	off_t size;
+
+	assert_int_equal(vhd_test_provision(t), 2);
+	vhd_test_write(t, 0, 0, 1);
+	test_io_run();
+	assert_int_equal(t->req[0].err, 0);
+
+	test_driver_close(&t->driver);
+	size = vhd_test_size(t);
+
+	assert_int_equal(vhd_open(&vhd, t->path, VHD_OPEN_RDONLY), 0);
+	assert_int_equal(vhd_end_of_data(&vhd, &eod), 0);
+	vhd_close(&vhd);
+
+	assert_int_equal(eod, ((off64_t)vhd_test_bat(t, 0) + 1) *
+			 VHD_SECTOR_SIZE + VHD_BLOCK_SIZE);
+	assert_int_equal(size, eod + sizeof(vhd_footer_t));
+
+	vhd_test_open(t);
+	vhd_test_check(t, 0, 1);
+}
+
+/*
+ * Anything but a block count from 1 to 1024 keeps the default of four
+ * blocks, which take five writes to zero.
+ */
+void
+test_vhd_provision_blocks_env(void **state)
+{
+	struct vhd_test *t = *state;
+	const char *bad[] = { "", "0", "-1", "1025", "2x" };
+	int i;
+
+	assert_int_equal(vhd_test_provision(t), 2);
+
+	setenv("TAPDISK_VHD_PROVISION_BLOCKS", "3", 1);
+	vhd_test_reopen(t);
+	assert_int_equal(vhd_test_provision(t), 4);
+
+	for (i = 0; i < ARRAY_SIZE(bad); i++) {
+		setenv("TAPDISK_VHD_PROVISION_BLOCKS", bad[i], 1);
+		vhd_test_reopen(t);
+		assert_int_equal(vhd_test_provision(t), 5);
+	}
+}
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "libvhdx.h"
+
+extern struct tap_disk tapdisk_vhdx;
+
+#define VHDX_TEST_SIZE	(16 * VHDX_MiB)
+#define VHDX_TEST_LSEC	8		/* sectors, 4KiB logical sectors */
+#define VHDX_TEST_BUF	32
+
+/*
+ * A differencing image with 1MiB blocks and 4KiB logical sectors. Its
+ * parent is not opened: reads for it are collected by the
+ * td_forward_request() wrapper for the test to complete.
+ */
+struct vhdx_test {
+	char			dir[TEST_DIR_LEN];
+	char			parent[PATH_MAX];
+	char			path[PATH_MAX];
+	td_driver_t		driver;
+	char		       *buf;
+	struct test_req		req;
+};
+
+int
+vhdx_test_setup(void **state)
+{
+	struct vhdx_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+	n_forwarded = 0;
+
+	test_dir_create(t->dir, "test-block-vhdx");
+	test_dir_path(t->parent, sizeof(t->parent), t->dir, "parent.vhdx");
+	test_dir_path(t->path, sizeof(t->path), t->dir, "child.vhdx");
+
+	assert_int_equal(vhdx_create(t->parent, VHDX_TEST_SIZE, VHDX_MiB,
+				     VHDX_TEST_LSEC << SECTOR_SHIFT, NULL), 0);
+	assert_int_equal(vhdx_snapshot(t->path, t->parent, VHDX_MiB), 0);
+
+	/* the image is opened O_DIRECT */
+	assert_int_equal(posix_memalign((void **)&t->buf, 4096,
+					VHDX_TEST_BUF << SECTOR_SHIFT), 0);
+
+	assert_int_equal(test_driver_open(&t->driver, &tapdisk_vhdx,
+					  t->path, 0), 0);
+
+	*state = t;
+	return 0;
+}
+
+int
+vhdx_test_teardown(void **state)
+{
+	struct vhdx_test *t = *state;
+
+	test_driver_close(&t->driver);
+	test_dir_remove(t->dir);
+	free(t->buf);
+	free(t);
+
+	return 0;
+}
+
+static void
+vhdx_test_reopen(struct vhdx_test *t)
+{
+	test_driver_close(&t->driver);
+	assert_int_equal(test_driver_open(&t->driver, &tapdisk_vhdx,
+					  t->path, 0), 0);
+}
+
+static void
+vhdx_test_write(struct vhdx_test *t, td_sector_t sec, int secs, int seed)
+{
+	test_fill(t->buf, secs, seed);
+	tapdisk_vhdx.td_queue_write(&t->driver,
+				    test_request(&t->req, TD_OP_WRITE,
+						 t->buf, sec, secs));
+}
+
+static void
+vhdx_test_read(struct vhdx_test *t, td_sector_t sec, int secs)
+{
+	memset(t->buf, 0xee, (size_t)secs << SECTOR_SHIFT);
+	tapdisk_vhdx.td_queue_read(&t->driver,
+				   test_request(&t->req, TD_OP_READ,
+						t->buf, sec, secs));
+}
+
+/*
+ * Completes the oldest read forwarded to the parent, which holds
+ * @seed plus the sector number everywhere.
+ */
+static td_request_t
+vhdx_test_parent_read(int seed, int err)
+{
+	td_request_t treq;
+
+	assert_int_not_equal(n_forwarded, 0);
+	treq = pop_forwarded();
+	assert_int_equal(treq.op, TD_OP_READ);
+
+	test_fill(treq.buf, treq.secs, seed + treq.sec);
+	treq.cb(treq, err);
+
+	return treq;
+}
+
+void
+test_vhdx_partial_write_merges_parent(void **state)
+{
+	struct vhdx_test *t = *state;
+	td_request_t treq;
+
+	/* the rest of the logical sector comes from the parent first */
+	vhdx_test_write(t, 3, 1, 0x40);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(forwarded[0].sec, 0);
+	assert_int_equal(forwarded[0].secs, VHDX_TEST_LSEC);
+	assert_int_equal(test_io_run(), 0);
+
+	vhdx_test_parent_read(1, 0);
+	assert_int_equal(t->req.ndone, 0);
+
+	/* the data, the sector bitmap and its BAT entry, then the block's */
+	assert_int_equal(test_io_run(), 4);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, 0);
+
+	/* the block is partially present: the rest is the parent's */
+	vhdx_test_reopen(t);
+
+	vhdx_test_read(t, 0, 2 * VHDX_TEST_LSEC);
+	assert_int_equal(n_forwarded, 1);
+	treq = vhdx_test_parent_read(1, 0);
+	assert_int_equal(treq.sec, VHDX_TEST_LSEC);
+	assert_int_equal(treq.secs, VHDX_TEST_LSEC);
+
+	assert_int_equal(test_io_run(), 1);
+	assert_int_equal(t->req.ndone, 2);
+	assert_int_equal(t->req.err, 0);
+	test_check(t->buf, 3, 1);
+	test_check(t->buf + (3 << SECTOR_SHIFT), 1, 0x40);
+	test_check(t->buf + (4 << SECTOR_SHIFT), 2 * VHDX_TEST_LSEC - 4, 5);
+}
+
+void
+test_vhdx_partial_write_spanning_logical_sectors(void **state)
+{
+	struct vhdx_test *t = *state;
+
+	/* part of two, both read, only once each */
+	vhdx_test_write(t, 4, VHDX_TEST_LSEC, 0x40);
+	assert_int_equal(n_forwarded, 2);
+	assert_int_equal(forwarded[0].sec, 0);
+	assert_int_equal(forwarded[1].sec, VHDX_TEST_LSEC);
+
+	vhdx_test_parent_read(1, 0);
+	assert_int_equal(test_io_run(), 0);
+	vhdx_test_parent_read(1, 0);
+	assert_int_equal(test_io_run(), 4);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, 0);
+
+	vhdx_test_read(t, 0, 2 * VHDX_TEST_LSEC);
+	assert_int_equal(n_forwarded, 0);
+	assert_int_equal(test_io_run(), 1);
+	test_check(t->buf, 4, 1);
+	test_check(t->buf + (4 << SECTOR_SHIFT), VHDX_TEST_LSEC, 0x40);
+	test_check(t->buf + ((4 + VHDX_TEST_LSEC) << SECTOR_SHIFT), 4,
+		   1 + 4 + VHDX_TEST_LSEC);
+}
+
+void
+test_vhdx_partial_writes_wait_for_each_other(void **state)
+{
+	struct vhdx_test *t = *state;
+	struct test_req first;
+	char *buf;
+
+	assert_int_equal(posix_memalign((void **)&buf, 4096, SECTOR_SIZE), 0);
+	test_fill(buf, 1, 0x40);
+	tapdisk_vhdx.td_queue_write(&t->driver,
+				    test_request(&first, TD_OP_WRITE,
+						 buf, 1, 1));
+
+	/* another part of the same logical sector */
+	vhdx_test_write(t, 5, 1, 0x50);
+	assert_int_equal(n_forwarded, 1);
+
+	vhdx_test_parent_read(1, 0);
+	assert_int_equal(t->req.ndone, 0);
+
+	/* once the first is in, the second reads it back from here */
+	assert_int_equal(test_io_run(), 4 + 3);
+	assert_int_equal(n_forwarded, 0);
+	assert_int_equal(first.ndone, 1);
+	assert_int_equal(first.err, 0);
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, 0);
+
+	vhdx_test_read(t, 0, VHDX_TEST_LSEC);
+	assert_int_equal(test_io_run(), 1);
+	test_check(t->buf, 1, 1);
+	test_check(t->buf + (1 << SECTOR_SHIFT), 1, 0x40);
+	test_check(t->buf + (2 << SECTOR_SHIFT), 3, 3);
+	test_check(t->buf + (5 << SECTOR_SHIFT), 1, 0x50);
+	test_check(t->buf + (6 << SECTOR_SHIFT), 2, 7);
+
+	free(buf);
+}
+
+void
+test_vhdx_failed_parent_read_fails_write(void **state)
+{
+	struct vhdx_test *t = *state;
+
+	vhdx_test_write(t, 3, 1, 0x40);
+	vhdx_test_parent_read(1, -EIO);
+
+	assert_int_equal(t->req.ndone, 1);
+	assert_int_equal(t->req.err, -EIO);
+	assert_int_equal(test_io_run(), 0);
+
+	/* nothing was written */
+	vhdx_test_read(t, 0, VHDX_TEST_LSEC);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(forwarded[0].secs, VHDX_TEST_LSEC);
+}
+
+void
+test_vhdx_sector_bitmap(void **state)
+{
+	struct vhdx_test *t = *state;
+	td_request_t treq;
+
+	/* whole logical sectors need nothing from the parent */
+	vhdx_test_write(t, VHDX_TEST_LSEC, VHDX_TEST_LSEC, 0x40);
+	assert_int_equal(test_io_run(), 4);
+	vhdx_test_write(t, 3 * VHDX_TEST_LSEC, VHDX_TEST_LSEC, 0x50);
+	assert_int_equal(test_io_run(), 2);
+	assert_int_equal(n_forwarded, 0);
+
+	vhdx_test_reopen(t);
+
+	/* present and absent runs, in order */
+	vhdx_test_read(t, 0, 4 * VHDX_TEST_LSEC);
+	assert_int_equal(n_forwarded, 2);
+	assert_int_equal(forwarded[0].sec, 0);
+	assert_int_equal(forwarded[0].secs, VHDX_TEST_LSEC);
+	assert_int_equal(forwarded[1].sec, 2 * VHDX_TEST_LSEC);
+	assert_int_equal(forwarded[1].secs, VHDX_TEST_LSEC);
+
+	vhdx_test_parent_read(1, 0);
+	vhdx_test_parent_read(1, 0);
+	assert_int_equal(test_io_run(), 2);
+	assert_int_equal(t->req.ndone, 4);
+	assert_int_equal(t->req.err, 0);
+
+	test_check(t->buf, VHDX_TEST_LSEC, 1);
+	test_check(t->buf + (VHDX_TEST_LSEC << SECTOR_SHIFT),
+		   VHDX_TEST_LSEC, 0x40);
+	test_check(t->buf + (2 * VHDX_TEST_LSEC << SECTOR_SHIFT),
+		   VHDX_TEST_LSEC, 1 + 2 * VHDX_TEST_LSEC);
+	test_check(t->buf + (3 * VHDX_TEST_LSEC << SECTOR_SHIFT),
+		   VHDX_TEST_LSEC, 0x50);
+
+	/* blocks never written are the parent's too */
+	vhdx_test_read(t, VHDX_MiB >> SECTOR_SHIFT, 8);
+	assert_int_equal(n_forwarded, 1);
+	treq = pop_forwarded();
+	assert_int_equal(treq.secs, 8);
+}
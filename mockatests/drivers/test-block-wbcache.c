@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
+#include "scheduler.h"
+
+extern struct tap_disk tapdisk_wbcache;
+
+/* gettimeofday() is wrapped in test-scheduler.c */
+extern struct timeval fake_gettimeofday;
+
+#define WB_TEST_SECS	(16 << 11)	/* 16MiB image */
+#define WB_TEST_BIG	(1 << 11)	/* 1MiB writes, to fill the log */
+#define WB_TEST_MAX	16
+
+/*
+ * The cache over a test disk, which keeps destage writes queued until
+ * the test completes them, and then applies them to DISK. The log is
+ * the smallest there can be, 8MiB.
+ */
+struct wb_test {
+	char			dir[TEST_DIR_LEN];
+	char			log[PATH_MAX];
+	td_driver_t		driver;
+	td_driver_t		parent;
+
+	char		       *disk;
+	td_request_t		writes[WB_TEST_MAX];
+	int			n_writes;
+
+	char		       *buf;
+	char		       *rbuf;
+};
+
+static struct wb_test *wb_test;
+
+static void
+wb_test_disk_write(td_driver_t *driver, td_request_t treq)
+{
+	assert_in_range(wb_test->n_writes, 0, WB_TEST_MAX - 1);
+	wb_test->writes[wb_test->n_writes++] = treq;
+}
+
+static struct tap_disk wb_test_disk = {
+	.disk_type      = "test",
+	.td_queue_write = wb_test_disk_write,
+};
+
+static int
+wb_test_open(struct wb_test *t, const char *parent)
+{
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_TIMEOUT);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+
+	assert_int_equal(test_driver_open(&t->driver, &tapdisk_wbcache,
+					  t->log, 0), 0);
+
+	t->parent.name      = (char *)parent;
+	t->parent.type      = DISK_TYPE_AIO;
+	t->parent.ops       = &wb_test_disk;
+	t->parent.info.size = WB_TEST_SECS;
+	t->driver.info      = t->parent.info;
+
+	return tapdisk_wbcache.td_validate_parent(&t->driver, &t->parent, 0);
+}
+
+static void
+wb_test_reopen(struct wb_test *t)
+{
+	test_driver_close(&t->driver);
+	assert_int_equal(wb_test_open(t, "disk.img"), 0);
+}
+
+int
+wbc_test_setup(void **state)
+{
+	struct wb_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+	wb_test = t;
+
+	n_forwarded = 0;
+	fake_gettimeofday = (struct timeval){ .tv_sec = 1000 };
+	setenv("TAPDISK_WBC_SIZE_MB", "8", 1);
+
+	test_dir_create(t->dir, "test-block-wbcache");
+	test_dir_path(t->log, sizeof(t->log), t->dir, "wbc.log");
+
+	/* the log may be opened O_DIRECT */
+	assert_int_equal(posix_memalign((void **)&t->buf, 4096,
+					WB_TEST_BIG << SECTOR_SHIFT), 0);
+	assert_int_equal(posix_memalign((void **)&t->rbuf, 4096,
+					WB_TEST_BIG << SECTOR_SHIFT), 0);
+	t->disk = calloc(WB_TEST_SECS, SECTOR_SIZE);
+	assert_non_null(t->disk);
+
+	assert_int_equal(wb_test_open(t, "disk.img"), 0);
+
+	*state = t;
+	return 0;
+}
+
+int
+wbc_test_teardown(void **state)
+{
+	struct wb_test *t = *state;
+
+	test_driver_close(&t->driver);
+	test_dir_remove(t->dir);
+
+	free(t->buf);
+	free(t->rbuf);
+	free(t->disk);
+	free(t);
+	wb_test = NULL;
+
+	return 0;
+}
+
+static void
+wb_test_write(struct wb_test *t, struct test_req *req,
+	      td_sector_t sec, int secs, int seed)
+{
+	test_fill(t->buf, secs, seed);
+	tapdisk_wbcache.td_queue_write(&t->driver,
+				       test_request(req, TD_OP_WRITE,
+						    t->buf, sec, secs));
+}
+
+/*
+ * Writes and waits for the log.
+ */
+static void
+wb_test_log(struct wb_test *t, td_sector_t sec, int secs, int seed)
+{
+	struct test_req req;
+
+	wb_test_write(t, &req, sec, secs, seed);
+	test_io_run();
+
+	assert_int_equal(req.ndone, 1);
+	assert_int_equal(req.err, 0);
+}
+
+static void
+wb_test_read(struct wb_test *t, struct test_req *req,
+	     td_sector_t sec, int secs)
+{
+	memset(t->rbuf, 0xee, (size_t)secs << SECTOR_SHIFT);
+	tapdisk_wbcache.td_queue_read(&t->driver,
+				      test_request(req, TD_OP_READ,
+						   t->rbuf, sec, secs));
+}
+
+static void
+wb_test_complete_write(struct wb_test *t, int err)
+{
+	td_request_t treq;
+
+	assert_int_not_equal(t->n_writes, 0);
+	treq = t->writes[0];
+	memmove(&t->writes[0], &t->writes[1],
+		--t->n_writes * sizeof(treq));
+
+	if (!err)
+		memcpy(t->disk + ((size_t)treq.sec << SECTOR_SHIFT), treq.buf,
+		       (size_t)treq.secs << SECTOR_SHIFT);
+
+	td_complete_request(treq, err);
+}
+
+static void
+wb_test_tick(int secs)
+{
+	fake_gettimeofday.tv_sec += secs;
+	registered_cb(0, SCHEDULER_POLL_TIMEOUT, registered_data);
+}
+
+/*
+ * What the VBD does while quiescing: ask until the cache is no longer
+ * busy, completing whatever it has in flight.
+ */
+static void
+wb_test_drain(struct wb_test *t)
+{
+	int i;
+
+	for (i = 0; tapdisk_wbcache.td_busy(&t->driver); i++) {
+		assert_in_range(i, 0, 16);
+		test_io_run();
+		while (t->n_writes)
+			wb_test_complete_write(t, 0);
+	}
+}
+
+void
+test_wbc_acks_once_logged(void **state)
+{
+	struct wb_test *t = *state;
+	struct test_req w, r;
+
+	wb_test_write(t, &w, 100, 8, 1);
+	assert_int_equal(w.ndone, 0);
+
+	/* served from memory until it is durable */
+	wb_test_read(t, &r, 100, 8);
+	assert_int_equal(r.ndone, 1);
+	test_check(t->rbuf, 8, 1);
+
+	assert_int_equal(test_io_run(), 1);
+	assert_int_equal(w.ndone, 1);
+	assert_int_equal(w.err, 0);
+
+	/* then from the log, and around it from the image */
+	wb_test_read(t, &r, 96, 16);
+	assert_int_equal(n_forwarded, 2);
+	assert_int_equal(forwarded[0].sec, 96);
+	assert_int_equal(forwarded[0].secs, 4);
+	assert_int_equal(forwarded[1].sec, 108);
+	assert_int_equal(forwarded[1].secs, 4);
+	n_forwarded = 0;
+
+	assert_int_equal(test_io_run(), 1);
+	assert_int_equal(r.ndone, 1);
+	test_check(t->rbuf + (4 << SECTOR_SHIFT), 8, 1);
+
+	/* nothing reaches the image while writes settle */
+	wb_test_tick(0);
+	assert_int_equal(test_io_run(), 0);
+	assert_int_equal(t->n_writes, 0);
+}
+
+void
+test_wbc_destages_in_merged_runs(void **state)
+{
+	struct wb_test *t = *state;
+	struct test_req r;
+
+	wb_test_log(t, 100, 8, 3);
+	wb_test_log(t, 8, 8, 2);
+	wb_test_log(t, 0, 8, 1);
+
+	wb_test_tick(2);
+	assert_int_equal(test_io_run(), 3);
+
+	/* sorted, with adjacent records merged */
+	assert_int_equal(t->n_writes, 2);
+	assert_int_equal(t->writes[0].sec, 0);
+	assert_int_equal(t->writes[0].secs, 16);
+	assert_int_equal(t->writes[1].sec, 100);
+	assert_int_equal(t->writes[1].secs, 8);
+	wb_test_complete_write(t, 0);
+	wb_test_complete_write(t, 0);
+
+	test_check(t->disk, 8, 1);
+	test_check(t->disk + (8 << SECTOR_SHIFT), 8, 2);
+	test_check(t->disk + (100 << SECTOR_SHIFT), 8, 3);
+	assert_int_equal(tapdisk_wbcache.td_busy(&t->driver), 0);
+
+	/* destaged records are gone, now and after a restart */
+	wb_test_read(t, &r, 0, 8);
+	assert_int_equal(n_forwarded, 1);
+	n_forwarded = 0;
+
+	wb_test_reopen(t);
+	wb_test_read(t, &r, 100, 8);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(test_io_run(), 0);
+}
+
+void
+test_wbc_keeps_write_order(void **state)
+{
+	struct wb_test *t = *state;
+	struct test_req r;
+
+	/* an overwritten record is neither read nor destaged */
+	wb_test_log(t, 0, 8, 1);
+	wb_test_log(t, 0, 8, 2);
+
+	wb_test_read(t, &r, 0, 8);
+	assert_int_equal(test_io_run(), 1);
+	test_check(t->rbuf, 8, 2);
+
+	wb_test_tick(2);
+	assert_int_equal(test_io_run(), 1);
+	assert_int_equal(t->n_writes, 1);
+	wb_test_complete_write(t, 0);
+	test_check(t->disk, 8, 2);
+
+	/* one only partly overwritten goes down first, on its own */
+	wb_test_log(t, 16, 8, 3);
+	wb_test_log(t, 18, 2, 4);
+
+	wb_test_tick(2);
+	assert_int_equal(test_io_run(), 1);
+	assert_int_equal(t->n_writes, 1);
+	assert_int_equal(t->writes[0].sec, 16);
+	assert_int_equal(t->writes[0].secs, 8);
+	wb_test_complete_write(t, 0);
+
+	assert_int_equal(test_io_run(), 1);
+	assert_int_equal(t->n_writes, 1);
+	assert_int_equal(t->writes[0].sec, 18);
+	assert_int_equal(t->writes[0].secs, 2);
+	wb_test_complete_write(t, 0);
+
+	test_check(t->disk + (16 << SECTOR_SHIFT), 2, 3);
+	test_check(t->disk + (18 << SECTOR_SHIFT), 2, 4);
+	test_check(t->disk + (20 << SECTOR_SHIFT), 4, 7);
+	assert_int_equal(tapdisk_wbcache.td_busy(&t->driver), 0);
+}
+
+void
+test_wbc_replays_after_restart(void **state)
+{
+	struct wb_test *t = *state;
+	struct test_req r;
+
+	wb_test_log(t, 0, 8, 1);
+	wb_test_log(t, 64, 8, 2);
+	wb_test_log(t, 2, 2, 3);
+
+	/* the log holds writes for this image only */
+	test_driver_close(&t->driver);
+	assert_int_equal(wb_test_open(t, "other.img"), -EINVAL);
+	wb_test_reopen(t);
+
+	wb_test_read(t, &r, 0, 8);
+	assert_int_equal(n_forwarded, 0);
+	assert_int_equal(test_io_run(), 3);
+	assert_int_equal(r.ndone, 3);
+	test_check(t->rbuf, 2, 1);
+	test_check(t->rbuf + (2 << SECTOR_SHIFT), 2, 3);
+	test_check(t->rbuf + (4 << SECTOR_SHIFT), 4, 5);
+
+	wb_test_read(t, &r, 64, 8);
+	assert_int_equal(test_io_run(), 1);
+	test_check(t->rbuf, 8, 2);
+
+	/* draining does not wait for writes to settle */
+	wb_test_drain(t);
+	test_check(t->disk, 2, 1);
+	test_check(t->disk + (2 << SECTOR_SHIFT), 2, 3);
+	test_check(t->disk + (4 << SECTOR_SHIFT), 4, 5);
+	test_check(t->disk + (64 << SECTOR_SHIFT), 8, 2);
+
+	/* once clean, it can go to another */
+	test_driver_close(&t->driver);
+	assert_int_equal(wb_test_open(t, "other.img"), 0);
+}
+
+void
+test_wbc_failed_log_write_is_skipped(void **state)
+{
+	struct wb_test *t = *state;
+	struct test_req w, r;
+
+	test_io_fail_write(0, -EIO);
+	wb_test_write(t, &w, 0, 8, 1);
+	test_io_run();
+	assert_int_equal(w.ndone, 1);
+	assert_int_equal(w.err, -EIO);
+
+	wb_test_log(t, 8, 8, 2);
+
+	wb_test_read(t, &r, 0, 16);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(forwarded[0].sec, 0);
+	assert_int_equal(forwarded[0].secs, 8);
+	n_forwarded = 0;
+	test_io_run();
+
+	/* replay steps over the failed record to the one after */
+	wb_test_reopen(t);
+
+	wb_test_read(t, &r, 0, 16);
+	assert_int_equal(n_forwarded, 1);
+	assert_int_equal(forwarded[0].sec, 0);
+	n_forwarded = 0;
+	assert_int_equal(test_io_run(), 1);
+	test_check(t->rbuf + (8 << SECTOR_SHIFT), 8, 2);
+
+	wb_test_log(t, 16, 8, 10);
+
+	wb_test_drain(t);
+	test_check(t->disk + (8 << SECTOR_SHIFT), 16, 2);
+	test_check(t->disk, 1, 0);
+}
+
+void
+test_wbc_full_log_holds_writes(void **state)
+{
+	struct wb_test *t = *state;
+	struct test_req w;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		wb_test_log(t, i * WB_TEST_BIG, WB_TEST_BIG, i);
+	assert_int_equal(t->n_writes, 0);
+
+	/* half full: destage without waiting */
+	wb_test_log(t, 3 * WB_TEST_BIG, WB_TEST_BIG, 3);
+	assert_int_equal(t->n_writes, 4);
+
+	for (i = 4; i < 7; i++)
+		wb_test_log(t, i * WB_TEST_BIG, WB_TEST_BIG, i);
+
+	/* full: the next write waits for space */
+	wb_test_write(t, &w, 7 * WB_TEST_BIG, WB_TEST_BIG, 7);
+	assert_int_equal(test_io_run(), 0);
+	assert_int_equal(w.ndone, 0);
+
+	while (t->n_writes)
+		wb_test_complete_write(t, 0);
+
+	/* and goes in at the start of the log */
+	test_io_run();
+	assert_int_equal(w.ndone, 1);
+	assert_int_equal(w.err, 0);
+
+	wb_test_drain(t);
+	for (i = 0; i < 8; i++)
+		test_check(t->disk + ((size_t)i * WB_TEST_BIG << SECTOR_SHIFT),
+			   WB_TEST_BIG, i);
+}
@@ -42,7 +42,23 @@ int main(void)
 		cmocka_run_group_tests_name("Stats tests", tapdisk_stats_tests, NULL, NULL)+
 		cmocka_run_group_tests_name("nbd_server_tests", tapdisk_nbdserver_tests, NULL, NULL)+
 		cmocka_run_group_tests_name("VBD tests", tapdisk_vbd_tests, NULL, NULL)+
-		cmocka_run_group_tests_name("Scheduler tests", tapdisk_sched_tests, NULL, NULL);
+		cmocka_run_group_tests_name("Scheduler tests", tapdisk_sched_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("block-aio tests", block_aio_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("Dirty map and copier tests", tapdisk_dirty_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("Resync tests", tapdisk_resync_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("Mirror tests", tapdisk_mirror_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("Readahead tests", block_readahead_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("cz tests", block_cz_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("dedup tests", block_dedup_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("llcache tests", block_llcache_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("wbcache tests", block_wbcache_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("Syncer tests", tapdisk_syncer_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("vhdx tests", block_vhdx_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("uring tests", tapdisk_uring_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("qcow2 tests", block_qcow2_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("vhd tests", block_vhd_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("ublk tests", tapdisk_ublk_tests, NULL, NULL)+
+		cmocka_run_group_tests_name("diff tests", tapdisk_diff_tests, NULL, NULL);
 
 	return result;
 }
@@ -51,16 +51,32 @@ void test_vbd_complete_td_request(void **state);
 void test_vbd_issue_request(void **stat);
 void test_vbd_complete_block_status_request(void **stat);
 
+int vbd_class_test_setup(void **state);
+int vbd_class_test_teardown(void **state);
+
+void test_vbd_class_two_pass_issue(void **state);
+void test_vbd_class_deadline(void **state);
+
 static const struct CMUnitTest tapdisk_vbd_tests[] = {
 	cmocka_unit_test(test_vbd_linked_list),
 	cmocka_unit_test(test_vbd_issue_request),
-	cmocka_unit_test(test_vbd_complete_block_status_request)
+	cmocka_unit_test(test_vbd_complete_block_status_request),
+	cmocka_unit_test_setup_teardown(test_vbd_class_two_pass_issue, vbd_class_test_setup, vbd_class_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vbd_class_deadline, vbd_class_test_setup, vbd_class_test_teardown)
 };
 
 void test_nbdserver_new_protocol_handshake(void **state);
 void test_nbdserver_new_protocol_handshake_send_fails(void **state);
+int nbd_test_setup(void **state);
+int nbd_test_teardown(void **state);
+void test_nbdserver_attached_client_is_foreground(void **state);
+void test_nbdserver_flush_waits_for_writes(void **state);
+void test_nbdserver_flush_when_idle(void **state);
 static const struct CMUnitTest tapdisk_nbdserver_tests[] = {
-	cmocka_unit_test(test_nbdserver_new_protocol_handshake)
+	cmocka_unit_test(test_nbdserver_new_protocol_handshake),
+	cmocka_unit_test_setup_teardown(test_nbdserver_attached_client_is_foreground, nbd_test_setup, nbd_test_teardown),
+	cmocka_unit_test_setup_teardown(test_nbdserver_flush_waits_for_writes, nbd_test_setup, nbd_test_teardown),
+	cmocka_unit_test_setup_teardown(test_nbdserver_flush_when_idle, nbd_test_setup, nbd_test_teardown)
 };
 
 void test_scheduler_set_max_timeout(void **state);
@@ -177,4 +193,269 @@ static const struct CMUnitTest tapdisk_sched_tests[] = {
   cmocka_unit_test(test_scheduler_run_deleted_duplicate_event),
 };
 
+void test_aio_block_status_splits_extents(void **state);
+void test_aio_block_status_cache_hits(void **state);
+void test_aio_write_invalidates_hole(void **state);
+void test_aio_block_status_without_seek_hole(void **state);
+
+static const struct CMUnitTest block_aio_tests[] = {
+	cmocka_unit_test(test_aio_block_status_splits_extents),
+	cmocka_unit_test(test_aio_block_status_cache_hits),
+	cmocka_unit_test(test_aio_write_invalidates_hole),
+	cmocka_unit_test(test_aio_block_status_without_seek_hole)
+};
+
+void test_dirty_map_mark_and_runs(void **state);
+void test_copier_copies_dirty_runs(void **state);
+void test_copier_respects_budget_and_state(void **state);
+void test_copier_holds_runs_under_pending_writes(void **state);
+void test_copier_redirties_racing_writes(void **state);
+void test_copier_redirties_failed_copies(void **state);
+void test_copier_destroy_cancels_queued_copies(void **state);
+
+static const struct CMUnitTest tapdisk_dirty_tests[] = {
+	cmocka_unit_test(test_dirty_map_mark_and_runs),
+	cmocka_unit_test(test_copier_copies_dirty_runs),
+	cmocka_unit_test(test_copier_respects_budget_and_state),
+	cmocka_unit_test(test_copier_holds_runs_under_pending_writes),
+	cmocka_unit_test(test_copier_redirties_racing_writes),
+	cmocka_unit_test(test_copier_redirties_failed_copies),
+	cmocka_unit_test(test_copier_destroy_cancels_queued_copies)
+};
+
+void test_resync_degraded_tracks_writes(void **state);
+void test_resync_copies_dirty_blocks_to_secondary(void **state);
+void test_resync_redirties_writes_racing_copies(void **state);
+void test_resync_write_failure_degrades(void **state);
+void test_resync_free_cancels_queued_copies(void **state);
+
+static const struct CMUnitTest tapdisk_resync_tests[] = {
+	cmocka_unit_test(test_resync_degraded_tracks_writes),
+	cmocka_unit_test(test_resync_copies_dirty_blocks_to_secondary),
+	cmocka_unit_test(test_resync_redirties_writes_racing_copies),
+	cmocka_unit_test(test_resync_write_failure_degrades),
+	cmocka_unit_test(test_resync_free_cancels_queued_copies)
+};
+
+void test_mirror_async_writes_keep_order(void **state);
+void test_mirror_lag_limits(void **state);
+void test_mirror_failure_degrades_to_resync(void **state);
+void test_mirror_busy_secondary_retries(void **state);
+
+static const struct CMUnitTest tapdisk_mirror_tests[] = {
+	cmocka_unit_test(test_mirror_async_writes_keep_order),
+	cmocka_unit_test(test_mirror_lag_limits),
+	cmocka_unit_test(test_mirror_failure_degrades_to_resync),
+	cmocka_unit_test(test_mirror_busy_secondary_retries)
+};
+
+int ra_test_setup(void **state);
+int ra_test_teardown(void **state);
+
+void test_readahead_sequential_reads_prefetch(void **state);
+void test_readahead_reads_wait_for_prefetch(void **state);
+void test_readahead_failed_prefetch_forwards_waiters(void **state);
+void test_readahead_write_drops_prefetched_data(void **state);
+void test_readahead_write_discards_pending_prefetch(void **state);
+void test_readahead_defers_prefetch_over_pending_write(void **state);
+void test_readahead_close_drops_queued_prefetches(void **state);
+
+static const struct CMUnitTest block_readahead_tests[] = {
+	cmocka_unit_test_setup_teardown(test_readahead_sequential_reads_prefetch, ra_test_setup, ra_test_teardown),
+	cmocka_unit_test_setup_teardown(test_readahead_reads_wait_for_prefetch, ra_test_setup, ra_test_teardown),
+	cmocka_unit_test_setup_teardown(test_readahead_failed_prefetch_forwards_waiters, ra_test_setup, ra_test_teardown),
+	cmocka_unit_test_setup_teardown(test_readahead_write_drops_prefetched_data, ra_test_setup, ra_test_teardown),
+	cmocka_unit_test_setup_teardown(test_readahead_write_discards_pending_prefetch, ra_test_setup, ra_test_teardown),
+	cmocka_unit_test_setup_teardown(test_readahead_defers_prefetch_over_pending_write, ra_test_setup, ra_test_teardown),
+	cmocka_unit_test_setup_teardown(test_readahead_close_drops_queued_prefetches, ra_test_setup, ra_test_teardown)
+};
+
+int cz_test_setup(void **state);
+int cz_test_teardown(void **state);
+
+void test_cz_write_read_compressed(void **state);
+void test_cz_zero_and_unwritten_chunks(void **state);
+void test_cz_partial_write_merges_parent_data(void **state);
+void test_cz_rewrite_keeps_cache_coherent(void **state);
+void test_cz_requests_wait_for_their_chunk(void **state);
+void test_cz_rewrites_reuse_space(void **state);
+
+static const struct CMUnitTest block_cz_tests[] = {
+	cmocka_unit_test_setup_teardown(test_cz_write_read_compressed, cz_test_setup, cz_test_teardown),
+	cmocka_unit_test_setup_teardown(test_cz_zero_and_unwritten_chunks, cz_test_setup, cz_test_teardown),
+	cmocka_unit_test_setup_teardown(test_cz_partial_write_merges_parent_data, cz_test_setup, cz_test_teardown),
+	cmocka_unit_test_setup_teardown(test_cz_rewrite_keeps_cache_coherent, cz_test_setup, cz_test_teardown),
+	cmocka_unit_test_setup_teardown(test_cz_requests_wait_for_their_chunk, cz_test_setup, cz_test_teardown),
+	cmocka_unit_test_setup_teardown(test_cz_rewrites_reuse_space, cz_test_setup, cz_test_teardown)
+};
+
+int dedup_test_setup(void **state);
+int dedup_test_teardown(void **state);
+
+void test_dedup_identical_chunks_stored_once(void **state);
+void test_dedup_reopen_reads_from_store(void **state);
+void test_dedup_partial_writes(void **state);
+void test_dedup_full_store_passes_through(void **state);
+void test_dedup_failed_writes_keep_old_copy(void **state);
+
+static const struct CMUnitTest block_dedup_tests[] = {
+	cmocka_unit_test_setup_teardown(test_dedup_identical_chunks_stored_once, dedup_test_setup, dedup_test_teardown),
+	cmocka_unit_test_setup_teardown(test_dedup_reopen_reads_from_store, dedup_test_setup, dedup_test_teardown),
+	cmocka_unit_test_setup_teardown(test_dedup_partial_writes, dedup_test_setup, dedup_test_teardown),
+	cmocka_unit_test_setup_teardown(test_dedup_full_store_passes_through, dedup_test_setup, dedup_test_teardown),
+	cmocka_unit_test_setup_teardown(test_dedup_failed_writes_keep_old_copy, dedup_test_setup, dedup_test_teardown)
+};
+
+int llcache_test_setup(void **state);
+int llcache_test_teardown(void **state);
+
+void test_llcache_degrades_and_recovers(void **state);
+void test_llcache_failed_probe_backs_off(void **state);
+void test_llcache_writes_during_recovery(void **state);
+
+static const struct CMUnitTest block_llcache_tests[] = {
+	cmocka_unit_test_setup_teardown(test_llcache_degrades_and_recovers, llcache_test_setup, llcache_test_teardown),
+	cmocka_unit_test_setup_teardown(test_llcache_failed_probe_backs_off, llcache_test_setup, llcache_test_teardown),
+	cmocka_unit_test_setup_teardown(test_llcache_writes_during_recovery, llcache_test_setup, llcache_test_teardown)
+};
+
+int wbc_test_setup(void **state);
+int wbc_test_teardown(void **state);
+
+void test_wbc_acks_once_logged(void **state);
+void test_wbc_destages_in_merged_runs(void **state);
+void test_wbc_keeps_write_order(void **state);
+void test_wbc_replays_after_restart(void **state);
+void test_wbc_failed_log_write_is_skipped(void **state);
+void test_wbc_full_log_holds_writes(void **state);
+
+static const struct CMUnitTest block_wbcache_tests[] = {
+	cmocka_unit_test_setup_teardown(test_wbc_acks_once_logged, wbc_test_setup, wbc_test_teardown),
+	cmocka_unit_test_setup_teardown(test_wbc_destages_in_merged_runs, wbc_test_setup, wbc_test_teardown),
+	cmocka_unit_test_setup_teardown(test_wbc_keeps_write_order, wbc_test_setup, wbc_test_teardown),
+	cmocka_unit_test_setup_teardown(test_wbc_replays_after_restart, wbc_test_setup, wbc_test_teardown),
+	cmocka_unit_test_setup_teardown(test_wbc_failed_log_write_is_skipped, wbc_test_setup, wbc_test_teardown),
+	cmocka_unit_test_setup_teardown(test_wbc_full_log_holds_writes, wbc_test_setup, wbc_test_teardown)
+};
+
+int syncer_test_setup(void **state);
+int syncer_test_teardown(void **state);
+
+void test_syncer_detects_io_mode(void **state);
+void test_syncer_batches_completions(void **state);
+void test_syncer_passes_through(void **state);
+void test_syncer_close_flushes(void **state);
+void test_syncer_failed_sync_is_sticky(void **state);
+
+static const struct CMUnitTest tapdisk_syncer_tests[] = {
+	cmocka_unit_test_setup_teardown(test_syncer_detects_io_mode, syncer_test_setup, syncer_test_teardown),
+	cmocka_unit_test_setup_teardown(test_syncer_batches_completions, syncer_test_setup, syncer_test_teardown),
+	cmocka_unit_test_setup_teardown(test_syncer_passes_through, syncer_test_setup, syncer_test_teardown),
+	cmocka_unit_test_setup_teardown(test_syncer_close_flushes, syncer_test_setup, syncer_test_teardown),
+	cmocka_unit_test_setup_teardown(test_syncer_failed_sync_is_sticky, syncer_test_setup, syncer_test_teardown)
+};
+
+int vhdx_test_setup(void **state);
+int vhdx_test_teardown(void **state);
+
+void test_vhdx_partial_write_merges_parent(void **state);
+void test_vhdx_partial_write_spanning_logical_sectors(void **state);
+void test_vhdx_partial_writes_wait_for_each_other(void **state);
+void test_vhdx_failed_parent_read_fails_write(void **state);
+void test_vhdx_sector_bitmap(void **state);
+
+static const struct CMUnitTest block_vhdx_tests[] = {
+	cmocka_unit_test_setup_teardown(test_vhdx_partial_write_merges_parent, vhdx_test_setup, vhdx_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhdx_partial_write_spanning_logical_sectors, vhdx_test_setup, vhdx_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhdx_partial_writes_wait_for_each_other, vhdx_test_setup, vhdx_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhdx_failed_parent_read_fails_write, vhdx_test_setup, vhdx_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhdx_sector_bitmap, vhdx_test_setup, vhdx_test_teardown)
+};
+
+int uring_test_setup(void **state);
+int uring_test_teardown(void **state);
+
+void test_uring_accept_nonblocking(void **state);
+void test_uring_recv_counts_kicks(void **state);
+void test_uring_kick_coalesces(void **state);
+void test_uring_server_spurious_wakeup(void **state);
+void test_uring_server_request(void **state);
+void test_uring_server_busy_rejects(void **state);
+
+static const struct CMUnitTest tapdisk_uring_tests[] = {
+	cmocka_unit_test_setup_teardown(test_uring_accept_nonblocking, uring_test_setup, uring_test_teardown),
+	cmocka_unit_test_setup_teardown(test_uring_recv_counts_kicks, uring_test_setup, uring_test_teardown),
+	cmocka_unit_test_setup_teardown(test_uring_kick_coalesces, uring_test_setup, uring_test_teardown),
+	cmocka_unit_test_setup_teardown(test_uring_server_spurious_wakeup, uring_test_setup, uring_test_teardown),
+	cmocka_unit_test_setup_teardown(test_uring_server_request, uring_test_setup, uring_test_teardown),
+	cmocka_unit_test_setup_teardown(test_uring_server_busy_rejects, uring_test_setup, uring_test_teardown)
+};
+
+int qcow2_test_setup(void **state);
+int qcow2_test_teardown(void **state);
+
+void test_qcow2_alloc_full_cluster(void **state);
+void test_qcow2_cow_from_backing(void **state);
+void test_qcow2_concurrent_allocs(void **state);
+void test_qcow2_overwrite_compressed(void **state);
+void test_qcow2_overwrite_zero_clusters(void **state);
+void test_qcow2_l2_cache_full(void **state);
+void test_qcow2_failed_refcount_update(void **state);
+
+static const struct CMUnitTest block_qcow2_tests[] = {
+	cmocka_unit_test_setup_teardown(test_qcow2_alloc_full_cluster, qcow2_test_setup, qcow2_test_teardown),
+	cmocka_unit_test_setup_teardown(test_qcow2_cow_from_backing, qcow2_test_setup, qcow2_test_teardown),
+	cmocka_unit_test_setup_teardown(test_qcow2_concurrent_allocs, qcow2_test_setup, qcow2_test_teardown),
+	cmocka_unit_test_setup_teardown(test_qcow2_overwrite_compressed, qcow2_test_setup, qcow2_test_teardown),
+	cmocka_unit_test_setup_teardown(test_qcow2_overwrite_zero_clusters, qcow2_test_setup, qcow2_test_teardown),
+	cmocka_unit_test_setup_teardown(test_qcow2_l2_cache_full, qcow2_test_setup, qcow2_test_teardown),
+	cmocka_unit_test_setup_teardown(test_qcow2_failed_refcount_update, qcow2_test_setup, qcow2_test_teardown)
+};
+
+int vhd_test_setup(void **state);
+int vhd_test_teardown(void **state);
+int vhd_prov_test_setup(void **state);
+
+void test_vhd_alloc_write_order(void **state);
+void test_vhd_concurrent_allocs(void **state);
+void test_vhd_failed_bat_write(void **state);
+void test_vhd_provision_gate(void **state);
+void test_vhd_provision_truncate(void **state);
+void test_vhd_provision_blocks_env(void **state);
+
+static const struct CMUnitTest block_vhd_tests[] = {
+	cmocka_unit_test_setup_teardown(test_vhd_alloc_write_order, vhd_test_setup, vhd_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_concurrent_allocs, vhd_test_setup, vhd_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_failed_bat_write, vhd_test_setup, vhd_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_provision_gate, vhd_prov_test_setup, vhd_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_provision_truncate, vhd_prov_test_setup, vhd_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_provision_blocks_env, vhd_prov_test_setup, vhd_test_teardown)
+};
+
+int ublk_test_setup(void **state);
+int ublk_test_teardown(void **state);
+
+void test_ublk_flush_waits_for_earlier_requests(void **state);
+void test_ublk_flush_when_idle(void **state);
+void test_ublk_bad_requests(void **state);
+
+static const struct CMUnitTest tapdisk_ublk_tests[] = {
+	cmocka_unit_test_setup_teardown(test_ublk_flush_waits_for_earlier_requests, ublk_test_setup, ublk_test_teardown),
+	cmocka_unit_test_setup_teardown(test_ublk_flush_when_idle, ublk_test_setup, ublk_test_teardown),
+	cmocka_unit_test_setup_teardown(test_ublk_bad_requests, ublk_test_setup, ublk_test_teardown)
+};
+
+int diff_test_setup(void **state);
+int diff_test_teardown(void **state);
+
+void test_diff_reports_lowest_mismatch(void **state);
+void test_diff_reports_every_range(void **state);
+void test_diff_range_at_end_of_read(void **state);
+
+static const struct CMUnitTest tapdisk_diff_tests[] = {
+	cmocka_unit_test_setup_teardown(test_diff_reports_lowest_mismatch, diff_test_setup, diff_test_teardown),
+	cmocka_unit_test_setup_teardown(test_diff_reports_every_range, diff_test_setup, diff_test_teardown),
+	cmocka_unit_test_setup_teardown(test_diff_range_at_end_of_read, diff_test_setup, diff_test_teardown)
+};
+
 #endif /* __TEST_SUITES_H__ */
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE /* Needed for off64_t in libvhd.h */
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "test-suites.h"
+
+/* tapdisk-diff is a program of its own */
+#define main tapdisk_diff_main
+#include "tapdisk-diff.c"
+#undef main
+
+#define DIFF_TEST_SECS    8
+
+struct diff_test {
+	struct td_diff        d;
+	td_diff_read_t        r;
+	char                  bufs[2][DIFF_TEST_SECS << SECTOR_SHIFT];
+};
+
+int diff_test_setup(void **state)
+{
+	struct diff_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+	t->d.size   = 1024;
+	t->d.limit  = t->d.size;
+	t->r.buf[0] = t->bufs[0];
+	t->r.buf[1] = t->bufs[1];
+	t->r.secs   = DIFF_TEST_SECS;
+
+	*state = t;
+	return 0;
+}
+
+int diff_test_teardown(void **state)
+{
+	struct diff_test *t = *state;
+
+	free(t->d.diffs);
+	free(t);
+	return 0;
+}
+
+/*
+ * Compares a read at @sec whose second image differs from the first in
+ * the sectors set in @mask.
+ */
+static void
+diff_test_compare(struct diff_test *t, td_sector_t sec, unsigned int mask)
+{
+	int i;
+
+	memset(t->bufs, 0, sizeof(t->bufs));
+	for (i = 0; i < DIFF_TEST_SECS; i++)
+		if (mask & (1 << i))
+			t->bufs[1][(i << SECTOR_SHIFT) + 17] = 1;
+
+	t->r.sec = sec;
+	td_diff_compare(&t->d, &t->r);
+}
+
+void test_diff_reports_lowest_mismatch(void **state)
+{
+	struct diff_test *t = *state;
+
+	diff_test_compare(t, 100, 0);
+	assert_int_equal(td_diff_report(&t->d), 0);
+
+	diff_test_compare(t, 100, 0x40);
+	diff_test_compare(t, 40, 0x0c);
+	diff_test_compare(t, 200, 0x01);
+
+	assert_int_equal(t->d.n_diffs, 0);
+	assert_int_equal(t->d.limit, 42);
+	assert_int_equal(td_diff_report(&t->d), EINVAL);
+	assert_int_equal(t->d.compared, 4 * DIFF_TEST_SECS);
+}
+
+void test_diff_reports_every_range(void **state)
+{
+	struct diff_test *t = *state;
+
+	t->d.all = 1;
+
+	diff_test_compare(t, 100, 0);
+	assert_int_equal(td_diff_report(&t->d), 0);
+
+	/* 102-103 and 107, then 108-109 joins 107 as it arrives */
+	diff_test_compare(t, 100, 0x8c);
+	diff_test_compare(t, 108, 0x03);
+	assert_int_equal(t->d.n_diffs, 2);
+
+	/* out of order: 116, then 99 and 115 */
+	diff_test_compare(t, 116, 0x01);
+	diff_test_compare(t, 92, 0x80);
+	diff_test_compare(t, 108, 0x80);
+	assert_int_equal(t->d.n_diffs, 5);
+
+	assert_int_equal(td_diff_report(&t->d), EINVAL);
+	assert_int_equal(t->d.limit, t->d.size);
+
+	assert_int_equal(t->d.n_diffs, 4);
+	assert_int_equal(t->d.diffs[0].sec, 99);
+	assert_int_equal(t->d.diffs[0].secs, 1);
+	assert_int_equal(t->d.diffs[1].sec, 102);
+	assert_int_equal(t->d.diffs[1].secs, 2);
+	assert_int_equal(t->d.diffs[2].sec, 107);
+	assert_int_equal(t->d.diffs[2].secs, 3);
+	assert_int_equal(t->d.diffs[3].sec, 115);
+	assert_int_equal(t->d.diffs[3].secs, 2);
+}
+
+void test_diff_range_at_end_of_read(void **state)
+{
+	struct diff_test *t = *state;
+
+	t->d.all = 1;
+
+	diff_test_compare(t, 0, 0xff);
+	assert_int_equal(t->d.n_diffs, 1);
+	assert_int_equal(t->d.diffs[0].sec, 0);
+	assert_int_equal(t->d.diffs[0].secs, DIFF_TEST_SECS);
+
+	diff_test_compare(t, DIFF_TEST_SECS, 0xfe);
+	assert_int_equal(t->d.n_diffs, 2);
+	assert_int_equal(t->d.diffs[1].sec, DIFF_TEST_SECS + 1);
+	assert_int_equal(t->d.diffs[1].secs, DIFF_TEST_SECS - 1);
+}
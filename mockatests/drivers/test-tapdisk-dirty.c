@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-dirty.h"
+
+#define COPY_SHIFT	3		/* 8 sector blocks */
+#define COPY_SECS	1024		/* 128 blocks, over two words */
+#define COPY_CHUNK	4
+
+/*
+ * A copier over a bare VBD. Copies are read through the VBD: they are
+ * left on its new requests list, for the test to complete. Writes go
+ * through td_queue_write() and are collected by its wrapper.
+ */
+struct copy_test {
+	td_vbd_t		vbd;
+	struct td_copier       *c;
+	int			ticks;
+	int			write_err;
+	int			ndone;
+	int			done_err;
+	int			done_writing;
+	td_image_t		dest;
+};
+
+static void
+copy_test_tick(struct td_copier *c)
+{
+	struct copy_test *t = c->private;
+
+	t->ticks++;
+	td_copier_issue(c);
+}
+
+static int
+copy_test_write(struct td_copier *c, td_request_t treq)
+{
+	struct copy_test *t = c->private;
+
+	if (t->write_err)
+		return t->write_err;
+
+	td_queue_write(&t->dest, treq);
+	return 0;
+}
+
+static void
+copy_test_done(struct td_copier *c, struct td_copy_chunk *chunk, int err)
+{
+	struct copy_test *t = c->private;
+
+	t->ndone++;
+	t->done_err     = err;
+	t->done_writing = chunk->writing;
+}
+
+static const struct td_copy_ops copy_test_ops = {
+	.tick  = copy_test_tick,
+	.write = copy_test_write,
+	.done  = copy_test_done,
+};
+
+static void
+copy_test_init(struct copy_test *t, int max_inflight)
+{
+	bzero(t, sizeof(*t));
+	test_vbd_init(&t->vbd);
+	n_queued_writes = 0;
+
+	t->c = td_copier_create(&t->vbd, "copy", COPY_SECS, COPY_SHIFT,
+				COPY_CHUNK, max_inflight, 1 << 20, 100000,
+				&copy_test_ops, t);
+	assert_non_null(t->c);
+	t->c->budget = 1 << 20;
+}
+
+static int
+copy_test_queued_reads(struct copy_test *t)
+{
+	td_vbd_request_t *vreq;
+	int n = 0;
+
+	list_for_each_entry(vreq, &t->vbd.new_requests, next)
+		n++;
+
+	return n;
+}
+
+/*
+ * Completes the oldest copy read the VBD holds.
+ */
+static void
+copy_test_complete_read(struct copy_test *t, int err)
+{
+	td_vbd_request_t *vreq;
+
+	assert_false(list_empty(&t->vbd.new_requests));
+	vreq = list_entry(t->vbd.new_requests.next, td_vbd_request_t, next);
+	list_del_init(&vreq->next);
+	vreq->list_head = NULL;
+
+	vreq->cb(vreq, err, vreq->token, 1);
+}
+
+static void
+copy_test_complete_write(int err)
+{
+	td_request_t treq = pop_queued_write();
+
+	treq.cb(treq, err);
+}
+
+void
+test_dirty_map_mark_and_runs(void **state)
+{
+	struct td_dirty_map map;
+	uint64_t block, count;
+
+	assert_int_equal(td_dirty_map_init(&map, COPY_SECS + 1, COPY_SHIFT), 0);
+	assert_int_equal(map.nbits, COPY_SECS / 8 + 1);
+	assert_int_equal(td_dirty_next_run(&map, 8, &block), 0);
+
+	/* partial blocks at either end are dirty as a whole */
+	td_dirty_mark(&map, 10, 20);
+	assert_int_equal(map.ndirty, 3);
+	assert_false(td_dirty_any(&map, 0, 8));
+	assert_true(td_dirty_any(&map, 7, 2));
+	assert_true(td_dirty_any(&map, 24, 8));
+	assert_false(td_dirty_any(&map, 32, 100));
+
+	/* marking again does not count twice */
+	td_dirty_mark(&map, 8, 8);
+	assert_int_equal(map.ndirty, 3);
+
+	count = td_dirty_next_run(&map, 2, &block);
+	assert_int_equal(block, 1);
+	assert_int_equal(count, 2);
+
+	/* runs span words */
+	td_dirty_set_range(&map, 62, 4);
+	map.cursor = 60;
+	count = td_dirty_next_run(&map, 16, &block);
+	assert_int_equal(block, 62);
+	assert_int_equal(count, 4);
+
+	/* and the search wraps around once */
+	map.cursor = 100;
+	count = td_dirty_next_run(&map, 16, &block);
+	assert_int_equal(block, 1);
+	assert_int_equal(count, 3);
+	assert_int_equal(map.passes, 1);
+
+	/* the map ends where the disk does */
+	td_dirty_set_range(&map, map.nbits - 1, 8);
+	assert_int_equal(map.ndirty, 8);
+
+	td_dirty_clear_range(&map, 0, map.nbits);
+	assert_int_equal(map.ndirty, 0);
+	assert_int_equal(td_dirty_next_run(&map, 8, &block), 0);
+
+	td_dirty_map_free(&map);
+}
+
+void
+test_copier_copies_dirty_runs(void **state)
+{
+	struct copy_test t;
+	td_vbd_request_t *vreq;
+
+	copy_test_init(&t, 2);
+
+	/* blocks 0-7, and 40 */
+	td_copier_mark(t.c, 0, 64);
+	td_copier_mark(t.c, 320, 1);
+	assert_int_equal(t.c->map.ndirty, 9);
+
+	t.c->ops->tick(t.c);
+	assert_int_equal(t.ticks, 1);
+
+	/* two chunks, as many as there are, the bits clear meanwhile */
+	assert_int_equal(copy_test_queued_reads(&t), 2);
+	assert_int_equal(t.c->inflight, 2);
+	assert_int_equal(t.c->map.ndirty, 1);
+
+	vreq = list_entry(t.vbd.new_requests.next, td_vbd_request_t, next);
+	assert_int_equal(vreq->op, TD_OP_READ);
+	assert_int_equal(vreq->io_class, TD_VREQ_CLASS_BG);
+	assert_int_equal(vreq->sec, 0);
+	assert_int_equal(vreq->iov->secs, COPY_CHUNK << COPY_SHIFT);
+	assert_string_equal(vreq->name, "copy-0");
+
+	copy_test_complete_read(&t, 0);
+	assert_int_equal(n_queued_writes, 1);
+	assert_int_equal(queued_writes[0].op, TD_OP_WRITE);
+	assert_int_equal(queued_writes[0].sec, 0);
+	assert_int_equal(queued_writes[0].secs, COPY_CHUNK << COPY_SHIFT);
+	assert_true(td_copier_busy(t.c));
+
+	copy_test_complete_write(0);
+	assert_int_equal(t.ndone, 1);
+	assert_int_equal(t.done_err, 0);
+	assert_int_equal(t.c->stats.copied, COPY_CHUNK);
+	assert_false(td_copier_busy(t.c));
+
+	copy_test_complete_read(&t, 0);
+	copy_test_complete_write(0);
+	assert_int_equal(t.c->stats.copied, 2 * COPY_CHUNK);
+	assert_int_equal(t.c->inflight, 0);
+
+	/* the last run is cut short at the end of the dirty blocks */
+	td_copier_issue(t.c);
+	vreq = list_entry(t.vbd.new_requests.next, td_vbd_request_t, next);
+	assert_int_equal(vreq->sec, 320);
+	assert_int_equal(vreq->iov->secs, 1 << COPY_SHIFT);
+
+	copy_test_complete_read(&t, 0);
+	copy_test_complete_write(0);
+	assert_int_equal(t.c->map.ndirty, 0);
+	assert_int_equal(t.c->stats.copied, 2 * COPY_CHUNK + 1);
+
+	td_copier_destroy(t.c);
+}
+
+void
+test_copier_respects_budget_and_state(void **state)
+{
+	struct copy_test t;
+
+	copy_test_init(&t, 4);
+	td_copier_mark(t.c, 0, COPY_SECS);
+
+	/* a paused VBD issues nothing */
+	t.vbd.state = TD_VBD_PAUSED;
+	td_copier_issue(t.c);
+	assert_int_equal(t.c->inflight, 0);
+	t.vbd.state = 0;
+
+	/* one chunk overdraws the budget, the next waits for a refill */
+	t.c->budget = 1;
+	td_copier_issue(t.c);
+	assert_int_equal(t.c->inflight, 1);
+	assert_true(t.c->budget < 0);
+
+	td_copier_issue(t.c);
+	assert_int_equal(t.c->inflight, 1);
+
+	while (t.c->inflight) {
+		copy_test_complete_read(&t, 0);
+		copy_test_complete_write(0);
+	}
+
+	td_copier_destroy(t.c);
+}
+
+void
+test_copier_holds_runs_under_pending_writes(void **state)
+{
+	struct copy_test t;
+	td_vbd_request_t write;
+	struct td_iovec iov;
+
+	copy_test_init(&t, 2);
+	td_copier_mark(t.c, 0, 64);
+
+	/* a guest write in flight over block 1 */
+	bzero(&write, sizeof(write));
+	iov.base    = NULL;
+	iov.secs    = 4;
+	write.op    = TD_OP_WRITE;
+	write.sec   = 10;
+	write.iov   = &iov;
+	write.iovcnt = 1;
+	list_add_tail(&write.next, &t.vbd.pending_requests);
+
+	td_copier_issue(t.c);
+
+	/* blocks 0-3 are held back, and stay dirty */
+	assert_int_equal(t.c->stats.held, 1);
+	assert_int_equal(t.c->inflight, 1);
+	assert_int_equal(t.c->map.ndirty, 4);
+	assert_true(td_dirty_any(&t.c->map, 0, 32));
+	assert_false(td_dirty_any(&t.c->map, 32, 32));
+
+	copy_test_complete_read(&t, 0);
+	copy_test_complete_write(0);
+
+	/* once the write is done, they are copied */
+	list_del(&write.next);
+	td_copier_issue(t.c);
+	assert_int_equal(t.c->inflight, 1);
+	assert_int_equal(t.c->map.ndirty, 0);
+
+	copy_test_complete_read(&t, 0);
+	copy_test_complete_write(0);
+	assert_int_equal(t.c->stats.copied, 8);
+
+	td_copier_destroy(t.c);
+}
+
+void
+test_copier_redirties_racing_writes(void **state)
+{
+	struct copy_test t;
+
+	copy_test_init(&t, 1);
+	td_copier_mark(t.c, 0, 32);
+
+	td_copier_issue(t.c);
+	assert_int_equal(t.c->map.ndirty, 0);
+
+	/* writes outside the copy are none of its business */
+	td_copier_mark_busy(t.c, 64, 8);
+	assert_int_equal(t.c->map.ndirty, 0);
+
+	/* a write racing the copy marks what it overlaps again */
+	td_copier_mark_busy(t.c, 12, 8);
+	assert_int_equal(t.c->map.ndirty, 2);
+	assert_int_equal(t.c->stats.redirtied, 2);
+
+	copy_test_complete_read(&t, 0);
+	copy_test_complete_write(0);
+
+	/* the copy succeeded, but the blocks still need another pass */
+	assert_int_equal(t.c->map.ndirty, 2);
+	assert_true(td_dirty_any(&t.c->map, 8, 16));
+
+	td_copier_destroy(t.c);
+}
+
+void
+test_copier_redirties_failed_copies(void **state)
+{
+	struct copy_test t;
+	td_request_t treq;
+
+	copy_test_init(&t, 1);
+	td_copier_mark(t.c, 0, 32);
+
+	/* a failed read */
+	td_copier_issue(t.c);
+	copy_test_complete_read(&t, -EIO);
+	assert_int_equal(t.ndone, 1);
+	assert_int_equal(t.done_err, -EIO);
+	assert_false(t.done_writing);
+	assert_int_equal(t.c->map.ndirty, 4);
+
+	/* a write the destination refuses */
+	t.write_err = -ENODEV;
+	td_copier_issue(t.c);
+	copy_test_complete_read(&t, 0);
+	assert_int_equal(t.ndone, 2);
+	assert_int_equal(t.done_err, -ENODEV);
+	assert_int_equal(t.c->map.ndirty, 4);
+	t.write_err = 0;
+
+	/* a write completed piecewise, with its second half failing */
+	td_copier_issue(t.c);
+	copy_test_complete_read(&t, 0);
+	treq = pop_queued_write();
+
+	treq.secs = 16;
+	treq.cb(treq, 0);
+	assert_int_equal(t.ndone, 2);
+
+	treq.sec  = 16;
+	treq.cb(treq, -EIO);
+	assert_int_equal(t.ndone, 3);
+	assert_int_equal(t.done_err, -EIO);
+	assert_true(t.done_writing);
+	assert_ptr_equal(t.c->chunks[0].image, &t.dest);
+
+	assert_int_equal(t.c->map.ndirty, 4);
+	assert_int_equal(t.c->stats.errors, 3);
+	assert_int_equal(t.c->stats.copied, 0);
+	assert_int_equal(t.c->inflight, 0);
+
+	td_copier_destroy(t.c);
+}
+
+void
+test_copier_destroy_cancels_queued_copies(void **state)
+{
+	struct copy_test t;
+	td_request_t treq;
+
+	copy_test_init(&t, 2);
+	td_copier_mark(t.c, 0, 64);
+	td_copier_issue(t.c);
+	assert_int_equal(t.c->inflight, 2);
+
+	/* one copy being written, the other still queued on the VBD */
+	copy_test_complete_read(&t, 0);
+	treq = pop_queued_write();
+
+	td_copier_destroy(t.c);
+
+	/* the queued one came back right away, without calling back */
+	assert_true(list_empty(&t.vbd.new_requests));
+	assert_int_equal(t.ndone, 0);
+
+	/* the copier goes with the write still in flight */
+	treq.cb(treq, 0);
+	assert_int_equal(t.ndone, 0);
+}
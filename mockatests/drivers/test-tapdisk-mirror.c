@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-dirty.h"
+#include "tapdisk-resync.h"
+#include "tapdisk-mirror.h"
+
+#define MIRROR_SECS	4096
+
+struct mirror_test {
+	td_vbd_t		vbd;
+	td_image_t		leaf;
+	td_image_t		secondary;
+	char			buf[64 << SECTOR_SHIFT];
+};
+
+static void
+mirror_test_init(struct mirror_test *t)
+{
+	bzero(t, sizeof(*t));
+	test_vbd_init(&t->vbd);
+
+	INIT_LIST_HEAD(&t->leaf.next);
+	t->leaf.info.size = MIRROR_SECS;
+	list_add_tail(&t->leaf.next, &t->vbd.images);
+
+	INIT_LIST_HEAD(&t->secondary.next);
+	t->secondary.info.size = MIRROR_SECS;
+	list_add_tail(&t->secondary.next, &t->vbd.images);
+	t->vbd.secondary      = &t->secondary;
+	t->vbd.secondary_mode = TD_VBD_SECONDARY_MIRROR;
+
+	unsetenv("TAPDISK_MIRROR_MAX_LAG_MB");
+	unsetenv("TAPDISK_MIRROR_MAX_LAG_MS");
+	n_queued_writes = 0;
+
+	assert_int_equal(tapdisk_vbd_mirror_create(&t->vbd), 0);
+	assert_non_null(t->vbd.mirror);
+}
+
+static void
+mirror_test_write(struct mirror_test *t, td_sector_t sec, int secs)
+{
+	td_request_t treq;
+
+	bzero(&treq, sizeof(treq));
+	treq.op   = TD_OP_WRITE;
+	treq.sec  = sec;
+	treq.secs = secs;
+	treq.buf  = t->buf;
+
+	assert_int_equal(tapdisk_vbd_mirror_queue(&t->vbd, treq, 0), 0);
+}
+
+void
+test_mirror_async_writes_keep_order(void **state)
+{
+	struct mirror_test t;
+	struct td_vbd_mirror *m;
+	td_request_t first, treq;
+
+	mirror_test_init(&t);
+	m = t.vbd.mirror;
+
+	memset(t.buf, 0x5a, sizeof(t.buf));
+	mirror_test_write(&t, 0, 8);
+	memset(t.buf, 0, sizeof(t.buf));
+
+	/* the copy is issued right away, from a copy of the data */
+	assert_int_equal(n_queued_writes, 1);
+	first = pop_queued_write();
+	assert_ptr_equal(first.image, &t.secondary);
+	assert_ptr_not_equal(first.buf, t.buf);
+	assert_int_equal(((unsigned char *)first.buf)[0], 0x5a);
+	assert_int_equal(m->lag_bytes, 8 << SECTOR_SHIFT);
+	assert_true(tapdisk_vbd_mirror_busy(&t.vbd));
+
+	/* an overlapping write waits for it, and later ones stay behind */
+	mirror_test_write(&t, 4, 8);
+	mirror_test_write(&t, 64, 8);
+	assert_int_equal(n_queued_writes, 0);
+
+	first.cb(first, 0);
+	assert_int_equal(n_queued_writes, 2);
+	assert_int_equal(queued_writes[0].sec, 4);
+	assert_int_equal(queued_writes[1].sec, 64);
+
+	while (n_queued_writes) {
+		treq = pop_queued_write();
+		treq.cb(treq, 0);
+	}
+
+	assert_false(tapdisk_vbd_mirror_busy(&t.vbd));
+	assert_int_equal(m->lag_bytes, 0);
+	assert_int_equal(m->stats.async, 3);
+	assert_int_equal(m->stats.completed, 3);
+	assert_int_equal(m->stats.max_lag_bytes, 24 << SECTOR_SHIFT);
+
+	tapdisk_vbd_mirror_free(&t.vbd);
+	assert_null(t.vbd.mirror);
+}
+
+void
+test_mirror_lag_limits(void **state)
+{
+	struct mirror_test t;
+	struct td_vbd_mirror *m;
+	struct td_mirror_entry *oldest;
+	td_request_t treq;
+
+	mirror_test_init(&t);
+	m = t.vbd.mirror;
+	m->max_lag_bytes = 16 << SECTOR_SHIFT;
+
+	assert_false(tapdisk_vbd_mirror_lagging(&t.vbd));
+
+	mirror_test_write(&t, 0, 8);
+	assert_false(tapdisk_vbd_mirror_lagging(&t.vbd));
+
+	/* too many bytes behind */
+	mirror_test_write(&t, 8, 8);
+	assert_true(tapdisk_vbd_mirror_lagging(&t.vbd));
+
+	treq = pop_queued_write();
+	treq.cb(treq, 0);
+	assert_false(tapdisk_vbd_mirror_lagging(&t.vbd));
+
+	/* too long behind */
+	oldest = list_entry(m->inflight.next, struct td_mirror_entry, next);
+	oldest->ts.tv_sec -= m->max_lag_ms / 1000 + 1;
+	assert_true(tapdisk_vbd_mirror_lagging(&t.vbd));
+
+	treq = pop_queued_write();
+	treq.cb(treq, 0);
+	assert_false(tapdisk_vbd_mirror_lagging(&t.vbd));
+
+	tapdisk_vbd_mirror_free(&t.vbd);
+}
+
+void
+test_mirror_failure_degrades_to_resync(void **state)
+{
+	struct mirror_test t;
+	struct td_vbd_mirror *m;
+	struct td_vbd_resync *rs;
+	td_request_t treq;
+
+	mirror_test_init(&t);
+	m = t.vbd.mirror;
+	td_flag_set(t.vbd.flags, TD_OPEN_RESYNC);
+
+	mirror_test_write(&t, 0, 8);
+	mirror_test_write(&t, 1024, 8);
+	mirror_test_write(&t, 4, 8);
+	assert_int_equal(n_queued_writes, 2);
+
+	/* the first copy fails: everything the secondary missed is dirty */
+	treq = pop_queued_write();
+	treq.cb(treq, -EIO);
+
+	assert_null(t.vbd.secondary);
+	assert_ptr_equal(t.vbd.retired, &t.secondary);
+	assert_int_equal(m->stats.errors, 1);
+	assert_int_equal(m->stats.dropped, 2);
+
+	rs = t.vbd.resync;
+	assert_non_null(rs);
+	assert_int_equal(rs->state, TD_RESYNC_DEGRADED);
+	assert_true(td_dirty_any(&rs->copier->map, 0, 12));
+	assert_false(td_dirty_any(&rs->copier->map, 1024, 8));
+
+	/* the copy still in flight fails too, and is tracked as well */
+	treq = pop_queued_write();
+	treq.cb(treq, -EIO);
+	assert_true(td_dirty_any(&rs->copier->map, 1024, 8));
+	assert_int_equal(m->stats.dropped, 3);
+
+	/* further writes are not copied, only tracked */
+	mirror_test_write(&t, 2048, 8);
+	assert_int_equal(n_queued_writes, 0);
+	assert_true(td_dirty_any(&rs->copier->map, 2048, 8));
+	assert_false(tapdisk_vbd_mirror_busy(&t.vbd));
+	assert_int_equal(m->lag_bytes, 0);
+
+	tapdisk_vbd_mirror_free(&t.vbd);
+	tapdisk_vbd_resync_free(&t.vbd);
+}
+
+void
+test_mirror_busy_secondary_retries(void **state)
+{
+	struct mirror_test t;
+	struct td_vbd_mirror *m;
+	td_request_t treq;
+
+	mirror_test_init(&t);
+	m = t.vbd.mirror;
+
+	mirror_test_write(&t, 0, 8);
+	treq = pop_queued_write();
+
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_TIMEOUT);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+	treq.cb(treq, -EBUSY);
+
+	/* requeued for a retry, not dropped, nor reissued meanwhile */
+	assert_int_equal(n_queued_writes, 0);
+	assert_int_equal(m->retry, 0);
+	assert_true(m->stalled);
+	assert_true(tapdisk_vbd_mirror_busy(&t.vbd));
+	assert_int_equal(m->stats.dropped, 0);
+	assert_int_equal(m->stats.errors, 0);
+
+	mirror_test_write(&t, 64, 8);
+	assert_int_equal(n_queued_writes, 0);
+
+	/* dropped on free */
+	tapdisk_vbd_mirror_free(&t.vbd);
+	assert_null(t.vbd.resync);
+}
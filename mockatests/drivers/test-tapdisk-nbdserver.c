@@ -33,9 +33,16 @@
 #include <setjmp.h>
 #include <cmocka.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
 #include "test-suites.h"
+#include "vbd-wrappers.h"
 #include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
 #include "tapdisk-nbdserver.h"
 #include "tapdisk-protocol-new.h"
 
@@ -67,3 +74,174 @@ test_nbdserver_new_protocol_handshake(void **state)
 	int err = tapdisk_nbdserver_new_protocol_handshake(&client, new_fd);
 	assert_int_equal(err, 0);
 }
+
+/*
+ * A client attached as for the kernel NBD driver, to an export server
+ * of a VBD which is never run: requests stay on its new list.
+ */
+struct nbd_test {
+	td_vbd_t                vbd;
+	td_nbdserver_t          server;
+	struct stats            stats;
+	td_nbdserver_client_t  *client;
+	int                     fd;
+};
+
+int
+nbd_test_setup(void **state)
+{
+	struct nbd_test *t;
+	int sv[2];
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+
+	test_vbd_init(&t->vbd);
+	t->server.vbd             = &t->vbd;
+	t->server.io_class        = TD_VREQ_CLASS_EXPORT;
+	t->server.nbd_stats.stats = &t->stats;
+	INIT_LIST_HEAD(&t->server.clients);
+
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	t->fd = sv[0];
+
+	expect_value(__wrap_tapdisk_server_register_event, cb,
+		     tapdisk_nbdserver_clientcb);
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_READ_FD);
+	t->client = tapdisk_nbdserver_attach_fd(&t->server, sv[1],
+						TD_VREQ_CLASS_FG);
+	assert_non_null(t->client);
+
+	*state = t;
+	return 0;
+}
+
+int
+nbd_test_teardown(void **state)
+{
+	struct nbd_test *t = *state;
+
+	tapdisk_nbdserver_free_client(t->client);
+	assert_true(list_empty(&t->server.clients));
+	close(t->fd);
+	free(t);
+
+	return 0;
+}
+
+/*
+ * Sends a request from the kernel end, and has the server read it.
+ */
+static void
+nbd_test_request(struct nbd_test *t, int type, const char *handle,
+		 uint64_t from, uint32_t len)
+{
+	struct nbd_request request;
+	char *buf;
+
+	memset(&request, 0, sizeof(request));
+	request.magic = htonl(NBD_REQUEST_MAGIC);
+	request.type  = htonl(type);
+	request.from  = htobe64(from);
+	request.len   = htonl(len);
+	memcpy(request.handle, handle, sizeof(request.handle));
+
+	assert_int_equal(write(t->fd, &request, sizeof(request)),
+			 sizeof(request));
+
+	if (type == TAPDISK_NBD_CMD_WRITE) {
+		buf = calloc(1, len);
+		assert_non_null(buf);
+		assert_int_equal(write(t->fd, buf, len), len);
+		free(buf);
+	}
+
+	tapdisk_nbdserver_clientcb(0, SCHEDULER_POLL_READ_FD, t->client);
+}
+
+static void
+nbd_test_expect_reply(struct nbd_test *t, const char *handle)
+{
+	static struct nbd_reply reply;
+
+	reply.magic = htonl(NBD_REPLY_MAGIC);
+	reply.error = 0;
+	memcpy(reply.handle, handle, sizeof(reply.handle));
+
+	expect_memory(__wrap_send, buf, &reply, sizeof(reply));
+	expect_value(__wrap_send, fd, t->client->client_fd);
+	expect_value(__wrap_send, size, sizeof(reply));
+	expect_value(__wrap_send, flags, 0);
+	will_return(__wrap_send, sizeof(reply));
+}
+
+/*
+ * Completes the oldest request the VBD was given.
+ */
+static void
+nbd_test_complete(struct nbd_test *t)
+{
+	td_vbd_request_t *vreq;
+
+	assert_false(list_empty(&t->vbd.new_requests));
+	vreq = list_first_entry(&t->vbd.new_requests, td_vbd_request_t, next);
+	list_del_init(&vreq->next);
+	vreq->cb(vreq, 0, vreq->token, 1);
+}
+
+/*
+ * The kernel device is a local consumer: its requests are foreground,
+ * not export ones as for the server's other clients.
+ */
+void
+test_nbdserver_attached_client_is_foreground(void **state)
+{
+	struct nbd_test *t = *state;
+	td_vbd_request_t *vreq;
+
+	nbd_test_request(t, TAPDISK_NBD_CMD_WRITE, "write-0", 0, 512);
+
+	vreq = list_first_entry(&t->vbd.new_requests, td_vbd_request_t, next);
+	assert_int_equal(vreq->op, TD_OP_WRITE);
+	assert_int_equal(vreq->io_class, TD_VREQ_CLASS_FG);
+
+	nbd_test_expect_reply(t, "write-0");
+	nbd_test_complete(t);
+}
+
+/*
+ * A flush is answered once the requests before it are, and nothing is
+ * read from the client until then.
+ */
+void
+test_nbdserver_flush_waits_for_writes(void **state)
+{
+	struct nbd_test *t = *state;
+
+	nbd_test_request(t, TAPDISK_NBD_CMD_WRITE, "write-0", 0, 512);
+	nbd_test_request(t, TAPDISK_NBD_CMD_WRITE, "write-1", 512, 512);
+	nbd_test_request(t, TAPDISK_NBD_CMD_FLUSH, "flush-0", 0, 0);
+	assert_true(t->client->flushing);
+
+	nbd_test_expect_reply(t, "write-0");
+	nbd_test_complete(t);
+	assert_true(t->client->flushing);
+
+	nbd_test_expect_reply(t, "write-1");
+	nbd_test_expect_reply(t, "flush-0");
+	nbd_test_complete(t);
+	assert_false(t->client->flushing);
+	assert_int_equal(tapdisk_nbdserver_reqs_pending(t->client), 0);
+}
+
+void
+test_nbdserver_flush_when_idle(void **state)
+{
+	struct nbd_test *t = *state;
+
+	nbd_test_expect_reply(t, "flush-0");
+	nbd_test_request(t, TAPDISK_NBD_CMD_FLUSH, "flush-0", 0, 0);
+	assert_false(t->client->flushing);
+	assert_true(list_empty(&t->vbd.new_requests));
+}
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-dirty.h"
+#include "tapdisk-resync.h"
+
+#define RESYNC_SECS	4096		/* 32 resync blocks */
+#define RESYNC_BLOCK	(1 << TD_RESYNC_BLOCK_SHIFT)
+
+struct resync_test {
+	td_vbd_t		vbd;
+	td_image_t		leaf;
+	td_image_t		secondary;
+};
+
+static void
+resync_test_init(struct resync_test *t)
+{
+	bzero(t, sizeof(*t));
+	test_vbd_init(&t->vbd);
+
+	INIT_LIST_HEAD(&t->leaf.next);
+	t->leaf.info.size = RESYNC_SECS;
+	list_add_tail(&t->leaf.next, &t->vbd.images);
+
+	INIT_LIST_HEAD(&t->secondary.next);
+	t->secondary.info.size = RESYNC_SECS;
+
+	unsetenv("TAPDISK_RESYNC_RATE_MB");
+	n_queued_writes = 0;
+}
+
+static void
+resync_test_attach(struct resync_test *t)
+{
+	list_add_tail(&t->secondary.next, &t->vbd.images);
+	t->vbd.secondary      = &t->secondary;
+	t->vbd.secondary_mode = TD_VBD_SECONDARY_MIRROR;
+
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_TIMEOUT);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+	tapdisk_vbd_resync_start(&t->vbd);
+}
+
+static void
+resync_test_tick(struct resync_test *t)
+{
+	struct td_copier *c = t->vbd.resync->copier;
+
+	c->budget = 8 << 20;
+	c->ops->tick(c);
+}
+
+/*
+ * Completes the oldest copy read the VBD holds.
+ */
+static void
+resync_test_complete_read(struct resync_test *t, int err)
+{
+	td_vbd_request_t *vreq;
+
+	assert_false(list_empty(&t->vbd.new_requests));
+	vreq = list_entry(t->vbd.new_requests.next, td_vbd_request_t, next);
+	list_del_init(&vreq->next);
+	vreq->list_head = NULL;
+
+	vreq->cb(vreq, err, vreq->token, 1);
+}
+
+void
+test_resync_degraded_tracks_writes(void **state)
+{
+	struct resync_test t;
+	struct td_vbd_resync *rs;
+
+	resync_test_init(&t);
+
+	/* nothing is tracked until the secondary degrades */
+	tapdisk_vbd_resync_mark(&t.vbd, 0, 8);
+	assert_null(t.vbd.resync);
+
+	assert_int_equal(tapdisk_vbd_resync_degrade(&t.vbd, 0, 8), 0);
+	rs = t.vbd.resync;
+	assert_non_null(rs);
+	assert_int_equal(rs->state, TD_RESYNC_DEGRADED);
+	assert_int_equal(rs->stats.degraded, 1);
+	assert_int_equal(rs->copier->map.nbits, RESYNC_SECS / RESYNC_BLOCK);
+	assert_int_equal(rs->copier->map.ndirty, 1);
+
+	/* every guest write is tracked while degraded */
+	tapdisk_vbd_resync_mark(&t.vbd, RESYNC_BLOCK + 1, RESYNC_BLOCK);
+	assert_int_equal(rs->copier->map.ndirty, 3);
+
+	assert_int_equal(tapdisk_vbd_resync_degrade(&t.vbd, 0, 8), 0);
+	assert_int_equal(rs->stats.degraded, 1);
+
+	/* no secondary to copy to yet */
+	tapdisk_vbd_resync_start(&t.vbd);
+	assert_int_equal(rs->state, TD_RESYNC_DEGRADED);
+	assert_true(list_empty(&t.vbd.new_requests));
+
+	tapdisk_vbd_resync_free(&t.vbd);
+	assert_null(t.vbd.resync);
+}
+
+void
+test_resync_copies_dirty_blocks_to_secondary(void **state)
+{
+	struct resync_test t;
+	struct td_vbd_resync *rs;
+	td_request_t treq;
+
+	resync_test_init(&t);
+	tapdisk_vbd_resync_degrade(&t.vbd, 0, 2 * RESYNC_BLOCK);
+	tapdisk_vbd_resync_degrade(&t.vbd, 10 * RESYNC_BLOCK, 1);
+	rs = t.vbd.resync;
+
+	resync_test_attach(&t);
+	assert_int_equal(rs->state, TD_RESYNC_COPYING);
+
+	resync_test_tick(&t);
+	assert_int_equal(rs->copier->inflight, 2);
+	assert_int_equal(rs->copier->map.ndirty, 0);
+
+	/* copies are written to the secondary alone */
+	resync_test_complete_read(&t, 0);
+	treq = pop_queued_write();
+	assert_ptr_equal(treq.image, &t.secondary);
+	assert_int_equal(treq.sec, 0);
+	assert_int_equal(treq.secs, 2 * RESYNC_BLOCK);
+	assert_true(tapdisk_vbd_resync_busy(&t.vbd));
+	treq.cb(treq, 0);
+
+	resync_test_complete_read(&t, 0);
+	treq = pop_queued_write();
+	assert_int_equal(treq.sec, 10 * RESYNC_BLOCK);
+	treq.cb(treq, 0);
+	assert_false(tapdisk_vbd_resync_busy(&t.vbd));
+
+	/* converged */
+	resync_test_tick(&t);
+	assert_int_equal(rs->state, TD_RESYNC_IDLE);
+	assert_int_equal(rs->copier->stats.copied, 3);
+
+	tapdisk_vbd_resync_mark(&t.vbd, 0, 8);
+	assert_int_equal(rs->copier->map.ndirty, 0);
+
+	tapdisk_vbd_resync_free(&t.vbd);
+}
+
+void
+test_resync_redirties_writes_racing_copies(void **state)
+{
+	struct resync_test t;
+	struct td_vbd_resync *rs;
+	td_request_t treq;
+
+	resync_test_init(&t);
+	tapdisk_vbd_resync_degrade(&t.vbd, 0, RESYNC_BLOCK);
+	rs = t.vbd.resync;
+
+	resync_test_attach(&t);
+	resync_test_tick(&t);
+	assert_int_equal(rs->copier->map.ndirty, 0);
+
+	/* mirrored writes elsewhere need no copy */
+	tapdisk_vbd_resync_mark(&t.vbd, 4 * RESYNC_BLOCK, 8);
+	assert_int_equal(rs->copier->map.ndirty, 0);
+
+	/* one into the block being copied needs another pass */
+	tapdisk_vbd_resync_mark(&t.vbd, 8, 8);
+	assert_int_equal(rs->copier->map.ndirty, 1);
+
+	resync_test_complete_read(&t, 0);
+	treq = pop_queued_write();
+	treq.cb(treq, 0);
+
+	resync_test_tick(&t);
+	assert_int_equal(rs->state, TD_RESYNC_COPYING);
+	assert_int_equal(rs->copier->inflight, 1);
+
+	resync_test_complete_read(&t, 0);
+	treq = pop_queued_write();
+	treq.cb(treq, 0);
+
+	resync_test_tick(&t);
+	assert_int_equal(rs->state, TD_RESYNC_IDLE);
+
+	tapdisk_vbd_resync_free(&t.vbd);
+}
+
+void
+test_resync_write_failure_degrades(void **state)
+{
+	struct resync_test t;
+	struct td_vbd_resync *rs;
+	td_request_t treq;
+
+	resync_test_init(&t);
+	tapdisk_vbd_resync_degrade(&t.vbd, 0, RESYNC_BLOCK);
+	rs = t.vbd.resync;
+
+	resync_test_attach(&t);
+	resync_test_tick(&t);
+
+	resync_test_complete_read(&t, 0);
+	treq = pop_queued_write();
+	treq.cb(treq, -EIO);
+
+	/* the secondary is retired, and the block still dirty */
+	assert_null(t.vbd.secondary);
+	assert_int_equal(t.vbd.secondary_mode, TD_VBD_SECONDARY_DISABLED);
+	assert_ptr_equal(t.vbd.retired, &t.secondary);
+	assert_int_equal(rs->state, TD_RESYNC_DEGRADED);
+	assert_int_equal(rs->stats.degraded, 2);
+	assert_int_equal(rs->copier->map.ndirty, 1);
+
+	/* writes are tracked again, and the copier stops on its tick */
+	tapdisk_vbd_resync_mark(&t.vbd, RESYNC_BLOCK, 8);
+	assert_int_equal(rs->copier->map.ndirty, 2);
+
+	resync_test_tick(&t);
+	assert_int_equal(rs->copier->timer, -1);
+	assert_true(list_empty(&t.vbd.new_requests));
+
+	tapdisk_vbd_resync_free(&t.vbd);
+}
+
+void
+test_resync_free_cancels_queued_copies(void **state)
+{
+	struct resync_test t;
+
+	resync_test_init(&t);
+	tapdisk_vbd_resync_degrade(&t.vbd, 0, RESYNC_SECS);
+
+	resync_test_attach(&t);
+	resync_test_tick(&t);
+	/* the whole disk, in two chunks */
+	assert_int_equal(t.vbd.resync->copier->inflight, 2);
+
+	tapdisk_vbd_resync_free(&t.vbd);
+	assert_null(t.vbd.resync);
+	assert_true(list_empty(&t.vbd.new_requests));
+	assert_int_equal(t.vbd.returned, 2);
+}
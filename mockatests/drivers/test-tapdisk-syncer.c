@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk-syncer.h"
+
+#define SYNC_TEST_MAX	4
+
+struct sync_test {
+	struct td_syncer	syncer;
+	struct td_sync_waiter	waiters[SYNC_TEST_MAX];
+	int			done[SYNC_TEST_MAX];
+	int			err[SYNC_TEST_MAX];
+	int			resubmit;
+	char			dir[TEST_DIR_LEN];
+	char			path[PATH_MAX];
+	int			fd;
+};
+
+static struct sync_test *sync_test;
+
+/*
+ * Reopens the test file with @flags.
+ */
+static void
+sync_test_open(struct sync_test *t, int flags)
+{
+	if (t->fd >= 0)
+		close(t->fd);
+
+	t->fd = open(t->path, O_RDWR | O_CREAT | flags, 0600);
+	assert_true(t->fd >= 0);
+}
+
+int
+syncer_test_setup(void **state)
+{
+	struct sync_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+	sync_test = t;
+
+	test_dir_create(t->dir, "test-tapdisk-syncer");
+	test_dir_path(t->path, sizeof(t->path), t->dir, "disk.img");
+
+	t->fd = -1;
+	sync_test_open(t, 0);
+
+	*state = t;
+	return 0;
+}
+
+int
+syncer_test_teardown(void **state)
+{
+	struct sync_test *t = *state;
+
+	close(t->fd);
+	test_dir_remove(t->dir);
+	free(t);
+	sync_test = NULL;
+
+	return 0;
+}
+
+static void
+sync_test_done(struct td_sync_waiter *waiter, int err)
+{
+	struct sync_test *t = sync_test;
+	int i = waiter - t->waiters;
+
+	assert_in_range(i, 0, SYNC_TEST_MAX - 1);
+	t->done[i]++;
+	t->err[i] = err;
+
+	/* a write issued from a completion goes into the next batch */
+	if (t->resubmit && i == 0) {
+		t->resubmit = 0;
+		expect_value(__wrap_tapdisk_server_register_event, mode,
+			     SCHEDULER_POLL_TIMEOUT);
+		expect_any(__wrap_tapdisk_server_register_event, cb);
+		td_syncer_complete(&t->syncer, &t->waiters[3],
+				   sync_test_done, 0, 4096, 0);
+	}
+}
+
+static void
+sync_test_complete(struct sync_test *t, int i, int err)
+{
+	td_syncer_complete(&t->syncer, &t->waiters[i], sync_test_done,
+			   (off_t)i * 4096, 4096, err);
+}
+
+static void
+sync_test_run(void)
+{
+	registered_cb(0, SCHEDULER_POLL_TIMEOUT, registered_data);
+}
+
+void
+test_syncer_detects_io_mode(void **state)
+{
+	struct sync_test *t = *state;
+
+	td_syncer_init(&t->syncer, t->fd, 1);
+	assert_int_equal(t->syncer.mode, TD_IO_MODE_BUFFERED);
+	assert_true(td_syncer_buffered(&t->syncer));
+	assert_string_equal(td_io_mode_name(t->syncer.mode), "buffered");
+
+	/* caches opened buffered on purpose keep writing through */
+	td_syncer_init(&t->syncer, t->fd, 0);
+	assert_int_equal(t->syncer.mode, TD_IO_MODE_BUFFERED);
+	assert_false(td_syncer_buffered(&t->syncer));
+
+	sync_test_open(t, O_DSYNC);
+	td_syncer_init(&t->syncer, t->fd, 1);
+	assert_int_equal(t->syncer.mode, TD_IO_MODE_DSYNC);
+	assert_false(td_syncer_buffered(&t->syncer));
+	assert_string_equal(td_io_mode_name(t->syncer.mode), "dsync");
+
+	td_syncer_init(&t->syncer, -1, 1);
+	assert_int_equal(t->syncer.mode, TD_IO_MODE_DIRECT);
+	assert_false(td_syncer_buffered(&t->syncer));
+}
+
+void
+test_syncer_batches_completions(void **state)
+{
+	struct sync_test *t = *state;
+
+	td_syncer_init(&t->syncer, t->fd, 1);
+
+	/* one sync scheduled for everything completing in this pass */
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_TIMEOUT);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+	sync_test_complete(t, 0, 0);
+	sync_test_complete(t, 1, 0);
+	sync_test_complete(t, 2, 0);
+	assert_int_equal(t->done[0] + t->done[1] + t->done[2], 0);
+	assert_int_equal(t->syncer.pending, 3);
+
+	t->resubmit = 1;
+	sync_test_run();
+	assert_int_equal(t->done[0], 1);
+	assert_int_equal(t->done[1], 1);
+	assert_int_equal(t->done[2], 1);
+	assert_int_equal(t->err[0] | t->err[1] | t->err[2], 0);
+	assert_int_equal(t->syncer.syncs, 1);
+	assert_int_equal(t->syncer.max_batch, 3);
+
+	/* the write completed from a callback waits for its own sync */
+	assert_int_equal(t->done[3], 0);
+	assert_int_equal(t->syncer.pending, 1);
+	sync_test_run();
+	assert_int_equal(t->done[3], 1);
+	assert_int_equal(t->err[3], 0);
+	assert_int_equal(t->syncer.syncs, 2);
+	assert_int_equal(t->syncer.writes, 4);
+
+	td_syncer_close(&t->syncer);
+	assert_int_equal(t->syncer.syncs, 2);
+	close(t->fd);
+}
+
+void
+test_syncer_passes_through(void **state)
+{
+	struct sync_test *t = *state;
+
+	td_syncer_init(&t->syncer, t->fd, 0);
+	sync_test_complete(t, 0, 0);
+	assert_int_equal(t->done[0], 1);
+	assert_int_equal(t->err[0], 0);
+
+	/* failed writes are not held back either */
+	td_syncer_init(&t->syncer, t->fd, 1);
+	sync_test_complete(t, 1, -EIO);
+	assert_int_equal(t->done[1], 1);
+	assert_int_equal(t->err[1], -EIO);
+	assert_int_equal(t->syncer.pending, 0);
+	assert_int_equal(t->syncer.syncs, 0);
+
+	td_syncer_close(&t->syncer);
+}
+
+void
+test_syncer_close_flushes(void **state)
+{
+	struct sync_test *t = *state;
+
+	td_syncer_init(&t->syncer, t->fd, 1);
+
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_TIMEOUT);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+	sync_test_complete(t, 0, 0);
+	assert_int_equal(t->done[0], 0);
+
+	td_syncer_close(&t->syncer);
+	assert_int_equal(t->done[0], 1);
+	assert_int_equal(t->err[0], 0);
+	assert_int_equal(t->syncer.syncs, 1);
+	close(t->fd);
+}
+
+void
+test_syncer_failed_sync_is_sticky(void **state)
+{
+	struct sync_test *t = *state;
+	int fds[2];
+
+	/* fdatasync() fails on a pipe */
+	assert_int_equal(pipe(fds), 0);
+
+	td_syncer_init(&t->syncer, fds[1], 1);
+	assert_true(td_syncer_buffered(&t->syncer));
+
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_TIMEOUT);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+	sync_test_complete(t, 0, 0);
+	sync_test_complete(t, 1, 0);
+	sync_test_run();
+
+	assert_int_equal(t->done[0], 1);
+	assert_int_equal(t->done[1], 1);
+	assert_int_equal(t->err[0], -EINVAL);
+	assert_int_equal(t->err[1], -EINVAL);
+
+	/* nothing after it can be known to be stable */
+	sync_test_complete(t, 2, 0);
+	assert_int_equal(t->done[2], 1);
+	assert_int_equal(t->err[2], -EINVAL);
+	assert_int_equal(t->syncer.syncs, 1);
+
+	td_syncer_close(&t->syncer);
+	close(fds[0]);
+	close(fds[1]);
+}
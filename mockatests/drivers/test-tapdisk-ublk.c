@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+
+#include "tapdisk-ublk.c"
+
+#ifdef HAVE_LINUX_UBLK_CMD_H
+
+#define UBLK_TEST_DEPTH   4
+#define UBLK_TEST_BUF     4096
+
+/*
+ * One queue of a device which was never added: commits pile up in a
+ * submission ring no kernel reads, and requests stay on the new list
+ * of a VBD which is never run.
+ */
+struct ublk_test {
+	td_vbd_t                vbd;
+	td_ublk_t               ublk;
+	td_ublk_queue_t         q;
+
+	struct ublksrv_io_desc  iods[UBLK_TEST_DEPTH];
+	td_ublk_req_t           reqs[UBLK_TEST_DEPTH];
+	char                    bufs[UBLK_TEST_DEPTH * UBLK_TEST_BUF];
+
+	unsigned int            sq_head;
+	unsigned int            sq_tail;
+	unsigned int            sq_mask;
+	unsigned int            sq_array[UBLK_TEST_DEPTH];
+	struct io_uring_sqe     sqes[UBLK_TEST_DEPTH];
+};
+
+int
+ublk_test_setup(void **state)
+{
+	struct td_ublk_ring *ring;
+	struct ublk_test *t;
+	int i;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+
+	test_vbd_init(&t->vbd);
+	t->vbd.disk_info.size        = 1024;
+	t->vbd.disk_info.sector_size = 512;
+
+	t->ublk.vbd      = &t->vbd;
+	t->ublk.depth    = UBLK_TEST_DEPTH;
+	t->ublk.buf_size = UBLK_TEST_BUF;
+	t->ublk.cdev_fd  = -1;
+
+	t->q.ublk = &t->ublk;
+	t->q.iods = t->iods;
+	t->q.reqs = t->reqs;
+	t->q.bufs = t->bufs;
+	for (i = 0; i < UBLK_TEST_DEPTH; i++) {
+		t->reqs[i].q   = &t->q;
+		t->reqs[i].tag = i;
+	}
+
+	ring = &t->q.ring;
+	ring->fd       = -1;
+	ring->entries  = UBLK_TEST_DEPTH;
+	ring->sqe_size = sizeof(struct io_uring_sqe);
+	ring->sq_head  = &t->sq_head;
+	ring->sq_tail  = &t->sq_tail;
+	ring->sq_mask  = &t->sq_mask;
+	ring->sq_array = t->sq_array;
+	ring->sqes     = t->sqes;
+	t->sq_mask     = UBLK_TEST_DEPTH - 1;
+
+	*state = t;
+	return 0;
+}
+
+int
+ublk_test_teardown(void **state)
+{
+	struct ublk_test *t = *state;
+
+	assert_true(list_empty(&t->vbd.new_requests));
+	free(t);
+
+	return 0;
+}
+
+/*
+ * The driver hands over @tag.
+ */
+static void
+ublk_test_request(struct ublk_test *t, int tag, int op,
+		  uint64_t sec, uint32_t secs)
+{
+	t->iods[tag].op_flags     = op;
+	t->iods[tag].start_sector = sec;
+	t->iods[tag].nr_sectors   = secs;
+
+	tapdisk_ublk_get_request(&t->q, tag);
+}
+
+/*
+ * Completes the request the VBD was given @nth.
+ */
+static void
+ublk_test_complete(struct ublk_test *t, int nth)
+{
+	td_vbd_request_t *vreq;
+	struct list_head *pos;
+
+	pos = t->vbd.new_requests.next;
+	while (nth--)
+		pos = pos->next;
+	assert_ptr_not_equal(pos, &t->vbd.new_requests);
+
+	vreq = list_entry(pos, td_vbd_request_t, next);
+	list_del_init(&vreq->next);
+	vreq->cb(vreq, 0, vreq->token, 1);
+}
+
+/*
+ * Checks the next commit queued, if any: -1 if there is none.
+ */
+static int
+ublk_test_commit(struct ublk_test *t, int *result)
+{
+	struct ublksrv_io_cmd *cmd;
+	struct io_uring_sqe *sqe;
+
+	if (t->sq_head == t->q.ring.sq_tail_pvt)
+		return -1;
+
+	sqe = &t->sqes[t->sq_head++ & t->sq_mask];
+	assert_int_equal(sqe->opcode, IORING_OP_URING_CMD);
+	assert_int_equal(sqe->cmd_op, TD_UBLK_IO_COMMIT_AND_FETCH);
+
+	cmd = (struct ublksrv_io_cmd *)sqe->cmd;
+	assert_int_equal(cmd->q_id, t->q.q_id);
+	assert_int_equal(cmd->tag, sqe->user_data);
+	*result = cmd->result;
+
+	return cmd->tag;
+}
+
+/*
+ * A flush is committed once the requests which reached the queue
+ * before it are, while those after it go ahead.
+ */
+void
+test_ublk_flush_waits_for_earlier_requests(void **state)
+{
+	struct ublk_test *t = *state;
+	int result;
+
+	ublk_test_request(t, 0, UBLK_IO_OP_WRITE, 0, 8);
+	ublk_test_request(t, 1, UBLK_IO_OP_FLUSH, 0, 0);
+	ublk_test_request(t, 2, UBLK_IO_OP_READ, 8, 8);
+	assert_int_equal(ublk_test_commit(t, &result), -1);
+
+	ublk_test_complete(t, 1);
+	assert_int_equal(ublk_test_commit(t, &result), 2);
+	assert_int_equal(result, 8 << SECTOR_SHIFT);
+	assert_int_equal(ublk_test_commit(t, &result), -1);
+
+	ublk_test_complete(t, 0);
+	assert_int_equal(ublk_test_commit(t, &result), 0);
+	assert_int_equal(result, 8 << SECTOR_SHIFT);
+	assert_int_equal(ublk_test_commit(t, &result), 1);
+	assert_int_equal(result, 0);
+	assert_int_equal(ublk_test_commit(t, &result), -1);
+
+	assert_int_equal(t->q.busy, 0);
+	assert_int_equal(t->q.flushes, 0);
+}
+
+void
+test_ublk_flush_when_idle(void **state)
+{
+	struct ublk_test *t = *state;
+	int result;
+
+	ublk_test_request(t, 3, UBLK_IO_OP_FLUSH, 0, 0);
+	assert_int_equal(ublk_test_commit(t, &result), 3);
+	assert_int_equal(result, 0);
+	assert_int_equal(t->q.flushes, 0);
+}
+
+/*
+ * Requests the VBD cannot serve fail right away.
+ */
+void
+test_ublk_bad_requests(void **state)
+{
+	struct ublk_test *t = *state;
+	int result;
+
+	ublk_test_request(t, 0, UBLK_IO_OP_DISCARD, 0, 8);
+	ublk_test_request(t, 1, UBLK_IO_OP_WRITE, 1020, 8);
+	ublk_test_request(t, 2, UBLK_IO_OP_READ, 0,
+			  (UBLK_TEST_BUF >> SECTOR_SHIFT) + 1);
+
+	assert_int_equal(ublk_test_commit(t, &result), 0);
+	assert_int_equal(result, -EOPNOTSUPP);
+	assert_int_equal(ublk_test_commit(t, &result), 1);
+	assert_int_equal(result, -EINVAL);
+	assert_int_equal(ublk_test_commit(t, &result), 2);
+	assert_int_equal(result, -EINVAL);
+
+	assert_int_equal(t->ublk.stats.errors, 3);
+	assert_int_equal(t->q.busy, 0);
+}
+
+#else /* HAVE_LINUX_UBLK_CMD_H */
+
+int
+ublk_test_setup(void **state)
+{
+	return 0;
+}
+
+int
+ublk_test_teardown(void **state)
+{
+	return 0;
+}
+
+void
+test_ublk_flush_waits_for_earlier_requests(void **state)
+{
+	skip();
+}
+
+void
+test_ublk_flush_when_idle(void **state)
+{
+	skip();
+}
+
+void
+test_ublk_bad_requests(void **state)
+{
+	skip();
+}
+
+#endif /* HAVE_LINUX_UBLK_CMD_H */
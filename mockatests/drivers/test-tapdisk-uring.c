@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "test-suites.h"
+#include "vbd-wrappers.h"
+#include "tapdisk-uring.h"
+
+struct uring_test {
+	td_vbd_t		vbd;
+	td_uring_server_t      *server;
+	td_uring_t		client;
+	event_cb_t		listen_cb;
+	event_cb_t		conn_cb;
+	char			dir[TEST_DIR_LEN];
+	char			location[PATH_MAX];
+};
+
+static void
+uring_test_expect_register(void)
+{
+	expect_value(__wrap_tapdisk_server_register_event, mode,
+		     SCHEDULER_POLL_READ_FD);
+	expect_any(__wrap_tapdisk_server_register_event, cb);
+}
+
+/*
+ * Has the server take the pending client, and picks up the event it
+ * registers for it.
+ */
+static void
+uring_test_accept(struct uring_test *t)
+{
+	uring_test_expect_register();
+	t->listen_cb(0, SCHEDULER_POLL_READ_FD, t->server);
+	t->conn_cb = registered_cb;
+
+	assert_true(t->server->ring.connfd >= 0);
+}
+
+/*
+ * The client's side of the control socket, written to directly: the
+ * library's own send() is mocked.
+ */
+static void
+uring_test_send(struct uring_test *t, uint8_t type, int count)
+{
+	td_uring_message_t msg = { .type = type };
+
+	while (count--)
+		assert_int_equal(write(t->client.connfd, &msg, sizeof(msg)),
+				 sizeof(msg));
+}
+
+static void
+uring_test_expect_kick(struct uring_test *t, int ret)
+{
+	expect_any(__wrap_send, buf);
+	expect_value(__wrap_send, fd, t->server->ring.connfd);
+	expect_value(__wrap_send, size, sizeof(td_uring_message_t));
+	expect_value(__wrap_send, flags, MSG_DONTWAIT | MSG_NOSIGNAL);
+	will_return(__wrap_send, ret);
+}
+
+static void
+uring_test_request(struct uring_test *t, uint64_t id, uint64_t sec, int secs)
+{
+	td_uring_front_ring_t *front = &t->client.front;
+	td_uring_request_t *req;
+
+	req = RING_GET_REQUEST(front, front->req_prod_pvt++);
+	req->op     = TD_URING_OP_READ;
+	req->id     = id;
+	req->sec    = sec;
+	req->secs   = secs;
+	req->offset = 0;
+
+	RING_PUSH_REQUESTS(front);
+}
+
+/*
+ * Completes the oldest request the server queued on the VBD.
+ */
+static void
+uring_test_complete(struct uring_test *t, int err)
+{
+	td_vbd_request_t *vreq;
+
+	assert_false(list_empty(&t->vbd.new_requests));
+	vreq = list_first_entry(&t->vbd.new_requests, td_vbd_request_t, next);
+	list_del_init(&vreq->next);
+
+	vreq->cb(vreq, err, vreq->token, 1);
+}
+
+int
+uring_test_setup(void **state)
+{
+	struct uring_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+
+	test_vbd_init(&t->vbd);
+	t->vbd.disk_info.size = 2048;
+
+	/* the shm object is named after the location's basename */
+	test_dir_create(t->dir, "test-uring");
+	test_dir_path(t->location, sizeof(t->location), t->dir,
+		      basename(t->dir));
+
+	uring_test_expect_register();
+	assert_int_equal(tapdisk_uring_server_open(t->location, &t->vbd,
+						   &t->server), 0);
+	t->listen_cb = registered_cb;
+
+	assert_int_equal(tapdisk_uring_connect(&t->client, t->location), 0);
+
+	*state = t;
+	return 0;
+}
+
+int
+uring_test_teardown(void **state)
+{
+	struct uring_test *t = *state;
+
+	tapdisk_uring_disconnect(&t->client);
+	tapdisk_uring_server_close(t->server);
+	test_dir_remove(t->dir);
+	free(t);
+
+	return 0;
+}
+
+void
+test_uring_accept_nonblocking(void **state)
+{
+	struct uring_test *t = *state;
+	int flags;
+
+	uring_test_accept(t);
+
+	flags = fcntl(t->server->ring.connfd, F_GETFL);
+	assert_true(flags & O_NONBLOCK);
+	assert_int_equal(t->server->stats.connects, 1);
+}
+
+void
+test_uring_recv_counts_kicks(void **state)
+{
+	struct uring_test *t = *state;
+
+	uring_test_accept(t);
+
+	assert_int_equal(tapdisk_uring_recv(&t->server->ring), -EAGAIN);
+
+	uring_test_send(t, TD_URING_MESSAGE_KICK, 3);
+	assert_int_equal(tapdisk_uring_recv(&t->server->ring), 3);
+	assert_int_equal(tapdisk_uring_recv(&t->server->ring), -EAGAIN);
+
+	uring_test_send(t, TD_URING_MESSAGE_KICK + 1, 1);
+	assert_int_equal(tapdisk_uring_recv(&t->server->ring), -EINVAL);
+
+	close(t->client.connfd);
+	t->client.connfd = -1;
+	assert_int_equal(tapdisk_uring_recv(&t->server->ring), -EIO);
+}
+
+void
+test_uring_kick_coalesces(void **state)
+{
+	struct uring_test *t = *state;
+
+	uring_test_accept(t);
+
+	uring_test_expect_kick(t, -EAGAIN);
+	assert_int_equal(tapdisk_uring_kick(&t->server->ring), -EAGAIN);
+	assert_int_equal(t->server->ring.tx_off, 0);
+
+	uring_test_expect_kick(t, sizeof(td_uring_message_t));
+	assert_int_equal(tapdisk_uring_kick(&t->server->ring), 0);
+
+	tapdisk_uring_hangup(&t->server->ring);
+	assert_int_equal(tapdisk_uring_kick(&t->server->ring), -ENOTCONN);
+}
+
+void
+test_uring_server_spurious_wakeup(void **state)
+{
+	struct uring_test *t = *state;
+
+	uring_test_accept(t);
+
+	/* nothing to read: the event returns instead of waiting */
+	t->conn_cb(0, SCHEDULER_POLL_READ_FD, t->server);
+
+	assert_true(t->server->ring.connfd >= 0);
+	assert_int_equal(t->server->stats.kicks.in, 0);
+}
+
+void
+test_uring_server_request(void **state)
+{
+	struct uring_test *t = *state;
+	td_uring_front_ring_t *front = &t->client.front;
+	td_uring_response_t *rsp;
+
+	uring_test_accept(t);
+
+	uring_test_request(t, 7, 8, 8);
+	uring_test_request(t, 9, 2048, 8);
+	uring_test_send(t, TD_URING_MESSAGE_KICK, 2);
+
+	/* the request past the end of the disk fails right away */
+	uring_test_expect_kick(t, sizeof(td_uring_message_t));
+	t->conn_cb(0, SCHEDULER_POLL_READ_FD, t->server);
+
+	assert_int_equal(t->server->stats.kicks.in, 2);
+	assert_int_equal(t->server->stats.kicks.out, 1);
+	assert_int_equal(t->server->stats.reqs.in, 2);
+
+	assert_int_equal(front->sring->rsp_prod, 1);
+	rsp = RING_GET_RESPONSE(front, 0);
+	assert_int_equal(rsp->id, 9);
+	assert_int_equal(rsp->status, TD_URING_RSP_ERROR);
+	front->rsp_cons = 1;
+
+	/* the client has not caught up with the first kick yet */
+	uring_test_complete(t, 0);
+	assert_int_equal(front->sring->rsp_prod, 2);
+	rsp = RING_GET_RESPONSE(front, 1);
+	assert_int_equal(rsp->id, 7);
+	assert_int_equal(rsp->status, TD_URING_RSP_OKAY);
+	front->rsp_cons = 2;
+
+	uring_test_request(t, 11, 0, 8);
+	uring_test_send(t, TD_URING_MESSAGE_KICK, 1);
+	t->conn_cb(0, SCHEDULER_POLL_READ_FD, t->server);
+
+	/* now it is, and its socket is full */
+	front->sring->rsp_event = front->rsp_cons + 1;
+	uring_test_expect_kick(t, -EAGAIN);
+	uring_test_complete(t, -EIO);
+
+	rsp = RING_GET_RESPONSE(front, 2);
+	assert_int_equal(rsp->id, 11);
+	assert_int_equal(rsp->status, TD_URING_RSP_ERROR);
+	assert_int_equal(t->server->stats.kicks.out, 1);
+	assert_int_equal(t->server->stats.kicks.coalesced, 1);
+	assert_true(t->server->ring.connfd >= 0);
+}
+
+void
+test_uring_server_busy_rejects(void **state)
+{
+	struct uring_test *t = *state;
+	td_uring_sring_t *sring = t->server->ring.ring_area;
+	td_uring_t late;
+
+	uring_test_accept(t);
+
+	uring_test_request(t, 1, 0, 8);
+	uring_test_send(t, TD_URING_MESSAGE_KICK, 1);
+	t->conn_cb(0, SCHEDULER_POLL_READ_FD, t->server);
+
+	tapdisk_uring_disconnect(&t->client);
+	t->conn_cb(0, SCHEDULER_POLL_READ_FD, t->server);
+	assert_true(t->server->ring.connfd < 0);
+
+	/* the request is still in flight: the ring must not be reset */
+	assert_int_equal(tapdisk_uring_connect(&late, t->location), 0);
+	t->listen_cb(0, SCHEDULER_POLL_READ_FD, t->server);
+
+	assert_true(t->server->ring.connfd < 0);
+	assert_int_equal(sring->req_prod, 1);
+	assert_int_equal(t->server->stats.connects, 1);
+	assert_int_equal(tapdisk_uring_recv(&late), -EIO);
+	tapdisk_uring_disconnect(&late);
+
+	/* nobody to answer to once it completes */
+	uring_test_complete(t, 0);
+	assert_int_equal(sring->rsp_prod, 0);
+
+	assert_int_equal(tapdisk_uring_connect(&t->client, t->location), 0);
+	uring_test_accept(t);
+	assert_int_equal(sring->req_prod, 0);
+	assert_int_equal(t->server->stats.connects, 2);
+}
@@ -32,6 +32,7 @@
 #include <stdarg.h>
 #include <setjmp.h>
 #include <cmocka.h>
+#include <errno.h>
 #include <stdlib.h>
 
 #include "test-suites.h"
@@ -41,6 +42,13 @@
 #include "tapdisk-image.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-nbdserver.h"
+#include "tapdisk-metrics.h"
+#include "vbd-wrappers.h"
+
+/* gettimeofday() is wrapped in test-scheduler.c */
+extern struct timeval fake_gettimeofday;
+
+#define VBD_CLASS_TEST_REQS	4
 
 void
 test_vbd_linked_list(void **state)
@@ -155,3 +163,170 @@ test_vbd_complete_block_status_request(void **stat)
 	tapdisk_image_close(image);
 	free_extents(extents);
 }
+
+/*
+ * A VBD with one image, which writes are issued to through the
+ * td_queue_write() wrapper, and requests of each class to queue.
+ */
+struct vbd_class_test {
+	td_vbd_t		vbd;
+	td_image_t		image;
+	struct stats		stats;
+	td_vbd_request_t	vreq[VBD_CLASS_TEST_REQS];
+	struct td_iovec		iov[VBD_CLASS_TEST_REQS];
+	char			buf[8 << SECTOR_SHIFT];
+};
+
+int
+vbd_class_test_setup(void **state)
+{
+	struct vbd_class_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+
+	test_vbd_init(&t->vbd);
+	t->vbd.vdi_stats.stats = &t->stats;
+
+	t->image.name = "image";
+	list_add_tail(&t->image.next, &t->vbd.images);
+
+	n_queued_writes = 0;
+	fake_gettimeofday = (struct timeval){ .tv_sec = 1000 };
+
+	*state = t;
+	return 0;
+}
+
+int
+vbd_class_test_teardown(void **state)
+{
+	free(*state);
+	return 0;
+}
+
+static td_vbd_request_t *
+vbd_class_test_write(struct vbd_class_test *t, int i, int io_class,
+		     td_sector_t sec, int secs)
+{
+	td_vbd_request_t *vreq = &t->vreq[i];
+
+	t->iov[i].base = t->buf;
+	t->iov[i].secs = secs;
+
+	vreq->op       = TD_OP_WRITE;
+	vreq->sec      = sec;
+	vreq->iov      = &t->iov[i];
+	vreq->iovcnt   = 1;
+	vreq->io_class = io_class;
+	vreq->name     = "test";
+	INIT_LIST_HEAD(&vreq->next);
+
+	assert_int_equal(tapdisk_vbd_queue_request(&t->vbd, vreq), 0);
+	return vreq;
+}
+
+static void
+vbd_class_test_tick(long ms)
+{
+	fake_gettimeofday.tv_usec += ms * 1000;
+	fake_gettimeofday.tv_sec  += fake_gettimeofday.tv_usec / 1000000;
+	fake_gettimeofday.tv_usec %= 1000000;
+}
+
+/*
+ * Foreground requests go ahead of held background ones, except those
+ * overlapping them, which wait their turn behind them.
+ */
+void
+test_vbd_class_two_pass_issue(void **state)
+{
+	struct vbd_class_test *t = *state;
+	td_vbd_request_t *bg, *fg, *fg_overlap;
+	td_request_t treq;
+
+	/* foreground I/O in flight, and background at its limit */
+	t->vbd.classes[TD_VREQ_CLASS_FG].inflight = 1;
+	t->vbd.classes[TD_VREQ_CLASS_BG].inflight = TD_VBD_BG_INFLIGHT;
+
+	bg         = vbd_class_test_write(t, 0, TD_VREQ_CLASS_BG, 0, 8);
+	fg         = vbd_class_test_write(t, 1, TD_VREQ_CLASS_FG, 100, 8);
+	fg_overlap = vbd_class_test_write(t, 2, TD_VREQ_CLASS_FG, 4, 8);
+
+	will_return(__wrap_tapdisk_image_check_request, 0);
+	assert_int_equal(tapdisk_vbd_issue_requests(&t->vbd), -EAGAIN);
+
+	assert_int_equal(n_queued_writes, 1);
+	treq = pop_queued_write();
+	assert_ptr_equal(treq.vreq, fg);
+	assert_int_equal(treq.sec, 100);
+
+	assert_ptr_equal(bg->list_head, &t->vbd.new_requests);
+	assert_ptr_equal(fg_overlap->list_head, &t->vbd.new_requests);
+	assert_int_equal(t->vbd.classes[TD_VREQ_CLASS_BG].deferred, 1);
+	assert_int_equal(t->vbd.classes[TD_VREQ_CLASS_FG].deferred, 1);
+	assert_int_equal(t->vbd.classes[TD_VREQ_CLASS_FG].issued, 1);
+
+	/* once the background request may go, the other follows it */
+	t->vbd.classes[TD_VREQ_CLASS_BG].inflight = 0;
+
+	will_return_count(__wrap_tapdisk_image_check_request, 0, 2);
+	assert_int_equal(tapdisk_vbd_issue_requests(&t->vbd), 0);
+
+	assert_int_equal(n_queued_writes, 2);
+	treq = pop_queued_write();
+	assert_ptr_equal(treq.vreq, bg);
+	treq = pop_queued_write();
+	assert_ptr_equal(treq.vreq, fg_overlap);
+	assert_true(list_empty(&t->vbd.new_requests));
+}
+
+/*
+ * Held requests go once they have waited out their class deadline,
+ * however busy the foreground is.
+ */
+void
+test_vbd_class_deadline(void **state)
+{
+	struct vbd_class_test *t = *state;
+	td_vbd_request_t *export, *bg;
+	td_request_t treq;
+
+	t->vbd.classes[TD_VREQ_CLASS_FG].inflight     = 1;
+	t->vbd.classes[TD_VREQ_CLASS_EXPORT].inflight = TD_VBD_EXPORT_INFLIGHT;
+	t->vbd.classes[TD_VREQ_CLASS_BG].inflight     = TD_VBD_BG_INFLIGHT;
+
+	export = vbd_class_test_write(t, 0, TD_VREQ_CLASS_EXPORT, 0, 8);
+	bg     = vbd_class_test_write(t, 1, TD_VREQ_CLASS_BG, 8, 8);
+
+	assert_int_equal(tapdisk_vbd_issue_requests(&t->vbd), -EAGAIN);
+	assert_int_equal(n_queued_writes, 0);
+
+	vbd_class_test_tick(TD_VBD_EXPORT_DEADLINE_MS - 1);
+	assert_int_equal(tapdisk_vbd_issue_requests(&t->vbd), -EAGAIN);
+	assert_int_equal(n_queued_writes, 0);
+
+	vbd_class_test_tick(1);
+	will_return(__wrap_tapdisk_image_check_request, 0);
+	assert_int_equal(tapdisk_vbd_issue_requests(&t->vbd), -EAGAIN);
+	assert_int_equal(n_queued_writes, 1);
+	treq = pop_queued_write();
+	assert_ptr_equal(treq.vreq, export);
+
+	assert_int_equal(t->vbd.classes[TD_VREQ_CLASS_EXPORT].expired, 1);
+	assert_int_equal(t->vbd.classes[TD_VREQ_CLASS_EXPORT].deferred, 2);
+	assert_int_equal(t->vbd.classes[TD_VREQ_CLASS_EXPORT].max_wait_us,
+			 TD_VBD_EXPORT_DEADLINE_MS * 1000);
+
+	vbd_class_test_tick(TD_VBD_BG_DEADLINE_MS - TD_VBD_EXPORT_DEADLINE_MS);
+	will_return(__wrap_tapdisk_image_check_request, 0);
+	assert_int_equal(tapdisk_vbd_issue_requests(&t->vbd), 0);
+	assert_int_equal(n_queued_writes, 1);
+	treq = pop_queued_write();
+	assert_ptr_equal(treq.vreq, bg);
+
+	assert_int_equal(t->vbd.classes[TD_VREQ_CLASS_BG].expired, 1);
+	assert_int_equal(t->vbd.classes[TD_VREQ_CLASS_BG].deferred, 3);
+	assert_int_equal(t->vbd.classes[TD_VREQ_CLASS_BG].max_wait_us,
+			 TD_VBD_BG_DEADLINE_MS * 1000);
+}
@@ -32,9 +32,19 @@
 #include <stddef.h>
 #include <setjmp.h>
 #include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
 
 #include "tapdisk.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-image.h"
+#include "tapdisk-syslog.h"
+#include "vbd-wrappers.h"
 
 int
 __wrap_tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
@@ -51,19 +61,401 @@ __wrap_td_queue_block_status(td_image_t *image, td_request_t *treq)
 int
 __wrap_send(int fd, void* buf, size_t size, int flags)
 {
+	int ret;
+
 	check_expected(buf);
 	check_expected(fd);
 	check_expected(size);
 	check_expected(flags);
-	return (int)mock();
+
+	/* a negative errno fails the call */
+	ret = (int)mock();
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return ret;
 }
 
+event_cb_t registered_cb;
+void *registered_data;
+
 event_id_t
 __wrap_tapdisk_server_register_event(char mode, int fd,
                               struct timeval timeout, event_cb_t cb, void *data)
 {
 	check_expected(mode);
 	check_expected_ptr(cb);
+	registered_cb   = cb;
+	registered_data = data;
+	return 0;
+}
+
+td_image_t *mock_image;
+
+int __real_tapdisk_image_open(int type, const char *name, int flags,
+			      struct td_vbd_encryption *encryption,
+			      td_image_t **_image);
+void __real_tapdisk_image_close(td_image_t *image);
+
+int
+__wrap_tapdisk_image_open(int type, const char *name, int flags,
+			  struct td_vbd_encryption *encryption,
+			  td_image_t **_image)
+{
+	if (!mock_image)
+		return __real_tapdisk_image_open(type, name, flags,
+						 encryption, _image);
+
+	*_image = mock_image;
+	return 0;
+}
+
+void
+__wrap_tapdisk_image_close(td_image_t *image)
+{
+	if (image != mock_image)
+		__real_tapdisk_image_close(image);
+}
+
+td_request_t queued_writes[MAX_QUEUED_WRITES];
+int n_queued_writes;
+
+void
+__wrap_td_queue_write(td_image_t *image, td_request_t treq)
+{
+	assert_in_range(n_queued_writes, 0, MAX_QUEUED_WRITES - 1);
+	treq.image = image;
+	queued_writes[n_queued_writes++] = treq;
+}
+
+td_request_t
+pop_queued_write(void)
+{
+	td_request_t treq;
+
+	assert_int_not_equal(n_queued_writes, 0);
+	treq = queued_writes[0];
+	memmove(&queued_writes[0], &queued_writes[1],
+		--n_queued_writes * sizeof(treq));
+
+	return treq;
+}
+
+td_request_t forwarded[MAX_FORWARDED];
+int n_forwarded;
+
+void
+__wrap_td_forward_request(td_request_t treq)
+{
+	assert_in_range(n_forwarded, 0, MAX_FORWARDED - 1);
+	forwarded[n_forwarded++] = treq;
+}
+
+td_request_t
+pop_forwarded(void)
+{
+	td_request_t treq;
+
+	assert_int_not_equal(n_forwarded, 0);
+	treq = forwarded[0];
+	memmove(&forwarded[0], &forwarded[1],
+		--n_forwarded * sizeof(treq));
+
+	return treq;
+}
+
+struct test_io {
+	struct tiocb	       *tiocb;
+	int			fd;
+	int			rw;
+	char		       *buf;
+	size_t			size;
+	long long		offset;
+};
+
+#define MAX_TEST_IO 256
+
+static struct test_io test_ios[MAX_TEST_IO];
+static int n_test_ios, n_queued_ios;
+static int fail_write_skip, fail_write_err;
+
+static void
+test_io_prep(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
+	     long long offset, td_queue_callback_t cb, void *arg)
+{
+	struct test_io *io;
+	int i;
+
+	for (i = 0; i < n_test_ios; i++)
+		if (test_ios[i].tiocb == tiocb)
+			break;
+
+	if (i == n_test_ios) {
+		assert_in_range(n_test_ios, 0, MAX_TEST_IO - 1);
+		n_test_ios++;
+	}
+
+	memset(tiocb, 0, sizeof(*tiocb));
+	tiocb->cb  = cb;
+	tiocb->arg = arg;
+
+	io         = &test_ios[i];
+	io->tiocb  = tiocb;
+	io->fd     = fd;
+	io->rw     = rw;
+	io->buf    = buf;
+	io->size   = size;
+	io->offset = offset;
+}
+
+static struct tiocb *test_io_queue[MAX_TEST_IO];
+
+static void
+test_io_queue_tiocb(struct tiocb *tiocb)
+{
+	assert_in_range(n_queued_ios, 0, MAX_TEST_IO - 1);
+	test_io_queue[n_queued_ios++] = tiocb;
+}
+
+void
+test_io_attach(td_driver_t *driver)
+{
+	n_test_ios   = 0;
+	n_queued_ios = 0;
+	fail_write_err = 0;
+
+	driver->prep_func  = test_io_prep;
+	driver->queue_func = test_io_queue_tiocb;
+}
+
+void
+test_io_fail_write(int skip, int err)
+{
+	fail_write_skip = skip;
+	fail_write_err  = err;
+}
+
+static struct test_io *
+test_io_find(struct tiocb *tiocb)
+{
+	int i;
+
+	for (i = 0; i < n_test_ios; i++)
+		if (test_ios[i].tiocb == tiocb)
+			return &test_ios[i];
+
+	fail_msg("tiocb %p was never prepared", tiocb);
+	return NULL;
+}
+
+int
+test_io_queued(int i, int *rw, long long *offset, size_t *size)
+{
+	struct test_io *io;
+
+	if (i >= n_queued_ios)
+		return 0;
+
+	io = test_io_find(test_io_queue[i]);
+	if (rw)
+		*rw = io->rw;
+	if (offset)
+		*offset = io->offset;
+	if (size)
+		*size = io->size;
+
+	return 1;
+}
+
+int
+test_io_step(void)
+{
+	struct tiocb *tiocb;
+	struct test_io *io;
+	ssize_t n;
+	int err;
+
+	if (!n_queued_ios)
+		return 0;
+
+	tiocb = test_io_queue[0];
+	memmove(&test_io_queue[0], &test_io_queue[1],
+		--n_queued_ios * sizeof(tiocb));
+
+	io = test_io_find(tiocb);
+
+	if (io->rw && fail_write_err && !fail_write_skip--) {
+		err = fail_write_err;
+		fail_write_err = 0;
+	} else {
+		n = io->rw ?
+			pwrite(io->fd, io->buf, io->size, io->offset) :
+			pread(io->fd, io->buf, io->size, io->offset);
+		err = n < 0 ? -errno : 0;
+
+		/* reads past the end of the file come back zeroed */
+		if (!io->rw && n >= 0 && n < io->size)
+			memset(io->buf + n, 0, io->size - n);
+	}
+
+	tiocb->cb(tiocb->arg, tiocb, err);
+	return 1;
+}
+
+int
+test_io_run(void)
+{
+	int done = 0;
+
+	while (test_io_step())
+		done++;
+
+	return done;
+}
+
+/*
+ * Log messages would otherwise go to the syslog socket through the
+ * send() wrapper.
+ */
+int
+__wrap_tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
+{
 	return 0;
 }
 
+int mock_storage_type;
+
+int __real_tapdisk_storage_type(const char *path);
+
+int
+__wrap_tapdisk_storage_type(const char *path)
+{
+	if (mock_storage_type)
+		return mock_storage_type;
+
+	return __real_tapdisk_storage_type(path);
+}
+
+void
+test_vbd_init(td_vbd_t *vbd)
+{
+	bzero(vbd, sizeof(*vbd));
+	INIT_LIST_HEAD(&vbd->images);
+	INIT_LIST_HEAD(&vbd->new_requests);
+	INIT_LIST_HEAD(&vbd->pending_requests);
+	INIT_LIST_HEAD(&vbd->failed_requests);
+	INIT_LIST_HEAD(&vbd->completed_requests);
+	vbd->name = "test";
+}
+
+void
+test_dir_create(char *dir, const char *name)
+{
+	snprintf(dir, TEST_DIR_LEN, "/tmp/%s-XXXXXX", name);
+	assert_non_null(mkdtemp(dir));
+}
+
+void
+test_dir_path(char *path, size_t size, const char *dir, const char *file)
+{
+	assert_true(snprintf(path, size, "%s/%s", dir, file) < size);
+}
+
+void
+test_dir_remove(const char *dir)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(dir);
+	assert_non_null(d);
+
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		test_dir_path(path, sizeof(path), dir, de->d_name);
+		assert_int_equal(unlink(path), 0);
+	}
+
+	closedir(d);
+	assert_int_equal(rmdir(dir), 0);
+}
+
+int
+test_driver_open(td_driver_t *driver, struct tap_disk *ops,
+		 const char *name, td_flag_t flags)
+{
+	driver->ops  = ops;
+	driver->data = calloc(1, ops->private_data_size);
+	assert_non_null(driver->data);
+	test_io_attach(driver);
+
+	return ops->td_open(driver, name, NULL, flags);
+}
+
+void
+test_driver_close(td_driver_t *driver)
+{
+	if (!driver->data)
+		return;
+
+	driver->ops->td_close(driver);
+	free(driver->data);
+	driver->data = NULL;
+}
+
+static void
+test_request_done(td_request_t treq, int err)
+{
+	struct test_req *req = treq.cb_data;
+
+	req->ndone++;
+	req->err    = req->err ? : err;
+	req->status = treq.status;
+}
+
+td_request_t
+test_request(struct test_req *req, int op, char *buf,
+	     td_sector_t sec, int secs)
+{
+	td_request_t treq;
+
+	bzero(&treq, sizeof(treq));
+	treq.op      = op;
+	treq.sec     = sec;
+	treq.secs    = secs;
+	treq.buf     = buf;
+	treq.cb      = test_request_done;
+	treq.cb_data = req;
+
+	bzero(req, sizeof(*req));
+
+	return treq;
+}
+
+void
+test_fill(char *buf, int secs, int seed)
+{
+	int i;
+
+	for (i = 0; i < secs; i++)
+		memset(buf + ((size_t)i << SECTOR_SHIFT), (seed + i) & 0xff,
+		       SECTOR_SIZE);
+}
+
+void
+test_check(const char *buf, int secs, int seed)
+{
+	int i;
+
+	for (i = 0; i < secs; i++) {
+		assert_int_equal((unsigned char)buf[(size_t)i << SECTOR_SHIFT],
+				 (seed + i) & 0xff);
+		assert_int_equal((unsigned char)
+				 buf[(((size_t)i + 1) << SECTOR_SHIFT) - 1],
+				 (seed + i) & 0xff);
+	}
+}
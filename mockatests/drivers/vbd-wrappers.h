@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __VBD_WRAPPERS_H__
+#define __VBD_WRAPPERS_H__
+
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-vbd.h"
+#include "scheduler.h"
+
+/*
+ * The last event registered with tapdisk_server_register_event(), for
+ * the test to fire.
+ */
+extern event_cb_t registered_cb;
+extern void *registered_data;
+
+/*
+ * If set, what tapdisk_image_open() returns instead of opening an
+ * image. tapdisk_image_close() leaves it alone.
+ */
+extern td_image_t *mock_image;
+
+/*
+ * If set, what tapdisk_storage_type() returns for any path.
+ */
+extern int mock_storage_type;
+
+/*
+ * Writes queued to an image through td_queue_write() are held here,
+ * in order, for the test to complete.
+ */
+#define MAX_QUEUED_WRITES 16
+
+extern td_request_t queued_writes[MAX_QUEUED_WRITES];
+extern int n_queued_writes;
+
+td_request_t pop_queued_write(void);
+
+/*
+ * Requests passed on with td_forward_request(), likewise.
+ */
+#define MAX_FORWARDED 16
+
+extern td_request_t forwarded[MAX_FORWARDED];
+extern int n_forwarded;
+
+td_request_t pop_forwarded(void);
+
+/*
+ * File I/O for drivers under test: test_io_attach() has the driver
+ * queue its tiocbs here, test_io_run() carries out everything queued,
+ * in order, until nothing is left, and returns how many it completed.
+ * test_io_step() carries out just the oldest one, and returns how many
+ * it completed. test_io_queued() looks at the @i-th still queued, and
+ * returns 0 if there is none.
+ * test_io_fail_write() lets @skip more writes through, and fails the
+ * one after with @err.
+ */
+void test_io_attach(td_driver_t *driver);
+int test_io_run(void);
+int test_io_step(void);
+int test_io_queued(int i, int *rw, long long *offset, size_t *size);
+void test_io_fail_write(int skip, int err);
+
+/*
+ * Fixtures for the driver tests' setup and teardown.
+ *
+ * test_vbd_init() sets up a bare VBD, without images, for filters and
+ * copiers to queue requests on.
+ *
+ * test_dir_create() makes a scratch directory /tmp/@name-XXXXXX for
+ * image files, test_dir_path() names a file in it, and
+ * test_dir_remove() removes it with everything left in it.
+ *
+ * test_driver_open() opens @driver with @ops on @name, its file I/O
+ * going through test_io, and test_driver_close() closes it again.
+ */
+void test_vbd_init(td_vbd_t *vbd);
+
+#define TEST_DIR_LEN 64
+
+void test_dir_create(char *dir, const char *name);
+void test_dir_path(char *path, size_t size, const char *dir, const char *file);
+void test_dir_remove(const char *dir);
+
+int test_driver_open(td_driver_t *driver, struct tap_disk *ops,
+		     const char *name, td_flag_t flags);
+void test_driver_close(td_driver_t *driver);
+
+/*
+ * A request against @buf, which counts its completions and keeps the
+ * first error and the last status in @req.
+ */
+struct test_req {
+	int			ndone;
+	int			err;
+	int			status;
+};
+
+td_request_t test_request(struct test_req *req, int op, char *buf,
+			  td_sector_t sec, int secs);
+
+/*
+ * Test data: each sector filled with one byte, @seed plus its place in
+ * the buffer.
+ */
+void test_fill(char *buf, int secs, int seed);
+void test_check(const char *buf, int secs, int seed);
+
+#endif /* __VBD_WRAPPERS_H__ */
@@ -0,0 +1,428 @@
+/*
+ * Copyright (c) 2020, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test-suites.h"
+
+/*
+ * PV images laid out as pvcreate does: the label in sector 1, one
+ * metadata area from 4KiB to 1MiB, data from 1MiB.
+ */
+#define PV_MDA_START    4096ULL
+#define PV_MDA_SIZE     (1048576ULL - PV_MDA_START)
+#define PV_SIZE         (8ULL << 20)
+
+#define UUID_A          "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+#define UUID_B          "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
+
+static char tmpdir[] = "/tmp/test-lvm-XXXXXX";
+static char dev_a[64], dev_b[64];
+
+static const char *vg_text =
+	"VG_XenStorage-1 {\n"
+	"id = \"Vvm4Xk-0000-0000-0000-0000-0000-000000\"\n"
+	"seqno = %d\n"
+	"format = \"lvm2\" # informational\n"
+	"status = [\"RESIZEABLE\", \"READ\", \"WRITE\"]\n"
+	"flags = []\n"
+	"extent_size = 8192\n"
+	"max_lv = 0\n"
+	"max_pv = 0\n"
+	"metadata_copies = 0\n"
+	"\n"
+	"physical_volumes {\n"
+	"\n"
+	"pv0 {\n"
+	"id = \"aaaaaa-aaaa-aaaa-aaaa-aaaa-aaaa-aaaaaa\"\n"
+	"device = \"/dev/sdz\"\n"
+	"status = [\"ALLOCATABLE\"]\n"
+	"flags = []\n"
+	"dev_size = 16384\n"
+	"pe_start = 2048\n"
+	"pe_count = 1\n"
+	"}\n"
+	"\n"
+	"pv1 {\n"
+	"id = \"bbbbbb-bbbb-bbbb-bbbb-bbbb-bbbb-bbbbbb\"\n"
+	"device = \"/dev/sdy\"\n"
+	"status = [\"ALLOCATABLE\"]\n"
+	"flags = []\n"
+	"dev_size = 16384\n"
+	"pe_start = 2048\n"
+	"pe_count = 1\n"
+	"}\n"
+	"}\n"
+	"\n"
+	"logical_volumes {\n"
+	"\n"
+	"VHD-2 {\n"
+	"id = \"Lv2000-0000-0000-0000-0000-0000-000000\"\n"
+	"status = [\"READ\", \"WRITE\", \"VISIBLE\"]\n"
+	"flags = []\n"
+	"tags = [\"a.b-c\"]\n"
+	"creation_time = 1600000000\n"
+	"segment_count = 2\n"
+	"\n"
+	"segment1 {\n"
+	"start_extent = 0\n"
+	"extent_count = 1\n"
+	"type = \"striped\"\n"
+	"stripe_count = 1\n"
+	"\n"
+	"stripes = [\n"
+	"\"pv1\", 0\n"
+	"]\n"
+	"}\n"
+	"segment2 {\n"
+	"start_extent = 1\n"
+	"extent_count = 2\n"
+	"type = \"striped\"\n"
+	"stripe_count = 1\n"
+	"\n"
+	"stripes = [\n"
+	"\"pv0\", 3\n"
+	"]\n"
+	"}\n"
+	"}\n"
+	"\n"
+	"MGT {\n"
+	"id = \"Lv1000-0000-0000-0000-0000-0000-000000\"\n"
+	"status = [\"READ\", \"WRITE\", \"VISIBLE\"]\n"
+	"flags = []\n"
+	"segment_count = 1\n"
+	"\n"
+	"segment1 {\n"
+	"start_extent = 0\n"
+	"extent_count = 1\n"
+	"type = \"striped\"\n"
+	"stripe_count = 1\n"
+	"\n"
+	"stripes = [\n"
+	"\"pv0\", 2\n"
+	"]\n"
+	"}\n"
+	"}\n"
+	"\n"
+	"hidden {\n"
+	"id = \"Lv3000-0000-0000-0000-0000-0000-000000\"\n"
+	"status = [\"READ\", \"WRITE\"]\n"
+	"flags = []\n"
+	"segment_count = 1\n"
+	"\n"
+	"segment1 {\n"
+	"start_extent = 0\n"
+	"extent_count = 1\n"
+	"type = \"striped\"\n"
+	"stripe_count = 1\n"
+	"\n"
+	"stripes = [\n"
+	"\"pv0\", 5\n"
+	"]\n"
+	"}\n"
+	"}\n"
+	"}\n"
+	"}\n"
+	"# Generated by LVM2 version 2.02.180(2)-RHEL7 (2018-07-20)\n"
+	"\n"
+	"contents = \"Text Format Volume Group\"\n"
+	"version = 1\n"
+	"\n"
+	"description = \"\"\n"
+	"\n"
+	"creation_host = \"host\\\"1\\\"\"\n"
+	"creation_time = 1600000000\n";
+
+static void
+put_le32(char *p, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static void
+put_le64(char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+#define CORRUPT_CHECKSUM  1
+#define CORRUPT_TEXT      2
+
+/*
+ * Writes a PV holding VG metadata of sequence number @seqno, placed
+ * @text_offset bytes into the metadata area.
+ */
+static void
+write_pv(const char *path, const char *uuid, int seqno,
+	 uint64_t text_offset, int corrupt)
+{
+	char *img, *label, *mda, *text;
+	uint64_t len, first;
+	uint32_t crc;
+	int fd;
+
+	img = calloc(1, PV_SIZE);
+	assert_non_null(img);
+
+	assert_true(asprintf(&text, vg_text, seqno) > 0);
+	len = strlen(text) + 1;
+
+	label = img + 512;
+	memcpy(label, "LABELONE", 8);
+	put_le64(label + 8, 1);
+	put_le32(label + 20, 32);
+	memcpy(label + 24, "LVM2 001", 8);
+	memcpy(label + 32, uuid, 32);
+	put_le64(label + 64, PV_SIZE);
+	put_le64(label + 72, 1048576);          /* data area */
+	put_le64(label + 104, PV_MDA_START);    /* metadata area */
+	put_le64(label + 112, PV_MDA_SIZE);
+	put_le32(label + 16, lvm_calc_crc(0xf597a6cf, label + 20, 512 - 20));
+
+	mda = img + PV_MDA_START;
+	memcpy(mda + 4, " LVM2 x[5A%r0N*>", 16);
+	put_le32(mda + 20, 1);
+	put_le64(mda + 24, PV_MDA_START);
+	put_le64(mda + 32, PV_MDA_SIZE);
+	put_le64(mda + 40, text_offset);
+	put_le64(mda + 48, len);
+
+	first = PV_MDA_SIZE - text_offset;
+	if (first > len)
+		first = len;
+	memcpy(mda + text_offset, text, first);
+	memcpy(mda + 512, text + first, len - first);
+
+	crc = lvm_calc_crc(0xf597a6cf, text, len);
+	put_le32(mda + 56, corrupt == CORRUPT_CHECKSUM ? ~crc : crc);
+
+	/* past the VG name and seqno, the text no longer parses */
+	if (corrupt == CORRUPT_TEXT)
+		memset(mda + text_offset + 100, '{', 16);
+	put_le32(mda, lvm_calc_crc(0xf597a6cf, mda + 4, 512 - 4));
+
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	assert_true(fd >= 0);
+	assert_int_equal(PV_SIZE, write(fd, img, PV_SIZE));
+	close(fd);
+
+	free(text);
+	free(img);
+}
+
+int
+lvm_test_setup(void **state)
+{
+	strcpy(tmpdir, "/tmp/test-lvm-XXXXXX");
+	if (!mkdtemp(tmpdir))
+		return -1;
+
+	snprintf(dev_a, sizeof(dev_a), "%s/a", tmpdir);
+	snprintf(dev_b, sizeof(dev_b), "%s/b", tmpdir);
+	lvm_cache_dir = tmpdir;
+
+	return 0;
+}
+
+int
+lvm_test_teardown(void **state)
+{
+	char *cache;
+
+	unlink(dev_a);
+	unlink(dev_b);
+	if (asprintf(&cache, "%s/VG_XenStorage-1", tmpdir) > 0) {
+		unlink(cache);
+		free(cache);
+	}
+
+	return rmdir(tmpdir);
+}
+
+static void
+check_vg(struct vg *vg)
+{
+	assert_string_equal("VG_XenStorage-1", vg->name);
+	assert_int_equal(4 << 20, vg->extent_size);
+
+	assert_int_equal(2, vg->pv_cnt);
+	assert_string_equal(dev_a, vg->pvs[0].name);
+	assert_int_equal(1 << 20, vg->pvs[0].start);
+	assert_string_equal(dev_b, vg->pvs[1].name);
+
+	/* visible LVs only, by name */
+	assert_int_equal(2, vg->lv_cnt);
+
+	assert_string_equal("MGT", vg->lvs[0].name);
+	assert_int_equal(4 << 20, vg->lvs[0].size);
+	assert_int_equal(1, vg->lvs[0].segments);
+	assert_int_equal(LVM_SEG_TYPE_LINEAR, vg->lvs[0].first_segment.type);
+	assert_string_equal(dev_a, vg->lvs[0].first_segment.device);
+	assert_int_equal((2 * 4 + 1) << 20, vg->lvs[0].first_segment.pe_start);
+	assert_int_equal(4 << 20, vg->lvs[0].first_segment.pe_size);
+
+	assert_string_equal("VHD-2", vg->lvs[1].name);
+	assert_int_equal(12 << 20, vg->lvs[1].size);
+	assert_int_equal(2, vg->lvs[1].segments);
+	assert_string_equal(dev_b, vg->lvs[1].first_segment.device);
+	assert_int_equal(1 << 20, vg->lvs[1].first_segment.pe_start);
+	assert_int_equal(4 << 20, vg->lvs[1].first_segment.pe_size);
+}
+
+void
+test_lvm_scan_single_pv(void **state)
+{
+	char *devices[] = { dev_a, dev_b };
+	struct vg vg;
+
+	write_pv(dev_a, UUID_A, 7, 512, 0);
+	write_pv(dev_b, UUID_B, 7, 512, 0);
+
+	assert_int_equal(0, lvm_scan_vg_devices("VG_XenStorage-1",
+						devices, 2, &vg));
+	check_vg(&vg);
+	lvm_free_vg(&vg);
+}
+
+void
+test_lvm_scan_newest_copy(void **state)
+{
+	char *devices[] = { dev_a, dev_b };
+	struct vg vg;
+
+	/* the stale copy is corrupt, so reading it would fail */
+	write_pv(dev_a, UUID_A, 6, 512, CORRUPT_CHECKSUM);
+	write_pv(dev_b, UUID_B, 8, 512, 0);
+
+	assert_int_equal(0, lvm_scan_vg_devices("VG_XenStorage-1",
+						devices, 2, &vg));
+	check_vg(&vg);
+	lvm_free_vg(&vg);
+}
+
+void
+test_lvm_scan_wrapped_text(void **state)
+{
+	char *devices[] = { dev_a, dev_b };
+	struct vg vg;
+
+	write_pv(dev_a, UUID_A, 9, PV_MDA_SIZE - 1000, 0);
+	write_pv(dev_b, UUID_B, 9, PV_MDA_SIZE - 5000, 0);
+
+	assert_int_equal(0, lvm_scan_vg_devices("VG_XenStorage-1",
+						devices, 2, &vg));
+	check_vg(&vg);
+	lvm_free_vg(&vg);
+}
+
+void
+test_lvm_scan_bad_checksum(void **state)
+{
+	char *devices[] = { dev_a };
+	struct vg vg;
+
+	write_pv(dev_a, UUID_A, 7, 512, CORRUPT_CHECKSUM);
+
+	assert_int_equal(-EINVAL, lvm_scan_vg_devices("VG_XenStorage-1",
+						      devices, 1, &vg));
+}
+
+void
+test_lvm_scan_no_vg(void **state)
+{
+	char *devices[] = { dev_a, dev_b };
+	struct vg vg;
+
+	write_pv(dev_a, UUID_A, 7, 512, 0);
+	write_pv(dev_b, UUID_B, 7, 512, 0);
+
+	assert_int_equal(-ENOENT, lvm_scan_vg_devices("VG_XenStorage-2",
+						      devices, 2, &vg));
+}
+
+void
+test_lvm_scan_missing_pv(void **state)
+{
+	char *devices[] = { dev_a };
+	struct vg vg;
+
+	write_pv(dev_a, UUID_A, 7, 512, 0);
+
+	assert_int_equal(-ENODEV, lvm_scan_vg_devices("VG_XenStorage-1",
+						      devices, 1, &vg));
+}
+
+void
+test_lvm_scan_cache(void **state)
+{
+	char *devices[] = { dev_a, dev_b };
+	struct vg vg;
+
+	write_pv(dev_a, UUID_A, 7, 512, 0);
+	write_pv(dev_b, UUID_B, 7, 512, 0);
+
+	assert_int_equal(0, lvm_scan_vg_devices("VG_XenStorage-1",
+						devices, 2, &vg));
+	lvm_free_vg(&vg);
+
+	/*
+	 * Same seqno and checksum, but unparseable text: only the cache
+	 * can satisfy this.
+	 */
+	write_pv(dev_a, UUID_A, 7, 512, CORRUPT_TEXT);
+	write_pv(dev_b, UUID_B, 7, 512, CORRUPT_TEXT);
+
+	assert_int_equal(0, lvm_scan_vg_devices("VG_XenStorage-1",
+						devices, 2, &vg));
+	check_vg(&vg);
+	lvm_free_vg(&vg);
+
+	/* a new seqno has the text read again */
+	write_pv(dev_a, UUID_A, 10, 512, CORRUPT_CHECKSUM);
+	write_pv(dev_b, UUID_B, 10, 512, CORRUPT_CHECKSUM);
+
+	assert_int_equal(-EINVAL, lvm_scan_vg_devices("VG_XenStorage-1",
+						      devices, 2, &vg));
+}
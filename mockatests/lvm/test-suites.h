@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2020, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TEST_SUITES_H__
+#define __TEST_SUITES_H__
+
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdint.h>
+
+#include "lvm-util.h"
+#include "lvm-util-priv.h"
+
+int lvm_test_setup(void **state);
+int lvm_test_teardown(void **state);
+
+void test_lvm_scan_single_pv(void **state);
+void test_lvm_scan_newest_copy(void **state);
+void test_lvm_scan_wrapped_text(void **state);
+void test_lvm_scan_bad_checksum(void **state);
+void test_lvm_scan_no_vg(void **state);
+void test_lvm_scan_missing_pv(void **state);
+void test_lvm_scan_cache(void **state);
+
+static const struct CMUnitTest lvm_metadata_tests[] = {
+	cmocka_unit_test_setup_teardown(test_lvm_scan_single_pv, lvm_test_setup, lvm_test_teardown),
+	cmocka_unit_test_setup_teardown(test_lvm_scan_newest_copy, lvm_test_setup, lvm_test_teardown),
+	cmocka_unit_test_setup_teardown(test_lvm_scan_wrapped_text, lvm_test_setup, lvm_test_teardown),
+	cmocka_unit_test_setup_teardown(test_lvm_scan_bad_checksum, lvm_test_setup, lvm_test_teardown),
+	cmocka_unit_test_setup_teardown(test_lvm_scan_no_vg, lvm_test_setup, lvm_test_teardown),
+	cmocka_unit_test_setup_teardown(test_lvm_scan_missing_pv, lvm_test_setup, lvm_test_teardown),
+	cmocka_unit_test_setup_teardown(test_lvm_scan_cache, lvm_test_setup, lvm_test_teardown)
+};
+
+#endif /* __TEST_SUITES_H__ */
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tap-ctl.h"
+#include "blktap2.h"
+#include "tapback-wrappers.h"
+
+#define MAX_TAPDISKS	8
+#define MAX_MINORS	4
+
+struct mock_tapdisk {
+	pid_t	pid;
+	int	minors[MAX_MINORS];
+	int	n_minors;
+};
+
+static struct mock_tapdisk tapdisks[MAX_TAPDISKS];
+static int n_tapdisks;
+
+char mock_control_dir[64];
+int mock_watch_err;
+
+pid_t queried[MAX_QUERIED];
+int n_queried;
+
+static struct mock_tapdisk *
+mock_tapdisk_find(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < n_tapdisks; i++)
+		if (tapdisks[i].pid == pid)
+			return &tapdisks[i];
+
+	return NULL;
+}
+
+void
+mock_tapdisk_start(pid_t pid)
+{
+	assert_null(mock_tapdisk_find(pid));
+	assert_true(n_tapdisks < MAX_TAPDISKS);
+
+	memset(&tapdisks[n_tapdisks], 0, sizeof(tapdisks[n_tapdisks]));
+	tapdisks[n_tapdisks++].pid = pid;
+}
+
+void
+mock_tapdisk_exit(pid_t pid)
+{
+	struct mock_tapdisk *td = mock_tapdisk_find(pid);
+
+	assert_non_null(td);
+	*td = tapdisks[--n_tapdisks];
+}
+
+void
+mock_tapdisk_serve(pid_t pid, int minor)
+{
+	struct mock_tapdisk *td = mock_tapdisk_find(pid);
+
+	assert_non_null(td);
+	assert_true(td->n_minors < MAX_MINORS);
+	td->minors[td->n_minors++] = minor;
+}
+
+void
+mock_tapdisk_unserve(pid_t pid, int minor)
+{
+	struct mock_tapdisk *td = mock_tapdisk_find(pid);
+	int i;
+
+	assert_non_null(td);
+	for (i = 0; i < td->n_minors; i++)
+		if (td->minors[i] == minor) {
+			td->minors[i] = td->minors[--td->n_minors];
+			return;
+		}
+
+	fail_msg("tapdisk[%d] does not serve minor %d", pid, minor);
+}
+
+void
+mock_tapdisks_reset(void)
+{
+	n_tapdisks     = 0;
+	n_queried      = 0;
+	mock_watch_err = 0;
+}
+
+static int
+mock_list_add(struct list_head *list, pid_t pid, int minor)
+{
+	tap_list_t *tl;
+
+	tl = calloc(1, sizeof(*tl));
+	if (!tl)
+		return -ENOMEM;
+
+	tl->pid   = pid;
+	tl->minor = minor;
+	tl->state = 0;
+	list_add_tail(&tl->entry, list);
+
+	return 0;
+}
+
+/*
+ * Like the real thing, a running tapdisk serving no minor is listed with
+ * minor -1.
+ */
+int
+__wrap_tap_ctl_list_pid(pid_t pid, struct list_head *list)
+{
+	struct mock_tapdisk *td;
+	int i, err;
+
+	assert_true(n_queried < MAX_QUERIED);
+	queried[n_queried++] = pid;
+
+	td = mock_tapdisk_find(pid);
+	if (!td)
+		return 0;
+
+	if (!td->n_minors)
+		return mock_list_add(list, pid, -1);
+
+	for (i = 0; i < td->n_minors; i++) {
+		err = mock_list_add(list, pid, td->minors[i]);
+		if (err) {
+			tap_ctl_list_free(list);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+DIR *__real_opendir(const char *name);
+
+DIR *
+__wrap_opendir(const char *name)
+{
+	if (!strcmp(name, BLKTAP2_CONTROL_DIR))
+		name = mock_control_dir;
+
+	return __real_opendir(name);
+}
+
+int __real_inotify_add_watch(int fd, const char *name, uint32_t mask);
+
+int
+__wrap_inotify_add_watch(int fd, const char *name, uint32_t mask)
+{
+	if (mock_watch_err) {
+		errno = mock_watch_err;
+		return -1;
+	}
+
+	if (!strcmp(name, BLKTAP2_CONTROL_DIR))
+		name = mock_control_dir;
+
+	return __real_inotify_add_watch(fd, name, mask);
+}
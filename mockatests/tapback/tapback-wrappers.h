@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TAPBACK_WRAPPERS_H__
+#define __TAPBACK_WRAPPERS_H__
+
+#include <sys/types.h>
+
+/*
+ * Stands in for BLKTAP2_CONTROL_DIR when opened or watched.
+ */
+extern char mock_control_dir[];
+
+/*
+ * Set to an errno value to have inotify_add_watch() fail with it.
+ */
+extern int mock_watch_err;
+
+/*
+ * The tapdisks tap_ctl_list_pid() knows of and the minors they serve.
+ * A tapdisk not running is listed as serving nothing at all.
+ */
+void mock_tapdisk_start(pid_t pid);
+void mock_tapdisk_exit(pid_t pid);
+void mock_tapdisk_serve(pid_t pid, int minor);
+void mock_tapdisk_unserve(pid_t pid, int minor);
+void mock_tapdisks_reset(void);
+
+/*
+ * The tapdisks asked by tap_ctl_list_pid(), in order.
+ */
+#define MAX_QUERIED 16
+
+extern pid_t queried[MAX_QUERIED];
+extern int n_queried;
+
+#endif /* __TAPBACK_WRAPPERS_H__ */
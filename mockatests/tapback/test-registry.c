@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "tapback.h"
+#include "blktap2.h"
+#include "test-suites.h"
+#include "tapback-wrappers.h"
+
+static void
+control_file(const char *fmt, pid_t pid, int minor, int create)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/", mock_control_dir);
+	snprintf(path + strlen(path), sizeof(path) - strlen(path), fmt,
+			pid, minor);
+
+	if (create) {
+		fd = open(path, O_CREAT | O_WRONLY, 0600);
+		assert_true(fd >= 0);
+		close(fd);
+	} else
+		assert_int_equal(unlink(path), 0);
+}
+
+/*
+ * A tapdisk starting creates its control socket.
+ */
+static void
+tapdisk_start(pid_t pid)
+{
+	mock_tapdisk_start(pid);
+	control_file(BLKTAP2_CONTROL_SOCKET"%d", pid, 0, 1);
+}
+
+static void
+tapdisk_exit(pid_t pid)
+{
+	mock_tapdisk_exit(pid);
+	control_file(BLKTAP2_CONTROL_SOCKET"%d", pid, 0, 0);
+}
+
+/*
+ * And an NBD server socket for each VBD it opens.
+ */
+static void
+tapdisk_open(pid_t pid, int minor)
+{
+	mock_tapdisk_serve(pid, minor);
+	control_file("nbdserver-new%d.%d", pid, minor, 1);
+}
+
+static int
+find(struct tapdisk_registry *reg, int minor, pid_t pid, pid_t *found)
+{
+	tap_list_t tap;
+	int err;
+
+	n_queried = 0;
+
+	err = tapback_registry_find(reg, minor, pid, &tap);
+	if (!err) {
+		assert_int_equal(tap.minor, minor);
+		*found = tap.pid;
+	}
+
+	return err;
+}
+
+int
+registry_test_setup(void **state)
+{
+	struct tapdisk_registry *reg;
+
+	mock_tapdisks_reset();
+
+	strcpy(mock_control_dir, "/tmp/test-tapback-XXXXXX");
+	assert_non_null(mkdtemp(mock_control_dir));
+
+	reg = calloc(1, sizeof(*reg));
+	assert_non_null(reg);
+	assert_int_equal(tapback_registry_init(reg), 0);
+
+	*state = reg;
+	return 0;
+}
+
+int
+registry_test_teardown(void **state)
+{
+	struct tapdisk_registry *reg = *state;
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+
+	tapback_registry_destroy(reg);
+	free(reg);
+
+	dir = opendir(mock_control_dir);
+	assert_non_null(dir);
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", mock_control_dir,
+				de->d_name);
+		unlink(path);
+	}
+	closedir(dir);
+
+	return rmdir(mock_control_dir);
+}
+
+void
+test_registry_finds_served_minor(void **state)
+{
+	struct tapdisk_registry *reg = *state;
+	pid_t pid;
+
+	tapdisk_start(100);
+	tapdisk_start(200);
+	mock_tapdisk_serve(200, 3);
+
+	assert_int_equal(find(reg, 3, -1, &pid), 0);
+	assert_int_equal(pid, 200);
+	assert_in_range(n_queried, 1, 2);
+	assert_int_equal(queried[n_queried - 1], 200);
+
+	/* it is asked first from now on, and only it */
+	assert_int_equal(find(reg, 3, -1, &pid), 0);
+	assert_int_equal(pid, 200);
+	assert_int_equal(n_queried, 1);
+
+	/* nobody serving a minor takes asking everyone once */
+	assert_int_equal(find(reg, 5, -1, &pid), -ESRCH);
+	assert_int_equal(n_queried, 2);
+}
+
+void
+test_registry_follows_nbd_hints(void **state)
+{
+	struct tapdisk_registry *reg = *state;
+	pid_t pid;
+	int i;
+
+	for (i = 100; i < 105; i++)
+		tapdisk_start(i);
+
+	tapdisk_open(103, 7);
+
+	assert_int_equal(find(reg, 7, -1, &pid), 0);
+	assert_int_equal(pid, 103);
+	assert_int_equal(n_queried, 1);
+	assert_int_equal(queried[0], 103);
+}
+
+void
+test_registry_drops_exited_tapdisks(void **state)
+{
+	struct tapdisk_registry *reg = *state;
+	pid_t pid;
+
+	tapdisk_start(100);
+	tapdisk_start(101);
+	tapdisk_open(101, 4);
+
+	assert_int_equal(find(reg, 4, -1, &pid), 0);
+	assert_int_equal(pid, 101);
+
+	tapdisk_exit(101);
+
+	assert_int_equal(find(reg, 4, -1, &pid), -ESRCH);
+	assert_int_equal(n_queried, 1);
+	assert_int_equal(queried[0], 100);
+
+	/* a tapdisk found gone when asked is forgotten as well */
+	mock_tapdisk_exit(100);
+
+	assert_int_equal(find(reg, 4, -1, &pid), -ESRCH);
+	assert_int_equal(n_queried, 1);
+
+	assert_int_equal(find(reg, 4, -1, &pid), -ESRCH);
+	assert_int_equal(n_queried, 0);
+}
+
+void
+test_registry_confirms_reused_minors(void **state)
+{
+	struct tapdisk_registry *reg = *state;
+	pid_t pid;
+
+	tapdisk_start(100);
+	tapdisk_start(101);
+	tapdisk_open(100, 7);
+
+	assert_int_equal(find(reg, 7, -1, &pid), 0);
+	assert_int_equal(pid, 100);
+
+	/*
+	 * The minor is freed and handed to another tapdisk, unannounced: the
+	 * stale entry is asked about and dropped.
+	 */
+	mock_tapdisk_unserve(100, 7);
+	mock_tapdisk_serve(101, 7);
+
+	assert_int_equal(find(reg, 7, -1, &pid), 0);
+	assert_int_equal(pid, 101);
+	assert_int_equal(n_queried, 2);
+	assert_int_equal(queried[0], 100);
+	assert_int_equal(queried[1], 101);
+
+	assert_int_equal(find(reg, 7, -1, &pid), 0);
+	assert_int_equal(pid, 101);
+	assert_int_equal(n_queried, 1);
+
+	/* and back, announced this time: the newest hint goes first */
+	mock_tapdisk_unserve(101, 7);
+	control_file("nbdserver-new%d.%d", 100, 7, 0);
+	tapdisk_open(100, 7);
+
+	assert_int_equal(find(reg, 7, -1, &pid), 0);
+	assert_int_equal(pid, 100);
+	assert_int_equal(n_queried, 1);
+}
+
+void
+test_registry_queries_given_pid(void **state)
+{
+	struct tapdisk_registry *reg = *state;
+	pid_t pid;
+
+	tapdisk_start(100);
+	tapdisk_start(101);
+	tapdisk_open(101, 2);
+
+	assert_int_equal(find(reg, 2, 100, &pid), -ESRCH);
+	assert_int_equal(n_queried, 1);
+	assert_int_equal(queried[0], 100);
+
+	assert_int_equal(find(reg, 2, 101, &pid), 0);
+	assert_int_equal(pid, 101);
+	assert_int_equal(n_queried, 1);
+	assert_int_equal(queried[0], 101);
+
+	/* one the registry never heard of is asked all the same */
+	mock_tapdisk_start(102);
+	mock_tapdisk_serve(102, 9);
+
+	assert_int_equal(find(reg, 9, 102, &pid), 0);
+	assert_int_equal(pid, 102);
+	assert_int_equal(n_queried, 1);
+}
+
+void
+test_registry_without_watch(void **state)
+{
+	struct tapdisk_registry *reg = *state;
+	pid_t pid;
+
+	/* no events: the control directory is read on every look-up */
+	tapback_registry_destroy(reg);
+	mock_watch_err = ENOSPC;
+	assert_int_equal(tapback_registry_init(reg), 0);
+	assert_true(reg->wd < 0);
+
+	tapdisk_start(100);
+	mock_tapdisk_serve(100, 1);
+
+	assert_int_equal(find(reg, 1, -1, &pid), 0);
+	assert_int_equal(pid, 100);
+
+	tapdisk_exit(100);
+
+	assert_int_equal(find(reg, 1, -1, &pid), -ESRCH);
+	assert_int_equal(n_queried, 0);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TEST_SUITES_H__
+#define __TEST_SUITES_H__
+
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdint.h>
+
+int registry_test_setup(void **state);
+int registry_test_teardown(void **state);
+
+void test_registry_finds_served_minor(void **state);
+void test_registry_follows_nbd_hints(void **state);
+void test_registry_drops_exited_tapdisks(void **state);
+void test_registry_confirms_reused_minors(void **state);
+void test_registry_queries_given_pid(void **state);
+void test_registry_without_watch(void **state);
+
+static const struct CMUnitTest registry_tests[] = {
+	cmocka_unit_test_setup_teardown(test_registry_finds_served_minor, registry_test_setup, registry_test_teardown),
+	cmocka_unit_test_setup_teardown(test_registry_follows_nbd_hints, registry_test_setup, registry_test_teardown),
+	cmocka_unit_test_setup_teardown(test_registry_drops_exited_tapdisks, registry_test_setup, registry_test_teardown),
+	cmocka_unit_test_setup_teardown(test_registry_confirms_reused_minors, registry_test_setup, registry_test_teardown),
+	cmocka_unit_test_setup_teardown(test_registry_queries_given_pid, registry_test_setup, registry_test_teardown),
+	cmocka_unit_test_setup_teardown(test_registry_without_watch, registry_test_setup, registry_test_teardown)
+};
+
+#endif /* __TEST_SUITES_H__ */
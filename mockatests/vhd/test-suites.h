@@ -44,6 +44,8 @@ void test_vhd_util_snapshot_einval_from_vhd_open(void **state);
 void test_vhd_util_snapshot_einval_from_vhd_get_keyhash(void **state);
 void test_vhd_util_snapshot_einval_from_vhd_open_cookie(void **state);
 void test_vhd_util_snapshot_einval_from_vhd_set_keyhash(void **state);
+void test_vhd_util_snapshot_fast(void **state);
+void test_vhd_util_snapshot_fast_enospc_from_depth_limit(void **state);
 
 /* Functions under test */
 extern int vhd_util_snapshot(int , char **);
@@ -58,7 +60,9 @@ static const struct CMUnitTest vhd_snapshot_tests[] = {
 	cmocka_unit_test(test_vhd_util_snapshot_einval_from_vhd_open),
 	cmocka_unit_test(test_vhd_util_snapshot_einval_from_vhd_get_keyhash),
 	cmocka_unit_test_setup(test_vhd_util_snapshot_einval_from_vhd_open_cookie, setup),
-	cmocka_unit_test_setup(test_vhd_util_snapshot_einval_from_vhd_set_keyhash, setup)
+	cmocka_unit_test_setup(test_vhd_util_snapshot_einval_from_vhd_set_keyhash, setup),
+	cmocka_unit_test_setup(test_vhd_util_snapshot_fast, setup),
+	cmocka_unit_test_setup(test_vhd_util_snapshot_fast_enospc_from_depth_limit, setup)
 };
 
 /* 'canonpath' tests */
@@ -94,4 +98,76 @@ static const struct CMUnitTest bitops_tests[] = {
 	cmocka_unit_test(test_bitmaps)
 };
 
+/* libvhd-aio tests */
+int aio_test_setup(void **state);
+int aio_test_teardown(void **state);
+
+void test_vhd_aio_queues_beyond_depth(void **state);
+void test_vhd_aio_scatter_gather(void **state);
+void test_vhd_aio_submit_rejects_bad_requests(void **state);
+void test_vhd_aio_callbacks_resubmit(void **state);
+void test_vhd_aio_short_read_fails(void **state);
+void test_vhd_aio_prep_block(void **state);
+void test_vhd_aio_sync_read_paths(void **state);
+
+static const struct CMUnitTest vhd_aio_tests[] = {
+	cmocka_unit_test_setup_teardown(test_vhd_aio_queues_beyond_depth, aio_test_setup, aio_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_aio_scatter_gather, aio_test_setup, aio_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_aio_submit_rejects_bad_requests, aio_test_setup, aio_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_aio_callbacks_resubmit, aio_test_setup, aio_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_aio_short_read_fails, aio_test_setup, aio_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_aio_prep_block, aio_test_setup, aio_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_aio_sync_read_paths, aio_test_setup, aio_test_teardown)
+};
+
+/* vhdx-util check tests */
+int vhdx_check_test_setup(void **state);
+int vhdx_check_test_teardown(void **state);
+
+void test_vhdx_check_new_image(void **state);
+void test_vhdx_check_overlapping_blocks(void **state);
+void test_vhdx_check_bad_entries(void **state);
+void test_vhdx_check_headers(void **state);
+
+static const struct CMUnitTest vhdx_check_tests[] = {
+	cmocka_unit_test_setup_teardown(test_vhdx_check_new_image, vhdx_check_test_setup, vhdx_check_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhdx_check_overlapping_blocks, vhdx_check_test_setup, vhdx_check_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhdx_check_bad_entries, vhdx_check_test_setup, vhdx_check_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhdx_check_headers, vhdx_check_test_setup, vhdx_check_test_teardown)
+};
+
+/* vhd-util copy tests */
+int copy_test_setup(void **state);
+int copy_test_teardown(void **state);
+
+void test_vhd_util_copy_layout(void **state);
+void test_vhd_util_copy_block_sparse(void **state);
+void test_vhd_util_copy_block_sparse_no_splice(void **state);
+void test_vhd_util_copy_block_full(void **state);
+void test_vhd_util_copy_pread_past_end(void **state);
+
+static const struct CMUnitTest vhd_util_copy_tests[] = {
+	cmocka_unit_test_setup_teardown(test_vhd_util_copy_layout, copy_test_setup, copy_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_util_copy_block_sparse, copy_test_setup, copy_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_util_copy_block_sparse_no_splice, copy_test_setup, copy_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_util_copy_block_full, copy_test_setup, copy_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_util_copy_pread_past_end, copy_test_setup, copy_test_teardown)
+};
+
+/* vhd-util read tests */
+int extmap_test_setup(void **state);
+int extmap_test_teardown(void **state);
+
+void test_vhd_util_read_extent_map_json(void **state);
+void test_vhd_util_read_extent_map_bin(void **state);
+void test_vhd_util_read_extent_map_chain(void **state);
+void test_vhd_util_read_extent_map_fixed(void **state);
+
+static const struct CMUnitTest vhd_util_read_tests[] = {
+	cmocka_unit_test_setup_teardown(test_vhd_util_read_extent_map_json, extmap_test_setup, extmap_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_util_read_extent_map_bin, extmap_test_setup, extmap_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_util_read_extent_map_chain, extmap_test_setup, extmap_test_teardown),
+	cmocka_unit_test_setup_teardown(test_vhd_util_read_extent_map_fixed, extmap_test_setup, extmap_test_teardown)
+};
+
 #endif /* __TEST_SUITES_H__ */
@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <wrappers.h>
+
+#include "test-suites.h"
+#include "libvhd.h"
+#include "libvhd-aio.h"
+
+#define SECTOR   512
+#define CHUNK    4096
+
+static int  n_done;
+static int  last_err;
+static int  n_chain;
+
+static void
+count_cb(vhd_aio_request_t *req, int err)
+{
+	n_done++;
+	if (err)
+		last_err = err;
+}
+
+static void
+chain_cb(vhd_aio_request_t *req, int err)
+{
+	vhd_aio_t *aio = req->data;
+
+	count_cb(req, err);
+
+	if (--n_chain > 0) {
+		req->offset += CHUNK;
+		assert_int_equal(vhd_aio_submit(aio, &req, 1), 0);
+	}
+}
+
+/*
+ * Each test gets an empty image file, already unlinked, and a context
+ * on it, and creates the AIO context it needs for teardown to destroy.
+ */
+struct aio_test {
+	vhd_context_t	ctx;
+	vhd_aio_t      *aio;
+};
+
+int aio_test_setup(void **state)
+{
+	char path[] = "/tmp/test-vhd-aio.XXXXXX";
+	struct aio_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+
+	t->ctx.fd = mkstemp(path);
+	assert_true(t->ctx.fd >= 0);
+	unlink(path);
+
+	n_done   = 0;
+	last_err = 0;
+
+	*state = t;
+	return 0;
+}
+
+int aio_test_teardown(void **state)
+{
+	struct aio_test *t = *state;
+
+	if (t->aio)
+		vhd_aio_destroy(t->aio);
+	close(t->ctx.fd);
+	free(t);
+
+	return 0;
+}
+
+static void
+fill(void *buf, size_t size, int seed)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		((unsigned char *)buf)[i] = (unsigned char)(seed + i * 7);
+}
+
+void test_vhd_aio_queues_beyond_depth(void **state)
+{
+	struct aio_test *t = *state;
+	vhd_context_t *ctx = &t->ctx;
+	vhd_aio_request_t reqs[8], *batch[8];
+	char bufs[8][CHUNK], check[CHUNK];
+	int i;
+
+	assert_int_equal(vhd_aio_create(&t->aio, 2), 0);
+
+	for (i = 0; i < 8; i++) {
+		fill(bufs[i], CHUNK, i);
+		vhd_aio_prep_buf(&reqs[i], ctx, VHD_AIO_WRITE,
+				 bufs[i], CHUNK, (off64_t)i * CHUNK);
+		reqs[i].cb = count_cb;
+		batch[i]   = &reqs[i];
+	}
+
+	/* only two fit in the kernel, the rest wait in the queue */
+	assert_int_equal(vhd_aio_submit(t->aio, batch, 8), 0);
+	assert_int_equal(vhd_aio_pending(t->aio), 8);
+
+	assert_int_equal(vhd_aio_drain(t->aio), 8);
+	assert_int_equal(vhd_aio_pending(t->aio), 0);
+	assert_int_equal(n_done, 8);
+	assert_int_equal(last_err, 0);
+
+	for (i = 0; i < 8; i++) {
+		assert_int_equal(pread(ctx->fd, check, CHUNK,
+				       (off64_t)i * CHUNK), CHUNK);
+		assert_memory_equal(check, bufs[i], CHUNK);
+	}
+}
+
+void test_vhd_aio_scatter_gather(void **state)
+{
+	struct aio_test *t = *state;
+	vhd_context_t *ctx = &t->ctx;
+	vhd_aio_request_t req, *batch = &req;
+	char data[CHUNK], back[CHUNK];
+	struct iovec wr[3], rd[6];
+	int i;
+
+	assert_int_equal(vhd_aio_create(&t->aio, 4), 0);
+
+	fill(data, CHUNK, 3);
+	wr[0].iov_base = data;        wr[0].iov_len = 512;
+	wr[1].iov_base = data + 512;  wr[1].iov_len = 1024;
+	wr[2].iov_base = data + 1536; wr[2].iov_len = CHUNK - 1536;
+
+	vhd_aio_prep(&req, ctx, VHD_AIO_WRITE, wr, 3, CHUNK);
+	assert_int_equal(req.size, CHUNK);
+	req.cb = count_cb;
+	assert_int_equal(vhd_aio_submit(t->aio, &batch, 1), 0);
+	assert_int_equal(vhd_aio_drain(t->aio), 1);
+	assert_int_equal(last_err, 0);
+
+	/* more segments than fit inline, split differently */
+	memset(back, 0, sizeof(back));
+	for (i = 0; i < 6; i++) {
+		rd[i].iov_base = back + i * 512;
+		rd[i].iov_len  = 512;
+	}
+	rd[5].iov_len = CHUNK - 5 * 512;
+
+	vhd_aio_prep(&req, ctx, VHD_AIO_READ, rd, 6, CHUNK);
+	assert_int_equal(vhd_aio_exec(&req), 0);
+	assert_memory_equal(back, data, CHUNK);
+
+	memset(back, 0, sizeof(back));
+	vhd_aio_prep(&req, ctx, VHD_AIO_READ, rd, 6, CHUNK);
+	req.cb = count_cb;
+	assert_int_equal(vhd_aio_submit(t->aio, &batch, 1), 0);
+	assert_int_equal(vhd_aio_drain(t->aio), 1);
+	assert_int_equal(last_err, 0);
+	assert_memory_equal(back, data, CHUNK);
+}
+
+void test_vhd_aio_submit_rejects_bad_requests(void **state)
+{
+	struct aio_test *t = *state;
+	vhd_context_t *ctx = &t->ctx;
+	vhd_aio_request_t reqs[2], *batch[2] = { &reqs[0], &reqs[1] };
+	char buf[CHUNK];
+
+	assert_int_equal(vhd_aio_create(&t->aio, 0), -EINVAL);
+	assert_null(t->aio);
+	assert_int_equal(vhd_aio_create(&t->aio, 2), 0);
+
+	vhd_aio_prep_buf(&reqs[0], ctx, VHD_AIO_WRITE, buf, CHUNK, 0);
+	vhd_aio_prep_buf(&reqs[1], ctx, VHD_AIO_WRITE, buf, CHUNK, CHUNK);
+	reqs[0].cb = count_cb;
+	reqs[1].cb = NULL;
+
+	/* a bad request fails the whole batch, nothing is queued */
+	assert_int_equal(vhd_aio_submit(t->aio, batch, 2), -EINVAL);
+	assert_int_equal(vhd_aio_pending(t->aio), 0);
+
+	reqs[1].cb = count_cb;
+	reqs[1].op = 7;
+	assert_int_equal(vhd_aio_submit(t->aio, batch, 2), -EINVAL);
+	assert_int_equal(vhd_aio_pending(t->aio), 0);
+
+	reqs[1].op     = VHD_AIO_WRITE;
+	reqs[1].iovcnt = 0;
+	assert_int_equal(vhd_aio_submit(t->aio, batch, 2), -EINVAL);
+	assert_int_equal(vhd_aio_pending(t->aio), 0);
+
+	assert_int_equal(vhd_aio_drain(t->aio), 0);
+	assert_int_equal(n_done, 0);
+}
+
+void test_vhd_aio_callbacks_resubmit(void **state)
+{
+	struct aio_test *t = *state;
+	vhd_context_t *ctx = &t->ctx;
+	vhd_aio_request_t req, *batch = &req;
+	char buf[CHUNK], check[CHUNK];
+	int i;
+
+	assert_int_equal(vhd_aio_create(&t->aio, 1), 0);
+
+	fill(buf, CHUNK, 9);
+	vhd_aio_prep_buf(&req, ctx, VHD_AIO_WRITE, buf, CHUNK, 0);
+	req.cb   = chain_cb;
+	req.data = t->aio;
+	n_chain  = 4;
+
+	assert_int_equal(vhd_aio_submit(t->aio, &batch, 1), 0);
+	assert_int_equal(vhd_aio_drain(t->aio), 4);
+	assert_int_equal(n_done, 4);
+	assert_int_equal(last_err, 0);
+
+	assert_int_equal(lseek(ctx->fd, 0, SEEK_END), 4 * CHUNK);
+	for (i = 0; i < 4; i++) {
+		assert_int_equal(pread(ctx->fd, check, CHUNK,
+				       (off64_t)i * CHUNK), CHUNK);
+		assert_memory_equal(check, buf, CHUNK);
+	}
+}
+
+void test_vhd_aio_short_read_fails(void **state)
+{
+	struct aio_test *t = *state;
+	vhd_context_t *ctx = &t->ctx;
+	vhd_aio_request_t req, *batch = &req;
+	char buf[2 * CHUNK];
+
+	assert_int_equal(vhd_aio_create(&t->aio, 2), 0);
+
+	fill(buf, CHUNK, 1);
+	assert_int_equal(pwrite(ctx->fd, buf, CHUNK, 0), CHUNK);
+
+	vhd_aio_prep_buf(&req, ctx, VHD_AIO_READ, buf, 2 * CHUNK, 0);
+	req.cb = count_cb;
+	assert_int_equal(vhd_aio_submit(t->aio, &batch, 1), 0);
+	assert_int_equal(vhd_aio_drain(t->aio), 1);
+	assert_int_equal(last_err, -EIO);
+
+	vhd_aio_prep_buf(&req, ctx, VHD_AIO_READ, buf, 2 * CHUNK, 0);
+	assert_int_equal(vhd_aio_exec(&req), -EIO);
+}
+
+/*
+ * A three block image with 4k blocks and one bitmap sector each: block
+ * 0 at sector 1, block 1 unallocated and block 2 at sector 10, cut
+ * short by the footer after three sectors of data.
+ */
+static uint32_t test_bat[3] = { 1, DD_BLK_UNUSED, 10 };
+
+static void
+dynamic_image(vhd_context_t *ctx)
+{
+	char sector[SECTOR];
+	int i;
+
+	ctx->footer.type       = HD_TYPE_DYNAMIC;
+	ctx->header.block_size = CHUNK;
+	ctx->spb               = CHUNK / SECTOR;
+	ctx->bm_secs           = 1;
+	ctx->bat.spb           = ctx->spb;
+	ctx->bat.entries       = 3;
+	ctx->bat.bat           = test_bat;
+
+	for (i = 0; i < 15; i++) {
+		memset(sector, i, sizeof(sector));
+		assert_int_equal(pwrite(ctx->fd, sector, SECTOR,
+					(off64_t)i * SECTOR), SECTOR);
+	}
+}
+
+void test_vhd_aio_prep_block(void **state)
+{
+	struct aio_test *t = *state;
+	vhd_context_t *ctx = &t->ctx;
+	vhd_aio_request_t req, *batch = &req;
+	char buf[CHUNK], map[SECTOR];
+	int i;
+
+	dynamic_image(ctx);
+	assert_int_equal(vhd_aio_create(&t->aio, 2), 0);
+
+	assert_int_equal(vhd_aio_prep_bitmap(&req, ctx, VHD_AIO_READ,
+					     0, map), 0);
+	assert_int_equal(req.offset, SECTOR);
+	assert_int_equal(req.size, SECTOR);
+	assert_int_equal(vhd_aio_exec(&req), 0);
+	assert_int_equal(map[0], 1);
+
+	assert_int_equal(vhd_aio_prep_block(&req, ctx, VHD_AIO_READ,
+					    0, 2, buf, 2 * SECTOR), 0);
+	assert_int_equal(req.offset, 4 * SECTOR);
+	assert_int_equal(vhd_aio_exec(&req), 0);
+	assert_int_equal(buf[0], 4);
+	assert_int_equal(buf[SECTOR], 5);
+
+	assert_int_equal(vhd_aio_prep_block(&req, ctx, VHD_AIO_READ,
+					    1, 0, buf, CHUNK), -EINVAL);
+	assert_int_equal(vhd_aio_prep_block(&req, ctx, VHD_AIO_READ,
+					    3, 0, buf, CHUNK), -ERANGE);
+	assert_int_equal(vhd_aio_prep_block(&req, ctx, VHD_AIO_READ,
+					    0, 1, buf, CHUNK), -ERANGE);
+
+	/* the last block reads zeroes past the footer, either way */
+	memset(buf, 0xff, sizeof(buf));
+	assert_int_equal(vhd_aio_prep_block(&req, ctx, VHD_AIO_READ,
+					    2, 0, buf, CHUNK), 0);
+	assert_int_equal(req.size, 3 * SECTOR);
+	assert_int_equal(vhd_aio_exec(&req), 0);
+	for (i = 0; i < 3; i++)
+		assert_int_equal(buf[i * SECTOR], 11 + i);
+	for (i = 3 * SECTOR; i < CHUNK; i++)
+		assert_int_equal(buf[i], 0);
+
+	memset(buf, 0xff, sizeof(buf));
+	assert_int_equal(vhd_aio_prep_block(&req, ctx, VHD_AIO_READ,
+					    2, 0, buf, CHUNK), 0);
+	req.cb = count_cb;
+	assert_int_equal(vhd_aio_submit(t->aio, &batch, 1), 0);
+	assert_int_equal(vhd_aio_drain(t->aio), 1);
+	assert_int_equal(last_err, 0);
+	for (i = 0; i < 3; i++)
+		assert_int_equal(buf[i * SECTOR], 11 + i);
+	for (i = 3 * SECTOR; i < CHUNK; i++)
+		assert_int_equal(buf[i], 0);
+
+	/* writes are never trimmed */
+	assert_int_equal(vhd_aio_prep_block(&req, ctx, VHD_AIO_WRITE,
+					    2, 0, buf, CHUNK), 0);
+	assert_int_equal(req.size, CHUNK);
+
+	ctx->footer.type = HD_TYPE_FIXED;
+	assert_int_equal(vhd_aio_prep_block(&req, ctx, VHD_AIO_READ,
+					    0, 0, buf, CHUNK), -EINVAL);
+}
+
+void test_vhd_aio_sync_read_paths(void **state)
+{
+	struct aio_test *t = *state;
+	vhd_context_t *ctx = &t->ctx;
+	char buf[2 * CHUNK], sector[SECTOR];
+	int i;
+
+	dynamic_image(ctx);
+	ctx->footer.curr_size = 3 * CHUNK;
+
+	/* every sector present in both allocated blocks */
+	memset(sector, 0xff, sizeof(sector));
+	assert_int_equal(pwrite(ctx->fd, sector, SECTOR, SECTOR), SECTOR);
+	assert_int_equal(pwrite(ctx->fd, sector, SECTOR, 10 * SECTOR), SECTOR);
+
+	assert_int_equal(vhd_read_at(ctx, 3, 0, SECTOR, buf), -ERANGE);
+	assert_int_equal(vhd_read_at(ctx, 1ULL << 32, 0, SECTOR, buf), -ERANGE);
+	assert_int_equal(vhd_read_at(ctx, 0, 1, SECTOR, buf), 0);
+	assert_int_equal(buf[0], 3);
+
+	assert_int_equal(vhd_io_read(ctx, buf, 2, 4), 0);
+	for (i = 0; i < 4; i++)
+		assert_int_equal(buf[i * SECTOR], 4 + i);
+
+	/* an unallocated block, then one cut short by the footer */
+	memset(buf, 0xff, sizeof(buf));
+	assert_int_equal(vhd_io_read(ctx, buf, 8, 16), 0);
+	for (i = 0; i < CHUNK; i++)
+		assert_int_equal(buf[i], 0);
+	for (i = 0; i < 3; i++)
+		assert_int_equal(buf[CHUNK + i * SECTOR], 11 + i);
+	for (i = CHUNK + 3 * SECTOR; i < 2 * CHUNK; i++)
+		assert_int_equal(buf[i], 0);
+
+	assert_int_equal(vhd_io_read(ctx, buf, 24, 1), -ERANGE);
+
+	ctx->footer.type = HD_TYPE_FIXED;
+	assert_int_equal(vhd_io_read(ctx, buf, 3, 2), 0);
+	assert_int_equal(buf[0], 3);
+	assert_int_equal(buf[SECTOR], 4);
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE /* copy_file_range in vhd-util-copy.c */
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <wrappers.h>
+
+#include "test-suites.h"
+
+/* the block copy helpers are static */
+#include "vhd-util-copy.c"
+
+#define SECTOR   512
+#define CHUNK    4096
+
+/*
+ * A three block source with 4k blocks and one bitmap sector each:
+ * block 0 at sector 1, block 1 unallocated and block 2 at sector 10.
+ * Sector i of the file holds bytes of value i.
+ */
+static uint32_t src_bat[3] = { 1, DD_BLK_UNUSED, 10 };
+
+struct copy_test {
+	vhd_context_t           source;
+	vhd_context_t           target;
+	uint32_t                target_bat[3];
+	struct vhd_copy         copy;
+	struct vhd_copy_worker  w;
+	char                    bitmap[SECTOR];
+};
+
+static int
+tmpfile_fd(void)
+{
+	char path[] = "/tmp/test-vhd-util-copy.XXXXXX";
+	int fd;
+
+	fd = mkstemp(path);
+	assert_true(fd >= 0);
+	unlink(path);
+
+	return fd;
+}
+
+int copy_test_setup(void **state)
+{
+	struct copy_test *t;
+	char sector[SECTOR];
+	int i;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+
+	t->source.fd                = tmpfile_fd();
+	t->source.footer.type       = HD_TYPE_DYNAMIC;
+	t->source.footer.curr_size  = 3 * CHUNK;
+	t->source.header.block_size = CHUNK;
+	t->source.spb               = CHUNK / SECTOR;
+	t->source.bm_secs           = 1;
+	t->source.bat.spb           = t->source.spb;
+	t->source.bat.entries       = 3;
+	t->source.bat.bat           = src_bat;
+
+	for (i = 0; i < 19; i++) {
+		memset(sector, i, sizeof(sector));
+		assert_int_equal(pwrite(t->source.fd, sector, SECTOR,
+					(off64_t)i * SECTOR), SECTOR);
+	}
+
+	/* an empty target, its BAT in the sector after its header */
+	t->target.fd                 = tmpfile_fd();
+	t->target.footer.type        = HD_TYPE_DYNAMIC;
+	t->target.footer.data_offset = SECTOR;
+	t->target.header.table_offset = 3 * SECTOR;
+	t->target.header.max_bat_size = 3;
+	t->target.header.block_size  = CHUNK;
+	t->target.spb                = CHUNK / SECTOR;
+	t->target.bm_secs            = 1;
+	t->target.bat.spb            = t->target.spb;
+	t->target.bat.entries        = 3;
+	t->target.bat.bat            = t->target_bat;
+	for (i = 0; i < 3; i++)
+		t->target_bat[i] = DD_BLK_UNUSED;
+
+	memset(t->bitmap, 0xff, sizeof(t->bitmap));
+
+	t->copy.source = &t->source;
+	t->copy.target = &t->target;
+	t->copy.src_fd = t->source.fd;
+	t->copy.dst_fd = t->target.fd;
+	t->copy.splice = 1;
+	t->copy.bitmap = t->bitmap;
+
+	t->w.copy   = &t->copy;
+	t->w.source = t->source;
+	assert_int_equal(posix_memalign((void **)&t->w.buf, 4096, CHUNK), 0);
+
+	*state = t;
+	return 0;
+}
+
+int copy_test_teardown(void **state)
+{
+	struct copy_test *t = *state;
+
+	free(t->w.buf);
+	close(t->source.fd);
+	close(t->target.fd);
+	free(t);
+
+	return 0;
+}
+
+/* sectors 0, 2 and 3 of the first source block are present */
+static void
+copy_test_sparse_bitmap(struct copy_test *t)
+{
+	char map[SECTOR];
+
+	memset(map, 0, sizeof(map));
+	map[0] = 0xb0;
+	assert_int_equal(pwrite(t->source.fd, map, SECTOR, SECTOR), SECTOR);
+}
+
+static void
+copy_test_check_sector(struct copy_test *t, uint64_t sec, int val)
+{
+	char sector[SECTOR];
+	int i;
+
+	/* past the end of the target reads as a hole */
+	memset(sector, 0, sizeof(sector));
+	assert_true(pread(t->target.fd, sector, SECTOR, sec * SECTOR) >= 0);
+	for (i = 0; i < SECTOR; i++)
+		assert_int_equal((unsigned char)sector[i], val);
+}
+
+void test_vhd_util_copy_layout(void **state)
+{
+	struct copy_test *t = *state;
+
+	/*
+	 * The target's data ends with its BAT at sector 4; each allocated
+	 * block gets its data on a page boundary, in source order.
+	 */
+	assert_int_equal(vhd_copy_layout(&t->source, &t->target), 0);
+	assert_int_equal(t->target_bat[0], 7);
+	assert_int_equal(t->target_bat[1], DD_BLK_UNUSED);
+	assert_int_equal(t->target_bat[2], 23);
+}
+
+static void
+copy_test_sparse_block(struct copy_test *t)
+{
+	int i;
+
+	copy_test_sparse_bitmap(t);
+	assert_int_equal(vhd_copy_layout(&t->source, &t->target), 0);
+
+	assert_int_equal(vhd_copy_block(&t->w, 0), 0);
+
+	/* every sector of the copy is marked present */
+	copy_test_check_sector(t, 7, 0xff);
+
+	/* only present sectors are copied, the others are left as holes */
+	copy_test_check_sector(t, 8, 2);
+	copy_test_check_sector(t, 9, 0);
+	copy_test_check_sector(t, 10, 4);
+	copy_test_check_sector(t, 11, 5);
+	for (i = 12; i < 16; i++)
+		copy_test_check_sector(t, i, 0);
+}
+
+void test_vhd_util_copy_block_sparse(void **state)
+{
+	copy_test_sparse_block(*state);
+}
+
+void test_vhd_util_copy_block_sparse_no_splice(void **state)
+{
+	struct copy_test *t = *state;
+
+	t->copy.splice = 0;
+	copy_test_sparse_block(t);
+}
+
+void test_vhd_util_copy_block_full(void **state)
+{
+	struct copy_test *t = *state;
+	char map[SECTOR];
+	int i;
+
+	memset(map, 0xff, sizeof(map));
+	assert_int_equal(pwrite(t->source.fd, map, SECTOR, 10 * SECTOR), SECTOR);
+	assert_int_equal(vhd_copy_layout(&t->source, &t->target), 0);
+
+	assert_int_equal(vhd_copy_block(&t->w, 2), 0);
+
+	copy_test_check_sector(t, 23, 0xff);
+	for (i = 0; i < 8; i++)
+		copy_test_check_sector(t, 24 + i, 11 + i);
+}
+
+void test_vhd_util_copy_pread_past_end(void **state)
+{
+	struct copy_test *t = *state;
+	char buf[2 * SECTOR];
+	int i;
+
+	assert_int_equal(ftruncate(t->source.fd, 2 * SECTOR), 0);
+
+	memset(buf, 0xaa, sizeof(buf));
+	assert_int_equal(vhd_copy_pread(t->source.fd, buf, sizeof(buf),
+					SECTOR), 0);
+	for (i = 0; i < SECTOR; i++)
+		assert_int_equal(buf[i], 1);
+	for (i = SECTOR; i < 2 * SECTOR; i++)
+		assert_int_equal(buf[i], 0);
+
+	memset(buf, 0xaa, sizeof(buf));
+	assert_int_equal(vhd_copy_pread(-1, buf, sizeof(buf), 0), -EBADF);
+}
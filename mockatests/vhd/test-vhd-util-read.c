@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE /* O_DIRECT in vhd-util-read.c */
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <wrappers.h>
+
+#include "test-suites.h"
+
+/* the extent map helpers are static */
+#include "vhd-util-read.c"
+
+#define SECTOR   512
+#define CHUNK    4096
+
+/*
+ * Two three block images with 4k blocks and one bitmap sector each,
+ * 2.5 blocks long. The child has sectors 0, 2, 3 and 7 of block 0 at
+ * sector 1 and all of block 2 at sector 10; its parent has sectors 4-7
+ * of block 0 at sector 1 and all of block 1 at sector 10.
+ */
+static uint32_t child_bat[3]  = { 1, DD_BLK_UNUSED, 10 };
+static uint32_t parent_bat[3] = { 1, 10, DD_BLK_UNUSED };
+
+struct extmap_test {
+	vhd_context_t   child;
+	vhd_context_t   parent;
+	int             out;
+};
+
+static void
+extmap_test_image(vhd_context_t *ctx, uint32_t *bat, char map0, char map1)
+{
+	char path[] = "/tmp/test-vhd-util-read.XXXXXX";
+	char sector[SECTOR];
+
+	ctx->fd = mkstemp(path);
+	assert_true(ctx->fd >= 0);
+	unlink(path);
+
+	ctx->footer.type       = HD_TYPE_DYNAMIC;
+	ctx->footer.curr_size  = 2 * CHUNK + 5 * SECTOR;
+	ctx->header.block_size = CHUNK;
+	ctx->spb               = CHUNK / SECTOR;
+	ctx->bm_secs           = 1;
+	ctx->bat.spb           = ctx->spb;
+	ctx->bat.entries       = 3;
+	ctx->bat.bat           = bat;
+
+	memset(sector, 0, sizeof(sector));
+	sector[0] = map0;
+	assert_int_equal(pwrite(ctx->fd, sector, SECTOR, SECTOR), SECTOR);
+	memset(sector, map1, sizeof(sector));
+	assert_int_equal(pwrite(ctx->fd, sector, SECTOR, 10 * SECTOR), SECTOR);
+}
+
+int extmap_test_setup(void **state)
+{
+	char path[] = "/tmp/test-vhd-util-read.XXXXXX";
+	struct extmap_test *t;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+
+	extmap_test_image(&t->child, child_bat, 0xb1, 0xff);
+	extmap_test_image(&t->parent, parent_bat, 0x0f, 0xff);
+
+	t->out = mkstemp(path);
+	assert_true(t->out >= 0);
+	unlink(path);
+
+	*state = t;
+	return 0;
+}
+
+int extmap_test_teardown(void **state)
+{
+	struct extmap_test *t = *state;
+
+	close(t->child.fd);
+	close(t->parent.fd);
+	close(t->out);
+	free(t);
+
+	return 0;
+}
+
+/*
+ * Runs the extent map of @ctx, merged with @parent if set, with stdout
+ * going to the test's output file, and returns what was written.
+ */
+static size_t
+extmap_test_run(struct extmap_test *t, vhd_context_t *parent, int fmt,
+		char *buf, size_t size)
+{
+	struct vhd_extmap m;
+	ssize_t n;
+	int err, fd;
+
+	memset(&m, 0, sizeof(m));
+	m.spb     = t->child.spb;
+	m.bm_size = t->child.spb >> 3;
+	m.blocks  = 3;
+	m.map     = calloc(m.blocks, sizeof(*m.map));
+	assert_non_null(m.map);
+
+	assert_int_equal(vhd_extmap_add(&m, &t->child), 0);
+	if (parent)
+		assert_int_equal(vhd_extmap_add(&m, parent), 0);
+
+	fflush(stdout);
+	fd = dup(STDOUT_FILENO);
+	assert_true(fd >= 0);
+	assert_true(dup2(t->out, STDOUT_FILENO) >= 0);
+
+	err = vhd_extmap_emit(&m, t->child.footer.curr_size, fmt);
+
+	assert_true(dup2(fd, STDOUT_FILENO) >= 0);
+	close(fd);
+	vhd_extmap_free(&m);
+	assert_int_equal(err, 0);
+
+	n = pread(t->out, buf, size, 0);
+	assert_true(n >= 0);
+	return n;
+}
+
+void test_vhd_util_read_extent_map_json(void **state)
+{
+	struct extmap_test *t = *state;
+	char buf[1024];
+	size_t n;
+
+	n = extmap_test_run(t, NULL, VHD_EXTMAP_JSON, buf, sizeof(buf) - 1);
+	buf[n] = '\0';
+
+	/* the last block is cut short by the end of the disk */
+	assert_string_equal(buf,
+			    "{\"size\": 10752, \"extents\": [\n"
+			    "{\"offset\": 0, \"length\": 512},\n"
+			    "{\"offset\": 1024, \"length\": 1024},\n"
+			    "{\"offset\": 3584, \"length\": 512},\n"
+			    "{\"offset\": 8192, \"length\": 2560}\n"
+			    "]}\n");
+}
+
+void test_vhd_util_read_extent_map_bin(void **state)
+{
+	struct extmap_test *t = *state;
+	uint64_t buf[16];
+	size_t n;
+
+	n = extmap_test_run(t, NULL, VHD_EXTMAP_BIN, (char *)buf, sizeof(buf));
+	assert_int_equal(n, 2 * 8 + 4 * 16);
+
+	assert_memory_equal(&buf[0], VHD_EXTMAP_MAGIC, 8);
+	assert_int_equal(le64toh(buf[1]), 10752);
+	assert_int_equal(le64toh(buf[2]), 0);
+	assert_int_equal(le64toh(buf[3]), 512);
+	assert_int_equal(le64toh(buf[4]), 1024);
+	assert_int_equal(le64toh(buf[5]), 1024);
+	assert_int_equal(le64toh(buf[6]), 3584);
+	assert_int_equal(le64toh(buf[7]), 512);
+	assert_int_equal(le64toh(buf[8]), 8192);
+	assert_int_equal(le64toh(buf[9]), 2560);
+}
+
+void test_vhd_util_read_extent_map_chain(void **state)
+{
+	struct extmap_test *t = *state;
+	char buf[1024];
+	size_t n;
+
+	/* the parent fills in block 0 from sector 4 and all of block 1 */
+	n = extmap_test_run(t, &t->parent, VHD_EXTMAP_JSON,
+			    buf, sizeof(buf) - 1);
+	buf[n] = '\0';
+
+	assert_string_equal(buf,
+			    "{\"size\": 10752, \"extents\": [\n"
+			    "{\"offset\": 0, \"length\": 512},\n"
+			    "{\"offset\": 1024, \"length\": 9728}\n"
+			    "]}\n");
+}
+
+void test_vhd_util_read_extent_map_fixed(void **state)
+{
+	struct extmap_test *t = *state;
+	char buf[1024];
+	size_t n;
+
+	/* a fixed ancestor backs every sector */
+	t->parent.footer.type = HD_TYPE_FIXED;
+	n = extmap_test_run(t, &t->parent, VHD_EXTMAP_JSON,
+			    buf, sizeof(buf) - 1);
+	buf[n] = '\0';
+
+	assert_string_equal(buf,
+			    "{\"size\": 10752, \"extents\": [\n"
+			    "{\"offset\": 0, \"length\": 10752}\n"
+			    "]}\n");
+
+	assert_int_equal(vhd_print_extent_map(&t->parent, VHD_EXTMAP_JSON, 0),
+			 -EINVAL);
+}
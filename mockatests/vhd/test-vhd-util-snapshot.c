@@ -63,6 +63,20 @@ char* args[ARGS_SIZE] = {
 		"71680",
 		"-e"};
 
+#define FAST_ARGS_SIZE 10
+
+char* fast_args[FAST_ARGS_SIZE] = {
+		"--debug",
+		"-n",
+		"test1.vhdcache",
+		"-p",
+		"test2.vhdcache",
+		"-S",
+		"71680",
+		"-f",
+		"-l",
+		"2"};
+
 /*
  * Tests to ensure errors are propagated by vhd-util-snapshot.
  */
@@ -132,3 +146,37 @@ void test_vhd_util_snapshot_einval_from_vhd_set_keyhash(void **state)
 	assert_int_equal(get_close_count(), 2);
 	assert_int_equal(res, EINVAL);
 }
+
+/*
+ * With -f the parent is opened once, and the depth limit still holds.
+ */
+void test_vhd_util_snapshot_fast(void **state)
+{
+	will_return(__wrap_canonpath, "testing");
+	will_return_always(__wrap_vhd_open, 0);
+	will_return(__wrap_vhd_get_keyhash, 0);
+	will_return(__wrap_vhd_snapshot, 0);
+	will_return_always(__wrap_vhd_close, 0);
+	expect_any_count(__wrap_vhd_close, ctx, 2);
+	/* the chain walk for -l, then the snapshot's backing path */
+	expect_any_count(__wrap_free, ptr, 2);
+	int res = vhd_util_snapshot(FAST_ARGS_SIZE, fast_args);
+	assert_int_equal(get_close_count(), 2);
+	assert_int_equal(res, 0);
+}
+
+void test_vhd_util_snapshot_fast_enospc_from_depth_limit(void **state)
+{
+	char *limit = fast_args[FAST_ARGS_SIZE - 1];
+
+	fast_args[FAST_ARGS_SIZE - 1] = "1";
+	will_return(__wrap_canonpath, "testing");
+	will_return(__wrap_vhd_open, 0);
+	will_return(__wrap_vhd_close, 0);
+	expect_any(__wrap_vhd_close, ctx);
+	expect_any_count(__wrap_free, ptr, 2);
+	int res = vhd_util_snapshot(FAST_ARGS_SIZE, fast_args);
+	fast_args[FAST_ARGS_SIZE - 1] = limit;
+	assert_int_equal(get_close_count(), 1);
+	assert_int_equal(res, -ENOSPC);
+}
@@ -48,13 +48,32 @@ static int teardownRealAllocator(void **state)
 	return 0;
 }
 
+/* for tests on real images, which free what libvhd allocates */
+static int setupUncheckedAllocator(void **state)
+{
+	set_use_real_allocator(true);
+	set_check_free(false);
+	return 0;
+}
+
+static int teardownUncheckedAllocator(void **state)
+{
+	set_check_free(true);
+	set_use_real_allocator(false);
+	return 0;
+}
+
 int main(void)
 {
 	int result =
 		cmocka_run_group_tests_name("Snapshot tests", vhd_snapshot_tests, setupRealAllocator, teardownRealAllocator) +
 		cmocka_run_group_tests_name("Canonpath tests", canonpath_tests, NULL, NULL) +
 		cmocka_run_group_tests_name("Utility tests", utility_tests, NULL, NULL) +
-		cmocka_run_group_tests_name("Bit Ops tests", bitops_tests, NULL, NULL);
+		cmocka_run_group_tests_name("Bit Ops tests", bitops_tests, NULL, NULL) +
+		cmocka_run_group_tests_name("AIO tests", vhd_aio_tests, setupUncheckedAllocator, teardownUncheckedAllocator) +
+		cmocka_run_group_tests_name("vhdx-util check tests", vhdx_check_tests, setupUncheckedAllocator, teardownUncheckedAllocator) +
+		cmocka_run_group_tests_name("vhd-util copy tests", vhd_util_copy_tests, setupUncheckedAllocator, teardownUncheckedAllocator) +
+		cmocka_run_group_tests_name("vhd-util read tests", vhd_util_read_tests, setupUncheckedAllocator, teardownUncheckedAllocator);
 
 	return result;
 }
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <wrappers.h>
+
+#include "test-suites.h"
+#include "libvhdx.h"
+#include "vhd-util.h"
+
+/*
+ * An 8MiB image with 1MiB blocks, and where its BAT and its end are,
+ * for the tests to write entries behind the library's back.
+ */
+struct vhdx_check_test {
+	char		dir[64];
+	char		path[PATH_MAX];
+	uint64_t	bat;
+	uint64_t	end;
+};
+
+int vhdx_check_test_setup(void **state)
+{
+	struct vhdx_check_test *t;
+	vhdx_context_t ctx;
+	struct stat st;
+
+	t = calloc(1, sizeof(*t));
+	assert_non_null(t);
+
+	strcpy(t->dir, "/tmp/test-vhdx-util-XXXXXX");
+	assert_non_null(mkdtemp(t->dir));
+	snprintf(t->path, sizeof(t->path), "%s/base.vhdx", t->dir);
+
+	assert_int_equal(vhdx_create(t->path, 8 * VHDX_MiB, VHDX_MiB,
+				     512, NULL), 0);
+
+	assert_int_equal(vhdx_open(&ctx, t->path, VHDX_OPEN_RDONLY), 0);
+	t->bat = ctx.bat_region.file_offset;
+	vhdx_close(&ctx);
+
+	assert_int_equal(stat(t->path, &st), 0);
+	t->end = (st.st_size + VHDX_MiB - 1) & ~(VHDX_MiB - 1);
+
+	*state = t;
+	return 0;
+}
+
+int vhdx_check_test_teardown(void **state)
+{
+	struct vhdx_check_test *t = *state;
+
+	unlink(t->path);
+	rmdir(t->dir);
+	free(t);
+
+	return 0;
+}
+
+static void
+poke(struct vhdx_check_test *t, const void *buf, size_t size, off_t off)
+{
+	int fd;
+
+	fd = open(t->path, O_RDWR);
+	assert_true(fd >= 0);
+	assert_int_equal(pwrite(fd, buf, size, off), size);
+	close(fd);
+}
+
+static void
+set_bat(struct vhdx_check_test *t, int i, int state, uint64_t off)
+{
+	uint64_t entry = vhdx_bat_entry(state, off);
+
+	poke(t, &entry, sizeof(entry), t->bat + i * sizeof(entry));
+}
+
+static int
+check(struct vhdx_check_test *t)
+{
+	char *argv[] = { "check", "-n", t->path };
+
+	return vhdx_util_check(3, argv);
+}
+
+void test_vhdx_check_new_image(void **state)
+{
+	struct vhdx_check_test *t = *state;
+	char *argv[] = { "check" };
+
+	assert_int_equal(check(t), 0);
+
+	/* no name */
+	assert_int_equal(vhdx_util_check(1, argv), -EINVAL);
+}
+
+void test_vhdx_check_overlapping_blocks(void **state)
+{
+	struct vhdx_check_test *t = *state;
+
+	assert_int_equal(truncate(t->path, t->end + 2 * VHDX_MiB), 0);
+
+	set_bat(t, 0, PAYLOAD_BLOCK_FULLY_PRESENT, t->end);
+	set_bat(t, 1, PAYLOAD_BLOCK_FULLY_PRESENT, t->end + VHDX_MiB);
+	assert_int_equal(check(t), 0);
+
+	set_bat(t, 1, PAYLOAD_BLOCK_FULLY_PRESENT, t->end);
+	assert_int_equal(check(t), -EINVAL);
+}
+
+void test_vhdx_check_bad_entries(void **state)
+{
+	struct vhdx_check_test *t = *state;
+
+	/* past the end of the file */
+	set_bat(t, 0, PAYLOAD_BLOCK_FULLY_PRESENT, t->end);
+	assert_int_equal(check(t), -EINVAL);
+
+	/* a state there is not */
+	set_bat(t, 0, 4, 0);
+	assert_int_equal(check(t), -EINVAL);
+
+	/* partially present without a parent, or a sector bitmap */
+	assert_int_equal(truncate(t->path, t->end + VHDX_MiB), 0);
+	set_bat(t, 0, PAYLOAD_BLOCK_PARTIALLY_PRESENT, t->end);
+	assert_int_equal(check(t), -EINVAL);
+
+	set_bat(t, 0, PAYLOAD_BLOCK_ZERO, 0);
+	assert_int_equal(check(t), 0);
+}
+
+void test_vhdx_check_headers(void **state)
+{
+	struct vhdx_check_test *t = *state;
+	uint32_t junk = 0xdeadbeef;
+
+	/* either copy will do */
+	poke(t, &junk, sizeof(junk), VHDX_HEADER1_OFFSET + 4);
+	assert_int_equal(check(t), 0);
+
+	poke(t, &junk, sizeof(junk), VHDX_HEADER2_OFFSET + 4);
+	assert_int_equal(check(t), -EINVAL);
+}
@@ -122,77 +122,27 @@ tapback_backend_destroy_device(vbd_t * const device)
  * Retrieves the tapdisk designated to serve this device, storing this
  * information in the supplied VBD handle.
  *
+ * @param device the VBD
+ * @param pid the tapdisk known to serve the minor, -1 if unknown
  * @param minor
  * @param tap output parameter that receives the tapdisk process information.
  * The parameter is undefined when the function returns a non-zero value.
- * @returns 0 if a suitable tapdisk is found, ESRCH if no suitable tapdisk is
+ * @returns 0 if a suitable tapdisk is found, -ESRCH if no suitable tapdisk is
  * found, and a negative error code in case of error
- *
- * TODO rename function
- *
- * XXX Only called by blkback_probe.
  */
 static inline int
-find_tapdisk(const int minor, tap_list_t *tap)
+find_tapdisk(vbd_t *device, const pid_t pid, const int minor, tap_list_t *tap)
 {
-    struct list_head list = LIST_HEAD_INIT(list);
-    tap_list_t *_tap;
     int err;
 
-    err = tap_ctl_list(&list);
-    if (err) {
-        WARN(NULL, "error listing tapdisks: %s\n", strerror(-err));
-        goto out;
-    }
-
-    err = -ESRCH;
-    if (!list_empty(&list)) {
-        tap_list_for_each_entry(_tap, &list) {
-            if (_tap->minor == minor) {
-                err = 0;
-                memcpy(tap, _tap, sizeof(*tap));
-                break;
-            }
-        }
-        tap_ctl_list_free(&list);
-    } else
-        DBG(NULL, "no tapdisks\n");
+    err = tapback_registry_find(&device->backend->slave.slave.registry,
+            minor, pid, tap);
+    if (err && err != -ESRCH)
+        WARN(device, "error listing tapdisks: %s\n", strerror(-err));
 
-out:
     return err;
 }
 
-static inline int
-find_tapdisk_by_pid(const pid_t pid, const int minor, tap_list_t *tap)
-{
-	struct list_head list = LIST_HEAD_INIT(list);
-	tap_list_t *entry;
-	int err;
-
-	err = tap_ctl_list_pid(pid, &list);
-	if (err) {
-		WARN(NULL, "error listing tapdisks: %s\n", strerror(-err));
-		goto out;
-	}
-
-	err = -ESRCH;
-	if (!list_empty(&list)) {
-		tap_list_for_each_entry(entry, &list) {
-			if (entry->minor == minor && entry->pid == pid) {
-				err = 0;
-				memcpy(tap, entry, sizeof(*tap));
-				break;
-			}
-		}
-		tap_ctl_list_free(&list);
-	} else {
-		DBG(NULL, "no tapdisks\n");
-	}
-
-out:
-	return err;
-}
-
 /**
  * Creates a device and adds it to the list of devices.
  *
@@ -325,7 +275,7 @@ physical_device_path_changed(vbd_t *device) {
 		goto out;
 	}
 
-	err = find_tapdisk_by_pid(pid, minor, device->tap);
+	err = find_tapdisk(device, pid, minor, device->tap);
 	if (err) {
 		WARN(device, "Error looking for tapdisk: %s\n", strerror(-err));
 		goto out;
@@ -483,7 +433,7 @@ physical_device_changed(vbd_t *device) {
 
     DBG(device, "need to find tapdisk serving minor=%d\n", device->minor);
 
-    err = find_tapdisk(device->minor, device->tap);
+    err = find_tapdisk(device, -1, device->minor, device->tap);
     if (err) {
         WARN(device, "error looking for tapdisk: %s\n", strerror(-err));
         goto out;
@@ -917,17 +867,29 @@ tapback_backend_probe_device(backend_t *backend,
     return err;
 }
 
+static int
+compare_name(const void *pa, const void *pb)
+{
+    return strcmp(*(char * const *)pa, *(char * const *)pb);
+}
+
 /**
- * Scans XenStore and probes any device found.
+ * Compares the devices between XenStore and the device list, and
+ * creates/destroys devices accordingly.
+ *
+ * Only devices that appeared or disappeared are probed, changes to the keys of
+ * the remaining ones are delivered to us by the watch on their own paths.
  */
 static int
 tapback_domain_scan(backend_t *backend, const domid_t domid)
 {
-	char *path = NULL, **sub = NULL;
-	int err = 0;
-	unsigned i, n = 0;
+    vbd_t *device = NULL, *next = NULL;
+    char **sub = NULL;
+    bool *known = NULL;
+    int err = 0;
+    unsigned i, n = 0;
 
-	ASSERT(backend);
+    ASSERT(backend);
 
     if (tapback_is_master(backend)) {
         /*
@@ -937,66 +899,80 @@ tapback_domain_scan(backend_t *backend, const domid_t domid)
          */
         WARN(NULL, "master restart not yet implemented, ignoring domain %d\n",
                 domid);
-    } else {
-        /*
-         * Read the devices of this domain.
-         */
-        sub = xs_directory(backend->xs, XBT_NULL, backend->path, &n);
-        err = -errno;
-        free(path);
+        return 0;
+    }
 
-        if (!sub)
+    /*
+     * Read the devices of this domain.
+     */
+    sub = xs_directory(backend->xs, XBT_NULL, backend->path, &n);
+    if (!sub) {
+        err = -errno;
+        if (err != -ENOENT)
+            return err;
+        n = 0;
+        err = 0;
+    } else {
+        known = calloc(n, sizeof(*known));
+        if (!known) {
+            err = -ENOMEM;
             goto out;
-
-        /*
-         * Probe each device.
-         */
-        for (i = 0; i < n; i++) {
-            err = tapback_backend_probe_device(backend, domid, sub[i], NULL);
-            if (unlikely(err))
-                /*
-                 * Keep probing other devices.
-                 */
-                WARN(NULL, "%s error probing device: %s\n",
-                        sub[i], strerror(-err));
         }
+        qsort(sub, n, sizeof(*sub), compare_name);
     }
 
-out:
-	free(sub);
-	return err;
-}
+    /*
+     * Scrap the devices that have disappeared, and remember the ones we
+     * already know about.
+     */
+    tapback_backend_for_each_device(backend, device, next) {
+        char **name;
+        int err2;
 
-/**
- * Compares the devices between XenStore and the device list, and
- * creates/destroys devices accordingly.
- */
-static int
-tapback_probe_domain(backend_t *backend, const domid_t domid)
-{
-    vbd_t *device = NULL, *next = NULL;
-    int err;
+        if (device->domid != domid)
+            continue;
 
-    ASSERT(backend);
+        name = n ? bsearch(&device->name, sub, n, sizeof(*sub), compare_name)
+            : NULL;
+        if (name) {
+            known[name - sub] = true;
+            continue;
+        }
+
+        err2 = tapback_backend_probe_device(backend, device->domid,
+                device->name, NULL);
+        if (unlikely(err2)) {
+            /*
+             * Keep probing other devices.
+             */
+            WARN(device, "error probing device: %s\n", strerror(-err2));
+            err = err2;
+        }
+    }
 
     /*
-     * scrap all non-existent devices
+     * Probe the new ones.
      */
-    tapback_backend_for_each_device(backend, device, next) {
-        if (device->domid == domid) {
-            err = tapback_backend_probe_device(backend, device->domid,
-                    device->name, NULL);
-            if (unlikely(err))
-                /*
-                 * Keep probing other devices.
-                 */
-                WARN(device, "error probing device: %s\n", strerror(-err));
+    for (i = 0; i < n; i++) {
+        int err2;
+
+        if (known[i])
+            continue;
+
+        err2 = tapback_backend_probe_device(backend, domid, sub[i], NULL);
+        if (unlikely(err2)) {
+            /*
+             * Keep probing other devices.
+             */
+            WARN(NULL, "%s error probing device: %s\n", sub[i],
+                    strerror(-err2));
+            err = err2;
         }
     }
 
-    err = tapback_domain_scan(backend, domid);
-    if (err == -ENOENT)
-        err = 0;
+out:
+    free(known);
+    free(sub);
     return err;
 }
 
@@ -1010,7 +986,6 @@ tapback_probe_domain(backend_t *backend, const domid_t domid)
 static int
 tapback_backend_scan(backend_t *backend)
 {
-    vbd_t *device = NULL, *next = NULL;
     unsigned int i = 0, n = 0;
     char **dir = NULL;
     int err = 0;
@@ -1019,32 +994,13 @@ tapback_backend_scan(backend_t *backend)
 
     DBG(NULL, "scanning entire back-end\n");
 
-    if (!tapback_is_master(backend)) {
-        /*
-         * scrap all non-existent devices
-         * TODO Why do we do this? Is this costly?
-         */
-        tapback_backend_for_each_device(backend, device, next) {
-            /*
-             * FIXME check that there is no compoment.
-             */
-            err = tapback_backend_probe_device(backend, device->domid,
-                    device->name, NULL);
-            if (unlikely(err))
-                /*
-                 * Keep probing other devices.
-                 */
-                WARN(device, "error probing device: %s\n", strerror(-err));
-        }
-    }
-
     /*
-     * probe the new ones
-     *
-     * TODO We're checking each and every device in each and every domain,
-     * could there be a performance issue in the presence of many VMs/VBDs?
-     * (e.g. boot-storm)
+     * A slave's path is that of its domain, so there is only one domain to
+     * look at.
      */
+    if (!tapback_is_master(backend))
+        return tapback_domain_scan(backend, backend->slave_domid);
+
     if (!(dir = xs_directory(backend->xs, XBT_NULL,
                     backend->path, &n))) {
         err = -errno;
@@ -1052,7 +1008,7 @@ tapback_backend_scan(backend_t *backend)
             err = 0;
         else
             WARN(NULL, "error listing %s: %s\n", backend->path,
-                    strerror(err));
+                    strerror(-err));
         goto out;
     }
 
@@ -1069,6 +1025,12 @@ tapback_backend_scan(backend_t *backend)
         if (*end != 0 || end == dir[i])
             continue;
 
+        /*
+         * Domains that already have a slave are taken care of by it.
+         */
+        if (tapback_find_slave(backend, domid))
+            continue;
+
 		err = tapback_domain_scan(backend, domid);
 		if (err)
 			WARN(NULL, "error scanning domain %d: %s\n", domid,
@@ -1236,7 +1198,7 @@ tapback_backend_handle_backend_watch(backend_t *backend,
              * The entire domain may be removed in one go, so we need to tear
              * down all devices.
              */
-            err = tapback_probe_domain(backend, domid);
+            err = tapback_domain_scan(backend, domid);
             if (err)
                 WARN(NULL, "failed to probe domain: %s\n", strerror(-err));
 
@@ -1260,7 +1222,7 @@ tapback_backend_handle_backend_watch(backend_t *backend,
          */
         device = strtok(NULL, "/");
         if (!device) {
-            err = tapback_probe_domain(backend, domid);
+            err = tapback_domain_scan(backend, domid);
             goto out;
         }
 
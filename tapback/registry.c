@@ -0,0 +1,529 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * This file contains the index of running tapdisks used to locate the tapdisk
+ * serving a minor without asking every tapdisk on the host.
+ *
+ * Tapdisks are discovered through their control sockets in
+ * BLKTAP2_CONTROL_DIR, which is watched with inotify. A tapdisk creates an NBD
+ * server socket named after its PID and the minor whenever it opens a VBD, so
+ * the same watch also tells which tapdisk most likely serves a new minor. The
+ * hint is always confirmed by asking that one tapdisk before it is used.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "tapback.h"
+#include "blktap2.h"
+
+#define REGISTRY_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM)
+
+/*
+ * Socket names created by a tapdisk in the control directory that carry a
+ * PID and a minor, most specific first.
+ */
+static const char * const nbd_patterns[] = {
+	"nbdserver-new%d.%d%n",
+	"nbdserver%d.%d%n",
+	"nbd%d.%d%n",
+};
+
+struct tapdisk {
+	pid_t pid;
+
+	/**
+	 * The minors served by this tapdisk, as last reported by it or as
+	 * announced by its NBD server sockets (state -1).
+	 */
+	struct list_head minors;
+
+	/**
+	 * Look-up generation in which this tapdisk was last queried.
+	 */
+	unsigned int gen;
+
+	struct list_head entry;
+};
+
+enum {
+	NAME_OTHER,
+	NAME_CONTROL,
+	NAME_NBD,
+};
+
+static int
+registry_parse_name(const char *name, pid_t *pid, int *minor)
+{
+	unsigned i;
+	int len = strlen(name), n;
+
+	n = -1;
+	if (sscanf(name, BLKTAP2_CONTROL_SOCKET"%d%n", pid, &n) == 1 &&
+			n == len)
+		return NAME_CONTROL;
+
+	for (i = 0; i < ARRAY_SIZE(nbd_patterns); i++) {
+		n = -1;
+		if (sscanf(name, nbd_patterns[i], pid, minor, &n) == 2 && n == len)
+			return NAME_NBD;
+	}
+
+	return NAME_OTHER;
+}
+
+static struct tapdisk *
+registry_find(struct tapdisk_registry *reg, const pid_t pid)
+{
+	struct tapdisk *td;
+
+	list_for_each_entry(td, &reg->tapdisks, entry)
+		if (td->pid == pid)
+			return td;
+
+	return NULL;
+}
+
+/**
+ * Returns the tapdisk with the specified PID, creating it if it's not yet
+ * known. New tapdisks go to the front of the list as they are the ones most
+ * likely to serve the minors we will be asked about next.
+ */
+static struct tapdisk *
+registry_get(struct tapdisk_registry *reg, const pid_t pid)
+{
+	struct tapdisk *td;
+
+	td = registry_find(reg, pid);
+	if (td)
+		return td;
+
+	td = calloc(1, sizeof(*td));
+	if (!td)
+		return NULL;
+
+	td->pid = pid;
+	INIT_LIST_HEAD(&td->minors);
+	list_add(&td->entry, &reg->tapdisks);
+
+	return td;
+}
+
+static void
+registry_put(struct tapdisk *td)
+{
+	list_del(&td->entry);
+	tap_ctl_list_free(&td->minors);
+	free(td);
+}
+
+static tap_list_t *
+tapdisk_find_minor(struct tapdisk *td, const int minor)
+{
+	tap_list_t *tl;
+
+	tap_list_for_each_entry(tl, &td->minors)
+		if (tl->minor == minor)
+			return tl;
+
+	return NULL;
+}
+
+/**
+ * Records that @pid has created an NBD server socket for @minor.
+ */
+static void
+registry_add_hint(struct tapdisk_registry *reg, const pid_t pid,
+		const int minor)
+{
+	struct tapdisk *td;
+	tap_list_t *tl;
+
+	td = registry_get(reg, pid);
+	if (!td)
+		return;
+
+	if (tapdisk_find_minor(td, minor))
+		return;
+
+	tl = calloc(1, sizeof(*tl));
+	if (!tl)
+		return;
+
+	tl->pid = pid;
+	tl->minor = minor;
+	tl->state = -1;
+	list_add(&tl->entry, &td->minors);
+
+	/*
+	 * Keep the tapdisk that opened a VBD most recently in front.
+	 */
+	list_move(&td->entry, &reg->tapdisks);
+}
+
+static void
+registry_del_hint(struct tapdisk_registry *reg, const pid_t pid,
+		const int minor)
+{
+	struct tapdisk *td;
+	tap_list_t *tl;
+
+	td = registry_find(reg, pid);
+	if (!td)
+		return;
+
+	tl = tapdisk_find_minor(td, minor);
+	if (tl) {
+		list_del(&tl->entry);
+		free(tl->type);
+		free(tl->path);
+		free(tl);
+	}
+}
+
+static void
+registry_add_name(struct tapdisk_registry *reg, const char *name)
+{
+	pid_t pid;
+	int minor;
+
+	switch (registry_parse_name(name, &pid, &minor)) {
+	case NAME_CONTROL:
+		if (!registry_get(reg, pid))
+			reg->resync = true;
+		break;
+	case NAME_NBD:
+		registry_add_hint(reg, pid, minor);
+		break;
+	}
+}
+
+static void
+registry_del_name(struct tapdisk_registry *reg, const char *name)
+{
+	struct tapdisk *td;
+	pid_t pid;
+	int minor;
+
+	switch (registry_parse_name(name, &pid, &minor)) {
+	case NAME_CONTROL:
+		td = registry_find(reg, pid);
+		if (td) {
+			DBG(NULL, "tapdisk[%d] exited\n", pid);
+			registry_put(td);
+		}
+		break;
+	case NAME_NBD:
+		registry_del_hint(reg, pid, minor);
+		break;
+	}
+}
+
+/**
+ * Re-reads the control directory, dropping tapdisks whose control socket is
+ * gone and adding the ones we missed.
+ */
+static int
+registry_resync(struct tapdisk_registry *reg)
+{
+	struct tapdisk *td, *next;
+	struct dirent *de;
+	unsigned int gen;
+	DIR *dir;
+
+	DBG(NULL, "re-reading %s\n", BLKTAP2_CONTROL_DIR);
+
+	dir = opendir(BLKTAP2_CONTROL_DIR);
+	if (!dir) {
+		int err = -errno;
+		if (err == -ENOENT) {
+			list_for_each_entry_safe(td, next, &reg->tapdisks, entry)
+				registry_put(td);
+			reg->resync = false;
+			return 0;
+		}
+		WARN(NULL, "failed to open %s: %s\n", BLKTAP2_CONTROL_DIR,
+				strerror(-err));
+		return err;
+	}
+
+	reg->resync = false;
+	gen = ++reg->gen;
+
+	while ((de = readdir(dir))) {
+		pid_t pid;
+		int minor;
+
+		switch (registry_parse_name(de->d_name, &pid, &minor)) {
+		case NAME_CONTROL:
+			td = registry_get(reg, pid);
+			if (td)
+				td->gen = gen;
+			else
+				reg->resync = true;
+			break;
+		case NAME_NBD:
+			registry_add_hint(reg, pid, minor);
+			break;
+		}
+	}
+	closedir(dir);
+
+	list_for_each_entry_safe(td, next, &reg->tapdisks, entry)
+		if (td->gen != gen)
+			registry_put(td);
+
+	return 0;
+}
+
+static void
+registry_watch(struct tapdisk_registry *reg)
+{
+	if (reg->fd < 0 || reg->wd >= 0)
+		return;
+
+	reg->wd = inotify_add_watch(reg->fd, BLKTAP2_CONTROL_DIR,
+			REGISTRY_EVENTS);
+	if (reg->wd < 0 && errno != ENOENT)
+		WARN(NULL, "failed to watch %s: %s\n", BLKTAP2_CONTROL_DIR,
+				strerror(errno));
+
+	/*
+	 * Whatever happened before the watch was in place went unnoticed.
+	 */
+	reg->resync = true;
+}
+
+void
+tapback_registry_handle_events(struct tapdisk_registry *reg)
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	ASSERT(reg);
+
+	if (reg->fd < 0)
+		return;
+
+	do {
+		len = read(reg->fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				WARN(NULL, "failed to read inotify events: %s\n",
+						strerror(errno));
+			break;
+		}
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW)
+				reg->resync = true;
+
+			if (ev->mask & IN_IGNORED) {
+				/*
+				 * The control directory went away, re-establish the watch
+				 * once it is re-created.
+				 */
+				reg->wd = -1;
+				reg->resync = true;
+			}
+
+			if (!ev->len)
+				continue;
+
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+				registry_add_name(reg, ev->name);
+			else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+				registry_del_name(reg, ev->name);
+		}
+	} while (1);
+}
+
+/**
+ * Brings the registry up to date with the control directory.
+ */
+static void
+registry_update(struct tapdisk_registry *reg)
+{
+	tapback_registry_handle_events(reg);
+	registry_watch(reg);
+
+	/*
+	 * Without a working watch we can only trust a fresh directory listing.
+	 */
+	if (reg->resync || reg->wd < 0)
+		registry_resync(reg);
+}
+
+/**
+ * Asks the tapdisk which minors it serves and updates the registry.
+ *
+ * @returns 0 if the tapdisk serves @minor, -ESRCH if it doesn't, and a
+ * negative error code on error
+ */
+static int
+registry_query(struct tapdisk_registry *reg, struct tapdisk *td,
+		const int minor, tap_list_t *tap)
+{
+	struct list_head list = LIST_HEAD_INIT(list);
+	tap_list_t *tl, *next;
+	int err;
+
+	td->gen = reg->gen;
+
+	err = tap_ctl_list_pid(td->pid, &list);
+	if (err)
+		return err;
+
+	if (list_empty(&list)) {
+		/*
+		 * The tapdisk is gone, the inotify event is on its way.
+		 */
+		registry_put(td);
+		return -ESRCH;
+	}
+
+	tap_ctl_list_free(&td->minors);
+	tap_list_for_each_entry_safe(tl, next, &list) {
+		if (tl->minor < 0) {
+			list_del(&tl->entry);
+			free(tl->type);
+			free(tl->path);
+			free(tl);
+		}
+	}
+	list_splice(&list, &td->minors);
+
+	tl = tapdisk_find_minor(td, minor);
+	if (!tl)
+		return -ESRCH;
+
+	*tap = *tl;
+	tap->type = tap->path = NULL;
+	INIT_LIST_HEAD(&tap->entry);
+
+	return 0;
+}
+
+int
+tapback_registry_find(struct tapdisk_registry *reg, const int minor,
+		const pid_t pid, tap_list_t *tap)
+{
+	struct tapdisk *td, *next;
+	int err;
+
+	ASSERT(reg);
+	ASSERT(tap);
+
+	registry_update(reg);
+	reg->gen++;
+
+	if (pid >= 0) {
+		td = registry_get(reg, pid);
+		if (!td)
+			return -ENOMEM;
+		return registry_query(reg, td, minor, tap);
+	}
+
+	/*
+	 * First ask the tapdisks that are known or announced to serve the minor.
+	 * Minors get reused, so anything we remember still needs confirming.
+	 */
+	list_for_each_entry_safe(td, next, &reg->tapdisks, entry) {
+		if (!tapdisk_find_minor(td, minor))
+			continue;
+		err = registry_query(reg, td, minor, tap);
+		if (err != -ESRCH)
+			return err;
+	}
+
+	/*
+	 * Fall back to asking the rest, most recently started first.
+	 */
+	list_for_each_entry_safe(td, next, &reg->tapdisks, entry) {
+		if (td->gen == reg->gen)
+			continue;
+		err = registry_query(reg, td, minor, tap);
+		if (err != -ESRCH)
+			return err;
+	}
+
+	return -ESRCH;
+}
+
+int
+tapback_registry_init(struct tapdisk_registry *reg)
+{
+	int err;
+
+	ASSERT(reg);
+
+	INIT_LIST_HEAD(&reg->tapdisks);
+	reg->wd = -1;
+	reg->gen = 0;
+	reg->resync = true;
+
+	reg->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (reg->fd < 0) {
+		err = -errno;
+		WARN(NULL, "failed to initialise inotify: %s\n", strerror(-err));
+		return err;
+	}
+
+	registry_update(reg);
+
+	return 0;
+}
+
+void
+tapback_registry_destroy(struct tapdisk_registry *reg)
+{
+	struct tapdisk *td, *next;
+
+	if (!reg->tapdisks.next)
+		return;
+
+	list_for_each_entry_safe(td, next, &reg->tapdisks, entry)
+		registry_put(td);
+
+	if (reg->fd >= 0) {
+		close(reg->fd);
+		reg->fd = -1;
+	}
+}
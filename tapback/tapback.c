@@ -173,6 +173,9 @@ tapback_backend_destroy(backend_t *backend)
 
     unlink(backend->local.sun_path);
 
+	if (!tapback_is_master(backend))
+		tapback_registry_destroy(&backend->slave.slave.registry);
+
 	list_del(&backend->entry);
 
 	free(backend);
@@ -274,6 +277,9 @@ tapback_backend_create(const char *name, const char *pidfile,
     if (domid) {
         backend->slave_domid = domid;
         INIT_LIST_HEAD(&backend->slave.slave.devices);
+        err = -tapback_registry_init(&backend->slave.slave.registry);
+        if (err)
+            goto out;
         err = asprintf(&backend->path, "%s/%s/%d", XENSTORE_BACKEND,
                 backend->name, backend->slave_domid);
         if (err == -1) {
@@ -432,12 +438,14 @@ out:
 static inline int
 tapback_backend_run(backend_t *backend)
 {
-    int fd;
+    int fd, reg_fd = -1;
 	int err;
 
 	ASSERT(backend);
 
 	fd = xs_fileno(backend->xs);
+    if (!tapback_is_master(backend))
+        reg_fd = backend->slave.slave.registry.fd;
 
     if (tapback_is_master(backend))
         INFO(NULL, "master tapback daemon started\n");
@@ -451,11 +459,14 @@ tapback_backend_run(backend_t *backend)
 
         FD_ZERO(&rfds);
         FD_SET(fd, &rfds);
+        if (reg_fd >= 0)
+            FD_SET(reg_fd, &rfds);
 
         /*
-         * poll the fd for changes in the XenStore path we're interested in
+         * poll the fd for changes in the XenStore path we're interested in,
+         * and the tapdisk control directory
          */
-        nfds = select(fd + 1, &rfds, NULL, NULL, NULL);
+        nfds = select((fd > reg_fd ? fd : reg_fd) + 1, &rfds, NULL, NULL, NULL);
         if (nfds == -1) {
             if (likely(errno == EINTR))
                 continue;
@@ -464,9 +475,12 @@ tapback_backend_run(backend_t *backend)
             break;
         }
 
-        if (FD_ISSET(fd, &rfds))
+        if (reg_fd >= 0 && FD_ISSET(reg_fd, &rfds))
+            tapback_registry_handle_events(&backend->slave.slave.registry);
+        if (FD_ISSET(fd, &rfds)) {
             tapback_read_watch(backend);
-        DBG(NULL, "--\n");
+            DBG(NULL, "--\n");
+        }
     } while (1);
 
     return err;
@@ -128,6 +128,37 @@ struct backend_master {
     void *slaves;
 };
 
+/**
+ * Index of the tapdisks running on the host and the minors they serve, kept
+ * up to date by watching the blktap control directory.
+ */
+struct tapdisk_registry {
+	/**
+	 * inotify descriptor, -1 if inotify is unavailable.
+	 */
+	int fd;
+
+	/**
+	 * Watch descriptor of the control directory, -1 if not watching.
+	 */
+	int wd;
+
+	/**
+	 * Known tapdisks, most recently started or active first.
+	 */
+	struct list_head tapdisks;
+
+	/**
+	 * Look-up generation, tells which tapdisks have already been queried.
+	 */
+	unsigned int gen;
+
+	/**
+	 * Events may have been lost, re-read the control directory.
+	 */
+	bool resync;
+};
+
 int
 compare(const void *pa, const void *pb);
 
@@ -144,6 +175,11 @@ struct backend_slave {
              * size of the request ring buffer"
              */
             int max_ring_page_order;
+
+            /**
+             * The tapdisks that may serve our devices.
+             */
+            struct tapdisk_registry registry;
         } slave;
         struct {
             pid_t pid;
@@ -522,6 +558,35 @@ tapback_xs_exists(struct xs_handle * const xs, xs_transaction_t xst,
 void
 tapback_backend_destroy(backend_t *backend);
 
+/**
+ * Initialises the tapdisk registry and starts watching the control directory.
+ *
+ * @returns 0 on success, a negative error code otherwise
+ */
+int
+tapback_registry_init(struct tapdisk_registry *reg);
+
+void
+tapback_registry_destroy(struct tapdisk_registry *reg);
+
+/**
+ * Processes pending inotify events on the control directory.
+ */
+void
+tapback_registry_handle_events(struct tapdisk_registry *reg);
+
+/**
+ * Locates the tapdisk serving @minor. Only the tapdisk with the specified PID
+ * is asked if @pid is not negative. The type and path of @tap are not filled
+ * in.
+ *
+ * @returns 0 if a suitable tapdisk is found, -ESRCH if no suitable tapdisk is
+ * found, and a negative error code in case of error
+ */
+int
+tapback_registry_find(struct tapdisk_registry *reg, const int minor,
+		const pid_t pid, tap_list_t *tap);
+
 bool verbose(void);
 
 #endif /* __TAPBACK_H__ */
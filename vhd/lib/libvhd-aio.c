@@ -0,0 +1,514 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libaio.h>
+
+#include "libvhd.h"
+#include "libvhd-aio.h"
+
+struct vhd_aio {
+	io_context_t               ioctx;
+	int                        depth;
+
+	struct iocb               *iocbs;
+	struct iocb              **free_iocbs;
+	int                        n_free;
+
+	struct iocb              **batch;
+	struct io_event           *events;
+
+	vhd_aio_request_t         *head;     /* waiting for an iocb */
+	vhd_aio_request_t         *tail;
+	int                        queued;
+	int                        busy;
+};
+
+int
+vhd_aio_create(vhd_aio_t **_aio, int depth)
+{
+	vhd_aio_t *aio;
+	int i, err;
+
+	*_aio = NULL;
+
+	if (depth <= 0)
+		return -EINVAL;
+
+	aio = calloc(1, sizeof(*aio));
+	if (!aio)
+		return -ENOMEM;
+
+	aio->depth      = depth;
+	aio->iocbs      = calloc(depth, sizeof(struct iocb));
+	aio->free_iocbs = calloc(depth, sizeof(struct iocb *));
+	aio->batch      = calloc(depth, sizeof(struct iocb *));
+	aio->events     = calloc(depth, sizeof(struct io_event));
+	if (!aio->iocbs || !aio->free_iocbs || !aio->batch || !aio->events) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < depth; i++)
+		aio->free_iocbs[aio->n_free++] = &aio->iocbs[i];
+
+	err = io_setup(depth, &aio->ioctx);
+	if (err) {
+		aio->ioctx = 0;
+		goto fail;
+	}
+
+	*_aio = aio;
+	return 0;
+
+fail:
+	vhd_aio_destroy(aio);
+	return err;
+}
+
+void
+vhd_aio_destroy(vhd_aio_t *aio)
+{
+	if (!aio)
+		return;
+
+	if (aio->ioctx)
+		io_destroy(aio->ioctx);
+
+	free(aio->iocbs);
+	free(aio->free_iocbs);
+	free(aio->batch);
+	free(aio->events);
+	free(aio);
+}
+
+int
+vhd_aio_pending(vhd_aio_t *aio)
+{
+	return aio->busy + aio->queued;
+}
+
+static void
+vhd_aio_zero_tail(vhd_aio_request_t *req)
+{
+	const struct iovec *last = &req->iov[req->iovcnt - 1];
+
+	if (req->_zero)
+		memset((char *)last->iov_base + last->iov_len, 0, req->_zero);
+}
+
+static void
+vhd_aio_finish(vhd_aio_request_t *req, int err)
+{
+	if (!err)
+		vhd_aio_zero_tail(req);
+
+	req->cb(req, err);
+}
+
+static void
+vhd_aio_enqueue(vhd_aio_t *aio, vhd_aio_request_t *req)
+{
+	req->_next = NULL;
+	if (aio->tail)
+		aio->tail->_next = req;
+	else
+		aio->head = req;
+	aio->tail = req;
+	aio->queued++;
+}
+
+static void
+vhd_aio_requeue(vhd_aio_t *aio, vhd_aio_request_t *req)
+{
+	struct iocb *iocb = req->_iocb;
+
+	req->_iocb = NULL;
+	aio->free_iocbs[aio->n_free++] = iocb;
+	aio->busy--;
+
+	req->_next = aio->head;
+	aio->head  = req;
+	if (!aio->tail)
+		aio->tail = req;
+	aio->queued++;
+}
+
+/*
+ * Move as many waiting requests as there are free iocbs into the
+ * kernel, in a single io_submit. A request the kernel refuses is
+ * completed with the error and the rest are retried.
+ */
+static int
+vhd_aio_kick(vhd_aio_t *aio)
+{
+	vhd_aio_request_t *req;
+	struct iocb *iocb;
+	int i, n, ret;
+
+again:
+	n = 0;
+	while (aio->head && aio->n_free) {
+		req       = aio->head;
+		aio->head = req->_next;
+		if (!aio->head)
+			aio->tail = NULL;
+		aio->queued--;
+
+		iocb       = aio->free_iocbs[--aio->n_free];
+		req->_iocb = iocb;
+		req->_next = NULL;
+		aio->busy++;
+
+		if (req->op == VHD_AIO_WRITE)
+			io_prep_pwritev(iocb, req->fd, req->iov,
+					req->iovcnt, req->offset);
+		else
+			io_prep_preadv(iocb, req->fd, req->iov,
+				       req->iovcnt, req->offset);
+		iocb->data = req;
+
+		aio->batch[n++] = iocb;
+	}
+
+	if (!n)
+		return 0;
+
+	ret = io_submit(aio->ioctx, n, aio->batch);
+	if (ret == -EAGAIN || ret == -EINTR)
+		ret = 0;
+
+	if (ret < 0) {
+		/* the error belongs to the first iocb only */
+		req = aio->batch[0]->data;
+		req->_iocb = NULL;
+		aio->free_iocbs[aio->n_free++] = aio->batch[0];
+		aio->busy--;
+
+		for (i = n - 1; i > 0; i--)
+			vhd_aio_requeue(aio, aio->batch[i]->data);
+
+		vhd_aio_finish(req, ret);
+		goto again;
+	}
+
+	for (i = n - 1; i >= ret; i--)
+		vhd_aio_requeue(aio, aio->batch[i]->data);
+
+	return ret;
+}
+
+int
+vhd_aio_submit(vhd_aio_t *aio, vhd_aio_request_t **reqs, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (!reqs[i]->cb)
+			return -EINVAL;
+		if (reqs[i]->op != VHD_AIO_READ &&
+		    reqs[i]->op != VHD_AIO_WRITE)
+			return -EINVAL;
+		if (reqs[i]->iovcnt <= 0)
+			return -EINVAL;
+	}
+
+	for (i = 0; i < nr; i++)
+		vhd_aio_enqueue(aio, reqs[i]);
+
+	vhd_aio_kick(aio);
+
+	return 0;
+}
+
+/*
+ * Complete at least @min_nr requests, waiting up to @timeout (NULL:
+ * forever). Returns the number of requests completed.
+ */
+int
+vhd_aio_reap(vhd_aio_t *aio, int min_nr, struct timespec *timeout)
+{
+	vhd_aio_request_t *req;
+	struct io_event *ev;
+	int i, n, err;
+
+	if (!aio->busy)
+		vhd_aio_kick(aio);
+
+	if (!aio->busy)
+		return 0;
+
+	if (min_nr > aio->busy)
+		min_nr = aio->busy;
+
+	do {
+		n = io_getevents(aio->ioctx, min_nr, aio->depth,
+				 aio->events, timeout);
+	} while (n == -EINTR);
+
+	if (n < 0)
+		return n;
+
+	for (i = 0; i < n; i++) {
+		ev  = &aio->events[i];
+		req = ev->data;
+
+		req->_iocb = NULL;
+		aio->free_iocbs[aio->n_free++] = ev->obj;
+		aio->busy--;
+	}
+
+	/* refill before the callbacks, to keep the queue full */
+	vhd_aio_kick(aio);
+
+	for (i = 0; i < n; i++) {
+		ev  = &aio->events[i];
+		req = ev->data;
+
+		if ((long)ev->res < 0)
+			err = (long)ev->res;
+		else if (ev->res != req->size)
+			err = -EIO;
+		else
+			err = 0;
+
+		vhd_aio_finish(req, err);
+	}
+
+	return n;
+}
+
+int
+vhd_aio_drain(vhd_aio_t *aio)
+{
+	int n, done;
+
+	done = 0;
+	while (vhd_aio_pending(aio)) {
+		n = vhd_aio_reap(aio, 1, NULL);
+		if (n < 0)
+			return n;
+		done += n;
+	}
+
+	return done;
+}
+
+void
+vhd_aio_prep(vhd_aio_request_t *req, vhd_context_t *ctx, int op,
+	     const struct iovec *iov, int iovcnt, off64_t offset)
+{
+	int i;
+
+	req->op     = op;
+	req->fd     = ctx->fd;
+	req->iov    = iov;
+	req->iovcnt = iovcnt;
+	req->offset = offset;
+	req->size   = 0;
+	req->_zero  = 0;
+	req->_iocb  = NULL;
+	req->_next  = NULL;
+
+	for (i = 0; i < iovcnt; i++)
+		req->size += iov[i].iov_len;
+}
+
+void
+vhd_aio_prep_buf(vhd_aio_request_t *req, vhd_context_t *ctx, int op,
+		 void *buf, size_t size, off64_t offset)
+{
+	req->_iov[0].iov_base = buf;
+	req->_iov[0].iov_len  = size;
+
+	vhd_aio_prep(req, ctx, op, req->_iov, 1, offset);
+}
+
+static int
+vhd_aio_get_block(vhd_context_t *ctx, uint32_t block, uint64_t *blk)
+{
+	int err;
+
+	if (!vhd_type_dynamic(ctx))
+		return -EINVAL;
+
+	err = vhd_get_bat(ctx);
+	if (err)
+		return err;
+
+	if (block >= ctx->bat.entries)
+		return -ERANGE;
+
+	*blk = ctx->bat.bat[block];
+	if (*blk == DD_BLK_UNUSED)
+		return -EINVAL;
+
+	return 0;
+}
+
+int
+vhd_aio_prep_bitmap(vhd_aio_request_t *req, vhd_context_t *ctx, int op,
+		    uint32_t block, void *map)
+{
+	int err;
+	uint64_t blk;
+
+	err = vhd_aio_get_block(ctx, block, &blk);
+	if (err)
+		return err;
+
+	vhd_aio_prep_buf(req, ctx, op, map,
+			 vhd_bytes_padded(ctx->spb >> 3),
+			 vhd_sectors_to_bytes(blk));
+	return 0;
+}
+
+/*
+ * Data of an allocated block, @from and @size relative to the start of
+ * the block. The last block of an image can be cut short by the
+ * footer; reads of that tail return zeroes.
+ */
+int
+vhd_aio_prep_block(vhd_aio_request_t *req, vhd_context_t *ctx, int op,
+		   uint32_t block, uint32_t from, void *buf, size_t size)
+{
+	int err;
+	uint64_t blk;
+	off64_t off, end;
+
+	err = vhd_aio_get_block(ctx, block, &blk);
+	if (err)
+		return err;
+
+	if (vhd_sectors_to_bytes(from) + size > ctx->header.block_size)
+		return -ERANGE;
+
+	off = vhd_sectors_to_bytes(blk + ctx->bm_secs + from);
+
+	vhd_aio_prep_buf(req, ctx, op, buf, size, off);
+
+	if (op != VHD_AIO_READ)
+		return 0;
+
+	end = lseek64(ctx->fd, 0, SEEK_END);
+	if (end == (off64_t)-1)
+		return -errno;
+	end -= sizeof(vhd_footer_t);
+
+	if (off + (off64_t)size > end) {
+		req->_zero = off < end ? off + size - end : size;
+		req->_iov[0].iov_len -= req->_zero;
+		req->size            -= req->_zero;
+	}
+
+	return 0;
+}
+
+/*
+ * Synchronous execution of a prepared request; the result is returned
+ * rather than passed to the callback. Short transfers are resumed,
+ * reaching EOF before the request is done is an error.
+ */
+int
+vhd_aio_exec(vhd_aio_request_t *req)
+{
+	struct iovec _iov[VHD_AIO_IOV_INLINE], *iov;
+	size_t done;
+	ssize_t ret;
+	int i, cnt, err;
+
+	iov = _iov;
+	if (req->iovcnt > VHD_AIO_IOV_INLINE) {
+		iov = malloc(req->iovcnt * sizeof(*iov));
+		if (!iov)
+			return -ENOMEM;
+	}
+
+	memcpy(iov, req->iov, req->iovcnt * sizeof(*iov));
+	cnt  = req->iovcnt;
+	i    = 0;
+	done = 0;
+	err  = 0;
+
+	while (done < req->size) {
+		while (i < cnt && !iov[i].iov_len)
+			i++;
+
+		if (req->op == VHD_AIO_WRITE)
+			ret = pwritev(req->fd, iov + i, cnt - i,
+				      req->offset + done);
+		else
+			ret = preadv(req->fd, iov + i, cnt - i,
+				     req->offset + done);
+
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			err = -errno;
+			break;
+		}
+
+		if (!ret) {
+			err = -EIO;
+			break;
+		}
+
+		done += ret;
+
+		while (ret > 0) {
+			size_t len = iov[i].iov_len;
+
+			if ((size_t)ret < len) {
+				iov[i].iov_base = (char *)iov[i].iov_base + ret;
+				iov[i].iov_len -= ret;
+				break;
+			}
+
+			ret -= len;
+			iov[i].iov_len = 0;
+			i++;
+		}
+	}
+
+	if (iov != _iov)
+		free(iov);
+
+	if (!err)
+		vhd_aio_zero_tail(req);
+
+	return err;
+}
@@ -54,6 +54,7 @@
 #include "debug.h"
 #include "xattr.h"
 #include "libvhd.h"
+#include "libvhd-aio.h"
 #include "relative-path.h"
 #include "canonpath.h"
 #include "compiler.h"
@@ -685,6 +686,77 @@ vhd_chain_depth(vhd_context_t *ctx, int *depth)
 	return err;
 }
 
+/*
+ * As vhd_chain_depth, but trusting the depth recorded in @ctx by
+ * vhd_set_chain_depth, as long as @ctx still has the parent it had
+ * then. Reparenting an image invalidates its hint, but not the hints
+ * of its descendants, which can then overstate the depth.
+ */
+int
+vhd_chain_depth_fast(vhd_context_t *ctx, int *depth)
+{
+	struct vhd_chain_hint hint;
+	uint32_t ts;
+	int err;
+
+	if (ctx->footer.type != HD_TYPE_DIFF) {
+		*depth = 1;
+		return 0;
+	}
+
+	if (vhd_parent_raw(ctx)) {
+		*depth = 2;
+		return 0;
+	}
+
+	err = vhd_get_chain_hint(ctx, &hint);
+	if (!err && hint.cookie == 1 && hint.depth) {
+		ts = ((uint32_t)hint.prt_ts[0] << 24) |
+			((uint32_t)hint.prt_ts[1] << 16) |
+			((uint32_t)hint.prt_ts[2] << 8) |
+			hint.prt_ts[3];
+
+		if (!memcmp(hint.prt_uuid, ctx->header.prt_uuid,
+			    sizeof(hint.prt_uuid)) &&
+		    ts == ctx->header.prt_ts) {
+			*depth = hint.depth;
+			return 0;
+		}
+	}
+
+	err = vhd_chain_depth(ctx, depth);
+	if (err)
+		return err;
+
+	/* best effort: a read-only batmap cannot keep it */
+	if (vhd_flag_test(ctx->oflags, VHD_OPEN_RDWR) || !vhd_has_batmap(ctx))
+		vhd_set_chain_depth(ctx, *depth);
+	return 0;
+}
+
+int
+vhd_set_chain_depth(vhd_context_t *ctx, int depth)
+{
+	struct vhd_chain_hint hint;
+
+	if (ctx->footer.type != HD_TYPE_DIFF || vhd_parent_raw(ctx))
+		return 0;
+
+	memset(&hint, 0, sizeof(hint));
+	if (depth > 0 && depth <= UINT8_MAX) {
+		hint.cookie    = 1;
+		hint.depth     = depth;
+		hint.prt_ts[0] = ctx->header.prt_ts >> 24;
+		hint.prt_ts[1] = ctx->header.prt_ts >> 16;
+		hint.prt_ts[2] = ctx->header.prt_ts >> 8;
+		hint.prt_ts[3] = ctx->header.prt_ts;
+		memcpy(hint.prt_uuid, ctx->header.prt_uuid,
+		       sizeof(hint.prt_uuid));
+	}
+
+	return vhd_set_chain_hint(ctx, &hint);
+}
+
 int
 vhd_batmap_test(vhd_context_t *ctx, vhd_batmap_t *batmap, uint32_t block)
 {
@@ -1966,42 +2038,27 @@ vhd_read_bitmap(vhd_context_t *ctx, uint32_t block, char **bufp)
 {
 	int err;
 	void *buf;
-	size_t size;
-	off64_t off;
-	uint64_t blk;
+	vhd_aio_request_t req;
 
 	buf   = NULL;
 	*bufp = NULL;
 
-	if (!vhd_type_dynamic(ctx))
-		return -EINVAL;
-
-	err = vhd_get_bat(ctx);
-	if (err)
-		return err;
-
-	if (block >= ctx->bat.entries)
-		return -ERANGE;
-
-	blk  = ctx->bat.bat[block];
-	if (blk == DD_BLK_UNUSED)
-		return -EINVAL;
-
-	off  = vhd_sectors_to_bytes(blk);
-	size = vhd_bytes_padded(ctx->spb >> 3);
-
-	err  = vhd_seek(ctx, off, SEEK_SET);
-	if (err)
-		return err;
-
-	err  = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
+	err  = posix_memalign(&buf, VHD_SECTOR_SIZE,
+			      vhd_bytes_padded(ctx->spb >> 3));
 	if (err)
 		return -err;
 
-	err  = vhd_read(ctx, buf, size);
+	err  = vhd_aio_prep_bitmap(&req, ctx, VHD_AIO_READ, block, buf);
 	if (err)
 		goto fail;
 
+	err  = vhd_aio_exec(&req);
+	if (err) {
+		VHDLOG("%s: bitmap read of block %u failed: %d\n",
+		       ctx->file, block, err);
+		goto fail;
+	}
+
 	*bufp = buf;
 	return 0;
 
@@ -2013,12 +2070,8 @@ fail:
 int
 vhd_read_at(vhd_context_t *ctx, uint64_t block, uint32_t from, size_t size, char *buf)
 {
-	/*
-	 * Sub call function, assumes that dynamic disk has been checked
-	 */
 	int err;
-	uint64_t blk;
-	off64_t end, off;
+	vhd_aio_request_t req;
 
 	err = vhd_get_bat(ctx);
 	if (err)
@@ -2027,32 +2080,17 @@ vhd_read_at(vhd_context_t *ctx, uint64_t block, uint32_t from, size_t size, char
 	if (block >= ctx->bat.entries)
 		return -ERANGE;
 
-	blk  = ctx->bat.bat[block];
-	if (blk == DD_BLK_UNUSED)
-		return -EINVAL;
-
-	off  = vhd_sectors_to_bytes(blk + ctx->bm_secs);
-
-	err  = vhd_footer_offset_at_eof(ctx, &end);
-	if (err)
-		return err;
-
-	if (end < off + ctx->header.block_size) {
-		size = end - off;
-		memset(buf + size, 0, ctx->header.block_size - size);
-	}
-
-	off = off + vhd_sectors_to_bytes(from);
-
-	err  = vhd_seek(ctx, off, SEEK_SET);
+	err = vhd_aio_prep_block(&req, ctx, VHD_AIO_READ, block, from,
+				 buf, size);
 	if (err)
 		return err;
 
-	err  = vhd_read(ctx, buf, size);
+	err = vhd_aio_exec(&req);
 	if (err)
-		return err;
+		VHDLOG("%s: read of block %"PRIu64" failed: %d\n",
+		       ctx->file, block, err);
 
-	return 0;
+	return err;
 }
 
 int
@@ -2723,7 +2761,7 @@ vhd_open(vhd_context_t *ctx, const char *file, int flags)
 		return err;
 
 	oflags = O_LARGEFILE;
-	if (!(flags & VHD_OPEN_CACHED)) {
+	if (!(flags & (VHD_OPEN_CACHED | VHD_OPEN_BUFFERED))) {
 		oflags |= O_DIRECT;
 		if (access("/etc/tapdisk_use_dsync", F_OK) != -1) {
 		/* tapdisk_use_dsync exists, it means we need to open
@@ -3130,6 +3168,7 @@ vhd_create_batmap(vhd_context_t *ctx)
 	off64_t off;
 	int err, map_bytes;
 	vhd_batmap_header_t *header;
+	vhd_batmap_t b;
 	void *map;
 
 	if (!vhd_type_dynamic(ctx))
@@ -3159,7 +3198,21 @@ vhd_create_batmap(vhd_context_t *ctx)
 	memset(map, 0, map_bytes);
 	ctx->batmap.map = map;
 
-	return vhd_write_batmap(ctx, &ctx->batmap);
+	if (ctx->is_block)
+		return vhd_write_batmap(ctx, &ctx->batmap);
+
+	/*
+	 * A new file reads back zeroes anyway: leave the map as a hole,
+	 * extending the file as far as vhd_write_batmap would have.
+	 */
+	map_bytes = vhd_sectors_to_bytes(secs_round_up_no_zero(
+			ctx->footer.curr_size >> (VHD_BLOCK_SHIFT + 3)));
+	if (ftruncate(ctx->fd, header->batmap_offset + map_bytes))
+		return -errno;
+
+	header->checksum = vhd_checksum_batmap(ctx, &ctx->batmap);
+	b = ctx->batmap;
+	return vhd_write_batmap_header(ctx, &b);
 }
 
 static int
@@ -3435,13 +3488,12 @@ static int
 __vhd_io_fixed_read(vhd_context_t *ctx,
 		    char *buf, uint64_t sec, uint32_t secs)
 {
-	int err;
+	vhd_aio_request_t req;
 
-	err = vhd_seek(ctx, vhd_sectors_to_bytes(sec), SEEK_SET);
-	if (err)
-		return err;
+	vhd_aio_prep_buf(&req, ctx, VHD_AIO_READ, buf,
+			 vhd_sectors_to_bytes(secs), vhd_sectors_to_bytes(sec));
 
-	return vhd_read(ctx, buf, vhd_sectors_to_bytes(secs));
+	return vhd_aio_exec(&req);
 }
 
 static void
@@ -3475,7 +3527,7 @@ __vhd_io_dynamic_read_link(vhd_context_t *ctx, char *map,
 	off64_t off;
 	uint32_t blk, sec;
 	int err, cnt, map_off, i;
-	char *bitmap, *data, *src;
+	char *bitmap, *data;
 
 	map_off = 0;
 
@@ -3502,18 +3554,24 @@ __vhd_io_dynamic_read_link(vhd_context_t *ctx, char *map,
 		if (err)
 			return err;
 
-		err = vhd_read_block(ctx, blk, &data);
+		err = posix_memalign((void **)&data, VHD_SECTOR_SIZE,
+				     vhd_sectors_to_bytes(cnt));
 		if (err) {
 			free(bitmap);
-			return err;
+			return -err;
 		}
 
-		src = data + vhd_sectors_to_bytes(sec);
+		err = vhd_read_at(ctx, blk, sec, vhd_sectors_to_bytes(cnt), data);
+		if (err) {
+			free(data);
+			free(bitmap);
+			return err;
+		}
 
 		__vhd_io_dynamic_copy_data(ctx,
 					   map, map_off,
 					   bitmap, sec,
-					   buf, src, cnt);
+					   buf, data, cnt);
 
 	next:
 		free(data);
@@ -4034,7 +4092,11 @@ vhd_block_vector_read(vhd_context_t *ctx, vhd_block_vector_t *vec)
 
 	for (i = 0; i < vec->entries; i++) {
 		vhd_block_vector_entry_t *v = vec->array + i;
-		err = vhd_pread(ctx, v->buf, v->bytes, off + v->off);
+		vhd_aio_request_t req;
+
+		vhd_aio_prep_buf(&req, ctx, VHD_AIO_READ,
+				 v->buf, v->bytes, off + v->off);
+		err = vhd_aio_exec(&req);
 		if (err)
 			goto out;
 	}
@@ -4721,3 +4783,44 @@ vhd_set_keyhash(vhd_context_t *ctx, const struct vhd_keyhash *keyhash)
 	memcpy(&(ctx->batmap.header.keyhash), keyhash, sizeof(*keyhash));
 	return vhd_write_batmap_header(ctx, &batmap);
 }
+
+int
+vhd_get_chain_hint(vhd_context_t *ctx, struct vhd_chain_hint *hint)
+{
+	int err;
+	vhd_batmap_t batmap;
+
+	if (!vhd_has_batmap(ctx))
+		return xattr_get(ctx->fd,
+				 VHD_XATTR_CHAIN,
+				 (void *)hint,
+				 sizeof(*hint));
+
+	err = vhd_read_batmap_header(ctx, &batmap);
+	if (err)
+		return err;
+
+	memcpy(hint, &batmap.header.chain, sizeof(*hint));
+	return 0;
+}
+
+int
+vhd_set_chain_hint(vhd_context_t *ctx, const struct vhd_chain_hint *hint)
+{
+	int err;
+	vhd_batmap_t batmap;
+
+	if (!vhd_has_batmap(ctx))
+		return xattr_set(ctx->fd,
+				 VHD_XATTR_CHAIN,
+				 (void *)hint,
+				 sizeof(*hint));
+
+	err = vhd_read_batmap_header(ctx, &batmap);
+	if (err)
+		return err;
+
+	memcpy(&batmap.header.chain, hint, sizeof(*hint));
+	memcpy(&(ctx->batmap.header.chain), hint, sizeof(*hint));
+	return vhd_write_batmap_header(ctx, &batmap);
+}
@@ -0,0 +1,1420 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <libgen.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <uuid/uuid.h>
+
+#include "libvhd.h"
+#include "libvhdx.h"
+#include "relative-path.h"
+#include "canonpath.h"
+
+#define VHDXLOG(_f, _a...)						\
+	syslog(LOG_INFO, "libvhdx::%s: "_f, __func__, ##_a)
+
+#define VHDX_ALIGN(_v, _a)       (((_v) + (_a) - 1) & ~((uint64_t)(_a) - 1))
+
+#define VHDX_LOG_HEADER_DESCS    126
+#define VHDX_LOG_SECTOR_DESCS    128
+#define VHDX_LOG_MAX_SIZE        (64 * VHDX_MiB)
+
+#define VHDX_META_ITEMS_OFFSET   VHDX_METADATA_TABLE_SIZE
+
+static const vhdx_guid_t vhdx_bat_guid =
+	VHDX_GUID(0x2dc27766, 0xf623, 0x4200,
+		  0x9d, 0x64, 0x11, 0x5e, 0x9b, 0xfd, 0x4a, 0x08);
+static const vhdx_guid_t vhdx_metadata_guid =
+	VHDX_GUID(0x8b7ca206, 0x4790, 0x4b9a,
+		  0xb8, 0xfe, 0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e);
+static const vhdx_guid_t vhdx_file_parameters_guid =
+	VHDX_GUID(0xcaa16737, 0xfa36, 0x4d43,
+		  0xb3, 0xb6, 0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b);
+static const vhdx_guid_t vhdx_disk_size_guid =
+	VHDX_GUID(0x2fa54224, 0xcd1b, 0x4876,
+		  0xb2, 0x11, 0x5d, 0xbe, 0xd8, 0x3b, 0xf4, 0xb8);
+static const vhdx_guid_t vhdx_page83_guid =
+	VHDX_GUID(0xbeca12ab, 0xb2e6, 0x4523,
+		  0x93, 0xef, 0xc3, 0x09, 0xe0, 0x00, 0xc7, 0x46);
+static const vhdx_guid_t vhdx_logical_sector_guid =
+	VHDX_GUID(0x8141bf1d, 0xa96f, 0x4709,
+		  0xba, 0x47, 0xf2, 0x33, 0xa8, 0xfa, 0xab, 0x5f);
+static const vhdx_guid_t vhdx_physical_sector_guid =
+	VHDX_GUID(0xcda348c7, 0x445d, 0x4471,
+		  0x9c, 0xc9, 0xe9, 0x88, 0x52, 0x51, 0xc5, 0x56);
+static const vhdx_guid_t vhdx_parent_locator_guid =
+	VHDX_GUID(0xa8d35f2f, 0xb30b, 0x454d,
+		  0xab, 0xf7, 0xd3, 0xd8, 0x48, 0x34, 0xab, 0x0c);
+static const vhdx_guid_t vhdx_locator_type_guid =
+	VHDX_GUID(0xb04aefb7, 0xd19e, 0x4a81,
+		  0xb7, 0x89, 0x25, 0xb8, 0xe9, 0x44, 0x59, 0x13);
+
+static const char vhdx_creator[] = "tapdisk";
+
+/*
+ * CRC-32C (Castagnoli), as used by every VHDX checksum.
+ */
+static uint32_t crc32c_table[256];
+
+static void
+crc32c_init(void)
+{
+	uint32_t i, j, crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+		crc32c_table[i] = crc;
+	}
+}
+
+static uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	if (!crc32c_table[1])
+		crc32c_init();
+
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+/*
+ * Checksum of @buf, taking the 4 bytes at @crc_offset as zero.
+ */
+uint32_t
+vhdx_checksum(const void *buf, size_t len, size_t crc_offset)
+{
+	static const uint32_t zero;
+	uint32_t crc = ~0U;
+
+	crc = crc32c(crc, buf, crc_offset);
+	crc = crc32c(crc, &zero, sizeof(zero));
+	crc = crc32c(crc, (const char *)buf + crc_offset + sizeof(zero),
+		     len - crc_offset - sizeof(zero));
+
+	return ~crc;
+}
+
+void
+vhdx_guid_generate(vhdx_guid_t *guid)
+{
+	uuid_t uuid;
+
+	uuid_generate(uuid);
+	memcpy(guid, uuid, sizeof(*guid));
+}
+
+int
+vhdx_guid_is_zero(const vhdx_guid_t *guid)
+{
+	static const vhdx_guid_t zero;
+	return !memcmp(guid, &zero, sizeof(zero));
+}
+
+static int
+vhdx_guid_equal(const vhdx_guid_t *a, const vhdx_guid_t *b)
+{
+	return !memcmp(a, b, sizeof(*a));
+}
+
+void
+vhdx_guid_to_string(const vhdx_guid_t *guid, char *out)
+{
+	const uint8_t *d = guid->data4;
+
+	sprintf(out, "{%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+		guid->data1, guid->data2, guid->data3,
+		d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]);
+}
+
+int
+vhdx_guid_from_string(const char *str, vhdx_guid_t *guid)
+{
+	unsigned int a, b, c, d[8];
+	int i, n = -1;
+
+	if (sscanf(str, "{%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x}%n",
+		   &a, &b, &c, &d[0], &d[1], &d[2], &d[3], &d[4], &d[5],
+		   &d[6], &d[7], &n) != 11 || n != (int)strlen(str))
+		return -EINVAL;
+
+	guid->data1 = a;
+	guid->data2 = b;
+	guid->data3 = c;
+	for (i = 0; i < 8; i++)
+		guid->data4[i] = d[i];
+
+	return 0;
+}
+
+static void *
+vhdx_alloc(size_t size)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, VHDX_LOG_SECTOR_SIZE, size))
+		return NULL;
+
+	memset(buf, 0, size);
+	return buf;
+}
+
+static int
+vhdx_pread(int fd, void *buf, size_t size, off64_t off)
+{
+	ssize_t n = pread(fd, buf, size, off);
+	if (n == (ssize_t)size)
+		return 0;
+	return n < 0 ? -errno : -EIO;
+}
+
+static int
+vhdx_pwrite(int fd, const void *buf, size_t size, off64_t off)
+{
+	ssize_t n = pwrite(fd, buf, size, off);
+	if (n == (ssize_t)size)
+		return 0;
+	return n < 0 ? -errno : -EIO;
+}
+
+/*
+ * Names in the parent locator are UTF-16LE. Like libvhd, we only deal in
+ * ASCII names.
+ */
+static char *
+vhdx_utf16_to_ascii(const uint8_t *s, size_t bytes)
+{
+	size_t i, n = bytes / 2;
+	char *out;
+
+	if (bytes & 1)
+		return NULL;
+
+	out = malloc(n + 1);
+	if (!out)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		if (s[2 * i] >= 0x80 || s[2 * i + 1]) {
+			free(out);
+			return NULL;
+		}
+		out[i] = s[2 * i];
+	}
+	out[n] = '\0';
+
+	return out;
+}
+
+static int
+vhdx_ascii_to_utf16(const char *s, uint8_t *out)
+{
+	size_t i, n = strlen(s);
+
+	for (i = 0; i < n; i++) {
+		if ((unsigned char)s[i] >= 0x80)
+			return -EINVAL;
+		out[2 * i]     = s[i];
+		out[2 * i + 1] = 0;
+	}
+
+	return 2 * n;
+}
+
+int
+vhdx_validate_header(const struct vhdx_header *h)
+{
+	if (h->signature != VHDX_HEADER_SIGNATURE)
+		return -EINVAL;
+
+	if (h->checksum != vhdx_checksum(h, VHDX_HEADER_SIZE,
+					 offsetof(struct vhdx_header, checksum)))
+		return -EINVAL;
+
+	if (h->version != 1 || h->log_version != 0)
+		return -EINVAL;
+
+	if (h->log_offset % VHDX_MiB || h->log_length % VHDX_MiB)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int
+vhdx_read_headers(vhdx_context_t *ctx)
+{
+	static const off64_t offs[2] = {
+		VHDX_HEADER1_OFFSET, VHDX_HEADER2_OFFSET
+	};
+	struct vhdx_file_identifier *fid;
+	struct vhdx_header *h[2] = { NULL, NULL };
+	int i, valid[2], err;
+	char *buf;
+
+	buf = vhdx_alloc(64 * VHDX_KiB);
+	if (!buf)
+		return -ENOMEM;
+
+	err = vhdx_pread(ctx->fd, buf, 64 * VHDX_KiB, 0);
+	if (err)
+		goto out;
+
+	fid = (struct vhdx_file_identifier *)buf;
+	if (fid->signature != VHDX_FILE_SIGNATURE) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < 2; i++) {
+		h[i] = vhdx_alloc(VHDX_HEADER_SIZE);
+		if (!h[i]) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		err = vhdx_pread(ctx->fd, h[i], VHDX_HEADER_SIZE, offs[i]);
+		if (err)
+			goto out;
+
+		valid[i] = !vhdx_validate_header(h[i]);
+	}
+
+	if (!valid[0] && !valid[1]) {
+		VHDXLOG("%s: no valid header\n", ctx->file);
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (valid[0] && valid[1])
+		i = h[1]->sequence_number > h[0]->sequence_number;
+	else
+		i = valid[1];
+
+	ctx->header      = *h[i];
+	ctx->header_slot = i;
+	err = 0;
+
+out:
+	free(h[0]);
+	free(h[1]);
+	free(buf);
+	return err;
+}
+
+/*
+ * Writes the header to both slots in turn, the inactive one first, so
+ * there is always a valid copy on disk. A new FileWriteGuid tells that the
+ * file has been opened for writing since, a new DataWriteGuid that the
+ * virtual disk contents may have changed, which invalidates children.
+ */
+static int
+__vhdx_update_header(vhdx_context_t *ctx, int fd, int data_write)
+{
+	struct vhdx_header *h;
+	vhdx_guid_t fguid, dguid;
+	int i, slot, err = 0;
+
+	h = vhdx_alloc(VHDX_HEADER_SIZE);
+	if (!h)
+		return -ENOMEM;
+
+	vhdx_guid_generate(&fguid);
+	dguid = ctx->header.data_write_guid;
+	if (data_write)
+		vhdx_guid_generate(&dguid);
+
+	for (i = 0; i < 2; i++) {
+		*h = ctx->header;
+		h->sequence_number++;
+		h->file_write_guid = fguid;
+		h->data_write_guid = dguid;
+		memset(&h->log_guid, 0, sizeof(h->log_guid));
+		h->checksum = 0;
+		h->checksum = vhdx_checksum(h, VHDX_HEADER_SIZE,
+					    offsetof(struct vhdx_header,
+						     checksum));
+
+		slot = !ctx->header_slot;
+		err  = vhdx_pwrite(fd, h, VHDX_HEADER_SIZE,
+				   slot ? VHDX_HEADER2_OFFSET :
+				   VHDX_HEADER1_OFFSET);
+		if (!err && fdatasync(fd))
+			err = -errno;
+		if (err)
+			break;
+
+		ctx->header      = *h;
+		ctx->header_slot = slot;
+	}
+
+	free(h);
+	return err;
+}
+
+int
+vhdx_update_header(vhdx_context_t *ctx, int data_write)
+{
+	return __vhdx_update_header(ctx, ctx->fd, data_write);
+}
+
+static int
+vhdx_region_sane(const struct vhdx_region_entry *e)
+{
+	return e->file_offset >= VHDX_HEADER_SECTION_SIZE &&
+		!(e->file_offset % VHDX_MiB) &&
+		e->length && !(e->length % VHDX_MiB);
+}
+
+static int
+vhdx_read_regions(vhdx_context_t *ctx)
+{
+	static const off64_t offs[2] = {
+		VHDX_REGION1_OFFSET, VHDX_REGION2_OFFSET
+	};
+	struct vhdx_region_table_header *th;
+	struct vhdx_region_entry *e;
+	int i, err = -EINVAL;
+	uint32_t j;
+	char *buf;
+
+	buf = vhdx_alloc(VHDX_REGION_TABLE_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < 2; i++) {
+		int bat = 0, meta = 0;
+
+		err = vhdx_pread(ctx->fd, buf, VHDX_REGION_TABLE_SIZE, offs[i]);
+		if (err)
+			break;
+
+		err = -EINVAL;
+		th  = (struct vhdx_region_table_header *)buf;
+		if (th->signature != VHDX_REGION_SIGNATURE ||
+		    th->entry_count > VHDX_REGION_MAX_ENTRIES ||
+		    th->checksum != vhdx_checksum(buf, VHDX_REGION_TABLE_SIZE,
+						  offsetof(struct vhdx_region_table_header,
+							   checksum)))
+			continue;
+
+		e = (struct vhdx_region_entry *)(th + 1);
+		for (j = 0; j < th->entry_count; j++, e++) {
+			if (vhdx_guid_equal(&e->guid, &vhdx_bat_guid)) {
+				ctx->bat_region = *e;
+				bat = 1;
+			} else if (vhdx_guid_equal(&e->guid,
+						   &vhdx_metadata_guid)) {
+				ctx->meta_region = *e;
+				meta = 1;
+			} else if (e->required & 1) {
+				VHDXLOG("%s: unknown required region\n",
+					ctx->file);
+				goto out;
+			}
+		}
+
+		if (!bat || !meta ||
+		    !vhdx_region_sane(&ctx->bat_region) ||
+		    !vhdx_region_sane(&ctx->meta_region))
+			continue;
+
+		err = 0;
+		break;
+	}
+
+	if (err)
+		VHDXLOG("%s: no valid region table\n", ctx->file);
+
+out:
+	free(buf);
+	return err;
+}
+
+/*
+ * Log replay.
+ *
+ * The log is a circular buffer of entries, each a run of 4KiB sectors: a
+ * header and descriptors, followed by one data sector per data
+ * descriptor. The active sequence is the run of consecutive entries
+ * ending at the valid entry with the highest sequence number, starting at
+ * the tail that entry records. Replaying it applies its descriptors in
+ * order.
+ */
+
+struct vhdx_log_seq {
+	uint64_t                     off;
+	uint64_t                     seq;
+	uint32_t                     len;
+	uint32_t                     tail;
+	uint64_t                     flushed;
+	uint64_t                     last;
+};
+
+static uint32_t
+vhdx_log_desc_sectors(uint32_t count)
+{
+	if (count <= VHDX_LOG_HEADER_DESCS)
+		return 1;
+
+	count -= VHDX_LOG_HEADER_DESCS;
+	return 1 + (count + VHDX_LOG_SECTOR_DESCS - 1) / VHDX_LOG_SECTOR_DESCS;
+}
+
+/*
+ * Copies the entry at @off to @entry, unwrapping it.
+ */
+static void
+vhdx_log_copy(const struct vhdx_header *h, const char *log, uint64_t off,
+	      uint32_t len, char *entry)
+{
+	uint32_t first = MIN((uint64_t)len, h->log_length - off);
+
+	memcpy(entry, log + off, first);
+	memcpy(entry + first, log, len - first);
+}
+
+static int
+vhdx_log_entry_valid(const struct vhdx_header *h, const char *log,
+		     uint64_t off, char *entry, struct vhdx_log_seq *seq)
+{
+	const struct vhdx_log_entry_header *eh;
+	const struct vhdx_log_descriptor *d;
+	const struct vhdx_log_data_sector *ds;
+	uint32_t i, len, secs, data = 0;
+
+	eh = (const struct vhdx_log_entry_header *)(log + off);
+	if (eh->signature != VHDX_LOG_SIGNATURE ||
+	    !vhdx_guid_equal(&eh->log_guid, &h->log_guid))
+		return 0;
+
+	len = eh->entry_length;
+	if (!len || len % VHDX_LOG_SECTOR_SIZE || len > h->log_length ||
+	    eh->tail % VHDX_LOG_SECTOR_SIZE || eh->tail >= h->log_length)
+		return 0;
+
+	secs = vhdx_log_desc_sectors(eh->descriptor_count);
+	if ((uint64_t)secs * VHDX_LOG_SECTOR_SIZE > len)
+		return 0;
+
+	vhdx_log_copy(h, log, off, len, entry);
+	eh = (const struct vhdx_log_entry_header *)entry;
+
+	if (eh->checksum != vhdx_checksum(entry, len,
+					  offsetof(struct vhdx_log_entry_header,
+						   checksum)))
+		return 0;
+
+	d = (const struct vhdx_log_descriptor *)(eh + 1);
+	for (i = 0; i < eh->descriptor_count; i++, d++) {
+		if (d->sequence_number != eh->sequence_number ||
+		    d->file_offset % VHDX_LOG_SECTOR_SIZE)
+			return 0;
+
+		switch (d->signature) {
+		case VHDX_LOG_ZERO_SIGNATURE:
+			if (d->leading_bytes % VHDX_LOG_SECTOR_SIZE)
+				return 0;
+			break;
+
+		case VHDX_LOG_DESC_SIGNATURE:
+			if ((uint64_t)(secs + data + 1) * VHDX_LOG_SECTOR_SIZE >
+			    len)
+				return 0;
+
+			ds = (const struct vhdx_log_data_sector *)
+				(entry + (size_t)(secs + data) *
+				 VHDX_LOG_SECTOR_SIZE);
+			if (ds->signature != VHDX_LOG_DATA_SIGNATURE ||
+			    ((uint64_t)ds->sequence_high << 32 |
+			     ds->sequence_low) != eh->sequence_number)
+				return 0;
+
+			data++;
+			break;
+
+		default:
+			return 0;
+		}
+	}
+
+	if ((uint64_t)(secs + data) * VHDX_LOG_SECTOR_SIZE != len)
+		return 0;
+
+	seq->off     = off;
+	seq->seq     = eh->sequence_number;
+	seq->len     = len;
+	seq->tail    = eh->tail;
+	seq->flushed = eh->flushed_file_offset;
+	seq->last    = eh->last_file_offset;
+
+	return 1;
+}
+
+static int
+vhdx_log_apply(int fd, const char *entry, char *sector, const char *zero)
+{
+	const struct vhdx_log_entry_header *eh;
+	const struct vhdx_log_descriptor *d;
+	const struct vhdx_log_data_sector *ds;
+	uint32_t i, secs, data = 0;
+	uint64_t off, left;
+	int err;
+
+	eh   = (const struct vhdx_log_entry_header *)entry;
+	secs = vhdx_log_desc_sectors(eh->descriptor_count);
+	d    = (const struct vhdx_log_descriptor *)(eh + 1);
+
+	for (i = 0; i < eh->descriptor_count; i++, d++) {
+		if (d->signature == VHDX_LOG_ZERO_SIGNATURE) {
+			off  = d->file_offset;
+			left = d->leading_bytes;
+			while (left) {
+				size_t n = MIN(left, VHDX_MiB);
+				err = vhdx_pwrite(fd, zero, n, off);
+				if (err)
+					return err;
+				off  += n;
+				left -= n;
+			}
+			continue;
+		}
+
+		ds = (const struct vhdx_log_data_sector *)
+			(entry + (size_t)(secs + data++) * VHDX_LOG_SECTOR_SIZE);
+
+		memcpy(sector, &d->leading_bytes, 8);
+		memcpy(sector + 8, ds->data, sizeof(ds->data));
+		memcpy(sector + 8 + sizeof(ds->data), &d->trailing_bytes, 4);
+
+		err = vhdx_pwrite(fd, sector, VHDX_LOG_SECTOR_SIZE,
+				  d->file_offset);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int
+vhdx_log_seq_compare(const void *a, const void *b)
+{
+	const struct vhdx_log_seq *x = a, *y = b;
+
+	if (x->seq == y->seq)
+		return 0;
+	return x->seq < y->seq ? 1 : -1;
+}
+
+static int
+vhdx_replay_log(vhdx_context_t *ctx, int fd)
+{
+	const struct vhdx_header *h = &ctx->header;
+	struct vhdx_log_seq *seqs = NULL, *head = NULL, **chain = NULL;
+	char *log = NULL, *entry = NULL, *sector = NULL, *zero = NULL;
+	uint64_t off, nslots;
+	int *slot = NULL;
+	int i, n = 0, len = 0, err;
+	struct stat st;
+
+	if (!h->log_length || h->log_length > VHDX_LOG_MAX_SIZE) {
+		VHDXLOG("%s: unsupported log size %u\n",
+			ctx->file, h->log_length);
+		return -EINVAL;
+	}
+
+	nslots = h->log_length / VHDX_LOG_SECTOR_SIZE;
+	err    = -ENOMEM;
+
+	log    = vhdx_alloc(h->log_length);
+	entry  = vhdx_alloc(h->log_length);
+	sector = vhdx_alloc(VHDX_LOG_SECTOR_SIZE);
+	zero   = vhdx_alloc(VHDX_MiB);
+	seqs   = calloc(nslots, sizeof(*seqs));
+	chain  = calloc(nslots, sizeof(*chain));
+	slot   = malloc(nslots * sizeof(*slot));
+	if (!log || !entry || !sector || !zero || !seqs || !chain || !slot)
+		goto out;
+
+	err = vhdx_pread(fd, log, h->log_length, h->log_offset);
+	if (err)
+		goto out;
+
+	for (off = 0; off < h->log_length; off += VHDX_LOG_SECTOR_SIZE)
+		if (vhdx_log_entry_valid(h, log, off, entry, &seqs[n]))
+			n++;
+
+	qsort(seqs, n, sizeof(*seqs), vhdx_log_seq_compare);
+
+	for (off = 0; off < nslots; off++)
+		slot[off] = -1;
+	for (i = 0; i < n; i++)
+		slot[seqs[i].off / VHDX_LOG_SECTOR_SIZE] = i;
+
+	/*
+	 * Find the newest entry whose sequence is complete.
+	 */
+	for (i = 0; i < n && !head; i++) {
+		struct vhdx_log_seq *e;
+		int s;
+
+		off = seqs[i].tail;
+		len = 0;
+
+		while (len < n) {
+			s = slot[off / VHDX_LOG_SECTOR_SIZE];
+			if (s < 0)
+				break;
+
+			e = &seqs[s];
+			if (e->seq > seqs[i].seq ||
+			    (len && e->seq != chain[len - 1]->seq + 1))
+				break;
+
+			chain[len++] = e;
+			if (e == &seqs[i]) {
+				head = e;
+				break;
+			}
+
+			off = (off + e->len) % h->log_length;
+		}
+	}
+
+	if (!head) {
+		VHDXLOG("%s: log holds no complete sequence\n", ctx->file);
+		err = 0;
+		goto out;
+	}
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+		goto out;
+	}
+
+	if ((uint64_t)st.st_size < head->flushed) {
+		VHDXLOG("%s: file is shorter than the log says it was flushed "
+			"to (%"PRIu64" < %"PRIu64")\n",
+			ctx->file, (uint64_t)st.st_size, head->flushed);
+		err = -EINVAL;
+		goto out;
+	}
+
+	VHDXLOG("%s: replaying %d log entries up to sequence %"PRIu64"\n",
+		ctx->file, len, head->seq);
+
+	for (i = 0; i < len; i++) {
+		vhdx_log_copy(h, log, chain[i]->off, chain[i]->len, entry);
+		err = vhdx_log_apply(fd, entry, sector, zero);
+		if (err)
+			goto out;
+	}
+
+	if ((uint64_t)st.st_size < head->last &&
+	    ftruncate(fd, head->last)) {
+		err = -errno;
+		goto out;
+	}
+
+	if (fdatasync(fd)) {
+		err = -errno;
+		goto out;
+	}
+
+	ctx->log_replayed = 1;
+	err = 0;
+
+out:
+	free(slot);
+	free(chain);
+	free(seqs);
+	free(zero);
+	free(sector);
+	free(entry);
+	free(log);
+	return err;
+}
+
+/*
+ * Replays the log, if any, and marks it empty. Read-only opens need to
+ * get write access for this, much like a journal has to be recovered
+ * before a filesystem can be mounted read-only.
+ */
+static int
+vhdx_recover(vhdx_context_t *ctx)
+{
+	int fd = ctx->fd, err;
+
+	if (vhdx_guid_is_zero(&ctx->header.log_guid))
+		return 0;
+
+	if (ctx->oflags & VHDX_OPEN_NOREPLAY) {
+		ctx->log_dirty = 1;
+		return 0;
+	}
+
+	if (ctx->oflags & VHDX_OPEN_RDONLY) {
+		fd = open_optional_odirect(ctx->file,
+					   O_RDWR | O_DIRECT | O_LARGEFILE);
+		if (fd == -1)
+			return -errno;
+	}
+
+	err = vhdx_replay_log(ctx, fd);
+	if (!err)
+		err = __vhdx_update_header(ctx, fd, 1);
+
+	if (fd != ctx->fd)
+		close(fd);
+
+	return err;
+}
+
+static int
+vhdx_resolve_parent(vhdx_context_t *ctx, const char *relative,
+		    const char *absolute)
+{
+	char __cpath[PATH_MAX], __location[PATH_MAX];
+	const char *names[2] = { relative, absolute };
+	char *cpath, *cdir, *location, *p;
+	int i, err = -ENOENT;
+
+	cpath = canonpath(ctx->file, __cpath, sizeof(__cpath));
+	if (!cpath)
+		return -errno;
+	cdir = dirname(cpath);
+
+	for (i = 0; i < 2; i++) {
+		if (!names[i])
+			continue;
+
+		if (names[i][0] == '/' || names[i][0] == '\\') {
+			location = strdup(names[i]);
+			if (!location)
+				return -ENOMEM;
+		} else if (asprintf(&location, "%s/%s", cdir, names[i]) == -1)
+			return -ENOMEM;
+
+		for (p = location; *p; p++)
+			if (*p == '\\')
+				*p = '/';
+
+		if (access(location, R_OK)) {
+			if (!ctx->parent)
+				ctx->parent = location;
+			else
+				free(location);
+			continue;
+		}
+
+		p = canonpath(location, __location, sizeof(__location));
+		free(ctx->parent);
+		ctx->parent = strdup(p ? p : location);
+		free(location);
+		err = ctx->parent ? 0 : -ENOMEM;
+		break;
+	}
+
+	/*
+	 * Leave a name to complain about when the parent is opened.
+	 */
+	if (ctx->parent && err == -ENOENT)
+		err = 0;
+
+	return err;
+}
+
+static int
+vhdx_parse_parent_locator(vhdx_context_t *ctx, const char *loc, uint32_t len)
+{
+	const struct vhdx_parent_locator_header *lh;
+	const struct vhdx_parent_locator_entry *le;
+	char *relative = NULL, *absolute = NULL;
+	char *key = NULL, *val = NULL;
+	int i, err = -EINVAL;
+
+	if (len < sizeof(*lh))
+		return -EINVAL;
+
+	lh = (const struct vhdx_parent_locator_header *)loc;
+	if (!vhdx_guid_equal(&lh->locator_type, &vhdx_locator_type_guid) ||
+	    sizeof(*lh) + (uint64_t)lh->key_value_count * sizeof(*le) > len)
+		return -EINVAL;
+
+	le = (const struct vhdx_parent_locator_entry *)(lh + 1);
+	for (i = 0; i < lh->key_value_count; i++, le++) {
+		if ((uint64_t)le->key_offset + le->key_length > len ||
+		    (uint64_t)le->value_offset + le->value_length > len)
+			goto out;
+
+		key = vhdx_utf16_to_ascii((const uint8_t *)loc +
+					  le->key_offset, le->key_length);
+		val = vhdx_utf16_to_ascii((const uint8_t *)loc +
+					  le->value_offset, le->value_length);
+		if (!key || !val)
+			goto out;
+
+		if (!strcmp(key, "parent_linkage")) {
+			free(ctx->parent_linkage);
+			ctx->parent_linkage = val;
+			val = NULL;
+		} else if (!strcmp(key, "relative_path")) {
+			free(relative);
+			relative = val;
+			val = NULL;
+		} else if (!strcmp(key, "absolute_win32_path")) {
+			free(absolute);
+			absolute = val;
+			val = NULL;
+		}
+
+		free(key);
+		free(val);
+		key = val = NULL;
+	}
+
+	if (!ctx->parent_linkage || (!relative && !absolute))
+		goto out;
+
+	err = vhdx_resolve_parent(ctx, relative, absolute);
+
+out:
+	if (err)
+		VHDXLOG("%s: bad parent locator\n", ctx->file);
+	free(key);
+	free(val);
+	free(relative);
+	free(absolute);
+	return err;
+}
+
+static int
+vhdx_read_metadata(vhdx_context_t *ctx)
+{
+	struct vhdx_metadata_table_header *th;
+	struct vhdx_metadata_entry *e;
+	int have_params = 0, have_size = 0, have_lss = 0, have_loc = 0;
+	uint32_t len = ctx->meta_region.length, i;
+	char *buf, *item;
+	int err;
+
+	buf = vhdx_alloc(len);
+	if (!buf)
+		return -ENOMEM;
+
+	err = vhdx_pread(ctx->fd, buf, len, ctx->meta_region.file_offset);
+	if (err)
+		goto out;
+
+	err = -EINVAL;
+	th  = (struct vhdx_metadata_table_header *)buf;
+	if (th->signature != VHDX_METADATA_SIGNATURE ||
+	    th->entry_count > VHDX_METADATA_MAX_ENTRIES)
+		goto out;
+
+	ctx->physical_sector_size = 512;
+
+	e = (struct vhdx_metadata_entry *)(th + 1);
+	for (i = 0; i < th->entry_count; i++, e++) {
+		if (e->length &&
+		    (e->offset < VHDX_META_ITEMS_OFFSET ||
+		     (uint64_t)e->offset + e->length > len))
+			goto out;
+
+		item = buf + e->offset;
+
+#define META_ITEM(_guid, _min)						\
+	(vhdx_guid_equal(&e->item_id, &(_guid)) && e->length >= (_min))
+
+		if (META_ITEM(vhdx_file_parameters_guid,
+			      sizeof(struct vhdx_file_parameters))) {
+			struct vhdx_file_parameters *p = (void *)item;
+			ctx->block_size   = p->block_size;
+			ctx->params_flags = p->flags;
+			have_params = 1;
+		} else if (META_ITEM(vhdx_disk_size_guid, sizeof(uint64_t))) {
+			memcpy(&ctx->size, item, sizeof(uint64_t));
+			have_size = 1;
+		} else if (META_ITEM(vhdx_page83_guid, sizeof(vhdx_guid_t))) {
+			memcpy(&ctx->disk_id, item, sizeof(vhdx_guid_t));
+		} else if (META_ITEM(vhdx_logical_sector_guid,
+				     sizeof(uint32_t))) {
+			memcpy(&ctx->logical_sector_size, item,
+			       sizeof(uint32_t));
+			have_lss = 1;
+		} else if (META_ITEM(vhdx_physical_sector_guid,
+				     sizeof(uint32_t))) {
+			memcpy(&ctx->physical_sector_size, item,
+			       sizeof(uint32_t));
+		} else if (vhdx_guid_equal(&e->item_id,
+					   &vhdx_parent_locator_guid)) {
+			have_loc = 1;
+			err = vhdx_parse_parent_locator(ctx, item, e->length);
+			if (err)
+				goto out;
+			err = -EINVAL;
+		} else if (e->flags & VHDX_META_IS_REQUIRED) {
+			VHDXLOG("%s: unknown required metadata item\n",
+				ctx->file);
+			goto out;
+		}
+
+#undef META_ITEM
+	}
+
+	if (!have_params || !have_size || !have_lss)
+		goto out;
+
+	if (ctx->block_size < VHDX_MIN_BLOCK_SIZE ||
+	    ctx->block_size > VHDX_MAX_BLOCK_SIZE ||
+	    (ctx->block_size & (ctx->block_size - 1)))
+		goto out;
+
+	if ((ctx->logical_sector_size != 512 &&
+	     ctx->logical_sector_size != 4096) ||
+	    (ctx->physical_sector_size != 512 &&
+	     ctx->physical_sector_size != 4096))
+		goto out;
+
+	if (!ctx->size || ctx->size > VHDX_MAX_SIZE ||
+	    ctx->size % ctx->logical_sector_size)
+		goto out;
+
+	if (vhdx_has_parent(ctx) && !have_loc)
+		goto out;
+
+	err = 0;
+
+out:
+	if (err == -EINVAL)
+		VHDXLOG("%s: bad metadata\n", ctx->file);
+	free(buf);
+	return err;
+}
+
+static void
+vhdx_geometry(uint64_t size, uint32_t block_size, uint32_t lss,
+	      int has_parent, uint32_t *chunk_ratio, uint64_t *data_blocks,
+	      uint64_t *bitmap_blocks, uint64_t *entries)
+{
+	*chunk_ratio   = ((1ULL << 23) * lss) / block_size;
+	*data_blocks   = (size + block_size - 1) / block_size;
+	*bitmap_blocks = (*data_blocks + *chunk_ratio - 1) / *chunk_ratio;
+
+	if (has_parent)
+		*entries = *bitmap_blocks * (*chunk_ratio + 1);
+	else
+		*entries = *data_blocks + (*data_blocks - 1) / *chunk_ratio;
+}
+
+static int
+vhdx_read_bat(vhdx_context_t *ctx)
+{
+	uint64_t len = ctx->bat_region.length;
+	int err;
+
+	vhdx_geometry(ctx->size, ctx->block_size, ctx->logical_sector_size,
+		      vhdx_has_parent(ctx), &ctx->chunk_ratio,
+		      &ctx->data_blocks, &ctx->bitmap_blocks,
+		      &ctx->bat_entries);
+
+	if (ctx->bat_entries * sizeof(uint64_t) > len) {
+		VHDXLOG("%s: BAT region too small\n", ctx->file);
+		return -EINVAL;
+	}
+
+	ctx->bat = vhdx_alloc(len);
+	if (!ctx->bat)
+		return -ENOMEM;
+
+	err = vhdx_pread(ctx->fd, ctx->bat, len, ctx->bat_region.file_offset);
+	if (err)
+		return err;
+
+	return 0;
+}
+
+int
+vhdx_open(vhdx_context_t *ctx, const char *file, int flags)
+{
+	int err, oflags;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fd     = -1;
+	ctx->oflags = flags;
+
+	ctx->file = strdup(file);
+	if (!ctx->file)
+		return -ENOMEM;
+
+	oflags = O_DIRECT | O_LARGEFILE;
+	oflags |= (flags & VHDX_OPEN_RDONLY) ? O_RDONLY : O_RDWR;
+
+	ctx->fd = open_optional_odirect(file, oflags);
+	if (ctx->fd == -1) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = vhdx_read_headers(ctx);
+	if (err)
+		goto fail;
+
+	err = vhdx_read_regions(ctx);
+	if (err)
+		goto fail;
+
+	err = vhdx_recover(ctx);
+	if (err)
+		goto fail;
+
+	err = vhdx_read_metadata(ctx);
+	if (err)
+		goto fail;
+
+	err = vhdx_read_bat(ctx);
+	if (err)
+		goto fail;
+
+	return 0;
+
+fail:
+	vhdx_close(ctx);
+	return err;
+}
+
+void
+vhdx_close(vhdx_context_t *ctx)
+{
+	if (ctx->fd != -1)
+		close(ctx->fd);
+	free(ctx->bat);
+	free(ctx->parent);
+	free(ctx->parent_linkage);
+	free(ctx->file);
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fd = -1;
+}
+
+/*
+ * Fills in the parent locator of a new child of @parent, returning its
+ * length.
+ */
+static int
+vhdx_build_parent_locator(const char *child, vhdx_context_t *parent,
+			  char *loc, size_t size)
+{
+	struct vhdx_parent_locator_header *lh;
+	struct vhdx_parent_locator_entry *le;
+	char linkage[40], *relative, *p;
+	const char *kv[4];
+	uint32_t off;
+	int i, n, err;
+
+	relative = relative_path_to((char *)child, parent->file, &err);
+	if (!relative || err)
+		return err ? err : -EINVAL;
+
+	for (p = relative; *p; p++)
+		if (*p == '/')
+			*p = '\\';
+
+	vhdx_guid_to_string(&parent->header.data_write_guid, linkage);
+
+	kv[0] = "parent_linkage";
+	kv[1] = linkage;
+	kv[2] = "relative_path";
+	kv[3] = relative;
+
+	lh = (struct vhdx_parent_locator_header *)loc;
+	lh->locator_type    = vhdx_locator_type_guid;
+	lh->key_value_count = 2;
+
+	le  = (struct vhdx_parent_locator_entry *)(lh + 1);
+	off = sizeof(*lh) + 2 * sizeof(*le);
+
+	for (i = 0; i < 4; i++) {
+		if (off + 2 * strlen(kv[i]) > size) {
+			err = -ENAMETOOLONG;
+			goto out;
+		}
+
+		n = vhdx_ascii_to_utf16(kv[i], (uint8_t *)loc + off);
+		if (n < 0) {
+			err = n;
+			goto out;
+		}
+
+		if (i & 1) {
+			le[i / 2].value_offset = off;
+			le[i / 2].value_length = n;
+		} else {
+			le[i / 2].key_offset = off;
+			le[i / 2].key_length = n;
+		}
+		off += n;
+	}
+
+	err = off;
+
+out:
+	free(relative);
+	return err;
+}
+
+/*
+ * Appends an item to the metadata region; a NULL @item was built in place.
+ */
+static void
+vhdx_add_metadata(char *meta, const vhdx_guid_t *guid, uint32_t *off,
+		  const void *item, uint32_t len, uint32_t flags)
+{
+	struct vhdx_metadata_table_header *th = (void *)meta;
+	struct vhdx_metadata_entry *e;
+
+	e = (struct vhdx_metadata_entry *)(th + 1) + th->entry_count++;
+	e->item_id = *guid;
+	e->offset  = *off;
+	e->length  = len;
+	e->flags   = flags;
+
+	if (item)
+		memcpy(meta + *off, item, len);
+	*off += VHDX_ALIGN(len, 8);
+}
+
+int
+vhdx_create(const char *name, uint64_t bytes, uint32_t block_size,
+	    uint32_t lss, const char *parent)
+{
+	struct vhdx_file_identifier *fid;
+	struct vhdx_region_table_header *th;
+	struct vhdx_region_entry *re;
+	struct vhdx_file_parameters params;
+	struct vhdx_header *h;
+	vhdx_context_t pctx;
+	uint64_t data_blocks, bitmap_blocks, entries, bat_len;
+	uint32_t chunk_ratio, pss, off;
+	char *buf = NULL, *meta = NULL;
+	int i, fd = -1, err;
+	vhdx_guid_t disk_id;
+
+	memset(&pctx, 0, sizeof(pctx));
+	pctx.fd = -1;
+
+	if (!block_size)
+		block_size = VHDX_DEFAULT_BLOCK_SIZE;
+
+	if (parent) {
+		err = vhdx_open(&pctx, parent, VHDX_OPEN_RDONLY);
+		if (err)
+			return err;
+
+		if (bytes && bytes != pctx.size) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		if (lss && lss != pctx.logical_sector_size) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		bytes = pctx.size;
+		lss   = pctx.logical_sector_size;
+	}
+
+	if (!lss)
+		lss = 512;
+	pss = 4096;
+
+	err = -EINVAL;
+	if (block_size < VHDX_MIN_BLOCK_SIZE ||
+	    block_size > VHDX_MAX_BLOCK_SIZE ||
+	    (block_size & (block_size - 1)))
+		goto out;
+
+	if (lss != 512 && lss != 4096)
+		goto out;
+
+	if (!bytes || bytes > VHDX_MAX_SIZE || bytes % lss)
+		goto out;
+
+	vhdx_geometry(bytes, block_size, lss, !!parent, &chunk_ratio,
+		      &data_blocks, &bitmap_blocks, &entries);
+	bat_len = VHDX_ALIGN(entries * sizeof(uint64_t), VHDX_MiB);
+	if (bat_len > UINT32_MAX)
+		goto out;
+
+	err = -ENOMEM;
+	buf  = vhdx_alloc(VHDX_HEADER_SECTION_SIZE);
+	meta = vhdx_alloc(VHDX_MiB);
+	if (!buf || !meta)
+		goto out;
+
+	fd = open(name, O_CREAT | O_EXCL | O_RDWR | O_LARGEFILE, 0644);
+	if (fd == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	/* header section */
+	fid = (struct vhdx_file_identifier *)buf;
+	fid->signature = VHDX_FILE_SIGNATURE;
+	vhdx_ascii_to_utf16(vhdx_creator, (uint8_t *)fid->creator);
+
+	h = (struct vhdx_header *)(buf + VHDX_HEADER1_OFFSET);
+	h->signature  = VHDX_HEADER_SIGNATURE;
+	h->version    = 1;
+	h->log_offset = VHDX_HEADER_SECTION_SIZE;
+	h->log_length = VHDX_LOG_DEFAULT_SIZE;
+	vhdx_guid_generate(&h->file_write_guid);
+	vhdx_guid_generate(&h->data_write_guid);
+
+	for (i = 0; i < 2; i++) {
+		h = (struct vhdx_header *)
+			(buf + (i ? VHDX_HEADER2_OFFSET : VHDX_HEADER1_OFFSET));
+		if (i)
+			memcpy(h, buf + VHDX_HEADER1_OFFSET, sizeof(*h));
+		h->sequence_number = i;
+		h->checksum = vhdx_checksum(h, VHDX_HEADER_SIZE,
+					    offsetof(struct vhdx_header,
+						     checksum));
+	}
+
+	for (i = 0; i < 2; i++) {
+		th = (struct vhdx_region_table_header *)
+			(buf + (i ? VHDX_REGION2_OFFSET : VHDX_REGION1_OFFSET));
+		th->signature   = VHDX_REGION_SIGNATURE;
+		th->entry_count = 2;
+
+		re = (struct vhdx_region_entry *)(th + 1);
+		re[0].guid        = vhdx_bat_guid;
+		re[0].file_offset = 3 * VHDX_MiB;
+		re[0].length      = bat_len;
+		re[0].required    = 1;
+		re[1].guid        = vhdx_metadata_guid;
+		re[1].file_offset = 2 * VHDX_MiB;
+		re[1].length      = VHDX_MiB;
+		re[1].required    = 1;
+
+		th->checksum = vhdx_checksum(th, VHDX_REGION_TABLE_SIZE,
+					     offsetof(struct vhdx_region_table_header,
+						      checksum));
+	}
+
+	/* metadata */
+	((struct vhdx_metadata_table_header *)meta)->signature =
+		VHDX_METADATA_SIGNATURE;
+	off = VHDX_META_ITEMS_OFFSET;
+
+	params.block_size = block_size;
+	params.flags      = parent ? VHDX_PARAMS_HAS_PARENT : 0;
+	vhdx_guid_generate(&disk_id);
+
+	vhdx_add_metadata(meta, &vhdx_file_parameters_guid, &off,
+			  &params, sizeof(params), VHDX_META_IS_REQUIRED);
+	vhdx_add_metadata(meta, &vhdx_disk_size_guid, &off,
+			  &bytes, sizeof(bytes),
+			  VHDX_META_IS_VIRTUAL_DISK | VHDX_META_IS_REQUIRED);
+	vhdx_add_metadata(meta, &vhdx_page83_guid, &off,
+			  &disk_id, sizeof(disk_id),
+			  VHDX_META_IS_VIRTUAL_DISK | VHDX_META_IS_REQUIRED);
+	vhdx_add_metadata(meta, &vhdx_logical_sector_guid, &off,
+			  &lss, sizeof(lss),
+			  VHDX_META_IS_VIRTUAL_DISK | VHDX_META_IS_REQUIRED);
+	vhdx_add_metadata(meta, &vhdx_physical_sector_guid, &off,
+			  &pss, sizeof(pss),
+			  VHDX_META_IS_VIRTUAL_DISK | VHDX_META_IS_REQUIRED);
+
+	if (parent) {
+		int len;
+
+		len = vhdx_build_parent_locator(name, &pctx, meta + off,
+						VHDX_MiB - off);
+		if (len < 0) {
+			err = len;
+			goto fail;
+		}
+
+		vhdx_add_metadata(meta, &vhdx_parent_locator_guid, &off,
+				  NULL, len, VHDX_META_IS_REQUIRED);
+	}
+
+	err = vhdx_pwrite(fd, buf, VHDX_HEADER_SECTION_SIZE, 0);
+	if (err)
+		goto fail;
+
+	err = vhdx_pwrite(fd, meta, VHDX_MiB, 2 * VHDX_MiB);
+	if (err)
+		goto fail;
+
+	/* an empty log and an empty BAT read as zeroes */
+	if (ftruncate(fd, 3 * VHDX_MiB + bat_len) || fsync(fd)) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = 0;
+	goto out;
+
+fail:
+	unlink(name);
+out:
+	if (fd != -1)
+		close(fd);
+	free(meta);
+	free(buf);
+	if (parent)
+		vhdx_close(&pctx);
+	return err;
+}
+
+int
+vhdx_snapshot(const char *name, const char *parent, uint32_t block_size)
+{
+	return vhdx_create(name, 0, block_size, 0, parent);
+}
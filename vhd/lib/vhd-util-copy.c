@@ -38,7 +38,9 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -46,6 +48,9 @@
 
 #include "libvhd.h"
 
+#define VHD_COPY_THREADS          4
+#define VHD_COPY_MAX_THREADS      64
+
 typedef int (*vhd_calculate_keyhash)(struct vhd_keyhash *keyhash,
 					     const uint8_t *key, size_t key_byte);
 typedef int (*vhd_open_crypto)(vhd_context_t *, const uint8_t *, size_t,
@@ -137,8 +142,519 @@ done:
 	return err;
 }
 
+/*
+ * Parallel copy.
+ *
+ * The target layout is fixed up front: blocks are placed exactly where
+ * the serial copy would have allocated them, in BAT order, so that
+ * workers can then fill them in any order with positioned I/O. Blocks
+ * are handed out one at a time to a pool of threads, each with its own
+ * source context (libvhd I/O goes through the file position) and its
+ * own cipher state.
+ *
+ * Sectors absent from a dynamic source read as zeroes and are left as
+ * holes. Without encryption, present sectors move with
+ * copy_file_range, which lets the filesystem share extents.
+ */
+struct vhd_copy {
+	vhd_context_t            *source;
+	vhd_context_t            *target;
+	const char               *target_name;
+	const uint8_t            *key;
+	int                       key_size;
+
+	int                       src_fd;
+	int                       dst_fd;
+	int                       chain;
+	int                       splice;
+	char                     *bitmap;
+
+	pthread_mutex_t           lock;
+	uint32_t                  next;
+	int                       err;
+};
+
+struct vhd_copy_worker {
+	struct vhd_copy          *copy;
+	pthread_t                 thread;
+	int                       started;
+
+	vhd_context_t             source;
+	vhd_context_t             crypt;
+	char                     *buf;
+};
+
+static int
+vhd_copy_layout(vhd_context_t *source, vhd_context_t *target)
+{
+	uint64_t max, spp;
+	off64_t end;
+	uint32_t i;
+	int err;
+
+	err = vhd_get_bat(target);
+	if (err)
+		return err;
+
+	err = vhd_end_of_data(target, &end);
+	if (err)
+		return err;
+
+	spp = getpagesize() >> VHD_SECTOR_SHIFT;
+	max = end >> VHD_SECTOR_SHIFT;
+
+	for (i = 0; i < source->bat.entries; i++) {
+		if (source->bat.bat[i] == DD_BLK_UNUSED)
+			continue;
+
+		/* as __vhd_io_allocate_block: page-aligned data */
+		if ((max + target->bm_secs) % spp)
+			max += spp - ((max + target->bm_secs) % spp);
+
+		if (max > UINT32_MAX)
+			return -EIO;
+
+		target->bat.bat[i] = max;
+		max += target->bm_secs + target->spb;
+	}
+
+	return 0;
+}
+
+static int
+vhd_copy_pread(int fd, char *buf, size_t size, off64_t off)
+{
+	ssize_t n;
+
+	while (size) {
+		n = pread(fd, buf, size, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (!n) {
+			/* past the end of a truncated source */
+			memset(buf, 0, size);
+			break;
+		}
+
+		buf  += n;
+		off  += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+static int
+vhd_copy_pwrite(int fd, const char *buf, size_t size, off64_t off)
+{
+	ssize_t n;
+
+	while (size) {
+		n = pwrite(fd, buf, size, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf  += n;
+		off  += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Copies @size bytes from @src in the source to @dst in the target,
+ * file to file. Returns 1 if the kernel cannot do it for these files.
+ */
+static int
+vhd_copy_splice(struct vhd_copy *copy, off64_t src, off64_t dst, size_t size)
+{
+	loff_t in = src, out = dst;
+	ssize_t n;
+
+	while (size) {
+		n = copy_file_range(copy->src_fd, &in, copy->dst_fd, &out,
+				    size, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOSYS || errno == EXDEV ||
+			    errno == EINVAL || errno == EOPNOTSUPP) {
+				if (in != src)
+					return -EIO;
+				copy->splice = 0;
+				return 1;
+			}
+			return -errno;
+		}
+
+		if (!n)
+			break;
+
+		size -= n;
+	}
+
+	return 0;
+}
+
 static int
-copy_vhd(const char *name, const char *new_name, int key_size, const uint8_t *encryption_key)
+vhd_copy_block_data(struct vhd_copy_worker *w, uint32_t blk, char *map)
+{
+	struct vhd_copy *copy = w->copy;
+	vhd_context_t *source = copy->source;
+	off64_t src, dst;
+	uint32_t i, j;
+	size_t size;
+	int err;
+
+	src = vhd_sectors_to_bytes(source->bat.bat[blk] + source->bm_secs);
+	dst = vhd_sectors_to_bytes(copy->target->bat.bat[blk] +
+				   copy->target->bm_secs);
+
+	for (i = 0; i < source->spb; i = j) {
+		for (; i < source->spb; i++)
+			if (vhd_bitmap_test(source, map, i))
+				break;
+
+		for (j = i; j < source->spb; j++)
+			if (!vhd_bitmap_test(source, map, j))
+				break;
+
+		if (i == j)
+			break;
+
+		size = vhd_sectors_to_bytes(j - i);
+
+		if (copy->splice) {
+			err = vhd_copy_splice(copy,
+					      src + vhd_sectors_to_bytes(i),
+					      dst + vhd_sectors_to_bytes(i),
+					      size);
+			if (err <= 0) {
+				if (err)
+					return err;
+				continue;
+			}
+		}
+
+		err = vhd_copy_pread(copy->src_fd, w->buf, size,
+				     src + vhd_sectors_to_bytes(i));
+		if (err)
+			return err;
+
+		err = vhd_copy_pwrite(copy->dst_fd, w->buf, size,
+				      dst + vhd_sectors_to_bytes(i));
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int
+vhd_copy_block_read(struct vhd_copy_worker *w, uint32_t blk, char *map)
+{
+	struct vhd_copy *copy = w->copy;
+	vhd_context_t *source = &w->source;
+	uint64_t sec, secs, end;
+	off64_t dst;
+	uint32_t i, j;
+	int err;
+
+	sec  = (uint64_t)blk * source->spb;
+	end  = source->footer.curr_size >> VHD_SECTOR_SHIFT;
+	secs = MIN(source->spb, end - sec);
+
+	memset(w->buf + vhd_sectors_to_bytes(secs), 0,
+	       vhd_sectors_to_bytes(source->spb - secs));
+
+	err = vhd_io_read(source, w->buf, sec, secs);
+	if (err)
+		return err;
+
+	if (w->crypt.xts_tfm)
+		for (i = 0; i < source->spb; i++) {
+			char *p = w->buf + vhd_sectors_to_bytes(i);
+
+			if (vhd_bitmap_test(source, map, i))
+				pvhd_crypto_encrypt_block(&w->crypt, sec + i,
+							  (uint8_t *)p,
+							  (uint8_t *)p,
+							  VHD_SECTOR_SIZE);
+		}
+
+	dst = vhd_sectors_to_bytes(copy->target->bat.bat[blk] +
+				   copy->target->bm_secs);
+
+	if (copy->chain)
+		return vhd_copy_pwrite(copy->dst_fd, w->buf,
+				       vhd_sectors_to_bytes(source->spb), dst);
+
+	for (i = 0; i < source->spb; i = j) {
+		for (; i < source->spb; i++)
+			if (vhd_bitmap_test(source, map, i))
+				break;
+
+		for (j = i; j < source->spb; j++)
+			if (!vhd_bitmap_test(source, map, j))
+				break;
+
+		if (i == j)
+			break;
+
+		err = vhd_copy_pwrite(copy->dst_fd,
+				      w->buf + vhd_sectors_to_bytes(i),
+				      vhd_sectors_to_bytes(j - i),
+				      dst + vhd_sectors_to_bytes(i));
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int
+vhd_copy_block(struct vhd_copy_worker *w, uint32_t blk)
+{
+	struct vhd_copy *copy = w->copy;
+	vhd_context_t *source = copy->source;
+	int err, full;
+	char *map;
+	uint32_t i;
+
+	err = vhd_read_bitmap(&w->source, blk, &map);
+	if (err)
+		return err;
+
+	for (full = 1, i = 0; i < source->spb; i++)
+		if (!vhd_bitmap_test(source, map, i)) {
+			full = 0;
+			break;
+		}
+
+	/*
+	 * Unless the parent chain may fill in the gaps, or the data is to
+	 * be encrypted, the source block can be taken as it is on disk.
+	 */
+	if (!w->crypt.xts_tfm && (full || !copy->chain))
+		err = vhd_copy_block_data(w, blk, map);
+	else
+		err = vhd_copy_block_read(w, blk, map);
+	free(map);
+	if (err)
+		return err;
+
+	/* every sector of a copied block is written, as by vhd_io_write */
+	return vhd_copy_pwrite(copy->dst_fd, copy->bitmap,
+			       vhd_sectors_to_bytes(copy->target->bm_secs),
+			       vhd_sectors_to_bytes(copy->target->bat.bat[blk]));
+}
+
+static void *
+vhd_copy_worker_run(void *arg)
+{
+	struct vhd_copy_worker *w = arg;
+	struct vhd_copy *copy = w->copy;
+	uint32_t blk;
+	int err;
+
+	for (;;) {
+		pthread_mutex_lock(&copy->lock);
+		while (copy->next < copy->source->bat.entries &&
+		       copy->source->bat.bat[copy->next] == DD_BLK_UNUSED)
+			copy->next++;
+		blk = copy->next++;
+		err = copy->err;
+		pthread_mutex_unlock(&copy->lock);
+
+		if (err || blk >= copy->source->bat.entries)
+			break;
+
+		err = vhd_copy_block(w, blk);
+		if (err) {
+			printf("Failed to copy block %u: %d\n", blk, err);
+			pthread_mutex_lock(&copy->lock);
+			if (!copy->err)
+				copy->err = err;
+			pthread_mutex_unlock(&copy->lock);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+vhd_copy_worker_free(struct vhd_copy_worker *w)
+{
+	if (w->source.file)
+		vhd_close(&w->source);
+	if (w->crypt.file)
+		vhd_close(&w->crypt);
+	free(w->buf);
+}
+
+static int
+vhd_copy_worker_init(struct vhd_copy_worker *w, struct vhd_copy *copy)
+{
+	int err;
+
+	memset(w, 0, sizeof(*w));
+	w->copy = copy;
+
+	err = posix_memalign((void **)&w->buf, 4096,
+			     copy->source->header.block_size);
+	if (err) {
+		w->buf = NULL;
+		return -err;
+	}
+
+	err = vhd_open(&w->source, copy->source->file, VHD_OPEN_RDONLY);
+	if (err)
+		goto fail;
+
+	err = vhd_get_bat(&w->source);
+	if (err)
+		goto fail;
+
+	if (copy->key) {
+		err = vhd_open(&w->crypt, copy->target_name, VHD_OPEN_RDONLY);
+		if (err)
+			goto fail;
+
+		err = pvhd_open_crypto(&w->crypt, copy->key, copy->key_size,
+				       copy->target_name);
+		if (err)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	vhd_copy_worker_free(w);
+	return err;
+}
+
+static int
+vhd_copy_blocks(vhd_context_t *source, vhd_context_t *target,
+		const char *new_name, int key_size, const uint8_t *key,
+		int threads)
+{
+	struct vhd_copy_worker *workers;
+	struct vhd_copy copy;
+	int i, err;
+
+	memset(&copy, 0, sizeof(copy));
+	copy.source      = source;
+	copy.target      = target;
+	copy.target_name = new_name;
+	copy.key         = key;
+	copy.key_size    = key_size;
+	copy.chain       = source->footer.type == HD_TYPE_DIFF;
+	copy.splice      = 1;
+	copy.src_fd      = -1;
+	copy.dst_fd      = -1;
+	pthread_mutex_init(&copy.lock, NULL);
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+
+	err = vhd_copy_layout(source, target);
+	if (err)
+		goto out;
+
+	err = posix_memalign((void **)&copy.bitmap, VHD_SECTOR_SIZE,
+			     vhd_sectors_to_bytes(target->bm_secs));
+	if (err) {
+		copy.bitmap = NULL;
+		err = -err;
+		goto out;
+	}
+	memset(copy.bitmap, 0xff, vhd_sectors_to_bytes(target->bm_secs));
+
+	/* plain descriptors, so that the kernel may share extents */
+	copy.src_fd = open(source->file, O_RDONLY | O_LARGEFILE);
+	copy.dst_fd = open(new_name, O_WRONLY | O_LARGEFILE);
+	if (copy.src_fd == -1 || copy.dst_fd == -1) {
+		err = -errno;
+		goto out;
+	}
+
+	for (i = 0; i < threads; i++) {
+		err = vhd_copy_worker_init(&workers[i], &copy);
+		if (err)
+			goto out;
+	}
+
+	for (i = 0; i < threads; i++) {
+		err = pthread_create(&workers[i].thread, NULL,
+				     vhd_copy_worker_run, &workers[i]);
+		if (err) {
+			pthread_mutex_lock(&copy.lock);
+			copy.err = -err;
+			pthread_mutex_unlock(&copy.lock);
+			break;
+		}
+		workers[i].started = 1;
+	}
+
+	for (i = 0; i < threads; i++)
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+
+	err = copy.err;
+	if (err)
+		goto out;
+
+	if (fsync(copy.dst_fd)) {
+		err = -errno;
+		goto out;
+	}
+
+	err = vhd_write_bat(target, &target->bat);
+	if (err)
+		goto out;
+
+	if (vhd_has_batmap(target)) {
+		err = vhd_get_batmap(target);
+		if (err)
+			goto out;
+
+		for (i = 0; i < target->bat.entries; i++)
+			if (target->bat.bat[i] != DD_BLK_UNUSED)
+				vhd_batmap_set(target, &target->batmap, i);
+
+		err = vhd_write_batmap(target, &target->batmap);
+		if (err)
+			goto out;
+	}
+
+	err = vhd_write_footer(target, &target->footer);
+
+out:
+	for (i = 0; i < threads; i++)
+		vhd_copy_worker_free(&workers[i]);
+	if (copy.src_fd != -1)
+		close(copy.src_fd);
+	if (copy.dst_fd != -1)
+		close(copy.dst_fd);
+	free(copy.bitmap);
+	free(workers);
+	pthread_mutex_destroy(&copy.lock);
+	return err;
+}
+
+static int
+copy_vhd(const char *name, const char *new_name, int key_size,
+	 const uint8_t *encryption_key, int threads)
 {
 	int err = 0;
 	int i;
@@ -220,6 +736,18 @@ copy_vhd(const char *name, const char *new_name, int key_size, const uint8_t *en
 			goto out;
 	}
 
+	/*
+	 * Blocks map one to one unless the block sizes differ, in which
+	 * case go through libvhd a block at a time.
+	 */
+	if (source_vhd.spb == target_vhd.spb &&
+	    source_vhd.header.max_bat_size ==
+	    target_vhd.header.max_bat_size) {
+		err = vhd_copy_blocks(&source_vhd, &target_vhd, new_name,
+				      key_size, encryption_key, threads);
+		goto out;
+	}
+
 	for (i = 0; i < source_vhd.bat.entries; i++) {
 		err = vhd_encrypt_copy_block(&source_vhd, &target_vhd, i);
 		if (err) {
@@ -266,12 +794,14 @@ vhd_util_copy(int argc, char **argv)
 	int c;
 	int key_fd;
 	int key_size;
+	int threads;
 	int err;
 
 	name = NULL;
 	new_name = NULL;
 	encryption_key = NULL;
 	key_size = 0;
+	threads = VHD_COPY_THREADS;
 
 
 	if (!argc || !argv)
@@ -279,7 +809,7 @@ vhd_util_copy(int argc, char **argv)
 
 	optind = 0;
 
-	while ((c = getopt(argc, argv, "n:N:k:Eh")) != -1) {
+	while ((c = getopt(argc, argv, "n:N:k:Ej:h")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -314,6 +844,14 @@ vhd_util_copy(int argc, char **argv)
 				return -err;
 			}
 			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > VHD_COPY_MAX_THREADS) {
+				fprintf(stderr, "Thread count must be 1 to %d\n",
+					VHD_COPY_MAX_THREADS);
+				goto usage;
+			}
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -325,13 +863,13 @@ vhd_util_copy(int argc, char **argv)
 		goto usage;
 	}
 
-	err =  copy_vhd(name, new_name, key_size, encryption_key);
+	err =  copy_vhd(name, new_name, key_size, encryption_key, threads);
 	free(encryption_key);
 	return err;
 usage:
 	printf("options: -n <name> -N <new VHD name> "
 	       "[-k <keyfile> | -E (pass encryption key on stdin)] "
-	       "[-h help] \n");
+	       "[-j <threads>] [-h help] \n");
 	if (encryption_key) {
 		free(encryption_key);
 	}
@@ -35,7 +35,9 @@
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <endian.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
 
@@ -755,12 +757,330 @@ vhd_read_bytes(vhd_context_t *vhd, uint64_t byte, int count, int hex)
 	return err;
 }
 
+/*
+ * Allocated extent map of an image, optionally merged with those of its
+ * ancestors, in one pass over each BAT and the bitmaps of the blocks
+ * that need them. Blocks the batmap marks full are taken as they are,
+ * and the remaining bitmaps are read in physical order.
+ *
+ * Each logical block is unallocated (NULL), fully allocated
+ * (VHD_EXTMAP_FULL), or has the union of the bitmaps seen so far.
+ */
+#define VHD_EXTMAP_JSON     1
+#define VHD_EXTMAP_BIN      2
+#define VHD_EXTMAP_MAGIC    "vhdextm1"
+#define VHD_EXTMAP_FULL     ((char *)-1)
+
+struct vhd_extmap {
+	uint64_t                  blocks;
+	uint32_t                  spb;
+	size_t                    bm_size;
+	char                    **map;
+};
+
+struct vhd_extmap_blk {
+	uint32_t                  blk;
+	uint32_t                  off;
+};
+
+static int
+vhd_extmap_blk_cmp(const void *a, const void *b)
+{
+	const struct vhd_extmap_blk *x = a, *y = b;
+
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+static void
+vhd_extmap_free(struct vhd_extmap *m)
+{
+	uint64_t i;
+
+	for (i = 0; m->map && i < m->blocks; i++)
+		if (m->map[i] != VHD_EXTMAP_FULL)
+			free(m->map[i]);
+	free(m->map);
+	m->map = NULL;
+}
+
+static void
+vhd_extmap_fill(struct vhd_extmap *m)
+{
+	uint64_t i;
+
+	for (i = 0; i < m->blocks; i++) {
+		if (m->map[i] != VHD_EXTMAP_FULL)
+			free(m->map[i]);
+		m->map[i] = VHD_EXTMAP_FULL;
+	}
+}
+
+static int
+vhd_extmap_add(struct vhd_extmap *m, vhd_context_t *vhd)
+{
+	struct vhd_extmap_blk *blks;
+	uint32_t i, j, n, entries;
+	int err, batmap, full;
+	char *buf;
+
+	if (!vhd_type_dynamic(vhd)) {
+		vhd_extmap_fill(m);
+		return 0;
+	}
+
+	if (vhd->spb != m->spb) {
+		fprintf(stderr, "%s: block size differs within the chain\n",
+			vhd->file);
+		return -EINVAL;
+	}
+
+	err = vhd_get_bat(vhd);
+	if (err)
+		return err;
+
+	batmap = 0;
+	if (vhd_has_batmap(vhd)) {
+		err = vhd_get_batmap(vhd);
+		if (err)
+			return err;
+		batmap = 1;
+	}
+
+	entries = MIN(vhd->bat.entries, m->blocks);
+
+	blks = malloc(sizeof(*blks) * (entries ? : 1));
+	if (!blks)
+		return -ENOMEM;
+
+	for (n = 0, i = 0; i < entries; i++) {
+		if (vhd->bat.bat[i] == DD_BLK_UNUSED ||
+		    m->map[i] == VHD_EXTMAP_FULL)
+			continue;
+
+		if (batmap && vhd_batmap_test(vhd, &vhd->batmap, i)) {
+			free(m->map[i]);
+			m->map[i] = VHD_EXTMAP_FULL;
+			continue;
+		}
+
+		blks[n].blk = i;
+		blks[n].off = vhd->bat.bat[i];
+		n++;
+	}
+
+	qsort(blks, n, sizeof(*blks), vhd_extmap_blk_cmp);
+
+	err = posix_memalign((void **)&buf, VHD_SECTOR_SIZE,
+			     vhd_sectors_to_bytes(vhd->bm_secs));
+	if (err) {
+		free(blks);
+		return -err;
+	}
+
+	for (i = 0; i < n; i++) {
+		uint32_t blk = blks[i].blk;
+		char *map;
+
+		err = vhd_seek(vhd, vhd_sectors_to_bytes(blks[i].off),
+			       SEEK_SET);
+		if (!err)
+			err = vhd_read(vhd, buf,
+				       vhd_sectors_to_bytes(vhd->bm_secs));
+		if (err)
+			goto out;
+
+		for (full = 1, j = 0; j < m->spb; j++)
+			if (!vhd_bitmap_test(vhd, buf, j)) {
+				full = 0;
+				break;
+			}
+
+		if (full) {
+			free(m->map[blk]);
+			m->map[blk] = VHD_EXTMAP_FULL;
+			continue;
+		}
+
+		map = m->map[blk];
+		if (!map) {
+			map = calloc(1, m->bm_size);
+			if (!map) {
+				err = -ENOMEM;
+				goto out;
+			}
+			m->map[blk] = map;
+		}
+
+		for (j = 0; j < m->bm_size; j++)
+			map[j] |= buf[j];
+	}
+
+	err = 0;
+
+out:
+	free(buf);
+	free(blks);
+	return err;
+}
+
+static int
+vhd_extmap_emit_one(uint64_t off, uint64_t len, int fmt, int *first)
+{
+	uint64_t rec[2];
+
+	if (fmt == VHD_EXTMAP_BIN) {
+		rec[0] = htole64(off);
+		rec[1] = htole64(len);
+		return fwrite(rec, sizeof(rec), 1, stdout) == 1 ? 0 : -EIO;
+	}
+
+	printf("%s\n{\"offset\": %"PRIu64", \"length\": %"PRIu64"}",
+	       *first ? "" : ",", off, len);
+	*first = 0;
+	return 0;
+}
+
+static int
+vhd_extmap_emit(struct vhd_extmap *m, uint64_t size, int fmt)
+{
+	uint64_t blk, sec, end, start, len, hdr[2];
+	int err, first, bit;
+	char *map;
+
+	if (fmt == VHD_EXTMAP_BIN) {
+		memcpy(&hdr[0], VHD_EXTMAP_MAGIC, sizeof(hdr[0]));
+		hdr[1] = htole64(size);
+		if (fwrite(hdr, sizeof(hdr), 1, stdout) != 1)
+			return -EIO;
+	} else
+		printf("{\"size\": %"PRIu64", \"extents\": [", size);
+
+	end   = size >> VHD_SECTOR_SHIFT;
+	first = 1;
+	start = 0;
+	len   = 0;
+
+	for (blk = 0; blk < m->blocks; blk++) {
+		map = m->map[blk];
+
+		for (sec = 0; sec < m->spb; sec++) {
+			uint64_t cur = blk * m->spb + sec;
+
+			if (cur >= end)
+				break;
+
+			if (!map)
+				bit = 0;
+			else if (map == VHD_EXTMAP_FULL)
+				bit = 1;
+			else
+				bit = test_bit(map, sec);
+
+			if (bit) {
+				if (!len)
+					start = cur;
+				len++;
+				continue;
+			}
+
+			if (len) {
+				err = vhd_extmap_emit_one(
+					vhd_sectors_to_bytes(start),
+					vhd_sectors_to_bytes(len), fmt, &first);
+				if (err)
+					return err;
+			}
+			len = 0;
+		}
+	}
+
+	if (len) {
+		err = vhd_extmap_emit_one(vhd_sectors_to_bytes(start),
+					  vhd_sectors_to_bytes(len),
+					  fmt, &first);
+		if (err)
+			return err;
+	}
+
+	if (fmt == VHD_EXTMAP_JSON)
+		printf("\n]}\n");
+
+	return fflush(stdout) ? -errno : 0;
+}
+
+static int
+vhd_print_extent_map(vhd_context_t *vhd, int fmt, int chain)
+{
+	vhd_context_t parent, *cur;
+	struct vhd_extmap m;
+	char *next;
+	int err;
+
+	if (!vhd_type_dynamic(vhd))
+		return -EINVAL;
+
+	memset(&m, 0, sizeof(m));
+	m.spb     = vhd->spb;
+	m.bm_size = vhd->spb >> 3;
+	m.blocks  = (vhd->footer.curr_size + vhd->header.block_size - 1) /
+		vhd->header.block_size;
+
+	m.map = calloc(m.blocks ? : 1, sizeof(*m.map));
+	if (!m.map)
+		return -ENOMEM;
+
+	cur  = vhd;
+	next = NULL;
+
+	for (;;) {
+		err = vhd_extmap_add(&m, cur);
+		if (err)
+			goto out;
+
+		if (!chain || cur->footer.type != HD_TYPE_DIFF)
+			break;
+
+		if (vhd_parent_raw(cur)) {
+			/* a raw parent backs every sector */
+			vhd_extmap_fill(&m);
+			break;
+		}
+
+		err = vhd_parent_locator_get(cur, &next);
+		if (err)
+			goto out;
+
+		if (cur != vhd)
+			vhd_close(cur);
+
+		cur = &parent;
+		err = vhd_open(cur, next, VHD_OPEN_RDONLY);
+		if (err) {
+			printf("Failed to open %s: %d\n", next, err);
+			cur = NULL;
+			goto out;
+		}
+
+		free(next);
+		next = NULL;
+	}
+
+	err = vhd_extmap_emit(&m, vhd->footer.curr_size, fmt);
+
+out:
+	if (cur && cur != vhd)
+		vhd_close(cur);
+	free(next);
+	vhd_extmap_free(&m);
+	return err;
+}
+
 int
 vhd_util_read(int argc, char **argv)
 {
 	char *name;
 	vhd_context_t vhd;
-	int c, err, headers, hex, bat_str, cache, flags;
+	int c, err, headers, hex, bat_str, cache, flags, extmap, chain;
 	uint64_t bat, bitmap, tbitmap, ebitmap, batmap, tbatmap, data, lsec, count, read;
 	uint64_t bread;
 
@@ -769,6 +1089,8 @@ vhd_util_read(int argc, char **argv)
 	cache   = 0;
 	headers = 0;
 	bat_str = 0;
+	extmap  = 0;
+	chain   = 0;
 	count   = 1;
 	bat     = -1;
 	bitmap  = -1;
@@ -786,7 +1108,7 @@ vhd_util_read(int argc, char **argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:pt:b:Bm:i:e:aj:d:c:r:R:xCh")) != -1) {
+	while ((c = getopt(argc, argv, "n:pt:b:Bm:i:e:E:Paj:d:c:r:R:xCh")) != -1) {
 		switch(c) {
 		case 'n':
 			name = optarg;
@@ -815,6 +1137,17 @@ vhd_util_read(int argc, char **argv)
 		case 'e':
 			ebitmap = strtoul(optarg, NULL, 10);
 			break;
+		case 'E':
+			if (!strcmp(optarg, "json"))
+				extmap = VHD_EXTMAP_JSON;
+			else if (!strcmp(optarg, "bin"))
+				extmap = VHD_EXTMAP_BIN;
+			else
+				goto usage;
+			break;
+		case 'P':
+			chain = 1;
+			break;
 		case 'a':
 			batmap = 1;
 			break;
@@ -900,6 +1233,12 @@ vhd_util_read(int argc, char **argv)
 			goto out;
 	}
 
+	if (extmap) {
+		err = vhd_print_extent_map(&vhd, extmap, chain);
+		if (err)
+			goto out;
+	}
+
 	if (batmap != -1) {
 		err = vhd_print_batmap(&vhd);
 		if (err)
@@ -947,12 +1286,16 @@ vhd_util_read(int argc, char **argv)
 	       "-m blk      print bitmap\n"
 	       "-i sec      test bitmap for logical sector\n"
 	       "-e sec      output extent list of allocated logical sectors\n"
+	       "-E fmt      output all allocated extents, in bytes, as json\n"
+	       "            or bin (\"%s\", size, then offset/length pairs,\n"
+	       "            all 64-bit little-endian after the magic)\n"
+	       "-P          with -E, merge the extents of all ancestors\n"
 	       "-a          print batmap\n"
 	       "-j blk      test batmap for block\n"
 	       "-d blk      print data\n"
 	       "-c num      num units\n"
 	       "-r sec      read num sectors at sec\n"
 	       "-R byte     read num bytes at byte\n"
-	       "-x          print in hex\n");
+	       "-x          print in hex\n", VHD_EXTMAP_MAGIC);
 	return EINVAL;
 }
@@ -113,11 +113,92 @@ vhd_util_check_depth(const char *name, int *depth)
 	return err;
 }
 
+/*
+ * Snapshots a parent that is its own snapshot target, opening it only
+ * once and taking the chain depth from its hint. The depth is passed
+ * on to the new child, so that later snapshots of it need no walk
+ * either. Returns 1 if the parent is empty and the full search for a
+ * target is needed.
+ *
+ * Coalescing or reparenting an ancestor leaves the hint stale, so a
+ * depth limit is still checked against the chain itself.
+ */
+static int
+vhd_util_snapshot_fast(const char *name, const char *ppath, uint64_t msize,
+		       int limit, int empty_check)
+{
+	struct vhd_keyhash keyhash;
+	vhd_context_t vhd;
+	int i, err, depth;
+
+	err = vhd_open(&vhd, ppath, VHD_OPEN_RDONLY);
+	if (err)
+		return err;
+
+	if (empty_check && vhd.footer.type == HD_TYPE_DIFF) {
+		err = vhd_get_bat(&vhd);
+		if (err)
+			goto out;
+
+		for (i = 0; i < vhd.bat.entries; i++)
+			if (vhd.bat.bat[i] != DD_BLK_UNUSED)
+				break;
+
+		if (i == vhd.bat.entries) {
+			err = 1;
+			goto out;
+		}
+	}
+
+	if (limit)
+		err = vhd_chain_depth(&vhd, &depth);
+	else
+		err = vhd_chain_depth_fast(&vhd, &depth);
+	if (err) {
+		printf("error checking snapshot depth: %d\n", err);
+		goto out;
+	}
+
+	if (limit && depth + 1 > limit) {
+		err = -ENOSPC;
+		printf("snapshot depth exceeded: "
+		       "current depth: %d, limit: %d\n", depth, limit);
+		goto out;
+	}
+
+	err = vhd_get_keyhash(&vhd, &keyhash);
+	if (err)
+		goto out;
+
+	vhd_close(&vhd);
+
+	err = vhd_snapshot(name, 0, ppath, msize << 20, 0);
+	if (err)
+		return err;
+
+	err = vhd_open(&vhd, name, VHD_OPEN_RDWR);
+	if (err)
+		return err;
+
+	if (keyhash.cookie == 1) {
+		err = vhd_set_keyhash(&vhd, &keyhash);
+		if (err)
+			goto out;
+	}
+
+	/* only a hint: the snapshot stands without it */
+	vhd_set_chain_depth(&vhd, depth + 1);
+
+out:
+	vhd_close(&vhd);
+	return err;
+}
+
 int
 vhd_util_snapshot(int argc, char **argv)
 {
 	vhd_flag_creat_t flags;
-	int c, err, prt_raw, limit, empty_check;
+	int c, err, prt_raw, limit, empty_check, fast;
 	char *name, *pname, *backing;
 	char *ppath, __ppath[PATH_MAX];
 	uint64_t size, msize;
@@ -132,6 +213,7 @@ vhd_util_snapshot(int argc, char **argv)
 	flags       = 0;
 	limit       = 0;
 	empty_check = 1;
+	fast        = 0;
 
 	if (!argc || !argv) {
 		err = -EINVAL;
@@ -139,7 +221,7 @@ vhd_util_snapshot(int argc, char **argv)
 	}
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:p:S:l:meh")) != -1) {
+	while ((c = getopt(argc, argv, "n:p:S:l:mefh")) != -1) {
 
 		switch (c) {
 		case 'n':
@@ -160,6 +242,9 @@ vhd_util_snapshot(int argc, char **argv)
 		case 'e':
 			empty_check = 0;
 			break;
+		case 'f':
+			fast = 1;
+			break;
 		case 'h':
 			err = 0;
 			goto usage;
@@ -178,6 +263,13 @@ vhd_util_snapshot(int argc, char **argv)
 	if (!ppath)
 		return -errno;
 
+	if (fast && !vhd_flag_test(flags, VHD_FLAG_CREAT_PARENT_RAW)) {
+		err = vhd_util_snapshot_fast(name, ppath, msize,
+					     limit, empty_check);
+		if (err <= 0)
+			goto out;
+	}
+
 	if (vhd_flag_test(flags, VHD_FLAG_CREAT_PARENT_RAW) || !empty_check) {
 		backing = strdup(ppath);
 		if (!backing) {
@@ -255,6 +347,6 @@ usage:
 	printf("options: <-n name> <-p parent name> [-l snapshot depth limit]"
 	       " [-m parent_is_raw] [-S size (MB) for metadata preallocation "
 	       "(see vhd-util resize)] [-e link to supplied parent name even "
-	       "if it's empty] [-h help]\n");
+	       "if it's empty] [-f use cached chain depth] [-h help]\n");
 	return err;
 }
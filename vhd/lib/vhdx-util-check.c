@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "libvhdx.h"
+#include "vhd-util.h"
+
+static int
+vhdx_check_headers(const char *name)
+{
+	static const off64_t offs[2] = {
+		VHDX_HEADER1_OFFSET, VHDX_HEADER2_OFFSET
+	};
+	struct vhdx_header *h;
+	int i, fd, bad = 0;
+
+	fd = open(name, O_RDONLY | O_LARGEFILE);
+	if (fd == -1)
+		return -errno;
+
+	if (posix_memalign((void **)&h, VHDX_HEADER_SIZE, VHDX_HEADER_SIZE)) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (pread(fd, h, VHDX_HEADER_SIZE, offs[i]) !=
+		    VHDX_HEADER_SIZE || vhdx_validate_header(h)) {
+			printf("%s: header %d is invalid\n", name, i + 1);
+			bad++;
+		}
+	}
+
+	free(h);
+	close(fd);
+	return bad == 2 ? -EINVAL : 0;
+}
+
+struct vhdx_extent {
+	uint64_t            off;
+	uint64_t            len;
+};
+
+static int
+vhdx_extent_compare(const void *a, const void *b)
+{
+	const struct vhdx_extent *x = a, *y = b;
+
+	if (x->off == y->off)
+		return 0;
+	return x->off < y->off ? -1 : 1;
+}
+
+static int
+vhdx_check_bat(vhdx_context_t *ctx)
+{
+	struct vhdx_extent *exts;
+	uint64_t i, n = 0;
+	struct stat st;
+	int err = 0;
+
+	if (fstat(ctx->fd, &st))
+		return -errno;
+
+	exts = calloc(ctx->bat_entries, sizeof(*exts));
+	if (!exts)
+		return -ENOMEM;
+
+	for (i = 0; i < ctx->bat_entries; i++) {
+		uint64_t entry = ctx->bat[i], off = vhdx_bat_offset(entry);
+		int state = vhdx_bat_state(entry);
+		int bitmap = (i % (ctx->chunk_ratio + 1)) == ctx->chunk_ratio;
+		uint64_t len = bitmap ? VHDX_BITMAP_BLOCK_SIZE :
+			ctx->block_size;
+
+		if (bitmap) {
+			if (state != SB_BLOCK_NOT_PRESENT &&
+			    state != SB_BLOCK_PRESENT) {
+				printf("%s: bad sector bitmap state %d at "
+				       "entry %"PRIu64"\n", ctx->file, state, i);
+				err = -EINVAL;
+				continue;
+			}
+			if (state == SB_BLOCK_NOT_PRESENT)
+				continue;
+		} else {
+			switch (state) {
+			case PAYLOAD_BLOCK_NOT_PRESENT:
+			case PAYLOAD_BLOCK_UNDEFINED:
+			case PAYLOAD_BLOCK_ZERO:
+			case PAYLOAD_BLOCK_UNMAPPED:
+				continue;
+
+			case PAYLOAD_BLOCK_PARTIALLY_PRESENT: {
+				uint64_t b = i - i / (ctx->chunk_ratio + 1);
+				uint64_t s = vhdx_bitmap_index(ctx, b);
+
+				if (!vhdx_has_parent(ctx) ||
+				    s >= ctx->bat_entries ||
+				    vhdx_bat_state(ctx->bat[s]) !=
+				    SB_BLOCK_PRESENT) {
+					printf("%s: partially present block "
+					       "%"PRIu64" has no sector bitmap\n",
+					       ctx->file, b);
+					err = -EINVAL;
+				}
+				break;
+			}
+
+			case PAYLOAD_BLOCK_FULLY_PRESENT:
+				break;
+
+			default:
+				printf("%s: bad payload block state %d at "
+				       "entry %"PRIu64"\n", ctx->file, state, i);
+				err = -EINVAL;
+				continue;
+			}
+		}
+
+		if (off < VHDX_HEADER_SECTION_SIZE ||
+		    off + len > (uint64_t)st.st_size) {
+			printf("%s: entry %"PRIu64" points outside the file "
+			       "(0x%"PRIx64")\n", ctx->file, i, off);
+			err = -EINVAL;
+			continue;
+		}
+
+		exts[n].off   = off;
+		exts[n++].len = len;
+	}
+
+	qsort(exts, n, sizeof(*exts), vhdx_extent_compare);
+	for (i = 1; i < n; i++)
+		if (exts[i - 1].off + exts[i - 1].len > exts[i].off) {
+			printf("%s: blocks overlap at 0x%"PRIx64"\n",
+			       ctx->file, exts[i].off);
+			err = -EINVAL;
+		}
+
+	free(exts);
+	return err;
+}
+
+static int
+vhdx_check_parent(vhdx_context_t *ctx)
+{
+	vhdx_context_t parent;
+	char guid[40];
+	int err;
+
+	err = vhdx_open(&parent, ctx->parent, VHDX_OPEN_RDONLY);
+	if (err) {
+		printf("%s: error opening parent %s: %d\n",
+		       ctx->file, ctx->parent, err);
+		return err;
+	}
+
+	vhdx_guid_to_string(&parent.header.data_write_guid, guid);
+	if (strcasecmp(guid, ctx->parent_linkage)) {
+		printf("%s: parent %s changed (linkage %s, parent %s)\n",
+		       ctx->file, ctx->parent, ctx->parent_linkage, guid);
+		err = -EINVAL;
+	}
+
+	if (parent.size != ctx->size ||
+	    parent.logical_sector_size != ctx->logical_sector_size) {
+		printf("%s: geometry differs from parent %s\n",
+		       ctx->file, ctx->parent);
+		err = -EINVAL;
+	}
+
+	vhdx_close(&parent);
+	return err;
+}
+
+int
+vhdx_util_check(int argc, char **argv)
+{
+	int c, err, ignore_parent = 0;
+	vhdx_context_t ctx;
+	char *name = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:ih")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'i':
+			ignore_parent = 1;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || optind != argc)
+		goto usage;
+
+	err = vhdx_check_headers(name);
+	if (err)
+		goto out;
+
+	err = vhdx_open(&ctx, name, VHDX_OPEN_RDONLY | VHDX_OPEN_NOREPLAY);
+	if (err) {
+		printf("error opening %s: %d\n", name, err);
+		goto out;
+	}
+
+	if (ctx.log_dirty) {
+		printf("%s: log needs replay, BAT not checked\n", name);
+		err = -EINVAL;
+	} else
+		err = vhdx_check_bat(&ctx);
+
+	if (!err && vhdx_has_parent(&ctx) && !ignore_parent)
+		err = vhdx_check_parent(&ctx);
+
+	vhdx_close(&ctx);
+
+out:
+	printf("%s %s\n", name, err ? "is invalid" : "appears valid");
+	return err;
+
+usage:
+	printf("options: -n <name> [-i ignore parent] [-h help]\n");
+	return -EINVAL;
+}
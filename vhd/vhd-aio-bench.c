@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * vhd-aio-bench: queue-depth sweep of the libvhd async API. Reads the
+ * allocated data blocks of an image, sequentially or at random, with a
+ * fixed number of requests in flight, and reports throughput and
+ * latency for each depth. Depth 1 is what the synchronous calls get.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "libvhd.h"
+#include "libvhd-aio.h"
+
+#define LAT_BUCKETS      32      /* log2(usecs) */
+
+struct bench_opts {
+	int                 depth;
+	int                 sweep;
+	uint32_t            bs;          /* bytes */
+	int                 random;
+	int                 runtime;     /* seconds */
+};
+
+struct bench_slot {
+	vhd_aio_request_t   req;
+	char               *buf;
+	struct timespec     start;
+};
+
+static struct bench_opts     opts;
+static vhd_context_t         vhd;
+static vhd_aio_t            *aio;
+static uint32_t             *blocks;     /* allocated, in BAT order */
+static uint32_t              n_blocks;
+static uint32_t              chunks;     /* bs-sized chunks per block */
+
+static unsigned int          seed;
+static uint64_t              cursor;
+static struct timespec       t_end;
+
+static uint64_t              ios;
+static uint64_t              errors;
+static uint64_t              lat_total;  /* usecs */
+static uint64_t              lat_max;
+static uint64_t              lat_hist[LAT_BUCKETS];
+
+static uint64_t
+ts_delta_us(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000ULL +
+		(b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+static int
+ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static uint64_t
+bench_pick_chunk(void)
+{
+	uint64_t total = (uint64_t)n_blocks * chunks, c;
+
+	if (opts.random)
+		return (((uint64_t)rand_r(&seed) << 31) ^ rand_r(&seed)) % total;
+
+	c = cursor;
+	cursor = (cursor + 1) % total;
+	return c;
+}
+
+static void bench_complete(vhd_aio_request_t *, int);
+
+static int
+bench_submit(struct bench_slot *slot)
+{
+	vhd_aio_request_t *req = &slot->req;
+	uint64_t c;
+	int err;
+
+	c   = bench_pick_chunk();
+	err = vhd_aio_prep_block(req, &vhd, VHD_AIO_READ, blocks[c / chunks],
+				 (c % chunks) * (opts.bs >> VHD_SECTOR_SHIFT),
+				 slot->buf, opts.bs);
+	if (err)
+		return err;
+
+	req->cb   = bench_complete;
+	req->data = slot;
+
+	clock_gettime(CLOCK_MONOTONIC, &slot->start);
+
+	return vhd_aio_submit(aio, &req, 1);
+}
+
+static void
+bench_complete(vhd_aio_request_t *req, int err)
+{
+	struct bench_slot *slot = req->data;
+	struct timespec now;
+	uint64_t lat;
+	int b;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	lat = ts_delta_us(&slot->start, &now);
+	lat_total += lat;
+	if (lat > lat_max)
+		lat_max = lat;
+	for (b = 0; b < LAT_BUCKETS - 1 && (2ULL << b) <= lat; b++)
+		;
+	lat_hist[b]++;
+
+	if (err)
+		errors++;
+	else
+		ios++;
+
+	if (ts_before(&now, &t_end) && bench_submit(slot))
+		errors++;
+}
+
+static void
+bench_report(int depth, double elapsed)
+{
+	uint64_t n, acc;
+	int b, p50 = -1, p99 = -1;
+
+	n = ios + errors;
+	for (acc = 0, b = 0; b < LAT_BUCKETS && n; b++) {
+		acc += lat_hist[b];
+		if (p50 < 0 && acc * 100 >= n * 50)
+			p50 = b;
+		if (p99 < 0 && acc * 100 >= n * 99)
+			p99 = b;
+	}
+
+	printf("depth %3d: %"PRIu64" ios, %.0f iops, %.1f MiB/s, "
+	       "errors %"PRIu64, depth, ios, ios / elapsed,
+	       ios * (double)opts.bs / elapsed / (1 << 20), errors);
+	if (n)
+		printf(", lat (usec): avg %"PRIu64", max %"PRIu64
+		       ", p50 < %llu, p99 < %llu", lat_total / n, lat_max,
+		       2ULL << p50, 2ULL << p99);
+	printf("\n");
+}
+
+static int
+bench_run(int depth)
+{
+	struct bench_slot *slots;
+	struct timespec t0, t1;
+	int i, n, err;
+
+	ios = errors = lat_total = lat_max = 0;
+	memset(lat_hist, 0, sizeof(lat_hist));
+	cursor = 0;
+
+	err = vhd_aio_create(&aio, depth);
+	if (err)
+		return err;
+
+	slots = calloc(depth, sizeof(*slots));
+	if (!slots) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < depth; i++) {
+		err = posix_memalign((void **)&slots[i].buf,
+				     VHD_SECTOR_SIZE, opts.bs);
+		if (err) {
+			slots[i].buf = NULL;
+			err = -err;
+			goto out;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	t_end = t0;
+	t_end.tv_sec += opts.runtime;
+
+	for (i = 0; i < depth; i++) {
+		err = bench_submit(&slots[i]);
+		if (err)
+			goto out;
+	}
+
+	while (vhd_aio_pending(aio)) {
+		n = vhd_aio_reap(aio, 1, NULL);
+		if (n < 0) {
+			err = n;
+			goto out;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	bench_report(depth, ts_delta_us(&t0, &t1) / 1000000.0);
+
+out:
+	vhd_aio_drain(aio);
+	vhd_aio_destroy(aio);
+	aio = NULL;
+	if (slots)
+		for (i = 0; i < depth; i++)
+			free(slots[i].buf);
+	free(slots);
+	return err;
+}
+
+static int
+bench_load_blocks(void)
+{
+	uint32_t i;
+	int err;
+
+	err = vhd_get_bat(&vhd);
+	if (err)
+		return err;
+
+	blocks = calloc(vhd.bat.entries, sizeof(uint32_t));
+	if (!blocks)
+		return -ENOMEM;
+
+	for (i = 0; i < vhd.bat.entries; i++)
+		if (vhd.bat.bat[i] != DD_BLK_UNUSED)
+			blocks[n_blocks++] = i;
+
+	return 0;
+}
+
+static uint32_t
+parse_size(const char *s)
+{
+	char *end;
+	unsigned long v;
+
+	v = strtoul(s, &end, 0);
+	switch (*end) {
+	case 'k': case 'K':
+		v <<= 10;
+		break;
+	case 'm': case 'M':
+		v <<= 20;
+		break;
+	}
+
+	return v;
+}
+
+static void
+usage(FILE *stream, const char *prog)
+{
+	fprintf(stream, "usage: %s [-d depth] [-S sweep 1..depth] "
+		"[-b block size] [-r random] [-t runtime seconds] "
+		"<vhd>\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c, depth, err;
+
+	opts.depth   = 32;
+	opts.sweep   = 0;
+	opts.bs      = 65536;
+	opts.random  = 0;
+	opts.runtime = 5;
+
+	while ((c = getopt(argc, argv, "d:Sb:rt:h")) != -1) {
+		switch (c) {
+		case 'd':
+			opts.depth = atoi(optarg);
+			break;
+		case 'S':
+			opts.sweep = 1;
+			break;
+		case 'b':
+			opts.bs = parse_size(optarg);
+			break;
+		case 'r':
+			opts.random = 1;
+			break;
+		case 't':
+			opts.runtime = atoi(optarg);
+			break;
+		case 'h':
+			usage(stdout, argv[0]);
+			return 0;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind != argc - 1 || opts.depth < 1 || !opts.bs ||
+	    opts.bs & (VHD_SECTOR_SIZE - 1) || opts.runtime < 1)
+		goto usage;
+
+	err = vhd_open(&vhd, argv[optind], VHD_OPEN_RDONLY);
+	if (err) {
+		fprintf(stderr, "failed to open %s: %s\n",
+			argv[optind], strerror(-err));
+		return -err;
+	}
+
+	if (!vhd_type_dynamic(&vhd) || vhd.header.block_size % opts.bs) {
+		fprintf(stderr, "%s: need a dynamic image with a block size "
+			"that is a multiple of %u\n", argv[optind], opts.bs);
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = bench_load_blocks();
+	if (err)
+		goto out;
+
+	if (!n_blocks) {
+		fprintf(stderr, "%s: no allocated blocks\n", argv[optind]);
+		err = -EINVAL;
+		goto out;
+	}
+
+	chunks = vhd.header.block_size / opts.bs;
+	seed   = time(NULL);
+
+	printf("%s: %u allocated blocks, %s reads of %u bytes, %ds per run\n",
+	       argv[optind], n_blocks, opts.random ? "random" : "sequential",
+	       opts.bs, opts.runtime);
+
+	for (depth = opts.sweep ? 1 : opts.depth; depth <= opts.depth;
+	     depth *= 2) {
+		err = bench_run(depth);
+		if (err) {
+			fprintf(stderr, "depth %d: %s\n", depth,
+				strerror(-err));
+			break;
+		}
+	}
+
+out:
+	free(blocks);
+	vhd_close(&vhd);
+	return -err;
+
+usage:
+	usage(stderr, argv[0]);
+	return EINVAL;
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "libvhd.h"
+#include "libvhdx.h"
+#include "vhd-util.h"
+
+typedef int (*vhdx_util_func_t) (int, char **);
+
+struct command {
+	char               *name;
+	vhdx_util_func_t    func;
+};
+
+static int
+vhdx_util_create(int argc, char **argv)
+{
+	uint32_t block_size = 0, lss = 0;
+	uint64_t size = 0;
+	char *name = NULL;
+	int c, err;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:s:b:l:h")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'l':
+			lss = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || !size || optind != argc)
+		goto usage;
+
+	err = vhdx_create(name, size, block_size, lss, NULL);
+	if (err)
+		fprintf(stderr, "creating %s failed: %d\n", name, err);
+
+	return err;
+
+usage:
+	printf("options: -n <name> -s <size (MB)> [-b <block size (MB)>] "
+	       "[-l <logical sector size (512|4096)>] [-h help]\n");
+	return -EINVAL;
+}
+
+static int
+vhdx_util_snapshot(int argc, char **argv)
+{
+	char *name = NULL, *parent = NULL;
+	uint32_t block_size = 0;
+	int c, err;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:p:b:h")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'p':
+			parent = optarg;
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || !parent || optind != argc)
+		goto usage;
+
+	err = vhdx_snapshot(name, parent, block_size);
+	if (err)
+		fprintf(stderr, "snapshot of %s failed: %d\n", parent, err);
+
+	return err;
+
+usage:
+	printf("options: -n <name> -p <parent> [-b <block size (MB)>] "
+	       "[-h help]\n");
+	return -EINVAL;
+}
+
+static int
+vhdx_util_query(int argc, char **argv)
+{
+	char *name = NULL, guid[40];
+	int c, err, size = 0, parent = 0, geometry = 0, allocated = 0;
+	vhdx_context_t ctx;
+	uint64_t i, n;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:vpgah")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'v':
+			size = 1;
+			break;
+		case 'p':
+			parent = 1;
+			break;
+		case 'g':
+			geometry = 1;
+			break;
+		case 'a':
+			allocated = 1;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || optind != argc || !(size | parent | geometry | allocated))
+		goto usage;
+
+	err = vhdx_open(&ctx, name, VHDX_OPEN_RDONLY);
+	if (err) {
+		printf("error opening %s: %d\n", name, err);
+		return err;
+	}
+
+	if (size)
+		printf("%"PRIu64"\n", ctx.size >> 20);
+
+	if (parent) {
+		if (vhdx_has_parent(&ctx))
+			printf("%s\n", ctx.parent);
+		else
+			printf("%s has no parent\n", name);
+	}
+
+	if (geometry) {
+		vhdx_guid_to_string(&ctx.disk_id, guid);
+		printf("block size: %u\n", ctx.block_size);
+		printf("logical sector size: %u\n", ctx.logical_sector_size);
+		printf("physical sector size: %u\n", ctx.physical_sector_size);
+		printf("disk id: %s\n", guid);
+	}
+
+	if (allocated) {
+		for (i = n = 0; i < ctx.data_blocks; i++) {
+			int state;
+
+			state = vhdx_bat_state(ctx.bat[vhdx_bat_index(&ctx, i)]);
+			if (state == PAYLOAD_BLOCK_FULLY_PRESENT ||
+			    state == PAYLOAD_BLOCK_PARTIALLY_PRESENT)
+				n++;
+		}
+		printf("%"PRIu64"\n", n);
+	}
+
+	vhdx_close(&ctx);
+	return 0;
+
+usage:
+	printf("options: -n <name> [-v print virtual size (MB)] "
+	       "[-p print parent] [-g print geometry] "
+	       "[-a print allocated block count] [-h help]\n");
+	return -EINVAL;
+}
+
+static struct command commands[] = {
+	{ .name = "create",      .func = vhdx_util_create       },
+	{ .name = "snapshot",    .func = vhdx_util_snapshot     },
+	{ .name = "query",       .func = vhdx_util_query        },
+	{ .name = "check",       .func = vhdx_util_check        },
+};
+
+static void
+help(void)
+{
+	int i, n;
+
+	n = sizeof(commands) / sizeof(struct command);
+
+	printf("usage: vhdx-util COMMAND [OPTIONS]\n");
+	printf("COMMAND := { %s", commands[0].name);
+	for (i = 1; i < n; i++)
+		printf(" | %s", commands[i].name);
+	printf(" }\n");
+	exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i, n;
+
+	if (argc < 2)
+		help();
+
+	n = sizeof(commands) / sizeof(struct command);
+	for (i = 0; i < n; i++)
+		if (!strcmp(argv[1], commands[i].name)) {
+			int ret = commands[i].func(argc - 1, argv + 1);
+			return ret >= 0 ? ret : -ret;
+		}
+
+	fprintf(stderr, "invalid COMMAND %s\n", argv[1]);
+	help();
+	return 0;
+}